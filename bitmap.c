@@ -54,6 +54,36 @@ bool bitmap_isset(const uint8_t *map, unsigned bit)
 	return !!(*word & BITMAP_BIT(bit));
 }
 
+/**
+ * bitmap_next() - Find next set bit in bitmap
+ * @map:	Pointer to bitmap, size rounded up to a multiple of longs
+ * @nbits:	Number of valid bits in bitmap
+ * @bit:	Bit number to start from
+ *
+ * Return: number of first set bit from @bit included, @nbits if none
+ */
+unsigned bitmap_next(const uint8_t *map, unsigned nbits, unsigned bit)
+{
+	const unsigned long *words = (const unsigned long *)map;
+	unsigned long w;
+	unsigned i;
+
+	if (bit >= nbits)
+		return nbits;
+
+	i = BITMAP_WORD(bit);
+	w = words[i] & (~0UL << (bit % (sizeof(long) * 8)));
+
+	while (!w) {
+		if (++i >= BITMAP_WORD(nbits - 1) + 1)
+			return nbits;
+		w = words[i];
+	}
+
+	bit = i * sizeof(long) * 8 + __builtin_ctzl(w);
+	return bit < nbits ? bit : nbits;
+}
+
 /**
  * bitmap_or() - Logical disjunction (OR) of two bitmaps
  * @dst:	Pointer to result bitmap
@@ -76,6 +106,27 @@ void bitmap_or(uint8_t *dst, size_t size, const uint8_t *a, const uint8_t *b)
 		dst[i] = a[i] | b[i];
 }
 
+/**
+ * bitmap_xor() - Exclusive disjunction (XOR) of two bitmaps
+ * @dst:	Pointer to result bitmap
+ * @size:	Size of bitmaps, in bytes
+ * @a:		First operand
+ * @b:		Second operand
+ */
+void bitmap_xor(uint8_t *dst, size_t size, const uint8_t *a, const uint8_t *b)
+{
+	unsigned long *dw = (unsigned long *)dst;
+	unsigned long *aw = (unsigned long *)a;
+	unsigned long *bw = (unsigned long *)b;
+	size_t i;
+
+	for (i = 0; i < size / sizeof(long); i++, dw++, aw++, bw++)
+		*dw = *aw ^ *bw;
+
+	for (i = size / sizeof(long) * sizeof(long); i < size; i++)
+		dst[i] = a[i] ^ b[i];
+}
+
 /**
  * bitmap_and_not() - Logical conjunction with complement (AND NOT) of bitmap
  * @dst:	Pointer to result bitmap
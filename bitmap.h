@@ -17,7 +17,9 @@
 void bitmap_set(uint8_t *map, unsigned bit);
 void bitmap_clear(uint8_t *map, unsigned bit);
 bool bitmap_isset(const uint8_t *map, unsigned bit);
+unsigned bitmap_next(const uint8_t *map, unsigned nbits, unsigned bit);
 void bitmap_or(uint8_t *dst, size_t size, const uint8_t *a, const uint8_t *b);
+void bitmap_xor(uint8_t *dst, size_t size, const uint8_t *a, const uint8_t *b);
 void bitmap_and_not(uint8_t *dst, size_t size,
 		    const uint8_t *a, const uint8_t *b);
 
@@ -107,7 +107,7 @@ static uint32_t sum_16b(const void *buf, size_t len)
  *
  * Return: 16-bit folded sum
  */
-static uint16_t csum_fold(uint32_t sum)
+uint16_t csum_fold(uint32_t sum)
 {
 	while (sum >> 16)
 		sum = (sum & 0xffff) + (sum >> 16);
@@ -584,7 +584,82 @@ uint32_t csum_unfolded(const void *buf, size_t len, uint32_t init)
 {
 	return csum_vsx(buf, len, init);
 }
-#else /* !__AVX2__ && !__POWER9_VECTOR__ && !__POWER8_VECTOR__ */
+#elif defined(__aarch64__) && defined(__ARM_NEON)
+#include <arm_neon.h>
+
+/**
+ * csum_neon() - Compute 32-bit checksum using NEON (AdvSIMD) instructions
+ * @buf:	Input buffer
+ * @len:	Input length
+ * @init:	Initial 32-bit checksum, 0 for no pre-computed checksum
+ *
+ * Return: 32-bit checksum, not complemented, not folded
+ *
+ * Pairwise add-and-accumulate (UADALP) sums 16-bit words into 32-bit lanes, so
+ * that each lane grows by at most 0x1fffe per 16-byte load. Lanes of the two
+ * accumulators are added into the 64-bit sum every 64 KiB, well before they
+ * could wrap around.
+ */
+/* NOLINTNEXTLINE(clang-diagnostic-unknown-attributes) */
+__attribute__((optimize("-fno-strict-aliasing")))	/* See csum_16b() */
+static uint32_t csum_neon(const void *buf, size_t len, uint32_t init)
+{
+	const uint8_t *p = buf;
+	uint64_t sum64 = init;
+
+	while (len >= 64) {
+		size_t block = MIN(len, (size_t)65536) / 64 * 64;
+		uint32x4_t sum_a = vdupq_n_u32(0);
+		uint32x4_t sum_b = vdupq_n_u32(0);
+
+		for (len -= block; block; block -= 64, p += 64) {
+			uint16x8_t v0 = vreinterpretq_u16_u8(vld1q_u8(p));
+			uint16x8_t v1 = vreinterpretq_u16_u8(vld1q_u8(p + 16));
+			uint16x8_t v2 = vreinterpretq_u16_u8(vld1q_u8(p + 32));
+			uint16x8_t v3 = vreinterpretq_u16_u8(vld1q_u8(p + 48));
+
+			sum_a = vpadalq_u16(sum_a, v0);
+			sum_b = vpadalq_u16(sum_b, v1);
+			sum_a = vpadalq_u16(sum_a, v2);
+			sum_b = vpadalq_u16(sum_b, v3);
+		}
+
+		sum64 += vaddlvq_u32(sum_a) + vaddlvq_u32(sum_b);
+	}
+
+	while (len >= 16) {
+		uint16x8_t v0 = vreinterpretq_u16_u8(vld1q_u8(p));
+
+		sum64 += vaddlvq_u32(vpaddlq_u16(v0));
+
+		p += 16;
+		len -= 16;
+	}
+
+	sum64 += sum_16b(p, len);
+
+	sum64 = (sum64 >> 32) + (sum64 & 0xffffffff);
+	sum64 += sum64 >> 32;
+
+	return (uint32_t)sum64;
+}
+
+/**
+ * csum_unfolded() - Calculate the unfolded checksum of a data buffer.
+ *
+ * @buf:   Input buffer
+ * @len:   Input length
+ * @init:  Initial 32-bit checksum, 0 for no pre-computed checksum
+ *
+ * Return: 32-bit unfolded checksum
+ */
+/* NOLINTNEXTLINE(clang-diagnostic-unknown-attributes) */
+__attribute__((optimize("-fno-strict-aliasing")))	/* See csum_16b() */
+uint32_t csum_unfolded(const void *buf, size_t len, uint32_t init)
+{
+	return csum_neon(buf, len, init);
+}
+#else /* !__AVX2__ && !__POWER9_VECTOR__ && !__POWER8_VECTOR__ && !NEON */
 /**
  * csum_unfolded() - Calculate the unfolded checksum of a data buffer.
  *
@@ -600,7 +675,7 @@ uint32_t csum_unfolded(const void *buf, size_t len, uint32_t init)
 {
 	return sum_16b(buf, len) + init;
 }
-#endif /* !__AVX2__ && !__POWER9_VECTOR__ && !__POWER8_VECTOR__ */
+#endif /* !__AVX2__ && !__POWER9_VECTOR__ && !__POWER8_VECTOR__ && !NEON */
 
 /**
  * csum_iov_tail() - Calculate unfolded checksum for the tail of an IO vector
@@ -14,6 +14,7 @@ struct icmphdr;
 struct icmp6hdr;
 struct iov_tail;
 
+uint16_t csum_fold(uint32_t sum);
 uint16_t csum_unaligned(const void *buf, size_t len, uint32_t init);
 uint16_t csum_ip4_header(uint16_t l3len, uint8_t protocol,
 			 struct in_addr saddr, struct in_addr daddr);
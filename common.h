@@ -38,6 +38,7 @@
 #define ROUND_UP(x, y)		(((x) + (y) - 1) & ~((y) - 1))
 
 #define UINT16_STRLEN		(sizeof("65535"))
+#define UINT32_STRLEN		(sizeof("4294967295"))
 
 /*
  * Starting from glibc 2.40.9000 and commit 25a5eb4010df ("string: strerror,
@@ -19,6 +19,7 @@
 #include <libgen.h>
 #include <string.h>
 #include <sched.h>
+#include <sys/mman.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <limits.h>
@@ -53,6 +54,8 @@
 #include "pesto.h"
 #include "serialise.h"
 #include "parse.h"
+#include "flow_table.h"
+#include "stats.h"
 
 #define NETNS_RUN_DIR	"/run/netns"
 
@@ -68,8 +71,14 @@
 				{{{ 0xfe, 0x80, 0, 0, 0, 0, 0, 0,	\
 				       0, 0, 0, 0, 0, 0, 0, 0x01 }}}
 
+/* Maximum busy-polling budget, microseconds, to keep CPU time bounded */
+#define BUSY_POLL_MAX		100000
+
 static const char *pasta_default_ifn = "tap0";
 
+/* Smallest snapshot length we accept: Ethernet, IPv6, and TCP headers */
+#define PCAP_SNAPLEN_MIN	(ETH_HLEN + 40 + 20)
+
 /**
  * add_dns4() - Possibly add the IPv4 address of a DNS resolver to configuration
  * @c:		Execution context
@@ -537,6 +546,9 @@ static void usage(const char *name, FILE *f, int status)
 		"      --trace		Be extra verbose, implies --debug\n"
 		"  --stats DELAY  	Display events statistics\n"
 		"    minimum DELAY seconds between updates\n"
+		"  --startup-trace	Report time taken by startup stages\n"
+		"  --profile		Account time spent in each handler\n"
+		"  --low-mem		Small buffers, release idle memory\n"
 		"  -q, --quiet		Don't print informational messages\n"
 		"  -f, --foreground	Don't run in background\n"
 		"    default: run in background\n"
@@ -547,6 +559,20 @@ static void usage(const char *name, FILE *f, int status)
 		"    numeric, or login and group names\n"
 		"    default: drop to user \"nobody\"\n"
 		"  -c, --conf-path PATH	Configuration socket path\n"
+		"  --max-flows COUNT	Maximum number of flows (flow table size)\n"
+		"    default: 131071\n"
+		"  --flow-rate RATE[:BURST]	Accept up to RATE new flows\n"
+		"    per second from each guest address, bursts of BURST\n"
+		"    default: no limit, BURST defaults to RATE\n"
+		"  --tap-rate RATE[:BURST]	Limit traffic via tap to RATE\n"
+		"    bytes per second each way, bursts of BURST bytes\n"
+		"    default: no limit, BURST defaults to RATE / 10\n"
+		"  --prio-ports PORTS	Handle events for flows with these\n"
+		"    destination ports first, PORTS as a comma-separated list\n"
+		"    default: no priority\n"
+		"  --cpus LIST	Run on these CPUs only, LIST as comma-separated\n"
+		"    CPU numbers or ranges, e.g. 0-3,8\n"
+		"    default: inherit CPU affinity\n"
 		"  -h, --help		Display this help message and exit\n"
 		"  --version		Show version and exit\n");
 
@@ -563,7 +589,10 @@ static void usage(const char *name, FILE *f, int status)
 			"  --vhost-user		Enable vhost-user mode\n"
 			"    UNIX domain socket is provided by -s option\n"
 			"  --print-capabilities	print back-end capabilities in JSON format,\n"
-			"    only meaningful for vhost-user mode\n");
+			"    only meaningful for vhost-user mode\n"
+			"  --busy-poll USEC	Poll guest and sockets for up to USEC\n"
+			"    microseconds before sleeping, vhost-user mode only\n"
+			"    default: don't poll\n");
 		FPRINTF(f,
 			"  --repair-path PATH	path for passt-repair(1)\n"
 			"    default: append '.repair' to UNIX domain path\n");
@@ -580,7 +609,16 @@ static void usage(const char *name, FILE *f, int status)
 	FPRINTF(f,
 		"  -F, --fd FD		Use FD as pre-opened connected socket\n"
 		"  -p, --pcap FILE	Log tap-facing traffic to pcap file\n"
+		"  --pcap-snaplen BYTES	Capture at most BYTES of each frame\n"
+		"    default: capture whole frames\n"
+		"  --pcap-filter PROTO[:PORT]	Capture only tcp, udp, or icmp\n"
+		"    frames, optionally with given source or destination port\n"
+		"    default: capture all frames\n"
+		"  --pcap-sample N	Capture one out of N frames\n"
+		"    default: capture all frames\n"
 		"  -P, --pid FILE	Write own PID to the given file\n"
+		"  --probe-cache FILE	Cache kernel feature probes in FILE\n"
+		"  --stats-file FILE	Keep statistics in shared FILE\n"
 		"  -m, --mtu MTU	Assign MTU via DHCP/NDP\n"
 		"    a zero value disables assignment\n"
 		"    default: 65520: maximum 802.3 MTU minus 802.3 header\n"
@@ -644,8 +682,19 @@ static void usage(const char *name, FILE *f, int status)
 		"  --dns-host ADDR	Host nameserver to direct queries to\n"
 		"    can be specified zero to two times (for IPv4 and IPv6)\n"
 		"    default: first nameserver from host's /etc/resolv.conf\n"
+		"  --dns-cache		Cache DNS replies for the guest\n"
 		"  --no-tcp		Disable TCP protocol handler\n"
+		"  --tcp-window-bdp MAX	Size TCP window to guest from host\n"
+		"    bandwidth-delay product, up to MAX bytes per connection\n"
+		"    default: from sending buffer size only\n"
+		"  --tcp-mem-budget BYTES	Share sending buffers of\n"
+		"    BYTES among TCP connections, shrinking windows\n"
+		"    default: no budget\n"
+		"  --tcp-mptcp		Use Multipath TCP for connections\n"
+		"    to host\n"
 		"  --no-udp		Disable UDP protocol handler\n"
+		"  --udp-shared		Share sockets among UDP flows to host\n"
+		"  --udp-ecn		Propagate ECN marks for UDP\n"
 		"  --no-icmp		Disable ICMP/ICMPv6 protocol handler\n"
 		"  --no-dhcp		Disable DHCP server\n"
 		"  --no-ndp		Disable NDP responses\n"
@@ -664,7 +713,8 @@ static void usage(const char *name, FILE *f, int status)
 		"        PORTS is a comma-separated list of ports or port\n"
 		"         ranges.  'all' indicates all unbound non-ephemeral\n"
 		"         ports.  Ranges can be reduced by excluding ports or\n"
-		"         ranges prefixed by '~'.\n"
+		"         ranges prefixed by '~'.  'tproxy' uses a single\n"
+		"         transparent socket per range, see man page.\n"
 		"%s"
 		"        Examples:\n"
 		"        -t all		Forward all ports\n"
@@ -682,7 +732,13 @@ static void usage(const char *name, FILE *f, int status)
 		"    default: %s\n"
 		"  -u, --udp-ports SPEC	UDP port forwarding to %s\n"
 		"    SPEC is as described for TCP above\n"
-		"    default: %s\n",
+		"    default: %s\n"
+		"  --fwd-tune OPTS	Socket options for following forwards\n"
+		"    OPTS is 'none' or a comma-separated list of:\n"
+		"      cc=NAME, notsent-lowat=BYTES, rcvbuf=BYTES,\n"
+		"      sndbuf=BYTES, busy-poll=USECS, max-rate=BYTES,\n"
+		"      priority=N, delay\n"
+		"    default: none\n",
 		guest,
 		strstr(name, "pasta") ?
 		"        The 'auto' keyword may be given to only forward\n"
@@ -732,7 +788,8 @@ pasta_opts:
 		"			Don't copy all addresses to namespace\n"
 		"  --ns-mac-addr ADDR	Set MAC address on tap interface\n"
 		"  --no-splice		Disable inbound socket splicing\n"
-		"  --splice-only	Only enable loopback forwarding\n");
+		"  --splice-only	Only enable loopback forwarding\n"
+		"  --io-uring		Read from tap device with batched io_uring\n");
 
 	passt_exit(status);
 }
@@ -1017,6 +1074,100 @@ static void conf_ugid(char *runas, uid_t *uid, gid_t *gid)
 	}
 }
 
+/**
+ * conf_prio_ports() - Parse --prio-ports option
+ * @c:		Execution context
+ * @arg:	Comma-separated list of ports or port ranges
+ */
+static void conf_prio_ports(struct ctx *c, const char *arg)
+{
+	const char *p = arg;
+
+	do {
+		struct port_range r;
+		unsigned port;
+
+		if (!parse_port_range(&p, &r))
+			die("Invalid port list for --prio-ports: %s", arg);
+
+		for (port = r.first; port <= r.last; port++)
+			bitmap_set(c->prio_ports, port);
+	} while (parse_literal(&p, ","));
+
+	if (!parse_eoi(p))
+		die("Invalid port list for --prio-ports: %s", arg);
+
+	c->prio = true;
+}
+
+/**
+ * conf_cpus() - Parse --cpus option
+ * @c:		Execution context
+ * @arg:	Comma-separated list of CPU numbers or ranges
+ */
+static void conf_cpus(struct ctx *c, const char *arg)
+{
+	const char *p = arg;
+
+	CPU_ZERO(&c->cpus);
+
+	do {
+		unsigned long first, last, cpu;
+
+		if (!parse_unsigned(&p, 10, &first))
+			goto bad;
+
+		last = first;
+		if (parse_literal(&p, "-") && !parse_unsigned(&p, 10, &last))
+			goto bad;
+
+		if (last < first || last >= CPU_SETSIZE)
+			goto bad;
+
+		for (cpu = first; cpu <= last; cpu++)
+			CPU_SET(cpu, &c->cpus);
+	} while (parse_literal(&p, ","));
+
+	if (parse_eoi(p))
+		return;
+bad:
+	die("Invalid CPU list: %s (CPUs 0-%u)", arg, CPU_SETSIZE - 1);
+}
+
+/**
+ * conf_pcap_filter() - Parse --pcap-filter option
+ * @c:		Execution context
+ * @arg:	Filter, as PROTO[:PORT], PROTO being "tcp", "udp", or "icmp"
+ */
+static void conf_pcap_filter(struct ctx *c, const char *arg)
+{
+	const char *p = arg;
+	unsigned long port;
+
+	if (parse_literal(&p, "tcp"))
+		c->pcap_proto = IPPROTO_TCP;
+	else if (parse_literal(&p, "udp"))
+		c->pcap_proto = IPPROTO_UDP;
+	else if (parse_literal(&p, "icmp"))
+		c->pcap_proto = IPPROTO_ICMP;	/* ICMPv6 too */
+	else
+		goto bad;
+
+	if (parse_eoi(p))
+		return;
+
+	if (c->pcap_proto == IPPROTO_ICMP || !parse_literal(&p, ":") ||
+	    !parse_unsigned(&p, 10, &port) || !parse_eoi(p) ||
+	    !port || port > USHRT_MAX)
+		goto bad;
+
+	c->pcap_port = port;
+	return;
+
+bad:
+	die("Invalid pcap filter: %s", arg);
+}
+
 /**
  * conf_nat() - Parse --map-host-loopback or --map-guest-addr option
  * @arg:	String argument to option
@@ -1053,6 +1204,34 @@ static void conf_nat(const char *arg, struct in_addr *addr4,
 	die("Invalid address to remap to host: %s", arg);
 }
 
+/**
+ * conf_stats_file() - Map statistics from a file other processes can read
+ * @path:	Path to statistics file, created or truncated
+ *
+ * Nothing is counted before we parse options, so there's nothing to copy.
+ */
+static void conf_stats_file(const char *path)
+{
+	int fd = output_file_open(path, O_RDWR);
+	void *p;
+
+	if (fd < 0)
+		die_perror("Couldn't open statistics file %s", path);
+
+	if (ftruncate(fd, sizeof(passt_stats)))
+		die_perror("Couldn't size statistics file %s", path);
+
+	p = mmap(&passt_stats, sizeof(passt_stats), PROT_READ | PROT_WRITE,
+		 MAP_SHARED | MAP_FIXED, fd, 0);
+	if (p == MAP_FAILED)
+		die_perror("Couldn't map statistics file %s", path);
+
+	close(fd);
+
+	passt_stats.size = sizeof(passt_stats);
+	passt_stats.version = STATS_FILE_VERSION;
+}
+
 /**
  * conf_open_files() - Open files as requested by configuration
  * @c:		Execution context
@@ -1085,6 +1264,9 @@ static void conf_open_files(struct ctx *c)
 			die_perror("Couldn't open PID file %s", c->pidfile);
 	}
 
+	if (*c->stats_file)
+		conf_stats_file(c->stats_file);
+
 	c->fd_control = -1;
 	if (*c->control_path) {
 		c->fd_control_listen = sock_unix(c->control_path);
@@ -1288,6 +1470,14 @@ void conf(struct ctx *c, int argc, char **argv)
 		{"no-splice",	no_argument,		&c->no_splice,	1 },
 		{"splice-only",	no_argument,		&c->splice_only, 1 },
 		{"freebind",	no_argument,		&c->freebind,	1 },
+		{"io-uring",	no_argument,		&c->io_uring,	1 },
+		{"dns-cache",	no_argument,		&c->dns_cache,	1 },
+		{"udp-shared",	no_argument,		&c->udp.shared,	1 },
+		{"udp-ecn",	no_argument,		&c->udp.ecn,	1 },
+		{"startup-trace", no_argument,		&c->startup_trace, 1 },
+		{"profile",	no_argument,		&c->profile,	1 },
+		{"low-mem",	no_argument,		&c->low_mem,	1 },
+		{"tcp-mptcp",	no_argument,		&c->tcp.mptcp,	1 },
 		{"no-map-gw",	no_argument,		&no_map_gw,	1 },
 		{"ipv4-only",	no_argument,		NULL,		'4' },
 		{"ipv6-only",	no_argument,		NULL,		'6' },
@@ -1331,6 +1521,20 @@ void conf(struct ctx *c, int argc, char **argv)
 		{"stats", required_argument,		NULL,		31 },
 		{"conf-path",	required_argument,	NULL,		'c' },
 		{"chroot-fallback", no_argument,	NULL, 		32 },
+		{"max-flows",	required_argument,	NULL,		33 },
+		{"busy-poll",	required_argument,	NULL,		34 },
+		{"pcap-snaplen", required_argument,	NULL,		35 },
+		{"pcap-filter",	required_argument,	NULL,		36 },
+		{"pcap-sample",	required_argument,	NULL,		37 },
+		{"prio-ports",	required_argument,	NULL,		38 },
+		{"cpus",	required_argument,	NULL,		39 },
+		{"probe-cache",	required_argument,	NULL,		40 },
+		{"stats-file",	required_argument,	NULL,		44 },
+		{"flow-rate",	required_argument,	NULL,		45 },
+		{"tap-rate",	required_argument,	NULL,		46 },
+		{"tcp-window-bdp", required_argument,	NULL,		41 },
+		{"tcp-mem-budget", required_argument,	NULL,		43 },
+		{"fwd-tune",	required_argument,	NULL,		42 },
 		{ 0 },
 	};
 	const char *optstring = "+dqfel:hs:c:F:I:p:P:m:a:n:M:g:i:o:D:S:H:461t:u:T:U:";
@@ -1339,6 +1543,7 @@ void conf(struct ctx *c, int argc, char **argv)
 	char userns[PATH_MAX] = { 0 }, netns[PATH_MAX] = { 0 };
 	bool copy_addrs_opt = false, copy_routes_opt = false;
 	bool v4_only = false, v6_only = false;
+	struct fwd_tune tune = { 0 };
 	unsigned dns4_idx = 0, dns6_idx = 0;
 	unsigned long max_mtu = IP_MAX_MTU;
 	struct fqdn *dnss = c->dns_search;
@@ -1361,6 +1566,7 @@ void conf(struct ctx *c, int argc, char **argv)
 	if (tap_l2_max_len(c) - ETH_HLEN < max_mtu)
 		max_mtu = tap_l2_max_len(c) - ETH_HLEN;
 	c->mtu = ROUND_DOWN(max_mtu, sizeof(uint32_t));
+	c->max_flows = FLOW_MAX_DEFAULT;
 	memcpy(c->our_tap_mac, MAC_OUR_LAA, ETH_ALEN);
 
 	optind = 0;
@@ -1572,6 +1778,145 @@ void conf(struct ctx *c, int argc, char **argv)
 		case 32:
 			c->chroot_fallback = true;
 			break;
+		case 33: {
+			unsigned long max;
+
+			p = optarg;
+			if (!parse_unsigned(&p, 0, &max) || !parse_eoi(p) ||
+			    max < 2 || max > FLOW_MAX)
+				die("Invalid maximum number of flows: %s (%u-%u)",
+				    optarg, 2, FLOW_MAX);
+
+			c->max_flows = max;
+			break;
+		}
+		case 45: {
+			unsigned long rate, burst;
+
+			p = optarg;
+			if (!parse_unsigned(&p, 0, &rate) ||
+			    !rate || rate > 1000000)
+				die("Invalid flow rate: %s", optarg);
+
+			burst = rate;
+			if (parse_literal(&p, ":") &&
+			    (!parse_unsigned(&p, 0, &burst) || !burst ||
+			     burst > FLOW_MAX))
+				die("Invalid flow burst: %s", optarg);
+
+			if (!parse_eoi(p))
+				die("Invalid flow rate: %s", optarg);
+
+			c->flow_rate = rate;
+			c->flow_burst = burst;
+			break;
+		}
+		case 46: {
+			unsigned long rate, burst;
+
+			p = optarg;
+			if (!parse_unsigned(&p, 0, &rate) ||
+			    rate < TAP_RATE_MIN || rate > UINT32_MAX)
+				die("Invalid tap rate: %s (%u-%u)", optarg,
+				    TAP_RATE_MIN, UINT32_MAX);
+
+			/* A full bucket refills in one second at most */
+			burst = MAX(rate / 10, TAP_RATE_MIN);
+			if (parse_literal(&p, ":") &&
+			    (!parse_unsigned(&p, 0, &burst) ||
+			     burst < TAP_RATE_MIN || burst > rate))
+				die("Invalid tap burst: %s", optarg);
+
+			if (!parse_eoi(p))
+				die("Invalid tap rate: %s", optarg);
+
+			c->tap_rate = rate;
+			c->tap_burst = burst;
+			break;
+		}
+		case 34: {
+			unsigned long usec;
+
+			if (c->mode != MODE_VU)
+				die("--busy-poll is for vhost-user mode only");
+
+			p = optarg;
+			if (!parse_unsigned(&p, 0, &usec) || !parse_eoi(p) ||
+			    usec > BUSY_POLL_MAX)
+				die("Invalid busy-poll budget: %s (0-%u)",
+				    optarg, BUSY_POLL_MAX);
+
+			c->busy_poll = usec;
+			break;
+		}
+		case 35: {
+			unsigned long len;
+
+			p = optarg;
+			if (!parse_unsigned(&p, 0, &len) || !parse_eoi(p) ||
+			    len < PCAP_SNAPLEN_MIN || len > USHRT_MAX)
+				die("Invalid pcap snapshot length: %s (%u-%u)",
+				    optarg, PCAP_SNAPLEN_MIN, USHRT_MAX);
+
+			c->pcap_snaplen = len;
+			break;
+		}
+		case 36:
+			conf_pcap_filter(c, optarg);
+			break;
+		case 37: {
+			unsigned long n;
+
+			p = optarg;
+			if (!parse_unsigned(&p, 0, &n) || !parse_eoi(p) ||
+			    !n || n > UINT_MAX)
+				die("Invalid pcap sampling rate: %s", optarg);
+
+			c->pcap_sample = n;
+			break;
+		}
+		case 38:
+			conf_prio_ports(c, optarg);
+			break;
+		case 39:
+			conf_cpus(c, optarg);
+			break;
+		case 40:
+			ret = snprintf(c->probe_cache, sizeof(c->probe_cache),
+				       "%s", optarg);
+			if (ret <= 0 || ret >= (int)sizeof(c->probe_cache))
+				die("Invalid probe cache path: %s", optarg);
+
+			break;
+		case 44:
+			ret = snprintf(c->stats_file, sizeof(c->stats_file),
+				       "%s", optarg);
+			if (ret <= 0 || ret >= (int)sizeof(c->stats_file))
+				die("Invalid statistics file: %s", optarg);
+
+			break;
+		case 41: {
+			unsigned long max;
+
+			p = optarg;
+			if (!parse_unsigned(&p, 0, &max) || !parse_eoi(p) ||
+			    max < USHRT_MAX || max > UINT32_MAX)
+				die("Invalid maximum window: %s", optarg);
+
+			c->tcp.wnd_bdp_max = max;
+			break;
+		}
+		case 43: {
+			unsigned long budget;
+
+			p = optarg;
+			if (!parse_unsigned(&p, 0, &budget) || !parse_eoi(p) ||
+			    !budget)
+				die("Invalid TCP memory budget: %s", optarg);
+
+			c->tcp.mem_budget = budget;
+			break;
+		}
 		case 'd':
 			c->debug = 1;
 			c->quiet = 0;
@@ -1758,6 +2103,7 @@ void conf(struct ctx *c, int argc, char **argv)
 			/* fall through */
 		case 't':
 		case 'u':
+		case 42:
 			/* Handle these later, once addresses are configured */
 			break;
 		case 'D': {
@@ -1810,6 +2156,8 @@ void conf(struct ctx *c, int argc, char **argv)
 		c->no_splice = 1;
 		if (c->splice_only)
 			die("--splice-only is for pasta mode only");
+		if (c->io_uring)
+			die("--io-uring is for pasta mode only");
 	}
 	if (c->no_splice && c->host_lo_to_ns_lo)
 		die("--host-lo-to-ns-lo is incompatible with --no-splice");
@@ -1913,16 +2261,22 @@ void conf(struct ctx *c, int argc, char **argv)
 
 		if (name == 't') {
 			opt_t = true;
-			fwd_rule_parse(name, false, optarg, c->fwd[PIF_HOST]);
+			fwd_rule_parse(name, false, optarg, &tune,
+				       c->fwd[PIF_HOST]);
 		} else if (name == 'u') {
 			opt_u = true;
-			fwd_rule_parse(name, false, optarg, c->fwd[PIF_HOST]);
+			fwd_rule_parse(name, false, optarg, &tune,
+				       c->fwd[PIF_HOST]);
 		} else if (name == 'T') {
 			opt_T = true;
-			fwd_rule_parse(name, false, optarg, c->fwd[PIF_SPLICE]);
+			fwd_rule_parse(name, false, optarg, &tune,
+				       c->fwd[PIF_SPLICE]);
 		} else if (name == 'U') {
 			opt_U = true;
-			fwd_rule_parse(name, false, optarg, c->fwd[PIF_SPLICE]);
+			fwd_rule_parse(name, false, optarg, &tune,
+				       c->fwd[PIF_SPLICE]);
+		} else if (name == 42) {
+			fwd_tune_parse(optarg, &tune);
 		}
 	} while (name != -1);
 
@@ -1974,13 +2328,17 @@ void conf(struct ctx *c, int argc, char **argv)
 
 	if (c->mode == MODE_PASTA) {
 		if (!opt_t)
-			fwd_rule_parse('t', false, "auto", c->fwd[PIF_HOST]);
+			fwd_rule_parse('t', false, "auto", &tune,
+				       c->fwd[PIF_HOST]);
 		if (!opt_T)
-			fwd_rule_parse('T', false, "auto", c->fwd[PIF_SPLICE]);
+			fwd_rule_parse('T', false, "auto", &tune,
+				       c->fwd[PIF_SPLICE]);
 		if (!opt_u)
-			fwd_rule_parse('u', false, "auto", c->fwd[PIF_HOST]);
+			fwd_rule_parse('u', false, "auto", &tune,
+				       c->fwd[PIF_HOST]);
 		if (!opt_U)
-			fwd_rule_parse('U', false, "auto", c->fwd[PIF_SPLICE]);
+			fwd_rule_parse('U', false, "auto", &tune,
+				       c->fwd[PIF_SPLICE]);
 	}
 
 	conf_sock_listen(c);
@@ -2007,7 +2365,7 @@ static int conf_send_rules(const struct ctx *c, int fd)
 	for (pif = 0; pif < PIF_NUM_TYPES; pif++) {
 		struct fwd_table *fwd = c->fwd[pif];
 		struct pesto_pif_info info = { 0 };
-		unsigned i;
+		unsigned i, count;
 		int rc;
 
 		if (!fwd)
@@ -2018,7 +2376,11 @@ static int conf_send_rules(const struct ctx *c, int fd)
 		rc = snprintf(info.name, sizeof(info.name), "%s", pif_name(pif));
 		assert(rc >= 0 && (size_t)rc < sizeof(info.name));
 		info.caps = htonl(fwd->caps);
-		info.count = htonl(fwd->count);
+
+		/* Skip slots left unused by fwd_rule_update() */
+		for (i = 0, count = 0; i < fwd->count; i++)
+			count += !fwd_rule_unused(&fwd->rules[i]);
+		info.count = htonl(count);
 
 		if (write_u8(fd, pif) < 0)
 			return -1;
@@ -2026,6 +2388,9 @@ static int conf_send_rules(const struct ctx *c, int fd)
 			return -1;
 
 		for (i = 0; i < fwd->count; i++) {
+			if (fwd_rule_unused(&fwd->rules[i]))
+				continue;
+
 			if (fwd_rule_write(fd, &fwd->rules[i]))
 				return -1;
 		}
@@ -2037,15 +2402,208 @@ static int conf_send_rules(const struct ctx *c, int fd)
 	return 0;
 }
 
+/**
+ * conf_send_stats() - Send statistics to configuration client (pesto)
+ * @fd:		Socket to the client
+ *
+ * Return: 0 on success, -1 on failure
+ *
+ * See PESTO_STATS_REQUEST for the format
+ */
+static int conf_send_stats(int fd)
+{
+	const uint64_t misc[] = {
+		passt_stats.tap_unsent,		passt_stats.tap_partial,
+		passt_stats.tcp_requeued,	passt_stats.loops,
+		passt_stats.loop_ns,		passt_stats.loop_ns_max,
+	};
+	const union flow *flow;
+	uint32_t flows = 0;
+	unsigned pif, i;
+
+	if (write_u32(fd, PESTO_STATS_PROTO_NUM) < 0)
+		return -1;
+
+	for (pif = PIF_NONE + 1; pif < PIF_NUM_TYPES; pif++) {
+		char name[PIF_NAME_SIZE] = { 0 };
+
+		snprintf(name, sizeof(name), "%s", pif_name(pif));
+
+		if (write_u8(fd, pif) < 0 ||
+		    write_all_buf(fd, name, sizeof(name)) < 0)
+			return -1;
+
+		for (i = 0; i < PESTO_STATS_PROTO_NUM; i++) {
+			const struct stats_l4 *s = &passt_stats.rx[pif][i];
+
+			if (write_u64(fd, s->packets) < 0 ||
+			    write_u64(fd, s->bytes) < 0 ||
+			    write_u64(fd, s->drops) < 0)
+				return -1;
+		}
+	}
+
+	if (write_u8(fd, PIF_NONE) < 0)
+		return -1;
+
+	flow_foreach(flow)
+		flows++;
+
+	if (write_u32(fd, flows) < 0 || write_u32(fd, flow_max) < 0)
+		return -1;
+
+	for (i = 0; i < ARRAY_SIZE(misc); i++) {
+		if (write_u64(fd, misc[i]) < 0)
+			return -1;
+	}
+
+	if (write_u32(fd, PESTO_STATS_HIST_NUM) < 0 ||
+	    write_u32(fd, PESTO_STATS_HIST_BUCKETS) < 0)
+		return -1;
+
+	for (i = 0; i < PESTO_STATS_HIST_NUM; i++) {
+		unsigned b;
+
+		for (b = 0; b < PESTO_STATS_HIST_BUCKETS; b++) {
+			if (write_u64(fd, passt_stats.hist[i][b]) < 0)
+				return -1;
+		}
+	}
+
+	if (write_u32(fd, EPOLL_NUM_TYPES + STATS_PROF_DEFER_NUM) < 0)
+		return -1;
+
+	for (i = 0; i < EPOLL_NUM_TYPES + STATS_PROF_DEFER_NUM; i++) {
+		char name[PESTO_STATS_PROF_NAME_SIZE] = { 0 };
+		const struct stats_prof *p;
+
+		if (i < EPOLL_NUM_TYPES) {
+			snprintf(name, sizeof(name), "%s", EPOLL_TYPE_STR(i));
+			p = &passt_stats.prof_events[i];
+		} else {
+			snprintf(name, sizeof(name), "%s",
+				 stats_prof_defer_str[i - EPOLL_NUM_TYPES]);
+			p = &passt_stats.prof_defer[i - EPOLL_NUM_TYPES];
+		}
+
+		if (write_all_buf(fd, name, sizeof(name)) < 0 ||
+		    write_u64(fd, p->calls) < 0 || write_u64(fd, p->ns) < 0)
+			return -1;
+	}
+
+	if (write_u32(fd, STATS_MEM_NUM) < 0)
+		return -1;
+
+	for (i = 0; i < STATS_MEM_NUM; i++) {
+		char name[PESTO_STATS_MEM_NAME_SIZE] = { 0 };
+
+		snprintf(name, sizeof(name), "%s", stats_mem_str[i]);
+
+		if (write_all_buf(fd, name, sizeof(name)) < 0 ||
+		    write_u64(fd, passt_stats.mem[i]) < 0)
+			return -1;
+	}
+
+	return 0;
+}
+
+/**
+ * conf_recv_delta() - Receive and apply differential update to current rules
+ * @c:		Execution context
+ * @fd:		Socket to the client
+ *
+ * Return: 0 on success, including rejected updates, -1 on failure
+ *
+ * See PESTO_DELTA_REQUEST for the format
+ */
+static int conf_recv_delta(const struct ctx *c, int fd)
+{
+	/**
+	 * struct conf_delta_op - Single operation of a differential update
+	 * @rule:	Rule to add or delete
+	 * @pif:	Interface whose table we're updating
+	 * @del:	Delete @rule instead of adding it
+	 */
+	static struct conf_delta_op {
+		struct fwd_rule rule;
+		uint8_t pif;
+		bool del;
+	} ops[PESTO_DELTA_MAX];
+	uint32_t count, failed = 0;
+	unsigned i;
+
+	if (read_u32(fd, &count))
+		return -1;
+
+	if (count > PESTO_DELTA_MAX) {
+		err("Received %"PRIu32" rule operations (maximum %u)",
+		    count, PESTO_DELTA_MAX);
+		return -1;
+	}
+
+	/* Read everything first, so that a truncated update has no effect */
+	for (i = 0; i < count; i++) {
+		struct fwd_rule *r = &ops[i].rule;
+		uint8_t op;
+
+		if (read_u8(fd, &op) || read_u8(fd, &ops[i].pif) ||
+		    fwd_rule_read(fd, r))
+			return -1;
+
+		if (op != PESTO_DELTA_ADD && op != PESTO_DELTA_DEL) {
+			err("Invalid rule operation %"PRIu8, op);
+			return -1;
+		}
+		ops[i].del = op == PESTO_DELTA_DEL;
+
+		if (r->ifname[sizeof(r->ifname) - 1]) {
+			err("Interface name was not NULL terminated");
+			return -1;
+		}
+		/* Redundant, to make static checkers happy */
+		r->ifname[sizeof(r->ifname) - 1] = '\0';
+	}
+
+	for (i = 0; i < count; i++) {
+		const struct conf_delta_op *o = &ops[i];
+		char rstr[FWD_RULE_STRLEN];
+
+		fwd_rule_fmt(&o->rule, rstr, sizeof(rstr));
+
+		if (fwd_rule_update(c, o->pif, &o->rule, o->del) < 0) {
+			warn("Can't %s %s rule %s, reverting update",
+			     o->del ? "delete" : "add", pif_name(o->pif), rstr);
+			failed = i + 1;
+			break;
+		}
+
+		info("%s %s rule %s", o->del ? "Deleted" : "Added",
+		     pif_name(o->pif), rstr);
+	}
+
+	/* Undo in reverse order whatever we applied before the failure */
+	while (failed && i--) {
+		const struct conf_delta_op *o = &ops[i];
+
+		if (fwd_rule_update(c, o->pif, &o->rule, !o->del) < 0)
+			err("Failed to revert update, rules might be missing");
+	}
+
+	return write_u32(fd, failed) < 0 ? -1 : 0;
+}
+
 /**
  * conf_recv_rules() - Receive forwarding rules from configuration client
  * @c:		Execution context
  * @fd:		Socket to the client
  *
- * Return: 0 on success, -1 on failure
+ * Return: 0 on success, 1 if the client asked for statistics, or sent a
+ *	   differential update, instead of replacing rules, -1 on failure
  */
 static int conf_recv_rules(const struct ctx *c, int fd)
 {
+	bool first = true;
+
 	while (1) {
 		struct fwd_table *fwd;
 		struct fwd_rule r;
@@ -2059,6 +2617,12 @@ static int conf_recv_rules(const struct ctx *c, int fd)
 		if (pif == PIF_NONE)
 			break;
 
+		if (pif == PESTO_STATS_REQUEST && first)
+			return conf_send_stats(fd) < 0 ? -1 : 1;
+		if (pif == PESTO_DELTA_REQUEST && first)
+			return conf_recv_delta(c, fd) < 0 ? -1 : 1;
+		first = false;
+
 		if (pif >= ARRAY_SIZE(c->fwd_pending) ||
 		    !(fwd = c->fwd_pending[pif])) {
 			err("Received rules for non-existent table");
@@ -2200,6 +2764,7 @@ void conf_handler(struct ctx *c, uint32_t events)
 {
 	if (events & EPOLLIN) {
 		unsigned pif;
+		int rc;
 
 		/* Clear pending tables */
 		for (pif = 0; pif < PIF_NUM_TYPES; pif++)
@@ -2208,7 +2773,8 @@ void conf_handler(struct ctx *c, uint32_t events)
 		/* FIXME: this could block indefinitely if the client doesn't
 		 * write as much as it should
 		 */
-		if (conf_recv_rules(c, c->fd_control) < 0)
+		rc = conf_recv_rules(c, c->fd_control);
+		if (rc)
 			goto close;
 
 		for (pif = 0; pif < PIF_NUM_TYPES; pif++) {
@@ -0,0 +1,549 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+
+/* PASST - Plug A Simple Socket Transport
+ *  for qemu/UNIX domain socket mode
+ *
+ * PASTA - Pack A Subtle Tap Abstraction
+ *  for network namespace/tap device mode
+ *
+ * dns.c - Cache of DNS replies for queries from the guest
+ *
+ * Copyright Red Hat
+ *
+ * With --dns-cache, we look at UDP queries from the guest to port 53, and at
+ * replies coming back on the corresponding flows. Positive replies are cached
+ * for the smallest TTL of their resource records, negative ones (RFC 2308) for
+ * the smallest of those and the minimum field of the SOA record in the
+ * authority section, capped to DNS_TTL_MAX. Further queries are then answered
+ * directly, with updated TTLs, without creating flows or sockets.
+ *
+ * While a query is in flight, identical queries (same server, name including
+ * case, type and class) are held, and answered once the reply comes back.
+ *
+ * The cache is a direct-mapped table, indexed by a hash of server address and
+ * question: on collisions, the most recent question wins.
+ */
+
+#include <limits.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <sys/types.h>
+#include <netinet/in.h>
+#include <netinet/udp.h>
+#include <arpa/inet.h>
+
+#include "util.h"
+#include "iov.h"
+#include "ip.h"
+#include "inany.h"
+#include "siphash.h"
+#include "passt.h"
+#include "flow.h"
+#include "tap.h"
+#include "dns.h"
+
+#define DNS_CACHE_SIZE		256	/* Entries, power of two */
+#define DNS_MSG_MAX		1232	/* Largest cached reply, as in RFC 9715 */
+#define DNS_MSG_MAX_NO_EDNS	512	/* Largest reply without EDNS, RFC 1035 */
+#define DNS_NAME_MAX		255
+#define DNS_KEY_MAX		(DNS_NAME_MAX + 4)	/* With type and class */
+#define DNS_RR_MAX		32	/* Resource records in cached reply */
+#define DNS_WAITERS		8	/* Queries held per query in flight */
+#define DNS_PENDING_TIMEOUT	2	/* s, before we forward queries again */
+#define DNS_TTL_MAX		3600	/* s */
+
+static_assert((DNS_CACHE_SIZE & (DNS_CACHE_SIZE - 1)) == 0,
+	      "DNS_CACHE_SIZE must be a power of two");
+
+#define DNS_FLAG_QR		0x8000
+#define DNS_FLAG_OPCODE		0x7800
+#define DNS_FLAG_TC		0x0200
+#define DNS_RCODE		0x000f
+#define DNS_RCODE_NOERROR	0
+#define DNS_RCODE_NXDOMAIN	3
+
+#define DNS_TYPE_SOA		6
+#define DNS_TYPE_OPT		41
+
+/* Type, class, TTL and data length of resource records */
+#define DNS_RR_FIXED_LEN	10
+
+/**
+ * struct dns_hdr - DNS message header (RFC 1035, 4.1.1)
+ * @id:		Query identifier
+ * @flags:	Flags, opcode and response code
+ * @qdcount:	Number of entries in question section
+ * @ancount:	Number of resource records in answer section
+ * @nscount:	Number of resource records in authority section
+ * @arcount:	Number of resource records in additional section
+ */
+struct dns_hdr {
+	uint16_t id;
+	uint16_t flags;
+	uint16_t qdcount;
+	uint16_t ancount;
+	uint16_t nscount;
+	uint16_t arcount;
+} __attribute__((packed));
+
+/**
+ * struct dns_waiter - Query held while an identical one is in flight
+ * @addr:	Guest address
+ * @port:	Guest port
+ * @id:		Query identifier, network order
+ */
+struct dns_waiter {
+	union inany_addr addr;
+	in_port_t port;
+	uint16_t id;
+};
+
+/**
+ * enum dns_state - State of cache entries
+ * @DNS_FREE:		Unused
+ * @DNS_PENDING:	Query in flight, @msg holds the query
+ * @DNS_VALID:		Reply cached in @msg
+ */
+enum dns_state {
+	DNS_FREE = 0,
+	DNS_PENDING,
+	DNS_VALID,
+};
+
+/**
+ * struct dns_entry - Cached reply, or query in flight
+ * @state:	enum dns_state
+ * @rr_count:	Number of TTL fields in @msg
+ * @waiters:	Number of queries held in @waiter
+ * @qlen:	Length of question (name, type, class), after header in @msg
+ * @len:	Length of message in @msg
+ * @server:	Server address, as seen by the guest
+ * @key:	Question, with lowercase name
+ * @start:	Time we forwarded the query, or got the reply, seconds
+ * @expire:	Time the cached reply expires, seconds
+ * @ttl:	Original TTLs of resource records in reply
+ * @ttl_off:	Offsets of TTL fields in reply
+ * @waiter:	Queries held while this one is pending
+ * @msg:	Cached reply, or query in flight
+ */
+struct dns_entry {
+	uint8_t state;
+	uint8_t rr_count;
+	uint8_t waiters;
+	uint16_t qlen;
+	uint16_t len;
+	union inany_addr server;
+	uint8_t key[DNS_KEY_MAX];
+	time_t start;
+	time_t expire;
+	uint32_t ttl[DNS_RR_MAX];
+	uint16_t ttl_off[DNS_RR_MAX];
+	struct dns_waiter waiter[DNS_WAITERS];
+	uint8_t msg[DNS_MSG_MAX];
+};
+
+static struct dns_entry dns_cache[DNS_CACHE_SIZE];
+
+/* Queries and replies we're looking at, and replies served from cache */
+static uint8_t dns_buf[USHRT_MAX];
+static uint8_t dns_out[DNS_MSG_MAX];
+
+/**
+ * dns_u16() - Read 16-bit field from message
+ * @p:		Pointer to field, network order
+ *
+ * Return: value of field, host order
+ */
+static uint16_t dns_u16(const uint8_t *p)
+{
+	return (uint16_t)(p[0] << 8 | p[1]);
+}
+
+/**
+ * dns_u32() - Read 32-bit field from message
+ * @p:		Pointer to field, network order
+ *
+ * Return: value of field, host order
+ */
+static uint32_t dns_u32(const uint8_t *p)
+{
+	return (uint32_t)p[0] << 24 | (uint32_t)p[1] << 16 |
+	       (uint32_t)p[2] << 8 | p[3];
+}
+
+/**
+ * dns_name_skip() - Skip over a possibly compressed domain name
+ * @msg:	Message
+ * @len:	Length of message
+ * @off:	Offset of name
+ *
+ * Return: offset past the name, -1 if malformed
+ */
+static ssize_t dns_name_skip(const uint8_t *msg, size_t len, size_t off)
+{
+	while (off < len) {
+		uint8_t l = msg[off];
+
+		if (!l)
+			return off + 1;
+
+		if ((l & 0xc0) == 0xc0)		/* Pointer, RFC 1035, 4.1.4 */
+			return off + 2 <= len ? (ssize_t)off + 2 : -1;
+
+		if (l & 0xc0)
+			return -1;
+
+		off += l + 1;
+	}
+
+	return -1;
+}
+
+/**
+ * dns_question() - Get question from message, with lowercase name, as key
+ * @msg:	Message, with a single question
+ * @len:	Length of message
+ * @key:	Question with lowercase name, set on return
+ *
+ * Return: length of question, 0 if malformed or compressed
+ */
+static size_t dns_question(const uint8_t *msg, size_t len, uint8_t *key)
+{
+	size_t start = sizeof(struct dns_hdr), off = start, i;
+
+	while (off < len && msg[off]) {
+		if (msg[off] & 0xc0)
+			return 0;
+		off += msg[off] + 1;
+	}
+
+	/* Name terminator, then type and class */
+	if (++off - start > DNS_NAME_MAX || (off += 4) > len)
+		return 0;
+
+	for (i = start; i < off; i++) {
+		uint8_t b = msg[i];
+
+		/* Labels are at most 63 bytes long: lengths aren't letters */
+		if (i < off - 4 && b >= 'A' && b <= 'Z')
+			b += 'a' - 'A';
+		key[i - start] = b;
+	}
+
+	return off - start;
+}
+
+/**
+ * dns_slot() - Find cache entry for server and question
+ * @c:		Execution context
+ * @server:	Server address
+ * @key:	Question, from dns_question()
+ * @qlen:	Length of question
+ *
+ * Return: pointer to cache entry, which might hold a different question
+ */
+static struct dns_entry *dns_slot(const struct ctx *c,
+				  const union inany_addr *server,
+				  const uint8_t *key, size_t qlen)
+{
+	struct siphash_state st = SIPHASH_INIT(c->hash_secret);
+	uint64_t w, tail = 0;
+	size_t i;
+
+	siphash_feed_inany(&st, server);
+	for (i = 0; i + sizeof(w) <= qlen; i += sizeof(w)) {
+		memcpy(&w, key + i, sizeof(w));
+		siphash_feed(&st, w);
+	}
+	memcpy(&tail, key + i, qlen - i);
+
+	return &dns_cache[siphash_final(&st, qlen, tail) &
+			  (DNS_CACHE_SIZE - 1)];
+}
+
+/**
+ * dns_match() - Check if cache entry matches server and question
+ * @e:		Cache entry
+ * @server:	Server address
+ * @key:	Question, from dns_question()
+ * @qlen:	Length of question
+ *
+ * Return: true if entry is in use for the same server and question
+ */
+static bool dns_match(const struct dns_entry *e,
+		      const union inany_addr *server,
+		      const uint8_t *key, size_t qlen)
+{
+	return e->state != DNS_FREE && e->qlen == qlen &&
+	       inany_equals(&e->server, server) && !memcmp(e->key, key, qlen);
+}
+
+/**
+ * dns_send() - Send DNS reply to guest
+ * @c:		Execution context
+ * @server:	Server address, as seen by the guest
+ * @addr:	Guest address
+ * @port:	Guest port
+ * @msg:	Reply
+ * @len:	Length of reply
+ */
+static void dns_send(const struct ctx *c, const union inany_addr *server,
+		     const union inany_addr *addr, in_port_t port,
+		     void *msg, size_t len)
+{
+	const struct in_addr *s4 = inany_v4(server), *d4 = inany_v4(addr);
+
+	if (s4 && d4) {
+		tap_udp4_send(c, *s4, DNS_PORT, *d4, port, msg, len);
+		return;
+	}
+
+	tap_udp6_send(c, &server->a6, DNS_PORT, &addr->a6, port, 0, msg, len);
+}
+
+/**
+ * dns_store() - Cache reply in dns_buf, if possible
+ * @e:		Cache entry to use
+ * @server:	Server address, as seen by the guest
+ * @key:	Question, from dns_question()
+ * @qlen:	Length of question
+ * @len:	Length of reply
+ * @now:	Current timestamp
+ *
+ * Return: true if the reply was cached, false if the entry was freed instead
+ */
+static bool dns_store(struct dns_entry *e, const union inany_addr *server,
+		      const uint8_t *key, size_t qlen, size_t len,
+		      const struct timespec *now)
+{
+	const struct dns_hdr *h = (struct dns_hdr *)dns_buf;
+	unsigned ancount = ntohs(h->ancount), nscount = ntohs(h->nscount);
+	unsigned rr, rrs = ancount + nscount + ntohs(h->arcount);
+	size_t off = sizeof(*h) + qlen;
+	uint16_t flags = ntohs(h->flags);
+	uint32_t ttl = DNS_TTL_MAX;
+	bool negative, soa = false;
+
+	e->state = DNS_FREE;
+
+	if (len > DNS_MSG_MAX || (flags & (DNS_FLAG_OPCODE | DNS_FLAG_TC)))
+		return false;
+
+	if ((flags & DNS_RCODE) == DNS_RCODE_NXDOMAIN)
+		negative = true;
+	else if ((flags & DNS_RCODE) == DNS_RCODE_NOERROR)
+		negative = !ancount;
+	else
+		return false;
+
+	e->rr_count = 0;
+	for (rr = 0; rr < rrs; rr++) {
+		ssize_t n = dns_name_skip(dns_buf, len, off);
+		uint32_t rr_ttl;
+		uint16_t type;
+		size_t rdlen;
+
+		if (n < 0 || (size_t)n + DNS_RR_FIXED_LEN > len)
+			return false;
+
+		off = n;
+		type = dns_u16(dns_buf + off);
+		rr_ttl = dns_u32(dns_buf + off + 4);
+		rdlen = dns_u16(dns_buf + off + 8);
+		if (off + DNS_RR_FIXED_LEN + rdlen > len)
+			return false;
+
+		if (type != DNS_TYPE_OPT) {	/* OPT has no TTL, RFC 6891 */
+			if (e->rr_count == DNS_RR_MAX)
+				return false;
+
+			e->ttl_off[e->rr_count] = off + 4;
+			e->ttl[e->rr_count++] = rr_ttl;
+			ttl = MIN(ttl, rr_ttl);
+
+			/* RFC 2308, 5: SOA TTL and minimum field */
+			if (type == DNS_TYPE_SOA && rdlen >= 20 &&
+			    rr >= ancount && rr < ancount + nscount) {
+				const uint8_t *min = dns_buf + off +
+						     DNS_RR_FIXED_LEN +
+						     rdlen - 4;
+
+				ttl = MIN(ttl, dns_u32(min));
+				soa = true;
+			}
+		}
+
+		off += DNS_RR_FIXED_LEN + rdlen;
+	}
+
+	if ((negative && !soa) || !ttl)
+		return false;
+
+	e->state = DNS_VALID;
+	e->waiters = 0;
+	e->qlen = qlen;
+	e->len = len;
+	e->server = *server;
+	memcpy(e->key, key, qlen);
+	memcpy(e->msg, dns_buf, len);
+	e->start = now->tv_sec;
+	e->expire = now->tv_sec + ttl;
+
+	return true;
+}
+
+/**
+ * dns_query() - Answer query from guest from cache, or hold it if possible
+ * @c:		Execution context
+ * @af:		Address family, AF_INET or AF_INET6
+ * @saddr:	Source (guest) address
+ * @daddr:	Destination (server) address
+ * @sport:	Source port
+ * @data:	UDP datagram, including UDP header
+ * @now:	Current timestamp
+ *
+ * Return: true if the query was answered or held, false if it needs to be
+ *	   forwarded
+ */
+bool dns_query(const struct ctx *c, sa_family_t af, const void *saddr,
+	       const void *daddr, in_port_t sport, const struct iov_tail *data,
+	       const struct timespec *now)
+{
+	const struct dns_hdr *h = (struct dns_hdr *)dns_buf;
+	union inany_addr server, guest;
+	struct iov_tail payload = *data;
+	uint8_t key[DNS_KEY_MAX];
+	struct dns_entry *e;
+	size_t len, qlen;
+	time_t elapsed;
+	unsigned i;
+
+	if (!c->dns_cache || !iov_drop_header(&payload, sizeof(struct udphdr)))
+		return false;
+
+	len = iov_tail_size(&payload);
+	if (len < sizeof(*h) || len > DNS_MSG_MAX)
+		return false;
+
+	iov_to_buf(payload.iov, payload.cnt, payload.off, dns_buf, len);
+
+	if ((ntohs(h->flags) & (DNS_FLAG_QR | DNS_FLAG_OPCODE)) ||
+	    ntohs(h->qdcount) != 1 || h->ancount || h->nscount)
+		return false;
+
+	if (!(qlen = dns_question(dns_buf, len, key)))
+		return false;
+
+	inany_from_af(&server, af, daddr);
+	inany_from_af(&guest, af, saddr);
+	e = dns_slot(c, &server, key, qlen);
+
+	if (!dns_match(e, &server, key, qlen) ||
+	    (e->state == DNS_VALID && now->tv_sec >= e->expire) ||
+	    (e->state == DNS_PENDING &&
+	     now->tv_sec >= e->start + DNS_PENDING_TIMEOUT)) {
+		/* Forward it, and hold identical queries until it's answered */
+		e->state = DNS_PENDING;
+		e->waiters = 0;
+		e->qlen = qlen;
+		e->len = sizeof(*h) + qlen;
+		e->server = server;
+		memcpy(e->key, key, qlen);
+		memcpy(e->msg, dns_buf, e->len);
+		e->start = now->tv_sec;
+		return false;
+	}
+
+	if (e->state == DNS_PENDING) {
+		struct dns_waiter *w;
+
+		/* Names need to match exactly, as resolvers might randomise
+		 * their case (draft-vixie-dnsext-dns0x20) and check replies
+		 */
+		if (e->waiters == DNS_WAITERS ||
+		    memcmp(e->msg + sizeof(*h), dns_buf + sizeof(*h), qlen))
+			return false;
+
+		w = &e->waiter[e->waiters++];
+		w->addr = guest;
+		w->port = sport;
+		w->id = h->id;
+		return true;
+	}
+
+	/* Without EDNS, the client can't take more than this, RFC 6891, 6.2.5 */
+	if (e->len > DNS_MSG_MAX_NO_EDNS && !h->arcount)
+		return false;
+
+	/* Use identifier and name (case) from query, update TTLs */
+	memcpy(dns_out, e->msg, e->len);
+	memcpy(dns_out, &h->id, sizeof(h->id));
+	memcpy(dns_out + sizeof(*h), dns_buf + sizeof(*h), qlen);
+
+	elapsed = now->tv_sec - e->start;
+	for (i = 0; i < e->rr_count; i++) {
+		uint32_t ttl = e->ttl[i] > elapsed ? e->ttl[i] - elapsed : 0;
+
+		ttl = htonl(ttl);
+		memcpy(dns_out + e->ttl_off[i], &ttl, sizeof(ttl));
+	}
+
+	dns_send(c, &server, &guest, sport, dns_out, e->len);
+
+	return true;
+}
+
+/**
+ * dns_reply() - Cache reply from server, answer held queries
+ * @c:		Execution context
+ * @toside:	Flowside of reply, towards the guest
+ * @data:	UDP payload of reply
+ * @dlen:	Length of UDP payload
+ * @now:	Current timestamp
+ */
+void dns_reply(const struct ctx *c, const struct flowside *toside,
+	       const struct iov_tail *data, size_t dlen,
+	       const struct timespec *now)
+{
+	const struct dns_hdr *h = (struct dns_hdr *)dns_buf;
+	struct dns_waiter waiter[DNS_WAITERS];
+	uint8_t key[DNS_KEY_MAX];
+	unsigned waiters = 0, i;
+	struct dns_entry *e;
+	size_t qlen;
+
+	if (!c->dns_cache || toside->oport != DNS_PORT ||
+	    dlen < sizeof(*h) || dlen > sizeof(dns_buf))
+		return;
+
+	iov_to_buf(data->iov, data->cnt, data->off, dns_buf, dlen);
+
+	if (!(ntohs(h->flags) & DNS_FLAG_QR) || ntohs(h->qdcount) != 1)
+		return;
+
+	if (!(qlen = dns_question(dns_buf, dlen, key)))
+		return;
+
+	e = dns_slot(c, &toside->oaddr, key, qlen);
+	if (dns_match(e, &toside->oaddr, key, qlen)) {
+		if (e->state == DNS_PENDING) {
+			waiters = e->waiters;
+			memcpy(waiter, e->waiter, sizeof(waiter[0]) * waiters);
+		}
+	} else if (e->state == DNS_PENDING &&
+		   now->tv_sec < e->start + DNS_PENDING_TIMEOUT) {
+		/* Don't evict a different query in flight */
+		return;
+	}
+
+	dns_store(e, &toside->oaddr, key, qlen, dlen, now);
+
+	for (i = 0; i < waiters; i++) {
+		memcpy(dns_buf, &waiter[i].id, sizeof(waiter[i].id));
+		dns_send(c, &toside->oaddr, &waiter[i].addr, waiter[i].port,
+			 dns_buf, dlen);
+	}
+}
@@ -0,0 +1,17 @@
+/* SPDX-License-Identifier: GPL-2.0-or-later
+ * Copyright Red Hat
+ */
+
+#ifndef DNS_H
+#define DNS_H
+
+#define DNS_PORT		53
+
+bool dns_query(const struct ctx *c, sa_family_t af, const void *saddr,
+	       const void *daddr, in_port_t sport, const struct iov_tail *data,
+	       const struct timespec *now);
+void dns_reply(const struct ctx *c, const struct flowside *toside,
+	       const struct iov_tail *data, size_t dlen,
+	       const struct timespec *now);
+
+#endif /* DNS_H */
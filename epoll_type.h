@@ -24,6 +24,8 @@ enum epoll_type {
 	EPOLL_TYPE_UDP_LISTEN,
 	/* UDP socket for a specific flow */
 	EPOLL_TYPE_UDP,
+	/* Unconnected UDP socket shared by outbound flows, see --udp-shared */
+	EPOLL_TYPE_UDP_SHARED,
 	/* ICMP/ICMPv6 ping sockets */
 	EPOLL_TYPE_PING,
 	/* inotify fd watching for end of netns (pasta) */
@@ -50,6 +52,8 @@ enum epoll_type {
 	EPOLL_TYPE_CONF_LISTEN,
 	/* Configuration socket */
 	EPOLL_TYPE_CONF,
+	/* epoll instance for flows with priority, see --prio-ports */
+	EPOLL_TYPE_PRIO,
 
 	EPOLL_NUM_TYPES,
 };
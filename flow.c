@@ -13,15 +13,19 @@
 #include <string.h>
 
 #include "util.h"
+#include "bitmap.h"
 #include "ip.h"
 #include "passt.h"
 #include "siphash.h"
 #include "inany.h"
 #include "flow.h"
 #include "flow_table.h"
+#include "frag.h"
 #include "repair.h"
 #include "epoll_ctl.h"
 #include "serialise.h"
+#include "probe.h"
+#include "stats.h"
 
 const char *flow_state_str[] = {
 	[FLOW_STATE_FREE]	= "FREE",
@@ -95,7 +99,7 @@ static_assert(ARRAY_SIZE(flow_epoll) == FLOW_NUM_TYPES,
  *
  * Free cluster list
  *    flow_first_free gives the index of the first (lowest index) free cluster.
- *    Each free cluster has the index of the next free cluster, or FLOW_MAX if
+ *    Each free cluster has the index of the next free cluster, or flow_max if
  *    it is the last free cluster.  Together these form a linked list of free
  *    clusters, in strictly increasing order of index.
  *
@@ -115,32 +119,82 @@ static_assert(ARRAY_SIZE(flow_epoll) == FLOW_NUM_TYPES,
  *    after cancellation.
  *
  *    2) Flows can be freed by returning true from the flow type specific
- *    deferred or timer function.  These are called from flow_defer_handler()
- *    which is already scanning the whole table in index order.  We can use that
- *    to rebuild the free cluster list correctly, either merging them into
- *    existing free clusters or creating new free clusters in the list for them.
+ *    deferred or timer function.  These are called from flow_defer_handler(),
+ *    which collects flows to be freed in a bitmap, and then frees them in index
+ *    order, walking the free cluster list at the same time.  This way, we can
+ *    keep the list correct, either merging freed entries into existing free
+ *    clusters or creating new free clusters in the list for them.
  *
  * Scanning the table
- *    Theoretically, scanning the table requires FLOW_MAX iterations.  However,
+ *    Theoretically, scanning the table requires flow_max iterations.  However,
  *    when we encounter the start of a free cluster, we can immediately skip
  *    past it, meaning that in practice we only need (number of active
  *    connections) + (number of free clusters) iterations.
+ *
+ *    flow_defer_handler() runs on every main loop iteration, so it avoids
+ *    scanning the table altogether: flows needing deferred handling are marked
+ *    with flow_defer(), and flows with periodic timers in a separate bitmap.
  */
 
+/* Flow table, sized at start-up (flow_max entries), committed as it's used */
 unsigned flow_first_free;
-union flow flowtab[FLOW_MAX];
+unsigned flow_max;
+union flow *flowtab;
+
+/* Entries in use, and whether flow_alloc() failed since flow timers last ran */
+static unsigned flow_count;
+static bool flow_full;
 static const union flow *flow_new_entry; /* = NULL */
+
+/**
+ * struct flow_admit_bucket - Token bucket for new flows from guest addresses
+ * @tat:	Theoretical arrival time of next new flow, nanoseconds
+ */
+struct flow_admit_bucket {
+	uint64_t tat;
+};
+
+/* Indexed by hash of guest source address, see flow_admit() */
+static struct flow_admit_bucket flow_admit_tab[FLOW_ADMIT_BUCKETS];
+
+/* Socket options from forwarding rule for flow_new_entry, set by flow_target */
+static const struct fwd_tune *flow_new_tune; /* = NULL */
 static int epoll_id_to_fd[EPOLLFD_ID_SIZE];
 
-/* Hash table to index it */
+/* Bitmaps with flow_max bits: flows to be freed by flow_defer_handler(), flows
+ * needing a call to their deferred handler, and flows with periodic timers
+ */
+static uint8_t *flow_to_free;
+static uint8_t *flow_deferred;
+static uint8_t *flow_timed;
+static unsigned flow_deferred_count;
+
+/* Hash table to index it: safe linear probing requires more entries than the
+ * number of sides in the flow table
+ */
 #define FLOW_HASH_LOAD		70		/* % */
-#define FLOW_HASH_SIZE		((2 * FLOW_MAX * 100 / FLOW_HASH_LOAD))
+#define FLOW_HASH_SIZE(max)	((2 * (size_t)(max) * 100 / FLOW_HASH_LOAD))
+
+/* Table for lookup from flowside information, flow_hash_size entries */
+static flow_sidx_t *flow_hashtab;
+static unsigned flow_hash_size;
 
-/* Table for lookup from flowside information */
-static flow_sidx_t flow_hashtab[FLOW_HASH_SIZE];
+/**
+ * struct flow_hash_meta - Metadata for entry in a hash table bucket
+ * @home:	Home bucket of the entry, that is, raw hash value modulo table size
+ * @tag:	Upper 32 bits of raw hash value, compared before looking at flows
+ *
+ * The table uses Robin Hood linear probing: entries in a cluster are sorted by
+ * home bucket, so lookups can stop at the first entry that's closer to its own
+ * home bucket than the probe is to ours, and removals shift entries back.
+ */
+struct flow_hash_meta {
+	uint32_t home;
+	uint32_t tag;
+};
 
-static_assert(ARRAY_SIZE(flow_hashtab) >= 2 * FLOW_MAX,
-"Safe linear probing requires hash table with more entries than the number of sides in the flow table");
+/* Metadata for entries in flow_hashtab, by bucket */
+static struct flow_hash_meta *flow_hashmeta;
 
 /* Last time the flow timers ran */
 static struct timespec flow_timer_run;
@@ -203,6 +257,25 @@ static int flowside_sock_splice(void *arg)
 	return 0;
 }
 
+/** flowside_ifname() - Interface to bind socket for a flowside to, if any
+ * @c:		Execution context
+ * @pif:	Interface for the socket
+ * @side:	Flowside the socket is for
+ *
+ * Return: name of outbound interface, NULL (or empty) to bind to any
+ */
+const char *flowside_ifname(const struct ctx *c, uint8_t pif,
+			    const struct flowside *side)
+{
+	if (pif != PIF_HOST || inany_is_loopback(&side->oaddr))
+		return NULL;
+
+	if (inany_v4(&side->oaddr))
+		return c->ip4.ifname_out;
+
+	return c->ip6.ifname_out;
+}
+
 /** flowside_sock_l4() - Create and bind socket based on flowside
  * @c:		Execution context
  * @type:	Socket epoll type
@@ -215,7 +288,6 @@ static int flowside_sock_splice(void *arg)
 int flowside_sock_l4(const struct ctx *c, enum epoll_type type, uint8_t pif,
 		     const struct flowside *side)
 {
-	const char *ifname = NULL;
 	union sockaddr_inany sa;
 
 	assert(pif_is_socket(pif));
@@ -224,14 +296,7 @@ int flowside_sock_l4(const struct ctx *c, enum epoll_type type, uint8_t pif,
 
 	switch (pif) {
 	case PIF_HOST:
-		if (inany_is_loopback(&side->oaddr))
-			ifname = NULL;
-		else if (sa.sa_family == AF_INET)
-			ifname = c->ip4.ifname_out;
-		else if (sa.sa_family == AF_INET6)
-			ifname = c->ip6.ifname_out;
-
-		return sock_l4(c, type, &sa, ifname);
+		return sock_l4(c, type, &sa, flowside_ifname(c, pif, side));
 
 	case PIF_SPLICE: {
 		struct flowside_sock_args args = {
@@ -379,6 +444,27 @@ void flow_epollid_set(struct flow_common *f, int epollid)
 	f->epollid = epollid;
 }
 
+/**
+ * flow_epollid_assign() - Associate a new flow with the appropriate epoll id
+ * @c:		Execution context
+ * @f:		Flow to update, with both sides already set
+ *
+ * Flows to or from ports given with --prio-ports go to a separate epoll
+ * instance, whose events are handled first in each iteration of the main loop
+ */
+void flow_epollid_assign(const struct ctx *c, struct flow_common *f)
+{
+	const struct flowside *ini = &f->side[INISIDE];
+	const struct flowside *tgt = &f->side[TGTSIDE];
+
+	/* Only consider ports of the listening or connected end */
+	if (c->prio && (bitmap_isset(c->prio_ports, ini->oport) ||
+			bitmap_isset(c->prio_ports, tgt->eport)))
+		flow_epollid_set(f, EPOLLFD_ID_PRIO);
+	else
+		flow_epollid_set(f, EPOLLFD_ID_DEFAULT);
+}
+
 /**
  * flow_epoll_set() - Add or modify epoll registration for a flow socket
  * @f:		Flow to register socket for
@@ -546,6 +632,7 @@ struct flowside *flow_target(const struct ctx *c, union flow *flow,
 	if (tgtpif == PIF_NONE)
 		goto nofwd;
 
+	flow_new_tune = rule ? &rule->tune : NULL;
 	f->pif[TGTSIDE] = tgtpif;
 	flow_set_state(f, FLOW_STATE_TGT);
 	return tgt;
@@ -564,6 +651,19 @@ nofwd:
 	return NULL;
 }
 
+/**
+ * flow_tune() - Socket options from the forwarding rule for a new flow
+ * @f:		Flow, must be the one being set up, after flow_target()
+ *
+ * Return: socket options to apply to sockets for @f, NULL for defaults
+ */
+const struct fwd_tune *flow_tune(const struct flow_common *f)
+{
+	assert(&flow_new_entry->f == f && f->state >= FLOW_STATE_TGT);
+
+	return flow_new_tune;
+}
+
 /**
  * flow_set_type() - Set type and move to TYPED
  * @flow:	Flow to change state
@@ -581,6 +681,7 @@ union flow *flow_set_type(union flow *flow, enum flow_type type)
 	assert(f->pif[INISIDE] != PIF_NONE && f->pif[TGTSIDE] != PIF_NONE);
 
 	f->type = type;
+	passt_stats.flows[type]++;
 	flow_set_state(f, FLOW_STATE_TYPED);
 	return flow;
 }
@@ -596,6 +697,125 @@ void flow_activate(struct flow_common *f)
 
 	flow_set_state(f, FLOW_STATE_ACTIVE);
 	flow_new_entry = NULL;
+
+	switch (f->type) {
+	case FLOW_TCP_SPLICE:
+	case FLOW_PING4:
+	case FLOW_PING6:
+	case FLOW_UDP:
+		bitmap_set(flow_timed, flow_idx(f));
+		break;
+	default:
+		;
+	}
+
+	/* Protocol handlers might rely on a first deferred pass, for example to
+	 * dispose of connections that never got going
+	 */
+	flow_defer(f);
+}
+
+/**
+ * flow_defer() - Request deferred handling for flow, at the end of this cycle
+ * @f:		Flow, its state might already be inconsistent or final
+ */
+void flow_defer(const struct flow_common *f)
+{
+	unsigned idx = flow_idx(f);
+
+	if (bitmap_isset(flow_deferred, idx))
+		return;
+
+	bitmap_set(flow_deferred, idx);
+	flow_deferred_count++;
+}
+
+/**
+ * flow_bits_clear() - Drop pending deferred handling and timers for a flow
+ * @idx:	Flow index
+ */
+static void flow_bits_clear(unsigned idx)
+{
+	if (bitmap_isset(flow_deferred, idx)) {
+		bitmap_clear(flow_deferred, idx);
+		flow_deferred_count--;
+	}
+
+	bitmap_clear(flow_timed, idx);
+}
+
+/**
+ * flow_pressure() - Get flow table pressure, to shorten timeouts of idle flows
+ *
+ * Return: 0 up to FLOW_TABLE_PRESSURE % of entries in use, rising linearly to
+ *	   100 for a full table, or 100 if flow_alloc() failed since flow timers
+ *	   last ran
+ */
+unsigned flow_pressure(void)
+{
+	unsigned used;
+
+	if (flow_full)
+		return 100;
+
+	used = (uint64_t)flow_count * 100 / flow_max;
+	if (used <= FLOW_TABLE_PRESSURE)
+		return 0;
+
+	return (used - FLOW_TABLE_PRESSURE) * 100 / (100 - FLOW_TABLE_PRESSURE);
+}
+
+/**
+ * flow_timeout() - Scale down timeout of idle flow depending on table pressure
+ * @timeout:	Timeout for flow, seconds
+ *
+ * Return: @timeout, reduced in proportion to flow_pressure(), down to zero
+ */
+int flow_timeout(int timeout)
+{
+	return timeout - (int)((int64_t)timeout * flow_pressure() / 100);
+}
+
+/**
+ * flow_admit() - Check new flow from tap against rate limit for its source
+ * @c:		Execution context
+ * @af:		Address family, AF_INET or AF_INET6
+ * @saddr:	Guest source address, pointer to in_addr or in6_addr
+ * @now:	Current timestamp
+ *
+ * Token buckets are kept as theoretical arrival times (GCRA): each new flow
+ * moves the time of its bucket forward by 1 / c->flow_rate seconds, and is
+ * refused if that's more than c->flow_burst intervals ahead of @now. Buckets
+ * are indexed by a hash of the address, and shared by colliding addresses: if
+ * colliding addresses took buckets over instead, resetting them, a guest could
+ * alternate between two of them to escape the limit altogether.
+ *
+ * Return: true if a new flow may be created, false if over the limit
+ */
+bool flow_admit(const struct ctx *c, sa_family_t af, const void *saddr,
+		const struct timespec *now)
+{
+	struct siphash_state state = SIPHASH_INIT(c->hash_secret);
+	uint64_t t, interval, tat;
+	struct flow_admit_bucket *b;
+	union inany_addr addr;
+
+	if (!c->flow_rate)
+		return true;
+
+	inany_from_af(&addr, af, saddr);
+	siphash_feed_inany(&state, &addr);
+	b = &flow_admit_tab[siphash_final(&state, 16, 0) % FLOW_ADMIT_BUCKETS];
+
+	t = (uint64_t)now->tv_sec * 1000000000 + now->tv_nsec;
+	interval = 1000000000 / c->flow_rate;
+
+	tat = MAX(b->tat, t) + interval;
+	if (tat - t > interval * c->flow_burst)
+		return false;
+
+	b->tat = tat;
+	return true;
 }
 
 /**
@@ -609,22 +829,24 @@ union flow *flow_alloc(void)
 
 	assert(!flow_new_entry);
 
-	if (flow_first_free >= FLOW_MAX)
+	if (flow_first_free >= flow_max) {
+		flow_full = true;
 		return NULL;
+	}
 
 	assert(flow->f.state == FLOW_STATE_FREE);
 	assert(flow->f.type == FLOW_TYPE_NONE);
 	assert(flow->free.n >= 1);
-	assert(flow_first_free + flow->free.n <= FLOW_MAX);
+	assert(flow_first_free + flow->free.n <= flow_max);
 
 	if (flow->free.n > 1) {
 		union flow *next;
 
 		/* Use one entry from the cluster */
-		assert(flow_first_free <= FLOW_MAX - 2);
+		assert(flow_first_free <= flow_max - 2);
 		next = &flowtab[++flow_first_free];
 
-		assert(FLOW_IDX(next) < FLOW_MAX);
+		assert(FLOW_IDX(next) < flow_max);
 		assert(next->f.type == FLOW_TYPE_NONE);
 		assert(next->free.n == 0);
 
@@ -636,9 +858,14 @@ union flow *flow_alloc(void)
 	}
 
 	flow_new_entry = flow;
+	flow_new_tune = NULL;
+	flow_count++;
+	passt_stats.mem[STATS_MEM_FLOW] += sizeof(union flow);
 	memset(flow, 0, sizeof(*flow));
 	flow_set_state(&flow->f, FLOW_STATE_NEW);
 
+	PROBE(flow_alloc, FLOW_IDX(flow));
+
 	return flow;
 }
 
@@ -657,12 +884,18 @@ void flow_alloc_cancel(union flow *flow)
 	       flow->f.state == FLOW_STATE_TYPED);
 	assert(flow_first_free > FLOW_IDX(flow));
 
+	if (flow->f.type != FLOW_TYPE_NONE)
+		passt_stats.flows[flow->f.type]--;
+
+	flow_bits_clear(FLOW_IDX(flow));
 	flow_set_state(&flow->f, FLOW_STATE_FREE);
 	memset(flow, 0, sizeof(*flow));
+	flow_count--;
+	passt_stats.mem[STATS_MEM_FLOW] -= sizeof(union flow);
 
 	/* Put it back in a length 1 free cluster, don't attempt to fully
 	 * reverse flow_alloc()s steps.  This will get folded together the next
-	 * time flow_defer_handler runs anyway() */
+	 * time an adjacent entry is freed, or reused by the next allocation */
 	flow->free.n = 1;
 	flow->free.next = flow_first_free;
 	flow_first_free = FLOW_IDX(flow);
@@ -681,12 +914,22 @@ void flow_alloc_cancel(union flow *flow)
 static uint64_t flow_hash(const struct ctx *c, uint8_t proto, uint8_t pif,
 			  const struct flowside *side)
 {
+	const struct in_addr *o4 = inany_v4(&side->oaddr);
+	const struct in_addr *e4 = inany_v4(&side->eaddr);
 	struct siphash_state state = SIPHASH_INIT(c->hash_secret);
+	size_t len;
 
-	siphash_feed_inany(&state, &side->oaddr);
-	siphash_feed_inany(&state, &side->eaddr);
+	if (o4 && e4) {
+		/* Skip the IPv4-mapped prefixes: half the rounds */
+		siphash_feed(&state, (uint64_t)o4->s_addr << 32 | e4->s_addr);
+		len = 14;
+	} else {
+		siphash_feed_inany(&state, &side->oaddr);
+		siphash_feed_inany(&state, &side->eaddr);
+		len = 38;
+	}
 
-	return siphash_final(&state, 38, (uint64_t)proto << 40 |
+	return siphash_final(&state, len, (uint64_t)proto << 40 |
 			     (uint64_t)pif << 32 |
 			     (uint64_t)side->oport << 16 |
 			     (uint64_t)side->eport);
@@ -710,21 +953,51 @@ static uint64_t flow_sidx_hash(const struct ctx *c, flow_sidx_t sidx)
 }
 
 /**
- * flow_hash_probe_() - Find hash bucket for a flow, given hash
+ * flow_hash_meta() - Get bucket metadata for a raw hash value
  * @hash:	Raw hash value for flow & side
+ *
+ * Return: home bucket and tag for @hash
+ */
+static inline struct flow_hash_meta flow_hash_meta(uint64_t hash)
+{
+	return (struct flow_hash_meta){
+		.home = hash % flow_hash_size,
+		.tag = hash >> 32,
+	};
+}
+
+/**
+ * flow_hash_dist() - Get probe distance of the entry in a given bucket
+ * @b:		Bucket, must hold a valid entry
+ *
+ * Return: number of buckets between home bucket of the entry and @b
+ */
+static inline unsigned flow_hash_dist(unsigned b)
+{
+	return mod_sub(flow_hashmeta[b].home, b, flow_hash_size);
+}
+
+/**
+ * flow_hash_probe_() - Find hash bucket for a flow, given bucket metadata
+ * @m:		Bucket metadata for flow & side
  * @sidx:	Flow and side to find bucket for
  *
- * Return: if @sidx is in the hash table, its current bucket, otherwise a
- *         suitable free bucket for it.
+ * Return: if @sidx is in the hash table, its current bucket, otherwise the
+ *         bucket where it should be inserted, which might be in use
  */
-static inline unsigned flow_hash_probe_(uint64_t hash, flow_sidx_t sidx)
+static inline unsigned flow_hash_probe_(const struct flow_hash_meta *m,
+					flow_sidx_t sidx)
 {
-	unsigned b = hash % FLOW_HASH_SIZE;
+	unsigned b = m->home, d;
 
-	/* Linear probing */
-	while (flow_sidx_valid(flow_hashtab[b]) &&
-	       !flow_sidx_eq(flow_hashtab[b], sidx))
-		b = mod_sub(b, 1, FLOW_HASH_SIZE);
+	/* Linear probing, stopping at the first entry closer to its home
+	 * bucket than we are: because of the Robin Hood invariant, @sidx can't
+	 * be anywhere beyond it
+	 */
+	for (d = 0; flow_sidx_valid(flow_hashtab[b]) &&
+		    !flow_sidx_eq(flow_hashtab[b], sidx) &&
+		    flow_hash_dist(b) >= d; d++)
+		b = mod_sub(b, 1, flow_hash_size);
 
 	return b;
 }
@@ -734,12 +1007,14 @@ static inline unsigned flow_hash_probe_(uint64_t hash, flow_sidx_t sidx)
  * @c:		Execution context
  * @sidx:	Flow and side to find bucket for
  *
- * Return: if @sidx is in the hash table, its current bucket, otherwise a
- *         suitable free bucket for it.
+ * Return: if @sidx is in the hash table, its current bucket, otherwise the
+ *         bucket where it should be inserted, which might be in use
  */
 static inline unsigned flow_hash_probe(const struct ctx *c, flow_sidx_t sidx)
 {
-	return flow_hash_probe_(flow_sidx_hash(c, sidx), sidx);
+	struct flow_hash_meta m = flow_hash_meta(flow_sidx_hash(c, sidx));
+
+	return flow_hash_probe_(&m, sidx);
 }
 
 /**
@@ -752,9 +1027,28 @@ static inline unsigned flow_hash_probe(const struct ctx *c, flow_sidx_t sidx)
 uint64_t flow_hash_insert(const struct ctx *c, flow_sidx_t sidx)
 {
 	uint64_t hash = flow_sidx_hash(c, sidx);
-	unsigned b = flow_hash_probe_(hash, sidx);
+	struct flow_hash_meta m = flow_hash_meta(hash);
+	unsigned b = flow_hash_probe_(&m, sidx), s;
+
+	if (!flow_sidx_eq(flow_hashtab[b], sidx)) {
+		/* Displace the rest of the cluster by one bucket, keeping
+		 * entries sorted by home bucket: the load factor guarantees
+		 * that there's a free bucket somewhere
+		 */
+		for (s = b; flow_sidx_valid(flow_hashtab[s]);
+		     s = mod_sub(s, 1, flow_hash_size))
+			;
+
+		for (; s != b; s = (s + 1) % flow_hash_size) {
+			unsigned from = (s + 1) % flow_hash_size;
+
+			flow_hashtab[s] = flow_hashtab[from];
+			flow_hashmeta[s] = flow_hashmeta[from];
+		}
+	}
 
 	flow_hashtab[b] = sidx;
+	flow_hashmeta[b] = m;
 	flow_dbg(flow_at_sidx(sidx), "Side %u hash table insert: bucket: %u",
 		 sidx.sidei, b);
 
@@ -770,24 +1064,21 @@ void flow_hash_remove(const struct ctx *c, flow_sidx_t sidx)
 {
 	unsigned b = flow_hash_probe(c, sidx), s;
 
-	if (!flow_sidx_valid(flow_hashtab[b]))
+	if (!flow_sidx_eq(flow_hashtab[b], sidx))
 		return; /* Redundant remove */
 
 	flow_dbg(flow_at_sidx(sidx), "Side %u hash table remove: bucket: %u",
 		 sidx.sidei, b);
 
-	/* Scan the remainder of the cluster */
-	for (s = mod_sub(b, 1, FLOW_HASH_SIZE);
-	     flow_sidx_valid(flow_hashtab[s]);
-	     s = mod_sub(s, 1, FLOW_HASH_SIZE)) {
-		unsigned h = flow_sidx_hash(c, flow_hashtab[s]) % FLOW_HASH_SIZE;
-
-		if (!mod_between(h, s, b, FLOW_HASH_SIZE)) {
-			/* flow_hashtab[s] can live in flow_hashtab[b]'s slot */
-			debug("hash table remove: shuffle %u -> %u", s, b);
-			flow_hashtab[b] = flow_hashtab[s];
-			b = s;
-		}
+	/* Backward shift: pull the remainder of the cluster up by one bucket,
+	 * until we find an entry that's already in its home bucket
+	 */
+	for (s = mod_sub(b, 1, flow_hash_size);
+	     flow_sidx_valid(flow_hashtab[s]) && flow_hashmeta[s].home != s;
+	     s = mod_sub(s, 1, flow_hash_size)) {
+		flow_hashtab[b] = flow_hashtab[s];
+		flow_hashmeta[b] = flow_hashmeta[s];
+		b = s;
 	}
 
 	flow_hashtab[b] = FLOW_SIDX_NONE;
@@ -802,21 +1093,28 @@ void flow_hash_remove(const struct ctx *c, flow_sidx_t sidx)
  *
  * Return: sidx of the matching flow & side, FLOW_SIDX_NONE if not found
  */
-static flow_sidx_t flowside_lookup(const struct ctx *c, uint8_t proto,
-				   uint8_t pif, const struct flowside *side)
+flow_sidx_t flowside_lookup(const struct ctx *c, uint8_t proto,
+			    uint8_t pif, const struct flowside *side)
 {
-	flow_sidx_t sidx;
-	union flow *flow;
-	unsigned b;
+	struct flow_hash_meta m = flow_hash_meta(flow_hash(c, proto, pif, side));
+	unsigned b = m.home, d;
+
+	for (d = 0; flow_sidx_valid(flow_hashtab[b]) && flow_hash_dist(b) >= d;
+	     d++, b = mod_sub(b, 1, flow_hash_size)) {
+		flow_sidx_t sidx = flow_hashtab[b];
+		const union flow *flow;
 
-	b = flow_hash(c, proto, pif, side) % FLOW_HASH_SIZE;
-	while ((sidx = flow_hashtab[b], flow = flow_at_sidx(sidx)) &&
-	       !(FLOW_PROTO(&flow->f) == proto &&
-		 flow->f.pif[sidx.sidei] == pif &&
-		 flowside_eq(&flow->f.side[sidx.sidei], side)))
-		b = mod_sub(b, 1, FLOW_HASH_SIZE);
+		if (flow_hashmeta[b].tag != m.tag)
+			continue;
 
-	return flow_hashtab[b];
+		flow = flow_at_sidx(sidx);
+		if (FLOW_PROTO(&flow->f) == proto &&
+		    flow->f.pif[sidx.sidei] == pif &&
+		    flowside_eq(&flow->f.side[sidx.sidei], side))
+			return sidx;
+	}
+
+	return FLOW_SIDX_NONE;
 }
 
 /**
@@ -880,6 +1178,60 @@ flow_sidx_t flow_lookup_sa(const struct ctx *c, uint8_t proto, uint8_t pif,
 	return flowside_lookup(c, proto, pif, &side);
 }
 
+/**
+ * flow_free_marked() - Free flows marked in flow_to_free, update free clusters
+ */
+static void flow_free_marked(void)
+{
+	unsigned *last_next = &flow_first_free, cur = flow_first_free, idx;
+	struct flow_free_cluster *prev = NULL;
+
+	for (idx = bitmap_next(flow_to_free, flow_max, 0); idx < flow_max;
+	     idx = bitmap_next(flow_to_free, flow_max, idx + 1)) {
+		union flow *flow = FLOW(idx);
+
+		bitmap_clear(flow_to_free, idx);
+		flow_bits_clear(idx);
+
+		/* Find the last free cluster before this entry */
+		while (cur < idx) {
+			prev = &FLOW(cur)->free;
+			last_next = &prev->next;
+			cur = prev->next;
+		}
+
+		assert(flow->f.state == FLOW_STATE_ACTIVE);
+		PROBE(flow_free, idx, flow->f.type);
+		passt_stats.flows[flow->f.type]--;
+		flow_set_state(&flow->f, FLOW_STATE_FREE);
+		memset(flow, 0, sizeof(*flow));
+		flow_count--;
+		passt_stats.mem[STATS_MEM_FLOW] -= sizeof(union flow);
+
+		if (prev && FLOW_IDX(prev) + prev->n == idx) {
+			/* Add slot to preceding free cluster */
+			prev->n++;
+		} else {
+			/* Create new free cluster, add to chain */
+			flow->free.n = 1;
+			flow->free.next = cur;
+			*last_next = idx;
+			prev = &flow->free;
+			last_next = &prev->next;
+		}
+
+		/* Merge following free cluster, if adjacent */
+		if (cur < flow_max && FLOW_IDX(prev) + prev->n == cur) {
+			struct flow_free_cluster *next = &FLOW(cur)->free;
+
+			prev->n += next->n;
+			prev->next = next->next;
+			next->n = next->next = 0;
+			cur = prev->next;
+		}
+	}
+}
+
 /**
  * flow_defer_handler() - Handler for per-flow deferred and timed tasks
  * @c:		Execution context
@@ -887,25 +1239,44 @@ flow_sidx_t flow_lookup_sa(const struct ctx *c, uint8_t proto, uint8_t pif,
  */
 void flow_defer_handler(const struct ctx *c, const struct timespec *now)
 {
-	struct flow_free_cluster *free_head = NULL;
-	unsigned *last_next = &flow_first_free;
-	bool to_free[FLOW_MAX] = { 0 };
-	bool timer = false;
-	union flow *flow;
+	bool timer = false, closing = false;
+	unsigned idx;
 
 	if (timespec_diff_ms(now, &flow_timer_run) >= FLOW_TIMER_INTERVAL) {
 		timer = true;
 		flow_timer_run = *now;
+
+		frag_timer(now);
 	}
 
+	/* Table full: reclaim flows idle from before this second right away,
+	 * instead of refusing new ones until timers would run
+	 */
+	if (flow_full)
+		timer = true;
+
 	assert(!flow_new_entry); /* Incomplete flow at end of cycle */
 
+	if (!c->no_udp)
+		udp_flow_refill(c, timer);
+
 	/* Check which flows we might need to close first, but don't free them
-	 * yet as it's not safe to do that in the middle of flow_foreach().
+	 * yet, as handlers might still refer to other flows.
 	 */
-	flow_foreach(flow) {
+	for (idx = flow_deferred_count ? bitmap_next(flow_deferred, flow_max, 0)
+				       : flow_max;
+	     idx < flow_max; idx = bitmap_next(flow_deferred, flow_max, idx + 1)) {
+		union flow *flow = FLOW(idx);
 		bool closed = false;
 
+		bitmap_clear(flow_deferred, idx);
+		flow_deferred_count--;
+
+		if (flow->f.state != FLOW_STATE_ACTIVE) {
+			flow_err(flow, "Bad flow state for deferred handling");
+			continue;
+		}
+
 		switch (flow->f.type) {
 		case FLOW_TYPE_NONE:
 			assert(false);
@@ -915,89 +1286,56 @@ void flow_defer_handler(const struct ctx *c, const struct timespec *now)
 			break;
 		case FLOW_TCP_SPLICE:
 			closed = tcp_splice_flow_defer(&flow->tcp_splice);
-			if (!closed && timer)
-				tcp_splice_timer(&flow->tcp_splice);
-			break;
-		case FLOW_PING4:
-		case FLOW_PING6:
-			if (timer)
-				closed = icmp_ping_timer(c, &flow->ping, now);
 			break;
 		case FLOW_UDP:
 			closed = udp_flow_defer(c, &flow->udp, now);
-			if (!closed && timer)
-				closed = udp_flow_timer(c, &flow->udp, now);
 			break;
 		default:
 			/* Assume other flow types don't need any handling */
 			;
 		}
 
-		to_free[FLOW_IDX(flow)] = closed;
+		if (closed) {
+			bitmap_set(flow_to_free, idx);
+			closing = true;
+		}
 	}
 
-	/* Second step: actually free the flows */
-	flow_foreach_slot(flow) {
-		switch (flow->f.state) {
-		case FLOW_STATE_FREE: {
-			unsigned skip = flow->free.n;
-
-			/* First entry of a free cluster must have n >= 1 */
-			assert(skip);
-
-			if (free_head) {
-				/* Merge into preceding free cluster */
-				free_head->n += flow->free.n;
-				flow->free.n = flow->free.next = 0;
-			} else {
-				/* New free cluster, add to chain */
-				free_head = &flow->free;
-				*last_next = FLOW_IDX(flow);
-				last_next = &free_head->next;
-			}
-
-			/* Skip remaining empty entries */
-			flow += skip - 1;
+	for (idx = timer ? bitmap_next(flow_timed, flow_max, 0) : flow_max;
+	     idx < flow_max; idx = bitmap_next(flow_timed, flow_max, idx + 1)) {
+		union flow *flow = FLOW(idx);
+		bool closed = false;
+
+		if (bitmap_isset(flow_to_free, idx))
 			continue;
-		}
 
-		case FLOW_STATE_NEW:
-		case FLOW_STATE_INI:
-		case FLOW_STATE_TGT:
-		case FLOW_STATE_TYPED:
-			/* Incomplete flow at end of cycle */
-			assert(false);
+		switch (flow->f.type) {
+		case FLOW_TCP_SPLICE:
+			tcp_splice_timer(&flow->tcp_splice);
 			break;
-
-		case FLOW_STATE_ACTIVE:
-			if (to_free[FLOW_IDX(flow)]) {
-				flow_set_state(&flow->f, FLOW_STATE_FREE);
-				memset(flow, 0, sizeof(*flow));
-
-				if (free_head) {
-					/* Add slot to current free cluster */
-					assert(FLOW_IDX(flow) ==
-					    FLOW_IDX(free_head) + free_head->n);
-					free_head->n++;
-					flow->free.n = flow->free.next = 0;
-				} else {
-					/* Create new free cluster */
-					free_head = &flow->free;
-					free_head->n = 1;
-					*last_next = FLOW_IDX(flow);
-					last_next = &free_head->next;
-				}
-			} else {
-				free_head = NULL;
-			}
+		case FLOW_PING4:
+		case FLOW_PING6:
+			closed = icmp_ping_timer(c, &flow->ping, now);
+			break;
+		case FLOW_UDP:
+			closed = udp_flow_timer(c, &flow->udp, now);
 			break;
-
 		default:
 			assert(false);
 		}
+
+		if (closed) {
+			bitmap_set(flow_to_free, idx);
+			closing = true;
+		}
 	}
 
-	*last_next = FLOW_MAX;
+	if (timer)
+		flow_full = false;
+
+	/* Second step: actually free the flows */
+	if (closing)
+		flow_free_marked();
 }
 
 /**
@@ -1084,6 +1422,26 @@ static int flow_migrate_repair_all(struct ctx *c, bool enable)
 	return 0;
 }
 
+/**
+ * flow_migrate_source_early() - Get ready for migration while guest is running
+ * @c:		Execution context
+ * @stage:	Migration stage information (unused)
+ *
+ * Connect to the TCP_REPAIR helper now, if it's already waiting, so that we
+ * don't spend time doing that once the guest is stopped.
+ *
+ * Return: 0 on success, positive error code on failure
+ */
+int flow_migrate_source_early(struct ctx *c, const struct migrate_stage *stage)
+{
+	(void)stage;
+
+	if (!flow_migrate_need_repair())
+		return 0;
+
+	return repair_wait(c);
+}
+
 /**
  * flow_migrate_source_pre() - Prepare flows for migration: enable repair mode
  * @c:		Execution context
@@ -1143,6 +1501,9 @@ int flow_migrate_source(struct ctx *c, const struct migrate_stage *stage,
 		return flow_migrate_source_rollback(c, FLOW_MAX, rc);
 	}
 
+	passt_stats.migrate.flows = count;
+	passt_stats.migrate.bytes += sizeof(count);
+
 	/* HACK: A local to local migrate will fail if the origin passt has the
 	 * listening sockets still open when the destination passt tries to bind
 	 * them.  This does mean there's a window where we lost our listen()s,
@@ -1226,6 +1587,9 @@ int flow_migrate_target(struct ctx *c, const struct migrate_stage *stage,
 	if (read_u32(fd, &count))
 		return errno;
 
+	passt_stats.migrate.flows = count;
+	passt_stats.migrate.bytes += sizeof(count);
+
 	debug("Receiving %u flows", count);
 
 	if (!count)
@@ -1260,20 +1624,46 @@ int flow_migrate_target(struct ctx *c, const struct migrate_stage *stage,
 		}
 	}
 
+	/* Clear repair mode for all the flows with a single round-trip to the
+	 * helper (in most cases), then let them resume
+	 */
+	repair_flush(c);
+
+	for (i = 0; i < count; i++)
+		tcp_flow_migrate_target_post(c, &flowtab[i].tcp, now);
+
 	return 0;
 }
 
 /**
  * flow_init() - Initialise flow related data structures
+ * @c:		Execution context
  */
-void flow_init(void)
+void flow_init(const struct ctx *c)
 {
+	size_t map_size;
 	unsigned b;
 
+	assert(c->max_flows >= 2 && c->max_flows <= FLOW_MAX);
+
+	flow_max = c->max_flows;
+	flow_hash_size = FLOW_HASH_SIZE(flow_max);
+	map_size = DIV_ROUND_UP(flow_max, 8 * sizeof(long)) * sizeof(long);
+
+	flowtab = mmap_lazy(flow_max * sizeof(*flowtab));
+	flow_hashtab = mmap_lazy(flow_hash_size * sizeof(*flow_hashtab));
+	flow_hashmeta = mmap_lazy(flow_hash_size * sizeof(*flow_hashmeta));
+	flow_to_free = mmap_lazy(map_size);
+	flow_deferred = mmap_lazy(map_size);
+	flow_timed = mmap_lazy(map_size);
+	if (!flowtab || !flow_hashtab || !flow_hashmeta ||
+	    !flow_to_free || !flow_deferred || !flow_timed)
+		die_perror("Can't allocate flow table for %u flows", flow_max);
+
 	/* Initial state is a single free cluster containing the whole table */
-	flowtab[0].free.n = FLOW_MAX;
-	flowtab[0].free.next = FLOW_MAX;
+	flowtab[0].free.n = flow_max;
+	flowtab[0].free.next = flow_max;
 
-	for (b = 0; b < FLOW_HASH_SIZE; b++)
+	for (b = 0; b < flow_hash_size; b++)
 		flow_hashtab[b] = FLOW_SIDX_NONE;
 }
@@ -161,17 +161,21 @@ struct flowside {
  * flowside_eq() - Check if two flowsides are equal
  * @left, @right:	Flowsides to compare
  *
+ * Ports are compared first: they're more likely to differ than addresses
+ * on hash collisions, and cheaper to compare.
+ *
  * Return: true if equal, false otherwise
  */
 static inline bool flowside_eq(const struct flowside *left,
 			       const struct flowside *right)
 {
-	return inany_equals(&left->eaddr, &right->eaddr) &&
-	       left->eport == right->eport &&
-	       inany_equals(&left->oaddr, &right->oaddr) &&
-	       left->oport == right->oport;
+	return left->eport == right->eport && left->oport == right->oport &&
+	       inany_equals(&left->eaddr, &right->eaddr) &&
+	       inany_equals(&left->oaddr, &right->oaddr);
 }
 
+const char *flowside_ifname(const struct ctx *c, uint8_t pif,
+			    const struct flowside *side);
 int flowside_sock_l4(const struct ctx *c, enum epoll_type type, uint8_t pif,
 		     const struct flowside *side);
 int flowside_connect(const struct ctx *c, int s,
@@ -208,12 +212,17 @@ struct flow_common {
 };
 
 #define EPOLLFD_ID_DEFAULT	0
+#define EPOLLFD_ID_PRIO		1
 #define EPOLLFD_ID_SIZE		(1 << EPOLLFD_ID_BITS)
 
-#define FLOW_INDEX_BITS		17	/* 128k - 1 */
+#define FLOW_INDEX_BITS		24	/* 16M - 1 */
 #define FLOW_MAX		MAX_FROM_BITS(FLOW_INDEX_BITS)
 
-#define FLOW_TABLE_PRESSURE		30	/* % of FLOW_MAX */
+/* Default flow table size, see --max-flows */
+#define FLOW_MAX_DEFAULT	MAX_FROM_BITS(17)	/* 128k - 1 */
+
+#define FLOW_TABLE_PRESSURE		30	/* % of flow_max */
+#define FLOW_ADMIT_BUCKETS		256	/* See --flow-rate */
 #define FLOW_FILE_PRESSURE		30	/* % of c->nofile */
 
 /**
@@ -254,6 +263,8 @@ static inline bool flow_sidx_eq(flow_sidx_t a, flow_sidx_t b)
 
 uint64_t flow_hash_insert(const struct ctx *c, flow_sidx_t sidx);
 void flow_hash_remove(const struct ctx *c, flow_sidx_t sidx);
+flow_sidx_t flowside_lookup(const struct ctx *c, uint8_t proto,
+			    uint8_t pif, const struct flowside *side);
 flow_sidx_t flow_lookup_af(const struct ctx *c,
 			   uint8_t proto, uint8_t pif, sa_family_t af,
 			   const void *eaddr, const void *oaddr,
@@ -264,15 +275,19 @@ flow_sidx_t flow_lookup_sa(const struct ctx *c, uint8_t proto, uint8_t pif,
 
 union flow;
 
-void flow_init(void);
+void flow_init(const struct ctx *c);
 int flow_epollfd(const struct flow_common *f);
 void flow_epollid_set(struct flow_common *f, int epollid);
+void flow_epollid_assign(const struct ctx *c, struct flow_common *f);
 int flow_epoll_set(const struct flow_common *f, int command, uint32_t events,
 		   int fd, unsigned int sidei);
 void flow_epollid_register(int epollid, int epollfd);
+unsigned flow_pressure(void);
+bool flow_admit(const struct ctx *c, sa_family_t af, const void *saddr,
+		const struct timespec *now);
+int flow_timeout(int timeout);
 void flow_defer_handler(const struct ctx *c, const struct timespec *now);
-int flow_migrate_source_early(struct ctx *c, const struct migrate_stage *stage,
-			      int fd);
+int flow_migrate_source_early(struct ctx *c, const struct migrate_stage *stage);
 int flow_migrate_source_pre(struct ctx *c, const struct migrate_stage *stage,
 			    int fd, const struct timespec *now);
 int flow_migrate_source(struct ctx *c, const struct migrate_stage *stage,
@@ -12,6 +12,8 @@
 #include "icmp_flow.h"
 #include "udp_flow.h"
 
+struct fwd_tune;
+
 /**
  * struct flow_free_cluster - Information about a cluster of free entries
  * @f:		Generic flow information
@@ -40,9 +42,14 @@ union flow {
 	struct udp_flow udp;
 };
 
+/* Keep entries aligned to cache lines, see struct tcp_tap_conn */
+static_assert(!(sizeof(union flow) % CACHE_LINE_SIZE),
+	      "Flow table entries must be a multiple of cache line size");
+
 /* Global Flow Table */
 extern unsigned flow_first_free;
-extern union flow flowtab[];
+extern unsigned flow_max;
+extern union flow *flowtab;
 
 /**
  * flow_foreach_sidei() - 'for' type macro to step through each side of flow
@@ -59,7 +66,7 @@ extern union flow flowtab[];
  * Includes FREE slots.
  */
 #define flow_foreach_slot(flow)						\
-	for ((flow) = flowtab; FLOW_IDX(flow) < FLOW_MAX; (flow)++)
+	for ((flow) = flowtab; FLOW_IDX(flow) < flow_max; (flow)++)
 
 /**
  * flow_foreach() - Step through each active flow
@@ -214,6 +221,7 @@ const struct flowside *flow_target_af(union flow *flow, uint8_t pif,
 struct flowside *flow_target(const struct ctx *c, union flow *flow,
 			     int rule_hint, uint8_t proto);
 
+const struct fwd_tune *flow_tune(const struct flow_common *f);
 union flow *flow_set_type(union flow *flow, enum flow_type type);
 #define FLOW_SET_TYPE(flow_, t_, var_)	(&flow_set_type((flow_), (t_))->var_)
 
@@ -221,4 +229,6 @@ void flow_activate(struct flow_common *f);
 #define FLOW_ACTIVATE(flow_)			\
 	(flow_activate(&(flow_)->f))
 
+void flow_defer(const struct flow_common *f);
+
 #endif /* FLOW_TABLE_H */
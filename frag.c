@@ -0,0 +1,321 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+
+/* PASST - Plug A Simple Socket Transport
+ *  for qemu/UNIX domain socket mode
+ *
+ * PASTA - Pack A Subtle Tap Abstraction
+ *  for network namespace/tap device mode
+ *
+ * frag.c - Reassembly of IPv4 and IPv6 fragments from the guest
+ *
+ * Copyright Red Hat
+ *
+ * Guests might send UDP datagrams (or ICMP echo requests) larger than the MTU,
+ * as fragments. We can't forward fragments as such, because we terminate L4
+ * on our side: collect them here, in a small and fixed number of buffers, and
+ * pass complete datagrams to protocol handlers once the tap handler is done
+ * with the current batch of frames.
+ *
+ * Overlapping fragments invalidate the whole datagram (RFC 5722 mandates this
+ * for IPv6, and it's a sensible choice for IPv4 too), and incomplete datagrams
+ * are discarded after FRAG_TIMEOUT.
+ */
+
+#include <limits.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <netinet/in.h>
+
+#include "util.h"
+#include "bitmap.h"
+#include "iov.h"
+#include "ip.h"
+#include "inany.h"
+#include "packet.h"
+#include "passt.h"
+#include "log.h"
+#include "stats.h"
+#include "tcp.h"
+#include "udp.h"
+#include "icmp.h"
+#include "frag.h"
+
+#define FRAG_ENTRIES		4	/* Datagrams reassembled at a time */
+#define FRAG_MAX_LEN		USHRT_MAX	/* Bytes of reassembled payload */
+#define FRAG_UNIT		8	/* Granularity of fragment offsets */
+#define FRAG_UNITS		DIV_ROUND_UP(FRAG_MAX_LEN, FRAG_UNIT)
+
+/**
+ * struct frag_entry - Datagram being reassembled
+ * @used:	Entry is in use
+ * @complete:	All fragments were received, datagram is ready for delivery
+ * @af:		Address family, AF_INET or AF_INET6
+ * @proto:	L4 protocol number
+ * @ttl:	TTL or hop limit of first fragment
+ * @id:		Identification field of IPv4 header, or of IPv6 fragment header
+ * @saddr:	Source address
+ * @daddr:	Destination address
+ * @len:	Length of reassembled payload, 0 until we see the last fragment
+ * @end:	Highest payload offset we received data for
+ * @received:	Bytes of payload received so far
+ * @start:	Timestamp of first fragment we received
+ * @map:	Bitmap of FRAG_UNIT blocks of payload received so far
+ * @buf:	Reassembled payload, starting from the L4 header
+ */
+struct frag_entry {
+	bool used;
+	bool complete;
+	sa_family_t af;
+	uint8_t proto;
+	uint8_t ttl;
+	uint32_t id;
+	union inany_addr saddr;
+	union inany_addr daddr;
+	size_t len;
+	size_t end;
+	size_t received;
+	struct timespec start;
+	uint8_t map[DIV_ROUND_UP(FRAG_UNITS, 8)];
+	uint8_t buf[FRAG_MAX_LEN];
+};
+
+static struct frag_entry frag_table[FRAG_ENTRIES];
+
+PACKET_POOL_DECL(pool_frag, 1);
+
+/**
+ * frag_free() - Release a reassembly entry
+ * @f:		Entry to release
+ */
+static void frag_free(struct frag_entry *f)
+{
+	f->used = f->complete = false;
+}
+
+/**
+ * frag_drop() - Account for and report a dropped fragment
+ * @af:		Address family
+ * @reason:	Reason for dropping it
+ * @now:	Current timestamp
+ */
+static void frag_drop(sa_family_t af, const char *reason,
+		      const struct timespec *now)
+{
+	static unsigned num_dropped;
+
+	num_dropped++;
+	warn_ratelimit(now, "Dropped IPv%i fragment: %s (%u dropped)",
+		       af == AF_INET ? 4 : 6, reason, num_dropped);
+}
+
+/**
+ * frag_get() - Find or allocate entry for the datagram a fragment belongs to
+ * @af:		Address family
+ * @saddr:	Source address
+ * @daddr:	Destination address
+ * @proto:	L4 protocol number
+ * @id:		Identification field
+ * @now:	Current timestamp
+ *
+ * Return: matching or new entry, NULL if all entries are complete datagrams
+ */
+static struct frag_entry *frag_get(sa_family_t af,
+				   const union inany_addr *saddr,
+				   const union inany_addr *daddr, uint8_t proto,
+				   uint32_t id, const struct timespec *now)
+{
+	struct frag_entry *f, *free = NULL, *oldest = NULL, *new;
+
+	for (f = frag_table; f < frag_table + FRAG_ENTRIES; f++) {
+		if (!f->used) {
+			free = free ? free : f;
+			continue;
+		}
+
+		if (f->af == af && f->proto == proto && f->id == id &&
+		    inany_equals(&f->saddr, saddr) &&
+		    inany_equals(&f->daddr, daddr))
+			return f;
+
+		if (!f->complete &&
+		    (!oldest || timespec_diff_ms(&f->start, &oldest->start) < 0))
+			oldest = f;
+	}
+
+	/* Recycle the oldest incomplete entry, if there's no free one */
+	if (!(new = free ? free : oldest))
+		return NULL;
+
+	if (new->used) {
+		frag_drop(new->af, "reassembly buffers exhausted", now);
+		frag_free(new);
+	}
+
+	memset(new->map, 0, sizeof(new->map));
+	new->used = true;
+	new->af = af;
+	new->proto = proto;
+	new->ttl = 0;
+	new->id = id;
+	new->saddr = *saddr;
+	new->daddr = *daddr;
+	new->len = new->end = new->received = 0;
+	new->start = *now;
+
+	return new;
+}
+
+/**
+ * frag_add() - Add fragment to datagram being reassembled
+ * @af:		Address family, AF_INET or AF_INET6
+ * @saddr:	Source address, struct in_addr or struct in6_addr
+ * @daddr:	Destination address, struct in_addr or struct in6_addr
+ * @proto:	L4 protocol number
+ * @id:		Identification field of IPv4 header, or of IPv6 fragment header
+ * @offset:	Fragment offset, in bytes
+ * @more:	More fragments follow (MF flag, or M flag for IPv6)
+ * @ttl:	TTL or hop limit
+ * @data:	Fragment payload
+ * @now:	Current timestamp
+ */
+void frag_add(sa_family_t af, const void *saddr, const void *daddr,
+	      uint8_t proto, uint32_t id, size_t offset, bool more,
+	      uint8_t ttl, struct iov_tail *data, const struct timespec *now)
+{
+	size_t len = iov_tail_size(data), end = offset + len, i;
+	union inany_addr s, d;
+	struct frag_entry *f;
+
+	if (proto != IPPROTO_TCP && proto != IPPROTO_UDP &&
+	    proto != IPPROTO_ICMP && proto != IPPROTO_ICMPV6) {
+		frag_drop(af, "unsupported protocol", now);
+		return;
+	}
+
+	if (!len || end > FRAG_MAX_LEN || (more && len % FRAG_UNIT)) {
+		frag_drop(af, "invalid length or offset", now);
+		return;
+	}
+
+	inany_from_af(&s, af, saddr);
+	inany_from_af(&d, af, daddr);
+
+	if (!(f = frag_get(af, &s, &d, proto, id, now)) || f->complete) {
+		frag_drop(af, "no reassembly buffer", now);
+		return;
+	}
+
+	if ((!more && ((f->len && f->len != end) || f->end > end)) ||
+	    (f->len && end > f->len))
+		goto bad;
+
+	for (i = offset / FRAG_UNIT; i < DIV_ROUND_UP(end, FRAG_UNIT); i++) {
+		if (bitmap_isset(f->map, i))
+			goto bad;
+		bitmap_set(f->map, i);
+	}
+
+	iov_to_buf(data->iov, data->cnt, data->off, f->buf + offset, len);
+
+	if (!more)
+		f->len = end;
+	if (!offset)
+		f->ttl = ttl;
+	f->end = MAX(f->end, end);
+	f->received += len;
+
+	if (f->received == f->len)
+		f->complete = true;
+
+	return;
+bad:
+	frag_free(f);
+	frag_drop(af, "overlapping or inconsistent fragments", now);
+}
+
+/**
+ * frag_deliver() - Pass reassembled datagrams to protocol handlers
+ * @c:		Execution context
+ * @af:		Address family of datagrams to deliver
+ * @now:	Current timestamp
+ */
+void frag_deliver(const struct ctx *c, sa_family_t af,
+		  const struct timespec *now)
+{
+	struct frag_entry *f;
+
+	for (f = frag_table; f < frag_table + FRAG_ENTRIES; f++) {
+		struct pool_frag_t p = PACKET_INIT(pool_frag, 1, (char *)f->buf,
+						   sizeof(f->buf));
+		struct iovec iov = { .iov_base = f->buf, .iov_len = f->len };
+		struct iov_tail data = IOV_TAIL(&iov, 1, 0);
+		const void *saddr, *daddr;
+
+		if (!f->used || !f->complete || f->af != af)
+			continue;
+
+		if (af == AF_INET) {
+			saddr = inany_v4(&f->saddr);
+			daddr = inany_v4(&f->daddr);
+		} else {
+			saddr = &f->saddr.a6;
+			daddr = &f->daddr.a6;
+		}
+
+		stats_rx(PIF_TAP, stats_proto(f->proto), 1, f->len);
+
+		switch (f->proto) {
+		case IPPROTO_TCP:
+			if (c->no_tcp) {
+				stats_drop(PIF_TAP, PESTO_STATS_TCP, 1);
+				break;
+			}
+			packet_add((struct pool *)&p, &data);
+			tcp_tap_handler(c, PIF_TAP, af, saddr, daddr, 0,
+					(struct pool *)&p, 0, now);
+			break;
+		case IPPROTO_UDP:
+			if (c->no_udp) {
+				stats_drop(PIF_TAP, PESTO_STATS_UDP, 1);
+				break;
+			}
+			packet_add((struct pool *)&p, &data);
+			udp_tap_handler(c, PIF_TAP, af, saddr, daddr, f->ttl,
+					0, (struct pool *)&p, 0, now);
+			break;
+		case IPPROTO_ICMP:
+		case IPPROTO_ICMPV6:
+			if (c->no_icmp) {
+				stats_drop(PIF_TAP, PESTO_STATS_ICMP, 1);
+				break;
+			}
+			icmp_tap_handler(c, PIF_TAP, af, saddr, daddr,
+					 &data, now);
+			break;
+		}
+
+		frag_free(f);
+	}
+}
+
+/**
+ * frag_timer() - Discard datagrams we couldn't reassemble in time
+ * @now:	Current timestamp
+ */
+void frag_timer(const struct timespec *now)
+{
+	struct frag_entry *f;
+
+	for (f = frag_table; f < frag_table + FRAG_ENTRIES; f++) {
+		if (!f->used || f->complete ||
+		    timespec_diff_ms(now, &f->start) < FRAG_TIMEOUT)
+			continue;
+
+		debug("IPv%i reassembly timed out, %zu bytes received",
+		      f->af == AF_INET ? 4 : 6, f->received);
+		frag_free(f);
+	}
+}
@@ -0,0 +1,17 @@
+/* SPDX-License-Identifier: GPL-2.0-or-later
+ * Copyright Red Hat
+ */
+
+#ifndef FRAG_H
+#define FRAG_H
+
+#define FRAG_TIMEOUT		5000	/* ms, to complete reassembly */
+
+void frag_add(sa_family_t af, const void *saddr, const void *daddr,
+	      uint8_t proto, uint32_t id, size_t offset, bool more,
+	      uint8_t ttl, struct iov_tail *data, const struct timespec *now);
+void frag_deliver(const struct ctx *c, sa_family_t af,
+		  const struct timespec *now);
+void frag_timer(const struct timespec *now);
+
+#endif /* FRAG_H */
@@ -20,6 +20,9 @@
 #include <sched.h>
 #include <unistd.h>
 #include <stdio.h>
+#include <netinet/tcp.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
 
 #include "util.h"
 #include "epoll_ctl.h"
@@ -34,7 +37,7 @@
 #include "arp.h"
 #include "ndp.h"
 
-#define NEIGH_TABLE_SLOTS    1024
+#define NEIGH_TABLE_SLOTS    8192
 #define NEIGH_TABLE_SIZE     (NEIGH_TABLE_SLOTS / 2)
 static_assert((NEIGH_TABLE_SLOTS & (NEIGH_TABLE_SLOTS - 1)) == 0,
 	      "NEIGH_TABLE_SLOTS must be a power of two");
@@ -58,11 +61,13 @@ struct neigh_table_entry {
  * @entries:	Entries to be plugged into the hash slots when allocated
  * @slots:	Hash table slots
  * @free:	Linked list of unused entries
+ * @evict:	Index of next entry to consider for eviction, if table is full
  */
 struct neigh_table {
 	struct neigh_table_entry entries[NEIGH_TABLE_SIZE];
 	struct neigh_table_entry *slots[NEIGH_TABLE_SLOTS];
 	struct neigh_table_entry *free;
+	unsigned evict;
 };
 
 static struct neigh_table neigh_table;
@@ -83,20 +88,19 @@ static size_t neigh_table_slot(const struct ctx *c,
 	siphash_feed_inany(&st, key);
 	i = siphash_final(&st, sizeof(*key), 0);
 
-	return ((size_t)i) & (NEIGH_TABLE_SIZE - 1);
+	return ((size_t)i) & (NEIGH_TABLE_SLOTS - 1);
 }
 
 /**
- * fwd_neigh_table_find() - Find a MAC table entry
- * @c:		Execution context
+ * neigh_table_find_slot() - Find a MAC table entry in a given hash slot
+ * @slot:	Hash slot, from neigh_table_slot()
  * @addr:	Neighbour address to be used as key for the lookup
  *
  * Return: the matching entry, if found. Otherwise NULL
  */
-static struct neigh_table_entry *fwd_neigh_table_find(const struct ctx *c,
-						      const union inany_addr *addr)
+static struct neigh_table_entry *neigh_table_find_slot(size_t slot,
+						       const union inany_addr *addr)
 {
-	size_t slot = neigh_table_slot(c, addr);
 	struct neigh_table_entry *e = neigh_table.slots[slot];
 
 	while (e && !inany_equals(&e->addr, addr))
@@ -105,6 +109,53 @@ static struct neigh_table_entry *fwd_neigh_table_find(const struct ctx *c,
 	return e;
 }
 
+/**
+ * fwd_neigh_table_find() - Find a MAC table entry
+ * @c:		Execution context
+ * @addr:	Neighbour address to be used as key for the lookup
+ *
+ * Return: the matching entry, if found. Otherwise NULL
+ */
+static struct neigh_table_entry *fwd_neigh_table_find(const struct ctx *c,
+						      const union inany_addr *addr)
+{
+	return neigh_table_find_slot(neigh_table_slot(c, addr), addr);
+}
+
+/**
+ * neigh_table_evict() - Unlink an entry to make room for a new one
+ * @c:		Execution context
+ *
+ * Return: unlinked entry, NULL if all entries are permanent
+ *
+ * NOTE: Only valid if the free list is empty, so that all entries are in use
+ */
+static struct neigh_table_entry *neigh_table_evict(const struct ctx *c)
+{
+	struct neigh_table *t = &neigh_table;
+	unsigned i;
+
+	/* Go round the entries like a clock hand: roughly, evict the entry
+	 * allocated or recycled the longest time ago
+	 */
+	for (i = 0; i < NEIGH_TABLE_SIZE; i++) {
+		struct neigh_table_entry *e = &t->entries[t->evict], **prev;
+
+		t->evict = (t->evict + 1) % NEIGH_TABLE_SIZE;
+		if (e->permanent)
+			continue;
+
+		prev = &t->slots[neigh_table_slot(c, &e->addr)];
+		while (*prev != e)
+			prev = &(*prev)->next;
+		*prev = e->next;
+
+		return e;
+	}
+
+	return NULL;
+}
+
 /**
  * fwd_neigh_table_update() - Allocate or update neighbour table entry
  * @c:		Execution context
@@ -115,25 +166,25 @@ static struct neigh_table_entry *fwd_neigh_table_find(const struct ctx *c,
 void fwd_neigh_table_update(const struct ctx *c, const union inany_addr *addr,
 			    const uint8_t *mac, bool permanent)
 {
+	size_t slot = neigh_table_slot(c, addr);
 	struct neigh_table *t = &neigh_table;
 	struct neigh_table_entry *e;
-	ssize_t slot;
 
 	/* MAC address might change sometimes */
-	e = fwd_neigh_table_find(c, addr);
+	e = neigh_table_find_slot(slot, addr);
 	if (e) {
 		if (!e->permanent)
 			memcpy(e->mac, mac, ETH_ALEN);
 		return;
 	}
 
-	e = t->free;
-	if (!e) {
+	if ((e = t->free)) {
+		t->free = e->next;
+	} else if (!(e = neigh_table_evict(c))) {
 		debug("Failed to allocate neighbour table entry");
 		return;
 	}
-	t->free = e->next;
-	slot = neigh_table_slot(c, addr);
+
 	e->next = t->slots[slot];
 	t->slots[slot] = e;
 
@@ -157,7 +208,7 @@ void fwd_neigh_table_update(const struct ctx *c, const union inany_addr *addr,
  */
 void fwd_neigh_table_free(const struct ctx *c, const union inany_addr *addr)
 {
-	ssize_t slot = neigh_table_slot(c, addr);
+	size_t slot = neigh_table_slot(c, addr);
 	struct neigh_table *t = &neigh_table;
 	struct neigh_table_entry *e, **prev;
 
@@ -250,6 +301,63 @@ static struct fwd_table fwd_out;
 static struct fwd_table fwd_in_pending;
 static struct fwd_table fwd_out_pending;
 
+/* Protocols we can have forwarding rules for, and lookup structure indices */
+#define FWD_LOOKUP_TCP		0
+#define FWD_LOOKUP_UDP		1
+#define FWD_LOOKUP_PROTOS	2
+
+/* Rule boundaries split the port space into at most 2n + 1 segments for each
+ * protocol. Leave as many again for fwd_lookup_patch(), which doesn't merge
+ * all segments with the same rules, before we need to compile from scratch.
+ */
+#define FWD_LOOKUP_SEGS(n)	(2 * (2 * (n) + FWD_LOOKUP_PROTOS))
+
+/* Rule bitmaps are sized in words, with room for at least this many rules */
+#define FWD_LOOKUP_RULES_MIN	(8 * sizeof(long))
+#define FWD_LOOKUP_RULES_MAX	ROUND_UP(MAX_FWD_RULES, FWD_LOOKUP_RULES_MIN)
+
+static_assert(FWD_LOOKUP_SEGS(FWD_LOOKUP_RULES_MAX) <= UINT16_MAX,
+	      "Lookup segments don't fit port to segment map");
+
+/**
+ * struct fwd_lookup - Port-indexed lookup structure for a forwarding table
+ * @fwd:	Forwarding table this was compiled from, NULL if none
+ * @seg:	Segment for each port, by protocol: ports in the same segment
+ *		are covered by the same set of rules
+ * @nsegs:	Number of segments we have storage for
+ * @nrules:	Number of rule indices segment bitmaps have room for
+ * @map_size:	Size of bitmap of candidate rules for each segment, bytes
+ * @size:	Size of mapped storage for @rules and @ports, bytes
+ * @rules:	Bitmaps of candidate rules, @map_size bytes for each segment
+ * @ports:	Number of ports in each segment, zero if segment is unused
+ */
+struct fwd_lookup {
+	const struct fwd_table *fwd;
+	uint16_t seg[FWD_LOOKUP_PROTOS][NUM_PORTS];
+	unsigned nsegs;
+	unsigned nrules;
+	size_t map_size;
+	size_t size;
+	uint8_t *rules;
+	uint32_t *ports;
+};
+
+static struct fwd_lookup fwd_lookups[PIF_NUM_TYPES];
+
+/**
+ * struct fwd_lookup_edge - Port where a rule starts or stops applying
+ * @port:	First port covered by the rule, or first port after its range
+ * @idx:	Index of the rule in its table
+ * @start:	Rule starts applying at @port, otherwise it stops
+ */
+struct fwd_lookup_edge {
+	uint32_t port;
+	uint16_t idx;
+	bool start;
+};
+
+static struct fwd_lookup_edge fwd_lookup_edges[2 * MAX_FWD_RULES];
+
 /**
  * fwd_rule_init() - Initialise forwarding tables
  * @c:		Execution context
@@ -299,6 +407,327 @@ static bool fwd_rule_match(const struct fwd_rule *rule,
 	       ini->oport >= rule->first && ini->oport <= rule->last;
 }
 
+/**
+ * fwd_lookup_map() - Get bitmap of candidate rules for a lookup segment
+ * @l:		Lookup structure
+ * @seg:	Segment index
+ *
+ * Return: pointer to bitmap, @l->map_size bytes
+ */
+static uint8_t *fwd_lookup_map(const struct fwd_lookup *l, unsigned seg)
+{
+	return l->rules + (size_t)seg * l->map_size;
+}
+
+/**
+ * fwd_lookup_alloc() - Make sure lookup storage fits a given number of rules
+ * @l:		Lookup structure
+ * @count:	Number of rules in table
+ *
+ * Storage is sized to the table, with room for as many rules again to be added
+ * by fwd_lookup_patch(), and grown as needed, but never shrunk.
+ *
+ * Return: 0 on success, -1 on failure
+ *
+ * #syscalls mmap|mmap2 munmap
+ */
+static int fwd_lookup_alloc(struct fwd_lookup *l, unsigned count)
+{
+	unsigned nrules, nsegs;
+	size_t map_size, size;
+	uint8_t *p;
+
+	if (count <= l->nrules && FWD_LOOKUP_SEGS(count) <= l->nsegs)
+		return 0;
+
+	nrules = ROUND_UP(MAX(count * 2, FWD_LOOKUP_RULES_MIN),
+			  FWD_LOOKUP_RULES_MIN);
+	nrules = MIN(nrules, FWD_LOOKUP_RULES_MAX);
+	nsegs = FWD_LOOKUP_SEGS(nrules);
+	map_size = nrules / 8;
+	size = nsegs * (map_size + sizeof(*l->ports));
+
+	p = mmap(NULL, size, PROT_READ | PROT_WRITE,
+		 MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (p == MAP_FAILED) {
+		warn_perror("Can't allocate lookup for %u forwarding rules",
+			    count);
+		return -1;
+	}
+
+	if (l->rules)
+		munmap(l->rules, l->size);
+
+	l->rules = p;
+	l->ports = (uint32_t *)(p + nsegs * map_size);
+	l->nsegs = nsegs;
+	l->nrules = nrules;
+	l->map_size = map_size;
+	l->size = size;
+
+	debug("Forwarding lookup for up to %u rules: %u segments, %zu bytes",
+	      nrules, nsegs, size);
+
+	return 0;
+}
+
+/**
+ * fwd_lookup_sift() - Sift edge down in max-heap ordered by port
+ * @e:		Edges
+ * @i:		Index of edge to sift down
+ * @n:		Number of edges in heap
+ */
+static void fwd_lookup_sift(struct fwd_lookup_edge *e, unsigned i, unsigned n)
+{
+	struct fwd_lookup_edge tmp = e[i];
+	unsigned child;
+
+	for (; (child = 2 * i + 1) < n; i = child) {
+		if (child + 1 < n && e[child + 1].port > e[child].port)
+			child++;
+
+		if (e[child].port <= tmp.port)
+			break;
+
+		e[i] = e[child];
+	}
+
+	e[i] = tmp;
+}
+
+/**
+ * fwd_lookup_sort() - Sort rule edges by port, in place
+ * @e:		Edges
+ * @n:		Number of edges
+ *
+ * Heapsort: qsort() might need to allocate memory for large arrays, which we
+ * can't do once seccomp filters apply.
+ */
+static void fwd_lookup_sort(struct fwd_lookup_edge *e, unsigned n)
+{
+	struct fwd_lookup_edge tmp;
+	unsigned i;
+
+	for (i = n / 2; i-- > 0; )
+		fwd_lookup_sift(e, i, n);
+
+	for (i = n; i-- > 1; ) {
+		tmp = e[0];
+		e[0] = e[i];
+		e[i] = tmp;
+		fwd_lookup_sift(e, 0, i);
+	}
+}
+
+/**
+ * fwd_lookup_build() - Compile forwarding table into port-indexed lookup
+ * @l:		Lookup structure to fill
+ * @fwd:	Forwarding table, might be NULL
+ *
+ * Rule edges are sorted by port, then swept once while keeping the set of
+ * active rules, so that the cost is O(n log n) in the number of rules, plus
+ * the number of segments and ports, instead of segments times rules.
+ *
+ * On allocation failure, the lookup is left unused, and searches fall back to
+ * scanning the table.
+ */
+static void fwd_lookup_build(struct fwd_lookup *l, const struct fwd_table *fwd)
+{
+	struct fwd_lookup_edge *e = fwd_lookup_edges;
+	uint8_t active[FWD_LOOKUP_RULES_MAX / 8];
+	unsigned p, seg = 0;
+
+	l->fwd = NULL;
+	if (!fwd || fwd_lookup_alloc(l, fwd->count))
+		return;
+
+	memset(l->ports, 0, l->nsegs * sizeof(*l->ports));
+
+	for (p = 0; p < FWD_LOOKUP_PROTOS; p++) {
+		uint8_t proto = p == FWD_LOOKUP_TCP ? IPPROTO_TCP : IPPROTO_UDP;
+		unsigned i, n = 0, port = 0;
+
+		for (i = 0; i < fwd->count; i++) {
+			const struct fwd_rule *rule = &fwd->rules[i];
+
+			if (rule->proto != proto)
+				continue;
+
+			e[n++] = (struct fwd_lookup_edge){
+				.port = rule->first, .idx = i, .start = true
+			};
+			e[n++] = (struct fwd_lookup_edge){
+				.port = rule->last + 1, .idx = i
+			};
+		}
+
+		fwd_lookup_sort(e, n);
+
+		/* Rule indices are unique, so order at the same port is moot */
+		memset(active, 0, l->map_size);
+		for (i = 0; port < NUM_PORTS; seg++) {
+			unsigned next;
+
+			for (; i < n && e[i].port == port; i++) {
+				if (e[i].start)
+					bitmap_set(active, e[i].idx);
+				else
+					bitmap_clear(active, e[i].idx);
+			}
+
+			next = i < n ? MIN(e[i].port, NUM_PORTS) : NUM_PORTS;
+
+			assert(seg < l->nsegs);
+			memcpy(fwd_lookup_map(l, seg), active, l->map_size);
+			l->ports[seg] = next - port;
+
+			for (; port < next; port++)
+				l->seg[p][port] = seg;
+		}
+	}
+
+	l->fwd = fwd;
+}
+
+/**
+ * fwd_lookup_seg() - Find or allocate segment for ports moved by a patch
+ * @l:		Lookup structure
+ * @p:		Protocol index, FWD_LOOKUP_TCP or FWD_LOOKUP_UDP
+ * @rule:	Rule being added or removed
+ * @idx:	Index of @rule in table
+ * @add:	Rule is being added, otherwise removed
+ * @from:	Current segment of ports being moved
+ * @port:	First port being moved
+ *
+ * Return: segment with candidates of @from, plus or minus @idx, or
+ *	   @l->nsegs if we're out of segments
+ */
+static unsigned fwd_lookup_seg(struct fwd_lookup *l, unsigned p,
+			       const struct fwd_rule *rule, unsigned idx,
+			       bool add, unsigned from, unsigned port)
+{
+	uint8_t want[FWD_LOOKUP_RULES_MAX / 8];
+	unsigned s;
+
+	memcpy(want, fwd_lookup_map(l, from), l->map_size);
+	if (add)
+		bitmap_set(want, idx);
+	else
+		bitmap_clear(want, idx);
+
+	/* Neighbouring ports might have the same candidates already */
+	if (port) {
+		s = l->seg[p][port - 1];
+		if (!memcmp(want, fwd_lookup_map(l, s), l->map_size))
+			return s;
+	}
+
+	if (rule->last < NUM_PORTS - 1) {
+		s = l->seg[p][rule->last + 1];
+		if (!memcmp(want, fwd_lookup_map(l, s), l->map_size))
+			return s;
+	}
+
+	for (s = 0; s < l->nsegs; s++) {
+		if (!l->ports[s]) {
+			memcpy(fwd_lookup_map(l, s), want, l->map_size);
+			return s;
+		}
+	}
+
+	return l->nsegs;
+}
+
+/**
+ * fwd_lookup_patch() - Add or remove a single rule in a compiled lookup
+ * @l:		Lookup structure
+ * @rule:	Rule being added or removed
+ * @idx:	Index of @rule in table
+ * @add:	Add @rule as candidate for its ports, remove it otherwise
+ *
+ * Ports covered by @rule move to segments with the updated set of candidates,
+ * and segments left without ports are reused later, so that the cost depends
+ * on the port range of @rule, not on the size of the table.
+ *
+ * Return: 0 on success, -1 if we ran out of segments or room in bitmaps
+ */
+static int fwd_lookup_patch(struct fwd_lookup *l, const struct fwd_rule *rule,
+			    unsigned idx, bool add)
+{
+	unsigned from = l->nsegs, to = l->nsegs, p, port;
+
+	if (idx >= l->nrules)
+		return -1;
+
+	p = rule->proto == IPPROTO_TCP ? FWD_LOOKUP_TCP : FWD_LOOKUP_UDP;
+
+	for (port = rule->first; port <= rule->last; port++) {
+		unsigned seg = l->seg[p][port];
+
+		if (seg != from) {
+			from = seg;
+			to = fwd_lookup_seg(l, p, rule, idx, add, from, port);
+			if (to >= l->nsegs)
+				return -1;
+		}
+
+		l->seg[p][port] = to;
+		l->ports[from]--;
+		l->ports[to]++;
+	}
+
+	return 0;
+}
+
+/**
+ * fwd_lookup_compile() - Compile current forwarding tables for fast lookup
+ * @c:		Execution context
+ */
+static void fwd_lookup_compile(const struct ctx *c)
+{
+	unsigned pif;
+
+	for (pif = 0; pif < PIF_NUM_TYPES; pif++)
+		fwd_lookup_build(&fwd_lookups[pif], c->fwd[pif]);
+}
+
+/**
+ * fwd_lookup_search() - Find first matching rule using compiled lookup
+ * @l:		Lookup structure compiled from @fwd
+ * @fwd:	Forwarding table
+ * @ini:	Initiating side flow information
+ * @proto:	Protocol to match
+ *
+ * Return: first matching rule, or NULL if there is none
+ */
+static const struct fwd_rule *fwd_lookup_search(const struct fwd_lookup *l,
+						const struct fwd_table *fwd,
+						const struct flowside *ini,
+						uint8_t proto)
+{
+	const uint8_t *map;
+	unsigned p, i;
+
+	if (proto == IPPROTO_TCP)
+		p = FWD_LOOKUP_TCP;
+	else if (proto == IPPROTO_UDP)
+		p = FWD_LOOKUP_UDP;
+	else
+		return NULL;
+
+	/* Rules past the end of the table are never set as candidates */
+	map = fwd_lookup_map(l, l->seg[p][ini->oport]);
+	for (i = bitmap_next(map, fwd->count, 0); i < fwd->count;
+	     i = bitmap_next(map, fwd->count, i + 1)) {
+		const struct fwd_rule *rule = &fwd->rules[i];
+
+		if (inany_matches(&ini->oaddr, fwd_rule_addr(rule)))
+			return rule;
+	}
+
+	return NULL;
+}
+
 /**
  * fwd_rule_search() - Find a rule which matches a prospective flow
  * @fwd:	Forwarding table
@@ -329,6 +758,12 @@ const struct fwd_rule *fwd_rule_search(const struct fwd_table *fwd,
 		return NULL;
 	}
 
+	for (i = 0; i < ARRAY_SIZE(fwd_lookups); i++) {
+		if (fwd_lookups[i].fwd == fwd)
+			return fwd_lookup_search(&fwd_lookups[i], fwd, ini, proto);
+	}
+
+	/* Not compiled (yet): fall back to a linear search */
 	for (i = 0; i < fwd->count; i++) {
 		if (fwd_rule_match(&fwd->rules[i], ini, proto))
 			return &fwd->rules[i];
@@ -337,30 +772,154 @@ const struct fwd_rule *fwd_rule_search(const struct fwd_table *fwd,
 	return NULL;
 }
 
+/* Index for per-protocol state below */
+#define FWD_PROTO_IDX(proto)	((proto) == IPPROTO_UDP)
+
+/* Automatically forwarded ports as of the last synchronisation, per pif */
+static uint8_t fwd_synced[PIF_NUM_TYPES][2][PORT_BITMAP_SIZE];
+
+/* Automatically forwarded ports we failed to listen on, per pif */
+static uint8_t fwd_failed[PIF_NUM_TYPES][2][PORT_BITMAP_SIZE];
+
+/* Did we fail to listen on any port for rules without FWD_SCAN, per pif? */
+static bool fwd_failed_fixed[PIF_NUM_TYPES];
+
+/**
+ * fwd_tune_sock() - Apply socket options of a forwarding rule to a socket
+ * @tune:	Socket options, NULL for defaults
+ * @s:		Socket
+ * @proto:	Protocol of @s, options only meaningful for TCP are skipped
+ *		for UDP
+ *
+ * Return: 0 on success, negative error code if any option failed to apply
+ */
+int fwd_tune_sock(const struct fwd_tune *tune, int s, uint8_t proto)
+{
+	bool tcp = proto == IPPROTO_TCP;
+	int ret = 0;
+
+	if (!tune)
+		return 0;
+
+#define FWD_TUNE_SET(cond, level, opt, val)				\
+	do {								\
+		if ((cond) &&						\
+		    setsockopt(s, (level), (opt), &(int){ (val) },	\
+			       sizeof(int))) {				\
+			ret = -errno;					\
+			debug_perror("Can't set " #opt " on socket %i", s); \
+		}							\
+	} while (0)
+
+	FWD_TUNE_SET(tune->rcvbuf, SOL_SOCKET, SO_RCVBUF, tune->rcvbuf);
+	FWD_TUNE_SET(tune->sndbuf, SOL_SOCKET, SO_SNDBUF, tune->sndbuf);
+	FWD_TUNE_SET(tune->busy_poll, SOL_SOCKET, SO_BUSY_POLL,
+		     tune->busy_poll);
+	FWD_TUNE_SET(tune->max_rate, SOL_SOCKET, SO_MAX_PACING_RATE,
+		     tune->max_rate);
+	FWD_TUNE_SET(tune->flags & FWD_TUNE_PRIORITY, SOL_SOCKET, SO_PRIORITY,
+		     tune->priority);
+	FWD_TUNE_SET(tcp && tune->notsent_lowat, SOL_TCP, TCP_NOTSENT_LOWAT,
+		     tune->notsent_lowat);
+	FWD_TUNE_SET(tcp && (tune->flags & FWD_TUNE_DELAY), SOL_TCP,
+		     TCP_NODELAY, 0);
+
+#undef FWD_TUNE_SET
+
+	if (tcp && *tune->cc &&
+	    setsockopt(s, SOL_TCP, TCP_CONGESTION, tune->cc,
+		       strnlen(tune->cc, sizeof(tune->cc)))) {
+		ret = -errno;
+		debug_perror("Can't set congestion control %.*s on socket %i",
+			     (int)sizeof(tune->cc), tune->cc, s);
+	}
+
+	return ret;
+}
+
+/** fwd_sync_port() - Create or remove listening socket for a single port
+ * @c:		Execution context
+ * @pif:	Interface to create listening sockets for
+ * @idx:	Rule index
+ * @map:	Bitmap of ports to listen for, NULL for all ports in rule
+ * @port:	Port number, within rule range
+ *
+ * Return: 1 if listening, 0 if not needed, negative error code on failure
+ */
+static int fwd_sync_port(const struct ctx *c, uint8_t pif, unsigned idx,
+			 const uint8_t *map, unsigned port)
+{
+	const struct fwd_rule *rule = &c->fwd[pif]->rules[idx];
+	const union inany_addr *addr = fwd_rule_addr(rule);
+	int *socks = c->fwd[pif]->rulesocks[idx];
+	const char *ifname = rule->ifname;
+	int fd = socks[port - rule->first];
+
+	if (!*ifname)
+		ifname = NULL;
+
+	if (map && !bitmap_isset(map, port)) {
+		/* We don't want to listen on this port */
+		if (fd >= 0) {
+			/* We already are, so stop */
+			epoll_del(c->epollfd, fd);
+			close(fd);
+			socks[port - rule->first] = -1;
+		}
+		return 0;
+	}
+
+	if (fd >= 0) /* Already listening, nothing to do */
+		return 1;
+
+	fd = pif_listen(c, rule->proto, pif, addr, ifname, port, idx,
+			rule->flags & FWD_TPROXY);
+	if (fd < 0) {
+		char astr[INANY_ADDRSTRLEN];
+
+		warn("Listen failed for %s %s port %s%s%s/%u: %s",
+		     pif_name(pif), ipproto_name(rule->proto),
+		     inany_ntop(addr, astr, sizeof(astr)),
+		     ifname ? "%" : "", ifname ? ifname : "",
+		     port, strerror_(-fd));
+		return fd;
+	}
+
+	if (fwd_tune_sock(&rule->tune, fd, rule->proto) < 0) {
+		warn("Couldn't apply all socket options for %s %s port %u",
+		     pif_name(pif), ipproto_name(rule->proto), port);
+	}
+
+	socks[port - rule->first] = fd;
+	return 1;
+}
+
 /** fwd_sync_one() - Create or remove listening sockets for a forward entry
  * @c:		Execution context
  * @pif:	Interface to create listening sockets for
  * @idx:	Rule index
  * @tcp:	Bitmap of TCP ports to listen for on FWD_SCAN entries
  * @udp:	Bitmap of UDP ports to listen for on FWD_SCAN entries
+ * @changed:	Ports to consider for FWD_SCAN entries (TCP, UDP), NULL for all
  *
  * Return: 0 on success, -1 on failure
  */
 static int fwd_sync_one(const struct ctx *c, uint8_t pif, unsigned idx,
-			const uint8_t *tcp, const uint8_t *udp)
+			const uint8_t *tcp, const uint8_t *udp,
+			uint8_t (*changed)[PORT_BITMAP_SIZE])
 {
 	const struct fwd_rule *rule = &c->fwd[pif]->rules[idx];
-	const union inany_addr *addr = fwd_rule_addr(rule);
-	int *socks = c->fwd[pif]->rulesocks[idx];
-	const char *ifname = rule->ifname;
-	const uint8_t *map = NULL;
+	const uint8_t *map = NULL, *walk = NULL;
+	unsigned port, last, nbits = rule->last + 1;
 	bool bound_one = false;
-	unsigned port;
+	uint8_t *failed;
 
 	assert(pif_is_socket(pif));
 
-	if (!*ifname)
-		ifname = NULL;
+	failed = fwd_failed[pif][FWD_PROTO_IDX(rule->proto)];
+
+	/* TPROXY rules redirect the whole range to a socket on the first port */
+	last = rule->flags & FWD_TPROXY ? rule->first : rule->last;
 
 	if (rule->flags & FWD_SCAN) {
 		if (rule->proto == IPPROTO_TCP)
@@ -368,48 +927,32 @@ static int fwd_sync_one(const struct ctx *c, uint8_t pif, unsigned idx,
 		else if (rule->proto == IPPROTO_UDP)
 			map = udp;
 		assert(map);
+
+		if (changed)
+			walk = changed[FWD_PROTO_IDX(rule->proto)];
 	}
 
-	for (port = rule->first; port <= rule->last; port++) {
-		int fd = socks[port - rule->first];
-
-		if (map && !bitmap_isset(map, port)) {
-			/* We don't want to listen on this port */
-			if (fd >= 0) {
-				/* We already are, so stop */
-				epoll_del(c->epollfd, fd);
-				close(fd);
-				socks[port - rule->first] = -1;
-			}
-			continue;
-		}
+	for (port = walk ? bitmap_next(walk, nbits, rule->first) : rule->first;
+	     port <= last;
+	     port = walk ? bitmap_next(walk, nbits, port + 1) : port + 1) {
+		int rc = fwd_sync_port(c, pif, idx, map, port);
 
-		if (fd >= 0) /* Already listening, nothing to do */ {
+		if (rc > 0) {
 			bound_one = true;
-			continue;
-		}
-
-		fd = pif_listen(c, rule->proto, pif, addr, ifname, port, idx);
-		if (fd < 0) {
-			char astr[INANY_ADDRSTRLEN];
-
-			warn("Listen failed for %s %s port %s%s%s/%u: %s",
-			     pif_name(pif), ipproto_name(rule->proto),
-			     inany_ntop(addr, astr, sizeof(astr)),
-			     ifname ? "%" : "", ifname ? ifname : "",
-			     port, strerror_(-fd));
-
+		} else if (rc < 0) {
 			if (!(rule->flags & FWD_WEAK))
 				return -1;
 
-			continue;
+			if (map)
+				bitmap_set(failed, port);
+			else
+				fwd_failed_fixed[pif] = true;
 		}
-
-		socks[port - rule->first] = fd;
-		bound_one = true;
 	}
 
 	if (!bound_one && !(rule->flags & FWD_SCAN)) {
+		const union inany_addr *addr = fwd_rule_addr(rule);
+		const char *ifname = *rule->ifname ? rule->ifname : NULL;
 		char astr[INANY_ADDRSTRLEN];
 
 		warn("All listens failed for %s %s %s%s%s/%u-%u",
@@ -427,13 +970,19 @@ static int fwd_sync_one(const struct ctx *c, uint8_t pif, unsigned idx,
  * @c:		Execution context
  * @tcpmap:	Bitmap of TCP ports to auto-forward
  * @udpmap:	Bitmap of TCP ports to auto-forward
+ * @changed:	Ports changed since last time (TCP, UDP), NULL for a full pass
+ * @fixed:	Also go through rules without FWD_SCAN, if @changed is set
  * @pif:	Interface to create listening sockets for
+ * @rule:	Rule index, for fwd_listen_rule_() only
  * @ret:	Return code
  */
 struct fwd_listen_args {
 	const struct ctx *c;
 	const uint8_t *tcpmap, *udpmap;
+	uint8_t (*changed)[PORT_BITMAP_SIZE];
+	bool fixed;
 	uint8_t pif;
+	unsigned rule;
 	int ret;
 };
 
@@ -450,16 +999,63 @@ static int fwd_listen_sync_(void *arg)
 	if (a->pif == PIF_SPLICE)
 		ns_enter(a->c);
 
+	if (a->changed) {
+		/* Ports we go through are flagged again if they still fail */
+		for (i = 0; i < 2; i++) {
+			bitmap_and_not(fwd_failed[a->pif][i], PORT_BITMAP_SIZE,
+				       fwd_failed[a->pif][i], a->changed[i]);
+		}
+	} else {
+		memset(fwd_failed[a->pif], 0, sizeof(fwd_failed[a->pif]));
+	}
+
+	if (!a->changed || a->fixed)
+		fwd_failed_fixed[a->pif] = false;
+
 	for (i = 0; i < a->c->fwd[a->pif]->count; i++) {
-		a->ret = fwd_sync_one(a->c, a->pif, i, a->tcpmap, a->udpmap);
+		const struct fwd_rule *rule = &a->c->fwd[a->pif]->rules[i];
+
+		if (fwd_rule_unused(rule))
+			continue;
+
+		if (a->changed && !a->fixed && !(rule->flags & FWD_SCAN))
+			continue;
+
+		a->ret = fwd_sync_one(a->c, a->pif, i, a->tcpmap, a->udpmap,
+				      a->changed);
 		if (a->ret < 0)
 			break;
 	}
 
+	memcpy(fwd_synced[a->pif][FWD_PROTO_IDX(IPPROTO_TCP)], a->tcpmap,
+	       PORT_BITMAP_SIZE);
+	memcpy(fwd_synced[a->pif][FWD_PROTO_IDX(IPPROTO_UDP)], a->udpmap,
+	       PORT_BITMAP_SIZE);
+
 	return 0;
 }
 
-/** fwd_listen_sync() - Call fwd_listen_sync_() in correct namespace
+/** fwd_listen_sync_args() - Call fwd_listen_sync_() in correct namespace
+ * @a:		Arguments for fwd_listen_sync_()
+ *
+ * Return: 0 on success, -1 on failure
+ */
+static int fwd_listen_sync_args(struct fwd_listen_args *a)
+{
+	if (a->pif == PIF_SPLICE)
+		NS_CALL(fwd_listen_sync_, a);
+	else
+		fwd_listen_sync_(a);
+
+	if (a->ret < 0) {
+		err("Couldn't listen on requested ports");
+		return -1;
+	}
+
+	return 0;
+}
+
+/** fwd_listen_sync() - Update all listening sockets to match forwards
  * @c:		Execution context
  * @pif:	Interface to create listening sockets for
  * @tcp:	Scanning state for TCP
@@ -474,16 +1070,156 @@ int fwd_listen_sync(const struct ctx *c, uint8_t pif,
 		.c = c, .tcpmap = tcp->map, .udpmap = udp->map, .pif = pif,
 	};
 
+	return fwd_listen_sync_args(&a);
+}
+
+/** fwd_listen_sync_changed() - Update listening sockets for changed ports only
+ * @c:		Execution context
+ * @pif:	Interface to create listening sockets for
+ * @tcp:	Scanning state for TCP
+ * @udp:	Scanning state for UDP
+ * @retry:	Also retry ports we previously failed to listen on
+ *
+ * Return: true if bound ports changed since the last sync, false otherwise
+ */
+static bool fwd_listen_sync_changed(const struct ctx *c, uint8_t pif,
+				   const struct fwd_scan *tcp,
+				   const struct fwd_scan *udp, bool retry)
+{
+	uint8_t changed[2][PORT_BITMAP_SIZE];
+	struct fwd_listen_args a = {
+		.c = c, .tcpmap = tcp->map, .udpmap = udp->map, .pif = pif,
+		.changed = changed, .fixed = retry && fwd_failed_fixed[pif],
+	};
+	bool any = a.fixed, moved = false;
+	unsigned i;
+
+	bitmap_xor(changed[FWD_PROTO_IDX(IPPROTO_TCP)], PORT_BITMAP_SIZE,
+		   tcp->map, fwd_synced[pif][FWD_PROTO_IDX(IPPROTO_TCP)]);
+	bitmap_xor(changed[FWD_PROTO_IDX(IPPROTO_UDP)], PORT_BITMAP_SIZE,
+		   udp->map, fwd_synced[pif][FWD_PROTO_IDX(IPPROTO_UDP)]);
+
+	for (i = 0; i < 2; i++) {
+		if (bitmap_next(changed[i], NUM_PORTS, 0) < NUM_PORTS)
+			moved = true;
+
+		if (retry) {
+			bitmap_or(changed[i], PORT_BITMAP_SIZE,
+				  changed[i], fwd_failed[pif][i]);
+		}
+
+		if (bitmap_next(changed[i], NUM_PORTS, 0) < NUM_PORTS)
+			any = true;
+	}
+
+	/* Steady state: nothing to do, don't even enter the namespace */
+	if (any)
+		fwd_listen_sync_args(&a);
+
+	return moved;
+}
+
+/** fwd_listen_rule_() - Create listening sockets for a single rule
+ * @arg:	struct fwd_listen_args with arguments
+ *
+ * Returns: zero
+ */
+static int fwd_listen_rule_(void *arg)
+{
+	struct fwd_listen_args *a = arg;
+
+	if (a->pif == PIF_SPLICE)
+		ns_enter(a->c);
+
+	a->ret = fwd_sync_one(a->c, a->pif, a->rule, a->tcpmap, a->udpmap,
+			      NULL);
+
+	return 0;
+}
+
+/** fwd_rule_close() - Close listening sockets for a single rule
+ * @fwd:	Forwarding table
+ * @idx:	Rule index
+ */
+static void fwd_rule_close(const struct fwd_table *fwd, unsigned idx)
+{
+	unsigned j, n = fwd_rule_nsocks(&fwd->rules[idx]);
+	int *socks = fwd->rulesocks[idx];
+
+	for (j = 0; j < n; j++) {
+		if (socks[j] >= 0) {
+			close(socks[j]);
+			socks[j] = -1;
+		}
+	}
+}
+
+/** fwd_rule_update() - Add or delete a single rule in a current table
+ * @c:		Execution context
+ * @pif:	Interface whose table we're updating
+ * @rule:	Rule to add, or to delete, matching an existing rule exactly
+ * @del:	Delete @rule instead of adding it
+ *
+ * Unlike fwd_listen_switch(), this only opens or closes listening sockets for
+ * @rule, and only patches the lookup structure for ports covered by @rule.
+ * Other rules keep their index, so their sockets are left untouched.
+ *
+ * Return: 0 on success, -1 on failure
+ */
+int fwd_rule_update(const struct ctx *c, uint8_t pif,
+		    const struct fwd_rule *rule, bool del)
+{
+	struct fwd_listen_args a = { .c = c, .pif = pif };
+	struct fwd_lookup *l;
+	struct fwd_table *fwd;
+	struct fwd_rule old;
+	int idx;
+
+	if (pif >= PIF_NUM_TYPES || !(fwd = c->fwd[pif]))
+		return -1;
+
+	l = &fwd_lookups[pif];
+
+	if (del) {
+		if ((idx = fwd_rule_find(fwd, rule)) < 0)
+			return -1;
+
+		old = fwd->rules[idx];
+		fwd_rule_close(fwd, idx);
+		fwd_rule_release(fwd, idx);
+
+		if (l->fwd == fwd && fwd_lookup_patch(l, &old, idx, false))
+			fwd_lookup_build(l, fwd);
+
+		return 0;
+	}
+
+	if ((idx = fwd_rule_add(fwd, rule)) < 0)
+		return -1;
+
+	if (pif == PIF_SPLICE) {
+		a.tcpmap = c->tcp.scan_out.map;
+		a.udpmap = c->udp.scan_out.map;
+	} else {
+		a.tcpmap = c->tcp.scan_in.map;
+		a.udpmap = c->udp.scan_in.map;
+	}
+	a.rule = idx;
+
 	if (pif == PIF_SPLICE)
-		NS_CALL(fwd_listen_sync_, &a);
+		NS_CALL(fwd_listen_rule_, &a);
 	else
-		fwd_listen_sync_(&a);
+		fwd_listen_rule_(&a);
 
 	if (a.ret < 0) {
-		err("Couldn't listen on requested ports");
+		fwd_rule_close(fwd, idx);
+		fwd_rule_release(fwd, idx);
 		return -1;
 	}
 
+	if (l->fwd == fwd && fwd_lookup_patch(l, rule, idx, true))
+		fwd_lookup_build(l, fwd);
+
 	return 0;
 }
 
@@ -495,12 +1231,11 @@ void fwd_listen_close(const struct fwd_table *fwd)
 	unsigned i;
 
 	for (i = 0; i < fwd->count; i++) {
-		const struct fwd_rule *rule = &fwd->rules[i];
+		unsigned j, n = fwd_rule_nsocks(&fwd->rules[i]);
 		int *socks = fwd->rulesocks[i];
-		unsigned port;
 
-		for (port = rule->first; port <= rule->last; port++) {
-			int *fdp = &socks[port - rule->first];
+		for (j = 0; j < n; j++) {
+			int *fdp = &socks[j];
 			if (*fdp >= 0) {
 				close(*fdp);
 				*fdp = -1;
@@ -509,13 +1244,15 @@ void fwd_listen_close(const struct fwd_table *fwd)
 	}
 }
 
-/** fwd_listen_init() - Set up listening sockets at start up
+/** fwd_listen_init() - Set up lookup and listening sockets for current rules
  * @c:		Execution context
  *
  * Return: 0 on success, -1 on failure
  */
 int fwd_listen_init(const struct ctx *c)
 {
+	fwd_lookup_compile(c);
+
 	if (fwd_listen_sync(c, PIF_HOST, &c->tcp.scan_in, &c->udp.scan_in) < 0)
 		return -1;
 
@@ -605,6 +1342,27 @@ static void procfs_scan_listen(int fd, unsigned int lstate, uint8_t *map)
 	}
 }
 
+/**
+ * fwd_scan_listen() - Set bits for listening TCP or UDP sockets
+ * @scan:	Scanning state with sock_diag socket and procfs fallback
+ * @proto:	IPPROTO_TCP or IPPROTO_UDP
+ * @map:	Bitmap where numbers of ports in listening state will be set
+ */
+static void fwd_scan_listen(const struct fwd_scan *scan, uint8_t proto,
+			    uint8_t *map)
+{
+	uint8_t lstate = proto == IPPROTO_TCP ? TCP_LISTEN : UDP_LISTEN;
+
+	/* Only listening sockets come back, no text to parse */
+	if (scan->diag >= 0 &&
+	    !nl_diag_listen(scan->diag, proto, AF_INET, lstate, map) &&
+	    !nl_diag_listen(scan->diag, proto, AF_INET6, lstate, map))
+		return;
+
+	procfs_scan_listen(scan->scan4, lstate, map);
+	procfs_scan_listen(scan->scan6, lstate, map);
+}
+
 /**
  * has_scan_rules() - Does the given table have any FWD_SCAN rules?
  * @fwd:	Forwarding table
@@ -623,49 +1381,57 @@ static bool has_scan_rules(const struct fwd_table *fwd, uint8_t proto)
 }
 
 /**
- * fwd_scan_ports_tcp() - Scan /proc to update TCP forwarding map
+ * fwd_scan_ports_tcp() - Scan listening sockets to update TCP forwarding map
  * @fwd:	Forwarding table
  * @scan:	Scanning state to update
  * @exclude:	Ports to _not_ forward
+ * @listen:	Bitmap of listening ports, set on return
+ *
+ * Return: true if we scanned and @listen is valid, false otherwise
  */
-static void fwd_scan_ports_tcp(const struct fwd_table *fwd,
-			       struct fwd_scan *scan, const uint8_t *exclude)
+static bool fwd_scan_ports_tcp(const struct fwd_table *fwd,
+			       struct fwd_scan *scan, const uint8_t *exclude,
+			       uint8_t *listen)
 {
 	if (!has_scan_rules(fwd, IPPROTO_TCP))
-		return;
+		return false;
 
-	memset(scan->map, 0, PORT_BITMAP_SIZE);
-	procfs_scan_listen(scan->scan4, TCP_LISTEN, scan->map);
-	procfs_scan_listen(scan->scan6, TCP_LISTEN, scan->map);
-	bitmap_and_not(scan->map, PORT_BITMAP_SIZE, scan->map, exclude);
+	memset(listen, 0, PORT_BITMAP_SIZE);
+	fwd_scan_listen(scan, IPPROTO_TCP, listen);
+	bitmap_and_not(scan->map, PORT_BITMAP_SIZE, listen, exclude);
+
+	return true;
 }
 
 /**
- * fwd_scan_ports_udp() - Scan /proc to update UDP forwarding map
+ * fwd_scan_ports_udp() - Scan bound sockets to update UDP forwarding map
  * @fwd:	Forwarding table
  * @scan:	Scanning state to update
  * @tcp_scan:	Corresponding TCP scanning state
+ * @tcp_listen:	Listening TCP ports from the same scan, NULL if not scanned
  * @exclude:	Ports to _not_ forward
  */
 static void fwd_scan_ports_udp(const struct fwd_table *fwd,
 			       struct fwd_scan *scan,
 			       const struct fwd_scan *tcp_scan,
+			       const uint8_t *tcp_listen,
 			       const uint8_t *exclude)
 {
 	if (!has_scan_rules(fwd, IPPROTO_UDP))
 		return;
 
 	memset(scan->map, 0, PORT_BITMAP_SIZE);
-	procfs_scan_listen(scan->scan4, UDP_LISTEN, scan->map);
-	procfs_scan_listen(scan->scan6, UDP_LISTEN, scan->map);
+	fwd_scan_listen(scan, IPPROTO_UDP, scan->map);
 
 	/* Also forward UDP ports with the same numbers as bound TCP ports.
 	 * This is useful for a handful of protocols (e.g. iperf3) where a TCP
 	 * control port is used to set up transfers on a corresponding UDP
 	 * port.
 	 */
-	procfs_scan_listen(tcp_scan->scan4, TCP_LISTEN, scan->map);
-	procfs_scan_listen(tcp_scan->scan6, TCP_LISTEN, scan->map);
+	if (tcp_listen)
+		bitmap_or(scan->map, PORT_BITMAP_SIZE, scan->map, tcp_listen);
+	else
+		fwd_scan_listen(tcp_scan, IPPROTO_TCP, scan->map);
 
 	bitmap_and_not(scan->map, PORT_BITMAP_SIZE, scan->map, exclude);
 }
@@ -685,14 +1451,14 @@ static void current_listen_map(uint8_t *map, const struct fwd_table *fwd,
 
 	for (i = 0; i < fwd->count; i++) {
 		const struct fwd_rule *rule = &fwd->rules[i];
-		unsigned port;
+		unsigned j, n = fwd_rule_nsocks(rule);
 
 		if (rule->proto != proto)
 			continue;
 
-		for (port = rule->first; port <= rule->last; port++) {
-			if (fwd->rulesocks[i][port - rule->first] >= 0)
-				bitmap_set(map, port);
+		for (j = 0; j < n; j++) {
+			if (fwd->rulesocks[i][j] >= 0)
+				bitmap_set(map, rule->first + j);
 		}
 	}
 }
@@ -705,18 +1471,42 @@ static void fwd_scan_ports(struct ctx *c)
 {
 	uint8_t excl_tcp_out[PORT_BITMAP_SIZE], excl_udp_out[PORT_BITMAP_SIZE];
 	uint8_t excl_tcp_in[PORT_BITMAP_SIZE], excl_udp_in[PORT_BITMAP_SIZE];
+	uint8_t tcp_out[PORT_BITMAP_SIZE], tcp_in[PORT_BITMAP_SIZE];
+	bool out, in;
 
 	current_listen_map(excl_tcp_out, c->fwd[PIF_HOST], IPPROTO_TCP);
 	current_listen_map(excl_tcp_in, c->fwd[PIF_SPLICE], IPPROTO_TCP);
 	current_listen_map(excl_udp_out, c->fwd[PIF_HOST], IPPROTO_UDP);
 	current_listen_map(excl_udp_in, c->fwd[PIF_SPLICE], IPPROTO_UDP);
 
-	fwd_scan_ports_tcp(c->fwd[PIF_SPLICE], &c->tcp.scan_out, excl_tcp_out);
-	fwd_scan_ports_tcp(c->fwd[PIF_HOST], &c->tcp.scan_in, excl_tcp_in);
+	/* Listening TCP ports are also needed for UDP: scan them once */
+	out = fwd_scan_ports_tcp(c->fwd[PIF_SPLICE], &c->tcp.scan_out,
+				 excl_tcp_out, tcp_out);
+	in = fwd_scan_ports_tcp(c->fwd[PIF_HOST], &c->tcp.scan_in,
+				excl_tcp_in, tcp_in);
 	fwd_scan_ports_udp(c->fwd[PIF_SPLICE], &c->udp.scan_out,
-			   &c->tcp.scan_out, excl_udp_out);
+			   &c->tcp.scan_out, out ? tcp_out : NULL,
+			   excl_udp_out);
 	fwd_scan_ports_udp(c->fwd[PIF_HOST], &c->udp.scan_in,
-			   &c->tcp.scan_in, excl_udp_in);
+			   &c->tcp.scan_in, in ? tcp_in : NULL,
+			   excl_udp_in);
+}
+
+/* Interval between scans for bound ports, milliseconds: doubled while bound
+ * ports don't change, up to FWD_PORT_SCAN_INTERVAL, and reset to the minimum
+ * as soon as they do, so that idle instances don't keep scanning at a fast pace
+ */
+static int scan_ports_interval = FWD_PORT_SCAN_INTERVAL;
+static int scan_ports_interval_min = FWD_PORT_SCAN_INTERVAL;
+
+/**
+ * fwd_scan_ports_interval() - Get interval between scans for bound ports
+ *
+ * Return: interval in milliseconds
+ */
+int fwd_scan_ports_interval(void)
+{
+	return scan_ports_interval;
 }
 
 /**
@@ -731,8 +1521,20 @@ void fwd_scan_ports_init(struct ctx *c)
 	c->tcp.scan_out.scan4 = c->tcp.scan_out.scan6 = -1;
 	c->udp.scan_in.scan4 = c->udp.scan_in.scan6 = -1;
 	c->udp.scan_out.scan4 = c->udp.scan_out.scan6 = -1;
+	c->tcp.scan_in.diag = c->tcp.scan_out.diag = -1;
+	c->udp.scan_in.diag = c->udp.scan_out.diag = -1;
 
 	if (c->mode == MODE_PASTA) {
+		nl_diag_sock_init(c);
+		c->tcp.scan_out.diag = c->udp.scan_out.diag = nl_sock_diag;
+		c->tcp.scan_in.diag = c->udp.scan_in.diag = nl_sock_diag_ns;
+
+		/* Scans are cheap with sock_diag: pick up new services fast */
+		if (nl_sock_diag >= 0 && nl_sock_diag_ns >= 0) {
+			scan_ports_interval = FWD_PORT_SCAN_INTERVAL_DIAG;
+			scan_ports_interval_min = FWD_PORT_SCAN_INTERVAL_DIAG;
+		}
+
 		c->tcp.scan_out.scan4 = open("/proc/net/tcp", flags);
 		c->tcp.scan_out.scan6 = open("/proc/net/tcp6", flags);
 		c->udp.scan_out.scan4 = open("/proc/net/udp", flags);
@@ -750,6 +1552,9 @@ void fwd_scan_ports_init(struct ctx *c)
 /* Last time we scanned for open ports */
 static struct timespec scan_ports_run;
 
+/* Last time we retried listening on ports that previously failed */
+static struct timespec scan_ports_retry;
+
 /**
  * fwd_scan_ports_timer() - Rescan open port information when necessary
  * @c:		Execution context
@@ -757,18 +1562,35 @@ static struct timespec scan_ports_run;
  */
 void fwd_scan_ports_timer(struct ctx *c, const struct timespec *now)
 {
+	bool retry, changed;
+
 	if (c->mode != MODE_PASTA)
 		return;
 
-	if (timespec_diff_ms(now, &scan_ports_run) < FWD_PORT_SCAN_INTERVAL)
+	if (timespec_diff_ms(now, &scan_ports_run) < scan_ports_interval)
 		return;
 
 	scan_ports_run = *now;
 
 	fwd_scan_ports(c);
 
-	fwd_listen_sync(c, PIF_HOST, &c->tcp.scan_in, &c->udp.scan_in);
-	fwd_listen_sync(c, PIF_SPLICE, &c->tcp.scan_out, &c->udp.scan_out);
+	/* Don't hammer ports we can't bind to at every (fast) scan */
+	retry = timespec_diff_ms(now, &scan_ports_retry) >=
+		FWD_PORT_SCAN_INTERVAL;
+	if (retry)
+		scan_ports_retry = *now;
+
+	changed = fwd_listen_sync_changed(c, PIF_HOST, &c->tcp.scan_in,
+					  &c->udp.scan_in, retry);
+	changed |= fwd_listen_sync_changed(c, PIF_SPLICE, &c->tcp.scan_out,
+					   &c->udp.scan_out, retry);
+
+	if (changed) {
+		scan_ports_interval = scan_ports_interval_min;
+	} else {
+		scan_ports_interval = MIN(scan_ports_interval * 2,
+					  FWD_PORT_SCAN_INTERVAL);
+	}
 }
 
 /**
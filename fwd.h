@@ -17,12 +17,15 @@
 #include "bitmap.h"
 #include "inany.h"
 #include "fwd_rule.h"
+#include "pif.h"
 
 struct flowside;
 struct ctx;
 
 #define FWD_NO_HINT	(-1)
 
+#define FWD_PIF_BITS	4
+
 /**
  * struct fwd_listen_ref - information about a single listening socket
  * @port:	Bound port number of the socket
@@ -31,37 +34,50 @@ struct ctx;
  */
 struct fwd_listen_ref {
 	in_port_t	port;
-	uint8_t		pif;
+	unsigned	pif :FWD_PIF_BITS;
 	unsigned	rule :FWD_RULE_BITS;
 };
 
+static_assert(PIF_NUM_TYPES <= MAX_FROM_BITS(FWD_PIF_BITS) + 1,
+	      "Not enough bits for pif in listening socket references");
+static_assert(sizeof(struct fwd_listen_ref) <= sizeof(uint32_t),
+	      "Listening socket references don't fit epoll references");
+
 /**
  * struct fwd_scan - Port scanning state for a protocol+direction
- * @scan4:	/proc/net fd to scan for IPv4 ports when in AUTO mode
- * @scan6:	/proc/net fd to scan for IPv6 ports when in AUTO mode
+ * @diag:	sock_diag socket to scan for ports when in AUTO mode, or -1
+ * @scan4:	/proc/net fd to scan for IPv4 ports, if sock_diag fails
+ * @scan6:	/proc/net fd to scan for IPv6 ports, if sock_diag fails
  * @map:	Bitmap describing which ports are forwarded
  */
 struct fwd_scan {
+	int diag;
 	int scan4;
 	int scan6;
 	uint8_t map[PORT_BITMAP_SIZE];
 };
 
 #define FWD_PORT_SCAN_INTERVAL		1000	/* ms */
+#define FWD_PORT_SCAN_INTERVAL_DIAG	100	/* ms, with sock_diag */
 
 void fwd_rule_init(struct ctx *c);
 const struct fwd_rule *fwd_rule_search(const struct fwd_table *fwd,
 				       const struct flowside *ini,
 				       uint8_t proto, int hint);
 
+int fwd_tune_sock(const struct fwd_tune *tune, int s, uint8_t proto);
+
 void fwd_scan_ports_init(struct ctx *c);
 void fwd_scan_ports_timer(struct ctx * c, const struct timespec *now);
 
 int fwd_listen_sync(const struct ctx *c, uint8_t pif,
 		    const struct fwd_scan *tcp, const struct fwd_scan *udp);
 void fwd_listen_close(const struct fwd_table *fwd);
+int fwd_scan_ports_interval(void);
 int fwd_listen_init(const struct ctx *c);
 void fwd_listen_switch(struct ctx *c);
+int fwd_rule_update(const struct ctx *c, uint8_t pif,
+		    const struct fwd_rule *rule, bool del);
 
 bool nat_inbound(const struct ctx *c, const union inany_addr *addr,
 		 union inany_addr *translated);
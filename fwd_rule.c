@@ -18,6 +18,8 @@
 #include <ctype.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <inttypes.h>
+#include <limits.h>
 #include <stdio.h>
 #include <unistd.h>
 
@@ -100,6 +102,72 @@ const union inany_addr *fwd_rule_addr(const struct fwd_rule *rule)
 	return &rule->addr;
 }
 
+/**
+ * fwd_rule_nsocks() - Number of listening sockets needed for a rule
+ * @rule:	Forwarding rule
+ *
+ * Return: one socket per port, or a single one for FWD_TPROXY rules
+ */
+unsigned fwd_rule_nsocks(const struct fwd_rule *rule)
+{
+	if (rule->flags & FWD_TPROXY)
+		return 1;
+
+	return (unsigned)rule->last - rule->first + 1;
+}
+
+/**
+ * fwd_tune_fmt() - Format socket options of a rule, if any, as a string
+ * @tune:	Socket options to format
+ * @dst:	Buffer to store output (should have FWD_TUNE_STRLEN bytes)
+ * @size:	Size of @dst
+ *
+ * Return: @dst, with an empty string if no options are set
+ */
+static const char *fwd_tune_fmt(const struct fwd_tune *tune,
+				char *dst, size_t size)
+{
+	const char *sep = " (";
+	size_t len = 0;
+
+	/* Append one option, prefixed by " (" for the first one, " " then */
+#define FWD_TUNE_FMT(fmt, ...)						\
+	do {								\
+		int ret_ = snprintf(dst + len, size - len, "%s" fmt,	\
+				    sep, __VA_ARGS__);			\
+		if (ret_ < 0 || (size_t)ret_ >= size - len)		\
+			return dst;					\
+		len += ret_;						\
+		sep = " ";						\
+	} while (0)
+
+	*dst = '\0';
+
+	if (*tune->cc)
+		FWD_TUNE_FMT("cc=%.*s", FWD_TUNE_CC_SIZE - 1, tune->cc);
+	if (tune->notsent_lowat)
+		FWD_TUNE_FMT("notsent-lowat=%"PRIu32, tune->notsent_lowat);
+	if (tune->rcvbuf)
+		FWD_TUNE_FMT("rcvbuf=%"PRIu32, tune->rcvbuf);
+	if (tune->sndbuf)
+		FWD_TUNE_FMT("sndbuf=%"PRIu32, tune->sndbuf);
+	if (tune->busy_poll)
+		FWD_TUNE_FMT("busy-poll=%"PRIu32, tune->busy_poll);
+	if (tune->max_rate)
+		FWD_TUNE_FMT("max-rate=%"PRIu32, tune->max_rate);
+	if (tune->flags & FWD_TUNE_PRIORITY)
+		FWD_TUNE_FMT("priority=%"PRIu16, tune->priority);
+	if (tune->flags & FWD_TUNE_DELAY)
+		FWD_TUNE_FMT("%s", "delay");
+
+#undef FWD_TUNE_FMT
+
+	if (len && len + 1 < size)
+		strcpy(dst + len, ")");
+
+	return dst;
+}
+
 /**
  * fwd_rule_fmt() - Prettily format forwarding rule as a string
  * @rule:	Rule to format
@@ -116,8 +184,9 @@ const char *fwd_rule_fmt(const struct fwd_rule *rule, char *dst, size_t size)
 {
 	const char *percent = *rule->ifname ? "%" : "";
 	char taddr[INANY_ADDRSTRLEN] = { 0 };
-	const char *weak = "", *scan = "";
+	const char *weak = "", *scan = "", *tproxy = "";
 	char addr[INANY_ADDRSTRLEN];
+	char tune[FWD_TUNE_STRLEN];
 	int len;
 
 	if (!inany_is_unspecified(&rule->taddr)) {
@@ -129,20 +198,24 @@ const char *fwd_rule_fmt(const struct fwd_rule *rule, char *dst, size_t size)
 		weak = " (best effort)";
 	if (rule->flags & FWD_SCAN)
 		scan = " (auto-scan)";
+	if (rule->flags & FWD_TPROXY)
+		tproxy = " (tproxy)";
+	fwd_tune_fmt(&rule->tune, tune, sizeof(tune));
 
 	if (rule->first == rule->last) {
 		len = snprintf(dst, size,
-			       "%s [%s]%s%s:%hu  =>  %s%hu %s%s",
+			       "%s [%s]%s%s:%hu  =>  %s%hu %s%s%s%s",
 			       ipproto_name(rule->proto), addr, percent,
 			       rule->ifname, rule->first,
-			       taddr, rule->to, weak, scan);
+			       taddr, rule->to, weak, scan, tproxy, tune);
 	} else {
 		in_port_t tolast = rule->last - rule->first + rule->to;
 		len = snprintf(dst, size,
-			       "%s [%s]%s%s:%hu-%hu  =>  %s%hu-%hu %s%s",
+			       "%s [%s]%s%s:%hu-%hu  =>  %s%hu-%hu %s%s%s%s",
 			       ipproto_name(rule->proto), addr, percent,
 			       rule->ifname, rule->first, rule->last,
-			       taddr, rule->to, tolast, weak, scan);
+			       taddr, rule->to, tolast, weak, scan, tproxy,
+			       tune);
 	}
 
 	if (len < 0 || (size_t)len >= size)
@@ -185,6 +258,66 @@ static bool fwd_rule_match(const struct fwd_rule *a, const struct fwd_rule *b)
 	return !memcmp(a, b, sizeof(*a));
 }
 
+/**
+ * fwd_rule_unused() - Is this the slot of a rule released from a live table?
+ * @rule:	Rule to check
+ *
+ * Return: true if @rule was released by fwd_rule_release(), false otherwise
+ */
+bool fwd_rule_unused(const struct fwd_rule *rule)
+{
+	return !rule->proto;
+}
+
+/**
+ * fwd_rule_find() - Find a rule exactly matching a given one
+ * @fwd:	Table to search
+ * @rule:	Rule to look for
+ *
+ * Return: index of matching rule, -ENOENT if not found
+ */
+int fwd_rule_find(const struct fwd_table *fwd, const struct fwd_rule *rule)
+{
+	unsigned i;
+
+	for (i = 0; i < fwd->count; i++) {
+		if (!fwd_rule_unused(&fwd->rules[i]) &&
+		    fwd_rule_match(rule, &fwd->rules[i]))
+			return i;
+	}
+
+	return -ENOENT;
+}
+
+/**
+ * fwd_rule_release() - Release a rule from a table, keeping other indices
+ * @fwd:	Table to update
+ * @idx:	Index of rule, all its listening sockets must be closed already
+ *
+ * Unlike fwd_rule_del(), this can be used on a table with open sockets, as
+ * other rules and their sockets don't move: the slot is left unused, with its
+ * socket space, for fwd_rule_add() to reuse, unless it's the last one.
+ */
+void fwd_rule_release(struct fwd_table *fwd, unsigned idx)
+{
+	assert(idx < fwd->count);
+
+	/* Keep ports and flags, they give the size of the socket space */
+	fwd->rules[idx].proto = 0;
+
+	while (fwd->count) {
+		unsigned last = fwd->count - 1;
+		unsigned num = fwd_rule_nsocks(&fwd->rules[last]);
+
+		if (!fwd_rule_unused(&fwd->rules[last]) ||
+		    fwd->rulesocks[last] + num != fwd->socks + fwd->sock_count)
+			break;
+
+		fwd->sock_count -= num;
+		fwd->count--;
+	}
+}
+
 /**
  * fwd_rule_clear() - Clear a forwarding table
  * @fwd:	Table to clear (might be NULL)
@@ -238,7 +371,7 @@ static int fwd_rule_del(struct fwd_table *fwd, const struct fwd_rule *rule)
 
 	/* Don't use anything else from 'rule' as passed, it's not validated */
 	rule = &fwd->rules[i];
-	num = (unsigned)rule->last - rule->first + 1;
+	num = fwd_rule_nsocks(rule);
 
 	fwd->count--;
 
@@ -261,14 +394,15 @@ static int fwd_rule_del(struct fwd_table *fwd, const struct fwd_rule *rule)
  * @fwd:	Table to add to
  * @new:	Rule to add
  *
- * Return: 0 on success, negative error code on failure
+ * Return: index of new rule on success, negative error code on failure
  */
 int fwd_rule_add(struct fwd_table *fwd, const struct fwd_rule *new)
 {
 	/* Flags which can be set from the caller */
-	const uint8_t allowed_flags = FWD_WEAK | FWD_SCAN | FWD_DUAL_STACK_ANY;
-	unsigned num = (unsigned)new->last - new->first + 1;
-	unsigned port, i;
+	const uint8_t allowed_flags = FWD_WEAK | FWD_SCAN | FWD_DUAL_STACK_ANY |
+				      FWD_TPROXY;
+	unsigned num = fwd_rule_nsocks(new);
+	unsigned i;
 
 	if (new->first > new->last) {
 		warn("Rule has invalid port range %u-%u",
@@ -289,6 +423,16 @@ int fwd_rule_add(struct fwd_table *fwd, const struct fwd_rule *new)
 		     new->flags & ~allowed_flags);
 		return -EINVAL;
 	}
+	if (new->flags & FWD_TPROXY) {
+		if (new->proto != IPPROTO_TCP) {
+			warn("TPROXY forwarding is only supported for TCP");
+			return -EINVAL;
+		}
+		if (new->flags & FWD_SCAN) {
+			warn("TPROXY forwarding can't be combined with 'auto'");
+			return -EINVAL;
+		}
+	}
 	if (new->flags & FWD_DUAL_STACK_ANY) {
 		if (!inany_equals(&new->addr, &inany_any6)) {
 			char astr[INANY_ADDRSTRLEN];
@@ -373,6 +517,21 @@ int fwd_rule_add(struct fwd_table *fwd, const struct fwd_rule *new)
 		return -EEXIST;
 	}
 
+	/* Reuse a slot from fwd_rule_release() with the same socket space */
+	for (i = 0; i < fwd->count; i++) {
+		unsigned j;
+
+		if (!fwd_rule_unused(&fwd->rules[i]) ||
+		    fwd_rule_nsocks(&fwd->rules[i]) != num)
+			continue;
+
+		for (j = 0; j < num; j++)
+			fwd->rulesocks[i][j] = -1;
+
+		fwd->rules[i] = *new;
+		return i;
+	}
+
 	if (fwd->count >= ARRAY_SIZE(fwd->rules)) {
 		warn("Too many rules (maximum %d)", ARRAY_SIZE(fwd->rules));
 		return -ENOSPC;
@@ -389,18 +548,12 @@ int fwd_rule_add(struct fwd_table *fwd, const struct fwd_rule *new)
 
 	fwd->rulesocks[fwd->count] = &fwd->socks[fwd->sock_count];
 
-	/* Redundant, but not for static checkers, that might be missing that
-	 * due to the check on 'num' above against ARRAY_SIZE(fwd->socks), we
-	 * have a proper upper bound for new->last in the loop below.
-	 */
-	if (new->last > ARRAY_SIZE(fwd->socks) + new->first)
-		return -ENOSPC;
-	for (port = new->first; port <= new->last; port++)
-		fwd->rulesocks[fwd->count][port - new->first] = -1;
+	for (i = 0; i < num; i++)
+		fwd->rulesocks[fwd->count][i] = -1;
 
-	fwd->rules[fwd->count++] = *new;
+	fwd->rules[fwd->count] = *new;
 	fwd->sock_count += num;
-	return 0;
+	return fwd->count++;
 }
 
 /**
@@ -417,6 +570,7 @@ int fwd_rule_add(struct fwd_table *fwd, const struct fwd_rule *new)
  * @tgt_addr:	Destination address on the target side
  * @tgt_first:	Destination port to use for @first on the target side
  * @flags:	Flags for forwarding entries
+ * @tune:	Socket options for forwarding entries, NULL for defaults
  */
 static void fwd_rule_range_except(struct fwd_table *fwd, bool del,
 				  uint8_t proto, const union inany_addr *addr,
@@ -425,7 +579,7 @@ static void fwd_rule_range_except(struct fwd_table *fwd, bool del,
 				  const uint8_t *exclude,
 				  const union inany_addr *tgt_addr,
 				  uint16_t tgt_first,
-				  uint8_t flags)
+				  uint8_t flags, const struct fwd_tune *tune)
 {
 	struct fwd_rule rule = {
 		.addr = addr ? *addr : inany_any6,
@@ -440,6 +594,8 @@ static void fwd_rule_range_except(struct fwd_table *fwd, bool del,
 
 	if (!addr)
 		rule.flags |= FWD_DUAL_STACK_ANY;
+	if (tune)
+		rule.tune = *tune;
 	if (ifname) {
 		int ret;
 
@@ -483,12 +639,14 @@ fail:
  * enum fwd_port_chunk_kind - Kind of port specifier piece
  * @CHUNK_ALL		"all"
  * @CHUNK_AUTO		"auto"
+ * @CHUNK_TPROXY	"tproxy"
  * @CHUNK_EXCLUDE	"~1111[-2222]"
  * @CHUNK_INCLUDE	"1111[-2222][:3333[-4444]]"
  */
 enum fwd_port_chunk_kind {
 	CHUNK_ALL,
 	CHUNK_AUTO,
+	CHUNK_TPROXY,
 	CHUNK_EXCLUDE,
 	CHUNK_INCLUDE,
 };
@@ -525,6 +683,8 @@ static bool parse_port_chunk(const char **cursor,
 		}
 	} else if (parse_literal(&p, "auto")) {
 		kind = CHUNK_AUTO;
+	} else if (parse_literal(&p, "tproxy")) {
+		kind = CHUNK_TPROXY;
 	} else if (parse_literal(&p, "~")) {
 		kind = CHUNK_EXCLUDE;
 		if (!parse_port_range(&p, &lr))
@@ -615,11 +775,12 @@ static bool parse_addrifname(const char **cursor,
  * @addr:	Listening address for forwarding
  * @ifname:	Interface name for listening
  * @spec:	Port range(s) specifier
+ * @tune:	Socket options for resulting rules, NULL for defaults
  */
 static void fwd_rule_parse_ports(struct fwd_table *fwd, bool del, uint8_t proto,
 				 const union inany_addr *addr,
 				 const char *ifname,
-				 const char *spec)
+				 const char *spec, const struct fwd_tune *tune)
 {
 	uint8_t exclude[PORT_BITMAP_SIZE] = { 0 };
 	union inany_addr all_taddr = inany_any6;
@@ -645,6 +806,14 @@ static void fwd_rule_parse_ports(struct fwd_table *fwd, bool del, uint8_t proto,
 			flags |= FWD_SCAN;
 			break;
 
+		case CHUNK_TPROXY:
+			if (proto != IPPROTO_TCP) {
+				die(
+"'tproxy' port forwarding is only supported for TCP");
+			}
+			flags |= FWD_TPROXY;
+			break;
+
 		case CHUNK_EXCLUDE:
 			for (i = lrange.first; i <= lrange.last; i++)
 				bitmap_set(exclude, i);
@@ -665,6 +834,7 @@ static void fwd_rule_parse_ports(struct fwd_table *fwd, bool del, uint8_t proto,
 
 		switch (kind) {
 		case CHUNK_AUTO:
+		case CHUNK_TPROXY:
 		case CHUNK_EXCLUDE:
 			continue; /* already handled */
 
@@ -682,7 +852,7 @@ static void fwd_rule_parse_ports(struct fwd_table *fwd, bool del, uint8_t proto,
 			fwd_rule_range_except(fwd, del, proto, addr, ifname,
 					      lrange.first, lrange.last,
 					      exclude, &taddr, trange.first,
-					      flags);
+					      flags, tune);
 			break;
 		default:
 			goto bad;
@@ -698,22 +868,98 @@ static void fwd_rule_parse_ports(struct fwd_table *fwd, bool del, uint8_t proto,
 
 		fwd_rule_range_except(fwd, del, proto, addr, ifname,
 				      1, NUM_PORTS - 1, exclude,
-				      &all_taddr, 1, flags | FWD_WEAK);
+				      &all_taddr, 1, flags | FWD_WEAK, tune);
 	}
 	return;
 bad:
 	die("Invalid port specifier '%s'", spec);
 }
 
+/**
+ * fwd_tune_parse() - Parse socket options for forwarding rules
+ * @optarg:	Option argument, "none" or comma-separated list of options
+ * @tune:	Socket options, updated
+ *
+ * Options are cc=NAME, notsent-lowat=BYTES, rcvbuf=BYTES, sndbuf=BYTES,
+ * busy-poll=USECS, max-rate=BYTES, priority=N, and delay or nodelay. Options
+ * not given keep their previous values, "none" resets all of them to defaults.
+ */
+void fwd_tune_parse(const char *optarg, struct fwd_tune *tune)
+{
+	struct fwd_tune tmp = *tune;
+	const char *p = optarg;
+
+	if (parse_literal(&p, "none") && parse_eoi(p)) {
+		memset(tune, 0, sizeof(*tune));
+		return;
+	}
+
+	p = optarg;
+	do {
+		unsigned long val;
+
+		if (parse_literal(&p, "cc=")) {
+			size_t len = strcspn(p, ",");
+
+			if (!len || len >= sizeof(tmp.cc))
+				goto bad;
+
+			memset(tmp.cc, 0, sizeof(tmp.cc));
+			memcpy(tmp.cc, p, len);
+			p += len;
+		} else if (parse_literal(&p, "notsent-lowat=")) {
+			if (!parse_unsigned(&p, 0, &val) || val > UINT32_MAX)
+				goto bad;
+			tmp.notsent_lowat = val;
+		} else if (parse_literal(&p, "rcvbuf=")) {
+			if (!parse_unsigned(&p, 0, &val) || val > INT_MAX / 2)
+				goto bad;
+			tmp.rcvbuf = val;
+		} else if (parse_literal(&p, "sndbuf=")) {
+			if (!parse_unsigned(&p, 0, &val) || val > INT_MAX / 2)
+				goto bad;
+			tmp.sndbuf = val;
+		} else if (parse_literal(&p, "busy-poll=")) {
+			if (!parse_unsigned(&p, 0, &val) || val > INT_MAX)
+				goto bad;
+			tmp.busy_poll = val;
+		} else if (parse_literal(&p, "max-rate=")) {
+			if (!parse_unsigned(&p, 0, &val) || val > INT_MAX)
+				goto bad;
+			tmp.max_rate = val;
+		} else if (parse_literal(&p, "priority=")) {
+			if (!parse_unsigned(&p, 0, &val) || val > UINT16_MAX)
+				goto bad;
+			tmp.priority = val;
+			tmp.flags |= FWD_TUNE_PRIORITY;
+		} else if (parse_literal(&p, "nodelay")) {
+			tmp.flags &= ~FWD_TUNE_DELAY;
+		} else if (parse_literal(&p, "delay")) {
+			tmp.flags |= FWD_TUNE_DELAY;
+		} else {
+			goto bad;
+		}
+	} while (parse_literal(&p, ","));
+
+	if (!parse_eoi(p))
+		goto bad;
+
+	*tune = tmp;
+	return;
+bad:
+	die("Invalid socket options '%s'", optarg);
+}
+
 /**
  * fwd_rule_parse() - Parse port configuration option
  * @optname:	Short option name, t, T, u, or U
  * @del:	Delete resulting rules from forwarding table, instead of adding
  * @optarg:	Option argument (port specification)
+ * @tune:	Socket options for resulting rules, NULL for defaults
  * @fwd:	Forwarding table to be updated
  */
 void fwd_rule_parse(char optname, bool del, const char *optarg,
-		    struct fwd_table *fwd)
+		    const struct fwd_tune *tune, struct fwd_table *fwd)
 {
 	const union inany_addr *addr;
 	union inany_addr addr_buf;
@@ -764,11 +1010,13 @@ void fwd_rule_parse(char optname, bool del, const char *optarg,
 
 			if (fwd->caps & FWD_CAP_IPV4) {
 				fwd_rule_parse_ports(fwd, del, proto,
-						     &inany_loopback4, NULL, p);
+						     &inany_loopback4, NULL, p,
+						     tune);
 			}
 			if (fwd->caps & FWD_CAP_IPV6) {
 				fwd_rule_parse_ports(fwd, del, proto,
-						     &inany_loopback6, NULL, p);
+						     &inany_loopback6, NULL, p,
+						     tune);
 			}
 			return;
 		}
@@ -790,7 +1038,8 @@ void fwd_rule_parse(char optname, bool del, const char *optarg,
 		    optname, optarg);
 	}
 
-	fwd_rule_parse_ports(fwd, del, proto, addr, *ifname ? ifname : NULL, p);
+	fwd_rule_parse_ports(fwd, del, proto, addr, *ifname ? ifname : NULL, p,
+			     tune);
 }
 
 /**
@@ -809,6 +1058,13 @@ int fwd_rule_read(int fd, struct fwd_rule *rule)
 	rule->first = ntohs(rule->first);
 	rule->last = ntohs(rule->last);
 	rule->to = ntohs(rule->to);
+	rule->tune.notsent_lowat = ntohl(rule->tune.notsent_lowat);
+	rule->tune.rcvbuf = ntohl(rule->tune.rcvbuf);
+	rule->tune.sndbuf = ntohl(rule->tune.sndbuf);
+	rule->tune.busy_poll = ntohl(rule->tune.busy_poll);
+	rule->tune.max_rate = ntohl(rule->tune.max_rate);
+	rule->tune.priority = ntohs(rule->tune.priority);
+	rule->tune.flags = ntohs(rule->tune.flags);
 
 	return 0;
 }
@@ -828,6 +1084,13 @@ int fwd_rule_write(int fd, const struct fwd_rule *rule)
 	tmp.first = htons(tmp.first);
 	tmp.last = htons(tmp.last);
 	tmp.to = htons(tmp.to);
+	tmp.tune.notsent_lowat = htonl(tmp.tune.notsent_lowat);
+	tmp.tune.rcvbuf = htonl(tmp.tune.rcvbuf);
+	tmp.tune.sndbuf = htonl(tmp.tune.sndbuf);
+	tmp.tune.busy_poll = htonl(tmp.tune.busy_poll);
+	tmp.tune.max_rate = htonl(tmp.tune.max_rate);
+	tmp.tune.priority = htons(tmp.tune.priority);
+	tmp.tune.flags = htons(tmp.tune.flags);
 
 	return write_all_buf(fd, &tmp, sizeof(tmp));
 }
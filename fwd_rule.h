@@ -30,6 +30,35 @@
 #define FWD_CAP_ALL		(FWD_CAP_IPV4 | FWD_CAP_IPV6 | FWD_CAP_TCP | \
 				 FWD_CAP_UDP | FWD_CAP_SCAN | FWD_CAP_IFNAME)
 
+/* Maximum length of congestion control algorithm name, as TCP_CA_NAME_MAX */
+#define FWD_TUNE_CC_SIZE	16
+
+/**
+ * struct fwd_tune - Socket options for sockets of a forwarding rule
+ * @cc:			TCP congestion control algorithm, "" for default
+ * @notsent_lowat:	TCP_NOTSENT_LOWAT, bytes, 0 for default
+ * @rcvbuf:		SO_RCVBUF, bytes, 0 for default
+ * @sndbuf:		SO_SNDBUF, bytes, 0 for default
+ * @busy_poll:		SO_BUSY_POLL, microseconds, 0 for default
+ * @max_rate:		SO_MAX_PACING_RATE, bytes per second, 0 for default
+ * @priority:		SO_PRIORITY, if FWD_TUNE_PRIORITY is set
+ * @flags:		Flag mask
+ *	FWD_TUNE_PRIORITY - Set SO_PRIORITY to @priority
+ *	FWD_TUNE_DELAY - Don't set TCP_NODELAY, enabling Nagle's algorithm
+ */
+struct fwd_tune {
+	char cc[FWD_TUNE_CC_SIZE];
+	uint32_t notsent_lowat;
+	uint32_t rcvbuf;
+	uint32_t sndbuf;
+	uint32_t busy_poll;
+	uint32_t max_rate;
+	uint16_t priority;
+#define FWD_TUNE_PRIORITY	BIT(0)
+#define FWD_TUNE_DELAY		BIT(1)
+	uint16_t flags;
+};
+
 /**
  * struct fwd_rule - Forwarding rule governing a range of ports
  * @addr:	Address to forward from
@@ -43,6 +72,9 @@
  * 	FWD_DUAL_STACK_ANY - match any IPv4 or IPv6 address (@addr should be ::)
  *	FWD_WEAK - Don't give an error if binds fail for some forwards
  *	FWD_SCAN - Only forward if the matching port in the target is listening
+ *	FWD_TPROXY - Single transparent socket on @first, with the whole range
+ *		     redirected to it by TPROXY rules (TCP only)
+ * @tune:	Socket options for listening and connected sockets
  */
 struct fwd_rule {
 	union inany_addr addr;
@@ -55,10 +87,12 @@ struct fwd_rule {
 #define FWD_DUAL_STACK_ANY	BIT(0)
 #define FWD_WEAK		BIT(1)
 #define FWD_SCAN		BIT(2)
+#define FWD_TPROXY		BIT(3)
 	uint8_t flags;
+	struct fwd_tune tune;
 };
 
-#define FWD_RULE_BITS	8
+#define FWD_RULE_BITS	12
 #define MAX_FWD_RULES	MAX_FROM_BITS(FWD_RULE_BITS)
 
 /* Maximum number of listening sockets (per pif)
@@ -91,20 +125,33 @@ struct fwd_table {
 
 void fwd_probe_ephemeral(void);
 
+#define FWD_TUNE_STRLEN					    \
+	(FWD_TUNE_CC_SIZE - 1				    \
+	 + 5 * (UINT32_STRLEN - 1)			    \
+	 + UINT16_STRLEN - 1				    \
+	 + sizeof(" (cc= notsent-lowat= rcvbuf= sndbuf="    \
+		  " busy-poll= max-rate= priority= delay)"))
+
 #define FWD_RULE_STRLEN					    \
 	(IPPROTO_STRLEN - 1				    \
 	 + INANY_ADDRSTRLEN - 1 /* listen addr */	    \
 	 + INANY_ADDRSTRLEN - 1	/* target addr */	    \
 	 + IFNAMSIZ - 1					    \
 	 + 4 * (UINT16_STRLEN - 1)			    \
-	 + sizeof(" []%:-  =>  :- (best effort) (auto-scan)"))
+	 + sizeof(" []%:-  =>  :- (best effort) (auto-scan) (tproxy)") \
+	 + FWD_TUNE_STRLEN - 1)
 
 const union inany_addr *fwd_rule_addr(const struct fwd_rule *rule);
+unsigned fwd_rule_nsocks(const struct fwd_rule *rule);
 const char *fwd_rule_fmt(const struct fwd_rule *rule, char *dst, size_t size);
+void fwd_tune_parse(const char *optarg, struct fwd_tune *tune);
 void fwd_rule_parse(char optname, bool del, const char *optarg,
-		    struct fwd_table *fwd);
+		    const struct fwd_tune *tune, struct fwd_table *fwd);
 int fwd_rule_read(int fd, struct fwd_rule *rule);
 int fwd_rule_write(int fd, const struct fwd_rule *rule);
+bool fwd_rule_unused(const struct fwd_rule *rule);
+int fwd_rule_find(const struct fwd_table *fwd, const struct fwd_rule *rule);
+void fwd_rule_release(struct fwd_table *fwd, unsigned idx);
 void fwd_rule_clear(struct fwd_table *fwd);
 int fwd_rule_add(struct fwd_table *fwd, const struct fwd_rule *new);
 
@@ -28,6 +28,7 @@
 
 #include <linux/icmpv6.h>
 
+#include "checksum.h"
 #include "packet.h"
 #include "util.h"
 #include "ip.h"
@@ -39,10 +40,62 @@
 #include "icmp.h"
 #include "flow_table.h"
 #include "epoll_ctl.h"
+#include "stats.h"
 
 #define ICMP_ECHO_TIMEOUT	60 /* s, timeout for ICMP socket activity */
 #define ICMP_NUM_IDS		(1U << 16)
 #define MAX_IOV_ICMP		16 /* Arbitrary, should be enough */
+#define ICMP_MAX_FRAMES		16 /* Echo replies queued to tap at a time */
+
+/* Static buffers */
+
+/* ICMP header and data of echo replies */
+static char icmp_payload[ICMP_MAX_FRAMES][USHRT_MAX]
+	__attribute__ ((aligned(__alignof__(struct icmp6hdr))));
+
+/* Ethernet headers for IPv4 and IPv6 frames */
+static struct ethhdr icmp_eth_hdr[ICMP_MAX_FRAMES];
+
+/**
+ * struct icmp_meta_t - IP and tap headers for echo replies
+ * @ip6h:	IPv6 header
+ * @ip4h:	IPv4 header
+ * @taph:	Tap backend specific header
+ */
+static struct icmp_meta_t {
+	struct ipv6hdr ip6h;
+	struct iphdr ip4h;
+	struct tap_hdr taph;
+} icmp_meta[ICMP_MAX_FRAMES];
+
+/**
+ * enum icmp_iov_idx - Indices for the buffers making up a single ICMP frame
+ * @ICMP_IOV_TAP:	tap specific header
+ * @ICMP_IOV_ETH:	Ethernet header
+ * @ICMP_IOV_IP:	IP (v4/v6) header
+ * @ICMP_IOV_PAYLOAD:	IP payload (ICMP header + data)
+ * @ICMP_IOV_ETH_PAD:	Ethernet (802.3) padding to 60 bytes
+ * @ICMP_NUM_IOVS:	the number of entries in the iovec array
+ */
+enum icmp_iov_idx {
+	ICMP_IOV_TAP,
+	ICMP_IOV_ETH,
+	ICMP_IOV_IP,
+	ICMP_IOV_PAYLOAD,
+	ICMP_IOV_ETH_PAD,
+	ICMP_NUM_IOVS,
+};
+
+/* IOVs, msghdr array and source addresses for receiving echo replies */
+static struct iovec		icmp_iov_recv		[ICMP_MAX_FRAMES];
+static struct mmsghdr		icmp_mh_recv		[ICMP_MAX_FRAMES];
+static union sockaddr_inany	icmp_addr_recv		[ICMP_MAX_FRAMES];
+
+/* IOVs for L2 frames */
+static struct iovec		icmp_l2_iov	[ICMP_MAX_FRAMES][ICMP_NUM_IOVS];
+
+/* Number of echo replies queued to tap */
+static unsigned icmp_frames_used;
 
 /**
  * ping_at_sidx() - Get ping specific flow at given sidx
@@ -63,37 +116,108 @@ static struct icmp_ping_flow *ping_at_sidx(flow_sidx_t sidx)
 }
 
 /**
- * icmp_sock_handler() - Handle new data from ICMP or ICMPv6 socket
+ * icmp_update_l2_buf() - Update L2 buffers with Ethernet destination address
+ * @eth_d:	Ethernet destination address, NULL if unchanged
+ */
+void icmp_update_l2_buf(const unsigned char *eth_d)
+{
+	int i;
+
+	for (i = 0; i < ICMP_MAX_FRAMES; i++)
+		eth_update_mac(&icmp_eth_hdr[i], eth_d, NULL);
+}
+
+/**
+ * icmp_flush() - Send out echo replies queued for the tap
  * @c:		Execution context
- * @ref:	epoll reference
- * @now:	Current timestamp
  */
-void icmp_sock_handler(const struct ctx *c, union epoll_ref ref,
-		       const struct timespec *now)
+void icmp_flush(const struct ctx *c)
+{
+	if (!icmp_frames_used)
+		return;
+
+	tap_send_frames(c, &icmp_l2_iov[0][0], ICMP_NUM_IOVS, icmp_frames_used);
+	icmp_frames_used = 0;
+}
+
+/**
+ * icmp_tap_prepare() - Prepare L2 frame for echo reply in queue
+ * @c:		Execution context
+ * @pingf:	Ping flow the reply belongs to
+ * @idx:	Index of frame, and of receiving buffer holding the reply
+ * @l4len:	Length of reply, including ICMP header
+ */
+static void icmp_tap_prepare(const struct ctx *c,
+			     const struct icmp_ping_flow *pingf,
+			     unsigned idx, size_t l4len)
 {
-	struct icmp_ping_flow *pingf = ping_at_sidx(ref.flowside);
 	const struct flowside *ini = &pingf->f.side[INISIDE];
-	union sockaddr_inany sr;
-	socklen_t sl = sizeof(sr);
-	char buf[USHRT_MAX];
-	uint16_t seq;
-	ssize_t n;
+	struct iovec *tiov = icmp_l2_iov[idx];
+	struct icmp_meta_t *bm = &icmp_meta[idx];
+	struct ethhdr *eh = &icmp_eth_hdr[idx];
+	void *l4h = icmp_iov_recv[idx].iov_base;
+	size_t l2len;
 
-	if (c->no_icmp)
-		return;
+	eth_update_mac(eh, NULL, pingf->f.tap_omac);
 
-	assert(pingf);
+	if (pingf->f.type == FLOW_PING4) {
+		const struct in_addr *saddr = inany_v4(&ini->oaddr);
+		const struct in_addr *daddr = inany_v4(&ini->eaddr);
+		struct icmphdr *ih4 = l4h;
 
-	n = recvfrom(ref.fd, buf, sizeof(buf), 0, &sr.sa, &sl);
-	if (n < 0) {
-		flow_perror_ratelimit(pingf, now, "recvfrom() error");
-		return;
+		assert(saddr && daddr); /* Must have IPv4 addresses */
+		tap_push_ip4h(&bm->ip4h, *saddr, *daddr, l4len, IPPROTO_ICMP);
+		csum_icmp4(ih4, ih4 + 1, l4len - sizeof(*ih4));
+
+		eh->h_proto = htons_constant(ETH_P_IP);
+		tiov[ICMP_IOV_IP] = IOV_OF_LVALUE(bm->ip4h);
+	} else {
+		const struct in6_addr *saddr = &ini->oaddr.a6;
+		const struct in6_addr *daddr = &ini->eaddr.a6;
+		struct icmp6hdr *ih6 = l4h;
+
+		tap_push_ip6h(&bm->ip6h, saddr, daddr, l4len,
+			      IPPROTO_ICMPV6, 0);
+		csum_icmp6(ih6, saddr, daddr, ih6 + 1,
+			   l4len - sizeof(*ih6));
+
+		eh->h_proto = htons_constant(ETH_P_IPV6);
+		tiov[ICMP_IOV_IP] = IOV_OF_LVALUE(bm->ip6h);
 	}
 
+	tiov[ICMP_IOV_PAYLOAD].iov_base = l4h;
+	tiov[ICMP_IOV_PAYLOAD].iov_len = l4len;
+
+	l2len = tiov[ICMP_IOV_ETH].iov_len + tiov[ICMP_IOV_IP].iov_len + l4len;
+	tiov[ICMP_IOV_ETH_PAD].iov_len = l2len < ETH_ZLEN ? ETH_ZLEN - l2len
+							  : 0;
+	tap_hdr_update(c, &bm->taph, MAX(l2len, ETH_ZLEN));
+}
+
+/**
+ * icmp_sock_reply() - Check and adjust one echo reply from ping socket
+ * @c:		Execution context
+ * @pingf:	Ping flow the reply belongs to
+ * @idx:	Index of receiving buffer holding the reply
+ * @now:	Current timestamp
+ *
+ * Return: true if the reply should be forwarded to the tap, false otherwise
+ */
+static bool icmp_sock_reply(const struct ctx *c, struct icmp_ping_flow *pingf,
+			    unsigned idx, const struct timespec *now)
+{
+	const struct flowside *ini = &pingf->f.side[INISIDE];
+	size_t n = icmp_mh_recv[idx].msg_len;
+	void *buf = icmp_iov_recv[idx].iov_base;
+	sa_family_t af = icmp_addr_recv[idx].sa_family;
+	uint16_t seq;
+
+	stats_rx(pingf->f.pif[TGTSIDE], PESTO_STATS_ICMP, 1, n);
+
 	if (pingf->f.type == FLOW_PING4) {
-		struct icmphdr *ih4 = (struct icmphdr *)buf;
+		struct icmphdr *ih4 = buf;
 
-		if (sr.sa_family != AF_INET || (size_t)n < sizeof(*ih4) ||
+		if (af != AF_INET || n < sizeof(*ih4) ||
 		    ih4->type != ICMP_ECHOREPLY)
 			goto unexpected;
 
@@ -101,9 +225,9 @@ void icmp_sock_handler(const struct ctx *c, union epoll_ref ref,
 		ih4->un.echo.id = htons(ini->eport);
 		seq = ntohs(ih4->un.echo.sequence);
 	} else if (pingf->f.type == FLOW_PING6) {
-		struct icmp6hdr *ih6 = (struct icmp6hdr *)buf;
+		struct icmp6hdr *ih6 = buf;
 
-		if (sr.sa_family != AF_INET6 || (size_t)n < sizeof(*ih6) ||
+		if (af != AF_INET6 || n < sizeof(*ih6) ||
 		    ih6->icmp6_type != ICMPV6_ECHO_REPLY)
 			goto unexpected;
 
@@ -116,8 +240,10 @@ void icmp_sock_handler(const struct ctx *c, union epoll_ref ref,
 
 	/* In PASTA mode, we'll get any reply we send, discard them. */
 	if (c->mode == MODE_PASTA) {
-		if (pingf->seq == seq)
-			return;
+		if (pingf->seq == seq) {
+			stats_drop(pingf->f.pif[TGTSIDE], PESTO_STATS_ICMP, 1);
+			return false;
+		}
 
 		pingf->seq = seq;
 	}
@@ -125,26 +251,94 @@ void icmp_sock_handler(const struct ctx *c, union epoll_ref ref,
 	flow_dbg(pingf, "echo reply to tap, ID: %"PRIu16", seq: %"PRIu16,
 		 ini->eport, seq);
 
-	/* Check if neighbour table has a recorded MAC address */
-	if (MAC_IS_UNDEF(pingf->f.tap_omac))
-		fwd_neigh_mac_get(c, &ini->oaddr, pingf->f.tap_omac);
+	return true;
 
-	if (pingf->f.type == FLOW_PING4) {
-		const struct in_addr *saddr = inany_v4(&ini->oaddr);
-		const struct in_addr *daddr = inany_v4(&ini->eaddr);
+unexpected:
+	stats_drop(pingf->f.pif[TGTSIDE], PESTO_STATS_ICMP, 1);
+	flow_err_ratelimit(pingf, now, "Unexpected packet on ping socket");
+	return false;
+}
 
-		assert(saddr && daddr); /* Must have IPv4 addresses */
-		tap_icmp4_send(c, *saddr, *daddr, buf, pingf->f.tap_omac, n);
-	} else if (pingf->f.type == FLOW_PING6) {
-		const struct in6_addr *saddr = &ini->oaddr.a6;
-		const struct in6_addr *daddr = &ini->eaddr.a6;
+/**
+ * icmp_sock_handler() - Handle new data from ICMP or ICMPv6 socket
+ * @c:		Execution context
+ * @ref:	epoll reference
+ * @now:	Current timestamp
+ *
+ * Replies are queued, together with replies from other ping sockets, and sent
+ * to the tap by icmp_flush(), once we're done with the current batch of events,
+ * or once the queue is full. With vhost-user, they are sent right away.
+ *
+ * #syscalls recvmmsg
+ */
+void icmp_sock_handler(const struct ctx *c, union epoll_ref ref,
+		       const struct timespec *now)
+{
+	struct icmp_ping_flow *pingf = ping_at_sidx(ref.flowside);
+	const struct flowside *ini;
+	unsigned i, first;
+	int n;
+
+	if (c->no_icmp)
+		return;
 
-		tap_icmp6_send(c, saddr, daddr, buf, pingf->f.tap_omac, n);
+	assert(pingf);
+	ini = &pingf->f.side[INISIDE];
+
+	if (icmp_frames_used == ICMP_MAX_FRAMES)
+		icmp_flush(c);
+
+	first = icmp_frames_used;
+	n = recvmmsg(ref.fd, icmp_mh_recv + first, ICMP_MAX_FRAMES - first, 0,
+		     NULL);
+	if (n < 0) {
+		flow_perror_ratelimit(pingf, now, "recvmmsg() error");
+		return;
 	}
-	return;
 
-unexpected:
-	flow_err_ratelimit(pingf, now, "Unexpected packet on ping socket");
+	/* Check if neighbour table has a recorded MAC address */
+	if (MAC_IS_UNDEF(pingf->f.tap_omac))
+		fwd_neigh_mac_get(c, &ini->oaddr, pingf->f.tap_omac);
+
+	for (i = first; i < first + n; i++) {
+		if (!icmp_sock_reply(c, pingf, i, now))
+			continue;
+
+		if (c->mode == MODE_VU) {
+			void *buf = icmp_iov_recv[i].iov_base;
+			size_t l4len = icmp_mh_recv[i].msg_len;
+
+			if (pingf->f.type == FLOW_PING4) {
+				const struct in_addr *saddr, *daddr;
+
+				saddr = inany_v4(&ini->oaddr);
+				daddr = inany_v4(&ini->eaddr);
+				assert(saddr && daddr);
+				tap_icmp4_send(c, *saddr, *daddr, buf,
+					       pingf->f.tap_omac, l4len);
+			} else {
+				tap_icmp6_send(c, &ini->oaddr.a6,
+					       &ini->eaddr.a6, buf,
+					       pingf->f.tap_omac, l4len);
+			}
+			continue;
+		}
+
+		/* Keep queued replies contiguous, swapping buffers over
+		 * discarded ones
+		 */
+		if (i != icmp_frames_used) {
+			void *buf = icmp_iov_recv[i].iov_base;
+
+			icmp_iov_recv[i].iov_base =
+				icmp_iov_recv[icmp_frames_used].iov_base;
+			icmp_iov_recv[icmp_frames_used].iov_base = buf;
+		}
+
+		icmp_tap_prepare(c, pingf, icmp_frames_used,
+				 icmp_mh_recv[i].msg_len);
+		icmp_frames_used++;
+	}
 }
 
 /**
@@ -215,7 +409,7 @@ static struct icmp_ping_flow *icmp_ping_new(const struct ctx *c,
 	if (pingf->sock > FD_REF_MAX)
 		goto cancel;
 
-	flow_epollid_set(&pingf->f, EPOLLFD_ID_DEFAULT);
+	flow_epollid_assign(c, &pingf->f);
 	if (flow_epoll_set(&pingf->f, EPOLL_CTL_ADD, EPOLLIN, pingf->sock,
 			   TGTSIDE) < 0) {
 		close(pingf->sock);
@@ -305,7 +499,8 @@ int icmp_tap_handler(const struct ctx *c, uint8_t pif, sa_family_t af,
 
 	if (flow)
 		pingf = &flow->ping;
-	else if (!(pingf = icmp_ping_new(c, af, id, saddr, daddr, now)))
+	else if (!flow_admit(c, af, saddr, now) ||
+		 !(pingf = icmp_ping_new(c, af, id, saddr, daddr, now)))
 		return 1;
 
 	tgt = &pingf->f.side[TGTSIDE];
@@ -345,9 +540,34 @@ int icmp_tap_handler(const struct ctx *c, uint8_t pif, sa_family_t af,
 bool icmp_ping_timer(const struct ctx *c, const struct icmp_ping_flow *pingf,
 		     const struct timespec *now)
 {
-	if (now->tv_sec - pingf->ts <= ICMP_ECHO_TIMEOUT)
+	if (now->tv_sec - pingf->ts <= flow_timeout(ICMP_ECHO_TIMEOUT))
 		return false;
 
 	icmp_ping_close(c, pingf);
 	return true;
 }
+
+/**
+ * icmp_init() - Initialise scatter-gather buffers for echo replies
+ * @c:		Execution context
+ */
+void icmp_init(const struct ctx *c)
+{
+	unsigned i;
+
+	for (i = 0; i < ICMP_MAX_FRAMES; i++) {
+		struct iovec *tiov = icmp_l2_iov[i];
+
+		icmp_iov_recv[i] = IOV_OF_LVALUE(icmp_payload[i]);
+		icmp_mh_recv[i].msg_hdr = (struct msghdr) {
+			.msg_name	= &icmp_addr_recv[i],
+			.msg_namelen	= sizeof(icmp_addr_recv[i]),
+			.msg_iov	= &icmp_iov_recv[i],
+			.msg_iovlen	= 1,
+		};
+
+		tiov[ICMP_IOV_TAP] = tap_hdr_iov(c, &icmp_meta[i].taph);
+		tiov[ICMP_IOV_ETH] = IOV_OF_LVALUE(icmp_eth_hdr[i]);
+		tiov[ICMP_IOV_ETH_PAD].iov_base = eth_pad;
+	}
+}
@@ -18,7 +18,9 @@ void icmp_sock_handler(const struct ctx *c, union epoll_ref ref,
 int icmp_tap_handler(const struct ctx *c, uint8_t pif, sa_family_t af,
 		     const void *saddr, const void *daddr,
 		     struct iov_tail *data, const struct timespec *now);
-void icmp_init(void);
+void icmp_update_l2_buf(const unsigned char *eth_d);
+void icmp_flush(const struct ctx *c);
+void icmp_init(const struct ctx *c);
 
 
 #endif /* ICMP_H */
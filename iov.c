@@ -28,7 +28,7 @@
 #include "iov.h"
 
 /**
- * iov_skip_bytes() - Find index and offset in iovec array given byte offset
+ * iov_skip_bytes_slow() - Find index and offset in iovec array, generic case
  * @iov:	iovec array
  * @n:		Number of entries in @iov
  * @skip:	Byte offset: leading bytes of @iov to skip
@@ -37,8 +37,8 @@
  * Return: index of iovec array containing the @skip byte counted as if buffers
  *	   were contiguous. If iovec has less than @skip bytes, return @n.
  */
-size_t iov_skip_bytes(const struct iovec *iov, size_t n,
-		      size_t skip, size_t *offset)
+size_t iov_skip_bytes_slow(const struct iovec *iov, size_t n,
+			   size_t skip, size_t *offset)
 {
 	size_t off = skip, i;
 
@@ -328,7 +328,7 @@ static void *iov_check_header(struct iov_tail *tail, size_t len, size_t align)
 }
 
 /**
- * iov_peek_header_() - Get pointer to a header from an IOV tail
+ * iov_peek_header_slow() - Get pointer to a header from an IOV tail, generic
  * @tail:	IOV tail to get header from
  * @v:		Temporary memory to use if the memory in @tail
  *		is discontinuous
@@ -342,8 +342,8 @@ static void *iov_check_header(struct iov_tail *tail, size_t len, size_t align)
  *         doesn't have the requested alignment. NULL if that overruns the
  *         IO vector.
  */
-/* cppcheck-suppress [staticFunction,unmatchedSuppression] */
-void *iov_peek_header_(struct iov_tail *tail, void *v, size_t len, size_t align)
+void *iov_peek_header_slow(struct iov_tail *tail, void *v, size_t len,
+			   size_t align)
 {
 	char *p = iov_check_header(tail, len, align);
 	size_t l;
@@ -388,34 +388,6 @@ size_t iov_push_header_(struct iov_tail *tail, const void *v, size_t len)
 	return l;
 }
 
-/**
- * iov_remove_header_() - Remove a header from an IOV tail
- * @tail:	IOV tail to remove header from (modified)
- * @v:		Temporary memory to use if the memory in @tail
- *		is discontinuous
- * @len:	Length of header to remove, in bytes
- * @align:	Required alignment of header, in bytes
- *
- * On success, @tail is updated so that it longer includes the bytes of the
- * returned header.
- *
- * Return: pointer to the first @len logical bytes of the tail, or to
- *         a copy if that overruns the IO vector, is not contiguous or
- *         doesn't have the requested alignment. NULL if that overruns the
- *         IO vector.
- */
-void *iov_remove_header_(struct iov_tail *tail, void *v, size_t len, size_t align)
-{
-	char *p = iov_peek_header_(tail, v, len, align);
-
-	if (!p)
-		return NULL;
-
-	tail->off = tail->off + len;
-
-	return p;
-}
-
 /**
  * iov_tail_clone() - Clone an iov tail into a new iovec array
  *
@@ -16,14 +16,16 @@
 #define IOVEC_H
 
 #include <stdbool.h>
+#include <stdint.h>
 #include <string.h>
 #include <unistd.h>
+#include <sys/uio.h>
 
 #define IOV_OF_LVALUE(lval) \
 	(struct iovec){ .iov_base = &(lval), .iov_len = sizeof(lval) }
 
-size_t iov_skip_bytes(const struct iovec *iov, size_t n,
-		      size_t skip, size_t *offset);
+size_t iov_skip_bytes_slow(const struct iovec *iov, size_t n,
+			   size_t skip, size_t *offset);
 size_t iov_from_buf(const struct iovec *iov, size_t iov_cnt,
 		    size_t offset, const void *buf, size_t bytes);
 size_t iov_to_buf(const struct iovec *iov, size_t iov_cnt,
@@ -36,6 +38,30 @@ size_t iov_memcpy(struct iovec *dst_iov, size_t dst_iov_cnt, size_t dst_offset,
 		  const struct iovec *src_iov, size_t src_iov_cnt,
 		  size_t src_offset, size_t length);
 
+/**
+ * iov_skip_bytes() - Find index and offset in iovec array given byte offset
+ * @iov:	iovec array
+ * @n:		Number of entries in @iov
+ * @skip:	Byte offset: leading bytes of @iov to skip
+ * @offset:	Offset within matching @iov entry, set on return, can be NULL
+ *
+ * Inline for the common case of an offset within the first entry.
+ *
+ * Return: index of iovec array containing the @skip byte counted as if buffers
+ *	   were contiguous. If iovec has less than @skip bytes, return @n.
+ */
+static inline size_t iov_skip_bytes(const struct iovec *iov, size_t n,
+				    size_t skip, size_t *offset)
+{
+	if (n && skip < iov[0].iov_len) {
+		if (offset)
+			*offset = skip;
+		return 0;
+	}
+
+	return iov_skip_bytes_slow(iov, n, skip, offset);
+}
+
 /*
  * DOC: Theory of Operation, struct iov_tail
  *
@@ -92,14 +118,73 @@ struct iov_tail {
 bool iov_tail_prune(struct iov_tail *tail);
 size_t iov_tail_size(struct iov_tail *tail);
 bool iov_drop_header(struct iov_tail *tail, size_t len);
-void *iov_peek_header_(struct iov_tail *tail, void *v, size_t len, size_t align);
+void *iov_peek_header_slow(struct iov_tail *tail, void *v, size_t len,
+			   size_t align);
 size_t iov_push_header_(struct iov_tail *tail, const void *v, size_t len);
-void *iov_remove_header_(struct iov_tail *tail, void *v, size_t len, size_t align);
 ssize_t iov_tail_clone(struct iovec *dst_iov, size_t dst_iov_cnt,
 		       struct iov_tail *tail);
 bool iov_tail_trim(struct iov_tail *tail, size_t len,
 		   struct iovec *scratch, size_t scratch_cnt);
 
+/**
+ * iov_peek_header_() - Get pointer to a header from an IOV tail
+ * @tail:	IOV tail to get header from
+ * @v:		Temporary memory to use if the memory in @tail
+ *		is discontinuous
+ * @len:	Length of header to get, in bytes
+ * @align:	Required alignment of header, in bytes
+ *
+ * Inline for tails with a single buffer, as frames from pkt_buf in passt and
+ * pasta modes, see iov_peek_header_slow() for anything else.
+ *
+ * Return: pointer to the first @len logical bytes of the tail, or to
+ *         a copy if that overruns the IO vector, is not contiguous or
+ *         doesn't have the requested alignment. NULL if that overruns the
+ *         IO vector.
+ */
+static inline void *iov_peek_header_(struct iov_tail *tail, void *v,
+				     size_t len, size_t align)
+{
+	if (tail->cnt == 1 && tail->off <= tail->iov[0].iov_len &&
+	    len <= tail->iov[0].iov_len - tail->off) {
+		char *p = (char *)tail->iov[0].iov_base + tail->off;
+
+		if (!((uintptr_t)p % align))
+			return p;
+	}
+
+	return iov_peek_header_slow(tail, v, len, align);
+}
+
+/**
+ * iov_remove_header_() - Remove a header from an IOV tail
+ * @tail:	IOV tail to remove header from (modified)
+ * @v:		Temporary memory to use if the memory in @tail
+ *		is discontinuous
+ * @len:	Length of header to remove, in bytes
+ * @align:	Required alignment of header, in bytes
+ *
+ * On success, @tail is updated so that it longer includes the bytes of the
+ * returned header.
+ *
+ * Return: pointer to the first @len logical bytes of the tail, or to
+ *         a copy if that overruns the IO vector, is not contiguous or
+ *         doesn't have the requested alignment. NULL if that overruns the
+ *         IO vector.
+ */
+static inline void *iov_remove_header_(struct iov_tail *tail, void *v,
+				       size_t len, size_t align)
+{
+	char *p = iov_peek_header_(tail, v, len, align);
+
+	if (!p)
+		return NULL;
+
+	tail->off = tail->off + len;
+
+	return p;
+}
+
 /**
  * IOV_PEEK_HEADER() - Get typed pointer to a header from an IOV tail
  * @tail_:	IOV tail to get header from
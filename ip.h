@@ -117,6 +117,28 @@ static inline uint32_t ip6_get_flow_lbl(const struct ipv6hdr *ip6h)
 		ip6h->flow_lbl[2];
 }
 
+/**
+ * ip6_get_ecn() - Get ECN field from an IPv6 header
+ * @ip6h:	Pointer to IPv6 header
+ *
+ * Return: ECN field, low two bits of the traffic class of @ip6h
+ */
+static inline uint8_t ip6_get_ecn(const struct ipv6hdr *ip6h)
+{
+	return (ip6h->flow_lbl[0] >> 4) & IPTOS_ECN_MASK;
+}
+
+/**
+ * ip6_set_ecn() - Set ECN field in an IPv6 header
+ * @ip6h:	Pointer to IPv6 header, updated
+ * @ecn:	ECN field, only the low two bits are used
+ */
+static inline void ip6_set_ecn(struct ipv6hdr *ip6h, uint8_t ecn)
+{
+	ip6h->flow_lbl[0] &= ~(IPTOS_ECN_MASK << 4);
+	ip6h->flow_lbl[0] |= (ecn & IPTOS_ECN_MASK) << 4;
+}
+
 #define IPPROTO_STRLEN		(sizeof("<unknown protocol>"))
 const char *ipproto_name(uint8_t proto);
 
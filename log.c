@@ -30,6 +30,10 @@
 #include "log.h"
 #include "util.h"
 #include "passt.h"
+#include "stats.h"
+
+#define LL_STRLEN	(sizeof("-9223372036854775808"))
+#define LOGTIME_STRLEN	(LL_STRLEN + 5)
 
 static int	log_sock = -1;		/* Optional socket to system logger */
 static char	log_ident[BUFSIZ];	/* Identifier string for openlog() */
@@ -41,15 +45,20 @@ static size_t	log_written;		/* Currently used bytes in log file */
 static size_t	log_cut_size;		/* Bytes to cut at start on rotation */
 static char	log_header[BUFSIZ];	/* File header, written back on cuts */
 
+/* Messages for log file, written out in one go by logfile_flush() */
+#define LOG_BUF_SIZE	(64 * 1024)
+#define LOG_DROPPED_LEN	(LOGTIME_STRLEN + 64)	/* Room for dropped count */
+static char	log_buf[LOG_BUF_SIZE + LOG_DROPPED_LEN];
+static size_t	log_buf_used;
+static size_t	log_buf_max;		/* Bytes we buffer, up to log_cut_size */
+static unsigned	log_dropped;		/* Messages dropped as buffer was full */
+
 struct timespec	log_start;		/* Start timestamp */
 
 int		log_trace;		/* --trace mode enabled */
 bool		log_conf_parsed;	/* Logging options already parsed */
 bool		log_stderr = true;	/* Not daemonised, no shell spawned */
 
-#define LL_STRLEN	(sizeof("-9223372036854775808"))
-#define LOGTIME_STRLEN	(LL_STRLEN + 5)
-
 /**
  * logtime() - Get the current time for logging purposes
  * @ts:		Buffer into which to store the timestamp
@@ -218,7 +227,45 @@ static int logfile_rotate(int fd, const struct timespec *now)
 }
 
 /**
- * logfile_write() - Write entry to log file, trigger rotation if full
+ * logfile_flush() - Write out pending log file entries, rotate file if needed
+ *
+ * Called before the main loop sleeps and on exit, so that rotating the file
+ * doesn't happen in the middle of packet processing, and right away for errors,
+ * which are rare, and might be the last thing we log before an abort.
+ */
+void logfile_flush(void)
+{
+	const struct timespec *now;
+	struct timespec ts;
+	ssize_t n;
+
+	if (log_file == -1 || (!log_buf_used && !log_dropped))
+		return;
+
+	now = logtime(&ts);
+
+	if (log_dropped) {
+		n = logtime_fmt(log_buf + log_buf_used, LOG_DROPPED_LEN, now);
+		n += snprintf(log_buf + log_buf_used + n, LOG_DROPPED_LEN - n,
+			      ": (dropped %u messages)\n", log_dropped);
+		log_buf_used += MIN(n, LOG_DROPPED_LEN - 1);
+		log_dropped = 0;
+	}
+
+	if (log_written + log_buf_used >= log_size &&
+	    logfile_rotate(log_file, now)) {
+		log_buf_used = 0;
+		return;
+	}
+
+	if ((n = write(log_file, log_buf, log_buf_used)) >= 0)
+		log_written += n;
+
+	log_buf_used = 0;
+}
+
+/**
+ * logfile_write() - Buffer entry for log file, write out previous ones if full
  * @newline:	Append newline at the end of the message, if missing
  * @cont:	Continuation of a previous message, on the same line
  * @pri:	Facility and level map, same as priority for vsyslog()
@@ -243,11 +290,32 @@ static void logfile_write(bool newline, bool cont, int pri,
 	if (newline && format[strlen(format)] != '\n')
 		n += snprintf(buf + n, BUFSIZ - n, "\n");
 
-	if ((log_written + n >= log_size) && logfile_rotate(log_file, now))
-		return;
+	n = MIN(n, BUFSIZ - 1);
 
-	if ((n = write(log_file, buf, n)) >= 0)
-		log_written += n;
+	if (log_buf_used + n > log_buf_max) {
+		ssize_t rc;
+
+		/* Writing out the buffer now would need a rotation: leave that
+		 * to logfile_flush(), outside of packet processing, and drop
+		 * this message instead.
+		 */
+		if (log_dropped || log_written + log_buf_used >= log_size) {
+			log_dropped++;
+			return;
+		}
+
+		if ((rc = write(log_file, log_buf, log_buf_used)) >= 0)
+			log_written += rc;
+		log_buf_used = 0;
+	}
+
+	memcpy(log_buf + log_buf_used, buf, n);
+	log_buf_used += n;
+	stats_mem_peak(STATS_MEM_LOG, log_buf_used);
+
+	/* Errors might precede an exit or abort: don't leave them pending */
+	if (LOG_PRI(pri) <= LOG_ERR)
+		logfile_flush();
 }
 
 /**
@@ -428,4 +496,7 @@ void logfile_init(const char *name, const char *path, size_t size)
 
 	/* For FALLOC_FL_COLLAPSE_RANGE: VFS block size can be up to one page */
 	log_cut_size = ROUND_UP(log_size * LOGFILE_CUT_RATIO / 100, PAGE_SIZE);
+
+	/* A single rotation always makes room for a full buffer */
+	log_buf_max = MIN(LOG_BUF_SIZE, log_cut_size - LOG_DROPPED_LEN);
 }
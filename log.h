@@ -157,6 +157,7 @@ void trace_init(int enable);
 
 void __openlog(const char *ident, int option, int facility);
 void logfile_init(const char *name, const char *path, size_t size);
+void logfile_flush(void);
 void __setlogmask(int mask);
 
 #endif /* !PESTO */
@@ -13,6 +13,7 @@
  */
 
 #include <errno.h>
+#include <fcntl.h>
 #include <sys/uio.h>
 
 #include "util.h"
@@ -25,10 +26,14 @@
 #include "migrate.h"
 #include "repair.h"
 #include "serialise.h"
+#include "stats.h"
 
 /* Magic identifier for migration data */
 #define MIGRATE_MAGIC		0xB1BB1D1B0BB1D1B0
 
+/* Capacity we try to set for the migration pipe: default maximum for users */
+#define MIGRATE_PIPE_SIZE	(1 << 20)
+
 /**
  * struct migrate_seen_addrs_v2 - Migratable guest addresses for v2 state stream
  * @addr6:	Observed guest IPv6 address
@@ -71,6 +76,8 @@ static int seen_addrs_source_v2(struct ctx *c,
 	if (write_all_buf(fd, &addrs, sizeof(addrs)))
 		return errno;
 
+	passt_stats.migrate.bytes += sizeof(addrs);
+
 	return 0;
 }
 
@@ -95,6 +102,8 @@ static int seen_addrs_target_v2(struct ctx *c,
 	if (read_all_buf(fd, &addrs, sizeof(addrs)))
 		return errno;
 
+	passt_stats.migrate.bytes += sizeof(addrs);
+
 	c->ip6.addr_seen = addrs.addr6;
 	c->ip6.addr_ll_seen = addrs.addr6_ll;
 	c->ip4.addr_seen = addrs.addr4;
@@ -112,6 +121,7 @@ static const struct migrate_stage stages_v2[] = {
 	},
 	{
 		.name = "prepare flows",
+		.prepare = flow_migrate_source_early,
 		.source = flow_migrate_source_pre,
 		.target = NULL,
 	},
@@ -123,6 +133,9 @@ static const struct migrate_stage stages_v2[] = {
 	{ 0 },
 };
 
+static_assert(ARRAY_SIZE(stages_v2) - 1 <= STATS_MIGRATE_STAGES,
+	      "Too many migration stages to keep timings for");
+
 /* Supported encoding versions, from latest (most preferred) to oldest */
 static const struct migrate_version versions[] = {
 	{ 2,	stages_v2, },
@@ -135,6 +148,25 @@ static const struct migrate_version versions[] = {
 /* Current encoding version */
 #define CURRENT_VERSION		(&versions[0])
 
+/**
+ * migrate_stage_done() - Account and report time spent in a migration stage
+ * @v:		Version the stage belongs to
+ * @s:		Completed stage
+ * @side:	"Source" or "Target", for logging
+ * @start:	Timestamp taken as the stage started
+ */
+static void migrate_stage_done(const struct migrate_version *v,
+			       const struct migrate_stage *s, const char *side,
+			       const struct timespec *start)
+{
+	uint64_t ns = stats_ns_since(start);
+
+	passt_stats.migrate.stage_ns[s - v->s] = ns;
+
+	info("%s migration stage %s: %" PRIu64 " us", side, s->name,
+	     ns / 1000);
+}
+
 /**
  * migrate_source() - Migration as source, send state to hypervisor
  * @c:		Execution context
@@ -160,17 +192,25 @@ static int migrate_source(struct ctx *c, int fd, const struct timespec *now)
 		return ret;
 	}
 
+	passt_stats.migrate.bytes += sizeof(header);
+
 	for (s = v->s; s->name; s++) {
+		struct timespec start;
+
 		if (!s->source)
 			continue;
 
 		debug("Source side migration stage: %s", s->name);
 
+		clock_gettime(CLOCK_MONOTONIC, &start);
+
 		if ((ret = s->source(c, s, fd, now))) {
 			err("Source migration stage: %s: %s, abort", s->name,
 			    strerror_(ret));
 			return ret;
 		}
+
+		migrate_stage_done(v, s, "Source", &start);
 	}
 
 	return 0;
@@ -191,6 +231,8 @@ static const struct migrate_version *migrate_target_read_header(int fd)
 	if (read_all_buf(fd, &h, sizeof(h)))
 		return NULL;
 
+	passt_stats.migrate.bytes += sizeof(h);
+
 	id = ntohl(h.version);
 	compat_id = ntohl(h.compat_version);
 
@@ -230,16 +272,22 @@ static int migrate_target(struct ctx *c, int fd, const struct timespec *now)
 		return errno;
 
 	for (s = v->s; s->name; s++) {
+		struct timespec start;
+
 		if (!s->target)
 			continue;
 
 		debug("Target side migration stage: %s", s->name);
 
+		clock_gettime(CLOCK_MONOTONIC, &start);
+
 		if ((ret = s->target(c, s, fd, now))) {
 			err("Target migration stage: %s: %s, abort", s->name,
 			    strerror_(ret));
 			return ret;
 		}
+
+		migrate_stage_done(v, s, "Target", &start);
 	}
 
 	return 0;
@@ -270,11 +318,40 @@ void migrate_close(struct ctx *c)
 	repair_close(c);
 }
 
+/**
+ * migrate_prepare() - Run preparation steps while the guest is still running
+ * @c:		Execution context
+ *
+ * The device state is only transferred once the guest is stopped, in a single
+ * pass, so we can't send anything ahead of time. We can, however, move any
+ * setup work out of the downtime window.
+ */
+void migrate_prepare(struct ctx *c)
+{
+	const struct migrate_version *v = CURRENT_VERSION;
+	const struct migrate_stage *s;
+	int ret;
+
+	for (s = v->s; s->name; s++) {
+		if (!s->prepare)
+			continue;
+
+		debug("Migration preparation stage: %s", s->name);
+
+		/* Not fatal: the stage is simply repeated later, if needed */
+		if ((ret = s->prepare(c, s)))
+			debug("Migration preparation stage: %s: %s", s->name,
+			      strerror_(ret));
+	}
+}
+
 /**
  * migrate_request() - Request a migration of device state
  * @c:		Execution context
  * @fd:		fd to transfer state
  * @target:	Are we the target of the migration?
+ *
+ * #syscalls:vu fcntl arm:fcntl64 ppc64:fcntl64|fcntl i686:fcntl64
  */
 void migrate_request(struct ctx *c, int fd, bool target)
 {
@@ -283,6 +360,14 @@ void migrate_request(struct ctx *c, int fd, bool target)
 	if (c->device_state_fd != -1)
 		migrate_close(c);
 
+	/* The channel is usually a pipe: with a larger one, we can keep dumping
+	 * TCP queues while the other side is still reading, or keep restoring
+	 * them while it's writing, instead of waiting on each other
+	 */
+	if (fcntl(fd, F_SETPIPE_SZ, MIGRATE_PIPE_SIZE) < 0)
+		debug_perror("Can't set migration pipe size to %i",
+			     MIGRATE_PIPE_SIZE);
+
 	c->device_state_fd = fd;
 	c->migrate_target = target;
 }
@@ -291,9 +376,14 @@ void migrate_request(struct ctx *c, int fd, bool target)
  * migrate_handler() - Send/receive passt internal state to/from hypervisor
  * @c:		Execution context
  * @now:	Current timestamp
+ *
+ * Timings, flow and byte counts, and repair helper round-trips for the state
+ * transfer are kept in passt_stats.migrate, and reported on success.
  */
 void migrate_handler(struct ctx *c, const struct timespec *now)
 {
+	struct stats_migrate *m = &passt_stats.migrate;
+	struct timespec start;
 	int rc;
 
 	if (c->device_state_fd < 0)
@@ -302,11 +392,23 @@ void migrate_handler(struct ctx *c, const struct timespec *now)
 	debug("Handling migration request from fd: %d, target: %d",
 	      c->device_state_fd, c->migrate_target);
 
+	memset(m, 0, sizeof(*m));
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
 	if (c->migrate_target)
 		rc = migrate_target(c, c->device_state_fd, now);
 	else
 		rc = migrate_source(c, c->device_state_fd, now);
 
+	m->ns = stats_ns_since(&start);
+
+	if (!rc) {
+		info("Migration as %s: %u flows, %" PRIu64 " bytes, "
+		     "%" PRIu64 " repair round-trips, %" PRIu64 " us",
+		     c->migrate_target ? "target" : "source",
+		     m->flows, m->bytes, m->repair, m->ns / 1000);
+	}
+
 	migrate_close(c);
 
 	c->device_state_result = rc;
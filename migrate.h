@@ -25,11 +25,13 @@ struct migrate_header {
 /**
  * struct migrate_stage - Callbacks and parameters for one stage of migration
  * @name:	Stage name (for debugging)
+ * @prepare:	Optional callback on the source as migration starts, guest running
  * @source:	Callback to implement this stage on the source
  * @target:	Callback to implement this stage on the target
  */
 struct migrate_stage {
 	const char *name;
+	int (*prepare)(struct ctx *c, const struct migrate_stage *stage);
 	int (*source)(struct ctx *c, const struct migrate_stage *stage, int fd,
 		      const struct timespec *now);
 	int (*target)(struct ctx *c, const struct migrate_stage *stage, int fd,
@@ -50,6 +52,7 @@ struct migrate_version {
 
 void migrate_init(struct ctx *c);
 void migrate_close(struct ctx *c);
+void migrate_prepare(struct ctx *c);
 void migrate_request(struct ctx *c, int fd, bool target);
 void migrate_handler(struct ctx *c, const struct timespec *now);
 
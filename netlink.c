@@ -6,7 +6,7 @@
  * PASTA - Pack A Subtle Tap Abstraction
  *  for network namespace/tap device mode
  *
- * netlink.c - rtnetlink routines: interfaces, addresses, routes
+ * netlink.c - rtnetlink routines: interfaces, addresses, routes; sock_diag
  *
  * Copyright (c) 2020-2021 Red Hat GmbH
  * Author: Stefano Brivio <sbrivio@redhat.com>
@@ -30,8 +30,11 @@
 
 #include <linux/netlink.h>
 #include <linux/rtnetlink.h>
+#include <linux/sock_diag.h>
+#include <linux/inet_diag.h>
 
 #include "util.h"
+#include "bitmap.h"
 #include "passt.h"
 #include "log.h"
 #include "ip.h"
@@ -55,6 +58,11 @@
  */
 #define NLBUFSIZ 65536
 
+/* Requests we send before collecting acknowledgements, so that they fit in the
+ * receive buffer of the socket, including error messages quoting the request
+ */
+#define NL_BATCH 64
+
 /* Socket in init, in target namespace, sequence (just needs to be monotonic) */
 int nl_sock			= -1;
 int nl_sock_ns			= -1;
@@ -63,6 +71,10 @@ static int nl_seq		=  1;
 /* Socket for neighbour event notifier */
 static int nl_sock_neigh	= -1;
 
+/* sock_diag sockets to scan for bound ports, in init and target namespace */
+int nl_sock_diag		= -1;
+int nl_sock_diag_ns		= -1;
+
 /**
  * nl_sock_init_do() - Set up netlink sockets in init or target namespace
  * @arg:	Execution context, if running from namespace, NULL otherwise
@@ -117,6 +129,38 @@ fail:
 	die("Failed to get netlink socket");
 }
 
+/**
+ * nl_diag_sock_init_do() - Get sock_diag socket in init or target namespace
+ * @arg:	Execution context, if running from namespace, NULL otherwise
+ *
+ * Return: 0
+ */
+static int nl_diag_sock_init_do(void *arg)
+{
+	int *s = arg ? &nl_sock_diag_ns : &nl_sock_diag;
+
+	if (arg)
+		ns_enter((struct ctx *)arg);
+
+	*s = socket(AF_NETLINK, SOCK_RAW | SOCK_CLOEXEC, NETLINK_SOCK_DIAG);
+	return 0;
+}
+
+/**
+ * nl_diag_sock_init() - Get sock_diag sockets in init and target namespace
+ * @c:		Execution context
+ *
+ * Failure is not fatal: callers can fall back to scanning procfs.
+ */
+void nl_diag_sock_init(const struct ctx *c)
+{
+	nl_diag_sock_init_do(NULL);
+	NS_CALL(nl_diag_sock_init_do, c);
+
+	if (nl_sock_diag < 0 || nl_sock_diag_ns < 0)
+		debug("netlink: No sock_diag socket, port scans use procfs");
+}
+
 /**
  * nl_send() - Prepare and send netlink request
  * @s:		Netlink socket
@@ -229,6 +273,25 @@ static struct nlmsghdr *nl_next(int s, char *buf, struct nlmsghdr *nh, ssize_t *
 		/* NOLINTNEXTLINE(readability-inconsistent-ifelse-braces) */\
 		} else
 
+/**
+ * nl_ack() - Wait for acknowledgement of a "do" request sent with nl_send()
+ * @s:		Netlink socket
+ * @buf:	Buffer for responses (at least NLBUFSIZ long)
+ * @seq:	Sequence number of request
+ *
+ * Return: 0 on success, negative error code on error
+ */
+static int nl_ack(int s, char *buf, uint32_t seq)
+{
+	struct nlmsghdr *nh;
+	ssize_t status;
+
+	nl_foreach(nh, status, s, buf, seq)
+		warn("netlink: Unexpected response message");
+
+	return status;
+}
+
 /**
  * nl_do() - Send netlink "do" request, and wait for acknowledgement
  * @s:		Netlink socket
@@ -241,16 +304,9 @@ static struct nlmsghdr *nl_next(int s, char *buf, struct nlmsghdr *nh, ssize_t *
  */
 static int nl_do(int s, void *req, uint16_t type, uint16_t flags, ssize_t len)
 {
-	struct nlmsghdr *nh;
 	char buf[NLBUFSIZ];
-	ssize_t status;
-	uint32_t seq;
-
-	seq = nl_send(s, req, type, flags, len);
-	nl_foreach(nh, status, s, buf, seq)
-		warn("netlink: Unexpected response message");
 
-	return status;
+	return nl_ack(s, buf, nl_send(s, req, type, flags, len));
 }
 
 /**
@@ -522,6 +578,36 @@ int nl_route_set_def(int s, unsigned int ifi, sa_family_t af, const void *gw)
 	return nl_do(s, &req, RTM_NEWROUTE, NLM_F_CREATE | NLM_F_EXCL, len);
 }
 
+/**
+ * nl_route_dup_ack() - Collect acknowledgements for a batch of new routes
+ * @s:		Netlink socket
+ * @buf:	Buffer for responses (at least NLBUFSIZ long)
+ * @first:	Sequence number of first request in batch
+ * @last:	Sequence number of last request in batch
+ * @again:	Set if a route couldn't be inserted (yet), as its gateway is
+ *		unreachable
+ *
+ * Return: 0 on success or if routes already exist, negative error code of the
+ *	   first request failing for other reasons
+ */
+static int nl_route_dup_ack(int s, char *buf, uint32_t first, uint32_t last,
+			    bool *again)
+{
+	uint32_t seq;
+	int ret = 0;
+
+	for (seq = first; seq <= last; seq++) {
+		int rc = nl_ack(s, buf, seq);
+
+		if (rc == -ENETUNREACH || rc == -EHOSTUNREACH)
+			*again = true;
+		else if (rc < 0 && rc != -EEXIST && !ret)
+			ret = rc;
+	}
+
+	return ret;
+}
+
 /**
  * nl_route_dup() - Copy routes for given interface and address family
  * @s_src:	Netlink socket in source namespace
@@ -551,9 +637,9 @@ int nl_route_dup(int s_src, unsigned int ifi_src,
 		.ifi		  = ifi_src,
 	};
 	ssize_t nlmsgs_size, left, status;
+	char buf[NLBUFSIZ], tail[NLBUFSIZ];
 	unsigned dup_routes = 0;
 	struct nlmsghdr *nh;
-	char buf[NLBUFSIZ];
 	uint32_t seq;
 	unsigned i;
 
@@ -649,7 +735,6 @@ int nl_route_dup(int s_src, unsigned int ifi_src,
 		/* Process any remaining datagrams in a different
 		 * buffer so we don't overwrite the first one.
 		 */
-		char tail[NLBUFSIZ];
 		unsigned extra = 0;
 
 		nl_foreach_oftype(nh, status, s_src, tail, seq, RTM_NEWROUTE)
@@ -669,24 +754,47 @@ int nl_route_dup(int s_src, unsigned int ifi_src,
 	 * Routes that have been already inserted will return -EEXIST, but we
 	 * can safely ignore that and repeat the requests. This avoids the need
 	 * to calculate dependencies: let the kernel do that.
+	 *
+	 * Send requests in batches without waiting for each acknowledgement,
+	 * and stop as soon as no route failed because of a missing gateway.
 	 */
 	for (i = 0; i < dup_routes; i++) {
+		uint32_t first = 0, last = 0;
+		unsigned sent = 0;
+		bool again = false;
+		int rc;
+
 		for (nh = (struct nlmsghdr *)buf, left = nlmsgs_size;
 		     NLMSG_OK(nh, left);
 		     nh = NLMSG_NEXT(nh, left)) {
 			uint16_t flags = nh->nlmsg_flags;
-			int rc;
 
 			if (nh->nlmsg_type != RTM_NEWROUTE)
 				continue;
 
-			rc = nl_do(s_dst, nh, RTM_NEWROUTE,
-				   (flags & ~NLM_F_DUMP_FILTERED) | NLM_F_CREATE,
-				   nh->nlmsg_len);
-			if (rc < 0 && rc != -EEXIST &&
-			    rc != -ENETUNREACH && rc != -EHOSTUNREACH)
+			last = nl_send(s_dst, nh, RTM_NEWROUTE,
+				       (flags & ~NLM_F_DUMP_FILTERED) |
+				       NLM_F_CREATE, nh->nlmsg_len);
+			if (!sent++)
+				first = last;
+
+			if (!(sent % NL_BATCH)) {
+				rc = nl_route_dup_ack(s_dst, tail, first, last,
+						      &again);
+				if (rc < 0)
+					return rc;
+				first = last + 1;
+			}
+		}
+
+		if (sent % NL_BATCH) {
+			rc = nl_route_dup_ack(s_dst, tail, first, last, &again);
+			if (rc < 0)
 				return rc;
 		}
+
+		if (!again)
+			break;
 	}
 
 	return 0;
@@ -925,6 +1033,30 @@ int nl_addr_set(int s, unsigned int ifi, sa_family_t af,
 	return nl_do(s, &req, RTM_NEWADDR, NLM_F_CREATE | NLM_F_EXCL, len);
 }
 
+/**
+ * nl_addr_dup_ack() - Collect acknowledgements for a batch of new addresses
+ * @s:		Netlink socket
+ * @buf:	Buffer for responses (at least NLBUFSIZ long)
+ * @first:	Sequence number of first request in batch
+ * @last:	Sequence number of last request in batch
+ *
+ * Return: 0 on success, negative error code of first failed request otherwise
+ */
+static int nl_addr_dup_ack(int s, char *buf, uint32_t first, uint32_t last)
+{
+	uint32_t seq;
+	int ret = 0;
+
+	for (seq = first; seq <= last; seq++) {
+		int rc = nl_ack(s, buf, seq);
+
+		if (rc < 0 && !ret)
+			ret = rc;
+	}
+
+	return ret;
+}
+
 /**
  * nl_addr_dup() - Copy IP addresses for given interface and address family
  * @s_src:	Netlink socket in source network namespace
@@ -946,10 +1078,11 @@ int nl_addr_dup(int s_src, unsigned int ifi_src,
 		.ifa.ifa_index     = ifi_src,
 		.ifa.ifa_prefixlen = 0,
 	};
-	char buf[NLBUFSIZ];
+	uint32_t seq, first = 0, last = 0;
+	char buf[NLBUFSIZ], ack[NLBUFSIZ];
 	struct nlmsghdr *nh;
+	unsigned sent = 0;
 	ssize_t status;
-	uint32_t seq;
 	int rc = 0;
 
 	seq = nl_send(s_src, &req, RTM_GETADDR, NLM_F_DUMP, sizeof(req));
@@ -981,10 +1114,24 @@ int nl_addr_dup(int s_src, unsigned int ifi_src,
 				*(uint32_t *)RTA_DATA(rta) |= IFA_F_NODAD;
 		}
 
-		rc = nl_do(s_dst, nh, RTM_NEWADDR,
-			   (nh->nlmsg_flags & ~NLM_F_DUMP_FILTERED) | NLM_F_CREATE,
-			   nh->nlmsg_len);
+		/* Don't wait for acknowledgements one by one: collect them
+		 * once per batch, and stop adding addresses on failure
+		 */
+		last = nl_send(s_dst, nh, RTM_NEWADDR,
+			       (nh->nlmsg_flags & ~NLM_F_DUMP_FILTERED) |
+			       NLM_F_CREATE, nh->nlmsg_len);
+		if (!sent++)
+			first = last;
+
+		if (!(sent % NL_BATCH)) {
+			rc = nl_addr_dup_ack(s_dst, ack, first, last);
+			first = last + 1;
+		}
 	}
+
+	if (sent % NL_BATCH)
+		rc = nl_addr_dup_ack(s_dst, ack, first, last);
+
 	if (status < 0)
 		return status;
 
@@ -1084,6 +1231,32 @@ int nl_link_set_mtu(int s, unsigned int ifi, int mtu)
 	return nl_do(s, &req, RTM_NEWLINK, 0, sizeof(req));
 }
 
+/**
+ * nl_link_set_gso_max_size() - Set maximum size of GSO packets for link
+ * @s:		Netlink socket
+ * @ifi:	Interface index
+ * @size:	Maximum GSO packet size, including L2 header
+ *
+ * Return: 0 on success, negative error code on failure
+ */
+int nl_link_set_gso_max_size(int s, unsigned int ifi, unsigned int size)
+{
+	struct req_t {
+		struct nlmsghdr nlh;
+		struct ifinfomsg ifm;
+		struct rtattr rta;
+		unsigned int size;
+	} req = {
+		.ifm.ifi_family	  = AF_UNSPEC,
+		.ifm.ifi_index	  = ifi,
+		.rta.rta_type	  = IFLA_GSO_MAX_SIZE,
+		.rta.rta_len	  = RTA_LENGTH(sizeof(unsigned int)),
+		.size		  = size,
+	};
+
+	return nl_do(s, &req, RTM_NEWLINK, 0, sizeof(req));
+}
+
 /**
  * nl_link_set_flags() - Set link flags
  * @s:		Netlink socket
@@ -1109,6 +1282,77 @@ int nl_link_set_flags(int s, unsigned int ifi,
 	return nl_do(s, &req, RTM_NEWLINK, 0, sizeof(req));
 }
 
+#define NL_NEIGH_BATCH		64
+
+/**
+ * struct nl_neigh_update - Pending neighbour table update from notifications
+ * @addr:	Guest-side neighbour address
+ * @mac:	MAC address, unused for removals
+ * @del:	Remove entry instead of updating it
+ */
+struct nl_neigh_update {
+	union inany_addr addr;
+	uint8_t mac[ETH_ALEN];
+	bool del;
+};
+
+/* Bursts of updates, coalesced by address, before applying them */
+static struct nl_neigh_update nl_neigh_batch[NL_NEIGH_BATCH];
+static unsigned nl_neigh_batch_len;
+
+/**
+ * nl_neigh_flush() - Apply pending neighbour table updates
+ * @c:		Execution context
+ */
+static void nl_neigh_flush(const struct ctx *c)
+{
+	unsigned i;
+
+	for (i = 0; i < nl_neigh_batch_len; i++) {
+		const struct nl_neigh_update *u = &nl_neigh_batch[i];
+
+		if (u->del)
+			fwd_neigh_table_free(c, &u->addr);
+		else
+			fwd_neigh_table_update(c, &u->addr, u->mac, false);
+	}
+
+	nl_neigh_batch_len = 0;
+}
+
+/**
+ * nl_neigh_queue() - Queue neighbour table update, superseding older ones
+ * @c:		Execution context
+ * @addr:	Guest-side neighbour address
+ * @mac:	MAC address, NULL to remove the entry
+ */
+static void nl_neigh_queue(const struct ctx *c, const union inany_addr *addr,
+			   const uint8_t *mac)
+{
+	struct nl_neigh_update *u;
+	unsigned i;
+
+	for (i = 0; i < nl_neigh_batch_len; i++) {
+		if (inany_equals(&nl_neigh_batch[i].addr, addr))
+			break;
+	}
+
+	if (i == NL_NEIGH_BATCH) {
+		nl_neigh_flush(c);
+		i = 0;
+	}
+
+	u = &nl_neigh_batch[i];
+	if (i == nl_neigh_batch_len) {
+		u->addr = *addr;
+		nl_neigh_batch_len++;
+	}
+
+	u->del = !mac;
+	if (mac)
+		memcpy(u->mac, mac, ETH_ALEN);
+}
+
 /**
  * nl_neigh_msg_read() - Interpret a neighbour state message from netlink
  * @c:		Execution context
@@ -1181,13 +1425,13 @@ static void nl_neigh_msg_read(const struct ctx *c, struct nlmsghdr *nh)
 
 	if (nh->nlmsg_type == RTM_DELNEIGH) {
 		trace("neighbour notifier delete: %s", ip_str);
-		fwd_neigh_table_free(c, &daddr);
+		nl_neigh_queue(c, &daddr, NULL);
 		return;
 	}
 	if (!(ndm->ndm_state & NUD_VALID)) {
 		trace("neighbour notifier: %s unreachable, state: 0x%04x",
 		      ip_str, ndm->ndm_state);
-		fwd_neigh_table_free(c, &daddr);
+		nl_neigh_queue(c, &daddr, NULL);
 		return;
 	}
 	if (!lladdr) {
@@ -1199,7 +1443,7 @@ static void nl_neigh_msg_read(const struct ctx *c, struct nlmsghdr *nh)
 
 	eth_ntop(lladdr, mac_str, sizeof(mac_str));
 	trace("neighbour notifier update: %s / %s", ip_str, mac_str);
-	fwd_neigh_table_update(c, &daddr, lladdr, false);
+	nl_neigh_queue(c, &daddr, lladdr);
 }
 
 /**
@@ -1225,6 +1469,8 @@ static void nl_neigh_sync(const struct ctx *c, int proto)
 	nl_foreach_oftype(nh, status, nl_sock, buf, seq, RTM_NEWNEIGH)
 		nl_neigh_msg_read(c, nh);
 
+	nl_neigh_flush(c);
+
 	if (status < 0)
 		warn("netlink: RTM_GETNEIGH failed: %s", strerror_(-status));
 }
@@ -1246,11 +1492,13 @@ void nl_neigh_notify_handler(const struct ctx *c)
 				continue;
 			if (errno != EAGAIN)
 				warn_perror("netlink notifier read error");
-			return;
+			break;
 		}
 		for (; NLMSG_OK(nh, n); nh = NLMSG_NEXT(nh, n))
 			nl_neigh_msg_read(c, nh);
 	}
+
+	nl_neigh_flush(c);
 }
 
 /**
@@ -1304,3 +1552,39 @@ int nl_neigh_notify_init(const struct ctx *c)
 
 	return 0;
 }
+
+/**
+ * nl_diag_listen() - Set bits for ports with TCP or UDP sockets in given state
+ * @s:		sock_diag socket
+ * @proto:	IPPROTO_TCP or IPPROTO_UDP
+ * @af:		Address family, AF_INET or AF_INET6
+ * @state:	Socket state to look for, as in kernel's include/net/tcp_states.h
+ * @map:	Bitmap where numbers of bound ports will be set
+ *
+ * Return: 0 on success, negative error code on failure (e.g. no UDP support)
+ */
+int nl_diag_listen(int s, uint8_t proto, sa_family_t af, uint8_t state,
+		   uint8_t *map)
+{
+	struct req_t {
+		struct nlmsghdr nlh;
+		struct inet_diag_req_v2 r;
+	} req = {
+		.r.sdiag_family		= af,
+		.r.sdiag_protocol	= proto,
+		.r.idiag_states		= 1U << state,
+	};
+	struct nlmsghdr *nh;
+	char buf[NLBUFSIZ];
+	ssize_t status;
+	uint32_t seq;
+
+	seq = nl_send(s, &req, SOCK_DIAG_BY_FAMILY, NLM_F_DUMP, sizeof(req));
+	nl_foreach_oftype(nh, status, s, buf, seq, SOCK_DIAG_BY_FAMILY) {
+		const struct inet_diag_msg *m = NLMSG_DATA(nh);
+
+		bitmap_set(map, ntohs(m->id.idiag_sport));
+	}
+
+	return status;
+}
@@ -7,13 +7,17 @@
 #define NETLINK_H
 
 #include <stdbool.h>
+#include <stdint.h>
 
 #include <netinet/in.h>
 
 extern int nl_sock;
 extern int nl_sock_ns;
+extern int nl_sock_diag;
+extern int nl_sock_diag_ns;
 
 void nl_sock_init(const struct ctx *c, bool ns);
+void nl_diag_sock_init(const struct ctx *c);
 unsigned int nl_get_ext_if(int s, sa_family_t af);
 int nl_route_get_def(int s, unsigned int ifi, sa_family_t af, void *gw);
 int nl_route_set_def(int s, unsigned int ifi, sa_family_t af, const void *gw);
@@ -32,9 +36,12 @@ int nl_addr_dup(int s_src, unsigned int ifi_src,
 int nl_link_get_mac(int s, unsigned int ifi, void *mac);
 int nl_link_set_mac(int s, unsigned int ifi, const void *mac);
 int nl_link_set_mtu(int s, unsigned int ifi, int mtu);
+int nl_link_set_gso_max_size(int s, unsigned int ifi, unsigned int size);
 int nl_link_set_flags(int s, unsigned int ifi,
 		      unsigned int set, unsigned int change);
 int nl_neigh_notify_init(const struct ctx *c);
 void nl_neigh_notify_handler(const struct ctx *c);
+int nl_diag_listen(int s, uint8_t proto, sa_family_t af, uint8_t state,
+		   uint8_t *map);
 
 #endif /* NETLINK_H */
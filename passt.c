@@ -20,7 +20,6 @@
  */
 
 #include <fcntl.h>
-#include <sys/mman.h>
 #include <sys/resource.h>
 #include <stdbool.h>
 #include <stdlib.h>
@@ -54,13 +53,21 @@
 #include "repair.h"
 #include "netlink.h"
 #include "epoll_ctl.h"
+#include "stats.h"
 
-#define NUM_EPOLL_EVENTS	8
+/* Number of events fetched by epoll_wait() grows and shrinks with readiness */
+#define EPOLL_EVENTS_MIN	8
+#define EPOLL_EVENTS_MAX	256
+
+/* Events for latency-sensitive flows fetched at once, see --prio-ports */
+#define EPOLL_EVENTS_PRIO	64
+/* Consecutive mostly-idle iterations before shrinking the batch size */
+#define EPOLL_SHRINK_AFTER	16
 
 #define TIMER_INTERVAL_		MIN(TCP_TIMER_INTERVAL, FWD_PORT_SCAN_INTERVAL)
 #define TIMER_INTERVAL		MIN(TIMER_INTERVAL_, FLOW_TIMER_INTERVAL)
 
-char pkt_buf[PKT_BUF_BYTES]	__attribute__ ((aligned(PAGE_SIZE)));
+char pkt_buf[PKT_BUF_BYTES]	__attribute__ ((aligned(HUGEPAGE_SIZE)));
 
 struct ctx passt_ctx = {
 	.pidfile_fd		= -1,
@@ -79,6 +86,7 @@ char *epoll_type_str[] = {
 	[EPOLL_TYPE_TCP_TIMER]		= "TCP timer",
 	[EPOLL_TYPE_UDP_LISTEN]		= "listening UDP socket",
 	[EPOLL_TYPE_UDP]		= "UDP flow socket",
+	[EPOLL_TYPE_UDP_SHARED]		= "shared UDP socket",
 	[EPOLL_TYPE_PING]	= "ICMP/ICMPv6 ping socket",
 	[EPOLL_TYPE_NSQUIT_INOTIFY]	= "namespace inotify watch",
 	[EPOLL_TYPE_NSQUIT_TIMER]	= "namespace timer watch",
@@ -92,17 +100,119 @@ char *epoll_type_str[] = {
 	[EPOLL_TYPE_NL_NEIGH]		= "netlink neighbour notifier socket",
 	[EPOLL_TYPE_CONF_LISTEN]	= "configuration listening socket",
 	[EPOLL_TYPE_CONF]		= "configuration socket",
+	[EPOLL_TYPE_PRIO]		= "epoll instance for priority flows",
 };
 static_assert(ARRAY_SIZE(epoll_type_str) == EPOLL_NUM_TYPES,
 	      "epoll_type_str[] doesn't match enum epoll_type");
 
+struct passt_stats passt_stats;
+
+const char *stats_prof_defer_str[] = {
+	[STATS_PROF_TCP_DEFER]		= "TCP deferred handler",
+	[STATS_PROF_ICMP_FLUSH]		= "ICMP flush",
+	[STATS_PROF_UDP_FLUSH]		= "UDP flush",
+	[STATS_PROF_FLOW_DEFER]		= "flow deferred handler",
+	[STATS_PROF_FWD_SCAN]		= "port scan timer",
+	[STATS_PROF_NDP_TIMER]		= "NDP timer",
+	[STATS_PROF_TAP_FLUSH]		= "tap flush",
+	[STATS_PROF_PCAP_FLUSH]		= "pcap flush",
+	[STATS_PROF_MIGRATE]		= "migration handler",
+};
+static_assert(ARRAY_SIZE(stats_prof_defer_str) == STATS_PROF_DEFER_NUM,
+	      "stats_prof_defer_str[] doesn't match enum stats_prof_defer");
+
+const char *stats_mem_str[] = {
+	[STATS_MEM_FLOW]		= "flow table",
+	[STATS_MEM_TCP_BUF]		= "TCP buffers",
+	[STATS_MEM_UDP_BUF]		= "UDP buffers",
+	[STATS_MEM_SPLICE_PIPE]		= "splice pipes",
+	[STATS_MEM_TCP_SNDBUF]		= "TCP socket sending buffers",
+	[STATS_MEM_VU_REGION]		= "vhost-user regions",
+	[STATS_MEM_PCAP]		= "pcap buffer",
+	[STATS_MEM_LOG]			= "log buffer",
+};
+static_assert(ARRAY_SIZE(stats_mem_str) == STATS_MEM_NUM,
+	      "stats_mem_str[] doesn't match enum stats_mem");
+
 /**
- * struct passt_stats - Statistics
- * @events:	Event counters for epoll type events
+ * epoll_batch_bucket() - Histogram bucket for a given epoll_wait() batch size
+ * @nfds:	Number of events returned by epoll_wait()
+ *
+ * Return: 0 for no events, n + 1 for 2^n to 2^(n + 1) - 1 events
  */
-struct passt_stats {
-	unsigned long events[EPOLL_NUM_TYPES];
-};
+static unsigned epoll_batch_bucket(int nfds)
+{
+	unsigned b;
+
+	if (nfds <= 0)
+		return 0;
+
+	for (b = 1; nfds > 1 && b < EPOLL_BATCH_BUCKETS - 1; b++)
+		nfds >>= 1;
+
+	return b;
+}
+
+/**
+ * epoll_batch_next() - Adapt number of events to fetch at next epoll_wait()
+ * @cur:	Current maximum number of events
+ * @nfds:	Number of events returned by the last epoll_wait()
+ *
+ * Double the batch size as soon as epoll_wait() fills it, as more events are
+ * likely pending, and halve it once we've been using less than a quarter of it
+ * for a while, so that an idle instance goes back to small batches, and timers
+ * and deferred tasks don't lag behind long runs of handlers.
+ *
+ * Return: maximum number of events for next epoll_wait() call
+ */
+static int epoll_batch_next(int cur, int nfds)
+{
+	static int low;
+
+	if (nfds >= cur) {
+		low = 0;
+		return MIN(cur * 2, EPOLL_EVENTS_MAX);
+	}
+
+	if (nfds > cur / 4 || cur <= EPOLL_EVENTS_MIN) {
+		low = 0;
+		return cur;
+	}
+
+	if (++low < EPOLL_SHRINK_AFTER)
+		return cur;
+
+	low = 0;
+	return MAX(cur / 2, EPOLL_EVENTS_MIN);
+}
+
+#define LOW_MEM_RELEASE_INTERVAL	1000	/* ms */
+
+/**
+ * low_mem_release() - Release pages of idle buffers, periodically, --low-mem
+ * @c:		Execution context
+ * @now:	Current timestamp
+ *
+ * With MADV_FREE, pages we write to again before the kernel reclaims them
+ * are simply kept, so releasing buffers that are still busy is cheap.
+ */
+static void low_mem_release(const struct ctx *c, const struct timespec *now)
+{
+	static struct timespec last;
+
+	if (timespec_diff_ms(now, &last) < LOW_MEM_RELEASE_INTERVAL)
+		return;
+
+	last = *now;
+
+	tap_release(c);
+
+	if (!c->no_tcp)
+		tcp_release();
+
+	if (!c->no_udp)
+		udp_release();
+}
 
 /**
  * post_handler() - Run periodic and deferred tasks for L4 protocol handlers
@@ -111,14 +221,120 @@ struct passt_stats {
  */
 static void post_handler(struct ctx *c, const struct timespec *now)
 {
-	if (!c->no_tcp)
+	struct stats_prof *prof = passt_stats.prof_defer;
+	bool p = c->profile;
+	struct timespec t;
+
+	if (p && clock_gettime(CLOCK_MONOTONIC, &t))
+		p = false;
+
+	if (!c->no_tcp) {
 		tcp_defer_handler(c, now);
+		if (p)
+			stats_prof_lap(&prof[STATS_PROF_TCP_DEFER], &t);
+	}
+
+	if (!c->no_icmp) {
+		icmp_flush(c);
+		if (p)
+			stats_prof_lap(&prof[STATS_PROF_ICMP_FLUSH], &t);
+	}
+
+	if (!c->no_udp) {
+		udp_flush(c);
+		if (p)
+			stats_prof_lap(&prof[STATS_PROF_UDP_FLUSH], &t);
+	}
 
 	flow_defer_handler(c, now);
+	if (p)
+		stats_prof_lap(&prof[STATS_PROF_FLOW_DEFER], &t);
+
 	fwd_scan_ports_timer(c, now);
+	if (p)
+		stats_prof_lap(&prof[STATS_PROF_FWD_SCAN], &t);
 
-	if (!c->no_ndp)
+	if (!c->no_ndp) {
 		ndp_timer(c, now);
+		if (p)
+			stats_prof_lap(&prof[STATS_PROF_NDP_TIMER], &t);
+	}
+
+	/* Last, as handlers above might send frames, too */
+	if (c->mode == MODE_VU)
+		vu_notify_deferred(c->vdev);
+	else
+		tap_flush(c);
+	if (p)
+		stats_prof_lap(&prof[STATS_PROF_TAP_FLUSH], &t);
+
+	if (pcap_fd != -1) {
+		pcap_flush();
+		if (p)
+			stats_prof_lap(&prof[STATS_PROF_PCAP_FLUSH], &t);
+	}
+
+	/* After flushing, so that buffers are likely to be idle */
+	if (c->low_mem)
+		low_mem_release(c, now);
+}
+
+#define STARTUP_STAGES_MAX	16
+
+/**
+ * struct startup_stage - Completion of a startup stage, for --startup-trace
+ * @name:	Description of stage
+ * @ts:		Time the stage completed
+ */
+static struct startup_stage {
+	const char *name;
+	struct timespec ts;
+} startup_stages[STARTUP_STAGES_MAX];
+
+static unsigned startup_stages_count;
+
+/**
+ * startup_mark() - Record completion of a startup stage
+ * @name:	Description of stage
+ *
+ * We don't know yet if --startup-trace is given for early stages, so always
+ * record them: it's just a clock_gettime() call each.
+ */
+static void startup_mark(const char *name)
+{
+	struct startup_stage *s;
+
+	if (startup_stages_count >= STARTUP_STAGES_MAX)
+		return;
+
+	s = &startup_stages[startup_stages_count++];
+	s->name = name;
+	if (clock_gettime(CLOCK_MONOTONIC, &s->ts))
+		s->ts = log_start;
+}
+
+/**
+ * startup_report() - Report time taken by startup stages, if requested
+ * @c:		Execution context
+ */
+static void startup_report(const struct ctx *c)
+{
+	const struct timespec *prev = &log_start;
+	unsigned i;
+
+	if (!c->startup_trace)
+		return;
+
+	for (i = 0; i < startup_stages_count; i++) {
+		const struct startup_stage *s = &startup_stages[i];
+
+		info("Startup: %-24s %8lli us", s->name,
+		     (long long)timespec_diff_us(&s->ts, prev));
+		prev = &s->ts;
+	}
+
+	info("Startup: %-24s %8lli us", "total",
+	     (long long)timespec_diff_us(prev, &log_start));
 }
 
 /**
@@ -155,6 +371,7 @@ void proto_update_l2_buf(const unsigned char *eth_d)
 {
 	tcp_update_l2_buf(eth_d);
 	udp_update_l2_buf(eth_d);
+	icmp_update_l2_buf(eth_d);
 }
 
 /**
@@ -217,9 +434,156 @@ static void print_stats(const struct ctx *c, const struct passt_stats *stats,
 	for (i = 1; i < EPOLL_NUM_TYPES; i++)
 		FPRINTF(stderr, " %6lu", stats->events[i]);
 	FPRINTF(stderr, "\n");
+
+	FPRINTF(stderr, "  epoll batch sizes: 0: %lu, 1: %lu",
+		stats->batch[0], stats->batch[1]);
+	for (i = 2; i < EPOLL_BATCH_BUCKETS - 1; i++) {
+		FPRINTF(stderr, ", %i-%i: %lu",
+			1 << (i - 1), (1 << i) - 1, stats->batch[i]);
+	}
+	FPRINTF(stderr, ", %i+: %lu\n", 1 << (i - 1), stats->batch[i]);
 	lines_printed++;
 }
 
+/**
+ * passt_wait() - Wait for events, busy polling first if configured
+ * @c:		Execution context
+ * @events:	epoll_event array to fill
+ * @nevents:	Size of @events
+ *
+ * With --busy-poll, spin for up to the configured budget on sockets, with
+ * epoll_wait() and no timeout, and on vhost-user TX queues, with guest
+ * notifications (kicks) suppressed, before sleeping. The budget restarts after
+ * each batch of work, so CPU time is only spent while we're busy.
+ *
+ * Return: number of ready file descriptors, as epoll_wait(). If zero with busy
+ *	   polling, vhost-user TX queues might need processing.
+ */
+static int passt_wait(struct ctx *c, struct epoll_event *events, int nevents)
+{
+	struct timespec start, now;
+	int nfds;
+
+	if (c->busy_poll && !clock_gettime(CLOCK_MONOTONIC, &start)) {
+		do {
+			if (vu_tx_notification(c->vdev, false))
+				return 0;
+
+			nfds = epoll_wait(c->epollfd, events, nevents, 0);
+			if (nfds)
+				return nfds;
+
+			if (clock_gettime(CLOCK_MONOTONIC, &now))
+				break;
+		} while (timespec_diff_us(&now, &start) < c->busy_poll);
+
+		/* Guest might have added buffers before seeing kicks enabled */
+		if (vu_tx_notification(c->vdev, true))
+			return 0;
+	}
+
+	/* NOLINTBEGIN(bugprone-branch-clone): intervals can be the same */
+	/* cppcheck-suppress [duplicateValueTernary, unmatchedSuppression] */
+	return epoll_wait(c->epollfd, events, nevents,
+			  MIN(TIMER_INTERVAL, fwd_scan_ports_interval()));
+	/* NOLINTEND(bugprone-branch-clone) */
+}
+
+/**
+ * passt_handle() - Dispatch a single epoll event to its handler
+ * @c:		Execution context
+ * @ev:		epoll event
+ * @now:	Current timestamp
+ */
+static void passt_handle(struct ctx *c, const struct epoll_event *ev,
+			 const struct timespec *now)
+{
+	union epoll_ref ref = *((union epoll_ref *)&ev->data.u64);
+	uint32_t eventmask = ev->events;
+	struct timespec start;
+
+	if (clock_gettime(CLOCK_MONOTONIC, &start))
+		start = *now;
+	stats_hist(PESTO_STATS_HIST_EPOLL, now, &start);
+
+	trace("%s: epoll event on %s %i (events: 0x%08x)",
+	      c->mode == MODE_PASTA ? "pasta" : "passt",
+	      EPOLL_TYPE_STR(ref.type), ref.fd, eventmask);
+
+	switch (ref.type) {
+	case EPOLL_TYPE_TAP_PASTA:
+		tap_handler_pasta(c, eventmask, now);
+		break;
+	case EPOLL_TYPE_TAP_PASST:
+		tap_handler_passt(c, eventmask, now);
+		break;
+	case EPOLL_TYPE_TAP_LISTEN:
+		tap_listen_handler(c, eventmask);
+		break;
+	case EPOLL_TYPE_NSQUIT_INOTIFY:
+		pasta_netns_quit_inotify_handler(c, ref.fd);
+		break;
+	case EPOLL_TYPE_NSQUIT_TIMER:
+		pasta_netns_quit_timer_handler(c, ref);
+		break;
+	case EPOLL_TYPE_TCP:
+		tcp_sock_handler(c, ref, eventmask, now);
+		break;
+	case EPOLL_TYPE_TCP_SPLICE:
+		tcp_splice_sock_handler(ref, eventmask, now);
+		break;
+	case EPOLL_TYPE_TCP_LISTEN:
+		tcp_listen_handler(c, ref, now);
+		break;
+	case EPOLL_TYPE_TCP_TIMER:
+		tcp_timer_handler(c, ref, now);
+		break;
+	case EPOLL_TYPE_UDP_LISTEN:
+		udp_listen_sock_handler(c, ref, eventmask, now);
+		break;
+	case EPOLL_TYPE_UDP:
+		udp_sock_handler(c, ref, eventmask, now);
+		break;
+	case EPOLL_TYPE_UDP_SHARED:
+		udp_shared_sock_handler(c, ref, eventmask, now);
+		break;
+	case EPOLL_TYPE_PING:
+		icmp_sock_handler(c, ref, now);
+		break;
+	case EPOLL_TYPE_VHOST_CMD:
+		vu_control_handler(c->vdev, c->fd_tap, eventmask);
+		break;
+	case EPOLL_TYPE_VHOST_KICK:
+		vu_kick_cb(c->vdev, ref, now);
+		break;
+	case EPOLL_TYPE_REPAIR_LISTEN:
+		repair_listen_handler(c, eventmask);
+		break;
+	case EPOLL_TYPE_REPAIR:
+		repair_handler(c, eventmask);
+		break;
+	case EPOLL_TYPE_NL_NEIGH:
+		nl_neigh_notify_handler(c);
+		break;
+	case EPOLL_TYPE_CONF_LISTEN:
+		conf_listen_handler(c, eventmask);
+		break;
+	case EPOLL_TYPE_CONF:
+		conf_handler(c, eventmask);
+		break;
+	case EPOLL_TYPE_PRIO:
+		/* Already drained at the beginning of passt_worker() */
+		break;
+	default:
+		/* Can't happen */
+		assert(0);
+	}
+	passt_stats.events[ref.type]++;
+	if (c->profile)
+		stats_prof_lap(&passt_stats.prof_events[ref.type], &start);
+	print_stats(c, &passt_stats, now);
+}
+
 /**
  * passt_worker() - Process epoll events and handle protocol operations
  * @opaque:	Pointer to execution context (struct ctx)
@@ -228,91 +592,51 @@ static void print_stats(const struct ctx *c, const struct passt_stats *stats,
  */
 static void passt_worker(void *opaque, int nfds, struct epoll_event *events)
 {
-	static struct passt_stats stats = { 0 };
+	struct timespec now, done;
 	struct ctx *c = opaque;
-	struct timespec now;
+	long long ns;
 	int i;
 
 	if (clock_gettime(CLOCK_MONOTONIC, &now))
 		err_perror("Failed to get CLOCK_MONOTONIC time");
 
-	for (i = 0; i < nfds; i++) {
-		union epoll_ref ref = *((union epoll_ref *)&events[i].data.u64);
-		uint32_t eventmask = events[i].events;
-
-		trace("%s: epoll event on %s %i (events: 0x%08x)",
-		      c->mode == MODE_PASTA ? "pasta" : "passt",
-		      EPOLL_TYPE_STR(ref.type), ref.fd, eventmask);
-
-		switch (ref.type) {
-		case EPOLL_TYPE_TAP_PASTA:
-			tap_handler_pasta(c, eventmask, &now);
-			break;
-		case EPOLL_TYPE_TAP_PASST:
-			tap_handler_passt(c, eventmask, &now);
-			break;
-		case EPOLL_TYPE_TAP_LISTEN:
-			tap_listen_handler(c, eventmask);
-			break;
-		case EPOLL_TYPE_NSQUIT_INOTIFY:
-			pasta_netns_quit_inotify_handler(c, ref.fd);
-			break;
-		case EPOLL_TYPE_NSQUIT_TIMER:
-			pasta_netns_quit_timer_handler(c, ref);
-			break;
-		case EPOLL_TYPE_TCP:
-			tcp_sock_handler(c, ref, eventmask, &now);
-			break;
-		case EPOLL_TYPE_TCP_SPLICE:
-			tcp_splice_sock_handler(c, ref, eventmask, &now);
-			break;
-		case EPOLL_TYPE_TCP_LISTEN:
-			tcp_listen_handler(c, ref, &now);
-			break;
-		case EPOLL_TYPE_TCP_TIMER:
-			tcp_timer_handler(c, ref, &now);
-			break;
-		case EPOLL_TYPE_UDP_LISTEN:
-			udp_listen_sock_handler(c, ref, eventmask, &now);
-			break;
-		case EPOLL_TYPE_UDP:
-			udp_sock_handler(c, ref, eventmask, &now);
-			break;
-		case EPOLL_TYPE_PING:
-			icmp_sock_handler(c, ref, &now);
-			break;
-		case EPOLL_TYPE_VHOST_CMD:
-			vu_control_handler(c->vdev, c->fd_tap, eventmask);
-			break;
-		case EPOLL_TYPE_VHOST_KICK:
-			vu_kick_cb(c->vdev, ref, &now);
-			break;
-		case EPOLL_TYPE_REPAIR_LISTEN:
-			repair_listen_handler(c, eventmask);
-			break;
-		case EPOLL_TYPE_REPAIR:
-			repair_handler(c, eventmask);
-			break;
-		case EPOLL_TYPE_NL_NEIGH:
-			nl_neigh_notify_handler(c);
-			break;
-		case EPOLL_TYPE_CONF_LISTEN:
-			conf_listen_handler(c, eventmask);
-			break;
-		case EPOLL_TYPE_CONF:
-			conf_handler(c, eventmask);
-			break;
-		default:
-			/* Can't happen */
-			assert(0);
-		}
-		stats.events[ref.type]++;
-		print_stats(c, &stats, &now);
+	passt_stats.batch[epoll_batch_bucket(nfds)]++;
+
+	/* Guest doesn't kick us while we busy poll, see passt_wait() */
+	if (c->busy_poll)
+		vu_tx_poll(c->vdev, &now);
+
+	/* Latency-sensitive flows go first, see --prio-ports */
+	if (c->prio) {
+		struct epoll_event prio[EPOLL_EVENTS_PRIO];
+		int n;
+
+		n = epoll_wait(c->epollfd_prio, prio, ARRAY_SIZE(prio), 0);
+		for (i = 0; i < n; i++)
+			passt_handle(c, &prio[i], &now);
 	}
 
+	for (i = 0; i < nfds; i++)
+		passt_handle(c, &events[i], &now);
+
 	post_handler(c, &now);
 
-	migrate_handler(c, &now);
+	if (c->profile && !clock_gettime(CLOCK_MONOTONIC, &done)) {
+		migrate_handler(c, &now);
+		stats_prof_lap(&passt_stats.prof_defer[STATS_PROF_MIGRATE],
+			       &done);
+	} else {
+		migrate_handler(c, &now);
+	}
+
+	if (clock_gettime(CLOCK_MONOTONIC, &done))
+		return;
+
+	ns = (done.tv_sec - now.tv_sec) * 1000000000LL +
+	     (done.tv_nsec - now.tv_nsec);
+	passt_stats.loops++;
+	passt_stats.loop_ns += ns;
+	passt_stats.loop_ns_max = MAX(passt_stats.loop_ns_max, (uint64_t)ns);
 }
 
 /**
@@ -332,8 +656,8 @@ static void passt_worker(void *opaque, int nfds, struct epoll_event *events)
  */
 int main(int argc, char **argv)
 {
-	struct epoll_event events[NUM_EPOLL_EVENTS];
-	int nfds, devnull_fd = -1, fd;
+	int nfds, devnull_fd = -1, fd, nevents = EPOLL_EVENTS_MIN;
+	struct epoll_event events[EPOLL_EVENTS_MAX];
 	struct ctx *c = &passt_ctx;
 	struct rlimit limit;
 	struct timespec now;
@@ -373,8 +697,6 @@ int main(int argc, char **argv)
 	if (signal(SIGPIPE, SIG_IGN) == SIG_ERR)
 		die_perror("Couldn't set disposition for SIGPIPE");
 
-	madvise(pkt_buf, sizeof(pkt_buf), MADV_HUGEPAGE);
-
 	c->epollfd = epoll_create1(EPOLL_CLOEXEC);
 	if (c->epollfd == -1)
 		die_perror("Failed to create epoll file descriptor");
@@ -387,28 +709,59 @@ int main(int argc, char **argv)
 	if (setrlimit(RLIMIT_NOFILE, &limit))
 		die_perror("Failed to set current limit for open files");
 
+	startup_mark("initial isolation");
+
 	sock_probe_features(c);
+	startup_mark("socket features");
 
 	conf(c, argc, argv);
 	trace_init(c->trace);
+	startup_mark("configuration");
+
+	/* Before buffers are first touched, so that they're allocated on the
+	 * NUMA node of the CPUs we'll run on
+	 */
+	if (CPU_COUNT(&c->cpus) &&
+	    sched_setaffinity(0, sizeof(c->cpus), &c->cpus))
+		die_perror("Failed to set CPU affinity");
+
+	if (c->prio) {
+		union epoll_ref ref = { .type = EPOLL_TYPE_PRIO };
+
+		c->epollfd_prio = epoll_create1(EPOLL_CLOEXEC);
+		if (c->epollfd_prio == -1)
+			die_perror("Failed to create epoll file descriptor");
+		flow_epollid_register(EPOLLFD_ID_PRIO, c->epollfd_prio);
+
+		ref.fd = c->epollfd_prio;
+		if (epoll_add(c->epollfd, EPOLLIN, ref))
+			die_perror("Failed to add priority epoll instance");
+	}
 
 	pasta_netns_quit_init(c);
 
 	tap_backend_init(c);
+	startup_mark("tap backend");
 
 	random_init(c);
 
 	if (clock_gettime(CLOCK_MONOTONIC, &now))
 		die_perror("Failed to get CLOCK_MONOTONIC time");
 
-	flow_init();
+	flow_init(c);
 	fwd_scan_ports_init(c);
+	startup_mark("flows, port scanning");
+
+	if (!c->no_icmp)
+		icmp_init(c);
 
 	if ((!c->no_udp && udp_init(c)) || (!c->no_tcp && tcp_init(c)))
 		passt_exit(EXIT_FAILURE);
+	startup_mark("protocol handlers");
 
 	if (fwd_listen_init(c))
 		passt_exit(EXIT_FAILURE);
+	startup_mark("listening sockets");
 
 	proto_update_l2_buf(c->guest_mac);
 
@@ -422,9 +775,11 @@ int main(int argc, char **argv)
 
 	fwd_neigh_table_init(c);
 	nl_neigh_notify_init(c);
+	startup_mark("DHCP, pcap, neighbours");
 
 	if (isolate_prefork(c))
 		die("Failed to sandbox process, exiting");
+	startup_mark("sandbox");
 
 	if (!c->foreground) {
 		__daemon(c->pidfile_fd, devnull_fd);
@@ -441,6 +796,9 @@ int main(int argc, char **argv)
 	if (devnull_fd > STDERR_FILENO)
 		close(devnull_fd);
 
+	startup_mark("daemon, PID file");
+	startup_report(c);
+
 	if (pasta_child_pid) {
 		kill(pasta_child_pid, SIGUSR1);
 		log_stderr = false;
@@ -451,14 +809,15 @@ int main(int argc, char **argv)
 	timer_init(c, &now);
 
 loop:
-	/* NOLINTBEGIN(bugprone-branch-clone): intervals can be the same */
-	/* cppcheck-suppress [duplicateValueTernary, unmatchedSuppression] */
-	nfds = epoll_wait(c->epollfd, events, NUM_EPOLL_EVENTS, TIMER_INTERVAL);
-	/* NOLINTEND(bugprone-branch-clone) */
+	/* Write out log messages from the last iteration before we sleep */
+	logfile_flush();
+
+	nfds = passt_wait(c, events, nevents);
 	if (nfds == -1 && errno != EINTR)
 		die_perror("epoll_wait() failed in main loop");
 
 	passt_worker(c, nfds, events);
+	nevents = epoll_batch_next(nevents, nfds);
 
 	goto loop;
 }
@@ -12,6 +12,7 @@
 union epoll_ref;
 
 #include <stdbool.h>
+#include <sched.h>
 #include <assert.h>
 #include <sys/epoll.h>
 
@@ -163,17 +164,36 @@ struct ip6_ctx {
  * @quiet:		Don't print informational messages
  * @foreground:		Run in foreground, don't log to stderr by default
  * @nofile:		Maximum number of open files (ulimit -n)
+ * @max_flows:		Size of flow table, maximum number of flows
+ * @flow_rate:		New flows from tap per second and guest address, 0: any
+ * @flow_burst:		Burst of new flows allowed over @flow_rate
+ * @tap_rate:		Traffic to and from tap, bytes per second and direction,
+ *			0 for no limit
+ * @tap_burst:		Burst of traffic allowed over @tap_rate, bytes
+ * @busy_poll:		Busy-polling budget before sleeping, microseconds,
+ *			vhost-user mode only, 0 if disabled
+ * @prio:		Handle flows for @prio_ports first, via @epollfd_prio
+ * @prio_ports:		Ports identifying latency-sensitive flows
+ * @cpus:		CPUs to run on, none set to keep inherited affinity
  * @sock_path:		Path for UNIX domain socket
  * @control_path:	Path for control/configuration UNIX domain socket
  * @repair_path:	TCP_REPAIR helper path, can be "none", empty for default
  * @pcap:		Path for packet capture file
+ * @pcap_snaplen:	Maximum bytes captured for each frame, 0 for whole frames
+ * @pcap_sample:	Capture one out of @pcap_sample frames, 0 or 1 for all
+ * @pcap_proto:		Only capture frames with this L4 protocol, if set
+ * @pcap_port:		Only capture frames with this source or destination
+ *			port (TCP or UDP), if set
  * @pidfile:		Path to PID file, empty string if not configured
  * @pidfile_fd:		File descriptor for PID file, -1 if none
+ * @stats_file:		Path to file backing statistics, empty if none
+ * @probe_cache:	Path to cache of kernel feature probes, empty if none
  * @pasta_netns_fd:	File descriptor for network namespace in pasta mode
  * @no_netns_quit:	In pasta mode, don't exit if fs-bound namespace is gone
  * @netns_base:		Base name for fs-bound namespace, if any, in pasta mode
  * @netns_dir:		Directory of fs-bound namespace, if any, in pasta mode
  * @epollfd:		File descriptor for epoll instance
+ * @epollfd_prio:	epoll instance for latency-sensitive flows, if @prio
  * @fd_tap_listen:	File descriptor for listening AF_UNIX socket, if any
  * @fd_tap:		AF_UNIX socket, tuntap device, or pre-opened socket
  * @fd_control_listen:	Listening control/configuration socket, if any
@@ -193,6 +213,7 @@ struct ip6_ctx {
  * @pasta_ifn:		Name of namespace interface for pasta
  * @pasta_ifi:		Index of namespace interface for pasta
  * @pasta_conf_ns:	Configure namespace after creating it
+ * @pasta_vnet_hdr:	Tap device for pasta uses virtio-net headers, offloads
  * @fwd:		Forwarding tables
  * @fwd_pending:	Pending forward tables
  * @no_tcp:		Disable TCP operation
@@ -205,6 +226,10 @@ struct ip6_ctx {
  * @no_dns_search:	Do not source/use domain search lists for any purpose
  * @no_dhcp_dns:	Do not assign any DNS server via DHCP/DHCPv6/NDP
  * @no_dhcp_dns_search:	Do not assign any DNS domain search via DHCP/DHCPv6/NDP
+ * @dns_cache:		Cache DNS replies for queries from the guest
+ * @startup_trace:	Report time taken by startup stages
+ * @profile:		Account time spent in each event and deferred handler
+ * @low_mem:		Use smaller buffers, release their pages when idle
  * @no_dhcp:		Disable DHCP server
  * @no_dhcpv6:		Disable DHCPv6 server
  * @no_ndp:		Disable NDP handler altogether
@@ -213,6 +238,7 @@ struct ip6_ctx {
  * @splice_only:	Only enable loopback forwarding
  * @host_lo_to_ns_lo:	Map host loopback addresses to ns loopback addresses
  * @freebind:		Allow binding of non-local addresses for forwarding
+ * @io_uring:		Use batched io_uring reads on tap device (pasta only)
  * @chroot_fallback:	Use chroot() in case pivot_root() fails
  * @low_wmem:		Low probed net.core.wmem_max
  * @low_rmem:		Low probed net.core.rmem_max
@@ -233,13 +259,28 @@ struct ctx {
 	int quiet;
 	int foreground;
 	int nofile;
+	unsigned max_flows;
+	unsigned flow_rate;
+	unsigned flow_burst;
+	uint32_t tap_rate;
+	uint32_t tap_burst;
+	unsigned busy_poll;
+	bool prio;
+	uint8_t prio_ports[PORT_BITMAP_SIZE];
+	cpu_set_t cpus;
 	char sock_path[UNIX_PATH_MAX];
 	char control_path[UNIX_PATH_MAX];
 	char repair_path[UNIX_PATH_MAX];
 	char pcap[PATH_MAX];
+	unsigned pcap_snaplen;
+	unsigned pcap_sample;
+	uint8_t pcap_proto;
+	in_port_t pcap_port;
 
 	char pidfile[PATH_MAX];
 	int pidfile_fd;
+	char stats_file[PATH_MAX];
+	char probe_cache[PATH_MAX];
 
 	int one_off;
 
@@ -250,6 +291,7 @@ struct ctx {
 	char netns_dir[PATH_MAX];
 
 	int epollfd;
+	int epollfd_prio;
 	int fd_tap_listen;
 	int fd_tap;
 	int fd_control_listen;
@@ -276,6 +318,7 @@ struct ctx {
 	char pasta_ifn[IF_NAMESIZE];
 	unsigned int pasta_ifi;
 	int pasta_conf_ns;
+	bool pasta_vnet_hdr;
 
 	struct fwd_table *fwd[PIF_NUM_TYPES];
 	struct fwd_table *fwd_pending[PIF_NUM_TYPES];
@@ -290,6 +333,10 @@ struct ctx {
 	int no_dns_search;
 	int no_dhcp_dns;
 	int no_dhcp_dns_search;
+	int dns_cache;
+	int startup_trace;
+	int profile;
+	int low_mem;
 	int no_dhcp;
 	int no_dhcpv6;
 	int no_ndp;
@@ -298,6 +345,7 @@ struct ctx {
 	int splice_only;
 	int host_lo_to_ns_lo;
 	int freebind;
+	int io_uring;
 	bool chroot_fallback;
 
 	int low_wmem;
@@ -29,26 +29,132 @@
 #include <net/if.h>
 
 #include "util.h"
+#include "ip.h"
 #include "passt.h"
 #include "log.h"
 #include "pcap.h"
 #include "iov.h"
 #include "tap.h"
 #include "serialise.h"
-
-#define PCAP_VERSION_MINOR 4
+#include "stats.h"
 
 int pcap_fd = -1;
 
-struct pcap_pkthdr {
-	uint32_t tv_sec;
-	uint32_t tv_usec;
-	uint32_t caplen;
-	uint32_t len;
-};
+/* Frames are collected here, and written out in one go by pcap_flush() */
+#define PCAP_BUF_SIZE		(1 << 20)
+
+static char pcap_buf[PCAP_BUF_SIZE];
+static size_t pcap_buf_used;
+static unsigned int pcap_buf_frames;
+
+/* Frames we failed to write out */
+static unsigned long pcap_dropped;
+
+/* Capture options, see struct ctx */
+static size_t pcap_snaplen;
+static unsigned int pcap_sample;
+static uint8_t pcap_proto;
+static in_port_t pcap_port;
+
+/* Frames seen so far passing the filter, to pick samples */
+static unsigned int pcap_seen;
+
+/* Bytes of headers we look at to apply the filter */
+#define PCAP_FILTER_HDR_LEN	256
+
+/**
+ * pcap_flush() - Write out captured frames collected so far
+ */
+void pcap_flush(void)
+{
+	if (!pcap_buf_used)
+		return;
+
+	if (write_all_buf(pcap_fd, pcap_buf, pcap_buf_used) < 0) {
+		pcap_dropped += pcap_buf_frames;
+		warn_perror("Cannot log %u packets, %lu dropped so far",
+			    pcap_buf_frames, pcap_dropped);
+	}
+
+	pcap_buf_used = 0;
+	pcap_buf_frames = 0;
+}
+
+/**
+ * pcap_match() - Check if frame matches the capture filter, if any
+ * @iov:	IO vector containing frame (with L2 headers and tap headers)
+ * @iovcnt:	Number of buffers (@iov entries) in frame
+ * @offset:	Byte offset of the L2 headers within @iov
+ * @l2len:	Length of L2 frame data
+ *
+ * Return: true if the frame should be captured, false otherwise
+ */
+static bool pcap_match(const struct iovec *iov, size_t iovcnt,
+		       size_t offset, size_t l2len)
+{
+	uint8_t h[PCAP_FILTER_HDR_LEN];
+	size_t len, l3 = ETH_HLEN, l4;
+	uint16_t sport, dport;
+	uint8_t proto;
+
+	if (!pcap_proto)
+		return true;
+
+	len = iov_to_buf(iov, iovcnt, offset, h, MIN(l2len, sizeof(h)));
+	if (len < ETH_HLEN)
+		return false;
+
+	switch (h[offsetof(struct ethhdr, h_proto)] << 8 |
+		h[offsetof(struct ethhdr, h_proto) + 1]) {
+	case ETH_P_IP:
+		if (len < l3 + sizeof(struct iphdr))
+			return false;
+
+		proto = h[l3 + offsetof(struct iphdr, protocol)];
+		l4 = l3 + (h[l3] & 0xf) * 4;
+		break;
+	case ETH_P_IPV6:
+		if (len < l3 + sizeof(struct ipv6hdr))
+			return false;
+
+		proto = h[l3 + offsetof(struct ipv6hdr, nexthdr)];
+		l4 = l3 + sizeof(struct ipv6hdr);
+
+		while (proto == IPPROTO_HOPOPTS || proto == IPPROTO_ROUTING ||
+		       proto == IPPROTO_DSTOPTS) {
+			if (len < l4 + sizeof(struct ipv6_opt_hdr))
+				return false;
+
+			proto = h[l4 + offsetof(struct ipv6_opt_hdr, nexthdr)];
+			l4 += (h[l4 + offsetof(struct ipv6_opt_hdr, hdrlen)] +
+			       1) * 8;
+		}
+
+		if (proto == IPPROTO_ICMPV6)
+			proto = IPPROTO_ICMP;
+		break;
+	default:
+		return false;
+	}
+
+	if (proto != pcap_proto)
+		return false;
+
+	if (!pcap_port)
+		return true;
+
+	/* Source and destination ports come first for both TCP and UDP */
+	if (len < l4 + sizeof(sport) + sizeof(dport))
+		return false;
+
+	memcpy(&sport, h + l4, sizeof(sport));
+	memcpy(&dport, h + l4 + sizeof(sport), sizeof(dport));
+
+	return ntohs(sport) == pcap_port || ntohs(dport) == pcap_port;
+}
 
 /**
- * pcap_frame() - Capture a single frame to pcap file with given timestamp
+ * pcap_frame() - Capture a single frame to pcap buffer with given timestamp
  * @iov:	IO vector containing frame (with L2 headers and tap headers)
  * @iovcnt:	Number of buffers (@iov entries) in frame
  * @offset:	Byte offset of the L2 headers within @iov
@@ -58,22 +164,39 @@ struct pcap_pkthdr {
 static void pcap_frame(const struct iovec *iov, size_t iovcnt,
 		       size_t offset, size_t l2len, const struct timespec *now)
 {
+	size_t caplen = pcap_snaplen ? MIN(l2len, pcap_snaplen) : l2len;
 	struct pcap_pkthdr h = {
 		.tv_sec = now->tv_sec,
 		.tv_usec = DIV_ROUND_CLOSEST(now->tv_nsec, 1000),
-		.caplen = l2len,
+		.caplen = caplen,
 		.len = l2len
 	};
 
-	if (write_all_buf(pcap_fd, &h, sizeof(h)) < 0) {
-		debug_perror("Cannot log packet, packet header error");
+	if (!pcap_match(iov, iovcnt, offset, l2len))
 		return;
-	}
 
-	if (write_remainder(pcap_fd, iov, iovcnt, offset, l2len) < 0) {
-		debug_perror("Cannot log packet, length %zu", l2len);
+	if (pcap_sample > 1 && pcap_seen++ % pcap_sample)
+		return;
+
+	if (sizeof(h) + caplen > PCAP_BUF_SIZE - pcap_buf_used)
+		pcap_flush();
+
+	if (sizeof(h) + caplen > PCAP_BUF_SIZE) {
+		/* Can't happen with our frame sizes, but don't lose it */
+		if (write_all_buf(pcap_fd, &h, sizeof(h)) < 0 ||
+		    write_remainder(pcap_fd, iov, iovcnt, offset, caplen) < 0) {
+			pcap_dropped++;
+			debug_perror("Cannot log packet, length %zu", l2len);
+		}
 		return;
 	}
+
+	h.caplen = iov_to_buf(iov, iovcnt, offset,
+			      pcap_buf + pcap_buf_used + sizeof(h), caplen);
+	memcpy(pcap_buf + pcap_buf_used, &h, sizeof(h));
+	pcap_buf_used += sizeof(h) + h.caplen;
+	stats_mem_peak(STATS_MEM_PCAP, pcap_buf_used);
+	pcap_buf_frames++;
 }
 
 /**
@@ -151,26 +274,13 @@ void pcap_iov(const struct iovec *iov, size_t iovcnt, size_t offset,
  */
 void pcap_init(struct ctx *c)
 {
-	/* See pcap.h from libpcap, or pcap-savefile(5) */
-#define PCAP_MAGIC		0xa1b2c3d4
-#define PCAP_VERSION_MAJOR	2
-#define PCAP_VERSION_MINOR	4
-#define PCAP_LINKTYPE_ETHERNET	1
-	const struct {
-		uint32_t magic;
-		uint16_t major;
-		uint16_t minor;
-
-		int32_t thiszone;
-		uint32_t sigfigs;
-		uint32_t snaplen;
-
-		uint32_t linktype;
-	} pcap_hdr = {
+	const struct pcap_file_hdr pcap_hdr = {
 		.magic = PCAP_MAGIC,
 		.major = PCAP_VERSION_MAJOR,
 		.minor = PCAP_VERSION_MINOR,
-		.snaplen = tap_l2_max_len(c),
+		.snaplen = c->pcap_snaplen ? MIN(c->pcap_snaplen,
+						 tap_l2_max_len(c))
+					   : tap_l2_max_len(c),
 		.linktype = PCAP_LINKTYPE_ETHERNET
 	};
 
@@ -188,6 +298,11 @@ void pcap_init(struct ctx *c)
 
 	info("Saving packet capture to %s", c->pcap);
 
+	pcap_snaplen = c->pcap_snaplen;
+	pcap_sample = c->pcap_sample;
+	pcap_proto = c->pcap_proto;
+	pcap_port = c->pcap_port;
+
 	if (write(pcap_fd, &pcap_hdr, sizeof(pcap_hdr)) < 0)
 		warn_perror("Cannot write PCAP header");
 }
@@ -7,6 +7,49 @@
 #define PCAP_H
 
 #include <stddef.h>
+#include <stdint.h>
+
+/* See pcap.h from libpcap, or pcap-savefile(5) */
+#define PCAP_MAGIC		0xa1b2c3d4
+#define PCAP_VERSION_MAJOR	2
+#define PCAP_VERSION_MINOR	4
+#define PCAP_LINKTYPE_ETHERNET	1
+
+/**
+ * struct pcap_file_hdr - pcap file header
+ * @magic:	PCAP_MAGIC, in host byte order
+ * @major:	PCAP_VERSION_MAJOR
+ * @minor:	PCAP_VERSION_MINOR
+ * @thiszone:	Offset of timestamps from UTC, always 0
+ * @sigfigs:	Accuracy of timestamps, always 0
+ * @snaplen:	Maximum length of captured frames
+ * @linktype:	Link-layer header type, PCAP_LINKTYPE_ETHERNET
+ */
+struct pcap_file_hdr {
+	uint32_t magic;
+	uint16_t major;
+	uint16_t minor;
+
+	int32_t thiszone;
+	uint32_t sigfigs;
+	uint32_t snaplen;
+
+	uint32_t linktype;
+};
+
+/**
+ * struct pcap_pkthdr - pcap record header, preceding each frame
+ * @tv_sec:	Timestamp, seconds
+ * @tv_usec:	Timestamp, microseconds
+ * @caplen:	Length of captured data following this header
+ * @len:	Original length of frame
+ */
+struct pcap_pkthdr {
+	uint32_t tv_sec;
+	uint32_t tv_usec;
+	uint32_t caplen;
+	uint32_t len;
+};
 
 extern int pcap_fd;
 
@@ -15,6 +58,7 @@ void pcap_multiple(const struct iovec *iov, size_t frame_parts, unsigned int n,
 		   size_t offset);
 void pcap_iov(const struct iovec *iov, size_t iovcnt, size_t offset,
 	      size_t l2len);
+void pcap_flush(void);
 void pcap_init(struct ctx *c);
 
 #endif /* PCAP_H */
@@ -94,7 +94,14 @@ static void usage(const char *name, FILE *f, int status)
 		"    SPEC is as described above\n"
 		"  -U, --udp-ns SPEC	UDP port forwarding to init namespace\n"
 		"    SPEC is as described above\n"
+		"  --fwd-tune OPTS	Socket options for following rules\n"
+		"    OPTS is 'none' or a comma-separated list of:\n"
+		"      cc=NAME, notsent-lowat=BYTES, rcvbuf=BYTES,\n"
+		"      sndbuf=BYTES, busy-poll=USECS, max-rate=BYTES,\n"
+		"      priority=N, delay\n"
+		"    specifiers to delete must give the same options\n"
 		"  -s, --show		Show configuration before and after\n"
+		"  -S, --stats		Show traffic and main loop statistics\n"
 		"  -d, --debug		Print debugging messages\n"
 		"  -h, --help		Display this help message and exit\n"
 		"  --version		Show version and exit\n");
@@ -108,6 +115,9 @@ struct pif_configuration {
 	uint8_t pif;
 	char name[PIF_NAME_SIZE];
 	struct fwd_table fwd;
+	/* Rules as received from passt/pasta, to send differences only */
+	unsigned norig;
+	struct fwd_rule orig[MAX_FWD_RULES];
 };
 
 struct configuration {
@@ -229,6 +239,9 @@ static bool read_pif_conf(int fd, struct configuration *conf)
 			die("Error reading from control socket");
 	}
 
+	memcpy(pc->orig, pc->fwd.rules, pc->fwd.count * sizeof(*pc->orig));
+	pc->norig = pc->fwd.count;
+
 	conf->npifs++;
 	return true;
 }
@@ -266,6 +279,107 @@ fail:
 	die_perror("Error writing to control socket");
 }
 
+/**
+ * rule_in() - Check if a rule is in an array of rules
+ * @rule:	Rule to look for
+ * @rules:	Array of rules
+ * @count:	Number of rules in @rules
+ *
+ * Return: true if @rules has an exact match for @rule, false otherwise
+ */
+static bool rule_in(const struct fwd_rule *rule,
+		    const struct fwd_rule *rules, unsigned count)
+{
+	unsigned i;
+
+	for (i = 0; i < count; i++) {
+		if (!memcmp(rule, &rules[i], sizeof(*rule)))
+			return true;
+	}
+
+	return false;
+}
+
+/**
+ * send_delta_ops() - Count or send operations of a differential update
+ * @fd:		Control socket, or -1 to count operations only
+ * @conf:	Updated configuration
+ * @del:	Deletions (rules we received but don't have any longer),
+ *		otherwise additions
+ *
+ * Return: number of operations
+ */
+static unsigned send_delta_ops(int fd, const struct configuration *conf,
+			       bool del)
+{
+	unsigned i, j, n = 0;
+
+	for (i = 0; i < conf->npifs; i++) {
+		const struct pif_configuration *pc = &conf->pif[i];
+		const struct fwd_rule *rules = del ? pc->orig : pc->fwd.rules;
+		const struct fwd_rule *other = del ? pc->fwd.rules : pc->orig;
+		unsigned nother = del ? pc->fwd.count : pc->norig;
+		unsigned count = del ? pc->norig : pc->fwd.count;
+
+		for (j = 0; j < count; j++) {
+			if (rule_in(&rules[j], other, nother))
+				continue;
+
+			n++;
+			if (fd < 0)
+				continue;
+
+			if (write_u8(fd, del ? PESTO_DELTA_DEL :
+					       PESTO_DELTA_ADD) < 0 ||
+			    write_u8(fd, pc->pif) < 0 ||
+			    fwd_rule_write(fd, &rules[j]) < 0)
+				die_perror("Error writing to control socket");
+		}
+	}
+
+	return n;
+}
+
+/**
+ * send_delta() - Send differential configuration update to passt/pasta
+ * @fd:		Control socket
+ * @conf:	Updated configuration
+ *
+ * Unchanged rules aren't sent, so that passt/pasta doesn't touch their
+ * listening sockets. Deletions go first, as they might make room for rules
+ * that would conflict otherwise. If there are more than PESTO_DELTA_MAX
+ * changes, as it happens loading tables in bulk, replace them altogether.
+ */
+static void send_delta(int fd, const struct configuration *conf)
+{
+	uint32_t count, failed;
+
+	count = send_delta_ops(-1, conf, true);
+	count += send_delta_ops(-1, conf, false);
+	if (count > PESTO_DELTA_MAX) {
+		debug("%"PRIu32" rule operations, replacing whole tables",
+		      count);
+		send_conf(fd, conf);
+		return;
+	}
+
+	debug("Sending %"PRIu32" rule operations", count);
+
+	if (write_u8(fd, PESTO_DELTA_REQUEST) < 0 || write_u32(fd, count) < 0)
+		die_perror("Error writing to control socket");
+
+	send_delta_ops(fd, conf, true);
+	send_delta_ops(fd, conf, false);
+
+	if (read_u32(fd, &failed) < 0)
+		die_perror("Error reading update result");
+
+	if (failed) {
+		die("Update rejected at operation %"PRIu32" of %"PRIu32
+		    ", no changes applied", failed, count);
+	}
+}
+
 /**
  * show_conf() - Show current configuration obtained from passt/pasta
  * @conf:	Configuration description
@@ -284,6 +398,240 @@ static void show_conf(const struct configuration *conf)
 	(void)fflush(stdout);
 }
 
+/**
+ * hist_bucket_min() - Lower bound of latency histogram bucket
+ * @i:		Bucket index, see PESTO_STATS_HIST_SUB_BITS
+ *
+ * Return: smallest value counted in bucket @i, nanoseconds
+ */
+static uint64_t hist_bucket_min(unsigned i)
+{
+	const unsigned sub = PESTO_STATS_HIST_SUB_BITS;
+
+	if (i < (1U << sub))
+		return i;
+
+	return (uint64_t)((1U << sub) + (i & ((1U << sub) - 1))) <<
+	       ((i >> sub) - 1);
+}
+
+/**
+ * fmt_ns() - Format a duration with a readable unit
+ * @buf:	Output buffer
+ * @size:	Size of @buf
+ * @ns:		Duration, nanoseconds
+ *
+ * Return: @buf
+ */
+static const char *fmt_ns(char *buf, size_t size, uint64_t ns)
+{
+	if (ns < 10000)
+		snprintf(buf, size, "%"PRIu64" ns", ns);
+	else if (ns < 10000000)
+		snprintf(buf, size, "%"PRIu64" us", ns / 1000);
+	else
+		snprintf(buf, size, "%"PRIu64" ms", ns / 1000000);
+
+	return buf;
+}
+
+/**
+ * show_hist() - Show percentiles from a latency histogram
+ * @name:	Name of histogram
+ * @hist:	Count of samples for each bucket
+ *
+ * Percentiles are given as upper bounds of the bucket they fall in.
+ */
+static void show_hist(const char *name,
+		      const uint64_t hist[PESTO_STATS_HIST_BUCKETS])
+{
+	static const unsigned pct[] = { 500, 900, 990, 999, 1000 };
+	static const char *pct_name[] = { "50%", "90%", "99%", "99.9%", "max" };
+	uint64_t total = 0, seen = 0;
+	unsigned i, b = 0;
+
+	for (i = 0; i < PESTO_STATS_HIST_BUCKETS; i++)
+		total += hist[i];
+
+	printf("    %-19s %"PRIu64" samples", name, total);
+	if (!total) {
+		printf("\n");
+		return;
+	}
+
+	for (i = 0; i < ARRAY_SIZE(pct); i++) {
+		uint64_t rank = (total * pct[i] + 999) / 1000;
+		char buf[sizeof("18446744073709551615 ms")];
+
+		while (seen + hist[b] < rank)
+			seen += hist[b++];
+
+		if (b == PESTO_STATS_HIST_BUCKETS - 1) {
+			printf(", %s: >= %s", pct_name[i],
+			       fmt_ns(buf, sizeof(buf), hist_bucket_min(b)));
+		} else {
+			printf(", %s: < %s", pct_name[i],
+			       fmt_ns(buf, sizeof(buf),
+				      hist_bucket_min(b + 1)));
+		}
+	}
+	printf("\n");
+}
+
+/**
+ * show_stats() - Request and show statistics from passt/pasta
+ * @fd:		Control socket
+ * @path:	Socket path, for display
+ */
+static void show_stats(int fd, const char *path)
+{
+	static const char *proto_name[PESTO_STATS_PROTO_NUM] = {
+		[PESTO_STATS_TCP]	= "TCP",
+		[PESTO_STATS_UDP]	= "UDP",
+		[PESTO_STATS_ICMP]	= "ICMP",
+		[PESTO_STATS_OTHER]	= "other",
+	};
+	static const char *hist_name[PESTO_STATS_HIST_NUM] = {
+		[PESTO_STATS_HIST_EPOLL]	= "Event dispatch:",
+		[PESTO_STATS_HIST_TAP]		= "Tap batch:",
+		[PESTO_STATS_HIST_SOCK_TAP]	= "TCP socket to tap:",
+		[PESTO_STATS_HIST_FLOW_SETUP]	= "TCP flow setup:",
+	};
+	uint64_t unsent, partial, requeued, loops, loop_ns, loop_ns_max;
+	uint64_t hist[PESTO_STATS_HIST_BUCKETS];
+	uint32_t nprotos, flows, flows_max, nhist, nbuckets, nprof, nmem;
+	unsigned profiled = 0;
+	uint8_t pif;
+	unsigned i;
+
+	if (write_u8(fd, PESTO_STATS_REQUEST) < 0)
+		die_perror("Error writing to control socket");
+
+	if (read_u32(fd, &nprotos) < 0)
+		goto fail;
+
+	if (nprotos != PESTO_STATS_PROTO_NUM) {
+		die("Server has unexpected number of protocols (%"PRIu32
+		    " not %u)", nprotos, PESTO_STATS_PROTO_NUM);
+	}
+
+	printf("passt/pasta statistics (%s)\n", path);
+
+	while (1) {
+		char name[PIF_NAME_SIZE];
+
+		if (read_u8(fd, &pif) < 0)
+			goto fail;
+
+		if (pif == PIF_NONE)
+			break;
+
+		if (read_all_buf(fd, name, sizeof(name)) < 0)
+			goto fail;
+		name[sizeof(name) - 1] = '\0';
+
+		printf("  Received from %s:\n", name);
+
+		for (i = 0; i < PESTO_STATS_PROTO_NUM; i++) {
+			uint64_t packets, bytes, drops;
+
+			if (read_u64(fd, &packets) < 0 ||
+			    read_u64(fd, &bytes) < 0 ||
+			    read_u64(fd, &drops) < 0)
+				goto fail;
+
+			printf("    %-6s %"PRIu64" packets, %"PRIu64" bytes, "
+			       "%"PRIu64" dropped\n",
+			       proto_name[i], packets, bytes, drops);
+		}
+	}
+
+	if (read_u32(fd, &flows) < 0 || read_u32(fd, &flows_max) < 0)
+		goto fail;
+
+	if (read_u64(fd, &unsent) < 0 || read_u64(fd, &partial) < 0 ||
+	    read_u64(fd, &requeued) < 0 || read_u64(fd, &loops) < 0 ||
+	    read_u64(fd, &loop_ns) < 0 || read_u64(fd, &loop_ns_max) < 0)
+		goto fail;
+
+	printf("  Flows: %"PRIu32" of %"PRIu32"\n", flows, flows_max);
+	printf("  Frames to tap: %"PRIu64" not sent, %"PRIu64
+	       " partially sent, %"PRIu64" TCP frames requeued\n",
+	       unsent, partial, requeued);
+	printf("  Main loop: %"PRIu64" iterations, average %"PRIu64
+	       " ns, maximum %"PRIu64" ns\n",
+	       loops, loops ? loop_ns / loops : 0, loop_ns_max);
+
+	if (read_u32(fd, &nhist) < 0 || read_u32(fd, &nbuckets) < 0)
+		goto fail;
+
+	if (nhist != PESTO_STATS_HIST_NUM ||
+	    nbuckets != PESTO_STATS_HIST_BUCKETS) {
+		die("Server has unexpected histogram layout (%"PRIu32" of %"
+		    PRIu32" buckets, not %u of %u)", nhist, nbuckets,
+		    PESTO_STATS_HIST_NUM, PESTO_STATS_HIST_BUCKETS);
+	}
+
+	printf("  Latency:\n");
+	for (i = 0; i < PESTO_STATS_HIST_NUM; i++) {
+		unsigned b;
+
+		for (b = 0; b < PESTO_STATS_HIST_BUCKETS; b++) {
+			if (read_u64(fd, &hist[b]) < 0)
+				goto fail;
+		}
+
+		show_hist(hist_name[i], hist);
+	}
+
+	if (read_u32(fd, &nprof) < 0)
+		goto fail;
+
+	for (i = 0; i < nprof; i++) {
+		char name[PESTO_STATS_PROF_NAME_SIZE];
+		uint64_t calls, ns;
+
+		if (read_all_buf(fd, name, sizeof(name)) < 0 ||
+		    read_u64(fd, &calls) < 0 || read_u64(fd, &ns) < 0)
+			goto fail;
+		name[sizeof(name) - 1] = '\0';
+
+		if (!calls)
+			continue;
+
+		if (!profiled++)
+			printf("  Time by handler (--profile):\n");
+
+		printf("    %-34s %"PRIu64" calls, %"PRIu64" us, average %"
+		       PRIu64" ns, %.1f%% of main loop\n",
+		       name, calls, ns / 1000, ns / calls,
+		       loop_ns ? (double)ns * 100 / loop_ns : 0);
+	}
+
+	if (read_u32(fd, &nmem) < 0)
+		goto fail;
+
+	if (nmem)
+		printf("  Memory usage:\n");
+	for (i = 0; i < nmem; i++) {
+		char name[PESTO_STATS_MEM_NAME_SIZE];
+		uint64_t bytes;
+
+		if (read_all_buf(fd, name, sizeof(name)) < 0 ||
+		    read_u64(fd, &bytes) < 0)
+			goto fail;
+		name[sizeof(name) - 1] = '\0';
+
+		printf("    %-34s %"PRIu64" bytes\n", name, bytes);
+	}
+
+	(void)fflush(stdout);
+	return;
+
+fail:
+	die("Error reading statistics from control socket");
+}
+
 /**
  * main() - Dynamic reconfiguration client main program
  * @argc:	Argument count
@@ -309,15 +657,18 @@ int main(int argc, char **argv)
 		{"tcp-ns",	required_argument,	NULL,		'T' },
 		{"udp-ns",	required_argument,	NULL,		'U' },
 		{"show",	no_argument,		NULL,		's' },
+		{"stats",	no_argument,		NULL,		'S' },
+		{"fwd-tune",	required_argument,	NULL,		2 },
 		{ 0 },
 	};
 	enum { MODE_CLEAR, MODE_ADD, MODE_DEL } mode = MODE_CLEAR;
 	bool inbound_cleared = false, outbound_cleared = false;
 	struct pif_configuration *inbound, *outbound;
-	const char *optstring = "dhADC:t:u:T:U:s";
+	const char *optstring = "dhADC:t:u:T:U:sS";
 	struct sockaddr_un a = { AF_UNIX, "" };
-	struct configuration conf = { 0 };
-	bool update = false, show = false;
+	static struct configuration conf;
+	struct fwd_tune tune = { 0 };
+	bool update = false, show = false, stats = false;
 	struct pesto_hello hello;
 	struct sock_fprog prog;
 	int optname, ret, s;
@@ -359,9 +710,15 @@ int main(int argc, char **argv)
 			 */
 			update = true;
 			break;
+		case 2:
+			/* Applies to following specifiers, parsed with them */
+			break;
 		case 's':
 			show = true;
 			break;
+		case 'S':
+			stats = true;
+			break;
 		case 'h':
 			usage(argv[0], stdout, EXIT_SUCCESS);
 			break;
@@ -380,6 +737,9 @@ int main(int argc, char **argv)
 	if (argc - optind != 1)
 		usage(argv[0], stderr, EXIT_FAILURE);
 
+	if (stats && (update || show))
+		die("--stats can't be combined with configuration updates");
+
 	debug("debug_flag=%d, path=\"%s\"", debug_flag, argv[optind]);
 
 	if ((s = socket(AF_UNIX, SOCK_STREAM, 0)) < 0)
@@ -410,6 +770,14 @@ int main(int argc, char **argv)
 		    s_version, PESTO_PROTOCOL_VERSION);
 	}
 
+	/* Rules carry socket options from version 7, and a pacing rate from
+	 * version 9, without compatibility, so older servers aren't supported
+	 */
+	if (s_version && s_version < 9) {
+		die("Server protocol version %"PRIu32
+		    " has incompatible forwarding rules", s_version);
+	}
+
 	if (!s_version) {
 		if (PESTO_PROTOCOL_VERSION)
 			die("Unsupported experimental server protocol");
@@ -432,6 +800,11 @@ int main(int argc, char **argv)
 	while (read_pif_conf(s, &conf))
 		;
 
+	if (stats) {
+		show_stats(s, a.sun_path);
+		goto noupdate;
+	}
+
 	if (!update) {
 		printf("passt/pasta configuration (%s)\n", a.sun_path);
 		show_conf(&conf);
@@ -484,7 +857,7 @@ int main(int argc, char **argv)
 			}
 
 			fwd_rule_parse(optname, mode == MODE_DEL, optarg,
-				       &inbound->fwd);
+				       &tune, &inbound->fwd);
 			break;
 		case 'T':
 		case 'U':
@@ -499,7 +872,10 @@ int main(int argc, char **argv)
 			}
 
 			fwd_rule_parse(optname, mode == MODE_DEL, optarg,
-				       &outbound->fwd);
+				       &tune, &outbound->fwd);
+			break;
+		case 2:
+			fwd_tune_parse(optarg, &tune);
 			break;
 		default:
 			continue;
@@ -511,7 +887,7 @@ int main(int argc, char **argv)
 		show_conf(&conf);
 	}
 
-	send_conf(s, &conf);
+	send_delta(s, &conf);
 
 noupdate:
 	if (shutdown(s, SHUT_RDWR) < 0 || close(s) < 0)
@@ -19,7 +19,52 @@
  * but was little enough used that we decided not to implement backwards
  * compatiblity code (i.e. a v2 pesto will not work with a v1 pasta)
  */
-#define PESTO_PROTOCOL_VERSION	2
+/* Version 2 had no statistics query (PESTO_STATS_REQUEST) */
+/* Version 3 had no latency histograms in statistics */
+/* Version 4 had no handler profile in statistics */
+/* Version 5 had no differential rule updates (PESTO_DELTA_REQUEST) */
+/* Version 6 had no socket options in struct fwd_rule */
+/* Version 7 had no memory usage in statistics */
+/* Version 8 had no pacing rate in struct fwd_tune */
+#define PESTO_PROTOCOL_VERSION	9
+
+/* Sent by the client in place of the first pif id to request statistics,
+ * instead of a rules update.  The server replies with:
+ *   - u32 number of protocols (PESTO_STATS_PROTO_NUM)
+ *   - for each pif: u8 pif id, pif name (PIF_NAME_SIZE bytes), and for each
+ *     protocol, u64 packets, bytes and drops received from that pif
+ *   - u8 PIF_NONE
+ *   - u32 flows in use, u32 maximum number of flows
+ *   - u64 frames not sent to tap, frames partially sent to tap, TCP frames
+ *     requeued, main loop iterations, total and maximum nanoseconds spent in
+ *     a single main loop iteration
+ *   - u32 number of histograms (PESTO_STATS_HIST_NUM), u32 number of buckets
+ *     per histogram (PESTO_STATS_HIST_BUCKETS), and, for each histogram, u64
+ *     count of samples for each bucket
+ *   - u32 number of profiled handlers, and for each handler: name
+ *     (PESTO_STATS_PROF_NAME_SIZE bytes), u64 calls and total nanoseconds,
+ *     all zero unless --profile is given
+ *   - u32 number of memory usage entries, and for each entry: name
+ *     (PESTO_STATS_MEM_NAME_SIZE bytes) and u64 bytes used
+ */
+#define PESTO_STATS_REQUEST	UINT8_MAX
+
+/* Sent by the client in place of the first pif id to add or delete single
+ * rules in the current tables, instead of replacing them, followed by:
+ *   - u32 number of operations, at most PESTO_DELTA_MAX
+ *   - for each operation: u8 PESTO_DELTA_ADD or PESTO_DELTA_DEL, u8 pif id,
+ *     and the rule, which must match an existing one exactly for deletion
+ * Operations are applied in order, and either all or none of them take effect.
+ * The server replies with a u32: zero on success, otherwise the number of the
+ * first operation that failed, starting from one.
+ */
+#define PESTO_DELTA_REQUEST	(UINT8_MAX - 1)
+
+#define PESTO_DELTA_ADD		1
+#define PESTO_DELTA_DEL		2
+
+/* Maximum number of operations in a differential update */
+#define PESTO_DELTA_MAX		1024
 
 /* Maximum size of a pif name, including \0 */
 #define	PIF_NAME_SIZE	(128)
@@ -55,4 +100,47 @@ struct pesto_pif_info {
 	uint32_t count;
 } __attribute__ ((__packed__));
 
+/**
+ * enum pesto_stats_proto - Protocols for per-pif statistics, in reply order
+ */
+enum pesto_stats_proto {
+	PESTO_STATS_TCP,
+	PESTO_STATS_UDP,
+	PESTO_STATS_ICMP,
+	/* Anything else, including frames we couldn't parse */
+	PESTO_STATS_OTHER,
+
+	PESTO_STATS_PROTO_NUM,
+};
+
+/**
+ * enum pesto_stats_hist - Latency histograms, in reply order
+ */
+enum pesto_stats_hist {
+	/* From epoll_wait() return to dispatch of each event */
+	PESTO_STATS_HIST_EPOLL,
+	/* Processing of a batch of frames from tap, in tap_handler() */
+	PESTO_STATS_HIST_TAP,
+	/* TCP socket data to tap: from first receive to send, per batch */
+	PESTO_STATS_HIST_SOCK_TAP,
+	/* TCP flow setup: from SYN from tap to connect() completion */
+	PESTO_STATS_HIST_FLOW_SETUP,
+
+	PESTO_STATS_HIST_NUM,
+};
+
+/* Histogram buckets, in nanoseconds, are log-linear: values below
+ * 2^PESTO_STATS_HIST_SUB_BITS have a bucket each, and each further power of
+ * two is split into 2^PESTO_STATS_HIST_SUB_BITS equal buckets. The last bucket
+ * also counts any larger value.
+ */
+#define PESTO_STATS_HIST_SUB_BITS	2
+#define PESTO_STATS_HIST_BUCKETS	128
+
+/* Maximum size of a profiled handler name, including \0 */
+#define PESTO_STATS_PROF_NAME_SIZE	64
+
+/* Maximum size of a memory usage entry name, including \0 */
+#define PESTO_STATS_MEM_NAME_SIZE	32
+
 #endif /* PESTO_H */
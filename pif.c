@@ -70,6 +70,7 @@ void pif_sockaddr(const struct ctx *c, union sockaddr_inany *sa,
  * @ifname:	Interface for binding, NULL for any
  * @port:	Port number to bind to (host byte order)
  * @rule:	Forwarding rule index this socket belongs to
+ * @transparent:	Set IP_TRANSPARENT (IPV6_TRANSPARENT) for TPROXY use
  *
  * NOTE: For namespace pifs, this must be called having already entered the
  * relevant namespace.
@@ -78,7 +79,7 @@ void pif_sockaddr(const struct ctx *c, union sockaddr_inany *sa,
  */
 int pif_listen(const struct ctx *c, uint8_t proto, uint8_t pif,
 	       const union inany_addr *addr, const char *ifname,
-	       in_port_t port, unsigned rule)
+	       in_port_t port, unsigned rule, bool transparent)
 {
 	enum epoll_type type;
 	union epoll_ref ref;
@@ -120,6 +121,21 @@ int pif_listen(const struct ctx *c, uint8_t proto, uint8_t pif,
 	if (ref.fd < 0)
 		return ref.fd;
 
+	if (transparent) {
+		bool v4 = addr && inany_v4(addr);
+		int one = 1;
+
+		/* Needs CAP_NET_ADMIN: connections redirected by TPROXY then
+		 * show their original destination as local address
+		 */
+		if (setsockopt(ref.fd, v4 ? IPPROTO_IP : IPPROTO_IPV6,
+			       v4 ? IP_TRANSPARENT : IPV6_TRANSPARENT,
+			       &one, sizeof(one))) {
+			ret = -errno;
+			goto fail;
+		}
+	}
+
 	ref.type = type;
 	ref.listen.port = port;
 	ref.listen.pif = pif;
@@ -0,0 +1,49 @@
+/* SPDX-License-Identifier: GPL-2.0-or-later
+ * Copyright Red Hat
+ *
+ * Statically defined tracing (USDT) probes on the data path
+ *
+ * If <sys/sdt.h> is available at build time, PROBE() places a probe point,
+ * a single NOP instruction with an ELF note describing its arguments, which
+ * tools such as bpftrace, perf(1) or SystemTap can attach to at run time. No
+ * system calls are involved, so the seccomp profile is unaffected. Otherwise,
+ * PROBE() compiles to nothing, and arguments aren't evaluated.
+ *
+ * Probes, provider "passt", and their arguments:
+ *
+ *   tap_add_packet		l2len
+ *   tap_send_frames		frames to send, frames sent
+ *   tap_send_partial		index of partially sent frame, bytes sent
+ *   tcp_data_from_sock_start	flow index, bytes allowed by window
+ *   tcp_data_from_sock_done	flow index, return value
+ *   tcp_data_from_tap_start	flow index, number of segments
+ *   tcp_data_from_tap_done	flow index, return value
+ *   tcp_payload_flush		frames to send, frames sent
+ *   udp_sock_fwd_start		socket, interface of socket
+ *   udp_sock_fwd_done		socket, interface of socket
+ *   udp_sock_fwd_batch		socket, datagrams received
+ *   flow_alloc			flow index
+ *   flow_free			flow index, flow type
+ *   vu_queue_pop		virtqueue, available index, entries in use
+ *   vu_queue_flush		virtqueue, entries flushed
+ *
+ * For example, to get a histogram of TCP socket-side forwarding latencies:
+ *
+ *   bpftrace -e '
+ *     usdt:./passt:passt:tcp_data_from_sock_start { @s[tid] = nsecs; }
+ *     usdt:./passt:passt:tcp_data_from_sock_done /@s[tid]/ {
+ *         @ns = hist(nsecs - @s[tid]); delete(@s[tid]); }'
+ */
+
+#ifndef PROBE_H
+#define PROBE_H
+
+#ifdef HAS_SDT
+#include <sys/sdt.h>
+
+#define PROBE(name, ...)	STAP_PROBEV(passt, name, __VA_ARGS__)
+#else
+#define PROBE(name, ...)	do { } while (0)
+#endif
+
+#endif /* PROBE_H */
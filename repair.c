@@ -25,6 +25,7 @@
 #include "epoll_ctl.h"
 
 #include "repair.h"
+#include "stats.h"
 
 #define SCM_MAX_FD 253 /* From Linux kernel (include/net/scm.h), not in UAPI */
 
@@ -242,6 +243,8 @@ int repair_flush(struct ctx *c)
 		return -ENXIO;
 	}
 
+	passt_stats.migrate.repair++;
+
 	return 0;
 }
 
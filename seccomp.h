@@ -0,0 +1,308 @@
+/* This file was automatically generated by seccomp.sh */
+
+#include <stddef.h>
+#include <linux/audit.h>
+#include <linux/filter.h>
+#include <linux/seccomp.h>
+
+#ifndef AUDIT_ARCH_PPC64LE
+#define AUDIT_ARCH_PPC64LE (AUDIT_ARCH_PPC64 | __AUDIT_ARCH_LE)
+#endif
+
+struct sock_filter filter_passt[] = {
+	/* cppcheck-suppress [badBitmaskCheck, unmatchedSuppression] */
+	BPF_STMT(BPF_LD | BPF_W | BPF_ABS,
+		 (offsetof(struct seccomp_data, arch))),
+	BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, AUDIT_ARCH_X86_64, 0, 88),
+	/* cppcheck-suppress [badBitmaskCheck, unmatchedSuppression] */
+	BPF_STMT(BPF_LD | BPF_W | BPF_ABS,
+		 (offsetof(struct seccomp_data, nr))),
+	BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, 232, 87, 0), /* epoll_wait */
+	BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, 281, 86, 0), /* epoll_pwait */
+	BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, 47, 85, 0), /* recvmsg */
+	BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, 46, 84, 0), /* sendmsg */
+	BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, 299, 83, 0), /* recvmmsg */
+	BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, 307, 82, 0), /* sendmmsg */
+	BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, 20, 81, 0), /* writev */
+	BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, 0, 80, 0), /* read */
+	BPF_JUMP(BPF_JMP | BPF_JGE | BPF_K, 8, 1, 0),
+	BPF_JUMP(BPF_JMP | BPF_JGE | BPF_K, 0, 2, 1),
+	BPF_JUMP(BPF_JMP | BPF_JGE | BPF_K, 51, 3, 2),
+	BPF_JUMP(BPF_JMP | BPF_JGE | BPF_K, 0, 4, 3),
+	BPF_JUMP(BPF_JMP | BPF_JGE | BPF_K, 0, 5, 4),
+	BPF_JUMP(BPF_JMP | BPF_JGE | BPF_K, 43, 6, 5),
+	BPF_JUMP(BPF_JMP | BPF_JGE | BPF_K, 232, 7, 6),
+	BPF_JUMP(BPF_JMP | BPF_JGE | BPF_K, 0, 10, 7),
+	BPF_JUMP(BPF_JMP | BPF_JGE | BPF_K, 0, 17, 13),
+	BPF_JUMP(BPF_JMP | BPF_JGE | BPF_K, 0, 24, 20),
+	BPF_JUMP(BPF_JMP | BPF_JGE | BPF_K, 0, 31, 27),
+	BPF_JUMP(BPF_JMP | BPF_JGE | BPF_K, 20, 38, 34),
+	BPF_JUMP(BPF_JMP | BPF_JGE | BPF_K, 47, 45, 41),
+	BPF_JUMP(BPF_JMP | BPF_JGE | BPF_K, 74, 52, 48),
+	BPF_JUMP(BPF_JMP | BPF_JGE | BPF_K, 285, 59, 55),
+	BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, 0, 64, 0), /* read */
+	BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, 0, 63, 0), /* read */
+	BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, 0, 62, 0), /* read */
+	BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, 0, 61, 0), /* read */
+	BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, 0, 60, 0), /* read */
+	BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, 0, 59, 0), /* read */
+	BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, 0, 58, 0), /* read */
+	BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, 0, 57, 0), /* read */
+	BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, 0, 56, 0), /* read */
+	BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, 0, 55, 0), /* read */
+	BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, 0, 54, 0), /* read */
+	BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, 0, 53, 0), /* read */
+	BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, 0, 52, 0), /* read */
+	BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, 0, 51, 0), /* read */
+	BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, 0, 50, 0), /* read */
+	BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, 0, 49, 0), /* read */
+	BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, 0, 48, 0), /* read */
+	BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, 0, 47, 0), /* read */
+	BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, 0, 46, 0), /* read */
+	BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, 0, 45, 0), /* read */
+	BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, 0, 44, 0), /* read */
+	BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, 0, 43, 0), /* read */
+	BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, 0, 42, 0), /* read */
+	BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, 0, 41, 0), /* read */
+	BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, 0, 40, 0), /* read */
+	BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, 0, 39, 0), /* read */
+	BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, 0, 38, 0), /* read */
+	BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, 0, 37, 0), /* read */
+	BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, 0, 36, 0), /* read */
+	BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, 1, 35, 0), /* write */
+	BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, 3, 34, 0), /* close */
+	BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, 8, 33, 0), /* lseek */
+	BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, 9, 32, 0), /* mmap */
+	BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, 11, 31, 0), /* munmap */
+	BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, 16, 30, 0), /* ioctl */
+	BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, 20, 29, 0), /* writev */
+	BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, 28, 28, 0), /* madvise */
+	BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, 41, 27, 0), /* socket */
+	BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, 42, 26, 0), /* connect */
+	BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, 43, 25, 0), /* accept */
+	BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, 44, 24, 0), /* sendto */
+	BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, 45, 23, 0), /* recvfrom */
+	BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, 46, 22, 0), /* sendmsg */
+	BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, 47, 21, 0), /* recvmsg */
+	BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, 48, 20, 0), /* shutdown */
+	BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, 49, 19, 0), /* bind */
+	BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, 50, 18, 0), /* listen */
+	BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, 51, 17, 0), /* getsockname */
+	BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, 54, 16, 0), /* setsockopt */
+	BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, 55, 15, 0), /* getsockopt */
+	BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, 72, 14, 0), /* fcntl */
+	BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, 74, 13, 0), /* fsync */
+	BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, 77, 12, 0), /* ftruncate */
+	BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, 228, 11, 0), /* clock_gettime */
+	BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, 231, 10, 0), /* exit_group */
+	BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, 232, 9, 0), /* epoll_wait */
+	BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, 233, 8, 0), /* epoll_ctl */
+	BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, 281, 7, 0), /* epoll_pwait */
+	BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, 283, 6, 0), /* timerfd_create */
+	BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, 285, 5, 0), /* fallocate */
+	BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, 286, 4, 0), /* timerfd_settime */
+	BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, 288, 3, 0), /* accept4 */
+	BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, 299, 2, 0), /* recvmmsg */
+	BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, 307, 1, 0), /* sendmmsg */
+	BPF_STMT(BPF_RET | BPF_K, SECCOMP_RET_KILL_PROCESS),
+	BPF_STMT(BPF_RET | BPF_K, SECCOMP_RET_ALLOW),
+};
+
+struct sock_filter filter_pasta[] = {
+	/* cppcheck-suppress [badBitmaskCheck, unmatchedSuppression] */
+	BPF_STMT(BPF_LD | BPF_W | BPF_ABS,
+		 (offsetof(struct seccomp_data, arch))),
+	BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, AUDIT_ARCH_X86_64, 0, 89),
+	/* cppcheck-suppress [badBitmaskCheck, unmatchedSuppression] */
+	BPF_STMT(BPF_LD | BPF_W | BPF_ABS,
+		 (offsetof(struct seccomp_data, nr))),
+	BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, 232, 88, 0), /* epoll_wait */
+	BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, 281, 87, 0), /* epoll_pwait */
+	BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, 47, 86, 0), /* recvmsg */
+	BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, 46, 85, 0), /* sendmsg */
+	BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, 299, 84, 0), /* recvmmsg */
+	BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, 307, 83, 0), /* sendmmsg */
+	BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, 20, 82, 0), /* writev */
+	BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, 0, 81, 0), /* read */
+	BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, 275, 80, 0), /* splice */
+	BPF_JUMP(BPF_JMP | BPF_JGE | BPF_K, 43, 1, 0),
+	BPF_JUMP(BPF_JMP | BPF_JGE | BPF_K, 0, 2, 1),
+	BPF_JUMP(BPF_JMP | BPF_JGE | BPF_K, 228, 3, 2),
+	BPF_JUMP(BPF_JMP | BPF_JGE | BPF_K, 0, 4, 3),
+	BPF_JUMP(BPF_JMP | BPF_JGE | BPF_K, 11, 5, 4),
+	BPF_JUMP(BPF_JMP | BPF_JGE | BPF_K, 51, 6, 5),
+	BPF_JUMP(BPF_JMP | BPF_JGE | BPF_K, 283, 7, 6),
+	BPF_JUMP(BPF_JMP | BPF_JGE | BPF_K, 0, 10, 7),
+	BPF_JUMP(BPF_JMP | BPF_JGE | BPF_K, 0, 17, 13),
+	BPF_JUMP(BPF_JMP | BPF_JGE | BPF_K, 1, 24, 20),
+	BPF_JUMP(BPF_JMP | BPF_JGE | BPF_K, 20, 31, 27),
+	BPF_JUMP(BPF_JMP | BPF_JGE | BPF_K, 47, 38, 34),
+	BPF_JUMP(BPF_JMP | BPF_JGE | BPF_K, 60, 45, 41),
+	BPF_JUMP(BPF_JMP | BPF_JGE | BPF_K, 247, 52, 48),
+	BPF_JUMP(BPF_JMP | BPF_JGE | BPF_K, 293, 59, 55),
+	BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, 0, 64, 0), /* read */
+	BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, 0, 63, 0), /* read */
+	BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, 0, 62, 0), /* read */
+	BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, 0, 61, 0), /* read */
+	BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, 0, 60, 0), /* read */
+	BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, 0, 59, 0), /* read */
+	BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, 0, 58, 0), /* read */
+	BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, 0, 57, 0), /* read */
+	BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, 0, 56, 0), /* read */
+	BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, 0, 55, 0), /* read */
+	BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, 0, 54, 0), /* read */
+	BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, 0, 53, 0), /* read */
+	BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, 0, 52, 0), /* read */
+	BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, 0, 51, 0), /* read */
+	BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, 0, 50, 0), /* read */
+	BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, 0, 49, 0), /* read */
+	BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, 0, 48, 0), /* read */
+	BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, 0, 47, 0), /* read */
+	BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, 0, 46, 0), /* read */
+	BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, 1, 45, 0), /* write */
+	BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, 3, 44, 0), /* close */
+	BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, 8, 43, 0), /* lseek */
+	BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, 9, 42, 0), /* mmap */
+	BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, 11, 41, 0), /* munmap */
+	BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, 14, 40, 0), /* rt_sigprocmask */
+	BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, 15, 39, 0), /* rt_sigreturn */
+	BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, 16, 38, 0), /* ioctl */
+	BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, 20, 37, 0), /* writev */
+	BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, 28, 36, 0), /* madvise */
+	BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, 41, 35, 0), /* socket */
+	BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, 42, 34, 0), /* connect */
+	BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, 43, 33, 0), /* accept */
+	BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, 44, 32, 0), /* sendto */
+	BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, 45, 31, 0), /* recvfrom */
+	BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, 46, 30, 0), /* sendmsg */
+	BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, 47, 29, 0), /* recvmsg */
+	BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, 48, 28, 0), /* shutdown */
+	BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, 49, 27, 0), /* bind */
+	BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, 50, 26, 0), /* listen */
+	BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, 51, 25, 0), /* getsockname */
+	BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, 54, 24, 0), /* setsockopt */
+	BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, 55, 23, 0), /* getsockopt */
+	BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, 56, 22, 0), /* clone */
+	BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, 60, 21, 0), /* exit */
+	BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, 72, 20, 0), /* fcntl */
+	BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, 74, 19, 0), /* fsync */
+	BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, 77, 18, 0), /* ftruncate */
+	BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, 228, 17, 0), /* clock_gettime */
+	BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, 231, 16, 0), /* exit_group */
+	BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, 232, 15, 0), /* epoll_wait */
+	BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, 233, 14, 0), /* epoll_ctl */
+	BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, 247, 13, 0), /* waitid */
+	BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, 257, 12, 0), /* openat */
+	BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, 275, 11, 0), /* splice */
+	BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, 281, 10, 0), /* epoll_pwait */
+	BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, 283, 9, 0), /* timerfd_create */
+	BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, 285, 8, 0), /* fallocate */
+	BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, 286, 7, 0), /* timerfd_settime */
+	BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, 288, 6, 0), /* accept4 */
+	BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, 293, 5, 0), /* pipe2 */
+	BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, 299, 4, 0), /* recvmmsg */
+	BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, 307, 3, 0), /* sendmmsg */
+	BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, 308, 2, 0), /* setns */
+	BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, 426, 1, 0), /* io_uring_enter */
+	BPF_STMT(BPF_RET | BPF_K, SECCOMP_RET_KILL_PROCESS),
+	BPF_STMT(BPF_RET | BPF_K, SECCOMP_RET_ALLOW),
+};
+
+struct sock_filter filter_vu[] = {
+	/* cppcheck-suppress [badBitmaskCheck, unmatchedSuppression] */
+	BPF_STMT(BPF_LD | BPF_W | BPF_ABS,
+		 (offsetof(struct seccomp_data, arch))),
+	BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, AUDIT_ARCH_X86_64, 0, 88),
+	/* cppcheck-suppress [badBitmaskCheck, unmatchedSuppression] */
+	BPF_STMT(BPF_LD | BPF_W | BPF_ABS,
+		 (offsetof(struct seccomp_data, nr))),
+	BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, 232, 87, 0), /* epoll_wait */
+	BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, 281, 86, 0), /* epoll_pwait */
+	BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, 47, 85, 0), /* recvmsg */
+	BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, 46, 84, 0), /* sendmsg */
+	BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, 299, 83, 0), /* recvmmsg */
+	BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, 307, 82, 0), /* sendmmsg */
+	BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, 20, 81, 0), /* writev */
+	BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, 0, 80, 0), /* read */
+	BPF_JUMP(BPF_JMP | BPF_JGE | BPF_K, 9, 1, 0),
+	BPF_JUMP(BPF_JMP | BPF_JGE | BPF_K, 0, 2, 1),
+	BPF_JUMP(BPF_JMP | BPF_JGE | BPF_K, 51, 3, 2),
+	BPF_JUMP(BPF_JMP | BPF_JGE | BPF_K, 0, 4, 3),
+	BPF_JUMP(BPF_JMP | BPF_JGE | BPF_K, 0, 5, 4),
+	BPF_JUMP(BPF_JMP | BPF_JGE | BPF_K, 43, 6, 5),
+	BPF_JUMP(BPF_JMP | BPF_JGE | BPF_K, 232, 7, 6),
+	BPF_JUMP(BPF_JMP | BPF_JGE | BPF_K, 0, 10, 7),
+	BPF_JUMP(BPF_JMP | BPF_JGE | BPF_K, 0, 17, 13),
+	BPF_JUMP(BPF_JMP | BPF_JGE | BPF_K, 0, 24, 20),
+	BPF_JUMP(BPF_JMP | BPF_JGE | BPF_K, 0, 31, 27),
+	BPF_JUMP(BPF_JMP | BPF_JGE | BPF_K, 20, 38, 34),
+	BPF_JUMP(BPF_JMP | BPF_JGE | BPF_K, 47, 45, 41),
+	BPF_JUMP(BPF_JMP | BPF_JGE | BPF_K, 74, 52, 48),
+	BPF_JUMP(BPF_JMP | BPF_JGE | BPF_K, 285, 59, 55),
+	BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, 0, 64, 0), /* read */
+	BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, 0, 63, 0), /* read */
+	BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, 0, 62, 0), /* read */
+	BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, 0, 61, 0), /* read */
+	BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, 0, 60, 0), /* read */
+	BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, 0, 59, 0), /* read */
+	BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, 0, 58, 0), /* read */
+	BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, 0, 57, 0), /* read */
+	BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, 0, 56, 0), /* read */
+	BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, 0, 55, 0), /* read */
+	BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, 0, 54, 0), /* read */
+	BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, 0, 53, 0), /* read */
+	BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, 0, 52, 0), /* read */
+	BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, 0, 51, 0), /* read */
+	BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, 0, 50, 0), /* read */
+	BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, 0, 49, 0), /* read */
+	BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, 0, 48, 0), /* read */
+	BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, 0, 47, 0), /* read */
+	BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, 0, 46, 0), /* read */
+	BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, 0, 45, 0), /* read */
+	BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, 0, 44, 0), /* read */
+	BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, 0, 43, 0), /* read */
+	BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, 0, 42, 0), /* read */
+	BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, 0, 41, 0), /* read */
+	BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, 0, 40, 0), /* read */
+	BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, 0, 39, 0), /* read */
+	BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, 0, 38, 0), /* read */
+	BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, 0, 37, 0), /* read */
+	BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, 1, 36, 0), /* write */
+	BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, 3, 35, 0), /* close */
+	BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, 8, 34, 0), /* lseek */
+	BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, 9, 33, 0), /* mmap */
+	BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, 11, 32, 0), /* munmap */
+	BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, 16, 31, 0), /* ioctl */
+	BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, 19, 30, 0), /* readv */
+	BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, 20, 29, 0), /* writev */
+	BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, 28, 28, 0), /* madvise */
+	BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, 41, 27, 0), /* socket */
+	BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, 42, 26, 0), /* connect */
+	BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, 43, 25, 0), /* accept */
+	BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, 44, 24, 0), /* sendto */
+	BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, 45, 23, 0), /* recvfrom */
+	BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, 46, 22, 0), /* sendmsg */
+	BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, 47, 21, 0), /* recvmsg */
+	BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, 48, 20, 0), /* shutdown */
+	BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, 49, 19, 0), /* bind */
+	BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, 50, 18, 0), /* listen */
+	BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, 51, 17, 0), /* getsockname */
+	BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, 54, 16, 0), /* setsockopt */
+	BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, 55, 15, 0), /* getsockopt */
+	BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, 72, 14, 0), /* fcntl */
+	BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, 74, 13, 0), /* fsync */
+	BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, 77, 12, 0), /* ftruncate */
+	BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, 228, 11, 0), /* clock_gettime */
+	BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, 231, 10, 0), /* exit_group */
+	BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, 232, 9, 0), /* epoll_wait */
+	BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, 233, 8, 0), /* epoll_ctl */
+	BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, 281, 7, 0), /* epoll_pwait */
+	BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, 283, 6, 0), /* timerfd_create */
+	BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, 285, 5, 0), /* fallocate */
+	BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, 286, 4, 0), /* timerfd_settime */
+	BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, 288, 3, 0), /* accept4 */
+	BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, 299, 2, 0), /* recvmmsg */
+	BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, 307, 1, 0), /* sendmmsg */
+	BPF_STMT(BPF_RET | BPF_K, SECCOMP_RET_KILL_PROCESS),
+	BPF_STMT(BPF_RET | BPF_K, SECCOMP_RET_ALLOW),
+};
@@ -65,12 +65,16 @@ POST='	BPF_STMT(BPF_RET | BPF_K, SECCOMP_RET_KILL_PROCESS),
 # Syscall, @NR@: number, @ALLOW@: offset to RET_ALLOW, @NAME@: syscall name
 CALL='	BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, @NR@, @ALLOW@, 0), /* @NAME@ */'
 
+# Data path system calls, checked before the binary search tree, in this order
+HOT="epoll_wait epoll_pwait recvmsg sendmsg recvmmsg sendmmsg writev read
+     splice"
+
 # Binary search tree node or leaf, @NR@: value, @R@: right jump, @L@: left jump
 BST='	BPF_JUMP(BPF_JMP | BPF_JGE | BPF_K, @NR@, @R@, @L@),'
 
 # cleanup() - Remove temporary file if it exists
 cleanup() {
-	rm -f "${TMP}" "${OUT}"
+	rm -f "${TMP}" "${TMP}.calls" "${OUT}"
 }
 trap "cleanup" EXIT
 
@@ -250,6 +254,28 @@ gen_profile() {
 		sub ${__i} CALL "NR:${__nr}" "NAME:${__name}" "ALLOW:${__allow}"
 	done
 
+	# Hot calls: prepend, jumps from statements above are relative
+	__hot=
+	for __name in ${HOT}; do
+		case " ${*} " in *" ${__name} "*) ;; *) continue ;; esac
+		__hot="${__hot} ${__name}"
+	done
+	__hot_count=0
+	for __name in ${__hot}; do __hot_count=$(( __hot_count + 1 )); done
+	__statements=$(( __statements + __hot_count ))
+
+	mv "${TMP}" "${TMP}.calls"
+	__allow=${__statements}
+	for __name in ${__hot}; do
+		printf '%s\n' "${CALL}" | sed			\
+			-e "s/@NR@/$(syscall_nr ${__name})/"	\
+			-e "s/@NAME@/${__name}/"		\
+			-e "s/@ALLOW@/${__allow}/" >> "${TMP}"
+		__allow=$(( __allow - 1 ))
+	done
+	cat "${TMP}.calls" >> "${TMP}"
+	rm "${TMP}.calls"
+
 	finish PRE "PROFILE:${__profile}" "KILL:$(( __statements + 1))" \
 	       "AUDIT_ARCH:${AUDIT_ARCH}"
 }
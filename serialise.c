@@ -126,5 +126,6 @@ int write_all_buf(int fd, const void *buf, size_t len)
 
 SERIALISE_UINT(8)
 SERIALISE_UINT(32)
+SERIALISE_UINT(64)
 
 #undef SERIALISE_UINT
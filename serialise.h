@@ -18,5 +18,6 @@ int write_all_buf(int fd, const void *buf, size_t len);
 
 SERIALISE_UINT_DECL(8)
 SERIALISE_UINT_DECL(32)
+SERIALISE_UINT_DECL(64)
 
 #endif /* SERIALISE_H */
@@ -0,0 +1,308 @@
+/* SPDX-License-Identifier: GPL-2.0-or-later
+ * Copyright Red Hat
+ *
+ * Statistics: event counters, per-pif packet counters, main loop timings
+ */
+
+#ifndef STATS_H
+#define STATS_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+#include <netinet/in.h>
+
+#include "common.h"
+#include "epoll_type.h"
+#include "flow.h"
+#include "pif.h"
+
+/* Histogram buckets for batch sizes: 0, 1, 2-3, 4-7, ..., 128-255, 256 */
+#define EPOLL_BATCH_BUCKETS	10
+
+/* Layout version of struct passt_stats, as mapped with --stats-file */
+#define STATS_FILE_VERSION	3
+
+/**
+ * struct stats_l4 - Counters for traffic received from a pif, single protocol
+ * @packets:	Packets (or segments, or datagrams) received
+ * @bytes:	Bytes received, L4 payload and headers for tap, payload otherwise
+ * @drops:	Packets we discarded instead of forwarding
+ */
+struct stats_l4 {
+	uint64_t packets;
+	uint64_t bytes;
+	uint64_t drops;
+};
+
+/**
+ * struct stats_prof - Time spent in a handler, with --profile
+ * @calls:	Number of calls
+ * @ns:		Total time, nanoseconds
+ */
+struct stats_prof {
+	uint64_t calls;
+	uint64_t ns;
+};
+
+/**
+ * enum stats_prof_defer - Deferred handlers and timers profiled per iteration
+ */
+enum stats_prof_defer {
+	STATS_PROF_TCP_DEFER,
+	STATS_PROF_ICMP_FLUSH,
+	STATS_PROF_UDP_FLUSH,
+	STATS_PROF_FLOW_DEFER,
+	STATS_PROF_FWD_SCAN,
+	STATS_PROF_NDP_TIMER,
+	STATS_PROF_TAP_FLUSH,
+	STATS_PROF_PCAP_FLUSH,
+	STATS_PROF_MIGRATE,
+
+	STATS_PROF_DEFER_NUM,
+};
+
+extern const char *stats_prof_defer_str[];
+
+/**
+ * enum stats_mem - Memory usage by subsystem, in bytes
+ */
+enum stats_mem {
+	/* Flow table entries in use */
+	STATS_MEM_FLOW,
+	/* Largest batch of TCP payload buffers filled for tap */
+	STATS_MEM_TCP_BUF,
+	/* Largest batch of UDP payload buffers filled from sockets */
+	STATS_MEM_UDP_BUF,
+	/* Size of pipes held by spliced TCP connections */
+	STATS_MEM_SPLICE_PIPE,
+	/* Sending buffer sizes of TCP sockets, as last fetched from kernel */
+	STATS_MEM_TCP_SNDBUF,
+	/* Guest memory regions mapped for vhost-user */
+	STATS_MEM_VU_REGION,
+	/* Peak usage of capture buffer, with --pcap */
+	STATS_MEM_PCAP,
+	/* Peak usage of log file buffer, with --log-file */
+	STATS_MEM_LOG,
+
+	STATS_MEM_NUM,
+};
+
+extern const char *stats_mem_str[];
+
+/* Migration stages we keep timings for, see struct migrate_version */
+#define STATS_MIGRATE_STAGES	4
+
+/**
+ * struct stats_migrate - Device state transfer, last migration only
+ * @flows:	Flows sent or received
+ * @bytes:	Bytes of device state sent or received
+ * @repair:	Round-trips to TCP_REPAIR helper
+ * @ns:		Total time, from header to last stage, nanoseconds
+ * @stage_ns:	Time spent in each stage, by stage index, nanoseconds
+ */
+struct stats_migrate {
+	uint32_t flows;
+	uint64_t bytes;
+	uint64_t repair;
+	uint64_t ns;
+	uint64_t stage_ns[STATS_MIGRATE_STAGES];
+};
+
+/**
+ * struct passt_stats - Statistics
+ * @version:		STATS_FILE_VERSION, set if backed by --stats-file
+ * @size:		Size of this structure, set if backed by --stats-file
+ * @events:		Event counters for epoll type events
+ * @batch:		Histogram of epoll_wait() return values, power-of-two
+ *			buckets
+ * @rx:			Traffic received from each pif, by protocol
+ * @tap_unsent:		Frames tap_send_frames() couldn't send
+ * @tap_partial:	Frames only partially written by tap_send_frames()
+ * @tcp_requeued:	TCP frames not sent to tap, to be sent again later
+ * @loops:		Main loop iterations
+ * @loop_ns:		Total time spent handling events, nanoseconds
+ * @loop_ns_max:	Longest main loop iteration, nanoseconds
+ * @hist:		Latency histograms, see PESTO_STATS_HIST_BUCKETS
+ * @prof_events:	Time spent on events, by epoll type, with --profile
+ * @prof_defer:		Time spent in deferred handlers, with --profile
+ * @flows:		Flows in use, by type
+ * @mem:		Memory usage by subsystem, bytes, see enum stats_mem
+ * @migrate:		Last migration, as source or target
+ *
+ * Page aligned and sized, so that --stats-file can map a file over it, and
+ * monitoring tools read counters from there as we update them.
+ */
+struct passt_stats {
+	uint32_t version;
+	uint32_t size;
+	unsigned long events[EPOLL_NUM_TYPES];
+	unsigned long batch[EPOLL_BATCH_BUCKETS];
+	struct stats_l4 rx[PIF_NUM_TYPES][PESTO_STATS_PROTO_NUM];
+	uint64_t tap_unsent;
+	uint64_t tap_partial;
+	uint64_t tcp_requeued;
+	uint64_t loops;
+	uint64_t loop_ns;
+	uint64_t loop_ns_max;
+	uint64_t hist[PESTO_STATS_HIST_NUM][PESTO_STATS_HIST_BUCKETS];
+	struct stats_prof prof_events[EPOLL_NUM_TYPES];
+	struct stats_prof prof_defer[STATS_PROF_DEFER_NUM];
+	uint32_t flows[FLOW_NUM_TYPES];
+	uint64_t mem[STATS_MEM_NUM];
+	struct stats_migrate migrate;
+} __attribute__ ((aligned(PAGE_SIZE)));
+
+extern struct passt_stats passt_stats;
+
+/**
+ * stats_proto() - Map IP protocol number to statistics protocol
+ * @proto:	IP protocol number
+ *
+ * Return: protocol index for per-pif statistics
+ */
+static inline enum pesto_stats_proto stats_proto(uint8_t proto)
+{
+	switch (proto) {
+	case IPPROTO_TCP:
+		return PESTO_STATS_TCP;
+	case IPPROTO_UDP:
+		return PESTO_STATS_UDP;
+	case IPPROTO_ICMP:
+	case IPPROTO_ICMPV6:
+		return PESTO_STATS_ICMP;
+	default:
+		return PESTO_STATS_OTHER;
+	}
+}
+
+/**
+ * stats_rx() - Account for traffic received from a pif
+ * @pif:	pif traffic was received from
+ * @proto:	Protocol index
+ * @packets:	Number of packets
+ * @bytes:	Number of bytes
+ */
+static inline void stats_rx(uint8_t pif, enum pesto_stats_proto proto,
+			    unsigned packets, size_t bytes)
+{
+	if (pif >= PIF_NUM_TYPES)
+		return;
+
+	passt_stats.rx[pif][proto].packets += packets;
+	passt_stats.rx[pif][proto].bytes += bytes;
+}
+
+/**
+ * stats_drop() - Account for packets from a pif we discarded
+ * @pif:	pif packets were received from
+ * @proto:	Protocol index
+ * @packets:	Number of packets
+ */
+static inline void stats_drop(uint8_t pif, enum pesto_stats_proto proto,
+			      unsigned packets)
+{
+	if (pif >= PIF_NUM_TYPES)
+		return;
+
+	passt_stats.rx[pif][proto].drops += packets;
+}
+
+/**
+ * stats_mem_peak() - Account for peak memory usage of a buffer
+ * @m:		Subsystem
+ * @bytes:	Bytes currently in use
+ */
+static inline void stats_mem_peak(enum stats_mem m, size_t bytes)
+{
+	if (bytes > passt_stats.mem[m])
+		passt_stats.mem[m] = bytes;
+}
+
+/**
+ * stats_hist_bucket() - Find latency histogram bucket for a value
+ * @ns:		Value, nanoseconds
+ *
+ * Return: bucket index, see PESTO_STATS_HIST_SUB_BITS
+ */
+static inline unsigned stats_hist_bucket(uint64_t ns)
+{
+	const unsigned sub = PESTO_STATS_HIST_SUB_BITS;
+	unsigned msb, i;
+
+	if (ns < (1U << sub))
+		return ns;
+
+	msb = 63 - __builtin_clzll(ns);
+	i = (msb - sub + 1) << sub;
+	i += (ns >> (msb - sub)) & ((1U << sub) - 1);
+
+	return MIN(i, PESTO_STATS_HIST_BUCKETS - 1);
+}
+
+/**
+ * stats_hist() - Account for a latency sample between two timestamps
+ * @h:		Histogram
+ * @start:	Start of measured interval
+ * @end:	End of measured interval
+ */
+static inline void stats_hist(enum pesto_stats_hist h,
+			      const struct timespec *start,
+			      const struct timespec *end)
+{
+	int64_t ns = (end->tv_sec - start->tv_sec) * 1000000000LL +
+		     (end->tv_nsec - start->tv_nsec);
+
+	passt_stats.hist[h][stats_hist_bucket(MAX(ns, 0))]++;
+}
+
+/**
+ * stats_hist_since() - Account for a latency sample from a timestamp to now
+ * @h:		Histogram
+ * @start:	Start of measured interval
+ */
+static inline void stats_hist_since(enum pesto_stats_hist h,
+				    const struct timespec *start)
+{
+	struct timespec now;
+
+	if (!clock_gettime(CLOCK_MONOTONIC, &now))
+		stats_hist(h, start, &now);
+}
+
+/**
+ * stats_ns_since() - Nanoseconds elapsed from a timestamp to now
+ * @start:	Start of measured interval
+ *
+ * Return: elapsed time, zero if the clock can't be read
+ */
+static inline uint64_t stats_ns_since(const struct timespec *start)
+{
+	struct timespec now;
+
+	if (clock_gettime(CLOCK_MONOTONIC, &now))
+		return 0;
+
+	return (now.tv_sec - start->tv_sec) * 1000000000ULL +
+	       (now.tv_nsec - start->tv_nsec);
+}
+
+/**
+ * stats_prof_lap() - Account time since previous timestamp to a handler
+ * @p:		Handler profile
+ * @t:		Previous timestamp, updated to current time
+ */
+static inline void stats_prof_lap(struct stats_prof *p, struct timespec *t)
+{
+	struct timespec now;
+
+	if (clock_gettime(CLOCK_MONOTONIC, &now))
+		return;
+
+	p->calls++;
+	p->ns += (now.tv_sec - t->tv_sec) * 1000000000ULL +
+		 (now.tv_nsec - t->tv_nsec);
+	*t = now;
+}
+
+#endif /* STATS_H */
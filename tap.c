@@ -57,10 +57,14 @@
 #include "packet.h"
 #include "repair.h"
 #include "tap.h"
+#include "frag.h"
 #include "log.h"
 #include "vhost_user.h"
 #include "vu_common.h"
 #include "epoll_ctl.h"
+#include "uring.h"
+#include "stats.h"
+#include "probe.h"
 
 /* Maximum allowed frame lengths (including L2 header) */
 
@@ -100,6 +104,118 @@ static PACKET_POOL_NOINIT(pool_tap6, TAP_MSGS_IP6);
 
 #define TAP_SEQS		128 /* Different L4 tuples in one batch */
 
+/* Hash buckets to find sequences by L4 tuple, see tap_seq_hash() */
+#define TAP_SEQ_HASH_BITS	8
+#define TAP_SEQ_BUCKETS		(1U << TAP_SEQ_HASH_BITS)
+static_assert(TAP_SEQ_BUCKETS >= TAP_SEQS * 2 && TAP_SEQS < UINT8_MAX,
+	      "Not enough hash buckets for L4 sequences");
+
+/* Index of sequence in tap4_l4 or tap6_l4, plus one, zero if bucket is free */
+static uint8_t tap_seq_bucket[TAP_SEQ_BUCKETS];
+
+/* Frames from tap_send_single() (ARP, NDP, DHCP...), sent by tap_flush() */
+#define TAP_CTRL_FRAMES		16
+#define TAP_CTRL_FRAME_MAX	2048 /* Larger frames are sent right away */
+
+static uint8_t tap_ctrl_buf[TAP_CTRL_FRAMES][TAP_CTRL_FRAME_MAX];
+static struct tap_hdr tap_ctrl_hdr[TAP_CTRL_FRAMES];
+static struct iovec tap_ctrl_iov[TAP_CTRL_FRAMES][2];
+static size_t tap_ctrl_count;
+
+/**
+ * struct tap_shape - Token bucket for --tap-rate, one for each direction
+ * @tokens:	Bytes allowed right now, negative if in excess
+ * @last:	Time of last refill, nanoseconds
+ */
+static struct tap_shape {
+	int64_t tokens;
+	uint64_t last;
+} tap_shape[TAP_SHAPE_DIRS];
+
+/**
+ * tap_shape_avail() - Refill token bucket, get bytes allowed in one direction
+ * @c:		Execution context
+ * @dir:	Direction of traffic
+ * @now:	Current timestamp
+ *
+ * Return: bytes that can be forwarded now, negative if in excess, INT64_MAX
+ *	   without --tap-rate
+ */
+int64_t tap_shape_avail(const struct ctx *c, enum tap_shape_dir dir,
+			const struct timespec *now)
+{
+	uint64_t ns = (uint64_t)now->tv_sec * 1000000000 + now->tv_nsec;
+	struct tap_shape *b = &tap_shape[dir];
+	uint64_t elapsed;
+
+	if (!c->tap_rate)
+		return INT64_MAX;
+
+	elapsed = ns - b->last;
+	b->last = ns;
+
+	/* Full bucket after a second at most, see conf() */
+	if (elapsed >= 1000000000) {
+		b->tokens = c->tap_burst;
+	} else {
+		b->tokens += elapsed * c->tap_rate / 1000000000;
+		b->tokens = MIN(b->tokens, (int64_t)c->tap_burst);
+	}
+
+	return b->tokens;
+}
+
+/**
+ * tap_shape_take() - Account for bytes forwarded in one direction
+ * @c:		Execution context
+ * @dir:	Direction of traffic
+ * @bytes:	Bytes forwarded
+ */
+void tap_shape_take(const struct ctx *c, enum tap_shape_dir dir, size_t bytes)
+{
+	if (c->tap_rate)
+		tap_shape[dir].tokens -= bytes;
+}
+
+/**
+ * tap_shape_admit() - Police traffic: take tokens for bytes, if any are left
+ * @c:		Execution context
+ * @dir:	Direction of traffic
+ * @bytes:	Bytes to forward
+ * @now:	Current timestamp
+ *
+ * Return: true if traffic can be forwarded, false if it should be dropped
+ */
+bool tap_shape_admit(const struct ctx *c, enum tap_shape_dir dir,
+		     size_t bytes, const struct timespec *now)
+{
+	if (tap_shape_avail(c, dir, now) <= 0)
+		return false;
+
+	tap_shape_take(c, dir, bytes);
+	return true;
+}
+
+/**
+ * tap_shape_wait() - Time until a given amount of bytes is allowed
+ * @c:		Execution context
+ * @dir:	Direction of traffic
+ * @bytes:	Bytes we need to forward
+ * @now:	Current timestamp
+ *
+ * Return: nanoseconds to wait, zero if @bytes can be forwarded right away
+ */
+uint64_t tap_shape_wait(const struct ctx *c, enum tap_shape_dir dir,
+			size_t bytes, const struct timespec *now)
+{
+	int64_t avail = tap_shape_avail(c, dir, now);
+
+	if (avail >= (int64_t)bytes)
+		return 0;
+
+	return DIV_ROUND_UP((bytes - avail) * 1000000000, c->tap_rate);
+}
+
 /**
  * tap_l2_max_len() - Maximum frame size (including L2 header) for current mode
  * @c:		Execution context
@@ -126,13 +242,18 @@ unsigned long tap_l2_max_len(const struct ctx *c)
  * @c:		Execution context
  * @data:	Packet buffer
  * @l2len:	Total L2 packet length
+ *
+ * Small frames are copied and queued, to be sent together with other frames by
+ * tap_flush(), or before any other frame: with vhost-user, guest notifications
+ * are already deferred, so we send them right away.
  */
 void tap_send_single(const struct ctx *c, const void *data, size_t l2len)
 {
 	uint8_t padded[ETH_ZLEN] = { 0 };
+	struct tap_hdr thdr;
 	struct iovec iov[2];
 	size_t iovcnt = 0;
-	uint32_t vnet_len;
+	uint8_t *buf;
 
 	if (l2len < ETH_ZLEN) {
 		memcpy(padded, data, l2len);
@@ -140,14 +261,33 @@ void tap_send_single(const struct ctx *c, const void *data, size_t l2len)
 		l2len = ETH_ZLEN;
 	}
 
-	vnet_len = htonl(l2len);
-
 	switch (c->mode) {
 	case MODE_PASST:
-		iov[iovcnt] = IOV_OF_LVALUE(vnet_len);
-		iovcnt++;
-		/* fall through */
 	case MODE_PASTA:
+		if (l2len <= TAP_CTRL_FRAME_MAX) {
+			struct tap_hdr *taph;
+
+			if (tap_ctrl_count == TAP_CTRL_FRAMES)
+				tap_flush(c);
+
+			buf = tap_ctrl_buf[tap_ctrl_count];
+			taph = &tap_ctrl_hdr[tap_ctrl_count];
+
+			memcpy(buf, data, l2len);
+			tap_hdr_update(c, taph, l2len);
+
+			tap_ctrl_iov[tap_ctrl_count][0] = tap_hdr_iov(c, taph);
+			tap_ctrl_iov[tap_ctrl_count][1].iov_base = buf;
+			tap_ctrl_iov[tap_ctrl_count][1].iov_len = l2len;
+			tap_ctrl_count++;
+			break;
+		}
+
+		tap_hdr_update(c, &thdr, l2len);
+
+		iov[iovcnt] = tap_hdr_iov(c, &thdr);
+		iovcnt++;
+
 		iov[iovcnt].iov_base = (void *)data;
 		iov[iovcnt].iov_len = l2len;
 		iovcnt++;
@@ -439,6 +579,8 @@ static size_t tap_send_frames_pasta(const struct ctx *c,
 			}
 		} else if ((size_t)rc < framelen) {
 			debug("short write on tuntap: %zd/%zu", rc, framelen);
+			passt_stats.tap_partial++;
+			PROBE(tap_send_partial, i / bufs_per_frame, rc);
 			break;
 		}
 	}
@@ -484,6 +626,8 @@ static size_t tap_send_frames_passt(const struct ctx *c,
 		/* Number of unsent or partially sent buffers for the frame */
 		size_t rembufs = bufs_per_frame - (i % bufs_per_frame);
 
+		passt_stats.tap_partial++;
+		PROBE(tap_send_partial, i / bufs_per_frame, sent);
 		if (write_remainder(c->fd_tap, &iov[i], rembufs, buf_offset,
 				    SIZE_MAX) < 0) {
 			err_perror("tap: partial frame send");
@@ -496,7 +640,7 @@ static size_t tap_send_frames_passt(const struct ctx *c,
 }
 
 /**
- * tap_send_frames() - Send out multiple prepared frames
+ * tap_send_frames_() - Send out multiple prepared frames
  * @c:			Execution context
  * @iov:		Array of buffers, each containing one frame (with L2 headers)
  * @bufs_per_frame:	Number of buffers (iovec entries) per frame
@@ -507,8 +651,8 @@ static size_t tap_send_frames_passt(const struct ctx *c,
  *
  * Return: number of frames actually sent, or accounted as sent
  */
-size_t tap_send_frames(const struct ctx *c, const struct iovec *iov,
-		       size_t bufs_per_frame, size_t nframes)
+static size_t tap_send_frames_(const struct ctx *c, const struct iovec *iov,
+			       size_t bufs_per_frame, size_t nframes)
 {
 	size_t m;
 
@@ -531,16 +675,55 @@ size_t tap_send_frames(const struct ctx *c, const struct iovec *iov,
 		assert(0);
 	}
 
-	if (m < nframes)
+	if (m < nframes) {
 		debug("tap: failed to send %zu frames of %zu",
 		      nframes - m, nframes);
+		passt_stats.tap_unsent += nframes - m;
+	}
 
-	pcap_multiple(iov, bufs_per_frame, m,
-		      c->mode == MODE_PASST ? sizeof(uint32_t) : 0);
+	PROBE(tap_send_frames, nframes, m);
+
+	pcap_multiple(iov, bufs_per_frame, m, tap_hdr_len(c));
 
 	return m;
 }
 
+/**
+ * tap_flush() - Send out frames queued by tap_send_single()
+ * @c:		Execution context
+ */
+void tap_flush(const struct ctx *c)
+{
+	size_t n = tap_ctrl_count;
+
+	if (!n)
+		return;
+
+	tap_ctrl_count = 0;
+	tap_send_frames_(c, &tap_ctrl_iov[0][0], 2, n);
+}
+
+/**
+ * tap_send_frames() - Send out queued frames, then multiple prepared frames
+ * @c:			Execution context
+ * @iov:		Array of buffers, each containing one frame (with L2 headers)
+ * @bufs_per_frame:	Number of buffers (iovec entries) per frame
+ * @nframes:		Number of frames to send
+ *
+ * @iov must have total length @bufs_per_frame * @nframes, with each set of
+ * @bufs_per_frame contiguous buffers representing a single frame.
+ *
+ * Return: number of frames actually sent, or accounted as sent
+ */
+size_t tap_send_frames(const struct ctx *c, const struct iovec *iov,
+		       size_t bufs_per_frame, size_t nframes)
+{
+	/* Keep ordering with frames queued by tap_send_single() */
+	tap_flush(c);
+
+	return tap_send_frames_(c, iov, bufs_per_frame, nframes);
+}
+
 /**
  * eth_update_mac() - Update tap L2 header with new Ethernet addresses
  * @eh:		Ethernet headers to update
@@ -563,6 +746,7 @@ PACKET_POOL_DECL(pool_l4, UIO_MAXIOV);
  * @msgs:	Count of messages in sequence
  * @protocol:	Protocol number
  * @ttl:	Time to live
+ * @ecn:	ECN field
  * @source:	Source port
  * @dest:	Destination port
  * @saddr:	Source address
@@ -572,6 +756,7 @@ PACKET_POOL_DECL(pool_l4, UIO_MAXIOV);
 static struct tap4_l4_t {
 	uint8_t protocol;
 	uint8_t ttl;
+	uint8_t ecn;
 
 	uint16_t source;
 	uint16_t dest;
@@ -592,6 +777,7 @@ static struct tap4_l4_t {
  * @saddr:	Source address
  * @daddr:	Destination address
  * @hop_limit:	Hop limit
+ * @ecn:	ECN field
  * @msg:	Array of messages that can be handled in a single call
  */
 static struct tap6_l4_t {
@@ -605,6 +791,7 @@ static struct tap6_l4_t {
 	struct in6_addr daddr;
 
 	uint8_t hop_limit;
+	uint8_t ecn;
 
 	struct pool_l4_t p;
 } tap6_l4[TAP_SEQS /* Arbitrary: TAP_MSGS in theory, so limit in users */];
@@ -663,22 +850,43 @@ static void tap_packet_debug(const struct iphdr *iph,
 /**
  * tap4_is_fragment() - Determine if a packet is an IP fragment
  * @iph:	IPv4 header (length already validated)
- * @now:	Current timestamp
  *
  * Return: true if iph is an IP fragment, false otherwise
  */
-static bool tap4_is_fragment(const struct iphdr *iph,
-			     const struct timespec *now)
+static bool tap4_is_fragment(const struct iphdr *iph)
+{
+	return ntohs(iph->frag_off) & ~IP_DF;
+}
+
+/**
+ * tap_seq_hash() - Hash L4 tuple to find its sequence in a batch from tap
+ * @saddr:	Source address
+ * @daddr:	Destination address
+ * @alen:	Length of addresses, multiple of four bytes
+ * @source:	Source port, network order
+ * @dest:	Destination port, network order
+ * @proto:	Protocol number
+ *
+ * A whole batch comes from the same guest, so there's no point in a keyed hash
+ * here: colliding tuples only slow down that guest, and probing is bounded by
+ * TAP_SEQS anyway.
+ *
+ * Return: bucket index in tap_seq_bucket
+ */
+static unsigned tap_seq_hash(const void *saddr, const void *daddr, size_t alen,
+			     uint16_t source, uint16_t dest, uint8_t proto)
 {
-	if (ntohs(iph->frag_off) & ~IP_DF) {
-		static unsigned num_dropped;
+	uint32_t h = ((uint32_t)source << 16 | dest) ^ proto, w;
+	size_t i;
 
-		num_dropped++;
-		warn_ratelimit(now, "Can't process IPv4 fragments (%u dropped)",
-			       num_dropped);
-		return true;
+	for (i = 0; i < alen; i += sizeof(w)) {
+		memcpy(&w, (const uint8_t *)saddr + i, sizeof(w));
+		h = (h ^ w) * 0x9e3779b1;
+		memcpy(&w, (const uint8_t *)daddr + i, sizeof(w));
+		h = (h ^ w) * 0x9e3779b1;
 	}
-	return false;
+
+	return h >> (32 - TAP_SEQ_HASH_BITS);
 }
 
 /**
@@ -692,7 +900,7 @@ static bool tap4_is_fragment(const struct iphdr *iph,
 static int tap4_handler(struct ctx *c, const struct pool *in,
 			const struct timespec *now)
 {
-	unsigned int i, j, seq_count;
+	unsigned int i, j, h, seq_count, accepted = 0;
 	struct tap4_l4_t *seq;
 
 	if (!c->ifi4 || !in->count)
@@ -700,6 +908,7 @@ static int tap4_handler(struct ctx *c, const struct pool *in,
 
 	i = 0;
 resume:
+	memset(tap_seq_bucket, 0, sizeof(tap_seq_bucket));
 	for (seq_count = 0, seq = NULL; i < in->count; i++) {
 		struct iovec trim_iov[UIO_MAXIOV];
 		size_t l3len, hlen, l4len, check;
@@ -718,6 +927,9 @@ resume:
 		if (!eh)
 			continue;
 		if (ntohs(eh->h_proto) == ETH_P_ARP) {
+			stats_rx(PIF_TAP, PESTO_STATS_OTHER, 1,
+				 iov_tail_size(&data));
+			accepted++;
 			arp(c, &data);
 			continue;
 		}
@@ -735,10 +947,6 @@ resume:
 		    hlen > l3len)
 			continue;
 
-		/* We don't handle IP fragments, drop them */
-		if (tap4_is_fragment(iph, now))
-			continue;
-
 		l4len = htons(iph->tot_len) - hlen;
 
 		if (IN4_IS_ADDR_LOOPBACK(&iph->saddr) ||
@@ -775,9 +983,25 @@ resume:
 		    !iov_tail_trim(&data, l4len, trim_iov, ARRAY_SIZE(trim_iov)))
 			continue;
 
+		/* Delivered with frag_deliver() once the datagram is complete */
+		if (tap4_is_fragment(iph)) {
+			uint16_t off = ntohs(iph->frag_off);
+
+			accepted++;
+			frag_add(AF_INET, &iph->saddr, &iph->daddr,
+				 iph->protocol, ntohs(iph->id),
+				 (off & IP_OFFMASK) * 8UL, off & IP_MF,
+				 iph->ttl, &data, now);
+			continue;
+		}
+
 		if (iph->protocol == IPPROTO_ICMP) {
-			if (c->no_icmp)
+			stats_rx(PIF_TAP, PESTO_STATS_ICMP, 1, l4len);
+			accepted++;
+			if (c->no_icmp) {
+				stats_drop(PIF_TAP, PESTO_STATS_ICMP, 1);
 				continue;
+			}
 
 			tap_packet_debug(iph, NULL, NULL, 0, NULL, 1);
 
@@ -795,13 +1019,19 @@ resume:
 			struct iov_tail eh_data;
 
 			packet_get(in, i, &eh_data);
-			if (dhcp(c, &eh_data))
+			if (dhcp(c, &eh_data)) {
+				stats_rx(PIF_TAP, PESTO_STATS_UDP, 1, l4len);
+				accepted++;
 				continue;
+			}
 		}
 
 		if (iph->protocol != IPPROTO_TCP &&
 		    iph->protocol != IPPROTO_UDP) {
 			tap_packet_debug(iph, NULL, NULL, 0, NULL, 1);
+			stats_rx(PIF_TAP, PESTO_STATS_OTHER, 1, l4len);
+			stats_drop(PIF_TAP, PESTO_STATS_OTHER, 1);
+			accepted++;
 			continue;
 		}
 
@@ -809,7 +1039,8 @@ resume:
 	((seq)->protocol == (iph)->protocol &&					\
 	 (seq)->source   == (uh)->source    && (seq)->dest  == (uh)->dest &&	\
 	 (seq)->saddr.s_addr == (iph)->saddr &&				\
-	 (seq)->daddr.s_addr == (iph)->daddr && (seq)->ttl == (iph)->ttl)
+	 (seq)->daddr.s_addr == (iph)->daddr && (seq)->ttl == (iph)->ttl &&\
+	 (seq)->ecn == ((iph)->tos & IPTOS_ECN_MASK))
 
 #define L4_SET(iph, uh, seq)						\
 	do {								\
@@ -819,6 +1050,7 @@ resume:
 		(seq)->saddr.s_addr	= (iph)->saddr;			\
 		(seq)->daddr.s_addr	= (iph)->daddr;			\
 		(seq)->ttl		= (iph)->ttl;			\
+		(seq)->ecn		= (iph)->tos & IPTOS_ECN_MASK;	\
 	} while (0)
 
 		if (seq && L4_MATCH(iph, uh, seq) && seq->p.count < UIO_MAXIOV)
@@ -827,24 +1059,28 @@ resume:
 		if (seq_count == TAP_SEQS)
 			break;	/* Resume after flushing if i < in->count */
 
-		for (seq = tap4_l4 + seq_count - 1; seq >= tap4_l4; seq--) {
-			if (L4_MATCH(iph, uh, seq)) {
-				if (seq->p.count >= UIO_MAXIOV)
-					seq = NULL;
+		h = tap_seq_hash(&iph->saddr, &iph->daddr, sizeof(iph->saddr),
+				 uh->source, uh->dest, iph->protocol);
+		for (; tap_seq_bucket[h]; h = (h + 1) % TAP_SEQ_BUCKETS) {
+			seq = tap4_l4 + tap_seq_bucket[h] - 1;
+			if (L4_MATCH(iph, uh, seq))
 				break;
-			}
 		}
 
-		if (!seq || seq < tap4_l4) {
+		/* New tuple, or sequence full: next packets go to new one */
+		if (!tap_seq_bucket[h] || seq->p.count >= UIO_MAXIOV) {
 			seq = tap4_l4 + seq_count++;
 			L4_SET(iph, uh, seq);
 			pool_flush((struct pool *)&seq->p);
+			tap_seq_bucket[h] = seq_count;
 		}
 
 #undef L4_MATCH
 #undef L4_SET
 
 append:
+		stats_rx(PIF_TAP, stats_proto(iph->protocol), 1, l4len);
+		accepted++;
 		packet_add((struct pool *)&seq->p, &data);
 	}
 
@@ -854,6 +1090,11 @@ append:
 
 		tap_packet_debug(NULL, NULL, seq, 0, NULL, p->count);
 
+		if (c->no_tcp && seq->protocol == IPPROTO_TCP)
+			stats_drop(PIF_TAP, PESTO_STATS_TCP, p->count);
+		else if (c->no_udp && seq->protocol == IPPROTO_UDP)
+			stats_drop(PIF_TAP, PESTO_STATS_UDP, p->count);
+
 		if (seq->protocol == IPPROTO_TCP) {
 			if (c->no_tcp)
 				continue;
@@ -867,13 +1108,20 @@ append:
 			for (k = 0; k < p->count; )
 				k += udp_tap_handler(c, PIF_TAP, AF_INET,
 						     &seq->saddr, &seq->daddr,
-						     seq->ttl, p, k, now);
+						     seq->ttl, seq->ecn, p, k,
+						     now);
 		}
 	}
 
 	if (i < in->count)
 		goto resume;
 
+	frag_deliver(c, AF_INET, now);
+
+	/* Anything else was malformed, or not meant for us */
+	stats_rx(PIF_TAP, PESTO_STATS_OTHER, in->count - accepted, 0);
+	stats_drop(PIF_TAP, PESTO_STATS_OTHER, in->count - accepted);
+
 	return in->count;
 }
 
@@ -884,8 +1132,8 @@ append:
 
 /**
  * ipv6_l4hdr() - Find pointer to L4 header in IPv6 packet and extract protocol
- * @data:	IPv6 packet
- * @proto:	Filled with L4 protocol number
+ * @data:	IPv6 packet, moved to L4 header (or fragment header) on return
+ * @proto:	Filled with L4 protocol number, IPPROTO_FRAGMENT for fragments
  * @dlen:	Data length (payload excluding header extensions), set on return
  *
  * Return: true if the L4 header is found and @data, @proto, @dlen are set,
@@ -897,30 +1145,22 @@ static bool ipv6_l4hdr(struct iov_tail *data, uint8_t *proto, size_t *dlen)
 	const struct ipv6_opt_hdr *o;
 	struct ipv6hdr ip6h_storage;
 	const struct ipv6hdr *ip6h;
-	int hdrlen;
 	uint8_t nh;
 
 	ip6h = IOV_REMOVE_HEADER(data, ip6h_storage);
 	if (!ip6h)
 		return false;
 
-	nh = ip6h->nexthdr;
-	if (!IPV6_NH_OPT(nh))
-		goto found;
+	/* Skip extension headers, but stop at fragment headers, if any */
+	for (nh = ip6h->nexthdr; IPV6_NH_OPT(nh) && nh != IPPROTO_FRAGMENT; ) {
+		if (!(o = IOV_PEEK_HEADER(data, o_storage)))
+			return false;
 
-	while ((o = IOV_PEEK_HEADER(data, o_storage))) {
 		nh = o->nexthdr;
-		hdrlen = (o->hdrlen + 1) * 8;
-
-		if (IPV6_NH_OPT(nh))
-			iov_drop_header(data, hdrlen);
-		else
-			goto found;
+		if (!iov_drop_header(data, (o->hdrlen + 1) * 8))
+			return false;
 	}
 
-	return false;
-
-found:
 	if (nh == IPPROTO_NONE)
 		return false;
 
@@ -940,7 +1180,7 @@ found:
 static int tap6_handler(struct ctx *c, const struct pool *in,
 			const struct timespec *now)
 {
-	unsigned int i, j, seq_count = 0;
+	unsigned int i, j, h, seq_count = 0, accepted = 0;
 	struct tap6_l4_t *seq;
 
 	if (!c->ifi6 || !in->count)
@@ -948,6 +1188,7 @@ static int tap6_handler(struct ctx *c, const struct pool *in,
 
 	i = 0;
 resume:
+	memset(tap_seq_bucket, 0, sizeof(tap_seq_bucket));
 	for (seq_count = 0, seq = NULL; i < in->count; i++) {
 		size_t l4len, plen, check;
 		struct in6_addr *saddr, *daddr;
@@ -1012,14 +1253,36 @@ resume:
 			c->ip6.addr_seen = *saddr;
 		}
 
+		/* Delivered with frag_deliver() once the datagram is complete */
+		if (proto == IPPROTO_FRAGMENT) {
+			struct ip6_frag fh_storage;
+			const struct ip6_frag *fh;
+
+			fh = IOV_REMOVE_HEADER(&data, fh_storage);
+			if (!fh)
+				continue;
+
+			accepted++;
+			frag_add(AF_INET6, saddr, daddr, fh->ip6f_nxt,
+				 ntohl(fh->ip6f_ident),
+				 ntohs(fh->ip6f_offlg & IP6F_OFF_MASK),
+				 fh->ip6f_offlg & IP6F_MORE_FRAG,
+				 ip6h->hop_limit, &data, now);
+			continue;
+		}
+
 		if (proto == IPPROTO_ICMPV6) {
 			struct iov_tail ndp_data;
 
-			if (c->no_icmp)
+			if (l4len < sizeof(struct icmp6hdr))
 				continue;
 
-			if (l4len < sizeof(struct icmp6hdr))
+			stats_rx(PIF_TAP, PESTO_STATS_ICMP, 1, l4len);
+			accepted++;
+			if (c->no_icmp) {
+				stats_drop(PIF_TAP, PESTO_STATS_ICMP, 1);
 				continue;
+			}
 
 			ndp_data = data;
 			if (ndp(c, saddr, &ndp_data))
@@ -1041,12 +1304,18 @@ resume:
 		if (proto == IPPROTO_UDP) {
 			struct iov_tail uh_data = data;
 
-			if (dhcpv6(c, &uh_data, saddr, daddr))
+			if (dhcpv6(c, &uh_data, saddr, daddr)) {
+				stats_rx(PIF_TAP, PESTO_STATS_UDP, 1, l4len);
+				accepted++;
 				continue;
+			}
 		}
 
 		if (proto != IPPROTO_TCP && proto != IPPROTO_UDP) {
 			tap_packet_debug(NULL, ip6h, NULL, proto, NULL, 1);
+			stats_rx(PIF_TAP, PESTO_STATS_OTHER, 1, l4len);
+			stats_drop(PIF_TAP, PESTO_STATS_OTHER, 1);
+			accepted++;
 			continue;
 		}
 
@@ -1057,7 +1326,8 @@ resume:
 		 (seq)->flow_lbl == ip6_get_flow_lbl(ip6h) &&		\
 		 IN6_ARE_ADDR_EQUAL(&(seq)->saddr, saddr)  &&		\
 		 IN6_ARE_ADDR_EQUAL(&(seq)->daddr, daddr)  &&		\
-		 (seq)->hop_limit == (ip6h)->hop_limit)
+		 (seq)->hop_limit == (ip6h)->hop_limit    &&		\
+		 (seq)->ecn == ip6_get_ecn(ip6h))
 
 #define L4_SET(ip6h, proto, uh, seq)					\
 	do {								\
@@ -1068,6 +1338,7 @@ resume:
 		(seq)->saddr	= *saddr;				\
 		(seq)->daddr	= *daddr;				\
 		(seq)->hop_limit = (ip6h)->hop_limit;			\
+		(seq)->ecn	= ip6_get_ecn(ip6h);			\
 	} while (0)
 
 		if (seq && L4_MATCH(ip6h, proto, uh, seq) &&
@@ -1077,24 +1348,28 @@ resume:
 		if (seq_count == TAP_SEQS)
 			break;	/* Resume after flushing if i < in->count */
 
-		for (seq = tap6_l4 + seq_count - 1; seq >= tap6_l4; seq--) {
-			if (L4_MATCH(ip6h, proto, uh, seq)) {
-				if (seq->p.count >= UIO_MAXIOV)
-					seq = NULL;
+		h = tap_seq_hash(saddr, daddr, sizeof(*saddr),
+				 uh->source, uh->dest, proto);
+		for (; tap_seq_bucket[h]; h = (h + 1) % TAP_SEQ_BUCKETS) {
+			seq = tap6_l4 + tap_seq_bucket[h] - 1;
+			if (L4_MATCH(ip6h, proto, uh, seq))
 				break;
-			}
 		}
 
-		if (!seq || seq < tap6_l4) {
+		/* New tuple, or sequence full: next packets go to new one */
+		if (!tap_seq_bucket[h] || seq->p.count >= UIO_MAXIOV) {
 			seq = tap6_l4 + seq_count++;
 			L4_SET(ip6h, proto, uh, seq);
 			pool_flush((struct pool *)&seq->p);
+			tap_seq_bucket[h] = seq_count;
 		}
 
 #undef L4_MATCH
 #undef L4_SET
 
 append:
+		stats_rx(PIF_TAP, stats_proto(proto), 1, l4len);
+		accepted++;
 		packet_add((struct pool *)&seq->p, &data);
 	}
 
@@ -1105,6 +1380,11 @@ append:
 		tap_packet_debug(NULL, NULL, NULL, seq->protocol, seq,
 				 p->count);
 
+		if (c->no_tcp && seq->protocol == IPPROTO_TCP)
+			stats_drop(PIF_TAP, PESTO_STATS_TCP, p->count);
+		else if (c->no_udp && seq->protocol == IPPROTO_UDP)
+			stats_drop(PIF_TAP, PESTO_STATS_UDP, p->count);
+
 		if (seq->protocol == IPPROTO_TCP) {
 			if (c->no_tcp)
 				continue;
@@ -1118,13 +1398,20 @@ append:
 			for (k = 0; k < p->count; )
 				k += udp_tap_handler(c, PIF_TAP, AF_INET6,
 						     &seq->saddr, &seq->daddr,
-						     seq->hop_limit, p, k, now);
+						     seq->hop_limit, seq->ecn,
+						     p, k, now);
 		}
 	}
 
 	if (i < in->count)
 		goto resume;
 
+	frag_deliver(c, AF_INET6, now);
+
+	/* Anything else was malformed, or not meant for us */
+	stats_rx(PIF_TAP, PESTO_STATS_OTHER, in->count - accepted, 0);
+	stats_drop(PIF_TAP, PESTO_STATS_OTHER, in->count - accepted);
+
 	return in->count;
 }
 
@@ -1144,8 +1431,15 @@ void tap_flush_pools(void)
  */
 void tap_handler(struct ctx *c, const struct timespec *now)
 {
+	struct timespec start;
+
+	if (clock_gettime(CLOCK_MONOTONIC, &start))
+		start = *now;
+
 	tap4_handler(c, pool_tap4, now);
 	tap6_handler(c, pool_tap6, now);
+
+	stats_hist_since(PESTO_STATS_HIST_TAP, &start);
 }
 
 /**
@@ -1161,6 +1455,8 @@ void tap_add_packet(struct ctx *c, struct iov_tail *data,
 	struct ethhdr eh_storage;
 	const struct ethhdr *eh;
 
+	PROBE(tap_add_packet, l2len);
+
 	pcap_iov(data->iov, data->cnt, data->off, l2len);
 
 	eh = IOV_PEEK_HEADER(data, eh_storage);
@@ -1209,6 +1505,9 @@ void tap_sock_reset(struct ctx *c)
 	if (c->one_off)
 		passt_exit(EXIT_SUCCESS);
 
+	/* Frames queued for the previous guest, if any, are stale now */
+	tap_ctrl_count = 0;
+
 	/* Close the connected socket, wait for a new connection */
 	epoll_del(c->epollfd, c->fd_tap);
 	close(c->fd_tap);
@@ -1217,31 +1516,162 @@ void tap_sock_reset(struct ctx *c)
 		vu_cleanup(c->vdev);
 }
 
+/* EPOLLOUT requested for tap, see tap_wait_writable() */
+static bool tap_out_wait;
+
+/**
+ * tap_epoll_ref() - Get epoll reference for tap file descriptor
+ * @c:		Execution context
+ *
+ * Return: epoll reference
+ */
+static union epoll_ref tap_epoll_ref(const struct ctx *c)
+{
+	union epoll_ref ref = { 0 };
+
+	ref.fd = c->fd_tap;
+	switch (c->mode) {
+	case MODE_PASST:
+		ref.type = EPOLL_TYPE_TAP_PASST;
+		break;
+	case MODE_PASTA:
+		ref.type = EPOLL_TYPE_TAP_PASTA;
+		break;
+	case MODE_VU:
+		ref.type = EPOLL_TYPE_VHOST_CMD;
+		break;
+	}
+
+	return ref;
+}
+
+/**
+ * tap_epoll_out() - Enable or disable EPOLLOUT events for tap
+ * @c:		Execution context
+ * @out:	Whether to get EPOLLOUT events
+ */
+static void tap_epoll_out(const struct ctx *c, bool out)
+{
+	struct epoll_event ev = {
+		.events = EPOLLIN | EPOLLRDHUP | (out ? EPOLLOUT : 0),
+		.data.u64 = tap_epoll_ref(c).u64,
+	};
+
+	if (out == tap_out_wait)
+		return;
+
+	if (epoll_ctl(c->epollfd, EPOLL_CTL_MOD, c->fd_tap, &ev))
+		debug_perror("Failed to modify epoll events for tap");
+	else
+		tap_out_wait = out;
+}
+
+/**
+ * tap_wait_writable() - Get an event once the tap can take frames again
+ * @c:		Execution context
+ *
+ * Frames left unsent are sent from deferred handlers after the event.
+ */
+void tap_wait_writable(const struct ctx *c)
+{
+	if (c->fd_tap != -1)
+		tap_epoll_out(c, true);
+}
+
+/* Part of pkt_buf we read frames into with --low-mem */
+#define TAP_BUF_LOW_MEM		(256 * 1024)
+static_assert(TAP_BUF_LOW_MEM <= sizeof(pkt_buf) &&
+	      TAP_BUF_LOW_MEM >= 2 * (L2_MAX_LEN_PASST + sizeof(uint32_t)) &&
+	      TAP_BUF_LOW_MEM >= 2 * (L2_MAX_LEN_PASTA +
+				      sizeof(struct tap_hdr)),
+	      "TAP_BUF_LOW_MEM doesn't fit two frames, or pkt_buf");
+
+/* Bytes of pkt_buf we read frames into */
+static size_t tap_buf_size = sizeof(pkt_buf);
+
+/* Size of pkt_buf used as a ring by tap_passt_input(): the rest mirrors the
+ * start of the ring, so that frames wrapping around are contiguous
+ */
+#define TAP_PASST_RING	(tap_buf_size - L2_MAX_LEN_PASST - sizeof(uint32_t))
+
+/* Incomplete frame left in the ring by tap_passt_input(), if any */
+static size_t tap_partial_start, tap_partial_len;
+
+/**
+ * tap_passt_ring_iov() - Get buffers for free region of ring in pkt_buf
+ * @iov:	Array of two buffers, filled in (output)
+ * @off:	Offset of region in ring, taken modulo ring size
+ * @len:	Length of region, at most the size of the ring
+ *
+ * Return: number of buffers used: 1, or 2 if the region wraps around
+ */
+static size_t tap_passt_ring_iov(struct iovec *iov, size_t off, size_t len)
+{
+	off %= TAP_PASST_RING;
+
+	iov[0].iov_base = pkt_buf + off;
+	iov[0].iov_len = MIN(len, TAP_PASST_RING - off);
+	if (iov[0].iov_len == len)
+		return 1;
+
+	iov[1].iov_base = pkt_buf;
+	iov[1].iov_len = len - iov[0].iov_len;
+	return 2;
+}
+
+/**
+ * tap_passt_ring_get() - Get contiguous data from ring in pkt_buf
+ * @off:	Offset of data in ring, less than ring size
+ * @len:	Length of data, at most L2_MAX_LEN_PASST + sizeof(uint32_t)
+ *
+ * Return: pointer to data, copied past the end of the ring if it wraps around
+ */
+static char *tap_passt_ring_get(size_t off, size_t len)
+{
+	if (off + len > TAP_PASST_RING)
+		memcpy(pkt_buf + TAP_PASST_RING, pkt_buf,
+		       off + len - TAP_PASST_RING);
+
+	return pkt_buf + off;
+}
+
 /**
  * tap_passt_input() - Handler for new data on the socket to qemu
  * @c:		Execution context
  * @now:	Current timestamp
+ *
+ * This is the legacy stream protocol, as implemented by qemu's stream netdev
+ * backend: frames are copied through the socket, with a length header each.
+ * The shared memory equivalent is vhost-user (see vhost_user.c), which needs
+ * no separate ring protocol on our side.
+ *
+ * #syscalls:passt recvmsg
  */
 static void tap_passt_input(struct ctx *c, const struct timespec *now)
 {
-	static const char *partial_frame;
-	static ssize_t partial_len = 0;
+	struct iovec iov[2];
+	struct msghdr mh = {
+		.msg_iov = iov,
+	};
+	size_t start;
 	ssize_t n;
-	char *p;
 
 	tap_flush_pools();
 
-	if (partial_len) {
-		/* We have a partial frame from an earlier pass.  Move it to the
-		 * start of the buffer, top up with new data, then process all
-		 * of it.
-		 */
-		memmove(pkt_buf, partial_frame, partial_len);
-	}
+	/* Frames before any partial one from an earlier pass are gone, so use
+	 * pkt_buf as a ring: top up with new data after the partial frame,
+	 * wrapping around to the start of the buffer, instead of moving it.
+	 * Only frames actually wrapping around need to be copied, once.
+	 */
+	if (!tap_partial_len)
+		tap_partial_start = 0;
+
+	mh.msg_iovlen = tap_passt_ring_iov(iov,
+					   tap_partial_start + tap_partial_len,
+					   TAP_PASST_RING - tap_partial_len);
 
 	do {
-		n = recv(c->fd_tap, pkt_buf + partial_len,
-			 sizeof(pkt_buf) - partial_len, MSG_DONTWAIT);
+		n = recvmsg(c->fd_tap, &mh, MSG_DONTWAIT);
 	} while ((n < 0) && errno == EINTR);
 
 	if (n < 0) {
@@ -1252,12 +1682,16 @@ static void tap_passt_input(struct ctx *c, const struct timespec *now)
 		return;
 	}
 
-	p = pkt_buf;
-	n += partial_len;
+	start = tap_partial_start;
+	n += tap_partial_len;
 
 	while (n >= (ssize_t)sizeof(uint32_t)) {
-		uint32_t l2len = ntohl_unaligned(p);
 		struct iov_tail data;
+		uint32_t l2len;
+		char *p;
+
+		p = tap_passt_ring_get(start, sizeof(uint32_t));
+		l2len = ntohl_unaligned(p);
 
 		if (l2len < sizeof(struct ethhdr) || l2len > L2_MAX_LEN_PASST) {
 			err("Bad frame size from guest, resetting connection");
@@ -1269,22 +1703,32 @@ static void tap_passt_input(struct ctx *c, const struct timespec *now)
 			/* Leave this incomplete frame for later */
 			break;
 
-		p += sizeof(uint32_t);
-		n -= sizeof(uint32_t);
-
-		data = IOV_TAIL_FROM_BUF(p, l2len, 0);
+		p = tap_passt_ring_get(start, sizeof(uint32_t) + l2len);
+		data = IOV_TAIL_FROM_BUF(p + sizeof(uint32_t), l2len, 0);
 		tap_add_packet(c, &data, now);
 
-		p += l2len;
-		n -= l2len;
+		start = (start + sizeof(uint32_t) + l2len) % TAP_PASST_RING;
+		n -= sizeof(uint32_t) + l2len;
 	}
 
-	partial_len = n;
-	partial_frame = p;
+	tap_partial_len = n;
+	tap_partial_start = start;
 
 	tap_handler(c, now);
 }
 
+/**
+ * tap_release() - Release pages of pkt_buf, unless it holds pending data
+ * @c:		Execution context
+ */
+void tap_release(const struct ctx *c)
+{
+	if (c->mode == MODE_VU || tap_partial_len)
+		return;
+
+	madvise_free(pkt_buf, tap_buf_size);
+}
+
 /**
  * tap_handler_passt() - Event handler for AF_UNIX file descriptor
  * @c:		Execution context
@@ -1299,10 +1743,82 @@ void tap_handler_passt(struct ctx *c, uint32_t events,
 		return;
 	}
 
+	if (events & EPOLLOUT)
+		tap_epoll_out(c, false);
+
 	if (events & EPOLLIN)
 		tap_passt_input(c, now);
 }
 
+/**
+ * tap_pasta_input_uring() - Read frames from tap device with batched io_uring
+ * @c:		Execution context
+ * @now:	Current timestamp
+ *
+ * Return: 0 on success, negative error code if io_uring can't be used, once
+ *	   frames from reads that completed in the same batch were queued
+ */
+static int tap_pasta_input_uring(struct ctx *c, const struct timespec *now)
+{
+	size_t hlen = tap_hdr_len(c), frame = L2_MAX_LEN_PASTA + hlen;
+	struct iovec iov[URING_ENTRIES];
+	ssize_t res[URING_ENTRIES];
+	size_t n = 0;
+	int i, rc = 0;
+
+	while (!rc && n <= tap_buf_size - frame) {
+		int cnt = MIN(URING_ENTRIES, (tap_buf_size - n) / frame);
+		bool drained = false;
+
+		for (i = 0; i < cnt; i++) {
+			iov[i].iov_base = pkt_buf + n + i * frame;
+			iov[i].iov_len = frame;
+		}
+
+		rc = uring_read_batch(c->fd_tap, iov, res, cnt);
+		if (rc)
+			return rc;
+
+		for (i = 0; i < cnt; i++) {
+			struct iov_tail data;
+
+			if (res[i] == 0)
+				die("EOF on tap device, exiting");
+
+			if (res[i] < 0) {
+				if (res[i] == -EAGAIN || res[i] == -EINTR) {
+					drained = true;
+					continue;
+				}
+
+				/* Keep frames from other reads, fall back */
+				if (res[i] == -EOPNOTSUPP ||
+				    res[i] == -EINVAL) {
+					rc = res[i];
+					continue;
+				}
+
+				errno = -res[i];
+				die_perror("Error on tap device, exiting");
+			}
+
+			/* Ignore frames of bad length */
+			if (res[i] < (ssize_t)(hlen + sizeof(struct ethhdr)))
+				continue;
+
+			data = IOV_TAIL_FROM_BUF(iov[i].iov_base, res[i], hlen);
+			tap_add_packet(c, &data, now);
+		}
+
+		n += cnt * frame;
+
+		if (drained)
+			break;
+	}
+
+	return rc;
+}
+
 /**
  * tap_pasta_input() - Handler for new data on the socket to hypervisor
  * @c:		Execution context
@@ -1310,16 +1826,28 @@ void tap_handler_passt(struct ctx *c, uint32_t events,
  */
 static void tap_pasta_input(struct ctx *c, const struct timespec *now)
 {
+	size_t hlen = tap_hdr_len(c), frame = L2_MAX_LEN_PASTA + hlen;
 	ssize_t n, len;
 
 	tap_flush_pools();
 
-	for (n = 0;
-	     n <= (ssize_t)(sizeof(pkt_buf) - L2_MAX_LEN_PASTA);
-	     n += len) {
+	if (uring_enabled()) {
+		int rc = tap_pasta_input_uring(c, now);
+
+		tap_handler(c, now);
+		if (!rc)
+			return;
+
+		warn("io_uring reads on tap device failed: %s, using read()",
+		     strerror_(-rc));
+		uring_disable();
+		tap_flush_pools();
+	}
+
+	for (n = 0; n <= (ssize_t)(tap_buf_size - frame); n += len) {
 		struct iov_tail data;
 
-		len = read(c->fd_tap, pkt_buf + n, L2_MAX_LEN_PASTA);
+		len = read(c->fd_tap, pkt_buf + n, frame);
 
 		if (len == 0) {
 			die("EOF on tap device, exiting");
@@ -1336,11 +1864,15 @@ static void tap_pasta_input(struct ctx *c, const struct timespec *now)
 		}
 
 		/* Ignore frames of bad length */
-		if (len < (ssize_t)sizeof(struct ethhdr) ||
-		    len > (ssize_t)L2_MAX_LEN_PASTA)
+		if (len < (ssize_t)(hlen + sizeof(struct ethhdr)) ||
+		    len > (ssize_t)frame)
 			continue;
 
-		data = IOV_TAIL_FROM_BUF(pkt_buf + n, len, 0);
+		/* With IFF_VNET_HDR, skip the virtio-net header: we don't need
+		 * checksums to be complete, as we only forward payloads, and
+		 * TCP super-frames are handled like any other segment
+		 */
+		data = IOV_TAIL_FROM_BUF(pkt_buf + n, len, hlen);
 		tap_add_packet(c, &data, now);
 	}
 
@@ -1359,6 +1891,9 @@ void tap_handler_pasta(struct ctx *c, uint32_t events,
 	if (events & (EPOLLRDHUP | EPOLLHUP | EPOLLERR))
 		die("Disconnect event on /dev/net/tun device, exiting");
 
+	if (events & EPOLLOUT)
+		tap_epoll_out(c, false);
+
 	if (events & EPOLLIN)
 		tap_pasta_input(c, now);
 }
@@ -1433,22 +1968,8 @@ bool tap_is_ready(const struct ctx *c)
  */
 static void tap_start_connection(const struct ctx *c)
 {
-	union epoll_ref ref = { 0 };
-
-	ref.fd = c->fd_tap;
-	switch (c->mode) {
-	case MODE_PASST:
-		ref.type = EPOLL_TYPE_TAP_PASST;
-		break;
-	case MODE_PASTA:
-		ref.type = EPOLL_TYPE_TAP_PASTA;
-		break;
-	case MODE_VU:
-		ref.type = EPOLL_TYPE_VHOST_CMD;
-		break;
-	}
-
-	epoll_add(c->epollfd, EPOLLIN | EPOLLRDHUP, ref);
+	tap_out_wait = false;
+	epoll_add(c->epollfd, EPOLLIN | EPOLLRDHUP, tap_epoll_ref(c));
 
 	if (!tap_is_ready(c))
 		return;
@@ -1539,10 +2060,23 @@ static int tap_ns_tun(void *arg)
 	if (fd < 0)
 		die_perror("Failed to open() /dev/net/tun");
 
+	/* Exchange virtio-net headers, so that we can hand segmentation and
+	 * checksum offload to the kernel, if supported
+	 */
+	ifr.ifr_flags |= IFF_VNET_HDR;
 	rc = ioctl(fd, (int)TUNSETIFF, &ifr);
+	if (rc < 0) {
+		ifr.ifr_flags &= ~IFF_VNET_HDR;
+		rc = ioctl(fd, (int)TUNSETIFF, &ifr);
+	}
 	if (rc < 0)
 		die_perror("TUNSETIFF ioctl on /dev/net/tun failed");
 
+	/* The header size defaults to sizeof(struct virtio_net_hdr) on open(),
+	 * no need for TUNSETVNETHDRSZ
+	 */
+	c->pasta_vnet_hdr = !!(ifr.ifr_flags & IFF_VNET_HDR);
+
 	if (!(c->pasta_ifi = if_nametoindex(c->pasta_ifn)))
 		die("Tap device opened but no network interface found");
 
@@ -1551,6 +2085,41 @@ static int tap_ns_tun(void *arg)
 	return 0;
 }
 
+/**
+ * tap_tun_offload() - Enable offloads for frames from the namespace, if usable
+ * @c:		Execution context
+ *
+ * With TCP segmentation offload, the kernel hands us super-frames of up to the
+ * GSO size limit of the device, so that a single read() on the device can
+ * carry the equivalent of dozens of MSS-sized segments. That limit is 64 KiB
+ * by default, though, and frames can't be longer than PACKET_MAX_LEN for us:
+ * lower it first, and don't ask for segmentation offload if we can't.
+ *
+ * Partial checksums are fine in any case, we don't need them.
+ *
+ * #syscalls:pasta ioctl
+ */
+static void tap_tun_offload(const struct ctx *c)
+{
+	unsigned offload = TUN_F_CSUM;
+	int rc;
+
+	if (!c->pasta_vnet_hdr)
+		return;
+
+	rc = nl_link_set_gso_max_size(nl_sock_ns, c->pasta_ifi,
+				      L2_MAX_LEN_PASTA);
+	if (rc < 0)
+		debug("Can't set GSO size limit in namespace: %s", strerror_(-rc));
+	else
+		offload |= TUN_F_TSO4 | TUN_F_TSO6;
+
+	if (ioctl(c->fd_tap, (int)TUNSETOFFLOAD, offload) < 0 &&
+	    (offload == TUN_F_CSUM ||
+	     ioctl(c->fd_tap, (int)TUNSETOFFLOAD, TUN_F_CSUM) < 0))
+		debug_perror("TUNSETOFFLOAD ioctl on /dev/net/tun failed");
+}
+
 /**
  * tap_sock_tun_init() - Set up /dev/net/tun file descriptor
  * @c:		Execution context
@@ -1565,6 +2134,19 @@ static void tap_sock_tun_init(struct ctx *c)
 
 	pasta_ns_conf(c);
 
+	if (!c->splice_only)
+		tap_tun_offload(c);
+
+	if (!c->splice_only && c->io_uring) {
+		int rc = uring_init();
+
+		if (rc)
+			warn("Can't set up io_uring: %s, using read()",
+			     strerror_(-rc));
+		else
+			debug("Reading from tap device with io_uring");
+	}
+
 	if (!c->splice_only)
 		tap_start_connection(c);
 }
@@ -1599,6 +2181,10 @@ void tap_backend_init(struct ctx *c)
 		tap_sock_update_pool(&c->vdev->memory, 0);
 	} else {
 		tap_sock_update_pool(pkt_buf, sizeof(pkt_buf));
+		if (c->low_mem)
+			tap_buf_size = TAP_BUF_LOW_MEM;
+		else
+			madvise_hugepage(pkt_buf, sizeof(pkt_buf));
 	}
 
 	if (c->fd_tap != -1) { /* Passed as --fd */
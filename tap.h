@@ -6,9 +6,13 @@
 #ifndef TAP_H
 #define TAP_H
 
+#include <stdbool.h>
 #include <stddef.h>
 #include <stdint.h>
 
+#include <netinet/tcp.h>
+#include <linux/virtio_net.h>
+
 #include "passt.h"
 
 /** L2_MAX_LEN_PASTA - Maximum frame length for pasta mode (with L2 header)
@@ -41,11 +45,32 @@ struct udphdr;
 /**
  * struct tap_hdr - tap backend specific headers
  * @vnet_len:	Frame length (for qemu socket transport)
+ * @vnet_hdr:	virtio-net header (for tuntap device with IFF_VNET_HDR)
  */
 struct tap_hdr {
-	uint32_t vnet_len;
+	union {
+		uint32_t vnet_len;
+		struct virtio_net_hdr vnet_hdr;
+	};
 } __attribute__((packed));
 
+/**
+ * tap_hdr_len() - Length of tap specific header in the current configuration
+ * @c:		Execution context
+ *
+ * Return: length of header preceding each frame on the tap interface
+ */
+static inline size_t tap_hdr_len(const struct ctx *c)
+{
+	if (c->mode == MODE_PASST)
+		return sizeof(uint32_t);
+
+	if (c->mode == MODE_PASTA && c->pasta_vnet_hdr)
+		return sizeof(struct virtio_net_hdr);
+
+	return 0;
+}
+
 /**
  * tap_hdr_iov() - struct iovec for a tap header
  * @c:		Execution context
@@ -59,20 +84,101 @@ static inline struct iovec tap_hdr_iov(const struct ctx *c,
 {
 	return (struct iovec){
 		.iov_base = thdr,
-		.iov_len = c->mode == MODE_PASST ? sizeof(*thdr) : 0,
+		.iov_len = tap_hdr_len(c),
 	};
 }
 
 /**
  * tap_hdr_update() - Update the tap specific header for a frame
+ * @c:		Execution context
  * @taph:	Tap specific header buffer to update
  * @l2len:	Frame length (including L2 headers)
+ *
+ * For the tuntap device, this resets the virtio-net header: no offloads.
+ */
+static inline void tap_hdr_update(const struct ctx *c, struct tap_hdr *thdr,
+				  size_t l2len)
+{
+	if (c->mode == MODE_PASST)
+		thdr->vnet_len = htonl(l2len);
+	else
+		thdr->vnet_hdr = (struct virtio_net_hdr){ 0 };
+}
+
+/**
+ * tap_offload() - Can we offload checksums and segmentation to the kernel?
+ * @c:		Execution context
+ *
+ * Return: true if the tuntap device takes virtio-net headers, and we don't
+ *         need complete checksums for packet captures
+ */
+static inline bool tap_offload(const struct ctx *c)
+{
+	return c->mode == MODE_PASTA && c->pasta_vnet_hdr && !*c->pcap;
+}
+
+/**
+ * tap_hdr_csum() - Offload L4 checksum for a tuntap frame
+ * @thdr:	Tap specific header buffer, after tap_hdr_update()
+ * @l4off:	Offset of L4 header from start of frame
+ * @csum_off:	Offset of checksum field from start of L4 header
+ *
+ * The checksum field in the frame must hold the pseudo-header checksum.
+ * Fields use native endianness, which is what the tuntap driver expects
+ * unless TUNSETVNETLE or TUNSETVNETBE are used.
  */
-static inline void tap_hdr_update(struct tap_hdr *thdr, size_t l2len)
+static inline void tap_hdr_csum(struct tap_hdr *thdr, size_t l4off,
+				size_t csum_off)
 {
-	thdr->vnet_len = htonl(l2len);
+	thdr->vnet_hdr.flags = VIRTIO_NET_HDR_F_NEEDS_CSUM;
+	thdr->vnet_hdr.csum_start = l4off;
+	thdr->vnet_hdr.csum_offset = csum_off;
 }
 
+/**
+ * tap_hdr_tso() - Offload TCP checksum and segmentation for a tuntap frame
+ * @thdr:	Tap specific header buffer, after tap_hdr_update()
+ * @v6:		Set for IPv6 frames
+ * @l4off:	Offset of TCP header from start of frame
+ * @dlen:	TCP payload length
+ * @mss:	Maximum segment size: segment the frame if @dlen exceeds this
+ *
+ * The TCP checksum field in the frame must hold the pseudo-header checksum,
+ * as for tap_hdr_csum().
+ */
+static inline void tap_hdr_tso(struct tap_hdr *thdr, bool v6, size_t l4off,
+			       size_t dlen, uint16_t mss)
+{
+	tap_hdr_csum(thdr, l4off, offsetof(struct tcphdr, check));
+
+	if (dlen > mss) {
+		thdr->vnet_hdr.gso_type = v6 ? VIRTIO_NET_HDR_GSO_TCPV6 :
+					       VIRTIO_NET_HDR_GSO_TCPV4;
+		thdr->vnet_hdr.gso_size = mss;
+		thdr->vnet_hdr.hdr_len = l4off + sizeof(struct tcphdr);
+	}
+}
+
+/* Minimum rate and burst for --tap-rate: a full bucket fits any TCP segment */
+#define TAP_RATE_MIN		65536
+
+/**
+ * enum tap_shape_dir - Direction of traffic for --tap-rate token buckets
+ */
+enum tap_shape_dir {
+	TAP_SHAPE_TO_TAP,
+	TAP_SHAPE_FROM_TAP,
+
+	TAP_SHAPE_DIRS,
+};
+
+int64_t tap_shape_avail(const struct ctx *c, enum tap_shape_dir dir,
+			const struct timespec *now);
+void tap_shape_take(const struct ctx *c, enum tap_shape_dir dir, size_t bytes);
+bool tap_shape_admit(const struct ctx *c, enum tap_shape_dir dir,
+		     size_t bytes, const struct timespec *now);
+uint64_t tap_shape_wait(const struct ctx *c, enum tap_shape_dir dir,
+			size_t bytes, const struct timespec *now);
 unsigned long tap_l2_max_len(const struct ctx *c);
 void *tap_push_l2h(const struct ctx *c, void *buf,
 		   const void *src_mac, uint16_t proto);
@@ -107,6 +213,7 @@ void tap_icmp6_send(const struct ctx *c,
 		    const struct in6_addr *src, const struct in6_addr *dst,
 		    const void *in, const void *src_mac, size_t l4len);
 void tap_send_single(const struct ctx *c, const void *data, size_t l2len);
+void tap_flush(const struct ctx *c);
 size_t tap_send_frames(const struct ctx *c, const struct iovec *iov,
 		       size_t bufs_per_frame, size_t nframes);
 void eth_update_mac(struct ethhdr *eh,
@@ -119,6 +226,8 @@ void tap_handler_passt(struct ctx *c, uint32_t events,
 		       const struct timespec *now);
 int tap_sock_unix_open(char *sock_path);
 void tap_sock_reset(struct ctx *c);
+void tap_release(const struct ctx *c);
+void tap_wait_writable(const struct ctx *c);
 void tap_backend_init(struct ctx *c);
 void tap_flush_pools(void);
 void tap_handler(struct ctx *c, const struct timespec *now);
@@ -172,12 +172,17 @@
  * - outbound connection (from guest to socket): on SYN segment from guest, a
  *   new socket is created and mapped in connection tracking table, setting
  *   MSS and window clamping from header and option of the observed SYN segment
+ * - TCP Fast Open (RFC 7413) for outbound connections: the guest gets cookies
+ *   we derive from its address, and if it sends data with a valid cookie in
+ *   the SYN segment, we connect() the socket with sendmsg() and MSG_FASTOPEN,
+ *   acknowledging in the SYN, ACK segment as much as the kernel accepted
  *
  *
  * Aging and timeout
  * -----------------
  *
- * Timeouts are implemented by means of timerfd timers, set based on flags:
+ * Timeouts are implemented by means of a timer wheel (see wheel.c), driven by a
+ * single timerfd, and set based on flags:
  *
  * - RTO_INIT: if no ACK segment was received from tap/guest, either during
  *   handshake (flag ACK_FROM_TAP_DUE without ESTABLISHED event) or after
@@ -248,7 +253,9 @@
  *   - on packet from tap/guest:
  *     - set @ts_tap_act
  *     - check seq from header against @seq_from_tap, if data is missing, send
- *       two ACKs with number @seq_ack_to_tap, discard packet
+ *       two ACKs with number @seq_ack_to_tap, and hold a copy of the packet
+ *       (up to TCP_OOO_CONN_SEGS per connection) until the hole is filled,
+ *       reporting held data with SACK blocks if the guest allows for them
  *     - otherwise queue data to socket, set @seq_from_tap to seq from header
  *       plus payload length
  *     - in ESTABLISHED state, send ACK to tap as soon as we queue to the
@@ -291,6 +298,7 @@
 #include <sys/timerfd.h>
 #include <sys/types.h>
 #include <sys/uio.h>
+#include <sys/utsname.h>
 #include <time.h>
 #include <arpa/inet.h>
 
@@ -306,6 +314,7 @@
 #include "tcp_splice.h"
 #include "log.h"
 #include "inany.h"
+#include "siphash.h"
 #include "flow.h"
 #include "repair.h"
 #include "linux_dep.h"
@@ -316,6 +325,9 @@
 #include "tcp_buf.h"
 #include "tcp_vu.h"
 #include "epoll_ctl.h"
+#include "wheel.h"
+#include "probe.h"
+#include "stats.h"
 
 /*
  * The size of TCP header (including options) is given by doff (Data Offset)
@@ -327,6 +339,10 @@
  */
 #define OPTLEN_MAX (((1UL << 4) - 1 - 5) * 4UL)
 
+#ifndef IPPROTO_MPTCP
+#define IPPROTO_MPTCP	262
+#endif
+
 #ifndef __USE_MISC
 /* From Linux UAPI, missing in netinet/tcp.h provided by musl */
 struct tcp_repair_opt {
@@ -346,20 +362,48 @@ enum {
 #define MSS_DEFAULT			536
 #define WINDOW_DEFAULT			14600		/* RFC 6928 */
 
+/* With --tcp-window-bdp, multiple of bandwidth-delay product we let the guest
+ * fill, so that the congestion window on the host side can keep growing
+ */
+#define WINDOW_BDP_HEADROOM		2
+
 #define RTO_INIT			1		/* s, RFC 6298 */
 #define RTO_INIT_AFTER_SYN_RETRIES	3		/* s, RFC 6298 */
 
 #define INACTIVITY_INTERVAL		7200		/* s */
 #define	KEEPALIVE_INTERVAL		30		/* s */
 
-#define LOW_RTT_TABLE_SIZE		8
+#define TCP_DST_CACHE_SIZE		1024
+static_assert((TCP_DST_CACHE_SIZE & (TCP_DST_CACHE_SIZE - 1)) == 0,
+	      "TCP_DST_CACHE_SIZE must be a power of two");
 #define LOW_RTT_THRESHOLD		10 /* us */
 
+#define TCP_SYN_TS_SIZE			256
+
 /* Ratio of buffer to bandwidth * delay product implying interactive traffic */
 #define SNDBUF_TO_BW_DELAY_INTERACTIVE	/* > */ 20 /* (i.e. < 5% of buffer) */
 
 #define ACK_IF_NEEDED	0		/* See tcp_send_flag() */
 
+/* Maximum connections with ACKs deferred to the end of an iteration */
+#define ACK_DEFER_MAX	256
+
+/* Maximum connections accepted per wakeup, so that other events don't starve */
+#define ACCEPT_BATCH	64
+
+/* Out-of-order segments from tap held across batches, in total, and at most
+ * for a single connection, see tcp_ooo_add()
+ */
+#define TCP_OOO_SEGS		32
+#define TCP_OOO_CONN_SEGS	8
+#define TCP_OOO_SEG_MAX		USHRT_MAX
+
+/* SACK blocks we report for held segments: NOPs, kind and length come first */
+#define TCP_OOO_SACK_BLOCKS	2
+#define TCP_OOO_SACK_LEN	(4 + TCP_OOO_SACK_BLOCKS * 2 * sizeof(uint32_t))
+static_assert(TCP_OOO_SACK_LEN <= sizeof(struct tcp_syn_opts),
+	      "SACK blocks don't fit in space for TCP options");
+
 #define CONN_IS_CLOSING(conn)						\
 	(((conn)->events & ESTABLISHED) &&				\
 	 ((conn)->events & (SOCK_FIN_RCVD | TAP_FIN_RCVD)))
@@ -378,14 +422,17 @@ static uint8_t tcp_migrate_rcv_queue	[TCP_MIGRATE_RCV_QUEUE_MAX];
 #define SYN_RETRIES		"/proc/sys/net/ipv4/tcp_syn_retries"
 #define SYN_LINEAR_TIMEOUTS	"/proc/sys/net/ipv4/tcp_syn_linear_timeouts"
 #define RTO_MAX_MS		"/proc/sys/net/ipv4/tcp_rto_max_ms"
+#define TCP_WMEM		"/proc/sys/net/ipv4/tcp_wmem"
 
 #define SYN_RETRIES_DEFAULT		6
 #define SYN_LINEAR_TIMEOUTS_DEFAULT	4
 #define RTO_MAX_DEFAULT		120 /* s */
 #define MAX_SYNCNT			127 /* derived from kernel's limit */
 
-/* "Extended" data (not stored in the flow table) for TCP flow migration */
-static struct tcp_tap_transfer_ext migrate_ext[FLOW_MAX];
+/* "Extended" data (not stored in the flow table) for TCP flow migration,
+ * allocated for the whole flow table by tcp_init()
+ */
+static struct tcp_tap_transfer_ext *migrate_ext;
 
 static const char *tcp_event_str[] __attribute((__unused__)) = {
 	"SOCK_ACCEPTED", "TAP_SYN_RCVD", "ESTABLISHED", "TAP_SYN_ACK_SENT",
@@ -407,12 +454,64 @@ static const char *tcp_state_str[] __attribute((__unused__)) = {
 static const char *tcp_flag_str[] __attribute((__unused__)) = {
 	"STALLED", "LOCAL", "ACTIVE_CLOSE", "ACK_TO_TAP_DUE",
 	"ACK_FROM_TAP_DUE", "ACK_FROM_TAP_BLOCKS", "SYN_RETRIED",
+	"ACK_DEFERRED",
+};
+
+/**
+ * struct tcp_dst - Cached parameters for a destination of guest connections
+ * @addr:	Destination address, unspecified if entry is unused
+ * @min_rtt:	Minimum RTT seen for this destination, us, UINT32_MAX if unknown
+ * @sndbuf:	Last sending buffer size for this destination, scaled
+ * @wnd:	Last sending window, capped to @sndbuf, initial window hint
+ */
+struct tcp_dst {
+	union inany_addr addr;
+	uint32_t min_rtt;
+	uint32_t sndbuf;
+	uint32_t wnd;
 };
 
-/* Table of our guest side addresses with very low RTT (assumed to be local to
- * the host), LRU
+/* Direct-mapped cache of destinations, hashed by address: on collisions, the
+ * most recent destination wins. Very low RTT destinations are assumed to be
+ * local to the host.
  */
-static union inany_addr low_rtt_dst[LOW_RTT_TABLE_SIZE];
+static struct tcp_dst tcp_dst_cache[TCP_DST_CACHE_SIZE];
+
+/**
+ * struct tcp_syn_ts - Time of SYN from tap for a connection being set up
+ * @flowi:	Index of connection in flow table
+ * @ts:		Timestamp of SYN, zero if entry is unused
+ */
+struct tcp_syn_ts {
+	unsigned flowi;
+	struct timespec ts;
+};
+
+/* Direct-mapped by flow index, for PESTO_STATS_HIST_FLOW_SETUP: connections
+ * overwriting each other's entries while connecting are simply not accounted
+ */
+static struct tcp_syn_ts tcp_syn_ts[TCP_SYN_TS_SIZE];
+
+/**
+ * struct tcp_ooo_seg - Segment from tap past a hole, held until it's filled
+ * @flowi:	Index of connection in flow table
+ * @seq:	Sequence number of first byte of data
+ * @len:	Length of data, zero if entry is unused
+ */
+struct tcp_ooo_seg {
+	unsigned flowi;
+	uint32_t seq;
+	uint16_t len;
+};
+
+static struct tcp_ooo_seg tcp_ooo[TCP_OOO_SEGS];
+static uint8_t tcp_ooo_data[TCP_OOO_SEGS][TCP_OOO_SEG_MAX];
+
+/* Count of used entries in tcp_ooo, lookups are skipped if there are none */
+static unsigned tcp_ooo_used;
+
+/* Sum of sending buffer sizes of connections, as last fetched from kernel */
+static uint64_t tcp_sndbuf_total;
 
 char		tcp_buf_discard		[BUF_DISCARD_SIZE];
 
@@ -422,6 +521,10 @@ bool peek_offset_cap;
 /* Size of data returned by TCP_INFO getsockopt() */
 static socklen_t tcp_info_size;
 
+/* Single timerfd driving the timer wheel, and tick it's currently set for */
+static int tcp_timer_fd = -1;
+static uint64_t tcp_timer_armed = WHEEL_NONE;
+
 #define tcp_info_cap(f_)						\
 	((offsetof(struct tcp_info_linux, tcpi_##f_) +			\
 	  sizeof(((struct tcp_info_linux *)NULL)->tcpi_##f_)) <= tcp_info_size)
@@ -439,8 +542,8 @@ static socklen_t tcp_info_size;
 static struct iovec	tcp_iov			[UIO_MAXIOV];
 
 /* Pools for pre-opened sockets (in init) */
-int init_sock_pool4		[TCP_SOCK_POOL_SIZE];
-int init_sock_pool6		[TCP_SOCK_POOL_SIZE];
+struct sock_pool init_sock_pool4;
+struct sock_pool init_sock_pool6;
 
 /**
  * conn_at_sidx() - Get TCP connection specific flow at given sidx
@@ -530,8 +633,7 @@ static int tcp_epoll_ctl(struct tcp_tap_conn *conn)
 		int epollfd = flow_epollfd(&conn->f);
 
 		epoll_del(epollfd, conn->sock);
-		if (conn->timer != -1)
-			epoll_del(epollfd, conn->timer);
+		wheel_del(FLOW_IDX(conn));
 
 		return 0;
 	}
@@ -546,55 +648,57 @@ static int tcp_epoll_ctl(struct tcp_tap_conn *conn)
 }
 
 /**
- * tcp_timer_ctl() - Set timerfd based on flags/events, create timerfd if needed
+ * tcp_timer_arm() - Set timerfd for timer wheel, unless it expires earlier
+ * @expires:	Tick for next timer wheel event, WHEEL_NONE if none
+ *
+ * #syscalls timerfd_settime|timerfd_settime32
+ * #syscalls arm:timerfd_settime64 i686:timerfd_settime64
+ */
+static void tcp_timer_arm(uint64_t expires)
+{
+	struct itimerspec it = { { 0 }, { 0 } };
+	uint64_t ns;
+
+	/* If the timerfd fires earlier, tcp_timer_handler() re-arms it, and we
+	 * get a spurious but harmless wakeup if the timer is gone meanwhile.
+	 */
+	if (expires >= tcp_timer_armed)
+		return;
+
+	ns = expires * WHEEL_TICK_NS;
+	it.it_value.tv_sec = ns / (1000ULL * 1000 * 1000);
+	it.it_value.tv_nsec = ns % (1000ULL * 1000 * 1000);
+
+	if (timerfd_settime(tcp_timer_fd, TFD_TIMER_ABSTIME, &it, NULL)) {
+		err_perror("Failed to set TCP timer");
+		return;
+	}
+
+	tcp_timer_armed = expires;
+}
+
+/**
+ * tcp_timer_ctl() - Set, reset, or cancel timer based on flags/events
  * @c:		Execution context
  * @conn:	Connection pointer
  * @now:	Current timestamp
- *
- * #syscalls timerfd_create timerfd_settime|timerfd_settime32
  */
 static void tcp_timer_ctl(const struct ctx *c, struct tcp_tap_conn *conn,
 			  const struct timespec *now)
 {
-	struct itimerspec it = { { 0 }, { 0 } };
+	uint64_t ns, tick, expires;
 
 	if (conn->events == CLOSED)
 		return;
 
-	if (conn->timer == -1) {
-		union epoll_ref ref;
-		int fd;
-
-		fd = timerfd_create(CLOCK_MONOTONIC, 0);
-		if (fd == -1) {
-			flow_perror_ratelimit(conn, now, "failed to get timer");
-			return;
-		}
-		if (fd > FD_REF_MAX) {
-			flow_err_ratelimit(conn, now,
-					   "timer fd overflow (%d > %d)",
-					   fd, FD_REF_MAX);
-			close(fd);
-			return;
-		}
+	if (conn->flags & ACK_TO_TAP_DUE) {
+		ns = (uint64_t)RTT_GET(conn) / 2 * 1000;
 
-		ref.type = EPOLL_TYPE_TCP_TIMER;
-		ref.flow = FLOW_IDX(conn);
-		ref.fd = fd;
-		if (epoll_add(flow_epollfd(&conn->f), EPOLLIN | EPOLLET,
-			      ref) < 0) {
-			flow_perror_ratelimit(conn, now, "failed to add timer");
-			close(fd);
-			return;
+		/* Closed window: update it once --tap-rate allows a segment */
+		if (!conn->wnd_to_tap) {
+			ns = MAX(ns, tap_shape_wait(c, TAP_SHAPE_FROM_TAP,
+						    MSS_GET(conn), now));
 		}
-
-		conn->timer = fd;
-	}
-
-	if (conn->flags & ACK_TO_TAP_DUE) {
-		it.it_value.tv_sec = RTT_GET(conn) / 2 / ((long)1000 * 1000);
-		it.it_value.tv_nsec = RTT_GET(conn) / 2 % ((long)1000 * 1000) *
-				      1000;
 	} else if (conn->flags & ACK_FROM_TAP_DUE) {
 		int exp = conn->retries, timeout = RTO_INIT;
 		if (!(conn->events & ESTABLISHED))
@@ -602,27 +706,34 @@ static void tcp_timer_ctl(const struct ctx *c, struct tcp_tap_conn *conn,
 		else if (conn->flags & SYN_RETRIED)
 			timeout = MAX(timeout, RTO_INIT_AFTER_SYN_RETRIES);
 		timeout <<= MAX(exp, 0);
-		it.it_value.tv_sec = MIN(timeout, c->tcp.rto_max);
+		ns = (uint64_t)MIN(timeout, c->tcp.rto_max) * 1000 * 1000 * 1000;
+	} else if (c->tap_rate && (conn->flags & STALLED)) {
+		/* Resume sending once --tap-rate allows a segment, or disarm */
+		ns = tap_shape_wait(c, TAP_SHAPE_TO_TAP, MSS_GET(conn), now);
 	} else {
 		/* Disarm */
-		it.it_value.tv_sec = 0;
-		it.it_value.tv_nsec = 0;
+		ns = 0;
 	}
 
 	if (conn->flags & ACK_TO_TAP_DUE) {
 		flow_trace(conn, "timer expires in %llu.%02llums",
-			   (unsigned long long)it.it_value.tv_sec * 1000 +
-			   it.it_value.tv_nsec / 1000 / 1000,
-			   (unsigned long long)it.it_value.tv_nsec
-			   / 1000 / 10 % 100);
+			   (unsigned long long)ns / 1000 / 1000,
+			   (unsigned long long)ns / 1000 / 10 % 100);
 	} else {
 		flow_dbg(conn, "timer expires in %llu.%03llus",
-			 (unsigned long long)it.it_value.tv_sec,
-			 (unsigned long long)it.it_value.tv_nsec / 1000 / 1000);
+			 (unsigned long long)ns / 1000 / 1000 / 1000,
+			 (unsigned long long)ns / 1000 / 1000 % 1000);
+	}
+
+	if (!ns) {
+		wheel_del(FLOW_IDX(conn));
+		return;
 	}
 
-	if (timerfd_settime(conn->timer, 0, &it, NULL))
-		flow_perror(conn, "failed to set timer");
+	tick = wheel_tick(now);
+	expires = tick + (ns + WHEEL_TICK_NS - 1) / WHEEL_TICK_NS;
+	wheel_add(FLOW_IDX(conn), tick, expires);
+	tcp_timer_arm(expires);
 }
 
 /**
@@ -722,62 +833,103 @@ void conn_event_do(const struct ctx *c, struct tcp_tap_conn *conn,
 	if ((event == TAP_FIN_RCVD) && !(conn->events & SOCK_FIN_RCVD)) {
 		conn_flag(c, conn, ACTIVE_CLOSE, now);
 	} else {
-		if (event == CLOSED)
+		if (event == CLOSED) {
 			flow_hash_remove(c, TAP_SIDX(conn));
+			flow_defer(&conn->f);
+		}
 		tcp_epoll_ctl(conn);
 	}
 }
 
 /**
- * tcp_rtt_dst_low() - Check if low RTT was seen for connection endpoint
+ * tcp_dst_slot() - Find destination cache slot for connection endpoint
+ * @c:		Execution context
  * @conn:	Connection pointer
  *
- * Return: 1 if destination is in low RTT table, 0 otherwise
+ * Return: pointer to cache slot, which might hold a different destination
  */
-static int tcp_rtt_dst_low(const struct tcp_tap_conn *conn)
+static struct tcp_dst *tcp_dst_slot(const struct ctx *c,
+				    const struct tcp_tap_conn *conn)
 {
+	struct siphash_state st = SIPHASH_INIT(c->hash_secret);
 	const struct flowside *tapside = TAPFLOW(conn);
-	int i;
+	uint32_t h;
 
-	for (i = 0; i < LOW_RTT_TABLE_SIZE; i++)
-		if (inany_equals(&tapside->oaddr, low_rtt_dst + i))
-			return 1;
+	siphash_feed_inany(&st, &tapside->oaddr);
+	h = siphash_final(&st, sizeof(tapside->oaddr), 0);
 
-	return 0;
+	return &tcp_dst_cache[h & (TCP_DST_CACHE_SIZE - 1)];
 }
 
 /**
- * tcp_rtt_dst_check() - Check tcpi_min_rtt, insert endpoint in table if low
+ * tcp_dst_get() - Look up cached parameters for connection endpoint
+ * @c:		Execution context
+ * @conn:	Connection pointer
+ *
+ * Return: cache entry for destination, NULL if not cached
+ */
+static const struct tcp_dst *tcp_dst_get(const struct ctx *c,
+					 const struct tcp_tap_conn *conn)
+{
+	const struct tcp_dst *d = tcp_dst_slot(c, conn);
+
+	if (!inany_equals(&d->addr, &TAPFLOW(conn)->oaddr))
+		return NULL;
+
+	return d;
+}
+
+/**
+ * tcp_rtt_dst_low() - Check if low RTT was seen for connection endpoint
+ * @c:		Execution context
+ * @conn:	Connection pointer
+ *
+ * Return: 1 if destination is cached with a low RTT, 0 otherwise
+ */
+static int tcp_rtt_dst_low(const struct ctx *c,
+			   const struct tcp_tap_conn *conn)
+{
+	const struct tcp_dst *d = tcp_dst_get(c, conn);
+
+	return d && d->min_rtt <= LOW_RTT_THRESHOLD;
+}
+
+/**
+ * tcp_rtt_dst_check() - Update cached parameters for connection endpoint
+ * @c:		Execution context
  * @conn:	Connection pointer
  * @tinfo:	Pointer to struct tcp_info for socket
  */
-static void tcp_rtt_dst_check(const struct tcp_tap_conn *conn,
+static void tcp_rtt_dst_check(const struct ctx *c,
+			      const struct tcp_tap_conn *conn,
 			      const struct tcp_info_linux *tinfo)
 {
 	const struct flowside *tapside = TAPFLOW(conn);
-	int i, hole = -1;
+	struct tcp_dst *d = tcp_dst_slot(c, conn);
 
-	if (!min_rtt_cap ||
-	    (int)tinfo->tcpi_min_rtt > LOW_RTT_THRESHOLD)
-		return;
-
-	for (i = 0; i < LOW_RTT_TABLE_SIZE; i++) {
-		if (inany_equals(&tapside->oaddr, low_rtt_dst + i))
-			return;
-		if (hole == -1 && IN6_IS_ADDR_UNSPECIFIED(low_rtt_dst + i))
-			hole = i;
+	if (!inany_equals(&d->addr, &tapside->oaddr)) {
+		d->addr = tapside->oaddr;
+		d->min_rtt = UINT32_MAX;
 	}
 
-	/* Keep gcc 12 happy: this won't actually happen because the table is
-	 * guaranteed to have a hole, see the second memcpy() below.
-	 */
-	if (hole == -1)
-		return;
+	if (min_rtt_cap)
+		d->min_rtt = MIN(d->min_rtt, tinfo->tcpi_min_rtt);
+	d->sndbuf = SNDBUF_GET(conn);
+	if (snd_wnd_cap)
+		d->wnd = MIN(tinfo->tcpi_snd_wnd, d->sndbuf);
+}
 
-	low_rtt_dst[hole++] = tapside->oaddr;
-	if (hole == LOW_RTT_TABLE_SIZE)
-		hole = 0;
-	inany_from_af(low_rtt_dst + hole, AF_INET6, &in6addr_any);
+/**
+ * tcp_sndbuf_set() - Store sending buffer size, account for it in total
+ * @conn:	Connection pointer
+ * @bytes:	Sending buffer size, scaled, 0 if the connection goes away
+ */
+static void tcp_sndbuf_set(struct tcp_tap_conn *conn, uint32_t bytes)
+{
+	tcp_sndbuf_total -= SNDBUF_GET(conn);
+	SNDBUF_SET(conn, bytes);
+	tcp_sndbuf_total += SNDBUF_GET(conn);
+	passt_stats.mem[STATS_MEM_TCP_SNDBUF] = tcp_sndbuf_total;
 }
 
 /**
@@ -792,13 +944,13 @@ static void tcp_get_sndbuf(struct tcp_tap_conn *conn)
 
 	sl = sizeof(sndbuf);
 	if (getsockopt(s, SOL_SOCKET, SO_SNDBUF, &sndbuf, &sl)) {
-		SNDBUF_SET(conn, WINDOW_DEFAULT);
+		tcp_sndbuf_set(conn, WINDOW_DEFAULT);
 		return;
 	}
 
 	v = clamped_scale(sndbuf, sndbuf, SNDBUF_SMALL, SNDBUF_BIG, 75);
 
-	SNDBUF_SET(conn, MIN(INT_MAX, v));
+	tcp_sndbuf_set(conn, MIN(INT_MAX, v));
 }
 
 /**
@@ -887,6 +1039,203 @@ static int tcp_opt_get(const char *opts, size_t len, uint8_t type_find,
 	return -1;
 }
 
+/**
+ * tcp_ooo_add() - Hold copy of segment from tap past the next sequence we need
+ * @conn:	Connection pointer
+ * @p:		Pool of TCP packets, with TCP headers
+ * @idx:	Index of packet in pool
+ * @seq_from_tap:	Next sequence we need from tap
+ *
+ * Return: 1 if the segment was stored, 0 if it's not past @seq_from_tap, has
+ *	   no data, or we already hold it, -1 if there's no room for it
+ */
+static int tcp_ooo_add(const struct tcp_tap_conn *conn, const struct pool *p,
+		       int idx, uint32_t seq_from_tap)
+{
+	unsigned flowi = FLOW_IDX(conn), i, held = 0;
+	struct tcphdr th_storage;
+	const struct tcphdr *th;
+	struct iov_tail data;
+	int free = -1;
+	uint32_t seq;
+	size_t len;
+
+	if (!packet_get(p, idx, &data) ||
+	    !(th = IOV_PEEK_HEADER(&data, th_storage)))
+		return 0;
+
+	len = iov_tail_size(&data);
+	if (th->doff * 4UL < sizeof(*th) || th->doff * 4UL > len)
+		return 0;
+	len -= th->doff * 4UL;
+	iov_drop_header(&data, th->doff * 4UL);
+
+	seq = ntohl(th->seq);
+	if (!len || !SEQ_GT(seq, seq_from_tap))
+		return 0;
+
+	for (i = 0; i < TCP_OOO_SEGS; i++) {
+		const struct tcp_ooo_seg *o = &tcp_ooo[i];
+
+		if (!o->len) {
+			if (free < 0)
+				free = i;
+			continue;
+		}
+
+		if (o->flowi != flowi)
+			continue;
+
+		if (o->seq == seq && o->len >= len)
+			return 0;
+		held++;
+	}
+
+	if (free < 0 || held >= TCP_OOO_CONN_SEGS || len > TCP_OOO_SEG_MAX)
+		return -1;
+
+	iov_to_buf(data.iov, data.cnt, data.off, tcp_ooo_data[free], len);
+	tcp_ooo[free] = (struct tcp_ooo_seg){
+		.flowi = flowi, .seq = seq, .len = len,
+	};
+	tcp_ooo_used++;
+
+	return 1;
+}
+
+/**
+ * tcp_ooo_find() - Find held segment with data at given sequence
+ * @conn:	Connection pointer
+ * @seq:	Sequence
+ *
+ * Return: index of segment in tcp_ooo extending furthest past @seq, -1 if none
+ */
+static int tcp_ooo_find(const struct tcp_tap_conn *conn, uint32_t seq)
+{
+	unsigned flowi = FLOW_IDX(conn), i;
+	uint32_t end = seq;
+	int found = -1;
+
+	for (i = 0; tcp_ooo_used && i < TCP_OOO_SEGS; i++) {
+		const struct tcp_ooo_seg *o = &tcp_ooo[i];
+
+		if (!o->len || o->flowi != flowi || SEQ_GT(o->seq, seq))
+			continue;
+
+		if (SEQ_GT(o->seq + o->len, end)) {
+			end = o->seq + o->len;
+			found = i;
+		}
+	}
+
+	return found;
+}
+
+/**
+ * tcp_ooo_block() - Find first range of contiguous held data after sequence
+ * @conn:	Connection pointer
+ * @after:	Report only data starting after this sequence
+ * @left:	Start of range, set on return
+ * @right:	End of range (first sequence after it), set on return
+ *
+ * Return: true if a range was found, false otherwise
+ */
+static bool tcp_ooo_block(const struct tcp_tap_conn *conn, uint32_t after,
+			  uint32_t *left, uint32_t *right)
+{
+	unsigned flowi = FLOW_IDX(conn), i;
+	bool found = false, more;
+
+	for (i = 0; tcp_ooo_used && i < TCP_OOO_SEGS; i++) {
+		const struct tcp_ooo_seg *o = &tcp_ooo[i];
+
+		if (!o->len || o->flowi != flowi || !SEQ_GT(o->seq, after))
+			continue;
+
+		if (!found || SEQ_LT(o->seq, *left)) {
+			*left = o->seq;
+			*right = o->seq + o->len;
+			found = true;
+		}
+	}
+
+	if (!found)
+		return false;
+
+	do {
+		for (i = 0, more = false; i < TCP_OOO_SEGS; i++) {
+			const struct tcp_ooo_seg *o = &tcp_ooo[i];
+
+			if (!o->len || o->flowi != flowi ||
+			    !SEQ_GT(o->seq, after) || SEQ_GT(o->seq, *right) ||
+			    SEQ_LE(o->seq + o->len, *right))
+				continue;
+
+			*right = o->seq + o->len;
+			more = true;
+		}
+	} while (more);
+
+	return true;
+}
+
+/**
+ * tcp_ooo_sack() - Write SACK option for segments held for connection
+ * @conn:	Connection pointer
+ * @opts:	Buffer for options, at least TCP_OOO_SACK_LEN bytes
+ *
+ * Return: length of options written, 0 if none
+ */
+static size_t tcp_ooo_sack(const struct tcp_tap_conn *conn, uint8_t *opts)
+{
+	uint32_t after = conn->seq_from_tap, left, right;
+	size_t len = 4;
+
+	if (!conn->sack || !tcp_ooo_used)
+		return 0;
+
+	while (len < TCP_OOO_SACK_LEN &&
+	       tcp_ooo_block(conn, after, &left, &right)) {
+		uint32_t edges[2] = { htonl(left), htonl(right) };
+
+		memcpy(opts + len, edges, sizeof(edges));
+		len += sizeof(edges);
+		after = right;
+	}
+
+	if (len == 4)
+		return 0;
+
+	opts[0] = OPT_NOP;
+	opts[1] = OPT_NOP;
+	opts[2] = OPT_SACK;
+	opts[3] = len - 2;
+
+	return len;
+}
+
+/**
+ * tcp_ooo_drop() - Drop held segments for connection
+ * @conn:	Connection pointer
+ * @all:	Drop all segments, not just the ones we already sent to socket
+ */
+static void tcp_ooo_drop(const struct tcp_tap_conn *conn, bool all)
+{
+	unsigned flowi = FLOW_IDX(conn), i;
+
+	for (i = 0; tcp_ooo_used && i < TCP_OOO_SEGS; i++) {
+		struct tcp_ooo_seg *o = &tcp_ooo[i];
+
+		if (!o->len || o->flowi != flowi)
+			continue;
+
+		if (all || SEQ_LE(o->seq + o->len, conn->seq_from_tap)) {
+			o->len = 0;
+			tcp_ooo_used--;
+		}
+	}
+}
+
 /**
  * tcp_flow_defer() - Deferred per-flow handling (clean up closed connections)
  * @conn:	Connection to handle
@@ -899,8 +1248,11 @@ bool tcp_flow_defer(const struct tcp_tap_conn *conn)
 		return false;
 
 	close(conn->sock);
-	if (conn->timer != -1)
-		close(conn->timer);
+	wheel_del(FLOW_IDX(conn));
+	tcp_ooo_drop(conn, true);
+	tcp_sndbuf_total -= SNDBUF_GET(conn);
+	passt_stats.mem[STATS_MEM_TCP_SNDBUF] = tcp_sndbuf_total;
+	tcp_buf_conn_gone(conn);
 
 	return true;
 }
@@ -941,6 +1293,7 @@ static void tcp_fill_header(struct tcphdr *th,
  * @payload:		TCP payload
  * @dlen:		TCP payload length
  * @csum_flags:		TCP_CSUM if TCP checksum must be computed,
+ *                      TCP_CSUM_PARTIAL for pseudo-header checksum only,
  *                      IP4_CSUM if IPv4 checksum must be computed,
  *                      otherwise IPv4 checksum is provided in IP4_CMASK
  * @seq:		Sequence number for this segment
@@ -978,7 +1331,7 @@ size_t tcp_fill_headers(const struct ctx *c, struct tcp_tap_conn *conn,
 			ip4h->check = csum_flags & IP4_CMASK;
 		}
 
-		if (csum_flags & TCP_CSUM) {
+		if (csum_flags & (TCP_CSUM | TCP_CSUM_PARTIAL)) {
 			psum = proto_ipv4_header_psum(l4len, IPPROTO_TCP,
 						      *src4, *dst4);
 		}
@@ -998,7 +1351,7 @@ size_t tcp_fill_headers(const struct ctx *c, struct tcp_tap_conn *conn,
 
 		ip6_set_flow_lbl(ip6h, conn->sock);
 
-		if (csum_flags & TCP_CSUM) {
+		if (csum_flags & (TCP_CSUM | TCP_CSUM_PARTIAL)) {
 			psum = proto_ipv6_header_psum(l4len, IPPROTO_TCP,
 						      &ip6h->saddr,
 						      &ip6h->daddr);
@@ -1015,6 +1368,8 @@ size_t tcp_fill_headers(const struct ctx *c, struct tcp_tap_conn *conn,
 
 	if (csum_flags & TCP_CSUM)
 		tcp_update_csum(psum, th, payload, dlen);
+	else if (csum_flags & TCP_CSUM_PARTIAL)
+		th->check = csum_fold(psum);
 	else
 		th->check = 0;
 
@@ -1023,21 +1378,38 @@ size_t tcp_fill_headers(const struct ctx *c, struct tcp_tap_conn *conn,
 
 /**
  * tcp_wnd_from_sndbuf() - Calculate window from available send buffer space
+ * @c:		Execution context
  * @s:		Socket file descriptor
  * @conn:	Connection pointer
  * @tinfo:	tcp_info from kernel
  *
  * Return: window value to advertise, not scaled
  */
-static uint32_t tcp_wnd_from_sndbuf(int s, struct tcp_tap_conn *conn,
+static uint32_t tcp_wnd_from_sndbuf(const struct ctx *c, int s,
+				     struct tcp_tap_conn *conn,
 				     const struct tcp_info_linux *tinfo)
 {
+	bool over = c->tcp.mem_budget && tcp_sndbuf_total > c->tcp.mem_budget;
 	uint32_t rtt_ms_ceiling = DIV_ROUND_UP(tinfo->tcpi_rtt, 1000);
 	uint32_t mem[SK_MEMINFO_VARS];
 	socklen_t mem_sl = sizeof(mem);
 	int mss = MSS_GET(conn);
 	uint32_t limit, sendq;
 
+	/* Skip SIOCOUTQ and SO_MEMINFO while there's plenty of space left from
+	 * the last time we checked, assuming that no space was freed since then
+	 * as the peer acknowledged data: that's a conservative estimate, and we
+	 * check again once a quarter of the buffer or less is left.
+	 *
+	 * Not over the budget, though: the edge might predate that, and the
+	 * share below needs the current total anyway.
+	 */
+	limit = conn->seq_wnd_edge - conn->seq_from_tap;
+	if (!over && SEQ_GT(conn->seq_wnd_edge, conn->seq_from_tap) &&
+	    limit <= SNDBUF_GET(conn) &&
+	    limit >= MAX((uint32_t)mss, SNDBUF_GET(conn) / 4))
+		return MIN(tinfo->tcpi_snd_wnd, limit);
+
 	if (ioctl(s, SIOCOUTQ, &sendq)) {
 		debug_perror("SIOCOUTQ on socket %i, assuming 0", s);
 		sendq = 0;
@@ -1056,7 +1428,7 @@ static uint32_t tcp_wnd_from_sndbuf(int s, struct tcp_tap_conn *conn,
 		uint32_t scaled = clamped_scale(sndbuf, sndbuf, SNDBUF_SMALL,
 						SNDBUF_BIG, 75);
 
-		SNDBUF_SET(conn, MIN(INT_MAX, scaled));
+		tcp_sndbuf_set(conn, MIN(INT_MAX, scaled));
 
 		if (wmemq > sndbuf) {
 			limit = 0;
@@ -1072,6 +1444,20 @@ static uint32_t tcp_wnd_from_sndbuf(int s, struct tcp_tap_conn *conn,
 		}
 	}
 
+	/* Over budget: give each connection a share of the space left in its
+	 * buffer, in proportion to the budget. The kernel grows buffers of
+	 * bulk transfers only, so they keep the largest shares, but leave at
+	 * least one segment, so that no connection stalls altogether.
+	 */
+	if (over) {
+		uint64_t share = (uint64_t)limit * c->tcp.mem_budget /
+				 tcp_sndbuf_total;
+
+		limit = MIN(limit, MAX(share, (uint32_t)mss));
+	}
+
+	conn->seq_wnd_edge = conn->seq_from_tap + limit;
+
 	/* If the sender uses mechanisms to prevent Silly Window
 	 * Syndrome (SWS, described in RFC 813 Section 3) it's critical
 	 * that, should the window ever become less than the MSS, we
@@ -1105,6 +1491,74 @@ static uint32_t tcp_wnd_from_sndbuf(int s, struct tcp_tap_conn *conn,
 	return MIN(tinfo->tcpi_snd_wnd, limit);
 }
 
+/**
+ * tcp_wnd_from_bdp() - Calculate window from bandwidth-delay product
+ * @c:		Execution context
+ * @conn:	Connection pointer
+ * @tinfo:	tcp_info from kernel
+ *
+ * The window derived from the sending buffer size grows only as fast as the
+ * kernel auto-tunes the buffer, which in turn needs a full outbound queue.
+ * On paths with a large bandwidth-delay product, let the guest send enough
+ * to fill WINDOW_BDP_HEADROOM times that product instead, minus what's still
+ * queued in the socket, so that the kernel sees a full queue and grows the
+ * buffer as needed.
+ *
+ * Return: window value to advertise, not scaled, up to c->tcp.wnd_bdp_max,
+ *	   zero if the kernel doesn't report delivery rate or minimum RTT yet
+ */
+static uint32_t tcp_wnd_from_bdp(const struct ctx *c,
+				 const struct tcp_tap_conn *conn,
+				 const struct tcp_info_linux *tinfo)
+{
+	uint32_t queued, target;
+	uint64_t bdp;
+
+	if (!delivery_rate_cap || !min_rtt_cap || !bytes_acked_cap ||
+	    !tinfo->tcpi_min_rtt || tinfo->tcpi_min_rtt == UINT32_MAX)
+		return 0;
+
+	/* Bytes per second times microseconds */
+	bdp = tinfo->tcpi_delivery_rate * tinfo->tcpi_min_rtt / 1000 / 1000;
+	target = MIN(bdp * WINDOW_BDP_HEADROOM, c->tcp.wnd_bdp_max);
+
+	queued = conn->seq_from_tap -
+		 (tinfo->tcpi_bytes_acked + conn->seq_init_from_tap);
+	if (queued >= target)
+		return 0;
+
+	return target - queued;
+}
+
+/**
+ * tcp_wnd_shape() - Limit window advertised to guest to --tap-rate allowance
+ * @c:		Execution context
+ * @conn:	Connection pointer
+ * @wnd:	Window we would advertise otherwise
+ * @now:	Current timestamp
+ *
+ * Return: @wnd, or data not acknowledged yet plus allowance, if that's less.
+ *	   Without room for a full segment, close the window: a window update
+ *	   is then sent once enough allowance builds up, see tcp_timer_ctl().
+ */
+static uint32_t tcp_wnd_shape(const struct ctx *c,
+			      const struct tcp_tap_conn *conn, uint32_t wnd,
+			      const struct timespec *now)
+{
+	uint32_t unacked = conn->seq_from_tap - conn->seq_ack_to_tap;
+	int64_t avail = tap_shape_avail(c, TAP_SHAPE_FROM_TAP, now);
+
+	if (avail < MSS_GET(conn))
+		return MIN(wnd, unacked);
+
+	/* Round up to window scaling granularity, so that at least one full
+	 * segment fits: the excess is accounted for as debt anyway
+	 */
+	avail = ROUND_UP(MIN(avail, MAX_WINDOW), 1 << conn->ws_to_tap);
+
+	return MIN(wnd, unacked + avail);
+}
+
 /**
  * tcp_update_seqack_wnd() - Update ACK sequence and window to guest/tap
  * @c:		Execution context
@@ -1127,6 +1581,7 @@ int tcp_update_seqack_wnd(const struct ctx *c, struct tcp_tap_conn *conn,
 	socklen_t sl = sizeof(*tinfo);
 	struct tcp_info_linux tinfo_new;
 	uint32_t new_wnd_to_tap = prev_wnd_to_tap;
+	const struct tcp_dst *dst = NULL;
 	bool ack_everything = true;
 	int s = conn->sock;
 
@@ -1160,7 +1615,7 @@ int tcp_update_seqack_wnd(const struct ctx *c, struct tcp_tap_conn *conn,
 	 */
 	if (bytes_acked_cap && delivery_rate_cap && !force_seq &&
 	    !CONN_IS_CLOSING(conn) &&
-	    !(conn->flags & LOCAL) && !tcp_rtt_dst_low(conn)) {
+	    !(conn->flags & LOCAL) && !tcp_rtt_dst_low(c, conn)) {
 		if (!tinfo) {
 			tinfo = &tinfo_new;
 			if (getsockopt(s, SOL_TCP, TCP_INFO, tinfo, &sl))
@@ -1196,9 +1651,15 @@ int tcp_update_seqack_wnd(const struct ctx *c, struct tcp_tap_conn *conn,
 	if (SEQ_LT(conn->seq_ack_to_tap, prev_ack_to_tap))
 		conn->seq_ack_to_tap = prev_ack_to_tap;
 
+	if (!(conn->events & ESTABLISHED))
+		dst = tcp_dst_get(c, conn);
+
 	if (!snd_wnd_cap) {
 		tcp_get_sndbuf(conn);
-		new_wnd_to_tap = MIN(SNDBUF_GET(conn), MAX_WINDOW);
+		new_wnd_to_tap = SNDBUF_GET(conn);
+		if (dst)
+			new_wnd_to_tap = MAX(new_wnd_to_tap, dst->sndbuf);
+		new_wnd_to_tap = MIN(new_wnd_to_tap, MAX_WINDOW);
 		conn->wnd_to_tap = MIN(new_wnd_to_tap >> conn->ws_to_tap,
 				       USHRT_MAX);
 		goto out;
@@ -1214,15 +1675,33 @@ int tcp_update_seqack_wnd(const struct ctx *c, struct tcp_tap_conn *conn,
 		}
 	}
 
-	if ((conn->flags & LOCAL) || tcp_rtt_dst_low(conn))
+	if ((conn->flags & LOCAL) || tcp_rtt_dst_low(c, conn)) {
 		new_wnd_to_tap = tinfo->tcpi_snd_wnd;
-	else
-		new_wnd_to_tap = tcp_wnd_from_sndbuf(s, conn, tinfo);
+	} else {
+		new_wnd_to_tap = tcp_wnd_from_sndbuf(c, s, conn, tinfo);
+
+		/* Zero means no room at all: don't override that */
+		if (c->tcp.wnd_bdp_max && new_wnd_to_tap) {
+			uint32_t bdp = tcp_wnd_from_bdp(c, conn, tinfo);
+
+			bdp = MIN(bdp, tinfo->tcpi_snd_wnd);
+			new_wnd_to_tap = MAX(new_wnd_to_tap, bdp);
+		}
+	}
 
 	new_wnd_to_tap = MIN(new_wnd_to_tap, MAX_WINDOW);
-	if (!(conn->events & ESTABLISHED))
+	if (!(conn->events & ESTABLISHED)) {
 		new_wnd_to_tap = MAX(new_wnd_to_tap, WINDOW_DEFAULT);
 
+		/* Start from what we used for this destination before */
+		if (dst) {
+			new_wnd_to_tap = MAX(new_wnd_to_tap,
+					     MIN(dst->wnd, MAX_WINDOW));
+		}
+	} else {
+		new_wnd_to_tap = tcp_wnd_shape(c, conn, new_wnd_to_tap, now);
+	}
+
 	conn->wnd_to_tap = MIN(new_wnd_to_tap >> conn->ws_to_tap, USHRT_MAX);
 
 	/* Certain cppcheck versions, e.g. 2.12.0 have a bug where they think
@@ -1290,6 +1769,31 @@ static int tcp_rewind_seq(const struct ctx *c, struct tcp_tap_conn *conn,
 	return 0;
 }
 
+/**
+ * tcp_fastopen_cookie() - Calculate TCP Fast Open cookie for guest address
+ * @c:		Execution context
+ * @conn:	Connection pointer
+ * @cookie:	Cookie, set on return
+ *
+ * As suggested by RFC 7413, 4.1.2, cookies are a keyed hash of the address of
+ * the client, here, the guest.
+ */
+static void tcp_fastopen_cookie(const struct ctx *c,
+				const struct tcp_tap_conn *conn,
+				uint8_t cookie[TCP_FASTOPEN_COOKIE_SIZE])
+{
+	struct siphash_state st = SIPHASH_INIT(c->hash_secret);
+	const struct flowside *tapside = TAPFLOW(conn);
+	uint64_t h;
+
+	siphash_feed_inany(&st, &tapside->eaddr);
+	h = siphash_final(&st, sizeof(tapside->eaddr), OPT_FASTOPEN);
+
+	static_assert(sizeof(h) == TCP_FASTOPEN_COOKIE_SIZE,
+		      "TCP Fast Open cookie size doesn't match hash size");
+	memcpy(cookie, &h, sizeof(h));
+}
+
 /**
  * tcp_prepare_flags() - Prepare header for flags-only segment (no payload)
  * @c:		Execution context
@@ -1324,7 +1828,7 @@ int tcp_prepare_flags(const struct ctx *c, struct tcp_tap_conn *conn,
 	}
 
 	if (!(conn->flags & LOCAL))
-		tcp_rtt_dst_check(conn, &tinfo);
+		tcp_rtt_dst_check(c, conn, &tinfo);
 
 	if (!tcp_update_seqack_wnd(c, conn, !!flags, &tinfo, now) && !flags)
 		return 0;
@@ -1343,7 +1847,7 @@ int tcp_prepare_flags(const struct ctx *c, struct tcp_tap_conn *conn,
 				mss -= sizeof(struct ipv6hdr);
 
 			if (c->low_wmem &&
-			    !(conn->flags & LOCAL) && !tcp_rtt_dst_low(conn))
+			    !(conn->flags & LOCAL) && !tcp_rtt_dst_low(c, conn))
 				mss = MIN(mss, PAGE_SIZE);
 			else if (mss > PAGE_SIZE)
 				mss = ROUND_DOWN(mss, PAGE_SIZE);
@@ -1352,9 +1856,15 @@ int tcp_prepare_flags(const struct ctx *c, struct tcp_tap_conn *conn,
 		conn->ws_to_tap = MIN(MAX_WS, tinfo.tcpi_snd_wscale);
 
 		*opts = TCP_SYN_OPTS(mss, conn->ws_to_tap);
-		*optlen = sizeof(*opts);
+		*optlen = TCP_SYN_OPTS_LEN;
+
+		if (conn->fastopen_cookie) {
+			tcp_fastopen_cookie(c, conn, opts->fo.cookie);
+			*optlen = sizeof(*opts);
+		}
 	} else {
 		flags |= ACK;
+		*optlen = tcp_ooo_sack(conn, (uint8_t *)opts);
 	}
 
 	th->doff = (sizeof(*th) + *optlen) / 4;
@@ -1405,6 +1915,61 @@ static int tcp_send_flag(const struct ctx *c, struct tcp_tap_conn *conn,
 	return ret == -EAGAIN ? 0 : ret;
 }
 
+/* Connections with ACKs deferred by tcp_ack_defer() */
+static struct tcp_tap_conn *tcp_ack_deferred[ACK_DEFER_MAX];
+static unsigned int tcp_ack_deferred_count;
+
+/**
+ * tcp_ack_defer() - Send ACK, if needed, once the current events are handled
+ * @c:		Execution context
+ * @conn:	Connection pointer
+ * @now:	Current timestamp
+ *
+ * Return: negative error code on fatal connection failure, 0 otherwise
+ *
+ * Pure ACKs and window updates for data from tap are sent by tcp_ack_flush()
+ * from tcp_defer_handler(), all in the same batch of frames, with up-to-date
+ * sequence and window. If we queue data for the same connection meanwhile,
+ * the ACK is carried by the data segment instead.
+ */
+static int tcp_ack_defer(const struct ctx *c, struct tcp_tap_conn *conn,
+			 const struct timespec *now)
+{
+	if (conn->flags & ACK_DEFERRED)
+		return 0;
+
+	if (tcp_ack_deferred_count >= ACK_DEFER_MAX)
+		return tcp_send_flag(c, conn, ACK_IF_NEEDED, now);
+
+	tcp_ack_deferred[tcp_ack_deferred_count++] = conn;
+	conn_flag(c, conn, ACK_DEFERRED, now);
+
+	return 0;
+}
+
+/**
+ * tcp_ack_flush() - Send ACKs deferred by tcp_ack_defer(), if still needed
+ * @c:		Execution context
+ * @now:	Current timestamp
+ */
+static void tcp_ack_flush(const struct ctx *c, const struct timespec *now)
+{
+	unsigned int i;
+
+	for (i = 0; i < tcp_ack_deferred_count; i++) {
+		struct tcp_tap_conn *conn = tcp_ack_deferred[i];
+
+		conn_flag(c, conn, ~ACK_DEFERRED, now);
+		if (conn->events == CLOSED)
+			continue;
+
+		if (tcp_send_flag(c, conn, ACK_IF_NEEDED, now))
+			tcp_rst(c, conn, now);
+	}
+
+	tcp_ack_deferred_count = 0;
+}
+
 /**
  * tcp_linger0_() - Set SO_LINGER with 0 timeout on socket
  * @f:		Flow header (only for debug logging)
@@ -1524,35 +2089,18 @@ static uint32_t tcp_init_seq(uint64_t hash, const struct timespec *now)
 	return ((uint32_t)(hash >> 32) ^ (uint32_t)hash) + ns;
 }
 
-/**
- * tcp_conn_pool_sock() - Get socket for new connection from pre-opened pool
- * @pool:	Pool of pre-opened sockets
- *
- * Return: socket number if available, negative code if pool is empty
- */
-int tcp_conn_pool_sock(int pool[])
-{
-	int s = -1, i;
-
-	for (i = 0; i < TCP_SOCK_POOL_SIZE; i++) {
-		SWAP(s, pool[i]);
-		if (s >= 0)
-			return s;
-	}
-	return -1;
-}
-
 /**
  * tcp_conn_new_sock() - Open and prepare new socket for connection
  * @af:		Address family
+ * @proto:	IPPROTO_TCP, or IPPROTO_MPTCP
  *
  * Return: socket number on success, negative code if socket creation failed
  */
-static int tcp_conn_new_sock(sa_family_t af)
+static int tcp_conn_new_sock(sa_family_t af, int proto)
 {
 	int s;
 
-	s = socket(af, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, IPPROTO_TCP);
+	s = socket(af, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, proto);
 
 	if (s > FD_REF_MAX) {
 		close(s);
@@ -1575,16 +2123,17 @@ static int tcp_conn_new_sock(sa_family_t af)
  */
 int tcp_conn_sock(sa_family_t af)
 {
-	int *pool = af == AF_INET6 ? init_sock_pool6 : init_sock_pool4;
+	struct sock_pool *p = af == AF_INET6 ? &init_sock_pool6
+					     : &init_sock_pool4;
 	int s;
 
-	if ((s = tcp_conn_pool_sock(pool)) >= 0)
+	if ((s = sock_pool_get(p)) >= 0)
 		return s;
 
 	/* If the pool is empty we just open a new one without refilling the
 	 * pool to keep latency down.
 	 */
-	if ((s = tcp_conn_new_sock(af)) >= 0)
+	if ((s = tcp_conn_new_sock(af, IPPROTO_TCP)) >= 0)
 		return s;
 
 	err("TCP: Unable to open socket for new connection: %s",
@@ -1592,6 +2141,22 @@ int tcp_conn_sock(sa_family_t af)
 	return -1;
 }
 
+/**
+ * tcp_conn_sock_host() - Obtain a socket for a connection from tap to host
+ * @c:		Execution context
+ * @af:		Address family (AF_INET or AF_INET6)
+ *
+ * Return: socket fd on success, -errno on failure
+ */
+static int tcp_conn_sock_host(const struct ctx *c, sa_family_t af)
+{
+	/* Pools are shared with spliced connections, which stay on TCP */
+	if (c->tcp.mptcp)
+		return tcp_conn_new_sock(af, IPPROTO_MPTCP);
+
+	return tcp_conn_sock(af);
+}
+
 /**
  * tcp_conn_tap_mss() - Get MSS value advertised by tap/guest
  * @conn:	Connection pointer
@@ -1672,6 +2237,77 @@ static void tcp_bind_outbound(const struct ctx *c,
 	}
 }
 
+/**
+ * tcp_fastopen_connect() - Connect socket sending data from SYN, if allowed
+ * @c:		Execution context
+ * @conn:	Connection pointer
+ * @s:		Socket, not connected yet
+ * @sa:		Target address
+ * @opts:	Pointer to start of options of SYN segment from tap
+ * @optlen:	Bytes in options: caller MUST ensure available length
+ * @data:	Data from SYN segment
+ *
+ * If the guest sends a valid cookie (RFC 7413) with data, pass the data to the
+ * kernel with MSG_FASTOPEN, so that it can use TCP Fast Open on its own and
+ * send it with the SYN, and acknowledge it to the guest in the SYN-ACK. If the
+ * guest requests a cookie, or sends an invalid one, send one in the SYN-ACK.
+ *
+ * Return: -EINPROGRESS, as connect(), on success, -EOPNOTSUPP if TCP Fast Open
+ *	   can't be used and the caller should use connect() instead, another
+ *	   negative error code on failure
+ */
+static int tcp_fastopen_connect(const struct ctx *c, struct tcp_tap_conn *conn,
+				int s, const union sockaddr_inany *sa,
+				const char *opts, size_t optlen,
+				struct iov_tail *data)
+{
+	uint8_t cookie[TCP_FASTOPEN_COOKIE_SIZE], folen = 0;
+	struct msghdr mh = {
+		.msg_name = (void *)&sa->sa,
+		.msg_namelen = socklen_inany(sa),
+		.msg_iov = tcp_iov,
+	};
+	const char *fo = NULL;
+	ssize_t cnt, n;
+
+	tcp_opt_get(opts, optlen, OPT_FASTOPEN, &folen, &fo);
+	if (!fo)
+		return -EOPNOTSUPP;
+
+	tcp_fastopen_cookie(c, conn, cookie);
+	if (folen != sizeof(cookie) || memcmp(fo, cookie, sizeof(cookie))) {
+		/* Cookie request, or invalid cookie: ignore any data */
+		conn->fastopen_cookie = true;
+		return -EOPNOTSUPP;
+	}
+
+	if (!iov_tail_size(data))
+		return -EOPNOTSUPP;
+
+	cnt = iov_tail_clone(tcp_iov, UIO_MAXIOV, data);
+	if (cnt < 0)
+		return -EOPNOTSUPP;
+	mh.msg_iovlen = cnt;
+
+	n = sendmsg(s, &mh, MSG_FASTOPEN | MSG_NOSIGNAL);
+	if (n < 0) {
+		/* Not enabled for clients, see tcp_fastopen in ip-sysctl */
+		if (errno == EOPNOTSUPP)
+			return -EOPNOTSUPP;
+
+		return -errno;
+	}
+
+	flow_trace(conn, "TCP Fast Open: %zi bytes from SYN", n);
+
+	/* The kernel either sends the data with the SYN, or after it */
+	conn->seq_from_tap += n;
+	conn->seq_ack_to_tap = conn->seq_from_tap;
+	conn->seq_wnd_edge = conn->seq_from_tap;
+
+	return -EINPROGRESS;
+}
+
 /**
  * tcp_conn_from_tap() - Handle connection request (SYN segment) from tap
  * @c:		Execution context
@@ -1681,6 +2317,7 @@ static void tcp_bind_outbound(const struct ctx *c,
  * @th:		TCP header from tap: caller MUST ensure it's there
  * @opts:	Pointer to start of options
  * @optlen:	Bytes in options: caller MUST ensure available length
+ * @data:	Data carried by SYN segment, if any
  * @now:	Current timestamp
  *
  * #syscalls:vu getsockname
@@ -1688,7 +2325,8 @@ static void tcp_bind_outbound(const struct ctx *c,
 static void tcp_conn_from_tap(const struct ctx *c, sa_family_t af,
 			      const void *saddr, const void *daddr,
 			      const struct tcphdr *th, const char *opts,
-			      size_t optlen, const struct timespec *now)
+			      size_t optlen, struct iov_tail *data,
+			      const struct timespec *now)
 {
 	in_port_t srcport = ntohs(th->source);
 	in_port_t dstport = ntohs(th->dest);
@@ -1697,7 +2335,7 @@ static void tcp_conn_from_tap(const struct ctx *c, sa_family_t af,
 	union sockaddr_inany sa;
 	struct flowside *tgt;
 	union flow *flow;
-	int s = -1, mss;
+	int s = -1, mss, ret;
 	uint64_t hash;
 
 	if (!(flow = flow_alloc()))
@@ -1730,7 +2368,7 @@ static void tcp_conn_from_tap(const struct ctx *c, sa_family_t af,
 		goto cancel;
 	}
 
-	if ((s = tcp_conn_sock(af)) < 0)
+	if ((s = tcp_conn_sock_host(c, af)) < 0)
 		goto cancel;
 
 	pif_sockaddr(c, &sa, PIF_HOST, &tgt->eaddr, tgt->eport);
@@ -1751,13 +2389,12 @@ static void tcp_conn_from_tap(const struct ctx *c, sa_family_t af,
 	} else {
 		/* Not a local, bound destination, inconclusive test */
 		close(s);
-		if ((s = tcp_conn_sock(af)) < 0)
+		if ((s = tcp_conn_sock_host(c, af)) < 0)
 			goto cancel;
 	}
 
 	conn->sock = s;
-	conn->timer = -1;
-	flow_epollid_set(&conn->f, EPOLLFD_ID_DEFAULT);
+	flow_epollid_assign(c, &conn->f);
 	if (flow_epoll_set(&conn->f, EPOLL_CTL_ADD, 0, s, TGTSIDE) < 0) {
 		flow_perror_ratelimit(flow, now, "Can't register with epoll");
 		goto cancel;
@@ -1772,6 +2409,7 @@ static void tcp_conn_from_tap(const struct ctx *c, sa_family_t af,
 	MSS_SET(conn, mss);
 
 	tcp_get_tap_ws(conn, opts, optlen);
+	conn->sack = !tcp_opt_get(opts, optlen, OPT_SACKP, NULL, NULL);
 
 	/* RFC 7323, 2.2: first value is not scaled. Also, don't clamp yet, to
 	 * avoid getting a zero scale just because we set a small window now.
@@ -1782,6 +2420,7 @@ static void tcp_conn_from_tap(const struct ctx *c, sa_family_t af,
 	conn->seq_init_from_tap = ntohl(th->seq);
 	conn->seq_from_tap = conn->seq_init_from_tap + 1;
 	conn->seq_ack_to_tap = conn->seq_from_tap;
+	conn->seq_wnd_edge = conn->seq_from_tap;
 
 	hash = flow_hash_insert(c, TAP_SIDX(conn));
 	conn->seq_to_tap = tcp_init_seq(hash, now);
@@ -1789,20 +2428,33 @@ static void tcp_conn_from_tap(const struct ctx *c, sa_family_t af,
 
 	tcp_bind_outbound(c, conn, s, now);
 
-	if (connect(s, &sa.sa, socklen_inany(&sa))) {
-		if (errno != EINPROGRESS) {
+	ret = tcp_fastopen_connect(c, conn, s, &sa, opts, optlen, data);
+	if (ret == -EOPNOTSUPP)
+		ret = connect(s, &sa.sa, socklen_inany(&sa)) ? -errno : 0;
+
+	if (ret) {
+		struct tcp_syn_ts *syn;
+
+		if (ret != -EINPROGRESS) {
 			tcp_rst(c, conn, now);
 			goto cancel;
 		}
 
+		syn = &tcp_syn_ts[FLOW_IDX(conn) % TCP_SYN_TS_SIZE];
+		syn->flowi = FLOW_IDX(conn);
+		syn->ts = *now;
+
 		tcp_get_sndbuf(conn);
 	} else {
 		tcp_get_sndbuf(conn);
 
-		if (tcp_send_flag(c, conn, SYN | ACK, now))
+		if (tcp_send_flag(c, conn, SYN | ACK, now)) {
+			tcp_sndbuf_set(conn, 0);
 			goto cancel;
+		}
 
 		conn_event(c, conn, TAP_SYN_ACK_SENT, now);
+		stats_hist(PESTO_STATS_HIST_FLOW_SETUP, now, now);
 	}
 
 	tcp_epoll_ctl(conn);
@@ -1871,7 +2523,9 @@ static int tcp_data_from_sock(const struct ctx *c, struct tcp_tap_conn *conn,
 			      const struct timespec *now)
 {
 	uint32_t wnd_scaled = conn->wnd_from_tap << conn->ws_from_tap;
-	uint32_t already_sent;
+	uint32_t already_sent, fill, seq = conn->seq_to_tap;
+	int64_t avail;
+	int ret;
 
 	if (SEQ_LT(conn->seq_to_tap, conn->seq_ack_from_tap)) {
 		/* RFC 761, section 2.1. */
@@ -1894,10 +2548,138 @@ static int tcp_data_from_sock(const struct ctx *c, struct tcp_tap_conn *conn,
 		return 0;
 	}
 
+	/* Over --tap-rate allowance: wait until we can send a full segment.
+	 * If nothing is in flight, no ACK will wake us up, see tcp_timer_ctl()
+	 */
+	avail = tap_shape_avail(c, TAP_SHAPE_TO_TAP, now);
+	if (avail < MSS_GET(conn)) {
+		conn_flag(c, conn, STALLED, now);
+		if (!(conn->flags & (ACK_TO_TAP_DUE | ACK_FROM_TAP_DUE)))
+			tcp_timer_ctl(c, conn, now);
+		return 0;
+	}
+	fill = MIN(wnd_scaled - already_sent, avail);
+
+	PROBE(tcp_data_from_sock_start, FLOW_IDX(conn), fill);
+
+	if (c->mode == MODE_VU) {
+		struct timespec start;
+		bool timed = !clock_gettime(CLOCK_MONOTONIC, &start);
+
+		/* Frames go straight to the guest: each call is a batch */
+		ret = tcp_vu_data_from_sock(c, conn, already_sent, fill, now);
+		if (timed)
+			stats_hist_since(PESTO_STATS_HIST_SOCK_TAP, &start);
+	} else {
+		ret = tcp_buf_data_from_sock(c, conn, already_sent, fill, now);
+	}
+
+	if (ret >= 0 && SEQ_GT(conn->seq_to_tap, seq))
+		tap_shape_take(c, TAP_SHAPE_TO_TAP, conn->seq_to_tap - seq);
+
+	PROBE(tcp_data_from_sock_done, FLOW_IDX(conn), ret);
+
+	return ret;
+}
+
+/**
+ * tcp_sack_hole() - Find end of first hole in data acknowledged by guest
+ * @conn:	Connection pointer
+ * @ack_seq:	Acknowledged sequence from segment
+ * @th:		TCP header of segment
+ * @data:	Segment, starting from TCP header
+ *
+ * Return: left edge of lowest SACK block past @ack_seq, or current sequence to
+ *	   tap if the segment has no valid SACK blocks
+ */
+static uint32_t tcp_sack_hole(const struct tcp_tap_conn *conn,
+			      uint32_t ack_seq, const struct tcphdr *th,
+			      struct iov_tail data)
+{
+	size_t optlen = MIN(th->doff * 4UL - sizeof(*th), OPTLEN_MAX);
+	uint32_t end = conn->seq_to_tap;
+	const char *opts, *sack = NULL;
+	char optsc[OPTLEN_MAX];
+	uint8_t sacklen = 0;
+	unsigned i;
+
+	if (!optlen || !iov_drop_header(&data, sizeof(*th)))
+		return end;
+
+	opts = iov_peek_header_(&data, optsc, optlen, 1);
+	tcp_opt_get(opts, optlen, OPT_SACK, &sacklen, &sack);
+	if (!sack)
+		return end;
+
+	for (i = 0; i + 2 * sizeof(uint32_t) <= sacklen;
+	     i += 2 * sizeof(uint32_t)) {
+		uint32_t left, right;
+
+		memcpy(&left, sack + i, sizeof(left));
+		memcpy(&right, sack + i + sizeof(left), sizeof(right));
+		left = ntohl(left);
+		right = ntohl(right);
+
+		/* Skip D-SACK (RFC 2883) and bogus blocks */
+		if (SEQ_LE(left, ack_seq) || SEQ_GE(left, right) ||
+		    SEQ_GT(right, conn->seq_to_tap))
+			continue;
+
+		if (SEQ_LT(left, end))
+			end = left;
+	}
+
+	return end;
+}
+
+/**
+ * tcp_retransmit_hole() - Retransmit data up to the first block SACKed by guest
+ * @c:		Execution context
+ * @conn:	Connection pointer
+ * @end:	Left edge of first SACK block, from tcp_sack_hole()
+ * @now:	Current timestamp
+ *
+ * Return: negative on connection reset, 0 otherwise
+ *
+ * #syscalls recvmsg
+ */
+static int tcp_retransmit_hole(const struct ctx *c, struct tcp_tap_conn *conn,
+			       uint32_t end, const struct timespec *now)
+{
+	uint32_t wnd_scaled = conn->wnd_from_tap << conn->ws_from_tap;
+	uint32_t fillsize = MIN(end - conn->seq_ack_from_tap, wnd_scaled);
+	uint32_t seq_to_tap = conn->seq_to_tap;
+	int ret;
+
+	if (!fillsize)
+		return 0;
+
+	conn->seq_to_tap = conn->seq_ack_from_tap;
+	if (tcp_set_peek_offset(conn, 0, now)) {
+		tcp_rst(c, conn, now);
+		return -1;
+	}
+
 	if (c->mode == MODE_VU)
-		return tcp_vu_data_from_sock(c, conn, already_sent, now);
+		ret = tcp_vu_data_from_sock(c, conn, 0, fillsize, now);
+	else
+		ret = tcp_buf_data_from_sock(c, conn, 0, fillsize, now);
+
+	if (ret < 0)
+		return ret;
+
+	/* Data past the hole is still in flight: don't send it again */
+	if (SEQ_GT(seq_to_tap, conn->seq_to_tap)) {
+		conn->seq_to_tap = seq_to_tap;
+		if (tcp_set_peek_offset(conn,
+					seq_to_tap - conn->seq_ack_from_tap,
+					now)) {
+			tcp_rst(c, conn, now);
+			return -1;
+		}
+	}
 
-	return tcp_buf_data_from_sock(c, conn, already_sent, now);
+	return 0;
 }
 
 /**
@@ -1934,9 +2716,11 @@ static int tcp_data_from_tap(const struct ctx *c, struct tcp_tap_conn *conn,
 			     const struct timespec *now)
 {
 	int i, iov_i, ack = 0, fin = 0, retr = 0, keep = -1, partial_send = 0;
+	bool stored = false, dropped = false, drained = false;
 	uint16_t max_ack_seq_wnd = conn->wnd_from_tap;
 	uint32_t max_ack_seq = conn->seq_ack_from_tap;
 	uint32_t seq_from_tap = conn->seq_from_tap;
+	uint32_t sack_hole = conn->seq_to_tap;
 	struct msghdr mh = { .msg_iov = tcp_iov };
 	size_t len;
 	ssize_t n;
@@ -1948,15 +2732,17 @@ static int tcp_data_from_tap(const struct ctx *c, struct tcp_tap_conn *conn,
 
 	for (i = idx, iov_i = 0; i < (int)p->count; i++) {
 		uint32_t seq, seq_offset, ack_seq;
+		struct iov_tail data, segment;
 		struct tcphdr th_storage;
 		const struct tcphdr *th;
-		struct iov_tail data;
 		size_t off, size;
 		int count;
 
 		if (!packet_get(p, i, &data))
 			return -1;
 
+		segment = data;
+
 		th = IOV_PEEK_HEADER(&data, th_storage);
 		if (!th)
 			return -1;
@@ -2011,6 +2797,14 @@ static int tcp_data_from_tap(const struct ctx *c, struct tcp_tap_conn *conn,
 				       ack_seq == max_ack_seq &&
 				       ntohs(th->window) == max_ack_seq_wnd;
 
+				/* Duplicate ACKs might carry SACK blocks */
+				if (!len && !th->fin) {
+					sack_hole = tcp_sack_hole(conn, ack_seq,
+								  th, segment);
+				} else {
+					sack_hole = conn->seq_to_tap;
+				}
+
 				/* See tcp_tap_window_update() for details. On
 				 * top of that, we also need to check here if a
 				 * zero-window update is contained in a batch of
@@ -2087,16 +2881,60 @@ static int tcp_data_from_tap(const struct ctx *c, struct tcp_tap_conn *conn,
 			   "fast re-transmit, ACK: %u, previous sequence: %u",
 			   conn->seq_ack_from_tap, conn->seq_to_tap);
 
-		if (tcp_rewind_seq(c, conn, now))
-			return -1;
+		if (SEQ_GT(sack_hole, conn->seq_ack_from_tap) &&
+		    SEQ_LT(sack_hole, conn->seq_to_tap)) {
+			/* Guest told us what it has: fill the first hole */
+			flow_trace(conn, "SACK hole: %u-%u",
+				   conn->seq_ack_from_tap, sack_hole);
 
-		tcp_data_from_sock(c, conn, now);
+			if (tcp_retransmit_hole(c, conn, sack_hole, now))
+				return -1;
+		} else {
+			if (tcp_rewind_seq(c, conn, now))
+				return -1;
+
+			tcp_data_from_sock(c, conn, now);
+		}
+	}
+
+	/* Hold segments past the hole across batches, then use any held data
+	 * that's now in sequence
+	 */
+	for (i = keep; keep != -1 && i < (int)p->count; i++) {
+		int rc = tcp_ooo_add(conn, p, i, seq_from_tap);
+
+		stored |= rc > 0;
+		dropped |= rc < 0;
+	}
+
+	while (tcp_ooo_used && iov_i < UIO_MAXIOV &&
+	       (i = tcp_ooo_find(conn, seq_from_tap)) >= 0) {
+		const struct tcp_ooo_seg *o = &tcp_ooo[i];
+		uint32_t off = seq_from_tap - o->seq;
+
+		tcp_iov[iov_i].iov_base = tcp_ooo_data[i] + off;
+		tcp_iov[iov_i++].iov_len = o->len - off;
+		seq_from_tap = o->seq + o->len;
+		drained = true;
+	}
+
+	if (keep != -1 && !dropped) {
+		uint32_t left, right;
+
+		if (!tcp_ooo_block(conn, seq_from_tap, &left, &right))
+			keep = -1;
 	}
 
 	if (!iov_i)
 		goto out;
 
 	mh.msg_iovlen = iov_i;
+
+	/* No MSG_ZEROCOPY here: tap and vhost-user buffers are reused as soon
+	 * as we return, we can't hold them until completions arrive on the
+	 * error queue, and completions for closed sockets would be lost while
+	 * the kernel might still refer to those buffers.
+	 */
 eintr:
 	n = sendmsg(conn->sock, &mh, MSG_DONTWAIT | MSG_NOSIGNAL);
 	if (n < 0) {
@@ -2141,14 +2979,19 @@ eintr:
 	 }
 
 	conn->seq_from_tap += n;
+	tap_shape_take(c, TAP_SHAPE_FROM_TAP, n);
+	if (tcp_ooo_used)
+		tcp_ooo_drop(conn, false);
 
 out:
 	if (keep != -1 || partial_send) {
 		/* We use an 8-bit approximation here: the associated risk is
 		 * that we skip a duplicate ACK on 8-bit sequence number
 		 * collision. Fast retransmit is a SHOULD in RFC 5681, 3.2.
+		 * If we just held new data, though, SACK blocks changed.
 		 */
-		if (conn->seq_dup_ack_approx != (conn->seq_from_tap & 0xff)) {
+		if (conn->seq_dup_ack_approx != (conn->seq_from_tap & 0xff) ||
+		    stored) {
 			conn->seq_dup_ack_approx = conn->seq_from_tap & 0xff;
 			if (tcp_send_flag(c, conn, ACK | DUP_ACK, now))
 				return -1;
@@ -2164,8 +3007,12 @@ out:
 		conn->seq_from_tap++;
 
 		conn_event(c, conn, TAP_FIN_RCVD, now);
+	} else if (drained) {
+		/* RFC 5681, 4.2: acknowledge right away if we filled a hole */
+		if (tcp_send_flag(c, conn, ACK, now))
+			return -1;
 	} else {
-		if (tcp_send_flag(c, conn, ACK_IF_NEEDED, now))
+		if (tcp_ack_defer(c, conn, now))
 			return -1;
 	}
 
@@ -2189,6 +3036,7 @@ static void tcp_conn_from_sock_finish(const struct ctx *c,
 {
 	tcp_tap_window_update(c, conn, ntohs(th->window), now);
 	tcp_get_tap_ws(conn, opts, optlen);
+	conn->sack = !tcp_opt_get(opts, optlen, OPT_SACKP, NULL, NULL);
 
 	/* First value is not scaled */
 	if (!(conn->wnd_from_tap >>= conn->ws_from_tap))
@@ -2199,6 +3047,7 @@ static void tcp_conn_from_sock_finish(const struct ctx *c,
 	conn->seq_init_from_tap = ntohl(th->seq) + 1;
 	conn->seq_from_tap = conn->seq_init_from_tap;
 	conn->seq_ack_to_tap = conn->seq_from_tap;
+	conn->seq_wnd_edge = conn->seq_from_tap;
 
 	conn_event(c, conn, ESTABLISHED, now);
 	if (tcp_set_peek_offset(conn, 0, now)) {
@@ -2340,9 +3189,10 @@ int tcp_tap_handler(const struct ctx *c, uint8_t pif, sa_family_t af,
 
 	/* New connection from tap */
 	if (!flow) {
-		if (opts && th->syn && !th->ack)
+		if (opts && th->syn && !th->ack &&
+		    flow_admit(c, af, saddr, now))
 			tcp_conn_from_tap(c, af, saddr, daddr, th,
-					  opts, optlen, now);
+					  opts, optlen, &data, now);
 		else
 			tcp_rst_no_conn(c, af, saddr, daddr, flow_lbl, th, l4len);
 		return 1;
@@ -2462,7 +3312,9 @@ int tcp_tap_handler(const struct ctx *c, uint8_t pif, sa_family_t af,
 	}
 
 	/* Established connections accepting data from tap */
+	PROBE(tcp_data_from_tap_start, FLOW_IDX(conn), p->count - idx);
 	count = tcp_data_from_tap(c, conn, p, idx, now);
+	PROBE(tcp_data_from_tap_done, FLOW_IDX(conn), count);
 	if (count == -1)
 		goto reset;
 
@@ -2525,9 +3377,16 @@ reset:
 static void tcp_connect_finish(const struct ctx *c, struct tcp_tap_conn *conn,
 			       const struct timespec *now)
 {
+	struct tcp_syn_ts *syn = &tcp_syn_ts[FLOW_IDX(conn) % TCP_SYN_TS_SIZE];
 	socklen_t sl;
 	int so;
 
+	if (syn->flowi == FLOW_IDX(conn) &&
+	    (syn->ts.tv_sec || syn->ts.tv_nsec)) {
+		stats_hist(PESTO_STATS_HIST_FLOW_SETUP, &syn->ts, now);
+		syn->ts = (struct timespec){ 0 };
+	}
+
 	sl = sizeof(so);
 	if (getsockopt(conn->sock, SOL_SOCKET, SO_ERROR, &so, &sl) || so) {
 		tcp_rst(c, conn, now);
@@ -2558,10 +3417,9 @@ static void tcp_tap_conn_from_sock(const struct ctx *c, union flow *flow,
 	uint64_t hash;
 
 	conn->sock = s;
-	conn->timer = -1;
 	conn->ws_to_tap = conn->ws_from_tap = 0;
 
-	flow_epollid_set(&conn->f, EPOLLFD_ID_DEFAULT);
+	flow_epollid_assign(c, &conn->f);
 	if (flow_epoll_set(&conn->f, EPOLL_CTL_ADD, 0, s, INISIDE) < 0) {
 		flow_perror_ratelimit(flow, now, "Can't register with epoll");
 		conn_flag(c, conn, CLOSING, now);
@@ -2592,13 +3450,15 @@ static void tcp_tap_conn_from_sock(const struct ctx *c, union flow *flow,
 }
 
 /**
- * tcp_listen_handler() - Handle new connection request from listening socket
+ * tcp_listen_accept() - Accept and set up one connection from listening socket
  * @c:		Execution context
  * @ref:	epoll reference of listening socket
  * @now:	Current timestamp
+ *
+ * Return: 0 if a connection was dequeued, -1 if none, or no flow is available
  */
-void tcp_listen_handler(const struct ctx *c, union epoll_ref ref,
-			const struct timespec *now)
+static int tcp_listen_accept(const struct ctx *c, union epoll_ref ref,
+			     const struct timespec *now)
 {
 	union sockaddr_inany sa;
 	socklen_t sl = sizeof(sa);
@@ -2606,14 +3466,14 @@ void tcp_listen_handler(const struct ctx *c, union epoll_ref ref,
 	union flow *flow;
 	int s;
 
-	assert(!c->no_tcp);
-
 	if (!(flow = flow_alloc()))
-		return;
+		return -1;
 
 	s = accept4(ref.fd, &sa.sa, &sl, SOCK_NONBLOCK);
-	if (s < 0)
-		goto cancel;
+	if (s < 0) {
+		flow_alloc_cancel(flow);
+		return -1;
+	}
 
 	tcp_sock_set_nodelay(s);
 
@@ -2639,6 +3499,9 @@ void tcp_listen_handler(const struct ctx *c, union epoll_ref ref,
 	if (!flow_target(c, flow, ref.listen.rule, IPPROTO_TCP))
 		goto rst;
 
+	/* Most options are inherited from the listening socket, not these */
+	fwd_tune_sock(flow_tune(&flow->f), s, IPPROTO_TCP);
+
 	switch (flow->f.pif[TGTSIDE]) {
 	case PIF_SPLICE:
 	case PIF_HOST:
@@ -2658,44 +3521,52 @@ void tcp_listen_handler(const struct ctx *c, union epoll_ref ref,
 		goto rst;
 	}
 
-	return;
+	return 0;
 
 rst:
 	tcp_linger0(flow, s);
 	close(s);
-cancel:
 	flow_alloc_cancel(flow);
+	return 0;
 }
 
 /**
- * tcp_timer_handler() - timerfd events: close, send ACK, retransmit, or reset
+ * tcp_listen_handler() - Handle new connection requests from listening socket
  * @c:		Execution context
- * @ref:	epoll reference of timer (not connection)
+ * @ref:	epoll reference of listening socket
  * @now:	Current timestamp
- *
- * #syscalls timerfd_gettime|timerfd_gettime64
- * #syscalls arm:timerfd_gettime64 i686:timerfd_gettime64
- * #syscalls arm:timerfd_settime64 i686:timerfd_settime64
  */
-void tcp_timer_handler(const struct ctx *c, union epoll_ref ref,
-		       const struct timespec *now)
+void tcp_listen_handler(const struct ctx *c, union epoll_ref ref,
+			const struct timespec *now)
 {
-	struct itimerspec check_armed = { { 0 }, { 0 } };
-	struct tcp_tap_conn *conn = &FLOW(ref.flow)->tcp;
+	int i;
 
 	assert(!c->no_tcp);
-	assert(conn->f.type == FLOW_TCP);
 
-	/* We don't reset timers on ~ACK_FROM_TAP_DUE, ~ACK_TO_TAP_DUE. If the
-	 * timer is currently armed, this event came from a previous setting,
-	 * and we just set the timer to a new point in the future: discard it.
+	/* Drain the accept queue, instead of waiting for one wakeup for each
+	 * connection: the socket is level-triggered, so we'll get back to any
+	 * leftovers
 	 */
-	if (timerfd_gettime(conn->timer, &check_armed))
-		flow_perror_ratelimit(conn, now, "failed to read timer");
+	for (i = 0; i < ACCEPT_BATCH; i++) {
+		if (tcp_listen_accept(c, ref, now))
+			break;
+	}
+}
 
-	if (check_armed.it_value.tv_sec || check_armed.it_value.tv_nsec)
-		return;
+/**
+ * tcp_timer_expire() - Timer expired: close, send ACK, retransmit, or reset
+ * @c:		Execution context
+ * @conn:	Connection pointer
+ * @now:	Current timestamp
+ */
+static void tcp_timer_expire(const struct ctx *c, struct tcp_tap_conn *conn,
+			     const struct timespec *now)
+{
+	assert(conn->f.type == FLOW_TCP);
 
+	/* We don't cancel timers on ~ACK_FROM_TAP_DUE, ~ACK_TO_TAP_DUE: if no
+	 * flag is set, there's nothing to do.
+	 */
 	if (conn->flags & ACK_TO_TAP_DUE) {
 		if (tcp_send_flag(c, conn, ACK_IF_NEEDED, now)) {
 			tcp_rst(c, conn, now);
@@ -2737,9 +3608,40 @@ void tcp_timer_handler(const struct ctx *c, union epoll_ref ref,
 			tcp_data_from_sock(c, conn, now);
 			tcp_timer_ctl(c, conn, now);
 		}
+	} else if (c->tap_rate && (conn->flags & STALLED) &&
+		   (conn->events & ESTABLISHED)) {
+		/* Waiting for --tap-rate allowance, see tcp_data_from_sock() */
+		tcp_data_from_sock(c, conn, now);
 	}
 }
 
+/**
+ * tcp_timer_handler() - timerfd event: process expired timers from wheel
+ * @c:		Execution context
+ * @ref:	epoll reference of timerfd
+ * @now:	Current timestamp
+ */
+void tcp_timer_handler(const struct ctx *c, union epoll_ref ref,
+		       const struct timespec *now)
+{
+	uint64_t expirations;
+	int idx;
+
+	assert(!c->no_tcp);
+
+	if (read(ref.fd, &expirations, sizeof(expirations)) < 0 &&
+	    errno != EAGAIN)
+		err_perror("Failed to read TCP timer");
+
+	/* Expiry handlers set new timers: re-arm only once, below */
+	tcp_timer_armed = 0;
+	while ((idx = wheel_pop(wheel_tick(now))) >= 0)
+		tcp_timer_expire(c, &FLOW(idx)->tcp, now);
+
+	tcp_timer_armed = WHEEL_NONE;
+	tcp_timer_arm(wheel_next());
+}
+
 /**
  * tcp_sock_handler() - Handle new data from non-spliced socket
  * @c:		Execution context
@@ -2811,25 +3713,25 @@ void tcp_sock_handler(const struct ctx *c, union epoll_ref ref,
 
 /**
  * tcp_sock_refill_pool() - Refill one pool of pre-opened sockets
- * @pool:	Pool of sockets to refill
+ * @p:		Pool of sockets to refill
  * @af:		Address family to use
  *
  * Return: 0 on success, negative error code if there was at least one error
  */
-int tcp_sock_refill_pool(int pool[], sa_family_t af)
+int tcp_sock_refill_pool(struct sock_pool *p, sa_family_t af)
 {
-	int i;
+	unsigned i;
 
-	for (i = 0; i < TCP_SOCK_POOL_SIZE; i++) {
+	for (i = 0; i < p->size; i++) {
 		int fd;
 
-		if (pool[i] >= 0)
+		if (p->fd[i] >= 0)
 			continue;
 
-		if ((fd = tcp_conn_new_sock(af)) < 0)
+		if ((fd = tcp_conn_new_sock(af, IPPROTO_TCP)) < 0)
 			return fd;
 
-		pool[i] = fd;
+		p->fd[i] = fd;
 	}
 
 	return 0;
@@ -2838,17 +3740,26 @@ int tcp_sock_refill_pool(int pool[], sa_family_t af)
 /**
  * tcp_sock_refill_init() - Refill pools of pre-opened sockets in init ns
  * @c:		Execution context
+ * @timer:	Called from timer: resize pools, refill even if not low
  */
-static void tcp_sock_refill_init(const struct ctx *c)
+static void tcp_sock_refill_init(const struct ctx *c, bool timer)
 {
+	if (timer) {
+		sock_pool_resize(&init_sock_pool4);
+		sock_pool_resize(&init_sock_pool6);
+	} else if (!(c->ifi4 && sock_pool_low(&init_sock_pool4)) &&
+		   !(c->ifi6 && sock_pool_low(&init_sock_pool6))) {
+		return;
+	}
+
 	if (c->ifi4) {
-		int rc = tcp_sock_refill_pool(init_sock_pool4, AF_INET);
+		int rc = tcp_sock_refill_pool(&init_sock_pool4, AF_INET);
 		if (rc < 0)
 			warn("TCP: Error refilling IPv4 host socket pool: %s",
 			     strerror_(-rc));
 	}
 	if (c->ifi6) {
-		int rc = tcp_sock_refill_pool(init_sock_pool6, AF_INET6);
+		int rc = tcp_sock_refill_pool(&init_sock_pool6, AF_INET6);
 		if (rc < 0)
 			warn("TCP: Error refilling IPv6 host socket pool: %s",
 			     strerror_(-rc));
@@ -2858,15 +3769,16 @@ static void tcp_sock_refill_init(const struct ctx *c)
 /**
  * tcp_probe_peek_offset_cap() - Check if SO_PEEK_OFF is supported by kernel
  * @af:		Address family, IPv4 or IPv6
+ * @proto:	IPPROTO_TCP, or IPPROTO_MPTCP
  *
  * Return: true if supported, false otherwise
  */
-static bool tcp_probe_peek_offset_cap(sa_family_t af)
+static bool tcp_probe_peek_offset_cap(sa_family_t af, int proto)
 {
 	bool ret = false;
 	int s, optv = 0;
 
-	s = socket(af, SOCK_STREAM | SOCK_CLOEXEC, IPPROTO_TCP);
+	s = socket(af, SOCK_STREAM | SOCK_CLOEXEC, proto);
 	if (s < 0) {
 		warn_perror("Temporary TCP socket creation failed");
 	} else {
@@ -2878,6 +3790,35 @@ static bool tcp_probe_peek_offset_cap(sa_family_t af)
 	return ret;
 }
 
+/**
+ * tcp_probe_mptcp() - Check if we can open MPTCP sockets
+ * @c:		Execution context
+ *
+ * Return: true if we can, for all enabled address families, false otherwise
+ */
+static bool tcp_probe_mptcp(const struct ctx *c)
+{
+	sa_family_t af[] = { AF_INET, AF_INET6 };
+	bool en[] = { !!c->ifi4, !!c->ifi6 };
+	unsigned i;
+
+	for (i = 0; i < ARRAY_SIZE(af); i++) {
+		int s;
+
+		if (!en[i])
+			continue;
+
+		s = socket(af[i], SOCK_STREAM | SOCK_CLOEXEC, IPPROTO_MPTCP);
+		if (s < 0) {
+			debug_perror("Can't open MPTCP socket");
+			return false;
+		}
+		close(s);
+	}
+
+	return true;
+}
+
 /**
  * tcp_probe_tcp_info() - Check what data TCP_INFO reports
  *
@@ -2906,6 +3847,121 @@ static socklen_t tcp_probe_tcp_info(void)
 	return sl;
 }
 
+#define TCP_PROBE_CACHE_MAGIC	"passt-tcp-probe-1"
+#define TCP_PROBE_CACHE_BOOT_ID	"/proc/sys/kernel/random/boot_id"
+#define TCP_PROBE_CACHE_MAX	512
+
+/**
+ * tcp_probe_cache_key() - Build key identifying running kernel and our build
+ * @key:	Buffer for key
+ * @size:	Size of @key
+ *
+ * Probe results only depend on the kernel, so the boot identifier is enough,
+ * but add the kernel release to the key for the benefit of humans. The size
+ * of struct tcp_info_linux tells us if the binary changed in a relevant way.
+ *
+ * Return: 0 on success, -1 if we can't identify the running kernel
+ */
+static int tcp_probe_cache_key(char *key, size_t size)
+{
+	char boot_id[64];
+	struct utsname u;
+	int n;
+
+	if (uname(&u) ||
+	    read_file(TCP_PROBE_CACHE_BOOT_ID, boot_id, sizeof(boot_id)) <= 0)
+		return -1;
+
+	boot_id[strcspn(boot_id, "\n")] = '\0';
+
+	n = snprintf(key, size, "%s %s %s %zu", TCP_PROBE_CACHE_MAGIC, boot_id,
+		     u.release, sizeof(struct tcp_info_linux));
+	if (n < 0 || (size_t)n >= size)
+		return -1;
+
+	return 0;
+}
+
+/**
+ * tcp_probe_cache_load() - Load results of kernel feature probes from cache
+ * @c:		Execution context
+ * @key:	Key from tcp_probe_cache_key()
+ *
+ * Return: true if the cache is valid and was loaded, false otherwise
+ */
+static bool tcp_probe_cache_load(const struct ctx *c, const char *key)
+{
+	unsigned peek_off, info_size;
+	char buf[TCP_PROBE_CACHE_MAX];
+	size_t len = strlen(key);
+
+	if (read_file(c->probe_cache, buf, sizeof(buf)) <= 0)
+		return false;
+
+	if (strncmp(buf, key, len) || buf[len] != '\n') {
+		debug("Stale probe cache %s, probing again", c->probe_cache);
+		return false;
+	}
+
+	if (sscanf(buf + len + 1, "peek_offset_cap %u tcp_info_size %u",
+		   &peek_off, &info_size) != 2 || peek_off > 1 ||
+	    !info_size || info_size > sizeof(struct tcp_info_linux)) {
+		warn("Invalid probe cache %s, probing again", c->probe_cache);
+		return false;
+	}
+
+	peek_offset_cap = peek_off;
+	tcp_info_size = info_size;
+	debug("Using cached probe results from %s", c->probe_cache);
+
+	return true;
+}
+
+/**
+ * tcp_probe_cache_store() - Store results of kernel feature probes to cache
+ * @c:		Execution context
+ * @key:	Key from tcp_probe_cache_key()
+ *
+ * Write to a temporary file first, then rename it: other instances might be
+ * starting at the same time, and should only ever see complete files.
+ */
+static void tcp_probe_cache_store(const struct ctx *c, const char *key)
+{
+	char buf[TCP_PROBE_CACHE_MAX], tmp[PATH_MAX];
+	int fd, n;
+
+	/* Don't store results of probes failing for unrelated reasons */
+	if (!tcp_info_size)
+		return;
+
+	n = snprintf(buf, sizeof(buf), "%s\npeek_offset_cap %u\n"
+		     "tcp_info_size %u\n", key, (unsigned)peek_offset_cap,
+		     (unsigned)tcp_info_size);
+	if (n < 0 || (size_t)n >= sizeof(buf))
+		return;
+
+	n = snprintf(tmp, sizeof(tmp), "%s.%i", c->probe_cache, getpid());
+	if (n < 0 || (size_t)n >= sizeof(tmp))
+		return;
+
+	fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	if (fd < 0) {
+		warn_perror("Couldn't create probe cache %s", tmp);
+		return;
+	}
+	close(fd);
+
+	if (write_file(tmp, buf)) {
+		unlink(tmp);
+		return;
+	}
+
+	if (rename(tmp, c->probe_cache)) {
+		warn_perror("Couldn't update probe cache %s", c->probe_cache);
+		unlink(tmp);
+	}
+}
+
 /**
  * tcp_get_rto_params() - Get host kernel RTO parameters
  * @c:		Execution context
@@ -2931,6 +3987,60 @@ static void tcp_get_rto_params(struct ctx *c)
 	      c->tcp.rto_max);
 }
 
+/**
+ * tcp_get_wnd_params() - Clamp window from bandwidth-delay product, if enabled
+ * @c:		Execution context
+ */
+static void tcp_get_wnd_params(struct ctx *c)
+{
+	char buf[BUFSIZ], *p = buf;
+	unsigned long wmem_max;
+
+	if (!c->tcp.wnd_bdp_max)
+		return;
+
+	/* No point in going beyond the largest auto-tuned sending buffer, that
+	 * is, the third value from tcp_wmem
+	 */
+	if (read_file(TCP_WMEM, buf, sizeof(buf)) > 0 &&
+	    (wmem_max = strtoul(p, &p, 0)) &&
+	    (wmem_max = strtoul(p, &p, 0)) &&
+	    (wmem_max = strtoul(p, &p, 0)))
+		c->tcp.wnd_bdp_max = MIN(c->tcp.wnd_bdp_max, wmem_max);
+
+	c->tcp.wnd_bdp_max = MIN(c->tcp.wnd_bdp_max, MAX_WINDOW);
+
+	debug("Using window from bandwidth-delay product, up to %u bytes",
+	      c->tcp.wnd_bdp_max);
+}
+
+/**
+ * tcp_timer_init() - Create timerfd for timer wheel, add it to epoll
+ * @c:		Execution context
+ *
+ * #syscalls timerfd_create
+ */
+static void tcp_timer_init(const struct ctx *c)
+{
+	union epoll_ref ref = { .type = EPOLL_TYPE_TCP_TIMER };
+	int fd;
+
+	fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+	if (fd < 0)
+		die_perror("Failed to create TCP timer");
+	if (fd > FD_REF_MAX)
+		die("TCP timer file number %i too big, exiting", fd);
+
+	if (wheel_init(flow_max))
+		die_perror("Failed to allocate TCP timers");
+
+	ref.fd = fd;
+	if (epoll_add(c->epollfd, EPOLLIN, ref))
+		die_perror("Failed to add TCP timer to epoll");
+
+	tcp_timer_fd = fd;
+}
+
 /**
  * tcp_init() - Get initial sequence, hash secret, initialise per-socket data
  * @c:		Execution context
@@ -2939,25 +4049,59 @@ static void tcp_get_rto_params(struct ctx *c)
  */
 int tcp_init(struct ctx *c)
 {
+	char key[TCP_PROBE_CACHE_MAX] = { 0 };
+
 	assert(!c->no_tcp);
 
 	tcp_get_rto_params(c);
+	tcp_get_wnd_params(c);
 
-	tcp_sock_iov_init(c);
+	migrate_ext = mmap_lazy((size_t)flow_max * sizeof(*migrate_ext));
+	if (!migrate_ext)
+		die_perror("Failed to allocate TCP migration data");
 
-	memset(init_sock_pool4,		0xff,	sizeof(init_sock_pool4));
-	memset(init_sock_pool6,		0xff,	sizeof(init_sock_pool6));
+	tcp_sock_iov_init(c);
 
-	tcp_sock_refill_init(c);
+	/* Pools are filled from tcp_defer_handler(), once we're up: new
+	 * connections can always open sockets directly in the meantime
+	 */
+	sock_pool_init(&init_sock_pool4);
+	sock_pool_init(&init_sock_pool6);
 
 	if (c->mode == MODE_PASTA)
-		tcp_splice_init(c);
+		tcp_splice_init();
+
+	tcp_timer_init(c);
+
+	if (!*c->probe_cache ||
+	    tcp_probe_cache_key(key, sizeof(key)) ||
+	    !tcp_probe_cache_load(c, key)) {
+		peek_offset_cap =
+			(!c->ifi4 ||
+			 tcp_probe_peek_offset_cap(AF_INET, IPPROTO_TCP)) &&
+			(!c->ifi6 ||
+			 tcp_probe_peek_offset_cap(AF_INET6, IPPROTO_TCP));
+		tcp_info_size = tcp_probe_tcp_info();
+
+		if (*c->probe_cache && *key)
+			tcp_probe_cache_store(c, key);
+	}
 
-	peek_offset_cap = (!c->ifi4 || tcp_probe_peek_offset_cap(AF_INET)) &&
-			  (!c->ifi6 || tcp_probe_peek_offset_cap(AF_INET6));
-	debug("SO_PEEK_OFF%ssupported", peek_offset_cap ? " " : " not ");
+	if (c->tcp.mptcp && !tcp_probe_mptcp(c)) {
+		warn("MPTCP not available, using TCP for host connections");
+		c->tcp.mptcp = 0;
+	}
 
-	tcp_info_size = tcp_probe_tcp_info();
+	/* We use peek offsets on all sockets to host, or on none */
+	if (c->tcp.mptcp && peek_offset_cap) {
+		peek_offset_cap =
+			(!c->ifi4 ||
+			 tcp_probe_peek_offset_cap(AF_INET, IPPROTO_MPTCP)) &&
+			(!c->ifi6 ||
+			 tcp_probe_peek_offset_cap(AF_INET6, IPPROTO_MPTCP));
+	}
+
+	debug("SO_PEEK_OFF%ssupported", peek_offset_cap ? " " : " not ");
 
 #define dbg_tcpi(f_)	debug("TCP_INFO tcpi_%s field%s supported",	\
 			      STRINGIFY(f_), tcp_info_cap(f_) ? "" : " not")
@@ -3026,6 +4170,17 @@ static void tcp_inactivity(struct ctx *c, const struct timespec *now)
 	}
 }
 
+/**
+ * tcp_release() - Release pages of TCP buffers not holding any data
+ */
+void tcp_release(void)
+{
+	if (!tcp_ooo_used)
+		madvise_free(tcp_ooo_data, sizeof(tcp_ooo_data));
+
+	tcp_buf_release();
+}
+
 /**
  * tcp_defer_handler() - Handler for TCP deferred tasks
  * @c:		Execution context
@@ -3034,16 +4189,25 @@ static void tcp_inactivity(struct ctx *c, const struct timespec *now)
 /* cppcheck-suppress [constParameterPointer, unmatchedSuppression] */
 void tcp_defer_handler(struct ctx *c, const struct timespec *now)
 {
+	tcp_ack_flush(c, now);
 	tcp_payload_flush(c, now);
 
-	if (timespec_diff_ms(now, &c->tcp.timer_run) < TCP_TIMER_INTERVAL)
+	if (timespec_diff_ms(now, &c->tcp.timer_run) < TCP_TIMER_INTERVAL) {
+		/* Don't wait for the timer if a burst of connections used up
+		 * half of a pool, so that the next burst finds sockets ready
+		 */
+		tcp_sock_refill_init(c, false);
+		if (c->mode == MODE_PASTA)
+			tcp_splice_refill(c, false);
+
 		return;
+	}
 
 	c->tcp.timer_run = *now;
 
-	tcp_sock_refill_init(c);
+	tcp_sock_refill_init(c, true);
 	if (c->mode == MODE_PASTA)
-		tcp_splice_refill(c);
+		tcp_splice_refill(c, true);
 
 	tcp_keepalive(c, now);
 	tcp_inactivity(c, now);
@@ -3573,6 +4737,8 @@ int tcp_flow_migrate_source(int fd, struct tcp_tap_conn *conn)
 		return rc;
 	}
 
+	passt_stats.migrate.bytes += sizeof(t);
+
 	return 0;
 }
 
@@ -3591,6 +4757,7 @@ int tcp_flow_migrate_source_ext(const struct ctx *c,
 {
 	uint32_t peek_offset = conn->seq_to_tap - conn->seq_ack_from_tap;
 	struct tcp_tap_transfer_ext *t = &migrate_ext[FLOW_IDX(conn)];
+	struct iovec iov[3];
 	int s = conn->sock;
 	int rc;
 
@@ -3667,20 +4834,18 @@ int tcp_flow_migrate_source_ext(const struct ctx *c,
 	t->rcv_wnd	= htonl(t->rcv_wnd);
 	t->rcv_wup	= htonl(t->rcv_wup);
 
-	if (write_all_buf(fd, t, sizeof(*t))) {
-		flow_perror(conn, "Failed to write extended data");
-		return -EIO;
-	}
+	/* Extended data and queues with a single system call, in most cases */
+	iov[0] = (struct iovec){ t, sizeof(*t) };
+	iov[1] = (struct iovec){ tcp_migrate_snd_queue, ntohl(t->sndq) };
+	iov[2] = (struct iovec){ tcp_migrate_rcv_queue, ntohl(t->rcvq) };
 
-	if (write_all_buf(fd, tcp_migrate_snd_queue, ntohl(t->sndq))) {
-		flow_perror(conn, "Failed to write send queue data");
+	if (write_remainder(fd, iov, ARRAY_SIZE(iov), 0,
+			    iov_size(iov, ARRAY_SIZE(iov)))) {
+		flow_perror(conn, "Failed to write extended data and queues");
 		return -EIO;
 	}
 
-	if (write_all_buf(fd, tcp_migrate_rcv_queue, ntohl(t->rcvq))) {
-		flow_perror(conn, "Failed to write receive queue data");
-		return -EIO;
-	}
+	passt_stats.migrate.bytes += iov_size(iov, ARRAY_SIZE(iov));
 
 	return 0;
 
@@ -3697,6 +4862,8 @@ fail:
 		return -EIO;
 	}
 
+	passt_stats.migrate.bytes += sizeof(*t);
+
 	if (rc == -EIO) /* but not a migration data transfer failure */
 		return -ENODATA;
 
@@ -3783,8 +4950,6 @@ static int tcp_flow_repair_connect(const struct ctx *c,
 		return rc;
 	}
 
-	conn->timer = -1;
-
 	return 0;
 }
 
@@ -3813,6 +4978,8 @@ int tcp_flow_migrate_target(struct ctx *c, int fd)
 		return -errno;
 	}
 
+	passt_stats.migrate.bytes += sizeof(t);
+
 	flow->f.state = FLOW_STATE_TGT;
 	memcpy(&flow->f.pif, &t.pif, sizeof(flow->f.pif));
 	memcpy(&flow->f.side, &t.side, sizeof(flow->f.side));
@@ -3824,6 +4991,8 @@ int tcp_flow_migrate_target(struct ctx *c, int fd)
 	conn->events			= t.events;
 
 	conn->sndbuf			= htonl(t.sndbuf);
+	tcp_sndbuf_total		+= SNDBUF_GET(conn);
+	passt_stats.mem[STATS_MEM_TCP_SNDBUF] = tcp_sndbuf_total;
 
 	conn->flags			= t.flags;
 	conn->seq_dup_ack_approx	= t.seq_dup_ack_approx;
@@ -3836,6 +5005,7 @@ int tcp_flow_migrate_target(struct ctx *c, int fd)
 	conn->seq_to_tap		= ntohl(t.seq_to_tap);
 	conn->seq_ack_from_tap		= ntohl(t.seq_ack_from_tap);
 	conn->seq_from_tap		= ntohl(t.seq_from_tap);
+	conn->seq_wnd_edge		= conn->seq_from_tap;
 	conn->seq_ack_to_tap		= ntohl(t.seq_ack_to_tap);
 	conn->seq_init_from_tap		= ntohl(t.seq_init_from_tap);
 
@@ -3844,7 +5014,7 @@ int tcp_flow_migrate_target(struct ctx *c, int fd)
 		goto out;
 	}
 
-	flow_epollid_set(&conn->f, EPOLLFD_ID_DEFAULT);
+	flow_epollid_assign(c, &conn->f);
 	if (flow_epoll_set(&conn->f, EPOLL_CTL_ADD, 0, conn->sock,
 			   !TAPSIDE(conn)))
 		goto out; /* tcp_flow_migrate_target_ext() will clean this up */
@@ -3865,6 +5035,12 @@ out:
  * @now:	Current timestamp
  *
  * Return: 0 on success, negative on fatal failure, but 0 on single flow failure
+ *
+ * Clearing repair mode is only queued here, unless data not sent yet needs to
+ * be written to the socket: the caller flushes it for all flows at once, then
+ * completes them with tcp_flow_migrate_target_post().
+ *
+ * #syscalls:vu readv
  */
 int tcp_flow_migrate_target_ext(struct ctx *c, struct tcp_tap_conn *conn,
 				int fd, const struct timespec *now)
@@ -3872,6 +5048,10 @@ int tcp_flow_migrate_target_ext(struct ctx *c, struct tcp_tap_conn *conn,
 	uint32_t peek_offset = conn->seq_to_tap - conn->seq_ack_from_tap;
 	struct tcp_tap_transfer_ext t;
 	int s = conn->sock, rc;
+	struct iovec iov[2];
+
+	/* Not defined: tell tcp_flow_migrate_target_post() to skip this flow */
+	migrate_ext[FLOW_IDX(conn)].tcpi_state = 0;
 
 	if (read_all_buf(fd, &t, sizeof(t))) {
 		rc = -errno;
@@ -3879,6 +5059,8 @@ int tcp_flow_migrate_target_ext(struct ctx *c, struct tcp_tap_conn *conn,
 		return rc;
 	}
 
+	passt_stats.migrate.bytes += sizeof(t);
+
 	if (!t.tcpi_state) { /* Source wants us to skip this flow */
 		flow_err(conn, "Dropping as requested by source");
 		goto fail;
@@ -3918,18 +5100,17 @@ int tcp_flow_migrate_target_ext(struct ctx *c, struct tcp_tap_conn *conn,
 		return -EINVAL;
 	}
 
-	if (read_all_buf(fd, tcp_migrate_snd_queue, t.sndq)) {
-		rc = -errno;
-		flow_perror(conn, "Failed to read send queue data");
-		return rc;
-	}
+	iov[0] = (struct iovec){ tcp_migrate_snd_queue, t.sndq };
+	iov[1] = (struct iovec){ tcp_migrate_rcv_queue, t.rcvq };
 
-	if (read_all_buf(fd, tcp_migrate_rcv_queue, t.rcvq)) {
+	if (read_remainder(fd, iov, ARRAY_SIZE(iov), 0)) {
 		rc = -errno;
-		flow_perror(conn, "Failed to read receive queue data");
+		flow_perror(conn, "Failed to read queue data");
 		return rc;
 	}
 
+	passt_stats.migrate.bytes += t.sndq + t.rcvq;
+
 	if (conn->sock < 0)
 		/* We weren't able to create the socket, discard flow */
 		goto fail;
@@ -3994,9 +5175,13 @@ int tcp_flow_migrate_target_ext(struct ctx *c, struct tcp_tap_conn *conn,
 		goto fail;
 
 	tcp_flow_repair_off(c, conn);
-	repair_flush(c);
 
 	if (t.notsent) {
+		/* We can't keep a copy of the send queue for each flow: flush
+		 * now, together with any other flow queued so far.
+		 */
+		repair_flush(c);
+
 		if (tcp_flow_repair_queue(conn, t.notsent,
 					  tcp_migrate_snd_queue +
 					  (t.sndq - t.notsent))) {
@@ -4008,13 +5193,45 @@ int tcp_flow_migrate_target_ext(struct ctx *c, struct tcp_tap_conn *conn,
 		}
 	}
 
+	migrate_ext[FLOW_IDX(conn)] = t;
+
+	return 0;
+
+fail:
+	if (conn->sock >= 0) {
+		tcp_flow_repair_off(c, conn);
+		repair_flush(c);
+	}
+
+	conn->flags = 0; /* Not waiting for ACK, don't schedule timer */
+	tcp_rst(c, conn, now);
+
+	return 0;
+}
+
+/**
+ * tcp_flow_migrate_target_post() - Complete flow once repair mode is cleared
+ * @c:		Execution context
+ * @conn:	Connection entry restored by tcp_flow_migrate_target_ext()
+ * @now:	Current timestamp
+ */
+void tcp_flow_migrate_target_post(struct ctx *c, struct tcp_tap_conn *conn,
+				  const struct timespec *now)
+{
+	uint32_t peek_offset = conn->seq_to_tap - conn->seq_ack_from_tap;
+	const struct tcp_tap_transfer_ext *t = &migrate_ext[FLOW_IDX(conn)];
+	int s = conn->sock, rc;
+
+	if (!t->tcpi_state) /* Dropped, or already reset */
+		return;
+
 	/* If we sent a FIN but it wasn't acknowledged yet (TCP_FIN_WAIT1), send
 	 * it out, because we don't know if we already sent it.
 	 *
 	 * Call shutdown(x, SHUT_WR) *not* in repair mode, which moves us to
 	 * TCP_FIN_WAIT1.
 	 */
-	if (t.tcpi_state == TCP_FIN_WAIT1) {
+	if (t->tcpi_state == TCP_FIN_WAIT1) {
 		if (shutdown(s, SHUT_WR) < 0) {
 			flow_perror(conn, "Post-repair shutdown() failed");
 			goto fail;
@@ -4036,18 +5253,11 @@ int tcp_flow_migrate_target_ext(struct ctx *c, struct tcp_tap_conn *conn,
 		goto fail;
 	}
 
-	return 0;
+	return;
 
 fail:
-	if (conn->sock >= 0) {
-		tcp_flow_repair_off(c, conn);
-		repair_flush(c);
-	}
-
 	conn->flags = 0; /* Not waiting for ACK, don't schedule timer */
 	tcp_rst(c, conn, now);
-
-	return 0;
 }
 
 /**
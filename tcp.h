@@ -29,6 +29,7 @@ int tcp_tap_handler(const struct ctx *c, uint8_t pif, sa_family_t af,
 		    const struct pool *p, int idx, const struct timespec *now);
 int tcp_init(struct ctx *c);
 void tcp_defer_handler(struct ctx *c, const struct timespec *now);
+void tcp_release(void);
 
 void tcp_update_l2_buf(const unsigned char *eth_d);
 
@@ -39,23 +40,28 @@ extern bool peek_offset_cap;
  * @scan_in:		Port scanning state for inbound packets
  * @scan_out:		Port scanning state for outbound packets
  * @timer_run:		Timestamp of most recent timer run
- * @pipe_size:		Size of pipes for spliced connections
  * @rto_max:		Maximum retry timeout (in s)
  * @syn_retries:	SYN retries using exponential backoff timeout
  * @syn_linear_timeouts: SYN retries before using exponential backoff timeout
  * @keepalive_run:	Time we last issued tap-side keepalives
  * @inactivity_run:	Time we last scanned for inactive connections
+ * @wnd_bdp_max:	Maximum window from bandwidth-delay product, 0 to size
+ *			windows from sending buffers only
+ * @mem_budget:		Sending buffer space shared by connections, 0 for none
+ * @mptcp:		Use Multipath TCP for sockets of connections from tap
  */
 struct tcp_ctx {
 	struct fwd_scan scan_in;
 	struct fwd_scan scan_out;
 	struct timespec timer_run;
-	size_t pipe_size;
 	int rto_max;
 	uint8_t syn_retries;
 	uint8_t syn_linear_timeouts;
 	time_t keepalive_run;
 	time_t inactivity_run;
+	uint32_t wnd_bdp_max;
+	uint64_t mem_budget;
+	int mptcp;
 };
 
 #endif /* TCP_H */
@@ -32,10 +32,24 @@
 #include "tcp_conn.h"
 #include "tcp_internal.h"
 #include "tcp_buf.h"
+#include "checksum.h"
+#include "stats.h"
+#include "probe.h"
 
 #define TCP_FRAMES_MEM			128
 #define TCP_FRAMES							   \
-	(c->mode == MODE_PASTA ? 1 : TCP_FRAMES_MEM)
+	(c->mode == MODE_PASTA ? 1 : tcp_frames_share)
+
+/* Lower bound for batch size, and for the share of a single connection */
+#define TCP_FRAMES_MIN			8
+
+/* Segments without data we queue ahead of data frames, see tcp_flags[] */
+#define TCP_FLAGS_FRAMES		32
+
+/* Largest TCP payload in a super-frame segmented by the tuntap device */
+#define TCP_TSO_MAX(v6)							\
+	(L2_MAX_LEN_PASTA - sizeof(struct ethhdr) - sizeof(struct tcphdr) - \
+	 ((v6) ? sizeof(struct ipv6hdr) : sizeof(struct iphdr)))
 
 /* Static buffers */
 
@@ -49,15 +63,92 @@ static struct iphdr		tcp4_payload_ip[TCP_FRAMES_MEM];
 static struct ipv6hdr		tcp6_payload_ip[TCP_FRAMES_MEM];
 
 /* TCP segments with payload for IPv4 and IPv6 frames */
-static struct tcp_payload_t	tcp_payload[TCP_FRAMES_MEM];
+static struct tcp_payload_t	tcp_payload[TCP_FRAMES_MEM]
+	__attribute__ ((aligned(HUGEPAGE_SIZE)));
 
 static_assert(MSS4 <= sizeof(tcp_payload[0].data), "MSS4 is greater than 65516");
 static_assert(MSS6 <= sizeof(tcp_payload[0].data), "MSS6 is greater than 65516");
+static_assert(TCP_TSO_MAX(false) <= sizeof(tcp_payload[0].data),
+	      "Super-frames don't fit TCP payload buffers");
 
 /* References tracking the owner connection of frames in the tap outqueue */
 static struct tcp_tap_conn *tcp_frame_conns[TCP_FRAMES_MEM];
 static unsigned int tcp_payload_used;
 
+/* Frames before this one were sent, the ones from here on wait for the tap to
+ * become writable again, as long as they take up to half of tcp_frames_max
+ */
+static unsigned int tcp_payload_sent;
+static bool tcp_payload_held;
+
+/* Pseudo-header checksum of the last frame with headers built from scratch */
+static uint16_t tcp_payload_psum;
+
+/**
+ * struct tcp_flags_t - TCP header and options to send segments without data
+ * @th:		TCP header
+ * @opts:	TCP options, only for SYN segments
+ */
+struct tcp_flags_t {
+	struct tcphdr th;
+	struct tcp_syn_opts opts;
+} __attribute__ ((packed, aligned(__alignof__(unsigned int))));
+
+/* Segments without data (SYN, ACK, FIN, RST) for connections with no frames
+ * in the data queue. They don't need to follow any data frame, so we send them
+ * first, and handshakes and ACKs don't wait behind bulk transfers
+ */
+static struct ethhdr		tcp_flags_eth_hdr[TCP_FLAGS_FRAMES];
+static struct tap_hdr		tcp_flags_tap_hdr[TCP_FLAGS_FRAMES];
+static struct iphdr		tcp4_flags_ip[TCP_FLAGS_FRAMES];
+static struct ipv6hdr		tcp6_flags_ip[TCP_FLAGS_FRAMES];
+static struct tcp_flags_t	tcp_flags[TCP_FLAGS_FRAMES];
+static struct iovec		tcp_flags_iov[TCP_FLAGS_FRAMES][TCP_NUM_IOVS];
+static struct tcp_tap_conn	*tcp_flags_conns[TCP_FLAGS_FRAMES];
+static unsigned int		tcp_flags_used;
+
+/* Frames we queue at most before flushing: TCP_FRAMES_MIN with --low-mem */
+static unsigned int tcp_frames_max = TCP_FRAMES_MEM;
+
+/* Frames queued before we flush: halved if the tap doesn't take all of them,
+ * increased again, by TCP_FRAMES_MIN, as long as it does
+ */
+static unsigned int tcp_frames_batch = TCP_FRAMES_MEM;
+
+/* Connections queueing data since last flush, and frames each one can
+ * queue at a time: the batch split across connections seen in the previous
+ * one. As we leave remaining data in the socket, which keeps it ready, epoll
+ * hands us connections round-robin, instead of having a bulk transfer fill
+ * the whole batch ahead of interactive traffic
+ */
+static unsigned int tcp_frames_turns;
+static int tcp_frames_share = TCP_FRAMES_MEM;
+
+/* First receive from a socket for data frames in the current batch, if any */
+static struct timespec tcp_payload_start;
+static bool tcp_payload_timed;
+
+/**
+ * struct tcp_payload_csum - Payload checksum of a frame we might send again
+ * @conn:	Connection the frame belongs to
+ * @seq:	Sequence number of the first payload byte
+ * @dlen:	Payload length
+ * @sum:	Unfolded checksum of payload alone
+ */
+struct tcp_payload_csum {
+	const struct tcp_tap_conn *conn;
+	uint32_t seq;
+	uint32_t dlen;
+	uint32_t sum;
+};
+
+/* Payload checksums for frames queued in the current batch, by slot. Frames
+ * the tap didn't take in the last flush are valid in [first, last): once we
+ * revert sequences, they are queued again, in order, from the first slot
+ */
+static struct tcp_payload_csum tcp_payload_csum[TCP_FRAMES_MEM];
+static unsigned int tcp_payload_csum_first, tcp_payload_csum_last;
+
 /* recvmsg()/sendmsg() data for tap */
 static struct iovec	iov_sock		[TCP_FRAMES_MEM + DISCARD_IOV_NUM];
 
@@ -73,6 +164,9 @@ void tcp_update_l2_buf(const unsigned char *eth_d)
 
 	for (i = 0; i < TCP_FRAMES_MEM; i++)
 		eth_update_mac(&tcp_eth_hdr[i], eth_d, NULL);
+
+	for (i = 0; i < TCP_FLAGS_FRAMES; i++)
+		eth_update_mac(&tcp_flags_eth_hdr[i], eth_d, NULL);
 }
 
 /**
@@ -85,6 +179,12 @@ void tcp_sock_iov_init(const struct ctx *c)
 	struct iphdr iph = L2_BUF_IP4_INIT(IPPROTO_TCP);
 	int i;
 
+	if (c->low_mem)
+		tcp_frames_max = tcp_frames_batch = tcp_frames_share =
+			TCP_FRAMES_MIN;
+	else
+		madvise_hugepage(tcp_payload, sizeof(tcp_payload));
+
 	for (i = 0; i < ARRAY_SIZE(tcp_payload); i++) {
 		tcp6_payload_ip[i] = ip6;
 		tcp4_payload_ip[i] = iph;
@@ -98,6 +198,27 @@ void tcp_sock_iov_init(const struct ctx *c)
 		iov[TCP_IOV_PAYLOAD].iov_base = &tcp_payload[i];
 		iov[TCP_IOV_ETH_PAD].iov_base = eth_pad;
 	}
+
+	for (i = 0; i < TCP_FLAGS_FRAMES; i++) {
+		struct iovec *iov = tcp_flags_iov[i];
+
+		tcp6_flags_ip[i] = ip6;
+		tcp4_flags_ip[i] = iph;
+
+		iov[TCP_IOV_TAP] = tap_hdr_iov(c, &tcp_flags_tap_hdr[i]);
+		iov[TCP_IOV_ETH] = IOV_OF_LVALUE(tcp_flags_eth_hdr[i]);
+		iov[TCP_IOV_PAYLOAD].iov_base = &tcp_flags[i];
+		iov[TCP_IOV_ETH_PAD].iov_base = eth_pad;
+	}
+}
+
+/**
+ * tcp_buf_release() - Release pages of payload buffers if no frames are queued
+ */
+void tcp_buf_release(void)
+{
+	if (!tcp_payload_used)
+		madvise_free(tcp_payload, sizeof(tcp_payload));
 }
 
 /**
@@ -120,7 +241,7 @@ static void tcp_revert_seq(const struct ctx *c, struct tcp_tap_conn **conns,
 		uint32_t seq = ntohl(th->seq);
 		uint32_t peek_offset;
 
-		if (SEQ_LE(conn->seq_to_tap, seq))
+		if (!conn || SEQ_LE(conn->seq_to_tap, seq))
 			continue;
 
 		conn->seq_to_tap = seq;
@@ -130,6 +251,21 @@ static void tcp_revert_seq(const struct ctx *c, struct tcp_tap_conn **conns,
 	}
 }
 
+/**
+ * tcp_frames_reshare() - Split next batch across connections seen in this one
+ *
+ * Also starts counting connections again, for the next batch
+ */
+static void tcp_frames_reshare(void)
+{
+	if (tcp_frames_turns) {
+		tcp_frames_share = MAX(tcp_frames_batch / tcp_frames_turns,
+				       TCP_FRAMES_MIN);
+	}
+
+	tcp_frames_turns = 0;
+}
+
 /**
  * tcp_payload_flush() - Send out buffers for segments with data or flags
  * @c:		Execution context
@@ -139,13 +275,79 @@ void tcp_payload_flush(const struct ctx *c, const struct timespec *now)
 {
 	size_t m;
 
-	m = tap_send_frames(c, &tcp_l2_iov[0][0], TCP_NUM_IOVS,
-			    tcp_payload_used);
+	if (tcp_flags_used) {
+		m = tap_send_frames(c, &tcp_flags_iov[0][0], TCP_NUM_IOVS,
+				    tcp_flags_used);
+		if (m != tcp_flags_used) {
+			passt_stats.tcp_requeued += tcp_flags_used - m;
+			tcp_revert_seq(c, &tcp_flags_conns[m],
+				       &tcp_flags_iov[m], tcp_flags_used - m,
+				       now);
+		}
+		tcp_flags_used = 0;
+	}
+
+	stats_mem_peak(STATS_MEM_TCP_BUF,
+		       tcp_payload_used * sizeof(tcp_payload[0]));
+
+	m = tap_send_frames(c, &tcp_l2_iov[tcp_payload_sent][0], TCP_NUM_IOVS,
+			    tcp_payload_used - tcp_payload_sent);
+	PROBE(tcp_payload_flush, tcp_payload_used - tcp_payload_sent, m);
+	m += tcp_payload_sent;
+	if (tcp_payload_timed) {
+		stats_hist_since(PESTO_STATS_HIST_SOCK_TAP, &tcp_payload_start);
+		tcp_payload_timed = false;
+	}
+	if (m != tcp_payload_used && tcp_payload_used <= tcp_frames_max / 2) {
+		/* Keep frames, and headers, ready, instead of peeking again */
+		tcp_payload_sent = m;
+		tcp_payload_held = true;
+		tcp_payload_csum_first = tcp_payload_csum_last = 0;
+		tcp_frames_batch = MAX(tcp_frames_batch / 2, TCP_FRAMES_MIN);
+		tcp_frames_reshare();
+		tap_wait_writable(c);
+		return;
+	}
+
 	if (m != tcp_payload_used) {
+		passt_stats.tcp_requeued += tcp_payload_used - m;
 		tcp_revert_seq(c, &tcp_frame_conns[m], &tcp_l2_iov[m],
 			       tcp_payload_used - m, now);
+
+		tcp_frames_batch = MAX(tcp_frames_batch / 2, TCP_FRAMES_MIN);
+	} else if (m >= tcp_frames_batch) {
+		tcp_frames_batch = MIN(tcp_frames_batch + TCP_FRAMES_MIN,
+				       tcp_frames_max);
+	}
+
+	tcp_frames_reshare();
+
+	tcp_payload_csum_first = m;
+	tcp_payload_csum_last = tcp_payload_used;
+
+	tcp_payload_used = tcp_payload_sent = 0;
+	tcp_payload_held = false;
+}
+
+/**
+ * tcp_buf_conn_gone() - Forget connection for frames waiting for the tap
+ * @conn:	Connection pointer, about to be freed
+ *
+ * Frames are still sent, but we can't revert sequences if they aren't.
+ */
+void tcp_buf_conn_gone(const struct tcp_tap_conn *conn)
+{
+	unsigned int i;
+
+	for (i = tcp_payload_sent; i < tcp_payload_used; i++) {
+		if (tcp_frame_conns[i] == conn)
+			tcp_frame_conns[i] = NULL;
+	}
+
+	for (i = 0; i < tcp_flags_used; i++) {
+		if (tcp_flags_conns[i] == conn)
+			tcp_flags_conns[i] = NULL;
 	}
-	tcp_payload_used = 0;
 }
 
 /**
@@ -170,6 +372,9 @@ static void tcp_l2_buf_pad(struct iovec *iov)
  * @conn:	Connection pointer
  * @iov:	Pointer to an array of iovec of TCP pre-cooked buffers
  * @csum_flags:	TCP_CSUM if TCP checksum must be computed,
+ * 		TCP_CSUM_PARTIAL for pseudo-header checksum only, completed by
+ * 		the caller or, with offloads, by the kernel (which also
+ * 		segments the frame),
  * 		IP4_CSUM if IPv4 checksum must be computed,
  * 		otherwise IPv4 checksum is provided in IP4_CMASK
  * @seq:	Sequence number for this segment
@@ -185,6 +390,7 @@ static void tcp_l2_buf_fill_headers(const struct ctx *c,
 	const struct flowside *tapside = TAPFLOW(conn);
 	const struct in_addr *a4 = inany_v4(&tapside->oaddr);
 	struct ethhdr *eh = iov[TCP_IOV_ETH].iov_base;
+	size_t dlen = iov_tail_size(&tail);
 	struct ipv6hdr *ip6h = NULL;
 	struct iphdr *ip4h = NULL;
 	size_t l2len;
@@ -195,8 +401,156 @@ static void tcp_l2_buf_fill_headers(const struct ctx *c,
 		ip6h = iov[TCP_IOV_IP].iov_base;
 
 	l2len = tcp_fill_headers(c, conn, eh, ip4h, ip6h, th, &tail,
-				 iov_tail_size(&tail), csum_flags, seq);
-	tap_hdr_update(taph, l2len);
+				 dlen, csum_flags, seq);
+	tap_hdr_update(c, taph, l2len);
+
+	if ((csum_flags & TCP_CSUM_PARTIAL) && tap_offload(c)) {
+		size_t l4off = iov[TCP_IOV_ETH].iov_len + iov[TCP_IOV_IP].iov_len;
+
+		tap_hdr_tso(taph, !a4, l4off, dlen, MSS_GET(conn));
+	}
+}
+
+/**
+ * tcp_l2_buf_copy_headers() - Copy headers from previous frame, set sequence
+ * @iov:	Pointer to iovec of frame parts to fill
+ * @prev:	Pointer to iovec of previous frame, same connection and length
+ * @seq:	Sequence number for this segment
+ *
+ * Frames in the middle of a batch from the same socket only differ in their
+ * sequence number: addresses, lengths, IPv4 checksum and pseudo-header
+ * checksum are the same, and so are the ACK sequence and window, as we don't
+ * update them until the batch is queued.
+ */
+static void tcp_l2_buf_copy_headers(struct iovec *iov,
+				    const struct iovec *prev, uint32_t seq)
+{
+	const struct tcp_payload_t *pp = prev[TCP_IOV_PAYLOAD].iov_base;
+	struct tcp_payload_t *payload = iov[TCP_IOV_PAYLOAD].iov_base;
+
+	memcpy(iov[TCP_IOV_TAP].iov_base, prev[TCP_IOV_TAP].iov_base,
+	       prev[TCP_IOV_TAP].iov_len);
+	memcpy(iov[TCP_IOV_ETH].iov_base, prev[TCP_IOV_ETH].iov_base,
+	       sizeof(struct ethhdr));
+	memcpy(iov[TCP_IOV_IP].iov_base, prev[TCP_IOV_IP].iov_base,
+	       prev[TCP_IOV_IP].iov_len);
+
+	payload->th = pp->th;
+	payload->th.seq = htonl(seq);
+	payload->th.check = tcp_payload_psum;
+}
+
+/**
+ * tcp_buf_csum() - Complete TCP checksum, reusing payload checksum if known
+ * @conn:	Connection pointer
+ * @i:		Frame slot, pseudo-header checksum already in TCP header
+ * @seq:	Sequence number of the first payload byte
+ * @dlen:	Payload length
+ *
+ * If the tap didn't take a frame, we'll queue the same data, with the same
+ * sequence, at the next attempt: reuse the checksum we calculated for the
+ * payload, and sum the TCP header, as it might have a different ACK sequence
+ * or window, on top of it.
+ */
+static void tcp_buf_csum(const struct tcp_tap_conn *conn, unsigned int i,
+			 uint32_t seq, size_t dlen)
+{
+	unsigned int prev = i + tcp_payload_csum_first;
+	struct tcp_payload_csum *pc = &tcp_payload_csum[i];
+	struct tcp_payload_t *payload = &tcp_payload[i];
+	uint32_t sum;
+
+	if (prev < tcp_payload_csum_last &&
+	    tcp_payload_csum[prev].conn == conn &&
+	    tcp_payload_csum[prev].seq == seq &&
+	    tcp_payload_csum[prev].dlen == dlen)
+		sum = tcp_payload_csum[prev].sum;
+	else
+		sum = csum_unfolded(payload->data, dlen, 0);
+
+	*pc = (struct tcp_payload_csum){
+		.conn = conn, .seq = seq, .dlen = dlen, .sum = sum,
+	};
+
+	sum = csum_unfolded(&payload->th, sizeof(payload->th), sum);
+	payload->th.check = (uint16_t)~csum_fold(sum);
+}
+
+/**
+ * tcp_buf_frame_max() - Maximum payload we can place in a single tap frame
+ * @c:		Execution context
+ * @v6:		Set for IPv6 connections
+ * @mss:	Maximum segment size announced by the guest
+ *
+ * Return: @mss, or, if the tuntap device takes offloads, the largest multiple
+ *         of @mss fitting in a frame, for the kernel to segment
+ */
+static size_t tcp_buf_frame_max(const struct ctx *c, bool v6, uint16_t mss)
+{
+	size_t max = TCP_TSO_MAX(v6);
+
+	if (!tap_offload(c) || !mss || mss >= max)
+		return mss;
+
+	return max - max % mss;
+}
+
+/**
+ * tcp_buf_last_frame() - Find last frame queued for a connection in data queue
+ * @conn:	Connection pointer
+ *
+ * Return: slot of the last frame for @conn not sent yet, -1 if there's none
+ */
+static int tcp_buf_last_frame(const struct tcp_tap_conn *conn)
+{
+	unsigned int i;
+
+	/* Frames before tcp_payload_sent are gone already */
+	for (i = tcp_payload_used; i > tcp_payload_sent; i--) {
+		if (tcp_frame_conns[i - 1] == conn)
+			return i - 1;
+	}
+
+	return -1;
+}
+
+/**
+ * tcp_buf_ack_piggyback() - Carry ACK in data frame already queued, if any
+ * @c:		Execution context
+ * @conn:	Connection pointer, with ACK sequence and window up to date
+ * @i:		Slot of the last frame queued for @conn
+ *
+ * Return: true if the last frame queued for @conn carries data and was
+ *	   updated with the current ACK sequence and window, false otherwise
+ */
+static bool tcp_buf_ack_piggyback(const struct ctx *c,
+				  const struct tcp_tap_conn *conn,
+				  unsigned int i)
+{
+	struct tcphdr th_old, *th;
+	uint32_t sum;
+
+	th = &tcp_payload[i].th;
+	if (tcp_l2_iov[i][TCP_IOV_PAYLOAD].iov_len <= th->doff * 4UL)
+		return false;
+
+	th_old = *th;
+	th->ack_seq = htonl(conn->seq_ack_to_tap);
+	th->window = htons(conn->wnd_to_tap);
+
+	/* With offloads, the header isn't part of the checksum we stored */
+	if (tap_offload(c))
+		return true;
+
+	/* RFC 1624, 3: HC' = ~(~HC + ~m + m'), the checksum field itself is
+	 * the same in m and m', so it cancels out
+	 */
+	sum = (uint16_t)~th->check;
+	sum += (uint16_t)~csum_fold(csum_unfolded(&th_old, sizeof(*th), 0));
+	sum += csum_fold(csum_unfolded(th, sizeof(*th), 0));
+	th->check = (uint16_t)~csum_fold(sum);
+
+	return true;
 }
 
 /**
@@ -211,29 +565,60 @@ static void tcp_l2_buf_fill_headers(const struct ctx *c,
 int tcp_buf_send_flag(const struct ctx *c, struct tcp_tap_conn *conn, int flags,
 		      const struct timespec *now)
 {
-	struct tcp_payload_t *payload;
+	int last = tcp_buf_last_frame(conn);
+	struct iovec (*l2_iov)[TCP_NUM_IOVS];
+	struct tcp_tap_conn **conns;
+	struct tcp_syn_opts *opts;
+	unsigned int *used;
+	struct tcphdr *th;
 	struct iovec *iov;
 	size_t optlen;
 	size_t l4len;
 	uint32_t seq;
 	int ret;
 
-	iov = tcp_l2_iov[tcp_payload_used];
-	if (CONN_V4(conn))
-		iov[TCP_IOV_IP] = IOV_OF_LVALUE(tcp4_payload_ip[tcp_payload_used]);
-	else
-		iov[TCP_IOV_IP] = IOV_OF_LVALUE(tcp6_payload_ip[tcp_payload_used]);
+	if (last < 0 && !tcp_payload_held) {
+		used = &tcp_flags_used;
+		conns = tcp_flags_conns;
+		l2_iov = tcp_flags_iov;
+		iov = l2_iov[*used];
+
+		if (CONN_V4(conn))
+			iov[TCP_IOV_IP] = IOV_OF_LVALUE(tcp4_flags_ip[*used]);
+		else
+			iov[TCP_IOV_IP] = IOV_OF_LVALUE(tcp6_flags_ip[*used]);
+
+		th = &tcp_flags[*used].th;
+		opts = &tcp_flags[*used].opts;
+	} else {
+		/* Keep the order with frames for the same connection */
+		struct tcp_payload_t *payload;
+
+		used = &tcp_payload_used;
+		conns = tcp_frame_conns;
+		l2_iov = tcp_l2_iov;
+		iov = l2_iov[*used];
+
+		if (CONN_V4(conn))
+			iov[TCP_IOV_IP] = IOV_OF_LVALUE(tcp4_payload_ip[*used]);
+		else
+			iov[TCP_IOV_IP] = IOV_OF_LVALUE(tcp6_payload_ip[*used]);
+
+		iov[TCP_IOV_ETH] = IOV_OF_LVALUE(tcp_eth_hdr[*used]);
+		payload = iov[TCP_IOV_PAYLOAD].iov_base;
+		th = &payload->th;
+		opts = (struct tcp_syn_opts *)&payload->data;
+	}
 
-	iov[TCP_IOV_ETH] = IOV_OF_LVALUE(tcp_eth_hdr[tcp_payload_used]);
-	payload = iov[TCP_IOV_PAYLOAD].iov_base;
 	seq = conn->seq_to_tap;
-	ret = tcp_prepare_flags(c, conn, flags, &payload->th,
-				(struct tcp_syn_opts *)&payload->data,
-				&optlen, now);
+	ret = tcp_prepare_flags(c, conn, flags, th, opts, &optlen, now);
 	if (ret <= 0)
 		return ret;
 
-	tcp_frame_conns[tcp_payload_used++] = conn;
+	if (!flags && last >= 0 && tcp_buf_ack_piggyback(c, conn, last))
+		return 0;
+
+	conns[(*used)++] = conn;
 	l4len = optlen + sizeof(struct tcphdr);
 	iov[TCP_IOV_PAYLOAD].iov_len = l4len;
 
@@ -245,8 +630,8 @@ int tcp_buf_send_flag(const struct ctx *c, struct tcp_tap_conn *conn, int flags,
 	tcp_l2_buf_pad(iov);
 
 	if (flags & DUP_ACK) {
-		struct iovec *dup_iov = tcp_l2_iov[tcp_payload_used];
-		tcp_frame_conns[tcp_payload_used++] = conn;
+		struct iovec *dup_iov = l2_iov[*used];
+		conns[(*used)++] = conn;
 
 		memcpy(dup_iov[TCP_IOV_TAP].iov_base, iov[TCP_IOV_TAP].iov_base,
 		       iov[TCP_IOV_TAP].iov_len);
@@ -258,7 +643,8 @@ int tcp_buf_send_flag(const struct ctx *c, struct tcp_tap_conn *conn, int flags,
 		dup_iov[TCP_IOV_ETH_PAD].iov_len = iov[TCP_IOV_ETH_PAD].iov_len;
 	}
 
-	if (tcp_payload_used > TCP_FRAMES_MEM - 2)
+	if (tcp_payload_used > TCP_FRAMES_MEM - 2 ||
+	    tcp_flags_used > TCP_FLAGS_FRAMES - 2)
 		tcp_payload_flush(c, now);
 
 	return 0;
@@ -269,48 +655,49 @@ int tcp_buf_send_flag(const struct ctx *c, struct tcp_tap_conn *conn, int flags,
  * @c:		Execution context
  * @conn:	Connection pointer
  * @dlen:	TCP payload length
- * @no_csum:	Don't compute IPv4 checksum, use the one from previous buffer
+ * @no_csum:	Same length as previous buffer, for the same connection: copy
+ *		headers from there instead of building them
  * @seq:	Sequence number to be sent
  * @push:	Set PSH flag, last segment in a batch
- * @now:	Current timestamp
  */
 static void tcp_data_to_tap(const struct ctx *c, struct tcp_tap_conn *conn,
-			    ssize_t dlen, int no_csum, uint32_t seq, bool push,
-			    const struct timespec *now)
+			    ssize_t dlen, int no_csum, uint32_t seq, bool push)
 {
+	unsigned int i = tcp_payload_used;
 	struct tcp_payload_t *payload;
-	uint32_t check = IP4_CSUM;
 	struct iovec *iov;
 
 	conn->seq_to_tap = seq + dlen;
 	tcp_frame_conns[tcp_payload_used] = conn;
 	iov = tcp_l2_iov[tcp_payload_used];
-	if (CONN_V4(conn)) {
-		if (no_csum) {
-			struct iovec *iov_prev = tcp_l2_iov[tcp_payload_used - 1];
-			const struct iphdr *iph = iov_prev[TCP_IOV_IP].iov_base;
-
-			/* overwrite IP4_CSUM flag as we set the checksum */
-			check = iph->check;
-		}
+	if (CONN_V4(conn))
 		iov[TCP_IOV_IP] = IOV_OF_LVALUE(tcp4_payload_ip[tcp_payload_used]);
-	} else if (CONN_V6(conn)) {
+	else if (CONN_V6(conn))
 		iov[TCP_IOV_IP] = IOV_OF_LVALUE(tcp6_payload_ip[tcp_payload_used]);
-	}
 	iov[TCP_IOV_ETH].iov_base = &tcp_eth_hdr[tcp_payload_used];
-	payload = iov[TCP_IOV_PAYLOAD].iov_base;
-	payload->th.th_off = sizeof(struct tcphdr) / 4;
-	payload->th.th_x2 = 0;
-	payload->th.th_flags = 0;
-	payload->th.ack = 1;
-	payload->th.psh = push;
 	iov[TCP_IOV_PAYLOAD].iov_len = dlen + sizeof(struct tcphdr);
-	tcp_l2_buf_fill_headers(c, conn, iov, TCP_CSUM | check, seq);
+
+	if (no_csum) {
+		tcp_l2_buf_copy_headers(iov, tcp_l2_iov[tcp_payload_used - 1],
+					seq);
+	} else {
+		payload = iov[TCP_IOV_PAYLOAD].iov_base;
+		payload->th.th_off = sizeof(struct tcphdr) / 4;
+		payload->th.th_x2 = 0;
+		payload->th.th_flags = 0;
+		payload->th.ack = 1;
+		payload->th.psh = push;
+		tcp_l2_buf_fill_headers(c, conn, iov,
+					TCP_CSUM_PARTIAL | IP4_CSUM, seq);
+		tcp_payload_psum = payload->th.check;
+	}
+
+	if (!tap_offload(c))
+		tcp_buf_csum(conn, i, seq, dlen);
 
 	tcp_l2_buf_pad(iov);
 
-	if (++tcp_payload_used > TCP_FRAMES_MEM - 1)
-		tcp_payload_flush(c, now);
+	tcp_payload_used++;
 }
 
 /**
@@ -318,30 +705,51 @@ static void tcp_data_to_tap(const struct ctx *c, struct tcp_tap_conn *conn,
  * @c:		Execution context
  * @conn:	Connection pointer
  * @already_sent:	Number of bytes already sent to tap, but not acked
+ * @fillsize:	Maximum bytes to send, within guest-side receiving window
  * @now:	Current timestamp
  *
  * Return: negative on connection reset, 0 otherwise
  *
+ * Data is copied twice on this path: by recvmsg() into tcp_payload[], then by
+ * sendmsg() into the AF_UNIX socket (in passt mode). Neither copy can be
+ * replaced by zero-copy operations: TCP_ZEROCOPY_RECEIVE and splice() dequeue
+ * data, which we need to keep in the socket until the guest acknowledges it,
+ * TCP_ZEROCOPY_RECEIVE only maps page-aligned payload (not the case for most
+ * NICs, nor for loopback traffic), and AF_UNIX sockets don't implement
+ * MSG_ZEROCOPY. Use vhost-user mode to receive directly into guest memory.
+ *
  * #syscalls recvmsg
  */
 int tcp_buf_data_from_sock(const struct ctx *c, struct tcp_tap_conn *conn,
-			   uint32_t already_sent, const struct timespec *now)
+			   uint32_t already_sent, uint32_t fillsize,
+			   const struct timespec *now)
 {
-	uint32_t wnd_scaled = conn->wnd_from_tap << conn->ws_from_tap;
 	int fill_bufs, send_bufs = 0, last_len, iov_rem = 0;
 	int len, dlen, i, s = conn->sock;
 	struct msghdr mh_sock = { 0 };
-	uint16_t mss = MSS_GET(conn);
 	struct iovec *iov;
+	size_t frame;
 	uint32_t seq;
 
+	frame = tcp_buf_frame_max(c, CONN_V6(conn), MSS_GET(conn));
+
 	/* Set up buffer descriptors we'll fill completely and partially. */
-	fill_bufs = DIV_ROUND_UP(wnd_scaled - already_sent, mss);
+	fill_bufs = DIV_ROUND_UP(fillsize, frame);
 	if (fill_bufs > TCP_FRAMES) {
 		fill_bufs = TCP_FRAMES;
 		iov_rem = 0;
 	} else {
-		iov_rem = (wnd_scaled - already_sent) % mss;
+		iov_rem = fillsize % frame;
+	}
+
+	if (tcp_payload_used + fill_bufs > tcp_frames_batch) {
+		tcp_payload_flush(c, now);
+
+		/* Frames waiting for the tap take up to half the buffers */
+		if (tcp_payload_used + fill_bufs > tcp_frames_max) {
+			fill_bufs = tcp_frames_max - tcp_payload_used;
+			iov_rem = 0;
+		}
 	}
 
 	if (tcp_prepare_iov(&mh_sock, iov_sock, already_sent, fill_bufs)) {
@@ -349,20 +757,17 @@ int tcp_buf_data_from_sock(const struct ctx *c, struct tcp_tap_conn *conn,
 		return -1;
 	}
 
-	if (tcp_payload_used + fill_bufs > TCP_FRAMES_MEM) {
-		tcp_payload_flush(c, now);
-
-		/* Silence Coverity CWE-125 false positive */
-		tcp_payload_used = 0;
-	}
-
 	for (i = 0, iov = iov_sock + DISCARD_IOV_NUM; i < fill_bufs; i++, iov++) {
 		iov->iov_base = &tcp_payload[tcp_payload_used + i].data;
-		iov->iov_len = mss;
+		iov->iov_len = frame;
 	}
 	if (iov_rem)
 		iov_sock[fill_bufs + DISCARD_IOV_NUM - 1].iov_len = iov_rem;
 
+	if (!tcp_payload_timed &&
+	    !clock_gettime(CLOCK_MONOTONIC, &tcp_payload_start))
+		tcp_payload_timed = true;
+
 	/* Receive into buffers, don't dequeue until acknowledged by guest. */
 	do
 		len = recvmsg(s, &mh_sock, MSG_PEEK);
@@ -421,14 +826,16 @@ int tcp_buf_data_from_sock(const struct ctx *c, struct tcp_tap_conn *conn,
 	conn_flag(c, conn, ~ACK_FROM_TAP_BLOCKS, now);
 	conn_flag(c, conn, ~STALLED, now);
 
-	send_bufs = DIV_ROUND_UP(len, mss);
-	last_len = len - (send_bufs - 1) * mss;
+	send_bufs = DIV_ROUND_UP(len, frame);
+	tcp_frames_turns++;
+	last_len = len - (send_bufs - 1) * frame;
+	stats_rx(conn->f.pif[!TAPSIDE(conn)], PESTO_STATS_TCP, send_bufs, len);
 
 	/* Likely, some new data was acked too. */
 	tcp_update_seqack_wnd(c, conn, false, NULL, now);
 
 	/* Finally, queue to tap */
-	dlen = mss;
+	dlen = frame;
 	seq = conn->seq_to_tap;
 	for (i = 0; i < send_bufs; i++) {
 		int no_csum = i && i != send_bufs - 1 && tcp_payload_used;
@@ -439,10 +846,16 @@ int tcp_buf_data_from_sock(const struct ctx *c, struct tcp_tap_conn *conn,
 			push = true;
 		}
 
-		tcp_data_to_tap(c, conn, dlen, no_csum, seq, push, now);
+		tcp_data_to_tap(c, conn, dlen, no_csum, seq, push);
 		seq += dlen;
 	}
 
+	/* Not from tcp_data_to_tap(): frames waiting for the tap might take
+	 * more than a batch already, and we received into following buffers
+	 */
+	if (tcp_payload_used >= tcp_frames_batch)
+		tcp_payload_flush(c, now);
+
 	conn_flag(c, conn, ACK_FROM_TAP_DUE, now);
 
 	return 0;
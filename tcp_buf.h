@@ -8,8 +8,11 @@
 
 void tcp_sock_iov_init(const struct ctx *c);
 void tcp_payload_flush(const struct ctx *c, const struct timespec *now);
+void tcp_buf_release(void);
+void tcp_buf_conn_gone(const struct tcp_tap_conn *conn);
 int tcp_buf_data_from_sock(const struct ctx *c, struct tcp_tap_conn *conn,
-			   uint32_t already_sent, const struct timespec *now);
+			   uint32_t already_sent, uint32_t fillsize,
+			   const struct timespec *now);
 int tcp_buf_send_flag(const struct ctx *c, struct tcp_tap_conn *conn, int flags,
 		      const struct timespec *now);
 
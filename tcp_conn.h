@@ -22,9 +22,10 @@
  * @tap_mss:		MSS advertised by tap/guest, rounded to 2 ^ TCP_MSS_BITS
  * @tapinactive:	No tao activity within the current KEEPALIVE_INTERVAL
  * @inactive:		No activity within the current INACTIVITY_INTERVAL
+ * @fastopen_cookie:	Guest asked for a TCP Fast Open cookie, send in SYN-ACK
+ * @sack:		Guest sent SACK Permitted, we can send SACK blocks
  * @sock:		Socket descriptor number
  * @events:		Connection events, implying connection states
- * @timer:		timerfd descriptor for timeout events
  * @flags:		Connection flags representing internal attributes
  * @sndbuf:		Sending buffer in kernel, rounded to 2 ^ SNDBUF_BITS
  * @seq_dup_ack_approx:	Last duplicate ACK number sent to tap
@@ -35,6 +36,7 @@
  * @seq_from_tap:	Next sequence for packets from tap (not actually sent)
  * @seq_ack_to_tap:	Last ACK number sent to tap
  * @seq_init_from_tap:	Initial sequence number from tap
+ * @seq_wnd_edge:	Sequence from tap filling sending buffer, as last checked
  */
 struct tcp_tap_conn {
 	/* Must be first element */
@@ -66,6 +68,8 @@ struct tcp_tap_conn {
 
 	bool		tap_inactive	:1;
 	bool		inactive	:1;
+	bool		fastopen_cookie	:1;
+	bool		sack		:1;
 
 	int		sock		:FD_REF_BITS;
 
@@ -84,8 +88,6 @@ struct tcp_tap_conn {
 #define	CONN_STATE_BITS		/* Setting these clears other flags */	\
 	(SOCK_ACCEPTED | TAP_SYN_RCVD | ESTABLISHED)
 
-	int		timer		:FD_REF_BITS;
-
 	uint8_t		flags;
 #define STALLED			BIT(0)
 #define LOCAL			BIT(1)
@@ -94,6 +96,7 @@ struct tcp_tap_conn {
 #define ACK_FROM_TAP_DUE	BIT(4)
 #define ACK_FROM_TAP_BLOCKS	BIT(5)
 #define SYN_RETRIED		BIT(6)
+#define ACK_DEFERRED		BIT(7)
 
 #define SNDBUF_BITS		24
 	unsigned int	sndbuf		:SNDBUF_BITS;
@@ -110,8 +113,16 @@ struct tcp_tap_conn {
 	uint32_t	seq_from_tap;
 	uint32_t	seq_ack_to_tap;
 	uint32_t	seq_init_from_tap;
+	uint32_t	seq_wnd_edge;
 };
 
+/* Fields after the generic flow information are used for every frame: keep
+ * them in a single cache line (given cache line aligned flow table entries)
+ */
+static_assert(sizeof(struct flow_common) / CACHE_LINE_SIZE ==
+	      (sizeof(struct tcp_tap_conn) - 1) / CACHE_LINE_SIZE,
+	      "TCP connection state must fit in one cache line");
+
 /**
  * struct tcp_tap_transfer - Migrated TCP data, flow table part, network order
  * @pif:		Interfaces for each side of the flow
@@ -207,6 +218,8 @@ struct tcp_tap_transfer_ext {
  * @s:			File descriptor for sockets
  * @pipe:		File descriptors for pipes
  * @pending:		Bytes currently in each pipe
+ * @rlen:		Moving average of read sizes, each side, bytes
+ * @pipe_log2:		Size of each pipe, as base 2 logarithm of bytes
  * @events:		Events observed/actions performed on connection
  * @flags:		Connection flags (attributes, not events)
  */
@@ -218,6 +231,9 @@ struct tcp_splice_conn {
 	int pipe[SIDES][2];
 
 	uint32_t pending[SIDES];
+	uint16_t rlen[SIDES];
+	uint8_t pipe_log2[SIDES];
+#define PIPE_SIZE(conn, sidei_)		BIT((conn)->pipe_log2[sidei_])
 
 	uint8_t events;
 #define SPLICE_CLOSED			0
@@ -231,13 +247,12 @@ struct tcp_splice_conn {
 #define RCVLOWAT_SET(sidei_)		((sidei_) ? BIT(1) : BIT(0))
 #define RCVLOWAT_ACT(sidei_)		((sidei_) ? BIT(3) : BIT(2))
 #define CLOSING				BIT(4)
+#define PIPE_USED(sidei_)		((sidei_) ? BIT(6) : BIT(5))
 };
 
 /* Socket pools */
-#define TCP_SOCK_POOL_SIZE		32
-
-extern int init_sock_pool4	[TCP_SOCK_POOL_SIZE];
-extern int init_sock_pool6	[TCP_SOCK_POOL_SIZE];
+extern struct sock_pool init_sock_pool4;
+extern struct sock_pool init_sock_pool6;
 
 void tcp_linger0_(const struct flow_common *f, int s);
 #define tcp_linger0(flow_, s_)	tcp_linger0_(&(flow_)->f, (s_))
@@ -255,14 +270,15 @@ int tcp_flow_migrate_source_ext(const struct ctx *c,
 int tcp_flow_migrate_target(struct ctx *c, int fd);
 int tcp_flow_migrate_target_ext(struct ctx *c, struct tcp_tap_conn *conn,
 				int fd, const struct timespec *now);
+void tcp_flow_migrate_target_post(struct ctx *c, struct tcp_tap_conn *conn,
+				  const struct timespec *now);
 
 bool tcp_flow_is_established(const struct tcp_tap_conn *conn);
 
 bool tcp_splice_flow_defer(struct tcp_splice_conn *conn);
 void tcp_splice_timer(struct tcp_splice_conn *conn);
-int tcp_conn_pool_sock(int pool[]);
 int tcp_conn_sock(sa_family_t af);
-int tcp_sock_refill_pool(int pool[], sa_family_t af);
-void tcp_splice_refill(const struct ctx *c);
+int tcp_sock_refill_pool(struct sock_pool *p, sa_family_t af);
+void tcp_splice_refill(const struct ctx *c, bool timer);
 
 #endif /* TCP_CONN_H */
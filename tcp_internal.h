@@ -52,6 +52,10 @@
 #define OPT_SACKP	4
 #define OPT_SACK	5
 #define OPT_TS		8
+#define OPT_FASTOPEN	34	/* RFC 7413 */
+
+/* Size of TCP Fast Open cookies we give to the guest */
+#define TCP_FASTOPEN_COOKIE_SIZE	8
 
 #define TAPSIDE(conn_)		((conn_)->f.pif[1] == PIF_TAP)
 #define TAPFLOW(conn_)		(&((conn_)->f.side[TAPSIDE(conn_)]))
@@ -138,23 +142,64 @@ struct tcp_opt_ws {
 		.shift = (shift_),			\
 	})
 
+/** struct tcp_opt_sackp - TCP SACK Permitted option
+ * @kind:	Option kind (OPT_SACKP == 4)
+ * @len:	Option length
+ */
+struct tcp_opt_sackp {
+	uint8_t kind;
+	uint8_t len;
+} __attribute__ ((packed));
+#define TCP_OPT_SACKP					\
+	((struct tcp_opt_sackp) {			\
+		.kind = OPT_SACKP,			\
+		.len = sizeof(struct tcp_opt_sackp),	\
+	})
+
+/** struct tcp_opt_fastopen - TCP Fast Open Cookie option
+ * @kind:	Option kind (OPT_FASTOPEN == 34)
+ * @len:	Option length
+ * @cookie:	Cookie
+ */
+struct tcp_opt_fastopen {
+	uint8_t kind;
+	uint8_t len;
+	uint8_t cookie[TCP_FASTOPEN_COOKIE_SIZE];
+} __attribute__ ((packed));
+
 /** struct tcp_syn_opts - TCP options we apply to SYN packets
  * @mss:	Maximum Segment Size (MSS) option
  * @nop:	NOP opt (for alignment)
  * @ws:		Window Scaling (WS) option
+ * @nop2:	NOP opts (for alignment)
+ * @sackp:	SACK Permitted option
+ * @nop3:	NOP opts (for alignment), only sent with @fo
+ * @fo:		TCP Fast Open Cookie option, only sent if requested by guest
  */
 struct tcp_syn_opts {
 	struct tcp_opt_mss mss;
 	struct tcp_opt_nop nop;
 	struct tcp_opt_ws ws;
+	struct tcp_opt_nop nop2[2];
+	struct tcp_opt_sackp sackp;
+	struct tcp_opt_nop nop3[2];
+	struct tcp_opt_fastopen fo;
 } __attribute__ ((packed));
 #define TCP_SYN_OPTS(mss_, ws_)				\
 	((struct tcp_syn_opts){				\
 		.mss = TCP_OPT_MSS(mss_),		\
 		.nop = TCP_OPT_NOP,			\
 		.ws = TCP_OPT_WS(ws_),			\
+		.nop2 = { TCP_OPT_NOP, TCP_OPT_NOP },	\
+		.sackp = TCP_OPT_SACKP,			\
+		.nop3 = { TCP_OPT_NOP, TCP_OPT_NOP },	\
+		.fo = { .kind = OPT_FASTOPEN,		\
+			.len = sizeof(struct tcp_opt_fastopen) }, \
 	})
 
+/* Length of SYN options without TCP Fast Open Cookie */
+#define TCP_SYN_OPTS_LEN	offsetof(struct tcp_syn_opts, nop3)
+
 extern char tcp_buf_discard [BUF_DISCARD_SIZE];
 
 void conn_flag_do(const struct ctx *c, struct tcp_tap_conn *conn,
@@ -187,6 +232,7 @@ struct tcp_info_linux;
 #define IP4_CSUM	0x80000000
 #define IP4_CMASK	0x0000FFFF
 #define TCP_CSUM	0x40000000
+#define TCP_CSUM_PARTIAL 0x20000000
 
 size_t tcp_fill_headers(const struct ctx *c, struct tcp_tap_conn *conn,
 			struct ethhdr *eh,
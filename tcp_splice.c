@@ -28,6 +28,21 @@
  * - FIN_SENT_0:		FIN (write shutdown) sent to accepted socket
  * - FIN_SENT_1:		FIN (write shutdown) sent to target socket
  *
+ * Small messages, typical of request-response traffic, are cheaper to forward
+ * with a recv() and a send() through a small buffer than with two splice()
+ * calls through a pipe. Each direction keeps a moving average of read sizes,
+ * and data is copied as long as that's below TCP_SPLICE_COPY_THRESHOLD and the
+ * pipe is empty. Pipes are only taken once a direction goes bulk, or if the
+ * receiving socket doesn't take all the data we copied, and they're released
+ * by the timer once the direction is back to small messages.
+ *
+ * Forwarding entirely in the kernel, with sockets in a BPF sockmap and an sk_skb
+ * verdict program redirecting data, isn't an option: loading such programs
+ * needs CAP_BPF and CAP_NET_ADMIN in the initial user namespace, which pasta
+ * doesn't have in the common, rootless case, and would also take bpf(2) into
+ * our seccomp profile. Data and window updates would also bypass us entirely,
+ * so we couldn't implement half-closes and statistics as we do here.
+ *
  * #syscalls:pasta pipe2|pipe fcntl arm:fcntl64 ppc64:fcntl64|fcntl i686:fcntl64
  */
 
@@ -58,21 +73,29 @@
 #include "epoll_ctl.h"
 
 #include "flow_table.h"
+#include "stats.h"
 
 #define MAX_PIPE_SIZE			(8UL * 1024 * 1024)
+#define MIN_PIPE_SIZE			(64UL * 1024)	/* Default, 4 KiB pages */
 #define TCP_SPLICE_PIPE_POOL_SIZE	32
 #define TCP_SPLICE_CONN_PRESSURE	30	/* % of conn_count */
 #define TCP_SPLICE_FILE_PRESSURE	30	/* % of c->nofile */
+#define TCP_SPLICE_COPY_SIZE		(16UL * 1024)	/* Copy buffer */
+#define TCP_SPLICE_COPY_THRESHOLD	4096	/* Average read, bytes */
 
 /* Pools for pre-opened sockets (in namespace) */
-#define TCP_SOCK_POOL_TSH		16 /* Refill in ns if > x used */
-
-static int ns_sock_pool4	[TCP_SOCK_POOL_SIZE];
-static int ns_sock_pool6	[TCP_SOCK_POOL_SIZE];
+static struct sock_pool ns_sock_pool4;
+static struct sock_pool ns_sock_pool6;
 
 /* Pool of pre-opened pipes */
 static int splice_pipe_pool		[TCP_SPLICE_PIPE_POOL_SIZE][2];
 
+/* Usable size of pipes, probed on first use, 0 if not probed yet */
+static size_t splice_pipe_size;
+
+/* Buffer for small messages, see tcp_splice_copy() */
+static uint8_t splice_copy_buf[TCP_SPLICE_COPY_SIZE];
+
 #define CONN_HAS(conn, set)		(((conn)->events & (set)) == (set))
 
 /* Display strings for connection events */
@@ -83,11 +106,12 @@ static const char *tcp_splice_event_str[] __attribute((__unused__)) = {
 
 /* Display strings for connection flags */
 static const char *tcp_splice_flag_str[] __attribute((__unused__)) = {
-	"SPLICE_V6", "RCVLOWAT_SET_0", "RCVLOWAT_SET_1", "RCVLOWAT_ACT_0",
-	"RCVLOWAT_ACT_1", "CLOSING",
+	"RCVLOWAT_SET_0", "RCVLOWAT_SET_1", "RCVLOWAT_ACT_0", "RCVLOWAT_ACT_1",
+	"CLOSING", "PIPE_USED_0", "PIPE_USED_1",
 };
 
 /* Forward declaration */
+static size_t tcp_splice_pipe_size(void);
 static int tcp_sock_refill_ns(void *arg);
 static int tcp_conn_sock_ns(const struct ctx *c, sa_family_t af);
 
@@ -190,6 +214,7 @@ static void conn_flag_do(struct tcp_splice_conn *conn,
 	if (flag == CLOSING) {
 		epoll_del(flow_epollfd(&conn->f), conn->s[0]);
 		epoll_del(flow_epollfd(&conn->f), conn->s[1]);
+		flow_defer(&conn->f);
 	}
 }
 
@@ -256,6 +281,23 @@ static void tcp_splice_rst(struct tcp_splice_conn *conn)
 	conn_flag(conn, CLOSING);
 }
 
+/**
+ * tcp_splice_pipe_mem() - Account for pipe in memory usage statistics
+ * @conn:	Connection pointer
+ * @sidei:	Side data is read from, selecting the pipe
+ * @hold:	Pipe of current size is now held, otherwise it's released
+ */
+static void tcp_splice_pipe_mem(const struct tcp_splice_conn *conn,
+				unsigned sidei, bool hold)
+{
+	uint64_t *mem = &passt_stats.mem[STATS_MEM_SPLICE_PIPE];
+
+	if (hold)
+		*mem += PIPE_SIZE(conn, sidei);
+	else
+		*mem -= PIPE_SIZE(conn, sidei);
+}
+
 /**
  * tcp_splice_flow_defer() - Deferred per-flow handling (clean up closed)
  * @conn:	Connection entry to handle
@@ -275,6 +317,7 @@ bool tcp_splice_flow_defer(struct tcp_splice_conn *conn)
 			close(conn->pipe[sidei][0]);
 			close(conn->pipe[sidei][1]);
 			conn->pipe[sidei][0] = conn->pipe[sidei][1] = -1;
+			tcp_splice_pipe_mem(conn, sidei, false);
 		}
 
 		if (conn->s[sidei] >= 0) {
@@ -283,6 +326,7 @@ bool tcp_splice_flow_defer(struct tcp_splice_conn *conn)
 		}
 
 		conn->pending[sidei] = 0;
+		conn->rlen[sidei] = 0;
 	}
 
 	conn->events = SPLICE_CLOSED;
@@ -292,49 +336,87 @@ bool tcp_splice_flow_defer(struct tcp_splice_conn *conn)
 	return true;
 }
 
+/**
+ * tcp_splice_pipe_resize() - Try to resize pipe for one direction
+ * @conn:	Connection pointer
+ * @sidei:	Side data is read from, selecting the pipe
+ * @size:	New size, bytes
+ *
+ * Return: 0 on success, -1 if the size couldn't be changed
+ */
+static int tcp_splice_pipe_resize(struct tcp_splice_conn *conn, unsigned sidei,
+				  size_t size)
+{
+	int rc = fcntl(conn->pipe[sidei][0], F_SETPIPE_SZ, size);
+
+	if (rc < 0) {
+		flow_trace(conn, "cannot set %d->%d pipe size to %zu",
+			   sidei, !sidei, size);
+		return -1;
+	}
+
+	flow_trace(conn, "%d->%d pipe size %zu -> %i", sidei, !sidei,
+		   PIPE_SIZE(conn, sidei), rc);
+	tcp_splice_pipe_mem(conn, sidei, false);
+	conn->pipe_log2[sidei] = ilog2(rc);
+	tcp_splice_pipe_mem(conn, sidei, true);
+	return 0;
+}
+
+/**
+ * tcp_splice_pipe_get() - Get pipe for one direction, if we don't have one yet
+ * @conn:	Connection pointer
+ * @sidei:	Side data is read from, selecting the pipe
+ * @now:	Current timestamp
+ *
+ * Return: 0 on success, -EIO on failure
+ */
+static int tcp_splice_pipe_get(struct tcp_splice_conn *conn, unsigned sidei,
+			       const struct timespec *now)
+{
+	int i;
+
+	if (conn->pipe[sidei][0] >= 0)
+		return 0;
+
+	for (i = 0; i < TCP_SPLICE_PIPE_POOL_SIZE; i++) {
+		if (splice_pipe_pool[i][0] >= 0) {
+			SWAP(conn->pipe[sidei][0], splice_pipe_pool[i][0]);
+			SWAP(conn->pipe[sidei][1], splice_pipe_pool[i][1]);
+			tcp_splice_pipe_mem(conn, sidei, true);
+			return 0;
+		}
+	}
+
+	if (pipe2(conn->pipe[sidei], O_NONBLOCK | O_CLOEXEC)) {
+		flow_perror_ratelimit(conn, now, "cannot create %d->%d pipe",
+				      sidei, !sidei);
+		return -EIO;
+	}
+
+	tcp_splice_pipe_mem(conn, sidei, true);
+	tcp_splice_pipe_resize(conn, sidei, PIPE_SIZE(conn, sidei));
+	return 0;
+}
+
 /**
  * tcp_splice_connect_finish() - Completion of connect() or call on success
- * @c:		Execution context
  * @conn:	Connection pointer
  * @now:	Current timestamp
  *
  * Return: 0 on success, -EIO on failure
  */
-static int tcp_splice_connect_finish(const struct ctx *c,
-				     struct tcp_splice_conn *conn,
+static int tcp_splice_connect_finish(struct tcp_splice_conn *conn,
 				     const struct timespec *now)
 {
 	unsigned sidei;
-	int i = 0;
 
+	/* Start small, pipes grow as data fills them up. We only get them once
+	 * a direction needs them, see tcp_splice_pipe_get()
+	 */
 	flow_foreach_sidei(sidei) {
-		for (; i < TCP_SPLICE_PIPE_POOL_SIZE; i++) {
-			if (splice_pipe_pool[i][0] >= 0) {
-				SWAP(conn->pipe[sidei][0],
-				     splice_pipe_pool[i][0]);
-				SWAP(conn->pipe[sidei][1],
-				     splice_pipe_pool[i][1]);
-				break;
-			}
-		}
-
-		if (conn->pipe[sidei][0] < 0) {
-			if (pipe2(conn->pipe[sidei], O_NONBLOCK | O_CLOEXEC)) {
-				flow_perror_ratelimit(
-					conn, now,
-					"cannot create %d->%d pipe",
-					sidei, !sidei);
-				tcp_splice_rst(conn);
-				return -EIO;
-			}
-
-			if (fcntl(conn->pipe[sidei][0], F_SETPIPE_SZ,
-				  c->tcp.pipe_size) != (int)c->tcp.pipe_size) {
-				flow_trace(conn,
-					   "cannot set %d->%d pipe size to %zu",
-					   sidei, !sidei, c->tcp.pipe_size);
-			}
-		}
+		conn->pipe_log2[sidei] = ilog2(MIN(tcp_splice_pipe_size(),
+						   MIN_PIPE_SIZE));
 	}
 
 	if (!(conn->events & SPLICE_ESTABLISHED))
@@ -385,9 +467,14 @@ static int tcp_splice_connect(const struct ctx *c, struct tcp_splice_conn *conn,
 			   conn->s[1]);
 	}
 
+	if (fwd_tune_sock(flow_tune(&conn->f), conn->s[1], IPPROTO_TCP)) {
+		flow_trace(conn, "failed to set socket options on socket %i",
+			   conn->s[1]);
+	}
+
 	pif_sockaddr(c, &sa, tgtpif, &tgt->eaddr, tgt->eport);
 
-	flow_epollid_set(&conn->f, EPOLLFD_ID_DEFAULT);
+	flow_epollid_assign(c, &conn->f);
 	if (flow_epoll_set(&conn->f, EPOLL_CTL_ADD, 0, conn->s[0], 0) ||
 	    flow_epoll_set(&conn->f, EPOLL_CTL_ADD, 0, conn->s[1], 1)) {
 		int ret = -errno;
@@ -405,7 +492,7 @@ static int tcp_splice_connect(const struct ctx *c, struct tcp_splice_conn *conn,
 		}
 	} else {
 		conn_event(conn, SPLICE_ESTABLISHED, now);
-		return tcp_splice_connect_finish(c, conn, now);
+		return tcp_splice_connect_finish(conn, now);
 	}
 
 	return 0;
@@ -420,10 +507,10 @@ static int tcp_splice_connect(const struct ctx *c, struct tcp_splice_conn *conn,
  */
 static int tcp_conn_sock_ns(const struct ctx *c, sa_family_t af)
 {
-	int *p = af == AF_INET6 ? ns_sock_pool6 : ns_sock_pool4;
+	struct sock_pool *p = af == AF_INET6 ? &ns_sock_pool6 : &ns_sock_pool4;
 	int s;
 
-	if ((s = tcp_conn_pool_sock(p)) >= 0)
+	if ((s = sock_pool_get(p)) >= 0)
 		return s;
 
 	/* If the pool is empty we have to incur the latency of entering the ns.
@@ -432,7 +519,7 @@ static int tcp_conn_sock_ns(const struct ctx *c, sa_family_t af)
 	 */
 	NS_CALL(tcp_sock_refill_ns, c);
 
-	if ((s = tcp_conn_pool_sock(p)) >= 0)
+	if ((s = sock_pool_get(p)) >= 0)
 		return s;
 
 	err("TCP: No available ns sockets for new connection");
@@ -461,6 +548,7 @@ void tcp_splice_conn_from_sock(const struct ctx *c, union flow *flow, int s0,
 	conn->s[1] = -1;
 	conn->pipe[0][0] = conn->pipe[0][1] = -1;
 	conn->pipe[1][0] = conn->pipe[1][1] = -1;
+	conn->rlen[0] = conn->rlen[1] = 0;
 
 	if (setsockopt(s0, SOL_TCP, TCP_QUICKACK, &((int){ 1 }), sizeof(int)))
 		flow_trace(conn, "failed to set TCP_QUICKACK on %i", s0);
@@ -471,9 +559,107 @@ void tcp_splice_conn_from_sock(const struct ctx *c, union flow *flow, int s0,
 	FLOW_ACTIVATE(conn);
 }
 
+/**
+ * tcp_splice_rlen() - Update moving average of read sizes for one direction
+ * @conn:	Connection pointer
+ * @sidei:	Side data was read from
+ * @len:	Bytes read
+ */
+static void tcp_splice_rlen(struct tcp_splice_conn *conn, unsigned sidei,
+			    size_t len)
+{
+	int avg = conn->rlen[sidei];
+
+	avg += ((int)MIN(len, UINT16_MAX) - avg) / 4;
+	conn->rlen[sidei] = avg;
+}
+
+/**
+ * tcp_splice_copy() - Forward small messages in one direction by copying
+ * @conn:	Connection to forward data for
+ * @fromsidei:	Side to forward data from
+ * @now:	Current timestamp
+ *
+ * Return: 0 if there's nothing more to read for now, 1 if the caller should go
+ *	   on with splice(), -1 on error (connection should be reset)
+ *
+ * If the receiving socket doesn't take everything we read, we move the rest to
+ * the pipe and let tcp_splice_forward() drain it.
+ */
+static int tcp_splice_copy(struct tcp_splice_conn *conn, unsigned fromsidei,
+			   const struct timespec *now)
+{
+	uint8_t *buf = splice_copy_buf;
+
+	while (conn->rlen[fromsidei] < TCP_SPLICE_COPY_THRESHOLD) {
+		ssize_t readlen, written;
+
+		do
+			readlen = recv(conn->s[fromsidei], buf,
+				       TCP_SPLICE_COPY_SIZE, MSG_DONTWAIT);
+		while (readlen < 0 && errno == EINTR);
+
+		if (readlen < 0 && errno != EAGAIN) {
+			flow_perror_ratelimit(
+				conn, now, "Reading from %s socket",
+				pif_name(conn->f.pif[fromsidei]));
+			return -1;
+		}
+
+		flow_trace(conn, "%zi from read-side copy", readlen);
+
+		if (readlen <= 0) {
+			if (!readlen) /* EOF */
+				conn_event(conn, FIN_RCVD(fromsidei), now);
+			return 0;
+		}
+
+		tcp_splice_rlen(conn, fromsidei, readlen);
+		stats_rx(conn->f.pif[fromsidei], PESTO_STATS_TCP, 1, readlen);
+
+		if (conn->flags & RCVLOWAT_SET(fromsidei))
+			conn_flag(conn, RCVLOWAT_ACT(fromsidei));
+
+		do
+			written = send(conn->s[!fromsidei], buf, readlen,
+				       MSG_DONTWAIT | MSG_NOSIGNAL);
+		while (written < 0 && errno == EINTR);
+
+		if (written < 0) {
+			if (errno != EAGAIN) {
+				flow_perror_ratelimit(
+					conn, now, "Writing to %s socket",
+					pif_name(conn->f.pif[!fromsidei]));
+				return -1;
+			}
+			written = 0;
+		}
+
+		if (written < readlen) {
+			ssize_t left = readlen - written;
+
+			if (tcp_splice_pipe_get(conn, fromsidei, now))
+				return -1;
+
+			/* Pipes are bigger than our buffer, this can't block */
+			if (write(conn->pipe[fromsidei][1], buf + written,
+				  left) != left) {
+				flow_perror_ratelimit(conn, now,
+						      "Writing to pipe");
+				return -1;
+			}
+
+			conn->pending[fromsidei] += left;
+			conn_flag(conn, PIPE_USED(fromsidei));
+			return 1;
+		}
+	}
+
+	return 1;
+}
+
 /**
  * tcp_splice_forward() - Forward data in one direction using splice()
- * @c:		Execution context
  * @conn:	Connection to forward data for
  * @fromsidei:	Side to forward data from
  * @now:	Current timestamp
@@ -482,12 +668,26 @@ void tcp_splice_conn_from_sock(const struct ctx *c, union flow *flow, int s0,
  *
  * #syscalls:pasta splice
  */
-static int tcp_splice_forward(struct ctx *c,
-			      struct tcp_splice_conn *conn, unsigned fromsidei,
+static int tcp_splice_forward(struct tcp_splice_conn *conn, unsigned fromsidei,
 			      const struct timespec *now)
 {
 	uint8_t lowat_set_flag = RCVLOWAT_SET(fromsidei);
 	uint8_t lowat_act_flag = RCVLOWAT_ACT(fromsidei);
+	size_t size = PIPE_SIZE(conn, fromsidei);
+	bool full = false;
+
+	if (!conn->pending[fromsidei] &&
+	    conn->rlen[fromsidei] < TCP_SPLICE_COPY_THRESHOLD) {
+		int rc = tcp_splice_copy(conn, fromsidei, now);
+
+		if (rc < 0)
+			return -1;
+		if (!rc)
+			goto out;
+	}
+
+	if (tcp_splice_pipe_get(conn, fromsidei, now))
+		return -1;
 
 	while (1) {
 		ssize_t readlen, written;
@@ -495,8 +695,7 @@ static int tcp_splice_forward(struct ctx *c,
 
 		do
 			readlen = splice(conn->s[fromsidei], NULL,
-					 conn->pipe[fromsidei][1], NULL,
-					 c->tcp.pipe_size,
+					 conn->pipe[fromsidei][1], NULL, size,
 					 SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
 		while (readlen < 0 && errno == EINTR);
 
@@ -521,18 +720,24 @@ static int tcp_splice_forward(struct ctx *c,
 				break;
 		} else {
 			conn->pending[fromsidei] += readlen;
+			tcp_splice_rlen(conn, fromsidei, readlen);
+			stats_rx(conn->f.pif[fromsidei], PESTO_STATS_TCP, 1,
+				 readlen);
 
-			if (readlen >= (long)c->tcp.pipe_size * 90 / 100)
+			if (readlen >= (long)size * 90 / 100) {
 				more = SPLICE_F_MORE;
+				full = true;
+			}
 
 			if (conn->flags & lowat_set_flag)
 				conn_flag(conn, lowat_act_flag);
+
+			conn_flag(conn, PIPE_USED(fromsidei));
 		}
 
 		do
 			written = splice(conn->pipe[fromsidei][0], NULL,
-					 conn->s[!fromsidei], NULL,
-					 c->tcp.pipe_size,
+					 conn->s[!fromsidei], NULL, size,
 					 SPLICE_F_MOVE | more | SPLICE_F_NONBLOCK);
 		while (written < 0 && errno == EINTR);
 
@@ -544,7 +749,7 @@ static int tcp_splice_forward(struct ctx *c,
 		}
 
 		flow_trace(conn, "%zi from write-side call (passed %zi)",
-			   written, c->tcp.pipe_size);
+			   written, size);
 
 		if (written < 0)
 			break;
@@ -559,6 +764,13 @@ static int tcp_splice_forward(struct ctx *c,
 		}
 	}
 
+	/* The pipe filled up in one go, so it's probably limiting throughput:
+	 * try to double it, up to the size we probed at start
+	 */
+	if (full && size < tcp_splice_pipe_size())
+		tcp_splice_pipe_resize(conn, fromsidei, size * 2);
+
+out:
 	/* We need write-side wakeups if and only if we have data in the pipe to
 	 * drain.
 	 */
@@ -583,13 +795,12 @@ static int tcp_splice_forward(struct ctx *c,
 
 /**
  * tcp_splice_sock_handler() - Handler for socket mapped to spliced connection
- * @c:		Execution context
  * @ref:	epoll reference
  * @events:	epoll events bitmap
  * @now:	Current timestamp
  */
-void tcp_splice_sock_handler(struct ctx *c, union epoll_ref ref,
-			     uint32_t events, const struct timespec *now)
+void tcp_splice_sock_handler(union epoll_ref ref, uint32_t events,
+			     const struct timespec *now)
 {
 	struct tcp_splice_conn *conn = conn_at_sidx(ref.flowside);
 	unsigned evsidei = ref.flowside.sidei;
@@ -623,17 +834,17 @@ void tcp_splice_sock_handler(struct ctx *c, union epoll_ref ref,
 				events);
 			goto reset;
 		}
-		if (tcp_splice_connect_finish(c, conn, now))
+		if (tcp_splice_connect_finish(conn, now))
 			goto reset;
 	}
 
 	if (events & EPOLLOUT) {
-		if (tcp_splice_forward(c, conn, !evsidei, now))
+		if (tcp_splice_forward(conn, !evsidei, now))
 			goto reset;
 	}
 
 	if (events & (EPOLLIN | EPOLLRDHUP)) {
-		if (tcp_splice_forward(c, conn, evsidei, now))
+		if (tcp_splice_forward(conn, evsidei, now))
 			goto reset;
 	}
 
@@ -656,14 +867,22 @@ reset:
 }
 
 /**
- * tcp_set_pipe_size() - Set usable pipe size, probe starting from MAX_PIPE_SIZE
- * @c:		Execution context
+ * tcp_splice_pipe_size() - Get usable pipe size, probe it on first call
+ *
+ * Probing takes a while, as we need to set the size of a full pool of pipes,
+ * starting from MAX_PIPE_SIZE: don't do that at start, as we might not even
+ * need spliced connections.
+ *
+ * Return: size we can set for all the pipes in the pool
  */
-static void tcp_set_pipe_size(struct ctx *c)
+static size_t tcp_splice_pipe_size(void)
 {
 	int probe_pipe[TCP_SPLICE_PIPE_POOL_SIZE][2], i, j;
 
-	c->tcp.pipe_size = MAX_PIPE_SIZE;
+	if (splice_pipe_size)
+		return splice_pipe_size;
+
+	splice_pipe_size = MAX_PIPE_SIZE;
 
 smaller:
 	for (i = 0; i < TCP_SPLICE_PIPE_POOL_SIZE; i++) {
@@ -672,7 +891,7 @@ smaller:
 			break;
 		}
 
-		if (fcntl(probe_pipe[i][0], F_SETPIPE_SZ, c->tcp.pipe_size) < 0)
+		if (fcntl(probe_pipe[i][0], F_SETPIPE_SZ, splice_pipe_size) < 0)
 			break;
 	}
 
@@ -682,11 +901,11 @@ smaller:
 	}
 
 	if (i == TCP_SPLICE_PIPE_POOL_SIZE)
-		return;
+		return splice_pipe_size;
 
-	if (!(c->tcp.pipe_size /= 2)) {
-		c->tcp.pipe_size = MAX_PIPE_SIZE;
-		return;
+	if (!(splice_pipe_size /= 2)) {
+		splice_pipe_size = MAX_PIPE_SIZE;
+		return splice_pipe_size;
 	}
 
 	goto smaller;
@@ -696,20 +915,25 @@ smaller:
  * tcp_splice_pipe_refill() - Refill pool of pre-opened pipes
  * @c:		Execution context
  */
-static void tcp_splice_pipe_refill(const struct ctx *c)
+static void tcp_splice_pipe_refill(void)
 {
+	size_t size = MIN(splice_pipe_size, MIN_PIPE_SIZE);
 	int i;
 
+	/* No spliced connections yet, don't probe pipe size just for this */
+	if (!splice_pipe_size)
+		return;
+
 	for (i = 0; i < TCP_SPLICE_PIPE_POOL_SIZE; i++) {
 		if (splice_pipe_pool[i][0] >= 0)
 			break;
 		if (pipe2(splice_pipe_pool[i], O_NONBLOCK | O_CLOEXEC))
 			continue;
 
-		if (fcntl(splice_pipe_pool[i][0], F_SETPIPE_SZ,
-			  c->tcp.pipe_size) != (int)c->tcp.pipe_size) {
+		if (fcntl(splice_pipe_pool[i][0], F_SETPIPE_SZ, size) !=
+		    (int)size) {
 			trace("TCP (spliced): cannot set pool pipe size to %zu",
-			      c->tcp.pipe_size);
+			      size);
 		}
 	}
 }
@@ -728,13 +952,13 @@ static int tcp_sock_refill_ns(void *arg)
 	ns_enter(c);
 
 	if (c->ifi4) {
-		int rc = tcp_sock_refill_pool(ns_sock_pool4, AF_INET);
+		int rc = tcp_sock_refill_pool(&ns_sock_pool4, AF_INET);
 		if (rc < 0)
 			warn("TCP: Error refilling IPv4 ns socket pool: %s",
 			     strerror_(-rc));
 	}
 	if (c->ifi6) {
-		int rc = tcp_sock_refill_pool(ns_sock_pool6, AF_INET6);
+		int rc = tcp_sock_refill_pool(&ns_sock_pool6, AF_INET6);
 		if (rc < 0)
 			warn("TCP: Error refilling IPv6 ns socket pool: %s",
 			     strerror_(-rc));
@@ -746,28 +970,35 @@ static int tcp_sock_refill_ns(void *arg)
 /**
  * tcp_splice_refill() - Refill pools of resources needed for splicing
  * @c:		Execution context
+ * @timer:	Called from timer: resize socket pools
  */
-void tcp_splice_refill(const struct ctx *c)
+void tcp_splice_refill(const struct ctx *c, bool timer)
 {
-	if ((c->ifi4 && ns_sock_pool4[TCP_SOCK_POOL_TSH] < 0) ||
-	    (c->ifi6 && ns_sock_pool6[TCP_SOCK_POOL_TSH] < 0))
+	if (timer) {
+		sock_pool_resize(&ns_sock_pool4);
+		sock_pool_resize(&ns_sock_pool6);
+	}
+
+	/* Entering the namespace is expensive: refill only if half empty */
+	if ((c->ifi4 && sock_pool_low(&ns_sock_pool4)) ||
+	    (c->ifi6 && sock_pool_low(&ns_sock_pool6)))
 		NS_CALL(tcp_sock_refill_ns, c);
 
-	tcp_splice_pipe_refill(c);
+	tcp_splice_pipe_refill();
 }
 
 /**
- * tcp_splice_init() - Initialise pipe pool and size
- * @c:		Execution context
+ * tcp_splice_init() - Initialise pools of pipes and sockets, filled later
  */
-void tcp_splice_init(struct ctx *c)
+void tcp_splice_init(void)
 {
 	memset(splice_pipe_pool, 0xff, sizeof(splice_pipe_pool));
-	tcp_set_pipe_size(c);
 
-	memset(&ns_sock_pool4,		0xff,	sizeof(ns_sock_pool4));
-	memset(&ns_sock_pool6,		0xff,	sizeof(ns_sock_pool6));
-	NS_CALL(tcp_sock_refill_ns, c);
+	/* Entering the namespace is expensive: leave it to tcp_splice_refill()
+	 * or the first connection, so that we're ready for the guest earlier
+	 */
+	sock_pool_init(&ns_sock_pool4);
+	sock_pool_init(&ns_sock_pool6);
 }
 
 /**
@@ -776,10 +1007,35 @@ void tcp_splice_init(struct ctx *c)
  */
 void tcp_splice_timer(struct tcp_splice_conn *conn)
 {
+	size_t min = MIN(tcp_splice_pipe_size(), MIN_PIPE_SIZE);
 	unsigned sidei;
 
 	assert(!(conn->flags & CLOSING));
 
+	/* Release empty pipes if no data went through them since the last timer
+	 * run, and the direction is back to small messages. Otherwise, shrink
+	 * them back, so that idle connections don't pin large buffers
+	 */
+	flow_foreach_sidei(sidei) {
+		bool used = conn->flags & PIPE_USED(sidei);
+		int *p = conn->pipe[sidei];
+
+		conn_flag(conn, ~PIPE_USED(sidei));
+
+		if (p[0] < 0 || used || conn->pending[sidei])
+			continue;
+
+		if (conn->rlen[sidei] < TCP_SPLICE_COPY_THRESHOLD) {
+			close(p[0]);
+			close(p[1]);
+			p[0] = p[1] = -1;
+			tcp_splice_pipe_mem(conn, sidei, false);
+			conn->pipe_log2[sidei] = ilog2(min);
+		} else if (PIPE_SIZE(conn, sidei) > min) {
+			tcp_splice_pipe_resize(conn, sidei, min);
+		}
+	}
+
 	flow_foreach_sidei(sidei) {
 		if ((conn->flags & RCVLOWAT_SET(sidei)) &&
 		    !(conn->flags & RCVLOWAT_ACT(sidei))) {
@@ -11,10 +11,10 @@
 struct tcp_splice_conn;
 union sockaddr_inany;
 
-void tcp_splice_sock_handler(struct ctx *c, union epoll_ref ref,
-			     uint32_t events, const struct timespec *now);
+void tcp_splice_sock_handler(union epoll_ref ref, uint32_t events,
+			     const struct timespec *now);
 void tcp_splice_conn_from_sock(const struct ctx *c, union flow *flow, int s0,
 			       const struct timespec *now);
-void tcp_splice_init(struct ctx *c);
+void tcp_splice_init(void);
 
 #endif /* TCP_SPLICE_H */
@@ -33,6 +33,7 @@
 #include "tcp_internal.h"
 #include "checksum.h"
 #include "vu_common.h"
+#include "stats.h"
 #include <time.h>
 
 static struct iovec iov_vu[VIRTQUEUE_MAX_SIZE];
@@ -74,6 +75,28 @@ static size_t tcp_vu_hdrlen(bool v6)
 	return hdrlen;
 }
 
+/**
+ * tcp_vu_frame_max() - Maximum payload we can place in a single guest frame
+ * @vdev:	vhost-user device
+ * @v6:		Set for IPv6 connections
+ * @mss:	Maximum segment size announced by the guest
+ *
+ * Return: @mss, or, if the guest negotiated TCP segmentation offload for this
+ *         IP version, the largest multiple of @mss fitting in an IP packet
+ */
+static size_t tcp_vu_frame_max(const struct vu_dev *vdev, bool v6,
+			       uint16_t mss)
+{
+	unsigned int fbit = v6 ? VIRTIO_NET_F_GUEST_TSO6 :
+				 VIRTIO_NET_F_GUEST_TSO4;
+	size_t max = v6 ? MSS6 : MSS4;
+
+	if (!mss || mss >= max || !vu_has_feature(vdev, fbit))
+		return mss;
+
+	return max - max % mss;
+}
+
 /**
  * tcp_vu_send_dup() - Duplicate a frame into a new virtqueue element
  * @c:		Execution context
@@ -126,7 +149,7 @@ int tcp_vu_send_flag(const struct ctx *c, struct tcp_tap_conn *conn, int flags,
 		     const struct timespec *now)
 {
 	struct vu_dev *vdev = c->vdev;
-	struct vu_virtq *vq = &vdev->vq[VHOST_USER_RX_QUEUE];
+	struct vu_virtq *vq = vu_rx_queue(vdev, FLOW_IDX(conn));
 	size_t optlen, hdrlen, iov_cnt, iov_used;
 	struct vu_virtq_element flags_elem[2];
 	struct iov_tail payload, l2frame;
@@ -136,6 +159,7 @@ int tcp_vu_send_flag(const struct ctx *c, struct tcp_tap_conn *conn, int flags,
 	struct tcp_syn_opts opts;
 	struct tcphdr th = { 0 };
 	struct ipv6hdr ip6h;
+	struct vu_hash hash;
 	struct iphdr ip4h;
 	struct ethhdr eh;
 	uint32_t seq;
@@ -205,13 +229,15 @@ int tcp_vu_send_flag(const struct ctx *c, struct tcp_tap_conn *conn, int flags,
 					       flags_elem[0].in_sg, iov_cnt,
 					       hdrlen + optlen);
 	}
-	vu_flush(vdev, vq, flags_elem, elem_cnt, hdrlen + optlen);
+	hash = vu_hash_flow(FLOW_IDX(conn), IPPROTO_TCP, CONN_V6(conn));
+	vu_flush_hdr(vdev, vq, flags_elem, elem_cnt, hdrlen + optlen,
+		     &VU_HEADER, &hash);
 	if (dup_elem_cnt) {
-		vu_flush(vdev, vq, &flags_elem[elem_cnt], dup_elem_cnt,
-			 hdrlen + optlen);
+		vu_flush_hdr(vdev, vq, &flags_elem[elem_cnt], dup_elem_cnt,
+			     hdrlen + optlen, &VU_HEADER, &hash);
 	}
 
-	vu_queue_notify(vdev, vq);
+	vu_queue_notify_defer(vq);
 
 	return 0;
 }
@@ -236,15 +262,16 @@ static ssize_t tcp_vu_sock_recv(const struct ctx *c, struct vu_virtq *vq,
 {
 	static struct iovec iov_msg[VIRTQUEUE_MAX_SIZE + DISCARD_IOV_NUM];
 	const struct vu_dev *vdev = c->vdev;
+	size_t hdrlen, iov_used, frame_max;
 	struct msghdr mh_sock = { 0 };
 	uint16_t mss = MSS_GET(conn);
-	size_t hdrlen, iov_used;
 	int s = conn->sock;
 	ssize_t ret, dlen;
 	int elem_cnt;
 	int i, j;
 
 	hdrlen = tcp_vu_hdrlen(v6);
+	frame_max = tcp_vu_frame_max(vdev, v6, mss);
 
 	*elem_used = 0;
 
@@ -261,7 +288,7 @@ static ssize_t tcp_vu_sock_recv(const struct ctx *c, struct vu_virtq *vq,
 				 ARRAY_SIZE(elem) - elem_cnt,
 				 &iov_vu[iov_used],
 				 ARRAY_SIZE(iov_vu) - iov_used, &in_total,
-				 MIN(mss, fillsize) + hdrlen,
+				 MIN(frame_max, fillsize) + hdrlen,
 				 &frame_size);
 		if (cnt == 0)
 			break;
@@ -426,19 +453,23 @@ static void tcp_vu_prepare(const struct ctx *c, struct tcp_tap_conn *conn,
  * @c:		Execution context
  * @conn:	Connection pointer
  * @already_sent:	Number of bytes already sent to tap, but not acked
+ * @fillsize:	Maximum bytes to send, within guest-side receiving window
  * @now:	Current timestamp
  *
  * Return: negative on connection reset, 0 otherwise
  */
 int tcp_vu_data_from_sock(const struct ctx *c, struct tcp_tap_conn *conn,
-			  uint32_t already_sent, const struct timespec *now)
+			  uint32_t already_sent, uint32_t fillsize,
+			  const struct timespec *now)
 {
-	uint32_t wnd_scaled = conn->wnd_from_tap << conn->ws_from_tap;
 	struct vu_dev *vdev = c->vdev;
-	struct vu_virtq *vq = &vdev->vq[VHOST_USER_RX_QUEUE];
+	struct vu_virtq *vq = vu_rx_queue(vdev, FLOW_IDX(conn));
+	struct virtio_net_hdr vnethdr = VU_HEADER;
+	uint16_t mss = MSS_GET(conn);
 	ssize_t len, previous_dlen;
 	int i, elem_cnt, frame_cnt;
-	size_t hdrlen, fillsize;
+	struct vu_hash hash;
+	size_t hdrlen;
 	int v6 = CONN_V6(conn);
 	uint32_t check;
 
@@ -447,10 +478,6 @@ int tcp_vu_data_from_sock(const struct ctx *c, struct tcp_tap_conn *conn,
 		return 0;
 	}
 
-	/* Set up buffer descriptors we'll fill completely and partially. */
-
-	fillsize = wnd_scaled - already_sent;
-
 	/* collect the buffers from vhost-user and fill them with the
 	 * data from the socket
 	 */
@@ -494,6 +521,7 @@ int tcp_vu_data_from_sock(const struct ctx *c, struct tcp_tap_conn *conn,
 
 	conn_flag(c, conn, ~ACK_FROM_TAP_BLOCKS, now);
 	conn_flag(c, conn, ~STALLED, now);
+	stats_rx(conn->f.pif[!TAPSIDE(conn)], PESTO_STATS_TCP, frame_cnt, len);
 
 	/* Likely, some new data was acked too. */
 	tcp_update_seqack_wnd(c, conn, false, NULL, now);
@@ -507,6 +535,7 @@ int tcp_vu_data_from_sock(const struct ctx *c, struct tcp_tap_conn *conn,
 	 */
 
 	hdrlen = tcp_vu_hdrlen(v6);
+	hash = vu_hash_flow(FLOW_IDX(conn), IPPROTO_TCP, v6);
 	check = IP4_CSUM;
 	if (*c->pcap || !vu_has_feature(vdev, VIRTIO_NET_F_GUEST_CSUM))
 		check |= TCP_CSUM;
@@ -533,12 +562,25 @@ int tcp_vu_data_from_sock(const struct ctx *c, struct tcp_tap_conn *conn,
 			pcap_iov(iov, iov_cnt, VNET_HLEN,
 				 dlen + hdrlen - VNET_HLEN);
 		}
-		vu_flush(vdev, vq, &elem[frame[i].idx_element],
-			 frame[i].num_element, dlen + hdrlen);
+
+		/* Super-frame, guest negotiated TSO: let it segment */
+		if (dlen > mss) {
+			vnethdr.gso_type = v6 ? VIRTIO_NET_HDR_GSO_TCPV6 :
+						VIRTIO_NET_HDR_GSO_TCPV4;
+			vnethdr.gso_size = htole16(mss);
+			vnethdr.hdr_len = htole16(hdrlen - VNET_HLEN);
+		} else {
+			vnethdr = VU_HEADER;
+		}
+
+		vu_fill_hdr(vdev, vq, &elem[frame[i].idx_element],
+			    frame[i].num_element, dlen + hdrlen, &vnethdr,
+			    &hash, frame[i].idx_element);
 
 		conn->seq_to_tap += dlen;
 	}
-	vu_queue_notify(vdev, vq);
+	vu_queue_flush(vdev, vq, elem_cnt);
+	vu_queue_notify_defer(vq);
 
 	conn_flag(c, conn, ACK_FROM_TAP_DUE, now);
 
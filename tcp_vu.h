@@ -9,6 +9,7 @@
 int tcp_vu_send_flag(const struct ctx *c, struct tcp_tap_conn *conn, int flags,
 		     const struct timespec *now);
 int tcp_vu_data_from_sock(const struct ctx *c, struct tcp_tap_conn *conn,
-			  uint32_t already_sent, const struct timespec *now);
+			  uint32_t already_sent, uint32_t fillsize,
+			  const struct timespec *now);
 
 #endif  /*TCP_VU_H */
@@ -0,0 +1,1099 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+
+/* PASST - Plug A Simple Socket Transport
+ *  for qemu/UNIX domain socket mode
+ *
+ * PASTA - Pack A Subtle Tap Abstraction
+ *  for network namespace/tap device mode
+ *
+ * test/bench.c - Micro-benchmarks for hot-path primitives, tap traffic replay
+ *
+ * Copyright Red Hat
+ *
+ * Build and run with 'make bench' from the top-level directory. This links
+ * against all the passt sources except for passt.c, which is replaced by the
+ * few definitions below, and never enters the main loop.
+ *
+ * Each case runs for at least BENCH_MIN_NS, then reports nanoseconds per
+ * operation and, where available, cycles per operation as counted by the
+ * timestamp counter (which ticks at a constant rate, not at the current core
+ * frequency). Numbers are meant to be compared between builds on the same
+ * machine, not across machines.
+ *
+ * With 'replay', passt is configured as with --fd, with any further options
+ * given, and frames are fed through tap_add_packet(), tap_handler() and
+ * deferred handlers, reporting time spent per frame in each stage. Frames are
+ * either synthetic, from many guest ports to loopback peer sockets ('udp' for
+ * DNS-sized datagrams, 'tcp' for connection setup and reset), or the ones sent
+ * by the guest in a capture written by --pcap. Socket-side events are never
+ * processed, so this covers the guest to host direction only.
+ */
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <time.h>
+#include <syslog.h>
+#include <unistd.h>
+#include <net/ethernet.h>
+#include <netinet/in.h>
+#include <netinet/ip.h>
+#include <netinet/tcp.h>
+#include <netinet/udp.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+#include "util.h"
+#include "log.h"
+#include "iov.h"
+#include "ip.h"
+#include "inany.h"
+#include "checksum.h"
+#include "packet.h"
+#include "passt.h"
+#include "flow.h"
+#include "flow_table.h"
+#include "fwd.h"
+#include "stats.h"
+#include "conf.h"
+#include "tap.h"
+#include "tcp.h"
+#include "udp.h"
+#include "icmp.h"
+#include "dhcp.h"
+#include "pcap.h"
+
+#define BENCH_MIN_NS	(50ULL * 1000 * 1000)	/* Minimum run time per case */
+#define BENCH_BUF_SIZE	(USHRT_MAX + CACHE_LINE_SIZE)
+#define BENCH_FLOWS	(1U << 16)		/* Flow table size */
+#define BENCH_KEYS	1024			/* Distinct lookup keys */
+#define BENCH_POOL_SIZE	128			/* Descriptors in test pool */
+
+/* Normally defined by passt.c */
+char pkt_buf[PKT_BUF_BYTES];
+char *epoll_type_str[EPOLL_NUM_TYPES];
+struct ctx passt_ctx;
+struct passt_stats passt_stats;
+const char *stats_prof_defer_str[STATS_PROF_DEFER_NUM];
+const char *stats_mem_str[STATS_MEM_NUM];
+
+/**
+ * proto_update_l2_buf() - Update scatter-gather L2 buffers, as in passt.c
+ * @eth_d:	Ethernet destination address, NULL if unchanged
+ */
+void proto_update_l2_buf(const unsigned char *eth_d)
+{
+	tcp_update_l2_buf(eth_d);
+	udp_update_l2_buf(eth_d);
+	icmp_update_l2_buf(eth_d);
+}
+
+/* Results go here, so that the compiler can't drop the work */
+static volatile uint64_t bench_sink;
+
+static uint8_t bench_buf[BENCH_BUF_SIZE]
+	__attribute__((aligned(CACHE_LINE_SIZE)));
+
+/**
+ * bench_cycles() - Read timestamp counter, if we have one
+ *
+ * Return: current value of the counter, 0 if not available
+ */
+static uint64_t bench_cycles(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+	return __rdtsc();
+#else
+	return 0;
+#endif
+}
+
+/**
+ * bench_run() - Run a case, scaling iterations, and report time per operation
+ * @name:	Name of case, printed with result
+ * @fn:		Function running @n operations of the case
+ * @arg:	Argument for @fn
+ */
+static void bench_run(const char *name,
+		      void (*fn)(void *arg, unsigned long n), void *arg)
+{
+	unsigned long n = 1;
+
+	fn(arg, 1);	/* Warm up caches and branch predictors */
+
+	for (;;) {
+		struct timespec start, end;
+		uint64_t c0, c1, ns;
+
+		clock_gettime(CLOCK_MONOTONIC, &start);
+		c0 = bench_cycles();
+		fn(arg, n);
+		c1 = bench_cycles();
+		clock_gettime(CLOCK_MONOTONIC, &end);
+
+		ns = (end.tv_sec - start.tv_sec) * 1000000000ULL +
+		     end.tv_nsec - start.tv_nsec;
+		if (ns < BENCH_MIN_NS && n < (1UL << 40)) {
+			n *= 2;
+			continue;
+		}
+
+		if (c1)
+			printf("%-44s %10.2f ns/op %10.1f cycles/op\n", name,
+			       (double)ns / n, (double)(c1 - c0) / n);
+		else
+			printf("%-44s %10.2f ns/op\n", name, (double)ns / n);
+		return;
+	}
+}
+
+/**
+ * struct bench_csum - Arguments for checksum cases
+ * @off:	Offset of data from start of cache line
+ * @len:	Length of data
+ * @iov:	Data split in segments, for csum_iov_tail()
+ * @cnt:	Number of segments in @iov
+ */
+struct bench_csum {
+	size_t off;
+	size_t len;
+	struct iovec iov[4];
+	size_t cnt;
+};
+
+/**
+ * bench_csum_unfolded() - Run csum_unfolded() on a buffer
+ * @arg:	struct bench_csum
+ * @n:		Number of operations
+ */
+static void bench_csum_unfolded(void *arg, unsigned long n)
+{
+	const struct bench_csum *a = arg;
+	uint32_t sum = 0;
+
+	while (n--)
+		sum += csum_unfolded(bench_buf + a->off, a->len, 0);
+
+	bench_sink += sum;
+}
+
+/**
+ * bench_csum_iov_tail() - Run csum_iov_tail() on data split in segments
+ * @arg:	struct bench_csum
+ * @n:		Number of operations
+ */
+static void bench_csum_iov_tail(void *arg, unsigned long n)
+{
+	const struct bench_csum *a = arg;
+	uint32_t sum = 0;
+
+	while (n--) {
+		struct iov_tail tail = IOV_TAIL(a->iov, a->cnt, 0);
+
+		sum += csum_iov_tail(&tail, 0, a->len);
+	}
+
+	bench_sink += sum;
+}
+
+/**
+ * bench_csum() - Checksum cases, across sizes and alignments
+ */
+static void bench_csum(void)
+{
+	static const size_t lens[] = { 20, 64, 576, 1500, 9000, 65535 };
+	static const size_t offs[] = { 0, 1, 2 };
+	char name[64];
+	unsigned i, j;
+
+	for (i = 0; i < ARRAY_SIZE(bench_buf); i++)
+		bench_buf[i] = random();
+
+	for (i = 0; i < ARRAY_SIZE(lens); i++) {
+		for (j = 0; j < ARRAY_SIZE(offs); j++) {
+			struct bench_csum a = { .off = offs[j],
+						.len = lens[i] };
+
+			snprintf(name, sizeof(name),
+				 "csum_unfolded() %zu bytes, offset %zu",
+				 a.len, a.off);
+			bench_run(name, bench_csum_unfolded, &a);
+		}
+	}
+
+	for (i = 0; i < ARRAY_SIZE(lens); i++) {
+		struct bench_csum a = { .len = lens[i] };
+		size_t k, seg = DIV_ROUND_UP(a.len, ARRAY_SIZE(a.iov));
+
+		/* Headers and payload in separate buffers, as we have them */
+		for (k = 0; k * seg < a.len; k++) {
+			a.iov[k].iov_base = bench_buf + k * seg + k;
+			a.iov[k].iov_len = MIN(seg, a.len - k * seg);
+		}
+		a.cnt = k;
+
+		snprintf(name, sizeof(name), "csum_iov_tail() %zu bytes, %zu seg",
+			 a.len, a.cnt);
+		bench_run(name, bench_csum_iov_tail, &a);
+	}
+}
+
+/**
+ * struct bench_flow - Arguments for flow table cases
+ * @c:		Execution context
+ * @addr:	Guest addresses for lookup keys
+ * @port:	Guest ports for lookup keys
+ */
+struct bench_flow {
+	const struct ctx *c;
+	struct in_addr addr[BENCH_KEYS];
+	in_port_t port[BENCH_KEYS];
+};
+
+/**
+ * bench_flow_key() - Get guest address and port for n-th flow we insert
+ * @i:		Index of flow
+ * @addr:	Guest address, set on return
+ * @port:	Guest port, set on return
+ */
+static void bench_flow_key(unsigned i, struct in_addr *addr, in_port_t *port)
+{
+	addr->s_addr = htonl(0x0a000000 | (i >> 14));
+	*port = 1024 + (i & 0x3fff);
+}
+
+/**
+ * bench_flow_add() - Insert a UDP flow from tap, as udp_flow_from_tap() would
+ * @c:		Execution context
+ * @i:		Index of flow
+ */
+static void bench_flow_add(const struct ctx *c, unsigned i)
+{
+	struct in_addr src, dst = { htonl(0xc0000201) };
+	union flow *flow = flow_alloc();
+	in_port_t sport;
+
+	if (!flow) {
+		fprintf(stderr, "Flow table full\n");
+		exit(EXIT_FAILURE);
+	}
+
+	bench_flow_key(i, &src, &sport);
+	flow_initiate_af(flow, PIF_TAP, AF_INET, &src, sport, &dst, 53);
+	if (!flow_target(c, flow, FWD_NO_HINT, IPPROTO_UDP)) {
+		fprintf(stderr, "Can't set up flow target\n");
+		exit(EXIT_FAILURE);
+	}
+	flow_set_type(flow, FLOW_UDP);
+	flow_hash_insert(c, FLOW_SIDX(flow, INISIDE));
+	flow_activate(&flow->f);
+}
+
+/**
+ * bench_flow_lookup() - Run flow_lookup_af() on a set of keys
+ * @arg:	struct bench_flow
+ * @n:		Number of operations
+ */
+static void bench_flow_lookup(void *arg, unsigned long n)
+{
+	const struct bench_flow *a = arg;
+	struct in_addr dst = { htonl(0xc0000201) };
+	uint64_t found = 0;
+	unsigned long i;
+
+	for (i = 0; i < n; i++) {
+		unsigned k = i % BENCH_KEYS;
+		flow_sidx_t sidx;
+
+		sidx = flow_lookup_af(a->c, IPPROTO_UDP, PIF_TAP, AF_INET,
+				      &a->addr[k], &dst, a->port[k], 53);
+		found += flow_sidx_valid(sidx);
+	}
+
+	bench_sink += found;
+}
+
+/**
+ * bench_flow() - Flow table lookups at increasing table loads
+ */
+static void bench_flow(void)
+{
+	static const unsigned loads[] = { 1, 25, 50, 75, 90 };
+	static struct bench_flow a;
+	struct ctx *c = &passt_ctx;
+	unsigned i, used = 0;
+	char name[64];
+
+	c->max_flows = BENCH_FLOWS;
+	raw_random(&c->hash_secret, sizeof(c->hash_secret));
+	flow_init(c);
+	a.c = c;
+
+	for (i = 0; i < ARRAY_SIZE(loads); i++) {
+		unsigned target = (uint64_t)BENCH_FLOWS * loads[i] / 100, k;
+
+		for (; used < target; used++)
+			bench_flow_add(c, used);
+
+		/* Existing flows, in random order */
+		for (k = 0; k < BENCH_KEYS; k++)
+			bench_flow_key(random() % used, &a.addr[k], &a.port[k]);
+		snprintf(name, sizeof(name),
+			 "flow_lookup_af() hit, %u%% load", loads[i]);
+		bench_run(name, bench_flow_lookup, &a);
+
+		/* Flows we never inserted */
+		for (k = 0; k < BENCH_KEYS; k++)
+			bench_flow_key(BENCH_FLOWS + k, &a.addr[k], &a.port[k]);
+		snprintf(name, sizeof(name),
+			 "flow_lookup_af() miss, %u%% load", loads[i]);
+		bench_run(name, bench_flow_lookup, &a);
+	}
+}
+
+/**
+ * struct bench_fwd - Arguments for forwarding rule cases
+ * @fwd:	Forwarding table
+ * @ini:	Initiating side of flows to look up rules for
+ */
+struct bench_fwd {
+	struct fwd_table fwd;
+	struct flowside ini[BENCH_KEYS];
+};
+
+/**
+ * bench_fwd_search() - Run fwd_rule_search() for a set of flows
+ * @arg:	struct bench_fwd
+ * @n:		Number of operations
+ */
+static void bench_fwd_search(void *arg, unsigned long n)
+{
+	const struct bench_fwd *a = arg;
+	uint64_t found = 0;
+	unsigned long i;
+
+	for (i = 0; i < n; i++) {
+		const struct flowside *ini = &a->ini[i % BENCH_KEYS];
+
+		found += !!fwd_rule_search(&a->fwd, ini, IPPROTO_TCP,
+					   FWD_NO_HINT);
+	}
+
+	bench_sink += found;
+}
+
+/**
+ * bench_fwd() - Forwarding rule search with growing number of rules
+ *
+ * Tables set up here aren't compiled into port-indexed lookups, as that
+ * happens together with creating listening sockets: this measures the linear
+ * search used for other tables, and as fallback.
+ */
+static void bench_fwd(void)
+{
+	static const unsigned counts[] = { 1, 8, 32, 128, 255 };
+	static struct bench_fwd a;
+	char name[64];
+	unsigned i, k;
+
+	for (i = 0; i < ARRAY_SIZE(counts); i++) {
+		memset(&a.fwd, 0, sizeof(a.fwd));
+		a.fwd.caps = FWD_CAP_IPV4 | FWD_CAP_IPV6 | FWD_CAP_TCP;
+
+		/* Disjoint ranges of 16 ports each, starting from port 1000 */
+		for (k = 0; k < counts[i]; k++) {
+			struct fwd_rule r = {
+				.addr	= inany_any6,
+				.proto	= IPPROTO_TCP,
+				.first	= 1000 + k * 16,
+				.last	= 1000 + k * 16 + 15,
+				.to	= 1000 + k * 16,
+				.flags	= FWD_DUAL_STACK_ANY,
+			};
+
+			if (fwd_rule_add(&a.fwd, &r) < 0) {
+				fprintf(stderr, "Can't add forwarding rule\n");
+				exit(EXIT_FAILURE);
+			}
+		}
+
+		/* Ports spread over all rules, some matching none */
+		for (k = 0; k < BENCH_KEYS; k++) {
+			a.ini[k].eaddr = inany_from_v4((struct in_addr){
+				htonl(0xc0000202) });
+			a.ini[k].oaddr = inany_from_v4((struct in_addr){
+				htonl(0xc0000201) });
+			a.ini[k].eport = 40000 + k;
+			a.ini[k].oport = 1000 + random() % (counts[i] * 16 + 16);
+		}
+
+		snprintf(name, sizeof(name), "fwd_rule_search() %u rules",
+			 counts[i]);
+		bench_run(name, bench_fwd_search, &a);
+	}
+}
+
+/**
+ * struct bench_iov - Arguments for iov_tail cases
+ * @iov:	Segments
+ * @cnt:	Number of segments
+ */
+struct bench_iov {
+	struct iovec iov[16];
+	size_t cnt;
+};
+
+/**
+ * bench_iov_headers() - Peek, remove, drop headers and size up a tail
+ * @arg:	struct bench_iov
+ * @n:		Number of operations
+ *
+ * This is roughly what tap handlers do with each frame.
+ */
+static void bench_iov_headers(void *arg, unsigned long n)
+{
+	const struct bench_iov *a = arg;
+	uint64_t sum = 0;
+
+	while (n--) {
+		struct iov_tail tail = IOV_TAIL(a->iov, a->cnt, 0);
+		struct ethhdr eh_storage;
+		struct iphdr ih_storage;
+		const struct ethhdr *eh;
+		const struct iphdr *ih;
+
+		eh = IOV_REMOVE_HEADER(&tail, eh_storage);
+		ih = IOV_PEEK_HEADER(&tail, ih_storage);
+		if (!eh || !ih)
+			continue;
+
+		iov_drop_header(&tail, sizeof(*ih));
+		sum += eh->h_proto + ih->ttl + iov_tail_size(&tail);
+	}
+
+	bench_sink += sum;
+}
+
+/**
+ * bench_iov() - iov_tail operations, with growing number of segments
+ */
+static void bench_iov(void)
+{
+	static const size_t cnts[] = { 1, 2, 4, 16 };
+	static struct bench_iov a;
+	char name[64];
+	unsigned i, k;
+
+	for (i = 0; i < ARRAY_SIZE(cnts); i++) {
+		/* First segment holds headers only if there are several */
+		a.cnt = cnts[i];
+		for (k = 0; k < a.cnt; k++) {
+			a.iov[k].iov_base = bench_buf + k * 2048;
+			a.iov[k].iov_len = a.cnt == 1 ? 1514 :
+					   (k ? 1460 : ETH_HLEN + 20);
+		}
+
+		snprintf(name, sizeof(name), "iov_tail headers, %zu seg",
+			 a.cnt);
+		bench_run(name, bench_iov_headers, &a);
+	}
+}
+
+PACKET_POOL_DECL(bench_pool, BENCH_POOL_SIZE);
+
+/**
+ * struct bench_packet - Arguments for packet pool cases
+ * @p:		Pool
+ * @iov:	Segments of frame to add
+ * @cnt:	Number of segments
+ */
+struct bench_packet {
+	struct bench_pool_t p;
+	struct iovec iov[2];
+	size_t cnt;
+};
+
+/**
+ * bench_packet_add() - Fill a pool with packet_add_do(), flush, repeat
+ * @arg:	struct bench_packet
+ * @n:		Number of operations
+ */
+static void bench_packet_add(void *arg, unsigned long n)
+{
+	struct bench_packet *a = arg;
+	struct pool *p = (struct pool *)&a->p;
+
+	while (n--) {
+		struct iov_tail data = IOV_TAIL(a->iov, a->cnt, 0);
+
+		if (!pool_can_fit(p, &data))
+			pool_flush(p);
+
+		packet_add(p, &data);
+	}
+
+	bench_sink += p->count;
+}
+
+/**
+ * bench_packet() - Adding frames to packet pools
+ */
+static void bench_packet(void)
+{
+	static struct bench_packet a;
+	char name[64];
+	size_t cnt;
+
+	for (cnt = 1; cnt <= ARRAY_SIZE(a.iov); cnt++) {
+		a.p = PACKET_INIT(bench_pool, BENCH_POOL_SIZE,
+				  (char *)bench_buf, sizeof(bench_buf));
+		a.cnt = cnt;
+		a.iov[0].iov_base = bench_buf;
+		a.iov[0].iov_len = cnt == 1 ? 1514 : 54;
+		a.iov[1].iov_base = bench_buf + 2048;
+		a.iov[1].iov_len = 1460;
+
+		snprintf(name, sizeof(name), "packet_add_do() %zu seg", cnt);
+		bench_run(name, bench_packet_add, &a);
+	}
+}
+
+/* Replay of tap traffic through the actual tap and protocol handlers */
+
+#define REPLAY_BATCH		64	/* Frames per batch, as in one tap read */
+#define REPLAY_FLOWS		256	/* Flows in synthetic traffic */
+#define REPLAY_MIN_NS		(1000ULL * 1000 * 1000)	/* Synthetic traffic */
+#define REPLAY_BUF_SIZE		(64UL << 20)	/* Synthetic frames, or capture */
+#define REPLAY_FRAMES_MAX	(1U << 20)
+
+static char replay_buf[REPLAY_BUF_SIZE];
+static struct iovec replay_frames[REPLAY_FRAMES_MAX];
+static size_t replay_count;
+
+static const unsigned char replay_guest_mac[ETH_ALEN] = {
+	0x52, 0x54, 0x00, 0x12, 0x34, 0x56
+};
+
+/**
+ * struct replay_hdr4 - Headers for synthetic IPv4 frames from the guest
+ * @eh:		Ethernet header
+ * @iph:	IPv4 header
+ * @uh:		UDP header
+ * @th:		TCP header
+ * @opts:	TCP options: MSS only
+ */
+struct replay_hdr4 {
+	struct ethhdr eh;
+	struct iphdr iph;
+	union {
+		struct udphdr uh;
+		struct {
+			struct tcphdr th;
+			uint8_t opts[4];
+		} __attribute__((packed));
+	};
+} __attribute__((packed));
+
+/**
+ * struct replay_peer - Loopback sockets on the host side of the traffic
+ * @tap:	Our end of the socket pair passed to passt as --fd
+ * @udp:	UDP socket receiving datagrams for synthetic traffic
+ * @tcp:	TCP socket accepting connections for synthetic traffic
+ * @udp_port:	Bound port of @udp
+ * @tcp_port:	Bound port of @tcp
+ */
+static struct replay_peer {
+	int tap;
+	int udp;
+	int tcp;
+	in_port_t udp_port;
+	in_port_t tcp_port;
+} replay_peer = { -1, -1, -1, 0, 0 };
+
+/**
+ * struct replay_stats - Counters, and time spent per stage
+ * @frames:	Frames passed to tap_add_packet()
+ * @batches:	Batches of frames, each followed by handlers
+ * @ns_copy:	Copying frames to pkt_buf, in place of a read from tap
+ * @ns_queue:	tap_add_packet(): sorting frames into pools
+ * @ns_handle:	tap_handler(): L2, L3 and L4 handlers
+ * @ns_defer:	Deferred handlers, and frames queued for the guest
+ * @tap_bytes:	Bytes passt sent to the guest
+ * @peer_dgrams:	Datagrams received by peer UDP socket
+ * @peer_conns:	Connections accepted by peer TCP socket
+ */
+static struct replay_stats {
+	unsigned long frames;
+	unsigned long batches;
+	uint64_t ns_copy;
+	uint64_t ns_queue;
+	uint64_t ns_handle;
+	uint64_t ns_defer;
+	uint64_t tap_bytes;
+	unsigned long peer_dgrams;
+	unsigned long peer_conns;
+} replay_stats;
+
+/**
+ * replay_ns() - Get nanoseconds elapsed since a given timestamp, update it
+ * @ts:		Timestamp, set to current time on return
+ *
+ * Return: nanoseconds elapsed
+ */
+static uint64_t replay_ns(struct timespec *ts)
+{
+	struct timespec now;
+	uint64_t ns;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	ns = (now.tv_sec - ts->tv_sec) * 1000000000ULL +
+	     now.tv_nsec - ts->tv_nsec;
+	*ts = now;
+
+	return ns;
+}
+
+/**
+ * replay_frame_add() - Append a frame to the set of frames to replay
+ * @data:	Frame, including Ethernet header
+ * @len:	Length of frame
+ */
+static void replay_frame_add(const void *data, size_t len)
+{
+	static size_t used;
+
+	if (replay_count >= REPLAY_FRAMES_MAX ||
+	    used + len > sizeof(replay_buf))
+		die("Too many frames to replay");
+
+	memcpy(replay_buf + used, data, len);
+	replay_frames[replay_count].iov_base = replay_buf + used;
+	replay_frames[replay_count].iov_len = len;
+	replay_count++;
+
+	used = ROUND_UP(used + len, CACHE_LINE_SIZE);
+}
+
+/**
+ * replay_hdr4() - Fill Ethernet and IPv4 headers from guest to host loopback
+ * @c:		Execution context
+ * @h:		Headers to fill
+ * @proto:	L4 protocol number
+ * @l4len:	Length of L4 header and payload
+ */
+static void replay_hdr4(const struct ctx *c, struct replay_hdr4 *h,
+			uint8_t proto, size_t l4len)
+{
+	uint16_t l3len = sizeof(h->iph) + l4len;
+
+	memcpy(h->eh.h_dest, c->our_tap_mac, ETH_ALEN);
+	memcpy(h->eh.h_source, replay_guest_mac, ETH_ALEN);
+	h->eh.h_proto = htons(ETH_P_IP);
+
+	h->iph = (struct iphdr)L2_BUF_IP4_INIT(proto);
+	h->iph.tot_len = htons(l3len);
+	h->iph.saddr = c->ip4.addr.s_addr;
+	h->iph.daddr = c->ip4.map_host_loopback.s_addr;
+	h->iph.check = csum_ip4_header(l3len, proto, c->ip4.addr,
+				       c->ip4.map_host_loopback);
+}
+
+/**
+ * replay_udp() - Build DNS-sized UDP queries from many guest ports
+ * @c:		Execution context
+ */
+static void replay_udp(const struct ctx *c)
+{
+	static const uint8_t query[] = {
+		0x12, 0x34, 0x01, 0x00, 0x00, 0x01, 0x00, 0x00, 0x00, 0x00,
+		0x00, 0x00, 7, 'e', 'x', 'a', 'm', 'p', 'l', 'e', 3, 'c', 'o',
+		'm', 0, 0x00, 0x01, 0x00, 0x01,
+	};
+	size_t hlen = offsetof(struct replay_hdr4, uh) + sizeof(struct udphdr);
+	size_t l4len = sizeof(struct udphdr) + sizeof(query);
+	uint8_t frame[sizeof(struct replay_hdr4) + sizeof(query)];
+	struct replay_hdr4 h;
+	unsigned i;
+
+	for (i = 0; i < REPLAY_FLOWS; i++) {
+		struct iovec iov = { (void *)query, sizeof(query) };
+		struct iov_tail payload = IOV_TAIL(&iov, 1, 0);
+		struct udphdr uh = {
+			.source	= htons(10000 + i),
+			.dest	= htons(replay_peer.udp_port),
+			.len	= htons(l4len),
+		};
+
+		csum_udp4(&uh, c->ip4.addr, c->ip4.map_host_loopback,
+			  &payload, sizeof(query));
+		replay_hdr4(c, &h, IPPROTO_UDP, l4len);
+		h.uh = uh;
+
+		memcpy(frame, &h, hlen);
+		memcpy(frame + hlen, query, sizeof(query));
+		replay_frame_add(frame, hlen + sizeof(query));
+	}
+}
+
+/**
+ * replay_tcp() - Build SYN segments from many guest ports, then resets
+ * @c:		Execution context
+ *
+ * Connections are opened and reset in turn, so every round goes through
+ * connection setup and teardown, and flows are freed between rounds.
+ */
+static void replay_tcp(const struct ctx *c)
+{
+	size_t l4len = sizeof(struct tcphdr) + 4;
+	struct replay_hdr4 h;
+	unsigned i, rst;
+
+	for (rst = 0; rst <= 1; rst++) {
+		for (i = 0; i < REPLAY_FLOWS; i++) {
+			uint32_t psum;
+
+			replay_hdr4(c, &h, IPPROTO_TCP, l4len);
+			memset(&h.th, 0, sizeof(h.th));
+			h.th.source = htons(20000 + i);
+			h.th.dest = htons(replay_peer.tcp_port);
+			h.th.seq = htonl(1000 + rst);
+			h.th.doff = l4len / 4;
+			h.th.syn = !rst;
+			h.th.rst = rst;
+			h.th.window = htons(65535);
+			h.opts[0] = 2;		/* MSS */
+			h.opts[1] = 4;
+			h.opts[2] = 1460 >> 8;
+			h.opts[3] = 1460 & 0xff;
+
+			psum = proto_ipv4_header_psum(l4len, IPPROTO_TCP,
+						      c->ip4.addr,
+						      c->ip4.map_host_loopback);
+			h.th.check = ~csum_fold(csum_unfolded(&h.th, l4len,
+							      psum));
+
+			replay_frame_add(&h, sizeof(h));
+		}
+	}
+}
+
+/**
+ * replay_pcap() - Load frames sent by the guest from a capture file
+ * @c:		Execution context
+ * @path:	Capture file, as written by --pcap
+ *
+ * Frames we sent ourselves are skipped, as are truncated ones. Addresses are
+ * used as they are: pass the same options used for the capture, as needed.
+ */
+static void replay_pcap(const struct ctx *c, const char *path)
+{
+	static char file[REPLAY_BUF_SIZE];
+	struct pcap_file_hdr fh;
+	ssize_t len;
+	size_t off;
+
+	if ((len = read_file(path, file, sizeof(file))) < 0)
+		die("Can't read capture file %s: %s", path, strerror_(-len));
+
+	if ((size_t)len < sizeof(fh))
+		die("Capture file %s too short", path);
+
+	memcpy(&fh, file, sizeof(fh));
+	if (fh.magic != PCAP_MAGIC || fh.linktype != PCAP_LINKTYPE_ETHERNET)
+		die("Unsupported capture format in %s", path);
+
+	for (off = sizeof(fh); off + sizeof(struct pcap_pkthdr) <= (size_t)len;) {
+		struct pcap_pkthdr ph;
+		const char *frame;
+
+		memcpy(&ph, file + off, sizeof(ph));
+		off += sizeof(ph);
+		frame = file + off;
+		if (ph.caplen > len - off)
+			break;
+		off += ph.caplen;
+
+		if (ph.caplen != ph.len || ph.caplen < ETH_HLEN ||
+		    ph.caplen > L2_MAX_LEN_PASST ||
+		    !memcmp(frame + ETH_ALEN, c->our_tap_mac, ETH_ALEN))
+			continue;
+
+		replay_frame_add(frame, ph.caplen);
+	}
+
+	if (!replay_count)
+		die("No frames from guest in %s", path);
+}
+
+/**
+ * replay_peer_init() - Set up loopback sockets for synthetic traffic
+ */
+static void replay_peer_init(void)
+{
+	struct sockaddr_in sa = {
+		.sin_family = AF_INET,
+		.sin_addr = { htonl(INADDR_LOOPBACK) },
+	};
+	socklen_t sl = sizeof(sa);
+
+	replay_peer.udp = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK, 0);
+	if (replay_peer.udp < 0 ||
+	    bind(replay_peer.udp, (struct sockaddr *)&sa, sizeof(sa)) ||
+	    getsockname(replay_peer.udp, (struct sockaddr *)&sa, &sl))
+		die_perror("Can't set up peer UDP socket");
+	replay_peer.udp_port = ntohs(sa.sin_port);
+
+	sa.sin_port = 0;
+	replay_peer.tcp = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+	if (replay_peer.tcp < 0 ||
+	    bind(replay_peer.tcp, (struct sockaddr *)&sa, sizeof(sa)) ||
+	    listen(replay_peer.tcp, SOMAXCONN) ||
+	    getsockname(replay_peer.tcp, (struct sockaddr *)&sa, &sl))
+		die_perror("Can't set up peer TCP socket");
+	replay_peer.tcp_port = ntohs(sa.sin_port);
+}
+
+/**
+ * replay_drain() - Consume whatever passt sent to the guest and to peers
+ */
+static void replay_drain(void)
+{
+	ssize_t n;
+	int s;
+
+	while ((n = recv(replay_peer.tap, replay_buf + REPLAY_BUF_SIZE - 65536,
+			 65536, MSG_DONTWAIT)) > 0)
+		replay_stats.tap_bytes += n;
+
+	while (recv(replay_peer.udp, replay_buf + REPLAY_BUF_SIZE - 65536,
+		    65536, MSG_DONTWAIT) >= 0)
+		replay_stats.peer_dgrams++;
+
+	while ((s = accept4(replay_peer.tcp, NULL, NULL, SOCK_CLOEXEC)) >= 0) {
+		replay_stats.peer_conns++;
+		close(s);
+	}
+}
+
+/**
+ * replay_batch() - Feed a batch of frames through tap and deferred handlers
+ * @c:		Execution context
+ * @frames:	Frames
+ * @n:		Number of frames
+ *
+ * This follows tap_passt_input() and post_handler(), copying frames into
+ * pkt_buf instead of reading them from the socket.
+ */
+static void replay_batch(struct ctx *c, const struct iovec *frames, size_t n)
+{
+	struct iovec iov[REPLAY_BATCH];
+	struct timespec now, ts;
+	size_t i, off = 0;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	ts = now;
+
+	tap_flush_pools();
+	for (i = 0; i < n; i++) {
+		memcpy(pkt_buf + off, frames[i].iov_base, frames[i].iov_len);
+		iov[i].iov_base = pkt_buf + off;
+		iov[i].iov_len = frames[i].iov_len;
+		off += ROUND_UP(frames[i].iov_len, sizeof(uint32_t));
+	}
+	replay_stats.ns_copy += replay_ns(&ts);
+
+	for (i = 0; i < n; i++) {
+		struct iov_tail data = IOV_TAIL(&iov[i], 1, 0);
+
+		tap_add_packet(c, &data, &now);
+	}
+	replay_stats.ns_queue += replay_ns(&ts);
+
+	tap_handler(c, &now);
+	replay_stats.ns_handle += replay_ns(&ts);
+
+	if (!c->no_tcp)
+		tcp_defer_handler(c, &now);
+	if (!c->no_icmp)
+		icmp_flush(c);
+	if (!c->no_udp)
+		udp_flush(c);
+	flow_defer_handler(c, &now);
+	tap_flush(c);
+	if (pcap_fd != -1)
+		pcap_flush();
+	replay_stats.ns_defer += replay_ns(&ts);
+
+	replay_stats.frames += n;
+	replay_stats.batches++;
+
+	replay_drain();
+}
+
+/**
+ * replay() - Set up passt as with --fd, replay synthetic or captured frames
+ * @argc:	Argument count, starting from "replay"
+ * @argv:	"replay", then "udp", "tcp" or capture file, then passt options
+ *
+ * Return: 0 on success, 1 on invalid arguments
+ */
+static int replay(int argc, char **argv)
+{
+	char fdstr[sizeof("2147483647")], *conf_argv[64];
+	uint64_t ns_total, ns_run = 0;
+	struct ctx *c = &passt_ctx;
+	int conf_argc = 0, sv[2];
+	struct rlimit limit;
+	struct timespec ts;
+	bool synthetic;
+	size_t i;
+
+	if (argc < 2 || argc > (int)ARRAY_SIZE(conf_argv) - 4)
+		return 1;
+
+	if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, sv))
+		die_perror("Can't create socket pair for tap");
+	replay_peer.tap = sv[1];
+	snprintf(fdstr, sizeof(fdstr), "%i", sv[0]);
+
+	conf_argv[conf_argc++] = "passt";
+	conf_argv[conf_argc++] = "-f";
+	conf_argv[conf_argc++] = "-q";
+	conf_argv[conf_argc++] = "--fd";
+	conf_argv[conf_argc++] = fdstr;
+	for (i = 2; i < (size_t)argc; i++)
+		conf_argv[conf_argc++] = argv[i];
+	conf_argv[conf_argc] = NULL;
+
+	if (signal(SIGPIPE, SIG_IGN) == SIG_ERR)
+		die_perror("Couldn't set disposition for SIGPIPE");
+
+	c->mode = MODE_PASST;
+	c->fd_tap = sv[0];
+
+	c->epollfd = epoll_create1(EPOLL_CLOEXEC);
+	if (c->epollfd == -1)
+		die_perror("Failed to create epoll file descriptor");
+	flow_epollid_register(EPOLLFD_ID_DEFAULT, c->epollfd);
+
+	if (getrlimit(RLIMIT_NOFILE, &limit))
+		die_perror("Failed to get maximum value of open files limit");
+	c->nofile = limit.rlim_cur = limit.rlim_max;
+	if (setrlimit(RLIMIT_NOFILE, &limit))
+		die_perror("Failed to set current limit for open files");
+
+	sock_probe_features(c);
+	conf(c, conf_argc, conf_argv);
+	trace_init(c->trace);
+
+	tap_backend_init(c);
+	raw_random(&c->hash_secret, sizeof(c->hash_secret));
+	flow_init(c);
+	if (!c->no_icmp)
+		icmp_init(c);
+	if ((!c->no_udp && udp_init(c)) || (!c->no_tcp && tcp_init(c)))
+		die("Failed to initialise protocol handlers");
+	if (fwd_listen_init(c))
+		die("Failed to set up forwarding");
+	proto_update_l2_buf(c->guest_mac);
+	if (c->ifi4 && !c->no_dhcp)
+		dhcp_init();
+	pcap_init(c);
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	c->tcp.timer_run = ts;
+
+	synthetic = !strcmp(argv[1], "udp") || !strcmp(argv[1], "tcp");
+	if (synthetic) {
+		if (!c->ifi4 ||
+		    IN4_IS_ADDR_UNSPECIFIED(&c->ip4.map_host_loopback))
+			die("Synthetic traffic needs IPv4, --map-host-loopback");
+
+		replay_peer_init();
+		if (!strcmp(argv[1], "udp"))
+			replay_udp(c);
+		else
+			replay_tcp(c);
+	} else {
+		replay_pcap(c, argv[1]);
+	}
+
+	/* Synthetic traffic loops over frames, captures are replayed once */
+	do {
+		for (i = 0; i < replay_count; i += REPLAY_BATCH) {
+			replay_batch(c, replay_frames + i,
+				     MIN(REPLAY_BATCH, replay_count - i));
+		}
+
+		ns_run = replay_stats.ns_copy + replay_stats.ns_queue +
+			 replay_stats.ns_handle + replay_stats.ns_defer;
+	} while (synthetic && ns_run < REPLAY_MIN_NS);
+
+	ns_total = replay_ns(&ts);
+
+	printf("Replayed %lu frames from guest in %lu batches, %.3f s\n",
+	       replay_stats.frames, replay_stats.batches, ns_total / 1e9);
+	printf("%-44s %10.0f frames/s\n", "Throughput, excluding draining",
+	       replay_stats.frames / (ns_run / 1e9));
+	printf("%-44s %10.2f ns/frame\n", "Copy to pkt_buf",
+	       (double)replay_stats.ns_copy / replay_stats.frames);
+	printf("%-44s %10.2f ns/frame\n", "Queueing, tap_add_packet()",
+	       (double)replay_stats.ns_queue / replay_stats.frames);
+	printf("%-44s %10.2f ns/frame\n", "L2 to L4 handlers, tap_handler()",
+	       (double)replay_stats.ns_handle / replay_stats.frames);
+	printf("%-44s %10.2f ns/frame\n", "Deferred handlers, frames to guest",
+	       (double)replay_stats.ns_defer / replay_stats.frames);
+	printf("Guest received %llu bytes",
+	       (unsigned long long)replay_stats.tap_bytes);
+	if (synthetic)
+		printf(", peers received %lu datagrams, %lu connections",
+		       replay_stats.peer_dgrams, replay_stats.peer_conns);
+	printf("\n");
+
+	return 0;
+}
+
+/**
+ * main() - Run all micro-benchmarks, or replay tap traffic
+ * @argc:	Argument count
+ * @argv:	Nothing, or "replay" with replay arguments
+ *
+ * Return: 0 on success, 1 on invalid arguments
+ */
+int main(int argc, char **argv)
+{
+	if (clock_gettime(CLOCK_MONOTONIC, &log_start))
+		die_perror("Failed to get CLOCK_MONOTONIC time");
+
+	if (argc > 1) {
+		if (!strcmp(argv[1], "replay") &&
+		    !replay(argc - 1, argv + 1))
+			return 0;
+
+		fprintf(stderr,
+			"Usage: %s [replay udp|tcp|FILE.pcap [PASST_OPTIONS]]\n",
+			argv[0]);
+		return 1;
+	}
+
+	/* Flow state changes would otherwise be logged to stderr */
+	__setlogmask(LOG_UPTO(LOG_WARNING));
+	log_conf_parsed = true;
+
+	bench_csum();
+	bench_iov();
+	bench_packet();
+	bench_fwd();
+	bench_flow();
+
+	return 0;
+}
@@ -0,0 +1,637 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+
+/* flowscale - Request-response traffic over many concurrent TCP or UDP flows
+ *
+ * Copyright Red Hat
+ *
+ * The server echoes back anything it receives, on a range of ports. With -p,
+ * it samples CPU and memory usage of the given process, typically passt or
+ * pasta, while traffic flows, and prints, on exit:
+ *
+ *   cpu=	CPU usage, percent, empty if there was no traffic
+ *   rss=	peak resident memory, MiB, empty if there was no traffic
+ *
+ * The client opens the given number of flows, spread over the same range of
+ * ports, then keeps one request in flight on each flow, or, with -b, on the
+ * given number of them only, leaving the others idle, for the given time, and
+ * prints a single line with results:
+ *
+ *   flows=	flows established
+ *   failed=	flows that couldn't be established, or were reset
+ *   setup_ms=	time to establish all the flows, in milliseconds
+ *   trans=	completed request-response transactions
+ *   bps=	payload bits per second received back by the client
+ *   p50= p99= p999=
+ *		percentiles of transaction latency, in microseconds
+ *   lost=	UDP requests or responses lost, resent after RESEND_MS
+ *
+ * The server runs on the same side as the process under test, so that it can
+ * find it: pasta runs commands in a separate PID namespace.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <limits.h>
+#include <errno.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <time.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+
+#define MAX(a, b)	((a) > (b) ? (a) : (b))
+
+#define die(...)						\
+	do {							\
+		fprintf(stderr, "flowscale: " __VA_ARGS__);	\
+		exit(1);					\
+	} while (0)
+
+#define err(...)						\
+	do {							\
+		fprintf(stderr, "flowscale: " __VA_ARGS__);	\
+	} while (0)
+
+#define EVENTS		1024
+#define MSG_MAX		65536
+#define PORTS_MAX	64
+
+/* Outstanding non-blocking connect() calls at most, for TCP */
+#define CONNECT_BATCH	512
+
+/* Resend UDP requests not answered within this time, check that this often */
+#define RESEND_MS	1000
+#define RESEND_SCAN_MS	100
+
+/* Default payload size for requests and responses */
+#define SIZE_DEFAULT	1024
+
+/* Server exits after this long without any activity, once it saw some */
+#define IDLE_DEFAULT	3
+
+/* Sample CPU and memory usage of process under test this often */
+#define SAMPLE_MS	100
+
+/* Log-linear latency histogram, in nanoseconds: values below HIST_SUB have a
+ * bucket each, then each power of two is split into HIST_SUB buckets
+ */
+#define HIST_SUB_BITS	4
+#define HIST_SUB	(1 << HIST_SUB_BITS)
+#define HIST_BUCKETS	((64 - HIST_SUB_BITS + 1) * HIST_SUB)
+
+/**
+ * struct flow - Client flow
+ * @fd:		Socket, -1 if closed or not opened yet
+ * @rcvd:	Bytes of current response received so far
+ * @sent:	Timestamp of current request, nanoseconds, 0 if none
+ */
+struct flow {
+	int fd;
+	uint32_t rcvd;
+	uint64_t sent;
+};
+
+static uint8_t buf[MSG_MAX];
+static uint64_t hist[HIST_BUCKETS];
+
+static void usage(void)
+{
+	die("Usage:\n"
+	    "  flowscale server [-i IDLE] [-p PIDFILE] tcp|udp PORT PORTS\n"
+	    "    Echo data on ports PORT to PORT + PORTS - 1, exit after IDLE\n"
+	    "    seconds (default: %i) without traffic. With -p, report CPU\n"
+	    "    and memory usage of process in PIDFILE\n"
+	    "  flowscale client [-b BUSY] [-s SIZE] tcp|udp ADDR PORT PORTS\n"
+	    "                   FLOWS TIME\n"
+	    "    Open FLOWS flows to ADDR, ports PORT to PORT + PORTS - 1,\n"
+	    "    then exchange SIZE bytes (default: %i) requests and responses\n"
+	    "    on all of them, or on the first BUSY ones, for TIME seconds\n",
+	    IDLE_DEFAULT, SIZE_DEFAULT);
+}
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static unsigned long parse_ul(const char *s, unsigned long min,
+			      unsigned long max)
+{
+	unsigned long v;
+	char *e;
+
+	errno = 0;
+	v = strtoul(s, &e, 0);
+	if (*e || errno || v < min || v > max)
+		usage();
+
+	return v;
+}
+
+static bool parse_proto(const char *s)
+{
+	if (!strcmp(s, "tcp"))
+		return true;
+	if (strcmp(s, "udp"))
+		usage();
+
+	return false;
+}
+
+/* Raise open files limit to the hard limit, return the new limit */
+static unsigned long nofile_raise(void)
+{
+	struct rlimit lim;
+
+	if (getrlimit(RLIMIT_NOFILE, &lim))
+		die("getrlimit(): %s\n", strerror(errno));
+
+	lim.rlim_cur = lim.rlim_max;
+	if (setrlimit(RLIMIT_NOFILE, &lim))
+		die("setrlimit(): %s\n", strerror(errno));
+
+	return lim.rlim_cur;
+}
+
+static void epoll_add(int epollfd, int fd, uint32_t events, uint64_t data)
+{
+	struct epoll_event ev = { .events = events, .data.u64 = data };
+
+	if (epoll_ctl(epollfd, EPOLL_CTL_ADD, fd, &ev))
+		die("epoll_ctl(): %s\n", strerror(errno));
+}
+
+static unsigned hist_idx(uint64_t v)
+{
+	int msb;
+
+	if (v < HIST_SUB)
+		return v;
+
+	msb = 63 - __builtin_clzll(v);
+	return (msb - HIST_SUB_BITS + 1) * HIST_SUB +
+	       ((v >> (msb - HIST_SUB_BITS)) & (HIST_SUB - 1));
+}
+
+/* Middle of bucket containing the given percentile, in microseconds */
+static unsigned long long hist_pct(uint64_t total, double pct)
+{
+	uint64_t target = total * pct / 100, sum = 0;
+	unsigned i;
+
+	if (!total)
+		return 0;
+
+	for (i = 0; i < HIST_BUCKETS; i++) {
+		unsigned msb;
+		uint64_t low;
+
+		sum += hist[i];
+		if (sum <= target && i < HIST_BUCKETS - 1)
+			continue;
+
+		if (i < HIST_SUB)
+			return i / 1000;
+
+		msb = i / HIST_SUB - 1 + HIST_SUB_BITS;
+		low = (uint64_t)(HIST_SUB + i % HIST_SUB) <<
+		      (msb - HIST_SUB_BITS);
+		return (low + (1ULL << (msb - HIST_SUB_BITS)) / 2) / 1000;
+	}
+
+	return 0;
+}
+
+/* Read CPU time in clock ticks and resident memory in KiB of process */
+static bool proc_sample(pid_t pid, unsigned long long *ticks,
+			unsigned long long *rss)
+{
+	char path[64], line[BUFSIZ], stat[BUFSIZ];
+	unsigned long long utime, stime;
+	const char *p;
+	size_t n;
+	FILE *f;
+
+	snprintf(path, sizeof(path), "/proc/%i/stat", pid);
+	if (!(f = fopen(path, "r")))
+		return false;
+	n = fread(stat, 1, sizeof(stat) - 1, f);
+	fclose(f);
+	stat[n] = 0;
+
+	/* Process name in field 2 can contain spaces: skip up to ')' */
+	if (!(p = strrchr(stat, ')')) ||
+	    sscanf(p + 2, "%*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u "
+		   "%llu %llu", &utime, &stime) != 2)
+		return false;
+	*ticks = utime + stime;
+
+	snprintf(path, sizeof(path), "/proc/%i/status", pid);
+	if (!(f = fopen(path, "r")))
+		return false;
+	*rss = 0;
+	while (fgets(line, sizeof(line), f))
+		sscanf(line, "VmRSS: %llu", rss);
+	fclose(f);
+
+	return true;
+}
+
+static pid_t pid_read(const char *pidfile)
+{
+	FILE *f = fopen(pidfile, "r");
+	pid_t pid;
+
+	if (!f || fscanf(f, "%i", &pid) != 1)
+		die("can't read PID from %s\n", pidfile);
+	fclose(f);
+
+	return pid;
+}
+
+static void server(bool tcp, in_port_t port, unsigned ports, unsigned idle,
+		   const char *pidfile)
+{
+	unsigned long long ticks0 = 0, ticks1 = 0, rss, rss_max = 0;
+	uint64_t last = 0, t0 = 0, t1 = 0;
+	struct epoll_event ev[EVENTS];
+	pid_t pid = 0;
+	int epollfd;
+	unsigned i;
+
+	nofile_raise();
+
+	if (pidfile)
+		pid = pid_read(pidfile);
+
+	if ((epollfd = epoll_create1(0)) < 0)
+		die("epoll_create1(): %s\n", strerror(errno));
+
+	for (i = 0; i < ports; i++) {
+		struct sockaddr_in6 a = { .sin6_family = AF_INET6,
+					  .sin6_addr = IN6ADDR_ANY_INIT,
+					  .sin6_port = htons(port + i) };
+		int s, y = 1, n = 0;
+
+		s = socket(AF_INET6, (tcp ? SOCK_STREAM : SOCK_DGRAM) |
+				     SOCK_NONBLOCK, 0);
+		if (s < 0)
+			die("socket(): %s\n", strerror(errno));
+
+		setsockopt(s, SOL_SOCKET, SO_REUSEADDR, &y, sizeof(y));
+		setsockopt(s, IPPROTO_IPV6, IPV6_V6ONLY, &n, sizeof(n));
+
+		if (bind(s, (struct sockaddr *)&a, sizeof(a)))
+			die("bind() to port %i: %s\n", port + i,
+			    strerror(errno));
+
+		if (tcp && listen(s, SOMAXCONN))
+			die("listen(): %s\n", strerror(errno));
+
+		/* Listening sockets have the top bit set in epoll data */
+		epoll_add(epollfd, s, EPOLLIN, (uint64_t)s | (1ULL << 32));
+	}
+
+	while (!last || now_ns() - last < (uint64_t)idle * 1000000000) {
+		int n = epoll_wait(epollfd, ev, EVENTS, 1000);
+		bool data = false;
+		uint64_t now;
+
+		if (n < 0 && errno != EINTR)
+			die("epoll_wait(): %s\n", strerror(errno));
+
+		for (i = 0; i < (unsigned)MAX(n, 0); i++) {
+			int s = (int)ev[i].data.u64;
+			bool listening = ev[i].data.u64 >> 32;
+			ssize_t rc;
+
+			last = now_ns();
+
+			if (tcp && listening) {
+				int a;
+
+				while ((a = accept4(s, NULL, NULL,
+						    SOCK_NONBLOCK)) >= 0)
+					epoll_add(epollfd, a, EPOLLIN, a);
+				continue;
+			}
+
+			data = true;
+
+			if (!tcp) {
+				struct sockaddr_in6 a;
+				socklen_t sl = sizeof(a);
+
+				while ((rc = recvfrom(s, buf, sizeof(buf), 0,
+						      (struct sockaddr *)&a,
+						      &sl)) >= 0) {
+					sendto(s, buf, rc, 0,
+					       (struct sockaddr *)&a, sl);
+					sl = sizeof(a);
+				}
+				continue;
+			}
+
+			rc = recv(s, buf, sizeof(buf), 0);
+			if (rc <= 0) {
+				if (rc < 0 && errno == EAGAIN)
+					continue;
+				close(s);
+				continue;
+			}
+
+			if (send(s, buf, rc, MSG_NOSIGNAL) != rc)
+				err("short echo on socket %i\n", s);
+		}
+
+		/* Sample usage only while there's traffic, not on setup */
+		if (!pid || !data)
+			continue;
+
+		now = now_ns();
+		if (!t0) {
+			if (proc_sample(pid, &ticks0, &rss))
+				t0 = t1 = now;
+		} else if (now - t1 >= SAMPLE_MS * 1000000ULL &&
+			   proc_sample(pid, &ticks1, &rss)) {
+			t1 = now;
+			rss_max = MAX(rss_max, rss);
+		}
+	}
+
+	if (!pid)
+		return;
+
+	if (t1 > t0) {
+		printf("cpu=%.1f rss=%llu\n", (ticks1 - ticks0) * 100.0 /
+		       sysconf(_SC_CLK_TCK) / ((t1 - t0) / 1e9),
+		       (rss_max + 512) / 1024);
+	} else {
+		printf("cpu= rss=\n");
+	}
+}
+
+static void flow_close(int epollfd, struct flow *f, unsigned *failed)
+{
+	epoll_ctl(epollfd, EPOLL_CTL_DEL, f->fd, NULL);
+	close(f->fd);
+	f->fd = -1;
+	f->sent = 0;
+	(*failed)++;
+}
+
+/* Send request on flow, return false on failure */
+static bool flow_send(struct flow *f, size_t size, uint64_t now)
+{
+	if (send(f->fd, buf, size, MSG_NOSIGNAL) != (ssize_t)size)
+		return false;
+
+	f->rcvd = 0;
+	f->sent = now;
+	return true;
+}
+
+static void client(bool tcp, const char *addr, in_port_t port, unsigned ports,
+		   unsigned nflows, unsigned busy, unsigned time, size_t size)
+{
+	unsigned long long trans = 0, bytes = 0, lost = 0, setup_ms;
+	unsigned opened = 0, pending = 0, ready = 0, failed = 0;
+	struct sockaddr_storage sa = { 0 };
+	struct epoll_event ev[EVENTS];
+	uint64_t start, t0, t1, resend;
+	double secs;
+	struct flow *flows;
+	unsigned long lim;
+	socklen_t sl;
+	int epollfd;
+	unsigned i;
+
+	/* Leave some room for standard streams, epoll, and the like */
+	lim = nofile_raise();
+	if (nflows > lim - 16) {
+		err("open files limit %lu, using %lu flows\n", lim, lim - 16);
+		nflows = lim - 16;
+	}
+
+	if (inet_pton(AF_INET, addr, &((struct sockaddr_in *)&sa)->sin_addr)) {
+		sa.ss_family = AF_INET;
+		sl = sizeof(struct sockaddr_in);
+	} else if (inet_pton(AF_INET6, addr,
+			     &((struct sockaddr_in6 *)&sa)->sin6_addr)) {
+		sa.ss_family = AF_INET6;
+		sl = sizeof(struct sockaddr_in6);
+	} else {
+		usage();
+	}
+
+	if (!(flows = calloc(nflows, sizeof(*flows))))
+		die("can't allocate %u flows\n", nflows);
+
+	if ((epollfd = epoll_create1(0)) < 0)
+		die("epoll_create1(): %s\n", strerror(errno));
+
+	memset(buf, 'x', size);
+
+	/* Set up flows, with at most CONNECT_BATCH connections in progress */
+	start = now_ns();
+	while (ready + failed < nflows) {
+		int n;
+
+		while (opened < nflows && pending < CONNECT_BATCH) {
+			struct flow *f = &flows[opened];
+			in_port_t p = htons(port + opened % ports);
+			int s;
+
+			if (sa.ss_family == AF_INET)
+				((struct sockaddr_in *)&sa)->sin_port = p;
+			else
+				((struct sockaddr_in6 *)&sa)->sin6_port = p;
+
+			s = socket(sa.ss_family,
+				   (tcp ? SOCK_STREAM : SOCK_DGRAM) |
+				   SOCK_NONBLOCK, 0);
+			if (s < 0)
+				die("socket(): %s\n", strerror(errno));
+			f->fd = s;
+
+			if (connect(s, (struct sockaddr *)&sa, sl) &&
+			    errno != EINPROGRESS) {
+				err("connect(): %s\n", strerror(errno));
+				close(s);
+				f->fd = -1;
+				failed++;
+				opened++;
+				continue;
+			}
+
+			if (tcp) {
+				epoll_add(epollfd, s, EPOLLOUT, opened);
+				pending++;
+			} else {
+				epoll_add(epollfd, s, EPOLLIN, opened);
+				ready++;
+			}
+			opened++;
+		}
+
+		if (!pending)
+			continue;
+
+		n = epoll_wait(epollfd, ev, EVENTS, 1000);
+		for (i = 0; i < (unsigned)MAX(n, 0); i++) {
+			struct flow *f = &flows[ev[i].data.u64];
+			struct epoll_event mod = { .events = EPOLLIN,
+						   .data = ev[i].data };
+			int e = 0;
+
+			pending--;
+			getsockopt(f->fd, SOL_SOCKET, SO_ERROR, &e,
+				   &(socklen_t){ sizeof(e) });
+			if (e || (ev[i].events & (EPOLLERR | EPOLLHUP))) {
+				flow_close(epollfd, f, &failed);
+				continue;
+			}
+
+			epoll_ctl(epollfd, EPOLL_CTL_MOD, f->fd, &mod);
+			ready++;
+		}
+	}
+	setup_ms = (now_ns() - start) / 1000000;
+
+	/* Request-response traffic on busy flows, others stay idle */
+	t0 = now_ns();
+	for (i = 0; i < nflows && i < busy; i++) {
+		if (flows[i].fd >= 0 && !flow_send(&flows[i], size, t0))
+			flow_close(epollfd, &flows[i], &failed);
+	}
+
+	resend = t0 + RESEND_MS * 1000000ULL;
+	while ((t1 = now_ns()) - t0 < (uint64_t)time * 1000000000) {
+		int n = epoll_wait(epollfd, ev, EVENTS, 100);
+
+		for (i = 0; i < (unsigned)MAX(n, 0); i++) {
+			struct flow *f = &flows[ev[i].data.u64];
+			ssize_t rc;
+
+			if (f->fd < 0)
+				continue;
+
+			rc = recv(f->fd, buf, sizeof(buf), 0);
+			if (rc < 0 && errno == EAGAIN)
+				continue;
+			if (rc <= 0 || (ev[i].events & EPOLLERR)) {
+				flow_close(epollfd, f, &failed);
+				continue;
+			}
+
+			f->rcvd += rc;
+			bytes += rc;
+			if (f->rcvd < size)
+				continue;
+
+			t1 = now_ns();
+			hist[hist_idx(t1 - f->sent)]++;
+			trans++;
+			if (!flow_send(f, size, t1))
+				flow_close(epollfd, f, &failed);
+		}
+
+		if (tcp || t1 < resend)
+			continue;
+
+		for (i = 0; i < nflows; i++) {
+			struct flow *f = &flows[i];
+
+			if (f->fd < 0 || !f->sent ||
+			    t1 - f->sent < RESEND_MS * 1000000ULL)
+				continue;
+
+			lost++;
+			if (!flow_send(f, size, t1))
+				flow_close(epollfd, f, &failed);
+		}
+		resend = t1 + RESEND_SCAN_MS * 1000000ULL;
+	}
+	secs = (double)(t1 - t0) / 1000000000;
+
+	/* Flows established at first, minus any reset later */
+	printf("flows=%u failed=%u setup_ms=%llu trans=%llu bps=%llu "
+	       "p50=%llu p99=%llu p999=%llu lost=%llu\n",
+	       nflows - failed, failed, setup_ms, trans,
+	       (unsigned long long)(bytes * 8 / secs),
+	       hist_pct(trans, 50), hist_pct(trans, 99), hist_pct(trans, 99.9),
+	       lost);
+}
+
+int main(int argc, char *argv[])
+{
+	const char *pidfile = NULL;
+	unsigned idle = IDLE_DEFAULT, busy = UINT_MAX;
+	size_t size = SIZE_DEFAULT;
+	bool is_server, tcp;
+	int opt;
+
+	if (argc < 2)
+		usage();
+
+	if (!strcmp(argv[1], "server"))
+		is_server = true;
+	else if (!strcmp(argv[1], "client"))
+		is_server = false;
+	else
+		usage();
+
+	optind = 2;
+	while ((opt = getopt(argc, argv, "b:i:s:p:")) != -1) {
+		switch (opt) {
+		case 'b':
+			busy = parse_ul(optarg, 0, 10000000);
+			break;
+		case 'i':
+			idle = parse_ul(optarg, 1, 3600);
+			break;
+		case 's':
+			size = parse_ul(optarg, 1, MSG_MAX);
+			break;
+		case 'p':
+			pidfile = optarg;
+			break;
+		default:
+			usage();
+		}
+	}
+
+	argc -= optind;
+	argv += optind;
+
+	if (is_server) {
+		if (argc != 3)
+			usage();
+
+		tcp = parse_proto(argv[0]);
+		server(tcp, parse_ul(argv[1], 1, 65535),
+		       parse_ul(argv[2], 1, PORTS_MAX), idle, pidfile);
+	} else {
+		if (argc != 6)
+			usage();
+
+		tcp = parse_proto(argv[0]);
+		client(tcp, argv[1], parse_ul(argv[2], 1, 65535),
+		       parse_ul(argv[3], 1, PORTS_MAX),
+		       parse_ul(argv[4], 1, 10000000), busy,
+		       parse_ul(argv[5], 1, 3600), size);
+	}
+
+	exit(0);
+}
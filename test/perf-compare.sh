@@ -0,0 +1,91 @@
+#!/bin/sh
+#
+# SPDX-License-Identifier: GPL-2.0-or-later
+#
+# PASST - Plug A Simple Socket Transport
+#  for qemu/UNIX domain socket mode
+#
+# PASTA - Pack A Subtle Tap Abstraction
+#  for network namespace/tap device mode
+#
+# test/perf-compare.sh - Flag performance regressions against a baseline
+#
+# Copyright Red Hat
+#
+# Compare two CSV reports written by performance tests (test_logs/perf.csv),
+# matching measurements by mode, protocol, test, direction and size. Lower
+# throughput, or higher latency, CPU or memory usage, migration downtime, state
+# size or repair helper round-trips, by more than the given threshold is
+# reported as a regression, as are measurements missing from the current
+# report.
+#
+# Exit status is 0 if there are no regressions, 1 if there are, 2 on errors.
+
+usage() {
+	echo "Usage: ${0} [-t PERCENT] BASELINE.csv CURRENT.csv" >&2
+	echo "  -t PERCENT	Tolerated change, default: 10" >&2
+	exit 2
+}
+
+THRESHOLD=10
+while getopts t: __opt; do
+	case ${__opt} in
+	t)	THRESHOLD="${OPTARG}" ;;
+	*)	usage ;;
+	esac
+done
+shift $((OPTIND - 1))
+
+[ ${#} -eq 2 ] && [ -r "${1}" ] && [ -r "${2}" ] || usage
+
+awk -F, -v threshold="${THRESHOLD}" '
+	FNR == 1 {
+		file++
+		for (i = 1; i <= NF; i++)
+			col[$i] = i
+		next
+	}
+
+	{
+		key = $col["mode"] " " $col["proto"] ": " $col["test"] ", " \
+		      $col["direction"] ", " $col["param"] " " $col["size"]
+		metric[key] = $col["metric"]
+		unit[key] = $col["unit"]
+	}
+
+	file == 1 { base[key] = $col["value"]; order[++n] = key }
+	file == 2 { cur[key] = $col["value"] }
+
+	END {
+		for (i = 1; i <= n; i++) {
+			k = order[i]
+
+			if (!(k in cur)) {
+				printf "MISSING     %s\n", k
+				fail = 1
+				continue
+			}
+
+			b = base[k]
+			c = cur[k]
+			if (b == 0)
+				continue
+			change = (c - b) * 100 / b
+
+			if (metric[k] == "latency" || metric[k] == "cpu" ||
+			    metric[k] == "rss" || metric[k] == "downtime" ||
+			    metric[k] == "state" || metric[k] == "repair")
+				worse = change > threshold
+			else
+				worse = -change > threshold
+
+			if (worse)
+				fail = 1
+
+			printf "%-11s %s: %s -> %s %s (%+.1f%%)\n",
+			       worse ? "REGRESSION" : "ok", k, b, c, unit[k],
+			       change
+		}
+
+		exit fail
+	}' "${1}" "${2}"
@@ -59,6 +59,15 @@
  * port auto-probing.  The duplicate is used to deliver replies back to the
  * originating side.
  *
+ * With --udp-shared, flows from tap to the host don't get their own socket if
+ * we don't need a specific local address for them.  They share instead one of
+ * a few unconnected sockets, bound to ephemeral ports, of type
+ * EPOLL_TYPE_UDP_SHARED, and created on demand: a flow can use a shared socket
+ * if no other flow with the same peer uses it already.  Replies are matched to
+ * flows via the flow hash, as for listening sockets, with an unspecified local
+ * address, and they never create new flows.  The guest's source port and TTL
+ * are not preserved.
+ *
  * NOTE: A flow socket can have a bound address overlapping with a listening
  * socket.  That will happen naturally for flows initiated from a socket, but is
  * also possible (though unlikely) for tap initiated flows, depending on the
@@ -118,8 +127,17 @@
 #include "udp_internal.h"
 #include "udp_vu.h"
 #include "epoll_ctl.h"
+#include "stats.h"
+#include "dns.h"
+#include "probe.h"
+
+#define UDP_LOW_MEM_FRAMES	4   /* ...with --low-mem */
+#define UDP_SPLICE_FRAMES	128 /* max # of spliced datagrams to queue */
 
-#define UDP_MAX_FRAMES		32  /* max # of frames to receive at once */
+/* Maximum number of segments and payload for a single UDP_SEGMENT send */
+#define UDP_GSO_MAX_SEGS	64
+#define UDP_GSO_MAX_LEN		(USHRT_MAX - sizeof(struct udphdr) -	\
+				 sizeof(struct iphdr))
 
 #define UDP_TIMEOUT	"/proc/sys/net/netfilter/nf_conntrack_udp_timeout"
 #define UDP_TIMEOUT_STREAM	\
@@ -137,7 +155,8 @@
 /* Static buffers */
 
 /* UDP header and data for inbound messages */
-static struct udp_payload_t udp_payload[UDP_MAX_FRAMES];
+static struct udp_payload_t udp_payload[UDP_MAX_FRAMES]
+	__attribute__ ((aligned(HUGEPAGE_SIZE)));
 
 /* Ethernet headers for IPv4 and IPv6 frames */
 static struct ethhdr udp_eth_hdr[UDP_MAX_FRAMES];
@@ -162,6 +181,11 @@ udp_meta[UDP_MAX_FRAMES];
 	MAX(CMSG_SPACE(sizeof(struct in_pktinfo)),	\
 	    CMSG_SPACE(sizeof(struct in6_pktinfo)))
 
+/* IP_TOS is a single byte, IPV6_TCLASS an int */
+#define TOS_SPACE	CMSG_SPACE(sizeof(int))
+
+#define FWD_CMSG_SPACE	(PKTINFO_SPACE + TOS_SPACE)
+
 #define RECVERR_SPACE							\
 	MAX(CMSG_SPACE(sizeof(struct sock_extended_err) +		\
 		       sizeof(struct sockaddr_in)),			\
@@ -190,15 +214,44 @@ enum udp_iov_idx {
 static struct iovec	udp_iov_recv		[UDP_MAX_FRAMES];
 static struct mmsghdr	udp_mh_recv		[UDP_MAX_FRAMES];
 
-/* IOVs and msghdr arrays for sending "spliced" datagrams to sockets */
-static union sockaddr_inany udp_splice_to;
+/* msghdr array, source addresses and ancillary data for datagrams received
+ * from possibly unconnected sockets, sharing buffers with udp_mh_recv, which
+ * also uses ancillary data buffers with --udp-ecn
+ */
+static struct mmsghdr	udp_mh_fwd		[UDP_MAX_FRAMES];
+static union sockaddr_inany udp_fwd_src		[UDP_MAX_FRAMES];
+static char		udp_fwd_cmsg		[UDP_MAX_FRAMES][FWD_CMSG_SPACE]
+	__attribute__ ((aligned(__alignof__(struct cmsghdr))));
 
-static struct iovec	udp_iov_splice		[UDP_MAX_FRAMES];
-static struct mmsghdr	udp_mh_splice		[UDP_MAX_FRAMES];
+/* Data, destination addresses, target sockets, IOVs and msghdr arrays for
+ * "spliced" datagrams queued for sockets, sent by udp_splice_flush()
+ */
+static struct udp_payload_t udp_splice_payload[UDP_SPLICE_FRAMES];
+static union sockaddr_inany udp_splice_to	[UDP_SPLICE_FRAMES];
+static int		udp_splice_s		[UDP_SPLICE_FRAMES];
+
+static struct iovec	udp_iov_splice		[UDP_SPLICE_FRAMES];
+static struct mmsghdr	udp_mh_splice		[UDP_SPLICE_FRAMES];
+
+/* Number of datagrams currently queued in udp_mh_splice */
+static int udp_splice_count;
 
 /* IOVs for L2 frames */
 static struct iovec	udp_l2_iov		[UDP_MAX_FRAMES][UDP_NUM_IOVS];
 
+/* Number of frames queued in udp_l2_iov, sent by udp_buf_flush() */
+static int udp_buf_used;
+
+/* Frames we queue in udp_l2_iov at most, UDP_LOW_MEM_FRAMES with --low-mem */
+static int udp_buf_max = UDP_MAX_FRAMES;
+
+/* Kernel supports UDP_SEGMENT (generic segmentation offload) on sends */
+static bool udp_gso_cap;
+
+/* Ancillary data for UDP_SEGMENT, one per merged message from tap */
+static char udp_gso_cmsg[UIO_MAXIOV][CMSG_SPACE(sizeof(uint16_t))]
+	__attribute__ ((aligned(__alignof__(struct cmsghdr))));
+
 /**
  * udp_update_l2_buf() - Update L2 buffers with Ethernet and IPv4 addresses
  * @eth_d:	Ethernet destination address, NULL if unchanged
@@ -238,6 +291,11 @@ static void udp_iov_init_one(const struct ctx *c, size_t i)
 
 	mh->msg_iov	= siov;
 	mh->msg_iovlen	= 1;
+
+	udp_mh_fwd[i].msg_hdr = (struct msghdr) {
+		.msg_iov	= siov,
+		.msg_iovlen	= 1,
+	};
 }
 
 /**
@@ -248,6 +306,11 @@ static void udp_iov_init(const struct ctx *c)
 {
 	size_t i;
 
+	if (c->low_mem)
+		udp_buf_max = UDP_LOW_MEM_FRAMES;
+	else
+		madvise_hugepage(udp_payload, sizeof(udp_payload));
+
 	for (i = 0; i < UDP_MAX_FRAMES; i++)
 		udp_iov_init_one(c, i);
 }
@@ -353,17 +416,19 @@ static void udp_tap_pad(struct iovec *iov)
 
 /**
  * udp_tap_prepare() - Convert one datagram into a tap frame
+ * @c:		Execution context
  * @mmh:	Receiving mmsghdr array
  * @idx:	Index of the datagram to prepare
  * @tap_omac:	MAC address of remote endpoint as seen from the guest
  * @toside:	Flowside for destination side
+ * @ecn:	ECN field for the IP header
  * @no_udp_csum: Do not set UDP checksum
  */
-static void udp_tap_prepare(const struct mmsghdr *mmh,
+static void udp_tap_prepare(const struct ctx *c, const struct mmsghdr *mmh,
 			    unsigned int idx,
 			    const uint8_t *tap_omac,
 			    const struct flowside *toside,
-			    bool no_udp_csum)
+			    uint8_t ecn, bool no_udp_csum)
 {
 	struct iovec (*tap_iov)[UDP_NUM_IOVS] = &udp_l2_iov[idx];
 	struct udphdr *uh = (*tap_iov)[UDP_IOV_PAYLOAD].iov_base;
@@ -378,20 +443,41 @@ static void udp_tap_prepare(const struct mmsghdr *mmh,
 
 	eth_update_mac(eh, NULL, tap_omac);
 	if (!inany_v4(&toside->eaddr) || !inany_v4(&toside->oaddr)) {
+		bool offload = !no_udp_csum && tap_offload(c);
+
 		udp_update_hdr6(&bm->ip6h, uh, &payload, toside,
-			        mmh[idx].msg_len, no_udp_csum);
+			        mmh[idx].msg_len, no_udp_csum || offload);
+		ip6_set_ecn(&bm->ip6h, ecn);
 
 		l2len = MAX(l4len + sizeof(bm->ip6h) + ETH_HLEN, ETH_ZLEN);
-		tap_hdr_update(&bm->taph, l2len);
+		tap_hdr_update(c, &bm->taph, l2len);
+
+		if (offload) {
+			uint32_t psum;
+
+			psum = proto_ipv6_header_psum(l4len, IPPROTO_UDP,
+						      &bm->ip6h.saddr,
+						      &bm->ip6h.daddr);
+			uh->check = csum_fold(psum);
+			tap_hdr_csum(&bm->taph, ETH_HLEN + sizeof(bm->ip6h),
+				     offsetof(struct udphdr, check));
+		}
 
 		eh->h_proto = htons_constant(ETH_P_IPV6);
 		(*tap_iov)[UDP_IOV_IP] = IOV_OF_LVALUE(bm->ip6h);
 	} else {
 		udp_update_hdr4(&bm->ip4h, uh, &payload, toside,
 			        mmh[idx].msg_len, no_udp_csum);
+		bm->ip4h.tos = ecn;
+		if (ecn) {
+			/* Header checksum was calculated with a zero TOS */
+			uint32_t sum = (uint16_t)~bm->ip4h.check + htons(ecn);
+
+			bm->ip4h.check = ~csum_fold(sum);
+		}
 
 		l2len = MAX(l4len + sizeof(bm->ip4h) + ETH_HLEN, ETH_ZLEN);
-		tap_hdr_update(&bm->taph, l2len);
+		tap_hdr_update(c, &bm->taph, l2len);
 
 		eh->h_proto = htons_constant(ETH_P_IP);
 		(*tap_iov)[UDP_IOV_IP] = IOV_OF_LVALUE(bm->ip4h);
@@ -531,6 +617,33 @@ static int udp_pktinfo(struct msghdr *msg, union inany_addr *dst)
 	return -1;
 }
 
+/**
+ * udp_ecn() - Retrieve ECN field of received datagram from cmsg
+ * @msg:	msghdr into which message has been received
+ *
+ * Return: ECN field, Not-ECT (0) if the information is missing
+ */
+static uint8_t udp_ecn(struct msghdr *msg)
+{
+	struct cmsghdr *hdr;
+
+	for (hdr = CMSG_FIRSTHDR(msg); hdr; hdr = CMSG_NXTHDR(msg, hdr)) {
+		if (hdr->cmsg_level == IPPROTO_IP &&
+		    hdr->cmsg_type == IP_TOS)
+			return *(uint8_t *)CMSG_DATA(hdr) & IPTOS_ECN_MASK;
+
+		if (hdr->cmsg_level == IPPROTO_IPV6 &&
+		    hdr->cmsg_type == IPV6_TCLASS) {
+			int tclass;
+
+			memcpy(&tclass, CMSG_DATA(hdr), sizeof(tclass));
+			return tclass & IPTOS_ECN_MASK;
+		}
+	}
+
+	return 0;
+}
+
 /**
  * udp_sock_recverr() - Receive and clear an error from a socket
  * @c:		Execution context
@@ -550,7 +663,7 @@ static int udp_sock_recverr(const struct ctx *c, int s, flow_sidx_t sidx,
 			    uint8_t pif, in_port_t port,
 			    const struct timespec *now)
 {
-	char buf[PKTINFO_SPACE + RECVERR_SPACE];
+	char buf[PKTINFO_SPACE + TOS_SPACE + RECVERR_SPACE];
 	const struct sock_extended_err *ee;
 	char data[ICMP6_MAX_DLEN];
 	struct cmsghdr *hdr;
@@ -635,6 +748,12 @@ static int udp_sock_recverr(const struct ctx *c, int s, flow_sidx_t sidx,
 	topif = uflow->f.pif[!sidx.sidei];
 	dlen = rc;
 
+	/* Fragmentation needed, or packet too big: remember the path MTU, see
+	 * udp_tap_pmtu()
+	 */
+	if (pif == PIF_HOST && ee->ee_errno == EMSGSIZE && ee->ee_info)
+		uflow->pmtu = MIN(ee->ee_info, UINT16_MAX);
+
 	if (inany_from_sockaddr(&offender, &offender_port,
 				SO_EE_OFFENDER(ee)) < 0)
 		goto fail;
@@ -792,6 +911,124 @@ static int udp_sock_recv(const struct ctx *c, int s, struct mmsghdr *mmh, int n)
 	return n;
 }
 
+/**
+ * udp_stats_rx() - Account for datagrams just received from a socket
+ * @mmh:	mmsghdr array datagrams were received into
+ * @n:		Number of datagrams in @mmh
+ * @tosidx:	Flow & side datagrams will be forwarded to
+ */
+static void udp_stats_rx(const struct mmsghdr *mmh, int n, flow_sidx_t tosidx)
+{
+	uint8_t frompif = pif_at_sidx(flow_sidx_opposite(tosidx));
+	size_t bytes = 0;
+	int i;
+
+	for (i = 0; i < n; i++)
+		bytes += mmh[i].msg_len;
+
+	stats_rx(frompif, PESTO_STATS_UDP, n, bytes);
+}
+
+/**
+ * udp_splice_flush() - Send queued "spliced" datagrams, one batch per socket
+ *
+ * Datagrams for the same target socket are sent with a single sendmmsg(),
+ * even if they were queued by different flows, preserving their order.
+ *
+ * #syscalls sendmmsg
+ */
+void udp_splice_flush(void)
+{
+	static struct mmsghdr mmh[UDP_SPLICE_FRAMES];
+	int i, j, n;
+
+	for (i = 0; i < udp_splice_count; i++) {
+		int s = udp_splice_s[i];
+
+		if (s < 0)
+			continue;
+
+		for (n = 0, j = i; j < udp_splice_count; j++) {
+			if (udp_splice_s[j] != s)
+				continue;
+
+			mmh[n++] = udp_mh_splice[j];
+			udp_splice_s[j] = -1;
+		}
+
+		sendmmsg(s, mmh, n, MSG_NOSIGNAL);
+	}
+
+	udp_splice_count = 0;
+}
+
+/**
+ * udp_splice_queue() - Make room in the queue for datagrams for sockets
+ * @n:		Number of datagrams to be queued
+ *
+ * Return: index of the first free slot in the queue, followed by at least @n
+ */
+static int udp_splice_queue(int n)
+{
+	if (udp_splice_count + n > UDP_SPLICE_FRAMES)
+		udp_splice_flush();
+
+	return udp_splice_count;
+}
+
+/**
+ * udp_splice_commit() - Set destination and socket for queued datagrams
+ * @c:		Execution context
+ * @start:	Index of first datagram in the queue
+ * @n:		Number of datagrams, with data and length already set
+ * @tosidx:	Flow & side to forward datagrams to
+ */
+static void udp_splice_commit(const struct ctx *c, int start, int n,
+			      flow_sidx_t tosidx)
+{
+	const struct flowside *toside = flowside_at_sidx(tosidx);
+	const struct udp_flow *uflow = udp_at_sidx(tosidx);
+	int i;
+
+	pif_sockaddr(c, &udp_splice_to[start], pif_at_sidx(tosidx),
+		     &toside->eaddr, toside->eport);
+
+	for (i = start; i < start + n; i++) {
+		if (i != start)
+			udp_splice_to[i] = udp_splice_to[start];
+		udp_mh_splice[i].msg_hdr.msg_namelen = sizeof(udp_splice_to[i]);
+		udp_splice_s[i] = uflow->s[tosidx.sidei];
+	}
+
+	udp_splice_count = start + n;
+}
+
+/**
+ * udp_splice_send() - Queue datagrams already received for a socket
+ * @c:		Execution context
+ * @mmh:	mmsghdr array datagrams were received into
+ * @start:	Index of first datagram in @mmh
+ * @n:		Number of datagrams to forward
+ * @tosidx:	Flow & side to forward datagrams to
+ */
+static void udp_splice_send(const struct ctx *c, const struct mmsghdr *mmh,
+			    int start, int n, flow_sidx_t tosidx)
+{
+	int i, q = udp_splice_queue(n);
+
+	udp_stats_rx(mmh + start, n, tosidx);
+
+	for (i = 0; i < n; i++) {
+		size_t len = mmh[start + i].msg_len;
+
+		memcpy(udp_splice_payload[q + i].data,
+		       mmh[start + i].msg_hdr.msg_iov->iov_base, len);
+		udp_iov_splice[q + i].iov_len = len;
+	}
+
+	udp_splice_commit(c, q, n, tosidx);
+}
+
 /**
  * udp_sock_to_sock() - Forward datagrams from socket to socket
  * @c:		Execution context
@@ -799,29 +1036,142 @@ static int udp_sock_recv(const struct ctx *c, int s, struct mmsghdr *mmh, int n)
  * @n:		Maximum number of datagrams to forward
  * @tosidx:	Flow & side to forward datagrams to
  *
- * #syscalls sendmmsg
+ * Datagrams are received straight into the queue, and sent by
+ * udp_splice_flush() once the current batch of events is handled.
  */
 static void udp_sock_to_sock(const struct ctx *c, int from_s, int n,
 			     flow_sidx_t tosidx)
+{
+	int i, q = udp_splice_queue(n);
+
+	for (i = q; i < q + n; i++)
+		udp_iov_splice[i].iov_len = sizeof(udp_splice_payload[i].data);
+
+	if ((n = udp_sock_recv(c, from_s, udp_mh_splice + q, n)) <= 0)
+		return;
+
+	udp_stats_rx(udp_mh_splice + q, n, tosidx);
+
+	for (i = q; i < q + n; i++)
+		udp_iov_splice[i].iov_len = udp_mh_splice[i].msg_len;
+
+	/* recvmmsg() stored source addresses, replace them */
+	udp_splice_commit(c, q, n, tosidx);
+}
+
+/**
+ * udp_buf_flush() - Send frames queued for tap
+ * @c:		Execution context
+ */
+static void udp_buf_flush(const struct ctx *c)
+{
+	if (!udp_buf_used)
+		return;
+
+	tap_send_frames(c, &udp_l2_iov[0][0], UDP_NUM_IOVS, udp_buf_used);
+	udp_buf_used = 0;
+}
+
+/**
+ * udp_buf_queue() - Make room in the tap frame queue for datagrams to receive
+ * @c:		Execution context
+ * @n:		Number of datagrams needed
+ *
+ * Return: index of the first free buffer, followed by at least @n free ones
+ */
+static int udp_buf_queue(const struct ctx *c, int n)
+{
+	if (udp_buf_used + n > udp_buf_max)
+		udp_buf_flush(c);
+
+	return udp_buf_used;
+}
+
+/**
+ * udp_buf_move() - Move a received datagram to another, unused, buffer slot
+ * @mmh:	mmsghdr array datagram was received into
+ * @from:	Index of slot holding the datagram
+ * @to:		Index of unused slot
+ *
+ * Swap payload buffers between the two slots, instead of copying data, so
+ * that frames queued for tap stay contiguous in udp_l2_iov.
+ */
+static void udp_buf_move(struct mmsghdr *mmh, int from, int to)
+{
+	struct iovec *l2_from = &udp_l2_iov[from][UDP_IOV_PAYLOAD];
+	struct iovec *l2_to = &udp_l2_iov[to][UDP_IOV_PAYLOAD];
+	void *base;
+
+	base = udp_iov_recv[to].iov_base;
+	udp_iov_recv[to].iov_base = udp_iov_recv[from].iov_base;
+	udp_iov_recv[from].iov_base = base;
+
+	base = l2_to->iov_base;
+	l2_to->iov_base = l2_from->iov_base;
+	l2_from->iov_base = base;
+
+	mmh[to].msg_len = mmh[from].msg_len;
+}
+
+/**
+ * udp_buf_to_tap() - Queue datagrams already received as frames for tap
+ * @c:		Execution context
+ * @mmh:	mmsghdr array datagrams were received into
+ * @start:	Index of first datagram in @mmh, not before queued frames
+ * @n:		Number of datagrams to forward
+ * @tosidx:	Flow & side to forward datagrams to
+ * @now:	Current timestamp
+ *
+ * Frames are sent by udp_buf_flush(), once the current batch of events is
+ * handled, so that datagrams from many sockets go to tap with a single send.
+ */
+static void udp_buf_to_tap(const struct ctx *c, struct mmsghdr *mmh,
+			   int start, int n, flow_sidx_t tosidx,
+			   const struct timespec *now)
 {
 	const struct flowside *toside = flowside_at_sidx(tosidx);
-	const struct udp_flow *uflow = udp_at_sidx(tosidx);
-	uint8_t topif = pif_at_sidx(tosidx);
-	int to_s = uflow->s[tosidx.sidei];
+	struct udp_flow *uflow = udp_at_sidx(tosidx);
+	uint8_t *omac = uflow->f.tap_omac;
 	int i;
 
-	if ((n = udp_sock_recv(c, from_s, udp_mh_recv, n)) <= 0)
-		return;
+	udp_stats_rx(mmh + start, n, tosidx);
 
+	/* Police --tap-rate: drop whatever exceeds the allowance */
 	for (i = 0; i < n; i++) {
-		udp_mh_splice[i].msg_hdr.msg_iov->iov_len
-			= udp_mh_recv[i].msg_len;
+		if (!tap_shape_admit(c, TAP_SHAPE_TO_TAP,
+				     mmh[start + i].msg_len, now))
+			break;
+	}
+	if (i < n) {
+		stats_drop(pif_at_sidx(flow_sidx_opposite(tosidx)),
+			   PESTO_STATS_UDP, n - i);
+		n = i;
 	}
 
-	pif_sockaddr(c, &udp_splice_to, topif,
-		     &toside->eaddr, toside->eport);
+	/* Find if neighbour table has a recorded MAC address */
+	if (MAC_IS_UNDEF(omac))
+		fwd_neigh_mac_get(c, &toside->oaddr, omac);
+
+	for (i = udp_buf_used; i < udp_buf_used + n; i++) {
+		const struct msghdr *mh = &mmh[i].msg_hdr;
+		int from = start + i - udp_buf_used;
+		struct iov_tail data;
+		uint8_t ecn = 0;
+
+		/* Ancillary data isn't moved with datagrams, read it first */
+		if (c->udp.ecn)
+			ecn = udp_ecn(&mmh[from].msg_hdr);
+
+		/* Datagrams before @start might have gone elsewhere */
+		if (start != udp_buf_used)
+			udp_buf_move(mmh, from, i);
 
-	sendmmsg(to_s, udp_mh_splice, n, MSG_NOSIGNAL);
+		data = IOV_TAIL(mh->msg_iov, mh->msg_iovlen, 0);
+		dns_reply(c, toside, &data, mmh[i].msg_len, now);
+		udp_tap_prepare(c, mmh, i, omac, toside, ecn, false);
+	}
+
+	udp_buf_used += n;
 }
 
 /**
@@ -830,26 +1180,187 @@ static void udp_sock_to_sock(const struct ctx *c, int from_s, int n,
  * @s:		Socket to read data from
  * @n:		Maximum number of datagrams to forward
  * @tosidx:	Flow & side to forward data from @s to
+ * @now:	Current timestamp
  */
 static void udp_buf_sock_to_tap(const struct ctx *c, int s, int n,
-				flow_sidx_t tosidx)
+				flow_sidx_t tosidx, const struct timespec *now)
 {
-	const struct flowside *toside = flowside_at_sidx(tosidx);
-	struct udp_flow *uflow = udp_at_sidx(tosidx);
-	uint8_t *omac = uflow->f.tap_omac;
+	int i, q = udp_buf_queue(c, MIN(n, udp_buf_max / 2));
+
+	n = MIN(n, udp_buf_max - q);
+
+	for (i = q; c->udp.ecn && i < q + n; i++) {
+		struct msghdr *mh = &udp_mh_recv[i].msg_hdr;
+
+		mh->msg_control = udp_fwd_cmsg[i];
+		mh->msg_controllen = sizeof(udp_fwd_cmsg[i]);
+	}
+
+	if ((n = udp_sock_recv(c, s, udp_mh_recv + q, n)) <= 0)
+		return;
+
+	stats_mem_peak(STATS_MEM_UDP_BUF, (q + n) * sizeof(udp_payload[0]));
+
+	udp_buf_to_tap(c, udp_mh_recv, q, n, tosidx, now);
+}
+
+/**
+ * udp_flush() - Send datagrams and frames queued while handling events
+ * @c:		Execution context
+ */
+void udp_flush(const struct ctx *c)
+{
+	udp_splice_flush();
+	udp_buf_flush(c);
+}
+
+/**
+ * udp_sock_recv_addr() - Receive datagrams with their addresses from a socket
+ * @s:		Socket to receive from
+ * @start:	Index of first slot in udp_mh_fwd to receive into
+ * @max:	Maximum number of datagrams to receive
+ *
+ * Return: number of datagrams received into udp_mh_fwd, 0 if there are none,
+ *         -ve error code on error
+ *
+ * #syscalls recvmmsg arm:recvmmsg_time64 i686:recvmmsg_time64
+ */
+static int udp_sock_recv_addr(int s, int start, int max)
+{
+	int i, n;
+
+	for (i = start; i < start + max; i++) {
+		struct msghdr *mh = &udp_mh_fwd[i].msg_hdr;
+
+		mh->msg_name = &udp_fwd_src[i];
+		mh->msg_namelen = sizeof(udp_fwd_src[i]);
+		mh->msg_control = udp_fwd_cmsg[i];
+		mh->msg_controllen = sizeof(udp_fwd_cmsg[i]);
+	}
+
+	n = recvmmsg(s, udp_mh_fwd + start, max, MSG_DONTWAIT, NULL);
+	if (n < 0) {
+		if (errno == EAGAIN || errno == EWOULDBLOCK)
+			return 0;
+		return -errno;
+	}
+
+	stats_mem_peak(STATS_MEM_UDP_BUF,
+		       (start + n) * sizeof(udp_payload[0]));
+
+	return n;
+}
+
+/**
+ * udp_sock_fwd_one() - Forward a run of datagrams received for the same flow
+ * @c:		Execution context
+ * @start:	Index of first datagram in udp_mh_fwd
+ * @n:		Number of datagrams
+ * @frompif:	Interface datagrams were received on
+ * @tosidx:	Flow & side to forward datagrams to, or FLOW_SIDX_NONE
+ * @now:	Current timestamp
+ */
+static void udp_sock_fwd_one(const struct ctx *c, int start, int n,
+			     uint8_t frompif, flow_sidx_t tosidx,
+			     const struct timespec *now)
+{
+	uint8_t topif = pif_at_sidx(tosidx);
+	size_t bytes = 0;
 	int i;
 
-	if ((n = udp_sock_recv(c, s, udp_mh_recv, n)) <= 0)
+	if (pif_is_socket(topif)) {
+		udp_splice_send(c, udp_mh_fwd, start, n, tosidx);
 		return;
+	}
 
-	/* Find if neighbour table has a recorded MAC address */
-	if (MAC_IS_UNDEF(omac))
-		fwd_neigh_mac_get(c, &toside->oaddr, omac);
+	if (topif == PIF_TAP) {
+		udp_buf_to_tap(c, udp_mh_fwd, start, n, tosidx, now);
+		return;
+	}
 
-	for (i = 0; i < n; i++)
-		udp_tap_prepare(udp_mh_recv, i, omac, toside, false);
+	if (flow_sidx_valid(tosidx)) {
+		struct udp_flow *uflow = udp_at_sidx(tosidx);
+
+		flow_err_ratelimit(uflow, now,
+				   "No support for forwarding UDP from %s to %s",
+				   pif_name(frompif), pif_name(topif));
+	} else {
+		warn_ratelimit(now, "Discarding datagram without flow");
+	}
+
+	for (i = start; i < start + n; i++)
+		bytes += udp_mh_fwd[i].msg_len;
+
+	stats_rx(frompif, PESTO_STATS_UDP, n, bytes);
+	stats_drop(frompif, PESTO_STATS_UDP, n);
+}
+
+/**
+ * udp_sock_fwd_batch() - Forward datagrams from an unconnected socket, batched
+ * @c:		Execution context
+ * @s:		Socket to forward from
+ * @rule_hint:	Forwarding rule to use, or -1 if unknown
+ * @frompif:	Interface to which @s belongs
+ * @port:	Our (local) port number of @s
+ * @now:	Current timestamp
+ *
+ * Instead of peeking at each datagram to find its flow before receiving it,
+ * receive a batch together with source addresses and PKTINFO, then look up the
+ * flow for each datagram and forward consecutive datagrams belonging to the
+ * same flow with a single send.
+ */
+static void udp_sock_fwd_batch(const struct ctx *c, int s, int rule_hint,
+			       uint8_t frompif, in_port_t port,
+			       const struct timespec *now)
+{
+	int n, max;
+
+	do {
+		flow_sidx_t tosidx = FLOW_SIDX_NONE;
+		int i, base, start;
+
+		/* Leave frames already queued for tap alone if there's room */
+		base = start = udp_buf_queue(c, udp_buf_max / 2);
+		max = udp_buf_max - base;
+
+		if ((n = udp_sock_recv_addr(s, base, max)) < 0) {
+			trace("Error receiving from socket: %s",
+			      strerror_(-n));
+			/* Clear errors & carry on */
+			if (udp_sock_errs(c, s, FLOW_SIDX_NONE,
+					  frompif, port, now) < 0) {
+				err_ratelimit(now,
+"UDP: Unrecoverable error on listening socket: (%s port %hu)",
+				    pif_name(frompif), port);
+				return;
+			}
+			continue;
+		}
+
+		PROBE(udp_sock_fwd_batch, s, n);
+
+		for (i = base; i < base + n; i++) {
+			struct msghdr *mh = &udp_mh_fwd[i].msg_hdr;
+			flow_sidx_t sidx;
+			union inany_addr dst;
+
+			udp_pktinfo(mh, &dst);
+			sidx = udp_flow_from_sock(c, frompif, &dst, port,
+						  &udp_fwd_src[i], rule_hint,
+						  now);
+
+			if (i != base && !flow_sidx_eq(sidx, tosidx)) {
+				udp_sock_fwd_one(c, start, i - start,
+						 frompif, tosidx, now);
+				start = i;
+			}
+			tosidx = sidx;
+		}
 
-	tap_send_frames(c, &udp_l2_iov[0][0], UDP_NUM_IOVS, n);
+		if (n)
+			udp_sock_fwd_one(c, start, base + n - start,
+					 frompif, tosidx, now);
+	} while (n == max || n < 0);
 }
 
 /**
@@ -868,6 +1379,17 @@ void udp_sock_fwd(const struct ctx *c, int s, int rule_hint,
 	union inany_addr dst;
 	int rc;
 
+	PROBE(udp_sock_fwd_start, s, frompif);
+
+	/* With vhost-user we receive directly into guest buffers, so we need
+	 * to know the flow before receiving: peek at one datagram at a time
+	 */
+	if (c->mode != MODE_VU) {
+		udp_sock_fwd_batch(c, s, rule_hint, frompif, port, now);
+		PROBE(udp_sock_fwd_done, s, frompif);
+		return;
+	}
+
 	while ((rc = udp_peek_addr(s, &src, &dst)) != 0) {
 		bool discard = false;
 		flow_sidx_t tosidx;
@@ -894,10 +1416,7 @@ void udp_sock_fwd(const struct ctx *c, int s, int rule_hint,
 		if (pif_is_socket(topif)) {
 			udp_sock_to_sock(c, s, 1, tosidx);
 		} else if (topif == PIF_TAP) {
-			if (c->mode == MODE_VU)
-				udp_vu_sock_to_tap(c, s, 1, tosidx);
-			else
-				udp_buf_sock_to_tap(c, s, 1, tosidx);
+			udp_vu_sock_to_tap(c, s, 1, tosidx, now);
 		} else if (flow_sidx_valid(tosidx)) {
 			struct udp_flow *uflow = udp_at_sidx(tosidx);
 
@@ -913,11 +1432,19 @@ void udp_sock_fwd(const struct ctx *c, int s, int rule_hint,
 
 		if (discard) {
 			struct msghdr msg = { 0 };
+			ssize_t dlen;
 
-			if (recvmsg(s, &msg, MSG_DONTWAIT) < 0)
+			if ((dlen = recvmsg(s, &msg, MSG_DONTWAIT)) < 0) {
 				debug_perror("Failed to discard datagram");
+				continue;
+			}
+
+			stats_rx(frompif, PESTO_STATS_UDP, 1, dlen);
+			stats_drop(frompif, PESTO_STATS_UDP, 1);
 		}
 	}
+
+	PROBE(udp_sock_fwd_done, s, frompif);
 }
 
 /**
@@ -937,6 +1464,23 @@ void udp_listen_sock_handler(const struct ctx *c,
 	}
 }
 
+/**
+ * udp_shared_sock_handler() - Handle new data from shared socket
+ * @c:		Execution context
+ * @ref:	epoll reference
+ * @events:	epoll events bitmap
+ * @now:	Current timestamp
+ */
+void udp_shared_sock_handler(const struct ctx *c,
+			     union epoll_ref ref, uint32_t events,
+			     const struct timespec *now)
+{
+	if (events & (EPOLLERR | EPOLLIN)) {
+		udp_sock_fwd(c, ref.fd, UDP_SHARED_HINT,
+			     ref.listen.pif, ref.listen.port, now);
+	}
+}
+
 /**
  * udp_sock_handler() - Handle new data from flow specific socket
  * @c:		Execution context
@@ -982,9 +1526,9 @@ void udp_sock_handler(const struct ctx *c, union epoll_ref ref,
 		} else if (topif == PIF_TAP) {
 			if (c->mode == MODE_VU) {
 				udp_vu_sock_to_tap(c, s, UDP_MAX_FRAMES,
-						   tosidx);
+						   tosidx, now);
 			} else {
-				udp_buf_sock_to_tap(c, s, n, tosidx);
+				udp_buf_sock_to_tap(c, s, n, tosidx, now);
 			}
 		} else {
 			flow_err_ratelimit(uflow, now,
@@ -1000,6 +1544,158 @@ fail:
 	udp_flow_close(c, uflow);
 }
 
+/**
+ * udp_gso_merge() - Merge runs of equally sized datagrams into GSO messages
+ * @mm:		Messages, one per datagram, merged in place
+ * @n:		Number of messages (datagrams) in @mm
+ * @segs:	Number of datagrams carried by each resulting message (output)
+ *
+ * All datagrams in a run, except for the last one, need to have the same size,
+ * and the last one can't be bigger than the others: the kernel then splits the
+ * resulting message back into the original datagrams, as set by UDP_SEGMENT.
+ * Data for messages from tap is already contiguous in the iovec array.
+ *
+ * Return: number of resulting messages in @mm
+ */
+static int udp_gso_merge(struct mmsghdr *mm, int n, int *segs)
+{
+	int i, out;
+
+	for (i = 0, out = 0; i < n; out++) {
+		struct msghdr *mh = &mm[i].msg_hdr;
+		size_t size = iov_size(mh->msg_iov, mh->msg_iovlen);
+		size_t total = size;
+		int j = i + 1;
+
+		while (size && j < n && j - i < UDP_GSO_MAX_SEGS) {
+			const struct msghdr *next = &mm[j].msg_hdr;
+			size_t nsize = iov_size(next->msg_iov,
+						next->msg_iovlen);
+
+			if (!nsize || nsize > size ||
+			    total + nsize > UDP_GSO_MAX_LEN ||
+			    next->msg_iov != mh->msg_iov + mh->msg_iovlen)
+				break;
+
+			mh->msg_iovlen += next->msg_iovlen;
+			total += nsize;
+			j++;
+
+			if (nsize < size)
+				break;
+		}
+
+		if (j - i > 1) {
+			struct cmsghdr *cmsg;
+
+			mh->msg_control = udp_gso_cmsg[out];
+			mh->msg_controllen = sizeof(udp_gso_cmsg[out]);
+
+			cmsg = CMSG_FIRSTHDR(mh);
+			cmsg->cmsg_level = SOL_UDP;
+			cmsg->cmsg_type = UDP_SEGMENT;
+			cmsg->cmsg_len = CMSG_LEN(sizeof(uint16_t));
+			*(uint16_t *)CMSG_DATA(cmsg) = size;
+		}
+
+		segs[out] = j - i;
+		if (out != i)
+			mm[out] = mm[i];
+		i = j;
+	}
+
+	return out;
+}
+
+/**
+ * udp_tap_pmtu() - Report path MTU to guest if its datagrams don't fit
+ * @c:		Execution context
+ * @uflow:	UDP flow
+ * @tosidx:	Flow and side the datagrams are forwarded to
+ * @mm:		Datagrams from tap, without UDP header
+ * @n:		Number of datagrams in @mm
+ *
+ * The host fragments datagrams exceeding the path MTU it knows about, and
+ * fragments are commonly dropped on tunnels and by firewalls. Tell the guest
+ * with an ICMP "fragmentation needed" or "packet too big" message, as a router
+ * would, but forward datagrams anyway: the guest might not be able to do
+ * better. The path MTU is cached in the flow, and looked up again only if a
+ * datagram exceeds it, so that increases are noticed as well.
+ *
+ * #syscalls getsockopt
+ */
+static void udp_tap_pmtu(const struct ctx *c, struct udp_flow *uflow,
+			 flow_sidx_t tosidx, const struct mmsghdr *mm, int n)
+{
+	const struct flowside *tapside;
+	int s = uflow->s[tosidx.sidei];
+	struct sock_extended_err ee;
+	char data[ICMP6_MAX_DLEN];
+	size_t hlen, len, max = 0;
+	socklen_t sl;
+	int i, big, mtu;
+	bool v4;
+
+	tapside = flowside_at_sidx(flow_sidx_opposite(tosidx));
+	v4 = inany_v4(&tapside->eaddr);
+	hlen = sizeof(struct udphdr) +
+	       (v4 ? sizeof(struct iphdr) : sizeof(struct ipv6hdr));
+
+	for (i = 0, big = 0; i < n; i++) {
+		len = iov_size(mm[i].msg_hdr.msg_iov, mm[i].msg_hdr.msg_iovlen);
+		if (len > max) {
+			max = len;
+			big = i;
+		}
+	}
+
+	if (uflow->pmtu && max + hlen <= uflow->pmtu)
+		return;
+
+	/* Not connected yet, or shared: no route to look up */
+	if ((tosidx.sidei ? uflow->connect1 : uflow->connect0) ||
+	    (uflow->shared && tosidx.sidei == TGTSIDE))
+		return;
+
+	sl = sizeof(mtu);
+	if (getsockopt(s, v4 ? IPPROTO_IP : IPPROTO_IPV6,
+		       v4 ? IP_MTU : IPV6_MTU, &mtu, &sl) || mtu <= 0) {
+		flow_dbg_perror(uflow, "Can't get path MTU");
+		return;
+	}
+	uflow->pmtu = MIN(mtu, UINT16_MAX);
+
+	if (max + hlen <= uflow->pmtu)
+		return;
+
+	flow_dbg(uflow, "%zu bytes datagram exceeds path MTU %u",
+		 max + hlen, uflow->pmtu);
+
+	memset(&ee, 0, sizeof(ee));
+	ee.ee_errno = EMSGSIZE;
+	ee.ee_info = uflow->pmtu;
+	if (v4) {
+		ee.ee_origin = SO_EE_ORIGIN_ICMP;
+		ee.ee_type = ICMP_DEST_UNREACH;
+		ee.ee_code = ICMP_FRAG_NEEDED;
+
+		len = iov_to_buf(mm[big].msg_hdr.msg_iov,
+				 mm[big].msg_hdr.msg_iovlen, 0,
+				 data, ICMP4_MAX_DLEN);
+		udp_send_tap_icmp4(c, &ee, tapside,
+				   *inany_v4(&tapside->oaddr), data, len);
+	} else {
+		ee.ee_origin = SO_EE_ORIGIN_ICMP6;
+		ee.ee_type = ICMP6_PACKET_TOO_BIG;
+
+		len = iov_to_buf(mm[big].msg_hdr.msg_iov,
+				 mm[big].msg_hdr.msg_iovlen, 0,
+				 data, ICMP6_MAX_DLEN);
+		udp_send_tap_icmp6(c, &ee, tapside, &tapside->oaddr.a6,
+				   data, len, FLOW_IDX(uflow));
+	}
+}
+
 /**
  * udp_tap_handler() - Handle packets from tap
  * @c:		Execution context
@@ -1008,6 +1704,7 @@ fail:
  * @saddr:	Source address
  * @daddr:	Destination address
  * @ttl:	TTL or hop limit for packets to be sent in this call
+ * @ecn:	ECN field for packets to be sent in this call
  * @p:		Pool of UDP packets, with UDP headers
  * @idx:	Index of first packet to process
  * @now:	Current timestamp
@@ -1018,17 +1715,18 @@ fail:
  */
 int udp_tap_handler(const struct ctx *c, uint8_t pif,
 		    sa_family_t af, const void *saddr, const void *daddr,
-		    uint8_t ttl, const struct pool *p, int idx,
+		    uint8_t ttl, uint8_t ecn, const struct pool *p, int idx,
 		    const struct timespec *now)
 {
 	const struct flowside *toside;
 	struct mmsghdr mm[UIO_MAXIOV];
 	union sockaddr_inany to_sa;
 	struct iovec m[UIO_MAXIOV];
+	int i, j, s, n, count = 0, dropped, sent;
 	struct udphdr uh_storage;
 	const struct udphdr *uh;
+	int segs[UIO_MAXIOV];
 	struct udp_flow *uflow;
-	int i, j, s, count = 0;
 	struct iov_tail data;
 	flow_sidx_t tosidx;
 	in_port_t src, dst;
@@ -1049,6 +1747,10 @@ int udp_tap_handler(const struct ctx *c, uint8_t pif,
 	src = ntohs(uh->source);
 	dst = ntohs(uh->dest);
 
+	if (pif == PIF_TAP && dst == DNS_PORT &&
+	    dns_query(c, af, saddr, daddr, src, &data, now))
+		return 1;
+
 	tosidx = udp_flow_from_tap(c, pif, af, saddr, daddr, src, dst, now);
 	if (!(uflow = udp_at_sidx(tosidx))) {
 		char sstr[INET6_ADDRSTRLEN], dstr[INET6_ADDRSTRLEN];
@@ -1109,7 +1811,8 @@ int udp_tap_handler(const struct ctx *c, uint8_t pif,
 		mm[i].msg_hdr.msg_controllen = 0;
 		mm[i].msg_hdr.msg_flags = 0;
 
-		if (ttl != uflow->ttl[tosidx.sidei]) {
+		if (ttl != uflow->ttl[tosidx.sidei] &&
+		    !(uflow->shared && tosidx.sidei == TGTSIDE)) {
 			uflow->ttl[tosidx.sidei] = ttl;
 			if (af == AF_INET) {
 				if (setsockopt(s, IPPROTO_IP, IP_TTL,
@@ -1130,11 +1833,59 @@ int udp_tap_handler(const struct ctx *c, uint8_t pif,
 		count++;
 	}
 
-	count = sendmmsg(s, mm, count, MSG_NOSIGNAL);
-	if (count < 0)
-		return 1;
+	if (c->udp.ecn && ecn != uflow->ecn[tosidx.sidei] &&
+	    !(uflow->shared && tosidx.sidei == TGTSIDE)) {
+		int tos = ecn;
+
+		uflow->ecn[tosidx.sidei] = ecn;
+		if (setsockopt(s, af == AF_INET ? IPPROTO_IP : IPPROTO_IPV6,
+			       af == AF_INET ? IP_TOS : IPV6_TCLASS,
+			       &tos, sizeof(tos)) < 0)
+			flow_perror(uflow, "setsockopt IP_TOS");
+	}
+
+	/* Police --tap-rate: drop whatever exceeds the allowance */
+	for (i = 0; i < count; i++) {
+		size_t len = iov_size(mm[i].msg_hdr.msg_iov,
+				      mm[i].msg_hdr.msg_iovlen);
+
+		if (!tap_shape_admit(c, TAP_SHAPE_FROM_TAP, len, now))
+			break;
+	}
+	if ((dropped = count - i)) {
+		stats_drop(pif, PESTO_STATS_UDP, dropped);
+		if (!(count = i))
+			return dropped;
+	}
+
+	udp_tap_pmtu(c, uflow, tosidx, mm, count);
+
+	if (udp_gso_cap && !uflow->no_gso) {
+		n = udp_gso_merge(mm, count, segs);
+	} else {
+		for (i = 0; i < count; i++)
+			segs[i] = 1;
+		n = count;
+	}
+
+	n = sendmmsg(s, mm, n, MSG_NOSIGNAL);
+	if (n < 0) {
+		if (segs[0] > 1 && (errno == EINVAL || errno == EIO)) {
+			/* Segment size exceeds path MTU, or no segmentation
+			 * offload on the output device: go one by one
+			 */
+			flow_dbg_perror(uflow, "UDP_SEGMENT send failed");
+			uflow->no_gso = true;
+			return 0;
+		}
+		return segs[0];
+	}
+
+	for (i = 0, sent = 0; i < n; i++)
+		sent += segs[i];
 
-	return count;
+	/* Dropped datagrams are consumed too, unless we need to resume */
+	return sent == count ? sent + dropped : sent;
 }
 
 /**
@@ -1144,19 +1895,41 @@ static void udp_splice_iov_init(void)
 {
 	int i;
 
-	for (i = 0; i < UDP_MAX_FRAMES; i++) {
+	for (i = 0; i < UDP_SPLICE_FRAMES; i++) {
 		struct msghdr *mh = &udp_mh_splice[i].msg_hdr;
 
-		mh->msg_name = &udp_splice_to;
-		mh->msg_namelen = sizeof(udp_splice_to);
+		mh->msg_name = &udp_splice_to[i];
+		mh->msg_namelen = sizeof(udp_splice_to[i]);
 
-		udp_iov_splice[i].iov_base = udp_payload[i].data;
+		udp_iov_splice[i].iov_base = udp_splice_payload[i].data;
 
 		mh->msg_iov = &udp_iov_splice[i];
 		mh->msg_iovlen = 1;
 	}
 }
 
+/**
+ * udp_probe_gso_cap() - Check if UDP_SEGMENT is supported by the kernel
+ *
+ * Return: true if supported, false otherwise
+ */
+static bool udp_probe_gso_cap(void)
+{
+	bool ret = false;
+	int s, optv = 0;
+
+	s = socket(AF_INET, SOCK_DGRAM | SOCK_CLOEXEC, IPPROTO_UDP);
+	if (s < 0) {
+		warn_perror("Temporary UDP socket creation failed");
+	} else {
+		if (!setsockopt(s, SOL_UDP, UDP_SEGMENT, &optv, sizeof(optv)))
+			ret = true;
+		close(s);
+	}
+
+	return ret;
+}
+
 /**
  * udp_get_timeout_params() - Get host kernel UDP timeout parameters
  * @c:		Execution context
@@ -1175,6 +1948,15 @@ static void udp_get_timeout_params(struct ctx *c)
 	      c->udp.timeout, c->udp.stream_timeout);
 }
 
+/**
+ * udp_release() - Release pages of payload buffers if no frames are queued
+ */
+void udp_release(void)
+{
+	if (!udp_buf_used)
+		madvise_free(udp_payload, sizeof(udp_payload));
+}
+
 /**
  * udp_init() - Initialise per-socket data, and sockets in namespace
  * @c:		Execution context
@@ -1192,5 +1974,10 @@ int udp_init(struct ctx *c)
 	if (c->mode == MODE_PASTA)
 		udp_splice_iov_init();
 
+	udp_flow_init(c);
+
+	udp_gso_cap = udp_probe_gso_cap();
+	debug("UDP_SEGMENT%ssupported", udp_gso_cap ? " " : " not ");
+
 	return 0;
 }
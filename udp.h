@@ -15,11 +15,16 @@ void udp_listen_sock_handler(const struct ctx *c, union epoll_ref ref,
 			     uint32_t events, const struct timespec *now);
 void udp_sock_handler(const struct ctx *c, union epoll_ref ref,
 		      uint32_t events, const struct timespec *now);
+void udp_shared_sock_handler(const struct ctx *c, union epoll_ref ref,
+			     uint32_t events, const struct timespec *now);
 int udp_tap_handler(const struct ctx *c, uint8_t pif,
 		    sa_family_t af, const void *saddr, const void *daddr,
-		    uint8_t ttl, const struct pool *p, int idx,
+		    uint8_t ttl, uint8_t ecn, const struct pool *p, int idx,
 		    const struct timespec *now);
 int udp_init(struct ctx *c);
+void udp_splice_flush(void);
+void udp_flush(const struct ctx *c);
+void udp_release(void);
 void udp_update_l2_buf(const unsigned char *eth_d);
 
 /**
@@ -28,12 +33,16 @@ void udp_update_l2_buf(const unsigned char *eth_d);
  * @scan_out:		Port scanning state for outbound packets
  * @timeout:		Timeout for unidirectional flows (in s)
  * @stream_timeout:	Timeout for stream-like flows (in s)
+ * @shared:		Share unconnected sockets among flows from tap to host
+ * @ecn:		Propagate ECN field between tap and sockets
  */
 struct udp_ctx {
 	struct fwd_scan scan_in;
 	struct fwd_scan scan_out;
 	int timeout;
 	int stream_timeout;
+	int shared;
+	int ecn;
 };
 
 #endif /* UDP_H */
@@ -7,6 +7,7 @@
 
 #include <errno.h>
 #include <fcntl.h>
+#include <sched.h>
 #include <sys/uio.h>
 #include <unistd.h>
 #include <netinet/udp.h>
@@ -14,9 +15,31 @@
 #include "util.h"
 #include "passt.h"
 #include "flow_table.h"
+#include "udp.h"
 #include "udp_internal.h"
 #include "epoll_ctl.h"
 
+/* Pools of pre-opened sockets for flows on the host side */
+static struct sock_pool udp_init_pool4;
+static struct sock_pool udp_init_pool6;
+
+/* Pools of pre-opened sockets for flows in the namespace, pasta mode only */
+static struct sock_pool udp_ns_pool4;
+static struct sock_pool udp_ns_pool6;
+
+/* Unconnected sockets shared by flows from tap to host, see --udp-shared */
+#define UDP_SHARED_SOCKS	8
+
+/**
+ * struct udp_shared - Unconnected socket shared by outbound flows
+ * @s:		Socket, -1 if not created yet
+ * @port:	Bound (ephemeral) port
+ */
+static struct udp_shared {
+	int s;
+	in_port_t port;
+} udp_shared[2][UDP_SHARED_SOCKS];	/* By address family: IPv4, IPv6 */
+
 /**
  * udp_at_sidx() - Get UDP specific flow at given sidx
  * @sidx:    Flow and side to retrieve
@@ -47,25 +70,71 @@ void udp_flow_close(const struct ctx *c, struct udp_flow *uflow)
 	if (uflow->closed)
 		return; /* Nothing to do */
 
+	/* Datagrams might be queued for sockets we're about to close */
+	udp_splice_flush();
+
 	flow_foreach_sidei(sidei) {
 		flow_hash_remove(c, FLOW_SIDX(uflow, sidei));
 		if (uflow->s[sidei] >= 0) {
-			epoll_del(flow_epollfd(&uflow->f), uflow->s[sidei]);
-			close(uflow->s[sidei]);
+			if (!(uflow->shared && sidei == TGTSIDE)) {
+				epoll_del(flow_epollfd(&uflow->f),
+					  uflow->s[sidei]);
+				close(uflow->s[sidei]);
+			}
 			uflow->s[sidei] = -1;
 		}
 	}
 
 	uflow->closed = true;
+	flow_defer(&uflow->f);
+}
+
+/**
+ * udp_flow_sock_l4() - Create and bind socket based on flowside, using pools
+ * @c:		Execution context
+ * @pif:	Interface for this socket
+ * @side:	Flowside to create a socket for
+ *
+ * Return: socket bound to our address and port from @side, negative error code
+ *         on failure
+ */
+static int udp_flow_sock_l4(const struct ctx *c, uint8_t pif,
+			    const struct flowside *side)
+{
+	union sockaddr_inany sa;
+	struct sock_pool *p;
+	int s;
+
+	/* Sockets stay in the namespace they were created in, so we can bind
+	 * one from the pool without entering the namespace again
+	 */
+	pif_sockaddr(c, &sa, pif, &side->oaddr, side->oport);
+	if (sa.sa_family == AF_INET6)
+		p = pif == PIF_SPLICE ? &udp_ns_pool6 : &udp_init_pool6;
+	else
+		p = pif == PIF_SPLICE ? &udp_ns_pool4 : &udp_init_pool4;
+
+	if ((s = sock_pool_get(p)) < 0)
+		return flowside_sock_l4(c, EPOLL_TYPE_UDP, pif, side);
+
+	s = sock_l4_bind(s, EPOLL_TYPE_UDP, &sa, flowside_ifname(c, pif, side));
+	if (s < 0)
+		errno = -s;
+
+	return s;
 }
 
 /**
- * udp_flow_sock() - Create, bind and connect a flow specific UDP socket
+ * udp_flow_sock() - Create and bind a flow specific UDP socket
  * @c:		Execution context
  * @uflow:	UDP flow to open socket for
  * @sidei:	Side of @uflow to open socket for
  * @now:	Current timestamp
  *
+ * We don't connect() the socket here, but only once we're done with the
+ * current batch of packets, see udp_flow_connect(): datagrams we forward in
+ * the meantime carry their destination address anyway.
+ *
  * Return: fd of new socket on success, -ve error code on failure
  */
 static int udp_flow_sock(const struct ctx *c,
@@ -77,30 +146,88 @@ static int udp_flow_sock(const struct ctx *c,
 	int rc;
 	int s;
 
-	s = flowside_sock_l4(c, EPOLL_TYPE_UDP, pif, side);
+	s = udp_flow_sock_l4(c, pif, side);
 	if (s < 0) {
 		flow_perror_ratelimit(uflow, now,
 				      "Couldn't open flow specific socket");
 		return s;
 	}
 
-	flow_epollid_set(&uflow->f, EPOLLFD_ID_DEFAULT);
+	if (sidei == TGTSIDE &&
+	    fwd_tune_sock(flow_tune(&uflow->f), s, IPPROTO_UDP)) {
+		flow_trace(uflow, "failed to set socket options on socket %i",
+			   s);
+	}
+
+	flow_epollid_assign(c, &uflow->f);
 	if (flow_epoll_set(&uflow->f, EPOLL_CTL_ADD, EPOLLIN, s, sidei) < 0) {
 		rc = -errno;
 		close(s);
 		return rc;
 	}
+	uflow->s[sidei] = s;
+
+	if (sidei)
+		uflow->connect1 = true;
+	else
+		uflow->connect0 = true;
+	flow_defer(&uflow->f);
+
+	return s;
+}
+
+/**
+ * udp_flow_connect() - Connect flow specific socket, once the batch is done
+ * @c:		Execution context
+ * @uflow:	UDP flow
+ * @sidei:	Side of @uflow with the socket to connect
+ * @now:	Current timestamp
+ *
+ * Return: 0 on success, -1 on failure
+ *
+ * #syscalls getsockname
+ */
+static int udp_flow_connect(const struct ctx *c, struct udp_flow *uflow,
+			    unsigned sidei, const struct timespec *now)
+{
+	struct flowside *side = &uflow->f.side[sidei];
+	uint8_t pif = uflow->f.pif[sidei];
+	int s = uflow->s[sidei];
 
 	if (flowside_connect(c, s, pif, side) < 0) {
-		rc = -errno;
 		flow_warn_perror_ratelimit(uflow, now,
 					   "Couldn't connect flow socket");
+		return -1;
+	}
 
-		epoll_del(flow_epollfd(&uflow->f), s);
-		close(s);
-		return rc;
+	if (sidei == TGTSIDE && inany_is_unspecified(&side->oaddr)) {
+		/* When we target a socket, we connect() it, but might not
+		 * always bind() it to a specific address, leaving the kernel
+		 * to pick our address.  We need to determine it so that we
+		 * can match reply packets back to the correct flow: update
+		 * the flow, and its hash entry, with the information from
+		 * getsockname().  If the address was already known, there's
+		 * nothing to do.
+		 */
+		union sockaddr_inany sa;
+		socklen_t sl = sizeof(sa);
+		union inany_addr oaddr;
+		in_port_t port;
+
+		if (getsockname(s, &sa.sa, &sl) < 0 ||
+		    inany_from_sockaddr(&oaddr, &port, &sa) < 0) {
+			flow_perror(uflow, "Unable to determine local address");
+			return -1;
+		}
+		if (port != side->oport) {
+			flow_err_ratelimit(uflow, now, "Unexpected local port");
+			return -1;
+		}
+
+		flow_hash_remove(c, FLOW_SIDX(uflow, sidei));
+		side->oaddr = oaddr;
+		flow_hash_insert(c, FLOW_SIDX(uflow, sidei));
 	}
-	uflow->s[sidei] = s;
 
 	/* It's possible, if unlikely, that we could receive some packets in
 	 * between the bind() and connect() which may or may not be for this
@@ -124,7 +251,104 @@ static int udp_flow_sock(const struct ctx *c,
 	else
 		uflow->flush0 = true;
 
-	return s;
+	return 0;
+}
+
+/**
+ * udp_shared_sock() - Get shared socket, creating it if needed
+ * @c:		Execution context
+ * @v6:		Use IPv6 socket
+ * @i:		Index of shared socket
+ *
+ * Return: shared socket, or NULL if it can't be created
+ *
+ * #syscalls getsockname
+ */
+static const struct udp_shared *udp_shared_sock(const struct ctx *c,
+						bool v6, unsigned i)
+{
+	struct udp_shared *sh = &udp_shared[v6][i];
+	union epoll_ref ref = { .type = EPOLL_TYPE_UDP_SHARED };
+	union sockaddr_inany sa;
+	socklen_t sl = sizeof(sa);
+	int s;
+
+	if (sh->s >= 0)
+		return sh;
+
+	pif_sockaddr(c, &sa, PIF_HOST, v6 ? &inany_any6 : &inany_any4, 0);
+	if ((s = sock_l4(c, EPOLL_TYPE_UDP_SHARED, &sa, NULL)) < 0)
+		return NULL;
+
+	if (getsockname(s, &sa.sa, &sl) < 0) {
+		close(s);
+		return NULL;
+	}
+
+	ref.fd = s;
+	ref.listen.pif = PIF_HOST;
+	ref.listen.port = v6 ? ntohs(sa.sa6.sin6_port) : ntohs(sa.sa4.sin_port);
+	if (epoll_add(c->epollfd, EPOLLIN, ref) < 0) {
+		close(s);
+		return NULL;
+	}
+
+	sh->s = s;
+	sh->port = ref.listen.port;
+
+	return sh;
+}
+
+/**
+ * udp_flow_shared() - Use a shared socket for the target side, if possible
+ * @c:		Execution context
+ * @uflow:	New UDP flow, target side not hashed yet
+ *
+ * Flows from tap to host can share an unconnected socket if we don't need a
+ * specific local address or interface for them, and if no other flow using
+ * the same socket has the same peer, as we match replies by flow hash.
+ *
+ * Return: true if the flow now uses a shared socket, false otherwise
+ */
+static bool udp_flow_shared(const struct ctx *c, struct udp_flow *uflow)
+{
+	struct flowside *tgt = &uflow->f.side[TGTSIDE];
+	const char *ifname;
+	struct flowside side;
+	unsigned i;
+	bool v6;
+
+	if (!c->udp.shared || uflow->f.pif[INISIDE] != PIF_TAP ||
+	    uflow->f.pif[TGTSIDE] != PIF_HOST ||
+	    !inany_is_unspecified(&tgt->oaddr))
+		return false;
+
+	ifname = flowside_ifname(c, PIF_HOST, tgt);
+	if (ifname && *ifname)
+		return false;
+
+	v6 = !inany_v4(&tgt->eaddr);
+	side = *tgt;
+	side.oaddr = v6 ? inany_any6 : inany_any4;
+
+	for (i = 0; i < UDP_SHARED_SOCKS; i++) {
+		const struct udp_shared *sh = udp_shared_sock(c, v6, i);
+
+		if (!sh)
+			return false;
+
+		side.oport = sh->port;
+		if (flow_sidx_valid(flowside_lookup(c, IPPROTO_UDP, PIF_HOST,
+						    &side)))
+			continue;
+
+		*tgt = side;
+		uflow->s[TGTSIDE] = sh->s;
+		uflow->shared = true;
+		return true;
+	}
+
+	return false;
 }
 
 /**
@@ -136,8 +360,6 @@ static int udp_flow_sock(const struct ctx *c,
  *
  * Return: sidx for the target side of the new UDP flow, or FLOW_SIDX_NONE
  *         on failure.
- *
- * #syscalls getsockname
  */
 static flow_sidx_t udp_flow_new(const struct ctx *c, union flow *flow,
 				int rule_hint, const struct timespec *now)
@@ -153,36 +375,20 @@ static flow_sidx_t udp_flow_new(const struct ctx *c, union flow *flow,
 	uflow->ts = now->tv_sec;
 	uflow->s[INISIDE] = uflow->s[TGTSIDE] = -1;
 	uflow->ttl[INISIDE] = uflow->ttl[TGTSIDE] = 0;
+	uflow->ecn[INISIDE] = uflow->ecn[TGTSIDE] = 0;
 	uflow->activity[INISIDE] = 1;
 	uflow->activity[TGTSIDE] = 0;
+	uflow->pmtu = 0;
 
 	flow_foreach_sidei(sidei) {
-		if (pif_is_socket(uflow->f.pif[sidei]))
-			if (udp_flow_sock(c, uflow, sidei, now) < 0)
-				goto cancel;
-	}
+		if (!pif_is_socket(uflow->f.pif[sidei]))
+			continue;
 
-	if (uflow->s[TGTSIDE] >= 0 && inany_is_unspecified(&tgt->oaddr)) {
-		/* When we target a socket, we connect() it, but might not
-		 * always bind(), leaving the kernel to pick our address.  In
-		 * that case connect() will implicitly bind() the socket, but we
-		 * need to determine its local address so that we can match
-		 * reply packets back to the correct flow.  Update the flow with
-		 * the information from getsockname() */
-		union sockaddr_inany sa;
-		socklen_t sl = sizeof(sa);
-		in_port_t port;
+		if (sidei == TGTSIDE && udp_flow_shared(c, uflow))
+			continue;
 
-		if (getsockname(uflow->s[TGTSIDE], &sa.sa, &sl) < 0 ||
-		    inany_from_sockaddr(&uflow->f.side[TGTSIDE].oaddr,
-					&port, &sa) < 0) {
-			flow_perror(uflow, "Unable to determine local address");
-			goto cancel;
-		}
-		if (port != tgt->oport) {
-			flow_err_ratelimit(uflow, now, "Unexpected local port");
+		if (udp_flow_sock(c, uflow, sidei, now) < 0)
 			goto cancel;
-		}
 	}
 
 	/* Tap sides always need to be looked up by hash.  Socket sides don't
@@ -229,12 +435,21 @@ flow_sidx_t udp_flow_from_sock(const struct ctx *c, uint8_t pif,
 	union flow *flow;
 	flow_sidx_t sidx;
 
+	/* Shared sockets aren't bound to a specific address, see
+	 * udp_flow_shared(), and they don't create new flows
+	 */
+	if (rule_hint == UDP_SHARED_HINT)
+		dst = inany_v4(dst) ? &inany_any4 : &inany_any6;
+
 	sidx = flow_lookup_sa(c, IPPROTO_UDP, pif, s_in, dst, port);
 	if ((uflow = udp_at_sidx(sidx))) {
 		udp_flow_activity(uflow, sidx.sidei, now);
 		return flow_sidx_opposite(sidx);
 	}
 
+	if (rule_hint == UDP_SHARED_HINT)
+		return FLOW_SIDX_NONE;
+
 	if (!(flow = flow_alloc())) {
 		char sastr[SOCKADDR_STRLEN];
 
@@ -294,6 +509,9 @@ flow_sidx_t udp_flow_from_tap(const struct ctx *c,
 		return flow_sidx_opposite(sidx);
 	}
 
+	if (!flow_admit(c, af, saddr, now))
+		return FLOW_SIDX_NONE;
+
 	if (!(flow = flow_alloc())) {
 		char sstr[INET6_ADDRSTRLEN], dstr[INET6_ADDRSTRLEN];
 
@@ -345,6 +563,19 @@ static void udp_flush_flow(const struct ctx *c,
 bool udp_flow_defer(const struct ctx *c, struct udp_flow *uflow,
 		    const struct timespec *now)
 {
+	if (uflow->connect0) {
+		uflow->connect0 = false;
+		if (udp_flow_connect(c, uflow, INISIDE, now))
+			udp_flow_close(c, uflow);
+	}
+	if (uflow->connect1) {
+		uflow->connect1 = false;
+		if (!uflow->closed && udp_flow_connect(c, uflow, TGTSIDE, now))
+			udp_flow_close(c, uflow);
+	}
+	if (uflow->closed)
+		return true;
+
 	if (uflow->flush0) {
 		udp_flush_flow(c, uflow, INISIDE, now);
 		uflow->flush0 = false;
@@ -373,7 +604,7 @@ bool udp_flow_timer(const struct ctx *c, struct udp_flow *uflow,
 	    (uflow->activity[INISIDE] > 1 || uflow->activity[TGTSIDE] > 1))
 		timeout = c->udp.stream_timeout;
 
-	if (now->tv_sec - uflow->ts <= timeout)
+	if (now->tv_sec - uflow->ts <= flow_timeout(timeout))
 		return false;
 
 	udp_flow_close(c, uflow);
@@ -393,3 +624,94 @@ void udp_flow_activity(struct udp_flow *uflow, unsigned int sidei,
 	if (uflow->activity[sidei] < UINT8_MAX)
 		uflow->activity[sidei]++;
 }
+
+/**
+ * udp_flow_fill() - Fill pools of pre-opened sockets, in current namespace
+ * @c:		Execution context
+ * @p4:		Pool of IPv4 sockets
+ * @p6:		Pool of IPv6 sockets
+ */
+static void udp_flow_fill(const struct ctx *c,
+			  struct sock_pool *p4, struct sock_pool *p6)
+{
+	unsigned i;
+
+	for (i = 0; c->ifi4 && i < p4->size; i++) {
+		if (p4->fd[i] < 0 &&
+		    (p4->fd[i] = sock_l4_open(c, EPOLL_TYPE_UDP, AF_INET)) < 0)
+			break;
+	}
+
+	for (i = 0; c->ifi6 && i < p6->size; i++) {
+		if (p6->fd[i] < 0 &&
+		    (p6->fd[i] = sock_l4_open(c, EPOLL_TYPE_UDP, AF_INET6)) < 0)
+			break;
+	}
+}
+
+/**
+ * udp_flow_refill_ns() - Refill pools of pre-opened sockets in namespace
+ * @arg:	Execution context cast to void *
+ *
+ * Return: 0
+ */
+static int udp_flow_refill_ns(void *arg)
+{
+	const struct ctx *c = (const struct ctx *)arg;
+
+	ns_enter(c);
+
+	udp_flow_fill(c, &udp_ns_pool4, &udp_ns_pool6);
+
+	return 0;
+}
+
+/**
+ * udp_flow_refill() - Refill pools of pre-opened sockets for UDP flows
+ * @c:		Execution context
+ * @timer:	Called from timer: resize pools
+ */
+void udp_flow_refill(const struct ctx *c, bool timer)
+{
+	if (timer) {
+		sock_pool_resize(&udp_init_pool4);
+		sock_pool_resize(&udp_init_pool6);
+	}
+
+	/* Refill only if half empty, so that we open sockets in batches */
+	if ((c->ifi4 && sock_pool_low(&udp_init_pool4)) ||
+	    (c->ifi6 && sock_pool_low(&udp_init_pool6)))
+		udp_flow_fill(c, &udp_init_pool4, &udp_init_pool6);
+
+	if (c->mode != MODE_PASTA)
+		return;
+
+	if (timer) {
+		sock_pool_resize(&udp_ns_pool4);
+		sock_pool_resize(&udp_ns_pool6);
+	}
+
+	/* Entering the namespace is expensive: refill only if half empty */
+	if ((c->ifi4 && sock_pool_low(&udp_ns_pool4)) ||
+	    (c->ifi6 && sock_pool_low(&udp_ns_pool6)))
+		NS_CALL(udp_flow_refill_ns, c);
+}
+
+/**
+ * udp_flow_init() - Initialise pools of pre-opened sockets for UDP flows
+ * @c:		Execution context
+ */
+void udp_flow_init(const struct ctx *c)
+{
+	unsigned i;
+
+	for (i = 0; i < UDP_SHARED_SOCKS; i++)
+		udp_shared[0][i].s = udp_shared[1][i].s = -1;
+
+	sock_pool_init(&udp_init_pool4);
+	sock_pool_init(&udp_init_pool6);
+	sock_pool_init(&udp_ns_pool4);
+	sock_pool_init(&udp_ns_pool6);
+
+	udp_flow_refill(c, false);
+}
@@ -17,28 +17,43 @@
  * struct udp_flow - Descriptor for a flow of UDP packets
  * @f:		Generic flow information
  * @ttl:	TTL or hop_limit for both sides
+ * @ecn:	ECN field set on sockets, for both sides
  * @closed:	Flow is already closed
  * @flush0:	@s[0] may have datagrams queued for other flows
  * @flush1:	@s[1] may have datagrams queued for other flows
+ * @connect0:	@s[0] is bound, but not connected yet
+ * @connect1:	@s[1] is bound, but not connected yet
+ * @no_gso:	UDP_SEGMENT sends failed for this flow, don't merge datagrams
+ * @shared:	@s[1] is shared with other flows, see --udp-shared
  * @ts:		Activity timestamp
  * @s:		Socket fd (or -1) for each side of the flow
  * @activity:	Packets seen from each side of the flow, up to UINT8_MAX
+ * @pmtu:	Path MTU known by the host for its side, 0 if not known yet
  */
 struct udp_flow {
 	/* Must be first element */
 	struct flow_common f;
 
 	uint8_t ttl[SIDES];
+	uint8_t ecn[SIDES];
 
 	bool	closed	:1,
 		flush0	:1,
-		flush1	:1;
+		flush1	:1,
+		connect0 :1,
+		connect1 :1,
+		no_gso	:1,
+		shared	:1;
 
 	time_t ts;
 	int s[SIDES];
 	uint8_t activity[SIDES];
+	uint16_t pmtu;
 };
 
+/* Rule hint for shared sockets: only deliver datagrams to existing flows */
+#define UDP_SHARED_HINT		(-2)
+
 struct udp_flow *udp_at_sidx(flow_sidx_t sidx);
 flow_sidx_t udp_flow_from_sock(const struct ctx *c, uint8_t pif,
 			       const union inany_addr *dst, in_port_t port,
@@ -56,5 +71,7 @@ bool udp_flow_timer(const struct ctx *c, struct udp_flow *uflow,
 		    const struct timespec *now);
 void udp_flow_activity(struct udp_flow *uflow, unsigned int sidei,
 		       const struct timespec *now);
+void udp_flow_refill(const struct ctx *c, bool timer);
+void udp_flow_init(const struct ctx *c);
 
 #endif /* UDP_FLOW_H */
@@ -7,6 +7,7 @@
 
 #include <unistd.h>
 #include <assert.h>
+#include <errno.h>
 #include <net/ethernet.h>
 #include <net/if.h>
 #include <netinet/in.h>
@@ -14,6 +15,7 @@
 #include <netinet/udp.h>
 #include <stdint.h>
 #include <stddef.h>
+#include <sys/socket.h>
 #include <sys/uio.h>
 #include <linux/virtio_net.h>
 
@@ -32,6 +34,9 @@
 #include "udp_flow.h"
 #include "udp_vu.h"
 #include "vu_common.h"
+#include "stats.h"
+#include "dns.h"
+#include "tap.h"
 
 /**
  * udp_vu_hdrlen() - Sum size of all headers, from UDP to virtio-net
@@ -53,6 +58,30 @@ static size_t udp_vu_hdrlen(bool v6)
 	return hdrlen;
 }
 
+/* Descriptors for recvmmsg() into single-element frames */
+static struct mmsghdr udp_vu_mh[UDP_MAX_FRAMES];
+static struct iovec udp_vu_msg_iov[VIRTQUEUE_MAX_SIZE];
+
+/**
+ * udp_vu_iov_used() - Count buffer entries used by a frame, including padding
+ * @payload:	Buffer(s) for UDP payload, as passed to receive the datagram
+ * @dlen:	Size of received datagram
+ *
+ * Return: number of entries of @payload->iov used by the frame
+ */
+static size_t udp_vu_iov_used(const struct iov_tail *payload, size_t dlen)
+{
+	size_t iov_used;
+
+	iov_used = iov_skip_bytes(payload->iov, payload->cnt,
+				  MAX(dlen + payload->off,
+				      VNET_HLEN + ETH_ZLEN), NULL);
+	if (iov_used < payload->cnt)
+		iov_used++;
+
+	return iov_used;
+}
+
 /**
  * udp_vu_sock_recv() - Receive datagrams from socket into vhost-user buffers
  * @payload:	Buffer(s) for UDP payload
@@ -66,7 +95,6 @@ static ssize_t udp_vu_sock_recv(struct iov_tail *payload, size_t *cnt, int s)
 {
 	struct iovec msg_iov[VIRTQUEUE_MAX_SIZE];
 	struct msghdr msg  = { 0 };
-	size_t iov_used;
 	ssize_t iovlen;
 	ssize_t dlen;
 
@@ -82,16 +110,83 @@ static ssize_t udp_vu_sock_recv(struct iov_tail *payload, size_t *cnt, int s)
 	if (dlen < 0)
 		return -1;
 
-	iov_used = iov_skip_bytes(payload->iov, payload->cnt,
-				  MAX(dlen + payload->off,
-				      VNET_HLEN + ETH_ZLEN), NULL);
-	if (iov_used < payload->cnt)
-		iov_used++;
-	*cnt = iov_used; /* one iovec per element */
+	*cnt = udp_vu_iov_used(payload, dlen); /* one iovec per element */
 
 	return dlen;
 }
 
+/**
+ * udp_vu_sock_recv_batch() - Receive datagrams into single-element frames
+ * @vdev:	vhost-user device
+ * @vq:		Receive virtqueue
+ * @elem:	Array of VIRTQUEUE_MAX_SIZE virtqueue elements, one per frame
+ * @iov_vu:	Array of VIRTQUEUE_MAX_SIZE iovecs for buffers of @elem
+ * @n:		Maximum number of datagrams to receive
+ * @hdrlen:	Size of headers preceding UDP payload
+ * @s:		Socket to receive from
+ *
+ * Without VIRTIO_NET_F_MRG_RXBUF, each frame takes exactly one element, so we
+ * can pop elements for a batch upfront, receive into all of them with a single
+ * recvmmsg(), and return the ones left over, which are the last ones we
+ * popped. With mergeable buffers, we can't tell how many elements a datagram
+ * needs until we receive it, and we can't return unused elements from the
+ * middle of a batch, so the caller receives one datagram at a time instead.
+ *
+ * Return: number of datagrams received, with lengths in @udp_vu_mh, 0 if
+ *	   there are no buffers or no datagrams, -1 on error
+ *
+ * #syscalls:vu recvmmsg arm:recvmmsg_time64 i686:recvmmsg_time64
+ */
+static int udp_vu_sock_recv_batch(const struct vu_dev *vdev,
+				  struct vu_virtq *vq,
+				  struct vu_virtq_element *elem,
+				  struct iovec *iov_vu, int n, size_t hdrlen,
+				  int s)
+{
+	size_t iov_cnt = 0, msg_iov_cnt = 0;
+	int elem_cnt, ret;
+
+	n = MIN(n, (int)ARRAY_SIZE(udp_vu_mh));
+	for (elem_cnt = 0; elem_cnt < n; elem_cnt++) {
+		struct iovec *msg_iov = &udp_vu_msg_iov[msg_iov_cnt];
+		struct iov_tail payload;
+		size_t cnt;
+		ssize_t iovlen;
+
+		if (!vu_collect(vdev, vq, &elem[elem_cnt], 1,
+				&iov_vu[iov_cnt], VIRTQUEUE_MAX_SIZE - iov_cnt,
+				&cnt, IP_MAX_MTU + ETH_HLEN + VNET_HLEN, NULL))
+			break;
+
+		payload = IOV_TAIL(&iov_vu[iov_cnt], cnt, hdrlen);
+		iovlen = iov_tail_clone(msg_iov,
+					VIRTQUEUE_MAX_SIZE - msg_iov_cnt,
+					&payload);
+		if (iovlen < 0) {
+			vu_queue_rewind(vq, 1);
+			break;
+		}
+
+		udp_vu_mh[elem_cnt].msg_hdr = (struct msghdr){
+			.msg_iov = msg_iov, .msg_iovlen = iovlen,
+		};
+		iov_cnt += cnt;
+		msg_iov_cnt += iovlen;
+	}
+
+	if (!elem_cnt)
+		return 0;
+
+	ret = recvmmsg(s, udp_vu_mh, elem_cnt, MSG_DONTWAIT, NULL);
+	if (ret < 0) {
+		vu_queue_rewind(vq, elem_cnt);
+		return errno == EAGAIN || errno == EWOULDBLOCK ? 0 : -1;
+	}
+
+	vu_queue_rewind(vq, elem_cnt - ret);
+	return ret;
+}
+
 /**
  * udp_vu_prepare() - Prepare the packet header
  * @c:		Execution context
@@ -138,39 +233,139 @@ static void udp_vu_prepare(const struct ctx *c, struct iov_tail *data,
 	IOV_PUSH_HEADER(data, uh);
 }
 
+/**
+ * udp_vu_frame() - Finalise and queue frame for a received datagram
+ * @c:		Execution context
+ * @vq:		Receive virtqueue
+ * @elem:	Virtqueue elements used by the frame
+ * @elem_used:	Number of entries in @elem
+ * @iov:	Buffers of @elem
+ * @iov_cnt:	Number of entries in @iov used by the frame
+ * @payload:	UDP payload, as received
+ * @toside:	Flowside for destination side
+ * @hdrlen:	Size of headers preceding UDP payload
+ * @dlen:	Size of received datagram
+ * @hash:	Hash report for the flow
+ * @filled:	Frames queued but not flushed yet, updated on return
+ * @now:	Current timestamp
+ */
+static void udp_vu_frame(const struct ctx *c, struct vu_virtq *vq,
+			 struct vu_virtq_element *elem, int elem_used,
+			 struct iovec *iov, size_t iov_cnt,
+			 struct iov_tail *payload,
+			 const struct flowside *toside, size_t hdrlen,
+			 ssize_t dlen, const struct vu_hash *hash,
+			 unsigned int *filled, const struct timespec *now)
+{
+	struct vu_dev *vdev = c->vdev;
+	struct iov_tail data;
+
+	if (c->dns_cache && toside->oport == DNS_PORT) {
+		/* Replies to held queries use the same queue: make previous
+		 * frames visible before those are queued
+		 */
+		if (*filled) {
+			vu_queue_flush(vdev, vq, *filled);
+			*filled = 0;
+		}
+		dns_reply(c, toside, payload, dlen, now);
+	}
+
+	if (!iov_cnt)
+		return;
+
+	tap_shape_take(c, TAP_SHAPE_TO_TAP, dlen);
+
+	data = IOV_TAIL(iov, iov_cnt, VNET_HLEN);
+	udp_vu_prepare(c, &data, payload, toside, dlen);
+	if (*c->pcap)
+		pcap_iov(iov, iov_cnt, VNET_HLEN, hdrlen + dlen - VNET_HLEN);
+	vu_pad(iov, iov_cnt, hdrlen + dlen);
+	vu_fill_hdr(vdev, vq, elem, elem_used, hdrlen + dlen, &VU_HEADER,
+		    hash, *filled);
+	*filled += elem_used;
+}
+
 /**
  * udp_vu_sock_to_tap() - Forward datagrams from socket to tap
  * @c:		Execution context
  * @s:		Socket to read data from
  * @n:		Maximum number of datagrams to forward
  * @tosidx:	Flow & side to forward data from @s to
+ * @now:	Current timestamp
  */
-void udp_vu_sock_to_tap(const struct ctx *c, int s, int n, flow_sidx_t tosidx)
+void udp_vu_sock_to_tap(const struct ctx *c, int s, int n, flow_sidx_t tosidx,
+			const struct timespec *now)
 {
+	uint8_t frompif = pif_at_sidx(flow_sidx_opposite(tosidx));
 	const struct flowside *toside = flowside_at_sidx(tosidx);
 	bool v6 = !(inany_v4(&toside->eaddr) && inany_v4(&toside->oaddr));
 	static struct vu_virtq_element elem[VIRTQUEUE_MAX_SIZE];
 	static struct iovec iov_vu[VIRTQUEUE_MAX_SIZE];
 	struct vu_dev *vdev = c->vdev;
-	struct vu_virtq *vq = &vdev->vq[VHOST_USER_RX_QUEUE];
+	struct vu_virtq *vq = vu_rx_queue(vdev, tosidx.flowi);
+	struct vu_hash hash = vu_hash_flow(tosidx.flowi, IPPROTO_UDP, v6);
+	bool usable = vu_queue_enabled(vq) && vu_queue_started(vq);
 	size_t hdrlen = udp_vu_hdrlen(v6);
+	unsigned int filled = 0;
 	int i;
 
 	assert(!c->no_udp);
 
-	if (!vu_queue_enabled(vq) || !vu_queue_started(vq)) {
+	/* Police --tap-rate on the whole batch: we receive straight into guest
+	 * buffers, which can't be returned to the guest unused once filled
+	 */
+	if (!usable || tap_shape_avail(c, TAP_SHAPE_TO_TAP, now) <= 0) {
 		struct msghdr msg = { 0 };
 
-		debug("Got UDP packet, but RX virtqueue not usable yet");
+		if (!usable)
+			debug("Got UDP packet, RX virtqueue not usable yet");
 
 		for (i = 0; i < n; i++) {
-			if (recvmsg(s, &msg, MSG_DONTWAIT) < 0)
+			ssize_t dlen = recvmsg(s, &msg, MSG_DONTWAIT);
+
+			if (dlen < 0) {
+				if (errno == EAGAIN || errno == EWOULDBLOCK)
+					break;
+
 				debug_perror("Failed to discard datagram");
+				continue;
+			}
+
+			stats_rx(frompif, PESTO_STATS_UDP, 1, dlen);
+			stats_drop(frompif, PESTO_STATS_UDP, 1);
 		}
 
 		return;
 	}
 
+	if (!vu_has_feature(vdev, VIRTIO_NET_F_MRG_RXBUF)) {
+		size_t iov_off = 0;
+		int ret;
+
+		ret = udp_vu_sock_recv_batch(vdev, vq, elem, iov_vu, n, hdrlen,
+					     s);
+		for (i = 0; i < ret; i++) {
+			struct iovec *iov = &iov_vu[iov_off];
+			ssize_t dlen = udp_vu_mh[i].msg_len;
+			struct iov_tail payload;
+			size_t iov_cnt;
+
+			iov_off += elem[i].in_num;
+			stats_rx(frompif, PESTO_STATS_UDP, 1, dlen);
+
+			payload = IOV_TAIL(iov, elem[i].in_num, hdrlen);
+			iov_cnt = udp_vu_iov_used(&payload, dlen);
+			elem[i].in_num = iov_cnt;
+
+			udp_vu_frame(c, vq, &elem[i], 1, iov, iov_cnt,
+				     &payload, toside, hdrlen, dlen, &hash,
+				     &filled, now);
+		}
+
+		goto flush;
+	}
+
 	for (i = 0; i < n; i++) {
 		unsigned elem_cnt, elem_used, j, k;
 		struct iov_tail payload;
@@ -190,6 +385,8 @@ void udp_vu_sock_to_tap(const struct ctx *c, int s, int n, flow_sidx_t tosidx)
 			break;
 		}
 
+		stats_rx(frompif, PESTO_STATS_UDP, 1, dlen);
+
 		elem_used = 0;
 		for (j = 0, k = 0; k < iov_cnt && j < elem_cnt; j++) {
 			size_t iov_still_needed = iov_cnt - k;
@@ -203,16 +400,14 @@ void udp_vu_sock_to_tap(const struct ctx *c, int s, int n, flow_sidx_t tosidx)
 		/* release unused buffers */
 		vu_queue_rewind(vq, elem_cnt - elem_used);
 
-		if (iov_cnt > 0) {
-			struct iov_tail data = IOV_TAIL(iov_vu, iov_cnt, VNET_HLEN);
-			udp_vu_prepare(c, &data, &payload, toside, dlen);
-			if (*c->pcap) {
-				pcap_iov(iov_vu, iov_cnt, VNET_HLEN,
-					 hdrlen + dlen - VNET_HLEN);
-			}
-			vu_pad(iov_vu, iov_cnt, hdrlen + dlen);
-			vu_flush(vdev, vq, elem, elem_used, hdrlen + dlen);
-			vu_queue_notify(vdev, vq);
-		}
+		udp_vu_frame(c, vq, elem, elem_used, iov_vu, iov_cnt,
+			     &payload, toside, hdrlen, dlen, &hash, &filled,
+			     now);
+	}
+
+flush:
+	if (filled) {
+		vu_queue_flush(vdev, vq, filled);
+		vu_queue_notify_defer(vq);
 	}
 }
@@ -0,0 +1,229 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+
+/* PASST - Plug A Simple Socket Transport
+ *  for qemu/UNIX domain socket mode
+ *
+ * PASTA - Pack A Subtle Tap Abstraction
+ *  for network namespace/tap device mode
+ *
+ * uring.c - Minimal io_uring support for batched reads
+ *
+ * Copyright Red Hat
+ *
+ * We don't link against liburing: rings are set up with raw system calls, and
+ * mapped once at start-up, before the seccomp filter is installed. At run time,
+ * the only system call we need is io_uring_enter(), which submits a batch of
+ * reads and waits for all of them to complete.
+ *
+ * Reads are submitted with RWF_NOWAIT, so that they complete (or fail with
+ * EAGAIN) inline, from io_uring_enter(), and never need to be punted to kernel
+ * worker threads or wait for the descriptor to become readable: O_NONBLOCK
+ * alone doesn't prevent io_uring from arming a poll and completing them later.
+ */
+
+#include <errno.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <linux/io_uring.h>
+
+#include "util.h"
+#include "log.h"
+#include "uring.h"
+
+/**
+ * struct uring - Mapped io_uring instance
+ * @fd:		io_uring file descriptor, -1 if not set up
+ * @sq_head:	Submission queue head, advanced by the kernel
+ * @sq_tail:	Submission queue tail, advanced by us
+ * @sq_mask:	Mask for submission queue indices
+ * @sq_array:	Submission queue index array
+ * @sqes:	Submission queue entries
+ * @cq_head:	Completion queue head, advanced by us
+ * @cq_tail:	Completion queue tail, advanced by the kernel
+ * @cq_mask:	Mask for completion queue indices
+ * @cqes:	Completion queue entries
+ * @gen:	Batch generation, upper half of user_data for its reads, so that
+ *		late completions from previous batches aren't taken as ours
+ */
+struct uring {
+	int fd;
+
+	unsigned *sq_head;
+	unsigned *sq_tail;
+	unsigned *sq_mask;
+	unsigned *sq_array;
+	struct io_uring_sqe *sqes;
+
+	unsigned *cq_head;
+	unsigned *cq_tail;
+	unsigned *cq_mask;
+	struct io_uring_cqe *cqes;
+
+	uint32_t gen;
+};
+
+static struct uring uring = { .fd = -1 };
+
+/**
+ * uring_enabled() - Check if io_uring was successfully set up
+ *
+ * Return: true if uring_read_batch() can be used
+ */
+bool uring_enabled(void)
+{
+	return uring.fd >= 0;
+}
+
+/**
+ * uring_disable() - Stop using io_uring, close its file descriptor
+ */
+void uring_disable(void)
+{
+	if (uring.fd < 0)
+		return;
+
+	close(uring.fd);
+	uring.fd = -1;
+}
+
+/**
+ * uring_init() - Set up io_uring instance and map its rings
+ *
+ * Return: 0 on success, negative error code on failure
+ */
+int uring_init(void)
+{
+	struct io_uring_params p = { 0 };
+	size_t sq_len, cq_len;
+	char *sq, *cq;
+	int fd, rc;
+
+	fd = syscall(SYS_io_uring_setup, URING_ENTRIES, &p);
+	if (fd < 0)
+		return -errno;
+
+	sq_len = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+	cq_len = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+	if (p.features & IORING_FEAT_SINGLE_MMAP)
+		sq_len = cq_len = MAX(sq_len, cq_len);
+
+	sq = mmap(NULL, sq_len, PROT_READ | PROT_WRITE,
+		  MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+	if (sq == MAP_FAILED)
+		goto fail;
+
+	if (p.features & IORING_FEAT_SINGLE_MMAP) {
+		cq = sq;
+	} else {
+		cq = mmap(NULL, cq_len, PROT_READ | PROT_WRITE,
+			  MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+		if (cq == MAP_FAILED)
+			goto fail;
+	}
+
+	uring.sqes = mmap(NULL, p.sq_entries * sizeof(struct io_uring_sqe),
+			  PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+			  fd, IORING_OFF_SQES);
+	if (uring.sqes == MAP_FAILED)
+		goto fail;
+
+	uring.sq_head	= (unsigned *)(sq + p.sq_off.head);
+	uring.sq_tail	= (unsigned *)(sq + p.sq_off.tail);
+	uring.sq_mask	= (unsigned *)(sq + p.sq_off.ring_mask);
+	uring.sq_array	= (unsigned *)(sq + p.sq_off.array);
+
+	uring.cq_head	= (unsigned *)(cq + p.cq_off.head);
+	uring.cq_tail	= (unsigned *)(cq + p.cq_off.tail);
+	uring.cq_mask	= (unsigned *)(cq + p.cq_off.ring_mask);
+	uring.cqes	= (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+
+	uring.fd = fd;
+
+	return 0;
+
+fail:
+	/* Mappings go away with the process, and we'll never use them */
+	rc = -errno;
+	close(fd);
+	return rc;
+}
+
+/**
+ * uring_read_batch() - Submit a batch of reads on one descriptor, wait for them
+ * @fd:		Non-blocking file descriptor to read from
+ * @iov:	Buffers, one for each read, filled in order
+ * @res:	Result of each read: bytes read, or negative error code (output)
+ * @n:		Number of reads, at most URING_ENTRIES
+ *
+ * Return: 0 on success, negative error code if reads couldn't be submitted
+ *
+ * #syscalls:pasta io_uring_enter
+ */
+int uring_read_batch(int fd, const struct iovec *iov, ssize_t *res, int n)
+{
+	unsigned tail, head, mask;
+	int i, done, stale, rc;
+	uint32_t gen;
+
+	gen = ++uring.gen;
+	tail = *uring.sq_tail;
+	mask = *uring.sq_mask;
+	for (i = 0; i < n; i++) {
+		unsigned idx = (tail + i) & mask;
+		struct io_uring_sqe *sqe = &uring.sqes[idx];
+
+		memset(sqe, 0, sizeof(*sqe));
+		sqe->opcode	= IORING_OP_READ;
+		sqe->fd		= fd;
+		sqe->addr	= (uintptr_t)iov[i].iov_base;
+		sqe->len	= iov[i].iov_len;
+		sqe->rw_flags	= RWF_NOWAIT;
+		sqe->user_data	= (uint64_t)gen << 32 | i;
+
+		uring.sq_array[idx] = idx;
+		res[i] = -EAGAIN;
+	}
+	__atomic_store_n(uring.sq_tail, tail + n, __ATOMIC_RELEASE);
+
+	do {
+		rc = syscall(SYS_io_uring_enter, uring.fd, n, n,
+			     IORING_ENTER_GETEVENTS, NULL, 0);
+	} while (rc < 0 && errno == EINTR);
+	if (rc < 0)
+		return -errno;
+
+	head = *uring.cq_head;
+	mask = *uring.cq_mask;
+	/* Drain all completions, including late ones from previous batches */
+	for (done = stale = 0; ; head++) {
+		const struct io_uring_cqe *cqe;
+		uint32_t slot;
+
+		if (head == __atomic_load_n(uring.cq_tail, __ATOMIC_ACQUIRE))
+			break;
+
+		cqe = &uring.cqes[head & mask];
+		slot = cqe->user_data & UINT32_MAX;
+
+		if (cqe->user_data >> 32 != gen || slot >= (unsigned)n) {
+			stale++;
+			continue;
+		}
+
+		res[slot] = cqe->res;
+		done++;
+	}
+	__atomic_store_n(uring.cq_head, head, __ATOMIC_RELEASE);
+
+	if (stale)
+		debug("io_uring: %i late completions from past batches", stale);
+
+	if (done < n)
+		debug("io_uring: %i reads out of %i didn't complete", n - done, n);
+
+	return 0;
+}
@@ -0,0 +1,22 @@
+/* SPDX-License-Identifier: GPL-2.0-or-later
+ * Copyright Red Hat
+ *
+ * Minimal io_uring support for batched reads
+ */
+
+#ifndef URING_H
+#define URING_H
+
+#include <stdbool.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+/* Maximum number of reads submitted with a single io_uring_enter() call */
+#define URING_ENTRIES		64
+
+bool uring_enabled(void);
+void uring_disable(void);
+int uring_init(void);
+int uring_read_batch(int fd, const struct iovec *iov, ssize_t *res, int n);
+
+#endif /* URING_H */
@@ -18,6 +18,7 @@
 #include <unistd.h>
 #include <arpa/inet.h>
 #include <net/ethernet.h>
+#include <sys/mman.h>
 #include <sys/uio.h>
 #include <fcntl.h>
 #include <string.h>
@@ -45,20 +46,15 @@
 uint8_t eth_pad[ETH_ZLEN] = { 0 };
 
 /**
- * sock_l4_() - Create and bind socket to socket address
+ * sock_l4_open() - Create socket and set options, without binding it
  * @c:		Execution context
  * @type:	epoll type
- * @sa:		Socket address to bind to
- * @ifname:	Interface for binding, NULL for any
- * @v6only:	If >= 0, set IPV6_V6ONLY socket option to this value
+ * @af:		Address family
  *
  * Return: newly created socket, negative error code on failure
  */
-static int sock_l4_(const struct ctx *c, enum epoll_type type,
-		    const union sockaddr_inany *sa, const char *ifname,
-		    int v6only)
+int sock_l4_open(const struct ctx *c, enum epoll_type type, sa_family_t af)
 {
-	sa_family_t af = sa->sa_family;
 	bool freebind = false;
 	int fd, y = 1, ret;
 	uint8_t proto;
@@ -72,6 +68,7 @@ static int sock_l4_(const struct ctx *c, enum epoll_type type,
 		break;
 	case EPOLL_TYPE_UDP_LISTEN:
 	case EPOLL_TYPE_UDP:
+	case EPOLL_TYPE_UDP_SHARED:
 		freebind = c->freebind;
 		proto = IPPROTO_UDP;
 		socktype = SOCK_DGRAM | SOCK_NONBLOCK;
@@ -100,14 +97,6 @@ static int sock_l4_(const struct ctx *c, enum epoll_type type,
 		return -EBADF;
 	}
 
-	if (v6only >= 0) {
-		if (setsockopt(fd, IPPROTO_IPV6, IPV6_V6ONLY,
-			       &v6only, sizeof(v6only))) {
-			debug("Failed to set IPV6_V6ONLY to %d on socket %i",
-			      v6only, fd);
-		}
-	}
-
 	if (setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &y, sizeof(y)))
 		debug("Failed to set SO_REUSEADDR on socket %i", fd);
 
@@ -121,6 +110,51 @@ static int sock_l4_(const struct ctx *c, enum epoll_type type,
 
 		if (setsockopt(fd, level, pktinfo, &y, sizeof(y)))
 			die_perror("Failed to set PKTINFO on socket %i", fd);
+
+		if (c->udp.ecn &&
+		    setsockopt(fd, level,
+			       af == AF_INET ? IP_RECVTOS : IPV6_RECVTCLASS,
+			       &y, sizeof(y)))
+			debug_perror("Failed to set RECVTOS on socket %i", fd);
+	}
+
+	if (freebind) {
+		int level = af == AF_INET ? IPPROTO_IP : IPPROTO_IPV6;
+		int opt = af == AF_INET ? IP_FREEBIND : IPV6_FREEBIND;
+
+		if (setsockopt(fd, level, opt, &y, sizeof(y))) {
+			err_perror("Failed to set %s on socket %i",
+				   af == AF_INET ? "IP_FREEBIND"
+				                 : "IPV6_FREEBIND",
+				   fd);
+		}
+	}
+
+	return fd;
+}
+
+/**
+ * sock_l4_bind_() - Bind socket from sock_l4_open() to socket address
+ * @fd:		Socket, closed on failure
+ * @type:	epoll type
+ * @sa:		Socket address to bind to
+ * @ifname:	Interface for binding, NULL for any
+ * @v6only:	If >= 0, set IPV6_V6ONLY socket option to this value
+ *
+ * Return: @fd on success, negative error code on failure
+ */
+static int sock_l4_bind_(int fd, enum epoll_type type,
+			 const union sockaddr_inany *sa, const char *ifname,
+			 int v6only)
+{
+	int ret;
+
+	if (v6only >= 0) {
+		if (setsockopt(fd, IPPROTO_IPV6, IPV6_V6ONLY,
+			       &v6only, sizeof(v6only))) {
+			debug("Failed to set IPV6_V6ONLY to %d on socket %i",
+			      v6only, fd);
+		}
 	}
 
 	if (ifname && *ifname) {
@@ -143,18 +177,6 @@ static int sock_l4_(const struct ctx *c, enum epoll_type type,
 		}
 	}
 
-	if (freebind) {
-		int level = af == AF_INET ? IPPROTO_IP : IPPROTO_IPV6;
-		int opt = af == AF_INET ? IP_FREEBIND : IPV6_FREEBIND;
-
-		if (setsockopt(fd, level, opt, &y, sizeof(y))) {
-			err_perror("Failed to set %s on socket %i",
-				   af == AF_INET ? "IP_FREEBIND"
-				                 : "IPV6_FREEBIND",
-				   fd);
-		}
-	}
-
 	if (bind(fd, &sa->sa, socklen_inany(sa)) < 0) {
 		/* We'll fail to bind to low ports if we don't have enough
 		 * capabilities, and we'll fail to bind on already bound ports,
@@ -172,27 +194,73 @@ static int sock_l4_(const struct ctx *c, enum epoll_type type,
 }
 
 /**
- * sock_l4() - Create and bind socket to given address
+ * sock_l4_() - Create and bind socket to socket address
  * @c:		Execution context
  * @type:	epoll type
  * @sa:		Socket address to bind to
  * @ifname:	Interface for binding, NULL for any
+ * @v6only:	If >= 0, set IPV6_V6ONLY socket option to this value
  *
  * Return: newly created socket, negative error code on failure
  */
-int sock_l4(const struct ctx *c, enum epoll_type type,
-	    const union sockaddr_inany *sa, const char *ifname)
+static int sock_l4_(const struct ctx *c, enum epoll_type type,
+		    const union sockaddr_inany *sa, const char *ifname,
+		    int v6only)
 {
-	int v6only = -1;
+	int fd = sock_l4_open(c, type, sa->sa_family);
+
+	if (fd < 0)
+		return fd;
 
+	return sock_l4_bind_(fd, type, sa, ifname, v6only);
+}
+
+/**
+ * sock_l4_v6only() - Get IPV6_V6ONLY value to use for given bound address
+ * @sa:		Socket address to bind to
+ *
+ * Return: value for sock_l4_bind_(), -1 if we don't need to set the option
+ */
+static int sock_l4_v6only(const union sockaddr_inany *sa)
+{
 	/* The option doesn't exist for IPv4 sockets, and we don't care about it
 	 * for IPv6 sockets with a non-wildcard address.
 	 */
 	if (sa->sa_family == AF_INET6 &&
 	    IN6_IS_ADDR_UNSPECIFIED(&sa->sa6.sin6_addr))
-		v6only = 1;
+		return 1;
+
+	return -1;
+}
+
+/**
+ * sock_l4() - Create and bind socket to given address
+ * @c:		Execution context
+ * @type:	epoll type
+ * @sa:		Socket address to bind to
+ * @ifname:	Interface for binding, NULL for any
+ *
+ * Return: newly created socket, negative error code on failure
+ */
+int sock_l4(const struct ctx *c, enum epoll_type type,
+	    const union sockaddr_inany *sa, const char *ifname)
+{
+	return sock_l4_(c, type, sa, ifname, sock_l4_v6only(sa));
+}
 
-	return sock_l4_(c, type, sa, ifname, v6only);
+/**
+ * sock_l4_bind() - Bind socket from sock_l4_open() to given address
+ * @fd:		Socket, closed on failure
+ * @type:	epoll type
+ * @sa:		Socket address to bind to
+ * @ifname:	Interface for binding, NULL for any
+ *
+ * Return: @fd on success, negative error code on failure
+ */
+int sock_l4_bind(int fd, enum epoll_type type,
+		 const union sockaddr_inany *sa, const char *ifname)
+{
+	return sock_l4_bind_(fd, type, sa, ifname, sock_l4_v6only(sa));
 }
 
 /**
@@ -507,7 +575,11 @@ int output_file_open(const char *path, int flags)
  */
 int __daemon(int pidfile_fd, int devnull_fd)
 {
-	pid_t pid = fork();
+	pid_t pid;
+
+	logfile_flush();	/* Don't write pending messages twice */
+
+	pid = fork();
 
 	if (pid == -1) {
 		perror("fork");
@@ -602,7 +674,7 @@ int write_file(const char *path, const char *buf)
  *
  * Return: number of bytes read on success, negative error code on failure
  */
-static ssize_t read_file(const char *path, char *buf, size_t buf_size)
+ssize_t read_file(const char *path, char *buf, size_t buf_size)
 {
 	size_t total_read = 0;
 	int fd;
@@ -709,6 +781,8 @@ int do_clone(int (*fn)(void *),
 /* cppcheck-suppress [funcArgNamesDifferentUnnamed,unmatchedSuppression] */
 	     char *stack_area, size_t stack_size, int flags, void *arg)
 {
+	logfile_flush();	/* Don't write pending messages twice */
+
 #ifdef __ia64__
 	return __clone2(fn, stack_area + stack_size / 2, stack_size / 2,
 			flags, arg);
@@ -787,7 +861,6 @@ int write_remainder(int fd, const struct iovec *iov, size_t iovcnt,
  *
  * Note: mode-specific seccomp profiles need to enable readv() to use this.
  */
-/* cppcheck-suppress unusedFunction */
 int read_remainder(int fd, const struct iovec *iov, size_t cnt, size_t skip)
 {
 	size_t i = 0, offset;
@@ -1038,6 +1111,8 @@ void abort_with_msg(const char *fmt, ...)
 	vlogmsg(true, false, LOG_CRIT, fmt, ap);
 	va_end(ap);
 
+	logfile_flush();
+
 	/* This may actually cause a SIGSYS instead of SIGABRT, due to seccomp,
 	 * but that will still get the job done.
 	 */
@@ -1063,10 +1138,13 @@ void passt_exit(int status)
 		close(passt_ctx.fd_control_listen);
 
 	/* Make sure we don't leave the pcap file truncated */
+	if (pcap_fd != -1)
+		pcap_flush();
 	if (pcap_fd != -1 && fsync(pcap_fd))
 		warn_perror("Failed to flush pcap file, it might be truncated");
 
 	/* Make sure we don't leave an incomplete log */
+	logfile_flush();
 	if (log_file != -1)
 		(void)fsync(log_file);
 
@@ -1114,3 +1192,130 @@ long clamped_scale(long x, long y, long lo, long hi, long f)
 
 	return x - (x * (y - lo) / (hi - lo)) * (100 - f) / 100;
 }
+
+/**
+ * mmap_lazy() - Reserve zeroed memory, only committed as pages are touched
+ * @size:	Size of region, bytes
+ *
+ * Return: pointer to region, or NULL on failure
+ *
+ * Meant for large tables sized at start-up: call before seccomp filters apply
+ */
+void *mmap_lazy(size_t size)
+{
+	void *p = mmap(NULL, size, PROT_READ | PROT_WRITE,
+		       MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+
+	if (p == MAP_FAILED)
+		return NULL;
+
+	return p;
+}
+
+/**
+ * madvise_hugepage() - Ask for transparent huge pages backing a hot buffer
+ * @p:		Start of buffer
+ * @size:	Size of buffer, bytes
+ *
+ * Only whole pages within the buffer are affected, and only ranges aligned to
+ * HUGEPAGE_SIZE can actually be backed by huge pages. Failures are ignored:
+ * huge pages might be disabled or not supported, buffers work just the same.
+ *
+ * Meant for static buffers touched on every packet: call before seccomp
+ * filters apply
+ */
+void madvise_hugepage(void *p, size_t size)
+{
+	uintptr_t start = DIV_ROUND_UP((uintptr_t)p, PAGE_SIZE) * PAGE_SIZE;
+	uintptr_t end = ((uintptr_t)p + size) / PAGE_SIZE * PAGE_SIZE;
+
+	if (end > start)
+		madvise((void *)start, end - start, MADV_HUGEPAGE);
+}
+
+/**
+ * madvise_free() - Release pages of an idle buffer, keeping the mapping
+ * @p:		Start of buffer
+ * @size:	Size of buffer, bytes
+ *
+ * Only whole pages within the buffer are released. Contents are undefined
+ * afterwards: callers must not keep any state in the buffer. Without
+ * MADV_FREE (Linux < 4.5), fall back to MADV_DONTNEED.
+ *
+ * #syscalls madvise
+ */
+void madvise_free(void *p, size_t size)
+{
+	uintptr_t start = DIV_ROUND_UP((uintptr_t)p, PAGE_SIZE) * PAGE_SIZE;
+	uintptr_t end = ((uintptr_t)p + size) / PAGE_SIZE * PAGE_SIZE;
+
+	if (end <= start)
+		return;
+
+	if (madvise((void *)start, end - start, MADV_FREE) && errno == EINVAL)
+		madvise((void *)start, end - start, MADV_DONTNEED);
+}
+
+/**
+ * sock_pool_init() - Initialise empty pool of pre-opened sockets
+ * @p:		Pool
+ */
+void sock_pool_init(struct sock_pool *p)
+{
+	unsigned i;
+
+	for (i = 0; i < SOCK_POOL_MAX; i++)
+		p->fd[i] = -1;
+
+	p->size = SOCK_POOL_MIN;
+	p->taken = 0;
+}
+
+/**
+ * sock_pool_get() - Take socket from pool
+ * @p:		Pool
+ *
+ * Return: socket, -1 if the pool is empty
+ */
+int sock_pool_get(struct sock_pool *p)
+{
+	int s = -1;
+	unsigned i;
+
+	p->taken++;
+
+	for (i = 0; i < p->size; i++) {
+		SWAP(s, p->fd[i]);
+		if (s >= 0)
+			return s;
+	}
+
+	return -1;
+}
+
+/**
+ * sock_pool_resize() - Adapt pool size to sockets taken since last call
+ * @p:		Pool
+ *
+ * Double the size if we needed at least as many sockets as we had, halve it,
+ * closing extra sockets, if we used less than a quarter of them.
+ */
+void sock_pool_resize(struct sock_pool *p)
+{
+	unsigned size = p->size, i;
+
+	if (p->taken >= size)
+		size = MIN(size * 2, SOCK_POOL_MAX);
+	else if (p->taken < size / 4)
+		size = MAX(size / 2, SOCK_POOL_MIN);
+
+	for (i = size; i < p->size; i++) {
+		if (p->fd[i] >= 0) {
+			close(p->fd[i]);
+			p->fd[i] = -1;
+		}
+	}
+
+	p->size = size;
+	p->taken = 0;
+}
@@ -30,6 +30,12 @@
 #define IP_MAX_MTU			USHRT_MAX
 #endif
 
+/* Transparent huge page size with 4 KiB pages, alignment for hot buffers */
+#define HUGEPAGE_SIZE			(2UL << 20)
+
+/* Cache line size on common architectures, used to lay out per-flow data */
+#define CACHE_LINE_SIZE			64
+
 #define SWAP(a, b)							\
 	do {								\
 		__typeof__(a) __x = (a); (a) = (b); (b) = __x;		\
@@ -112,6 +118,10 @@ static inline void barrier(void) { __asm__ __volatile__("" ::: "memory"); }
 #define smp_wmb()	smp_mb_release()
 #define smp_rmb()	smp_mb_acquire()
 
+/* Start fetching cache lines we'll need soon, for reading or writing */
+#define prefetch(addr)		__builtin_prefetch((addr), 0)
+#define prefetchw(addr)		__builtin_prefetch((addr), 1)
+
 #define qatomic_or(ptr, n) \
 	((void) __atomic_fetch_or(ptr, n, __ATOMIC_SEQ_CST))
 
@@ -146,6 +156,9 @@ int do_clone(int (*fn)(void *), char *stack_area, size_t stack_size, int flags,
 struct ctx;
 union sockaddr_inany;
 
+int sock_l4_open(const struct ctx *c, enum epoll_type type, sa_family_t af);
+int sock_l4_bind(int fd, enum epoll_type type,
+		 const union sockaddr_inany *sa, const char *ifname);
 int sock_l4(const struct ctx *c, enum epoll_type type,
 	    const union sockaddr_inany *sa, const char *ifname);
 int sock_l4_dualstack_any(const struct ctx *c, enum epoll_type type,
@@ -164,12 +177,47 @@ int __daemon(int pidfile_fd, int devnull_fd);
 int fls(unsigned long x);
 int ilog2(unsigned long x);
 int write_file(const char *path, const char *buf);
+ssize_t read_file(const char *path, char *buf, size_t buf_size);
 intmax_t read_file_integer(const char *path, intmax_t fallback);
 int write_remainder(int fd, const struct iovec *iov, size_t iovcnt,
 		    size_t skip, size_t length);
 int read_remainder(int fd, const struct iovec *iov, size_t cnt, size_t skip);
 bool snprintf_check(char *str, size_t size, const char *format, ...);
 long clamped_scale(long x, long y, long lo, long hi, long f);
+void *mmap_lazy(size_t size);
+void madvise_hugepage(void *p, size_t size);
+void madvise_free(void *p, size_t size);
+
+/* Pre-opened sockets, with pool size adapted to demand within this range */
+#define SOCK_POOL_MIN		32
+#define SOCK_POOL_MAX		256
+
+/**
+ * struct sock_pool - Pool of pre-opened sockets
+ * @fd:		Sockets, taken from the start, -1 if not available
+ * @size:	Number of sockets we currently keep open
+ * @taken:	Sockets requested from the pool since the last resize
+ */
+struct sock_pool {
+	int fd[SOCK_POOL_MAX];
+	unsigned size;
+	unsigned taken;
+};
+
+void sock_pool_init(struct sock_pool *p);
+int sock_pool_get(struct sock_pool *p);
+void sock_pool_resize(struct sock_pool *p);
+
+/**
+ * sock_pool_low() - Check if at least half of the pool was used up
+ * @p:		Pool
+ *
+ * Return: true if the pool should be refilled
+ */
+static inline bool sock_pool_low(const struct sock_pool *p)
+{
+	return p->fd[p->size / 2] < 0;
+}
 
 /**
  * af_name() - Return name of an address family
@@ -44,6 +44,7 @@
 #include "pcap.h"
 #include "migrate.h"
 #include "epoll_ctl.h"
+#include "stats.h"
 
 /* vhost-user version we are compatible with */
 #define VHOST_USER_VERSION 1
@@ -150,6 +151,28 @@ static void *qva_to_va(struct vu_dev *dev, uint64_t qemu_addr)
 	return NULL;
 }
 
+/**
+ * qva_to_gpa() - Translate front-end (QEMU) virtual address to guest physical
+ * 		  address
+ * @dev:		vhost-user device
+ * @qemu_addr:		front-end userspace address
+ *
+ * Return: guest physical address, 0 if not found in any region
+ */
+static uint64_t qva_to_gpa(const struct vu_dev *dev, uint64_t qemu_addr)
+{
+	unsigned int i;
+
+	for (i = 0; i < dev->memory.nregions; i++) {
+		const struct vu_dev_region *r = &dev->memory.regions[i];
+
+		if ((qemu_addr >= r->qva) && (qemu_addr < (r->qva + r->size)))
+			return qemu_addr - r->qva + r->gpa;
+	}
+
+	return 0;
+}
+
 /**
  * vmsg_close_fds() - Close all file descriptors of a given message
  * @vmsg:	vhost-user message with the list of the file descriptors
@@ -310,6 +333,9 @@ static void vu_send_reply(int conn_fd, struct vhost_user_msg *vmsg)
 	vu_message_write(conn_fd, vmsg);
 }
 
+/* Set on feature negotiation, see VNET_HLEN */
+size_t vu_vnet_hlen = sizeof(struct virtio_net_hdr_mrg_rxbuf);
+
 /**
  * vu_get_features_exec() - Provide back-end features bitmask to front-end
  * @vdev:	vhost-user device
@@ -322,8 +348,16 @@ static bool vu_get_features_exec(struct vu_dev *vdev,
 {
 	uint64_t features =
 		1ULL << VIRTIO_F_VERSION_1 |
+		1ULL << VIRTIO_F_RING_PACKED |
+		1ULL << VIRTIO_NET_F_CSUM |
 		1ULL << VIRTIO_NET_F_GUEST_CSUM |
+		1ULL << VIRTIO_NET_F_GUEST_TSO4 |
+		1ULL << VIRTIO_NET_F_GUEST_TSO6 |
+		1ULL << VIRTIO_NET_F_HOST_TSO4 |
+		1ULL << VIRTIO_NET_F_HOST_TSO6 |
 		1ULL << VIRTIO_NET_F_MRG_RXBUF |
+		1ULL << VIRTIO_NET_F_MQ |
+		1ULL << VIRTIO_NET_F_HASH_REPORT |
 		1ULL << VHOST_F_LOG_ALL |
 		1ULL << VHOST_USER_F_PROTOCOL_FEATURES;
 
@@ -359,6 +393,8 @@ static void vu_set_enable_all_rings(struct vu_dev *vdev, bool enable)
 static bool vu_set_features_exec(struct vu_dev *vdev,
 				 struct vhost_user_msg *vmsg)
 {
+	unsigned int i;
+
 	debug("u64: 0x%016"PRIx64, vmsg->payload.u64);
 
 	vdev->features = vmsg->payload.u64;
@@ -371,6 +407,14 @@ static bool vu_set_features_exec(struct vu_dev *vdev,
 	if (!vu_has_feature(vdev, VHOST_USER_F_PROTOCOL_FEATURES))
 		vu_set_enable_all_rings(vdev, true);
 
+	for (i = 0; i < VHOST_USER_MAX_VQS; i++)
+		vdev->vq[i].packed = vu_has_feature(vdev, VIRTIO_F_RING_PACKED);
+
+	if (vu_has_feature(vdev, VIRTIO_NET_F_HASH_REPORT))
+		vu_vnet_hlen = sizeof(struct virtio_net_hdr_v1_hash);
+	else
+		vu_vnet_hlen = sizeof(struct virtio_net_hdr_mrg_rxbuf);
+
 	return false;
 }
 
@@ -396,6 +440,9 @@ static bool vu_set_owner_exec(struct vu_dev *vdev,
  * @vdev:	vhost-user device
  * @vq:		Virtqueue
  *
+ * With the packed layout, "used" and "avail" addresses point to device and
+ * driver event suppression areas.
+ *
  * Return: true if ring cannot be mapped to our address space
  */
 static bool map_ring(struct vu_dev *vdev, struct vu_virtq *vq)
@@ -403,6 +450,7 @@ static bool map_ring(struct vu_dev *vdev, struct vu_virtq *vq)
 	vq->vring.desc = qva_to_va(vdev, vq->vra.desc_user_addr);
 	vq->vring.used = qva_to_va(vdev, vq->vra.used_user_addr);
 	vq->vring.avail = qva_to_va(vdev, vq->vra.avail_user_addr);
+	vq->vring.log_desc_addr = qva_to_gpa(vdev, vq->vra.desc_user_addr);
 
 	debug("Setting virtq addresses:");
 	debug("    vring_desc  at %p", (void *)vq->vring.desc);
@@ -412,6 +460,20 @@ static bool map_ring(struct vu_dev *vdev, struct vu_virtq *vq)
 	return !(vq->vring.desc && vq->vring.used && vq->vring.avail);
 }
 
+/**
+ * vu_region_cmp() - Compare memory regions by guest physical address
+ * @a:		First region
+ * @b:		Second region
+ *
+ * Return: negative, zero or positive as for qsort()
+ */
+static int vu_region_cmp(const void *a, const void *b)
+{
+	const struct vu_dev_region *ra = a, *rb = b;
+
+	return (ra->gpa > rb->gpa) - (ra->gpa < rb->gpa);
+}
+
 /**
  * vu_set_mem_table_exec() - Sets the memory map regions to be able to
  * 			     translate the vring addresses.
@@ -438,6 +500,7 @@ static bool vu_set_mem_table_exec(struct vu_dev *vdev,
 		}
 	}
 	vdev->memory.nregions = memory->nregions;
+	passt_stats.mem[STATS_MEM_VU_REGION] = 0;
 
 	debug("vhost-user nregions: %u", memory->nregions);
 	for (i = 0; i < vdev->memory.nregions; i++) {
@@ -473,12 +536,17 @@ static bool vu_set_mem_table_exec(struct vu_dev *vdev,
 			die_perror("vhost-user region mmap error");
 
 		dev_region->mmap_addr = (uint64_t)(uintptr_t)mmap_addr;
+		passt_stats.mem[STATS_MEM_VU_REGION] += dev_region->size;
 		debug("    mmap_addr:       0x%016"PRIx64,
 		      dev_region->mmap_addr);
 
 		close(vmsg->fds[i]);
 	}
 
+	/* Sort by guest address for binary search in vu_gpa_to_va() */
+	qsort(vdev->memory.regions, vdev->memory.nregions,
+	      sizeof(vdev->memory.regions[0]), vu_region_cmp);
+
 	for (i = 0; i < VHOST_USER_MAX_VQS; i++) {
 		if (vdev->vq[i].vring.desc) {
 			if (map_ring(vdev, &vdev->vq[i]))
@@ -536,25 +604,40 @@ static void vu_log_page(uint8_t *log_table, uint64_t page)
 }
 
 /**
- * vu_log_write() - Log memory write
+ * vu_log_mark() - Log memory write, without informing the front-end yet
  * @vdev:	vhost-user device
  * @address:	Memory address
  * @length:	Memory size
+ *
+ * Return: true if the write was logged, false if logging is not enabled
  */
-void vu_log_write(const struct vu_dev *vdev, uint64_t address, uint64_t length)
+bool vu_log_mark(const struct vu_dev *vdev, uint64_t address, uint64_t length)
 {
 	uint64_t page;
 
 	if (!vdev->log_table || !length ||
 	    !vu_has_feature(vdev, VHOST_F_LOG_ALL))
-		return;
+		return false;
 
 	page = address / VHOST_LOG_PAGE;
 	while (page * VHOST_LOG_PAGE < address + length) {
 		vu_log_page(vdev->log_table, page);
 		page++;
 	}
-	vu_log_kick(vdev);
+
+	return true;
+}
+
+/**
+ * vu_log_write() - Log memory write, inform front-end of this and previous ones
+ * @vdev:	vhost-user device
+ * @address:	Memory address
+ * @length:	Memory size
+ */
+void vu_log_write(const struct vu_dev *vdev, uint64_t address, uint64_t length)
+{
+	if (vu_log_mark(vdev, address, length))
+		vu_log_kick(vdev);
 }
 
 /**
@@ -595,6 +678,11 @@ static bool vu_set_log_base_exec(struct vu_dev *vdev,
 	vdev->log_table = base;
 	vdev->log_size = log_mmap_size;
 
+	/* Dirty page logging starts: we're about to be migrated, but the guest
+	 * is still running. Get ready now rather than during downtime.
+	 */
+	migrate_prepare(vdev->context);
+
 	vmsg->hdr.size = sizeof(vmsg->payload.u64);
 	vmsg->fd_num = 0;
 
@@ -639,6 +727,10 @@ static bool vu_set_vring_num_exec(struct vu_dev *vdev,
 
 	trace("State.index: %u", idx);
 	trace("State.num:   %u", num);
+
+	if (idx >= VHOST_USER_MAX_VQS)
+		die("Invalid vring_num index: %u", idx);
+
 	vdev->vq[idx].vring.num = num;
 
 	return false;
@@ -659,7 +751,11 @@ static bool vu_set_vring_addr_exec(struct vu_dev *vdev,
 	 * can be unaligned as it is packed.
 	 */
 	struct vhost_vring_addr addr = vmsg->payload.addr;
-	struct vu_virtq *vq = &vdev->vq[addr.index];
+	struct vu_virtq *vq;
+
+	if (addr.index >= VHOST_USER_MAX_VQS)
+		die("Invalid vring_addr index: %u", addr.index);
+	vq = &vdev->vq[addr.index];
 
 	debug("vhost_vring_addr:");
 	debug("    index:  %d", addr.index);
@@ -680,6 +776,10 @@ static bool vu_set_vring_addr_exec(struct vu_dev *vdev,
 	if (map_ring(vdev, vq))
 		die("Invalid vring_addr message");
 
+	/* For packed rings, used index comes with VHOST_USER_SET_VRING_BASE */
+	if (vq->packed)
+		return false;
+
 	vq->used_idx = le16toh(vq->vring.used->idx);
 
 	if (vq->last_avail_idx != vq->used_idx) {
@@ -705,6 +805,27 @@ static bool vu_set_vring_base_exec(struct vu_dev *vdev,
 
 	debug("State.index: %u", idx);
 	debug("State.num:   %u", num);
+
+	if (idx >= VHOST_USER_MAX_VQS)
+		die("Invalid vring_base index: %u", idx);
+
+	if (vu_has_feature(vdev, VIRTIO_F_RING_PACKED)) {
+		struct vu_virtq *vq = &vdev->vq[idx];
+
+		/* Bits 0-14: next available descriptor, 15: its wrap counter,
+		 * bits 16-30: next used descriptor, 31: its wrap counter
+		 */
+		vq->last_avail_idx = num & 0x7fff;
+		vq->avail_wrap_counter = !!(num & (1U << 15));
+		vq->used_idx = (num >> 16) & 0x7fff;
+		vq->used_wrap_counter = !!(num & (1U << 31));
+		vq->shadow_avail_idx = vq->last_avail_idx;
+		vq->used_pending = 0;
+		vq->signalled_used_valid = false;
+
+		return false;
+	}
+
 	vdev->vq[idx].shadow_avail_idx = vdev->vq[idx].last_avail_idx = num;
 
 	return false;
@@ -724,7 +845,22 @@ static bool vu_get_vring_base_exec(struct vu_dev *vdev,
 	unsigned int idx = vmsg->payload.state.index;
 
 	debug("State.index: %u", idx);
-	vmsg->payload.state.num = vdev->vq[idx].last_avail_idx;
+
+	if (idx >= VHOST_USER_MAX_VQS)
+		die("Invalid vring_base index: %u", idx);
+
+	if (vu_has_feature(vdev, VIRTIO_F_RING_PACKED)) {
+		const struct vu_virtq *vq = &vdev->vq[idx];
+
+		/* Same encoding as VHOST_USER_SET_VRING_BASE */
+		vmsg->payload.state.num =
+			vq->last_avail_idx |
+			(unsigned)vq->avail_wrap_counter << 15 |
+			(unsigned)vq->used_idx << 16 |
+			(unsigned)vq->used_wrap_counter << 31;
+	} else {
+		vmsg->payload.state.num = vdev->vq[idx].last_avail_idx;
+	}
 	vmsg->hdr.size = sizeof(vmsg->payload.state);
 
 	vdev->vq[idx].started = false;
@@ -896,7 +1032,8 @@ static bool vu_set_vring_err_exec(struct vu_dev *vdev,
 static bool vu_get_protocol_features_exec(struct vu_dev *vdev,
 					  struct vhost_user_msg *vmsg)
 {
-	uint64_t features = 1ULL << VHOST_USER_PROTOCOL_F_REPLY_ACK |
+	uint64_t features = 1ULL << VHOST_USER_PROTOCOL_F_MQ |
+			    1ULL << VHOST_USER_PROTOCOL_F_REPLY_ACK |
 			    1ULL << VHOST_USER_PROTOCOL_F_LOG_SHMFD |
 			    1ULL << VHOST_USER_PROTOCOL_F_DEVICE_STATE |
 			    1ULL << VHOST_USER_PROTOCOL_F_RARP;
@@ -938,10 +1075,9 @@ static bool vu_get_queue_num_exec(struct vu_dev *vdev,
 {
 	(void)vdev;
 
-	/* NOLINTNEXTLINE(misc-redundant-expression) */
-	vmsg_set_reply_u64(vmsg, VHOST_USER_MAX_VQS / 2);
+	vmsg_set_reply_u64(vmsg, VHOST_USER_MAX_QUEUE_PAIRS);
 
-	debug("VHOST_USER_MAX_VQS  %u", VHOST_USER_MAX_VQS / 2);
+	debug("VHOST_USER_MAX_QUEUE_PAIRS  %u", VHOST_USER_MAX_QUEUE_PAIRS);
 
 	return true;
 }
@@ -1044,6 +1180,38 @@ static bool vu_check_device_state_exec(struct vu_dev *vdev,
 	return true;
 }
 
+/**
+ * vu_rx_queue() - Select receive virtqueue for a flow
+ * @vdev:	vhost-user device
+ * @hash:	Value identifying the flow, typically its index in the flow table
+ *
+ * With VIRTIO_NET_F_MQ, spread flows over the queue pairs enabled by the
+ * guest, so that a given flow always lands on the same queue, and the guest
+ * can process it on the CPU that queue is bound to.
+ *
+ * Return: receive virtqueue to be used, queue 0 if no other queue is usable
+ */
+struct vu_virtq *vu_rx_queue(struct vu_dev *vdev, unsigned int hash)
+{
+	unsigned int pairs[VHOST_USER_MAX_QUEUE_PAIRS];
+	unsigned int i, n = 0;
+
+	if (!vu_has_feature(vdev, VIRTIO_NET_F_MQ))
+		return &vdev->vq[VHOST_USER_RX_QUEUE];
+
+	for (i = 0; i < VHOST_USER_MAX_QUEUE_PAIRS; i++) {
+		const struct vu_virtq *vq = &vdev->vq[VHOST_USER_RX_QUEUE_PAIR(i)];
+
+		if (vu_queue_enabled(vq) && vu_queue_started(vq))
+			pairs[n++] = i;
+	}
+
+	if (!n)
+		return &vdev->vq[VHOST_USER_RX_QUEUE];
+
+	return &vdev->vq[VHOST_USER_RX_QUEUE_PAIR(pairs[hash % n])];
+}
+
 /**
  * vu_init() - Initialize vhost-user device structure
  * @c:		execution context
@@ -1112,6 +1280,7 @@ void vu_cleanup(struct vu_dev *vdev)
 		}
 	}
 	vdev->memory.nregions = 0;
+	passt_stats.mem[STATS_MEM_VU_REGION] = 0;
 
 	vu_close_log(vdev);
 
@@ -205,6 +205,8 @@ struct vhost_user_msg {
 #define VHOST_USER_RX_QUEUE 0
 /* index of the TX virtqueue */
 #define VHOST_USER_TX_QUEUE 1
+/* index of the RX virtqueue for a given queue pair */
+#define VHOST_USER_RX_QUEUE_PAIR(n)	((n) * 2)
 
 /* in case of multiqueue, the RX and TX queues are interleaved */
 #define VHOST_USER_IS_QUEUE_TX(n)	(n % 2)
@@ -238,9 +240,11 @@ static inline bool vu_queue_started(const struct vu_virtq *vq)
 	return vq->started;
 }
 
+struct vu_virtq *vu_rx_queue(struct vu_dev *vdev, unsigned int hash);
 void vu_print_capabilities(void);
 void vu_init(struct ctx *c);
 void vu_cleanup(struct vu_dev *vdev);
+bool vu_log_mark(const struct vu_dev *vdev, uint64_t address, uint64_t length);
 void vu_log_write(const struct vu_dev *vdev, uint64_t address,
 		  uint64_t length);
 void vu_control_handler(struct vu_dev *vdev, int fd, uint32_t events);
@@ -83,41 +83,105 @@
 #include "util.h"
 #include "virtio.h"
 #include "vhost_user.h"
+#include "probe.h"
 
 #define VIRTQUEUE_MAX_SIZE 1024
 
+/**
+ * vu_gpa_region() - Find memory region containing a guest physical address
+ * @dev:	Vhost-user device
+ * @guest_addr:	Guest physical address
+ *
+ * Return: index of matching region, -1 if none
+ */
+static int vu_gpa_region(const struct vu_dev *dev, uint64_t guest_addr)
+{
+	int lo = 0, hi = (int)dev->memory.nregions - 1;
+
+	/* Regions are sorted by guest address, see vu_set_mem_table_exec() */
+	while (lo <= hi) {
+		int mid = lo + (hi - lo) / 2;
+		const struct vu_dev_region *r = &dev->memory.regions[mid];
+
+		if (guest_addr < r->gpa)
+			hi = mid - 1;
+		else if (guest_addr >= r->gpa + r->size)
+			lo = mid + 1;
+		else
+			return mid;
+	}
+
+	return -1;
+}
+
 /**
  * vu_gpa_to_va() - Translate guest physical address to our virtual address.
  * @dev:	Vhost-user device
+ * @vq:		Virtqueue caching the last region used, can be NULL
  * @plen:	Physical length to map (input), capped to region (output)
  * @guest_addr:	Guest physical address
  *
  * Return: virtual address in our address space of the guest physical address
  */
-static void *vu_gpa_to_va(const struct vu_dev *dev, uint64_t *plen,
-			  uint64_t guest_addr)
+static void *vu_gpa_to_va(const struct vu_dev *dev, struct vu_virtq *vq,
+			  uint64_t *plen, uint64_t guest_addr)
 {
-	unsigned int i;
+	const struct vu_dev_region *r;
+	int i = -1;
 
 	if (*plen == 0)
 		return NULL;
 
-	/* Find matching memory region. */
+	/* Buffers of a queue are usually all in the same region */
+	if (vq && vq->region_hint < dev->memory.nregions) {
+		r = &dev->memory.regions[vq->region_hint];
+		if (guest_addr >= r->gpa && guest_addr < r->gpa + r->size)
+			i = vq->region_hint;
+	}
+
+	if (i < 0) {
+		if ((i = vu_gpa_region(dev, guest_addr)) < 0)
+			return NULL;
+		if (vq)
+			vq->region_hint = i;
+	}
+
+	r = &dev->memory.regions[i];
+	if ((guest_addr + *plen) > (r->gpa + r->size))
+		*plen = r->gpa + r->size - guest_addr;
+	/* NOLINTNEXTLINE(performance-no-int-to-ptr) */
+	return (void *)(uintptr_t)(guest_addr - r->gpa +
+				   r->mmap_addr + r->mmap_offset);
+}
+
+/**
+ * vu_va_to_gpa() - Translate our virtual address to guest physical address
+ * @dev:	Vhost-user device
+ * @vq:		Virtqueue caching the last region used, can be NULL
+ * @va:		Virtual address in our address space
+ * @gpa:	Guest physical address (output)
+ *
+ * Return: 0 on success, -1 if @va isn't in any region
+ */
+static int vu_va_to_gpa(const struct vu_dev *dev, struct vu_virtq *vq,
+			const void *va, uint64_t *gpa)
+{
+	unsigned int i, first = vq ? vq->region_hint : 0;
+	uint64_t addr = (uintptr_t)va;
+
+	/* Start from the region we used last for this queue */
 	for (i = 0; i < dev->memory.nregions; i++) {
-		const struct vu_dev_region *r = &dev->memory.regions[i];
-
-		if ((guest_addr >= r->gpa) &&
-		    (guest_addr < (r->gpa + r->size))) {
-			if ((guest_addr + *plen) > (r->gpa + r->size))
-				*plen = r->gpa + r->size - guest_addr;
-			/* NOLINTNEXTLINE(performance-no-int-to-ptr) */
-			return (void *)(uintptr_t)(guest_addr - r->gpa +
-						   r->mmap_addr +
-						   r->mmap_offset);
+		unsigned int j = (first + i) % dev->memory.nregions;
+		const struct vu_dev_region *r = &dev->memory.regions[j];
+		uint64_t start = r->mmap_addr + r->mmap_offset;
+
+		if (addr >= start && addr < start + r->size) {
+			*gpa = addr - start + r->gpa;
+			return 0;
 		}
 	}
 
-	return NULL;
+	return -1;
 }
 
 /**
@@ -203,10 +267,29 @@ static void virtqueue_get_head(const struct vu_virtq *vq,
 		die("vhost-user: Guest says index %u is available", *head);
 }
 
+/**
+ * virtqueue_prefetch_head() - Start fetching next descriptor chain head
+ * @vq:		Virtqueue
+ * @idx:	Available ring entry index, already published by the driver
+ *
+ * Ring entries are two bytes each, so the entry is most likely in the same
+ * cache line as the one we just read, but the descriptor it points to is
+ * usually not, and we'll need it as soon as we pop the next entry.
+ */
+static void virtqueue_prefetch_head(const struct vu_virtq *vq,
+				    unsigned int idx)
+{
+	unsigned int head = vring_avail_ring(vq, idx % vq->vring.num);
+
+	if (head < vq->vring.num)
+		prefetch(&vq->vring.desc[head]);
+}
+
 /**
  * virtqueue_read_indirect_desc() - Copy virtio ring descriptors from guest
  *                                  memory
  * @dev:	Vhost-user device
+ * @vq:		Virtqueue
  * @desc:	Destination address to copy the descriptors to
  * @addr:	Guest memory address to copy from
  * @len:	Length of memory to copy
@@ -214,11 +297,15 @@ static void virtqueue_get_head(const struct vu_virtq *vq,
  * Return: -1 if there is an error, 0 otherwise
  */
 static int virtqueue_read_indirect_desc(const struct vu_dev *dev,
-					struct vring_desc *desc,
-					uint64_t addr, size_t len)
+					struct vu_virtq *vq,
+					void *desc, uint64_t addr, size_t len)
 {
 	uint64_t read_len;
 
+	static_assert(sizeof(struct vring_desc) ==
+		      sizeof(struct vring_packed_desc),
+		      "Split and packed descriptors differ in size");
+
 	if (len > (VIRTQUEUE_MAX_SIZE * sizeof(struct vring_desc)))
 		return -1;
 
@@ -229,15 +316,14 @@ static int virtqueue_read_indirect_desc(const struct vu_dev *dev,
 		const struct vring_desc *orig_desc;
 
 		read_len = len;
-		orig_desc = vu_gpa_to_va(dev, &read_len, addr);
+		orig_desc = vu_gpa_to_va(dev, vq, &read_len, addr);
 		if (!orig_desc)
 			return -1;
 
 		memcpy(desc, orig_desc, read_len);
 		len -= read_len;
 		addr += read_len;
-		/* NOLINTNEXTLINE(bugprone-sizeof-expression,cert-arr39-c) */
-		desc += read_len / sizeof(struct vring_desc);
+		desc = (char *)desc + read_len;
 	}
 
 	return 0;
@@ -282,23 +368,121 @@ static int virtqueue_read_next_desc(const struct vring_desc *desc,
 	return VIRTQUEUE_READ_DESC_MORE;
 }
 
+/**
+ * vring_packed_desc_avail() - Check if a packed descriptor is available to us
+ * @desc:	Packed descriptor
+ * @wrap:	Driver ring wrap counter for the position of @desc
+ *
+ * Return: true if the driver made @desc available, and we didn't use it yet
+ */
+static bool vring_packed_desc_avail(const struct vring_packed_desc *desc,
+				    bool wrap)
+{
+	uint16_t flags = le16toh(desc->flags);
+	bool avail = !!(flags & (1 << VRING_PACKED_DESC_F_AVAIL));
+	bool used = !!(flags & (1 << VRING_PACKED_DESC_F_USED));
+
+	return avail == wrap && used != wrap;
+}
+
+/**
+ * vring_packed_indirect() - Get indirect descriptor table for packed layout
+ * @dev:	Vhost-user device
+ * @vq:		Virtqueue
+ * @desc:	Ring descriptor with VRING_DESC_F_INDIRECT
+ * @desc_buf:	Buffer for a copy of the table, if not contiguous in our memory
+ * @max:	Number of descriptors in the table (output)
+ *
+ * Return: pointer to indirect descriptor table, doesn't return on failure
+ */
+static const struct vring_packed_desc *
+vring_packed_indirect(const struct vu_dev *dev, struct vu_virtq *vq,
+		      const struct vring_packed_desc *desc,
+		      struct vring_packed_desc *desc_buf, unsigned int *max)
+{
+	const struct vring_packed_desc *table;
+	uint32_t desc_len = le32toh(desc->len);
+	uint64_t desc_addr = le64toh(desc->addr);
+	uint64_t read_len = desc_len;
+
+	if (desc_len % sizeof(struct vring_packed_desc))
+		die("vhost-user: Invalid size for indirect buffer table");
+
+	*max = desc_len / sizeof(struct vring_packed_desc);
+	table = vu_gpa_to_va(dev, vq, &read_len, desc_addr);
+	if (table && read_len != desc_len) {
+		/* Failed to use zero copy */
+		table = NULL;
+		if (!virtqueue_read_indirect_desc(dev, vq, desc_buf, desc_addr,
+						  desc_len))
+			table = desc_buf;
+	}
+	if (!table)
+		die("vhost-user: Invalid indirect buffer table");
+
+	return table;
+}
+
 /**
  * vu_queue_empty() - Check if virtqueue is empty
  * @vq:		Virtqueue
  *
  * Return: true if the virtqueue is empty, false otherwise
  */
-static bool vu_queue_empty(struct vu_virtq *vq)
+bool vu_queue_empty(struct vu_virtq *vq)
 {
 	if (!vq->vring.avail)
 		return true;
 
+	if (vq->packed) {
+		return !vring_packed_desc_avail(
+			&vq->vring.desc_packed[vq->last_avail_idx],
+			vq->avail_wrap_counter);
+	}
+
 	if (vq->shadow_avail_idx != vq->last_avail_idx)
 		return false;
 
 	return vring_avail_idx(vq) == vq->last_avail_idx;
 }
 
+/**
+ * vring_packed_can_notify() - Check if a notification can be sent, packed
+ * @dev:	Vhost-user device
+ * @vq:		Virtqueue
+ *
+ * Return: true if notification can be sent
+ */
+static bool vring_packed_can_notify(const struct vu_dev *dev,
+				    struct vu_virtq *vq)
+{
+	const struct vring_packed_desc_event *e = vq->vring.driver_event;
+	uint16_t flags = le16toh(e->flags);
+	uint16_t off_wrap = le16toh(e->off_wrap);
+	uint16_t old, new, off;
+	bool v, wrap;
+
+	v = vq->signalled_used_valid;
+	vq->signalled_used_valid = true;
+	old = vq->signalled_used;
+	new = vq->signalled_used = vq->used_idx;
+
+	if (flags == VRING_PACKED_EVENT_FLAG_DISABLE)
+		return false;
+
+	if (flags == VRING_PACKED_EVENT_FLAG_ENABLE ||
+	    !vu_has_feature(dev, VIRTIO_RING_F_EVENT_IDX))
+		return true;
+
+	/* Event offset refers to the driver's view of our wrap counter */
+	off = off_wrap & ~(1 << VRING_PACKED_EVENT_F_WRAP_CTR);
+	wrap = !!(off_wrap >> VRING_PACKED_EVENT_F_WRAP_CTR);
+	if (vq->used_wrap_counter != wrap)
+		off -= vq->vring.num;
+
+	return !v || vring_need_event(off, new, old);
+}
+
 /**
  * vring_can_notify() - Check if a notification can be sent
  * @dev:	Vhost-user device
@@ -319,6 +503,9 @@ static bool vring_can_notify(const struct vu_dev *dev, struct vu_virtq *vq)
 	    !vq->inuse && vu_queue_empty(vq))
 		return true;
 
+	if (vq->packed)
+		return vring_packed_can_notify(dev, vq);
+
 	if (!vu_has_feature(dev, VIRTIO_RING_F_EVENT_IDX))
 		return !(vring_avail_flags(vq) & VRING_AVAIL_F_NO_INTERRUPT);
 
@@ -348,6 +535,37 @@ void vu_queue_notify(const struct vu_dev *dev, struct vu_virtq *vq)
 		die_perror("Error writing vhost-user queue eventfd");
 }
 
+/**
+ * vu_queue_notify_defer() - Notify the given virtqueue once handlers are done
+ * @vq:		Virtqueue
+ *
+ * Batches of frames sent by different handlers in the same epoll iteration
+ * are then signalled to the guest with a single notification.
+ */
+void vu_queue_notify_defer(struct vu_virtq *vq)
+{
+	vq->notify_pending = true;
+}
+
+/**
+ * vu_notify_deferred() - Send notifications deferred by vu_queue_notify_defer()
+ * @dev:	Vhost-user device
+ */
+void vu_notify_deferred(struct vu_dev *dev)
+{
+	unsigned int i;
+
+	for (i = 0; i < VHOST_USER_MAX_VQS; i++) {
+		struct vu_virtq *vq = &dev->vq[i];
+
+		if (!vq->notify_pending)
+			continue;
+
+		vq->notify_pending = false;
+		vu_queue_notify(dev, vq);
+	}
+}
+
 /**
  * virtq_avail_event() -  Get location of available event indices
  *			  (only with VIRTIO_F_EVENT_IDX)
@@ -382,10 +600,78 @@ static inline void vring_set_avail_event(const struct vu_virtq *vq,
 	memcpy(virtq_avail_event(vq), &val_le, sizeof(val_le));
 }
 
+/**
+ * vring_packed_set_avail_event() - Ask driver to notify us past a descriptor
+ * @vq:		Virtqueue
+ *
+ * Like avail_event for split rings (VIRTIO_RING_F_EVENT_IDX): the driver
+ * doesn't need to notify us until it makes the next descriptor available.
+ */
+static void vring_packed_set_avail_event(const struct vu_virtq *vq)
+{
+	struct vring_packed_desc_event *e = vq->vring.device_event;
+
+	if (!vq->notification)
+		return;
+
+	e->off_wrap = htole16(vq->last_avail_idx |
+			      vq->avail_wrap_counter <<
+			      VRING_PACKED_EVENT_F_WRAP_CTR);
+	e->flags = htole16(VRING_PACKED_EVENT_FLAG_DESC);
+}
+
+/**
+ * vu_queue_set_notification() - Enable or disable notifications from driver
+ * @dev:	Vhost-user device
+ * @vq:		Virtqueue
+ * @enable:	True to ask for notifications (kicks), false to suppress them
+ *
+ * If notifications are enabled again, the caller needs to check the queue
+ * once more: the driver might have added buffers meanwhile, without kicks.
+ */
+void vu_queue_set_notification(const struct vu_dev *dev, struct vu_virtq *vq,
+			       bool enable)
+{
+	if (!vq->vring.avail)
+		return;
+
+	vq->notification = enable;
+
+	if (vq->packed) {
+		struct vring_packed_desc_event *e = vq->vring.device_event;
+
+		if (enable && vu_has_feature(dev, VIRTIO_RING_F_EVENT_IDX))
+			vring_packed_set_avail_event(vq);
+		else if (enable)
+			e->flags = htole16(VRING_PACKED_EVENT_FLAG_ENABLE);
+		else
+			e->flags = htole16(VRING_PACKED_EVENT_FLAG_DISABLE);
+	} else if (vu_has_feature(dev, VIRTIO_RING_F_EVENT_IDX)) {
+		/* If disabled, we just stop moving avail_event forward */
+		vring_set_avail_event(vq, vring_avail_idx(vq));
+	} else {
+		struct vring_used *used = vq->vring.used;
+
+		if (enable)
+			used->flags &= htole16(~VRING_USED_F_NO_NOTIFY);
+		else
+			used->flags |= htole16(VRING_USED_F_NO_NOTIFY);
+
+		vu_log_write(dev, vq->vring.log_guest_addr +
+			     offsetof(struct vring_used, flags),
+			     sizeof(used->flags));
+	}
+
+	/* Expose avail event or used flags before caller checks the queue */
+	if (enable)
+		smp_mb();
+}
+
 /**
  * virtqueue_map_desc() - Translate descriptor ring physical address into our
  * 			  virtual address space
  * @dev:	Vhost-user device
+ * @vq:		Virtqueue
  * @p_num_sg:	First iov entry to use (input),
  *		first iov entry not used (output)
  * @iov:	Iov array to use to store buffer virtual addresses
@@ -396,7 +682,7 @@ static inline void vring_set_avail_event(const struct vu_virtq *vq,
  *
  * Return: false on error, true otherwise
  */
-static bool virtqueue_map_desc(const struct vu_dev *dev,
+static bool virtqueue_map_desc(const struct vu_dev *dev, struct vu_virtq *vq,
 			       unsigned int *p_num_sg, struct iovec *iov,
 			       unsigned int max_num_sg,
 			       uint64_t pa, size_t sz)
@@ -409,7 +695,7 @@ static bool virtqueue_map_desc(const struct vu_dev *dev,
 	while (sz) {
 		uint64_t len = sz;
 
-		iov[num_sg].iov_base = vu_gpa_to_va(dev, &len, pa);
+		iov[num_sg].iov_base = vu_gpa_to_va(dev, vq, &len, pa);
 		if (iov[num_sg].iov_base == NULL)
 			die("vhost-user: invalid address for buffers");
 		iov[num_sg].iov_len = len;
@@ -422,6 +708,26 @@ static bool virtqueue_map_desc(const struct vu_dev *dev,
 	return true;
 }
 
+/**
+ * vu_queue_prefetch_buf() - Start fetching start of buffers for a new element
+ * @out_sg:	Device-readable buffers
+ * @out_num:	Number of entries in @out_sg
+ * @in_sg:	Device-writable buffers
+ * @in_num:	Number of entries in @in_sg
+ *
+ * Headers are at the beginning of the first buffer: we'll read them soon, for
+ * frames from the guest, or write them, for frames to the guest.
+ */
+static void vu_queue_prefetch_buf(const struct iovec *out_sg,
+				  unsigned int out_num,
+				  const struct iovec *in_sg, unsigned int in_num)
+{
+	if (out_num)
+		prefetch(out_sg[0].iov_base);
+	else if (in_num)
+		prefetchw(in_sg[0].iov_base);
+}
+
 /**
  * vu_queue_map_desc() - Map the virtqueue descriptor ring into our virtual
  * 			 address space
@@ -462,11 +768,12 @@ static int vu_queue_map_desc(const struct vu_dev *dev,
 		desc_len = le32toh(desc[i].len);
 		max = desc_len / sizeof(struct vring_desc);
 		read_len = desc_len;
-		desc = vu_gpa_to_va(dev, &read_len, desc_addr);
+		desc = vu_gpa_to_va(dev, vq, &read_len, desc_addr);
 		if (desc && read_len != desc_len) {
 			/* Failed to use zero copy */
 			desc = NULL;
-			if (!virtqueue_read_indirect_desc(dev, desc_buf, desc_addr, desc_len))
+			if (!virtqueue_read_indirect_desc(dev, vq, desc_buf,
+							  desc_addr, desc_len))
 				desc = desc_buf;
 		}
 		if (!desc)
@@ -476,8 +783,13 @@ static int vu_queue_map_desc(const struct vu_dev *dev,
 
 	/* Collect all the descriptors */
 	do {
+		/* Fetch the next descriptor while we map this one */
+		if ((le16toh(desc[i].flags) & VRING_DESC_F_NEXT) &&
+		    le16toh(desc[i].next) < max)
+			prefetch(&desc[le16toh(desc[i].next)]);
+
 		if (le16toh(desc[i].flags) & VRING_DESC_F_WRITE) {
-			if (!virtqueue_map_desc(dev, &in_num, in_sg,
+			if (!virtqueue_map_desc(dev, vq, &in_num, in_sg,
 						max_in_sg,
 						le64toh(desc[i].addr),
 						le32toh(desc[i].len)))
@@ -485,7 +797,7 @@ static int vu_queue_map_desc(const struct vu_dev *dev,
 		} else {
 			if (in_num)
 				die("Incorrect order for descriptors");
-			if (!virtqueue_map_desc(dev, &out_num, out_sg,
+			if (!virtqueue_map_desc(dev, vq, &out_num, out_sg,
 						max_out_sg,
 						le64toh(desc[i].addr),
 						le32toh(desc[i].len))) {
@@ -502,6 +814,8 @@ static int vu_queue_map_desc(const struct vu_dev *dev,
 	if (rc == VIRTQUEUE_READ_DESC_ERROR)
 		die("vhost-user: Failed to read descriptor list");
 
+	vu_queue_prefetch_buf(out_sg, out_num, in_sg, in_num);
+
 	elem->index = idx;
 	elem->in_sg = in_sg;
 	elem->in_num = in_num;
@@ -511,6 +825,133 @@ static int vu_queue_map_desc(const struct vu_dev *dev,
 	return 0;
 }
 
+/**
+ * vu_queue_packed_map_desc() - Map the next packed descriptor chain into our
+ *				virtual address space
+ * @dev:	Vhost-user device
+ * @vq:		Virtqueue
+ * @elem:	Virtqueue element to store descriptor ring iov
+ * @in_sg:	Incoming iovec array for device-writable descriptors
+ * @max_in_sg:	Maximum number of entries in @in_sg
+ * @out_sg:	Outgoing iovec array for device-readable descriptors
+ * @max_out_sg:	Maximum number of entries in @out_sg
+ *
+ * Return: -1 if there is an error, 0 otherwise
+ */
+static int vu_queue_packed_map_desc(const struct vu_dev *dev,
+				    struct vu_virtq *vq,
+				    struct vu_virtq_element *elem,
+				    struct iovec *in_sg, size_t max_in_sg,
+				    struct iovec *out_sg, size_t max_out_sg)
+{
+	const struct vring_packed_desc *desc = vq->vring.desc_packed;
+	struct vring_packed_desc desc_buf[VIRTQUEUE_MAX_SIZE];
+	unsigned int out_num = 0, in_num = 0, ndescs = 0;
+	unsigned int max = vq->vring.num;
+	unsigned int i = vq->last_avail_idx;
+	bool indirect = false;
+	uint16_t id = 0;
+
+	if (le16toh(desc[i].flags) & VRING_DESC_F_INDIRECT) {
+		/* A single ring descriptor: the table doesn't use NEXT */
+		id = le16toh(desc[i].id);
+		desc = vring_packed_indirect(dev, vq, &desc[i], desc_buf, &max);
+		indirect = true;
+		ndescs = 1;
+		i = 0;
+	}
+
+	/* Collect all the descriptors */
+	for (;;) {
+		uint16_t flags = le16toh(desc[i].flags);
+
+		if (flags & VRING_DESC_F_WRITE) {
+			if (!virtqueue_map_desc(dev, vq, &in_num, in_sg,
+						max_in_sg,
+						le64toh(desc[i].addr),
+						le32toh(desc[i].len)))
+				return -1;
+		} else {
+			if (in_num)
+				die("Incorrect order for descriptors");
+			if (!virtqueue_map_desc(dev, vq, &out_num, out_sg,
+						max_out_sg,
+						le64toh(desc[i].addr),
+						le32toh(desc[i].len)))
+				return -1;
+		}
+
+		if (indirect) {
+			if (++i == max)
+				break;
+			continue;
+		}
+
+		/* Buffer ID is in the last descriptor of the chain */
+		id = le16toh(desc[i].id);
+		if (!(flags & VRING_DESC_F_NEXT))
+			break;
+
+		if (++ndescs >= max)
+			die("vhost-user: Loop in queue descriptor list");
+		if (++i == max)
+			i = 0;
+	}
+
+	vu_queue_prefetch_buf(out_sg, out_num, in_sg, in_num);
+
+	elem->index = id;
+	elem->ndescs = indirect ? 1 : ndescs + 1;
+	elem->in_sg = in_sg;
+	elem->in_num = in_num;
+	elem->out_sg = out_sg;
+	elem->out_num = out_num;
+
+	return 0;
+}
+
+/**
+ * vu_queue_packed_pop() - Pop an entry from a packed virtqueue
+ * @dev:	Vhost-user device
+ * @vq:		Virtqueue, known not to be empty
+ * @elem:	Virtqueue element to fill with the entry information
+ * @in_sg:	Incoming iovec array for device-writable descriptors
+ * @max_in_sg:	Maximum number of entries in @in_sg
+ * @out_sg:	Outgoing iovec array for device-readable descriptors
+ * @max_out_sg:	Maximum number of entries in @out_sg
+ *
+ * Return: -1 if there is an error, 0 otherwise
+ */
+static int vu_queue_packed_pop(const struct vu_dev *dev, struct vu_virtq *vq,
+			       struct vu_virtq_element *elem,
+			       struct iovec *in_sg, size_t max_in_sg,
+			       struct iovec *out_sg, size_t max_out_sg)
+{
+	int ret;
+
+	ret = vu_queue_packed_map_desc(dev, vq, elem, in_sg, max_in_sg,
+				       out_sg, max_out_sg);
+	if (ret < 0)
+		return ret;
+
+	/* Same encoding as VHOST_USER_SET_VRING_BASE, for rewinds */
+	vq->pop_pos[vq->pop_seq++ % VIRTQUEUE_MAX_SIZE] =
+		vq->last_avail_idx | vq->avail_wrap_counter << 15;
+
+	vq->last_avail_idx += elem->ndescs;
+	if (vq->last_avail_idx >= vq->vring.num) {
+		vq->last_avail_idx -= vq->vring.num;
+		vq->avail_wrap_counter = !vq->avail_wrap_counter;
+	}
+
+	if (vu_has_feature(dev, VIRTIO_RING_F_EVENT_IDX))
+		vring_packed_set_avail_event(vq);
+
+	vq->inuse++;
+
+	return 0;
+}
+
 /**
  * vu_queue_pop() - Pop an entry from the virtqueue
  * @dev:	Vhost-user device
@@ -534,19 +975,33 @@ int vu_queue_pop(const struct vu_dev *dev, struct vu_virtq *vq,
 	if (!vq->vring.avail)
 		return -1;
 
-	if (vu_queue_empty(vq))
-		return -1;
+	if (vq->packed || vq->shadow_avail_idx == vq->last_avail_idx) {
+		if (vu_queue_empty(vq))
+			return -1;
 
-	/* Needed after vu_queue_empty(), see comment in
-	 * virtqueue_num_heads().
-	 */
-	smp_rmb();
+		/* Needed after vu_queue_empty(), see comment in
+		 * virtqueue_num_heads(). If we already have heads from a
+		 * previous read of the avail index, we don't need to read it
+		 * again, nor a barrier: pop those first.
+		 */
+		smp_rmb();
+	}
 
 	if (vq->inuse >= vq->vring.num)
 		die("vhost-user queue size exceeded");
 
+	PROBE(vu_queue_pop, vq, vq->last_avail_idx, vq->inuse);
+
+	if (vq->packed) {
+		return vu_queue_packed_pop(dev, vq, elem, in_sg, max_in_sg,
+					   out_sg, max_out_sg);
+	}
+
 	virtqueue_get_head(vq, vq->last_avail_idx++, &head);
 
+	if (vq->shadow_avail_idx != vq->last_avail_idx)
+		virtqueue_prefetch_head(vq, vq->last_avail_idx);
+
 	if (vu_has_feature(dev, VIRTIO_RING_F_EVENT_IDX))
 		vring_set_avail_event(vq, vq->last_avail_idx);
 
@@ -578,8 +1033,7 @@ void vu_queue_detach_element(struct vu_virtq *vq)
 /* cppcheck-suppress unusedFunction */
 void vu_queue_unpop(struct vu_virtq *vq)
 {
-	vq->last_avail_idx--;
-	vu_queue_detach_element(vq);
+	vu_queue_rewind(vq, 1);
 }
 
 /**
@@ -594,7 +1048,17 @@ bool vu_queue_rewind(struct vu_virtq *vq, unsigned int num)
 	if (num > vq->inuse)
 		return false;
 
-	vq->last_avail_idx -= num;
+	if (vq->packed && num) {
+		uint16_t pos;
+
+		vq->pop_seq -= num;
+		pos = vq->pop_pos[vq->pop_seq % VIRTQUEUE_MAX_SIZE];
+		vq->last_avail_idx = pos & 0x7fff;
+		vq->avail_wrap_counter = !!(pos >> 15);
+	} else {
+		vq->last_avail_idx -= num;
+	}
+
 	vq->inuse -= num;
 	return true;
 }
@@ -613,103 +1077,120 @@ static inline void vring_used_write(const struct vu_dev *vdev,
 	struct vring_used *used = vq->vring.used;
 
 	used->ring[i] = *uelem;
-	vu_log_write(vdev, vq->vring.log_guest_addr +
+	vu_log_mark(vdev, vq->vring.log_guest_addr +
 		     offsetof(struct vring_used, ring[i]),
 		     sizeof(used->ring[i]));
 }
 
 /**
- * vu_log_queue_fill() - Log virtqueue memory update
- * @dev:	vhost-user device
+ * vu_log_queue_fill() - Log guest memory written for an element
+ * @vdev:	vhost-user device
  * @vq:		Virtqueue
- * @index:	Descriptor ring index
+ * @elem:	Element we wrote to
  * @len:	Size of the element
+ *
+ * Buffers of @elem were translated from guest addresses when we popped it, and
+ * each entry of @elem->in_sg lies in a single region: translate them back,
+ * instead of walking descriptors (and indirect tables) again.
  */
 static void vu_log_queue_fill(const struct vu_dev *vdev, struct vu_virtq *vq,
-			      unsigned int index, unsigned int len)
+			      const struct vu_virtq_element *elem,
+			      unsigned int len)
 {
-	struct vring_desc desc_buf[VIRTQUEUE_MAX_SIZE];
-	struct vring_desc *desc = vq->vring.desc;
-	unsigned num_bufs = 0;
-	uint64_t read_len;
-	unsigned int max;
+	unsigned int i;
 
 	if (!vdev->log_table || !len || !vu_has_feature(vdev, VHOST_F_LOG_ALL))
 		return;
 
-	max = vq->vring.num;
-
-	if (le16toh(desc[index].flags) & VRING_DESC_F_INDIRECT) {
-		unsigned int desc_len;
-		uint64_t desc_addr;
-
-		if (le32toh(desc[index].len) % sizeof(struct vring_desc))
-			die("Invalid size for indirect buffer table");
+	for (i = 0; i < elem->in_num && len; i++) {
+		const struct iovec *iov = &elem->in_sg[i];
+		size_t min = MIN(iov->iov_len, len);
+		uint64_t gpa;
 
-		/* loop over the indirect descriptor table */
-		desc_addr = le64toh(desc[index].addr);
-		desc_len = le32toh(desc[index].len);
-		max = desc_len / sizeof(struct vring_desc);
-		read_len = desc_len;
-		desc = vu_gpa_to_va(vdev, &read_len, desc_addr);
-		if (desc && read_len != desc_len) {
-			/* Failed to use zero copy */
-			desc = NULL;
-			if (!virtqueue_read_indirect_desc(vdev, desc_buf,
-							  desc_addr,
-							  desc_len))
-				desc = desc_buf;
-		}
+		if (vu_va_to_gpa(vdev, vq, iov->iov_base, &gpa))
+			die("vhost-user: Can't log write to unknown address");
 
-		if (!desc)
-			die("Invalid indirect buffer table");
-
-		index = 0;
+		vu_log_mark(vdev, gpa, min);
+		len -= min;
 	}
-
-	do {
-		if (++num_bufs > max)
-			die("Looped descriptor");
-
-		if (le16toh(desc[index].flags) & VRING_DESC_F_WRITE) {
-			unsigned min = MIN(le32toh(desc[index].len), len);
-			vu_log_write(vdev, le64toh(desc[index].addr), min);
-			len -= min;
-		}
-	} while (len > 0 &&
-		 (virtqueue_read_next_desc(desc, index, max, &index) ==
-		  VIRTQUEUE_READ_DESC_MORE));
 }
 
-
 /**
- * vu_queue_fill_by_index() - Update information of a descriptor ring entry
- *			      in the used ring
+ * vu_queue_fill_split() - Update information of a descriptor ring entry
+ *			   in the used ring
  * @dev:	Vhost-user device
  * @vq:		Virtqueue
- * @index:	Descriptor ring index
+ * @elem:	Element information to fill
  * @len:	Size of the element
  * @idx:	Used ring entry index
  */
-static void vu_queue_fill_by_index(const struct vu_dev *vdev,
-				   struct vu_virtq *vq,
-				   unsigned int index, unsigned int len,
-				   unsigned int idx)
+static void vu_queue_fill_split(const struct vu_dev *vdev,
+				struct vu_virtq *vq,
+				const struct vu_virtq_element *elem,
+				unsigned int len, unsigned int idx)
 {
 	struct vring_used_elem uelem;
 
-	if (!vq->vring.avail)
-		return;
-
-	vu_log_queue_fill(vdev, vq, index, len);
+	vu_log_queue_fill(vdev, vq, elem, len);
 
 	idx = (idx + vq->used_idx) % vq->vring.num;
 
-	uelem.id = htole32(index);
+	uelem.id = htole32(elem->index);
 	uelem.len = htole32(len);
 	vring_used_write(vdev, vq, &uelem, idx);
 }
 
+/**
+ * vu_queue_packed_fill() - Write used descriptor for an element, packed layout
+ * @vdev:	Vhost-user device
+ * @vq:		Virtqueue
+ * @elem:	Element information to fill
+ * @len:	Size of the element
+ *
+ * Elements are returned in the order they were popped: the used descriptor
+ * goes in the first ring position after the ones filled since the last flush.
+ */
+static void vu_queue_packed_fill(const struct vu_dev *vdev,
+				 struct vu_virtq *vq,
+				 const struct vu_virtq_element *elem,
+				 unsigned int len)
+{
+	unsigned int i = vq->used_idx + vq->used_pending;
+	bool wrap = vq->used_wrap_counter;
+	struct vring_packed_desc *desc;
+	uint16_t flags = 0;
+
+	if (i >= vq->vring.num) {
+		i -= vq->vring.num;
+		wrap = !wrap;
+	}
+
+	vu_log_queue_fill(vdev, vq, elem, len);
+
+	desc = &vq->vring.desc_packed[i];
+	desc->id = htole16(elem->index);
+	desc->len = htole32(len);
+
+	if (wrap)
+		flags |= 1 << VRING_PACKED_DESC_F_AVAIL |
+			 1 << VRING_PACKED_DESC_F_USED;
+	if (elem->in_num)
+		flags |= VRING_DESC_F_WRITE;
+
+	/* The driver won't look past the first used descriptor before we set
+	 * its flags on flush, so this publishes the whole batch at once
+	 */
+	if (vq->used_pending)
+		desc->flags = htole16(flags);
+	else
+		vq->used_head_flags = flags;
+
+	vu_log_mark(vdev, vq->vring.log_desc_addr + i * sizeof(*desc),
+		     sizeof(*desc));
+
+	vq->used_pending += elem->ndescs;
+}
+
 /**
  * vu_queue_fill() - Update information of a given element in the used ring
  * @dev:	Vhost-user device
@@ -722,7 +1203,13 @@ void vu_queue_fill(const struct vu_dev *vdev, struct vu_virtq *vq,
 		   const struct vu_virtq_element *elem, unsigned int len,
 		   unsigned int idx)
 {
-	vu_queue_fill_by_index(vdev, vq, elem->index, len, idx);
+	if (!vq->vring.avail)
+		return;
+
+	if (vq->packed)
+		vu_queue_packed_fill(vdev, vq, elem, len);
+	else
+		vu_queue_fill_split(vdev, vq, elem, len, idx);
 }
 
 /**
@@ -742,6 +1229,40 @@ static inline void vring_used_idx_set(const struct vu_dev *vdev,
 	vq->used_idx = val;
 }
 
+/**
+ * vu_queue_packed_flush() - Make filled descriptors visible, packed layout
+ * @vdev:	Vhost-user device
+ * @vq:		Virtqueue
+ * @count:	Number of elements to flush
+ */
+static void vu_queue_packed_flush(const struct vu_dev *vdev,
+				  struct vu_virtq *vq, unsigned int count)
+{
+	struct vring_packed_desc *desc = &vq->vring.desc_packed[vq->used_idx];
+
+	if (!count)
+		return;
+
+	/* Make sure buffers and other descriptors are written before the
+	 * flags of the first descriptor
+	 */
+	smp_wmb();
+
+	desc->flags = htole16(vq->used_head_flags);
+	vu_log_write(vdev, vq->vring.log_desc_addr +
+		     vq->used_idx * sizeof(*desc), sizeof(*desc));
+
+	vq->used_idx += vq->used_pending;
+	if (vq->used_idx >= vq->vring.num) {
+		vq->used_idx -= vq->vring.num;
+		vq->used_wrap_counter = !vq->used_wrap_counter;
+		vq->signalled_used_valid = false;
+	}
+
+	vq->used_pending = 0;
+	vq->inuse -= count;
+}
+
 /**
  * vu_queue_flush() - Flush the virtqueue
  * @dev:	Vhost-user device
@@ -756,6 +1277,13 @@ void vu_queue_flush(const struct vu_dev *vdev, struct vu_virtq *vq,
 	if (!vq->vring.avail)
 		return;
 
+	PROBE(vu_queue_flush, vq, count);
+
+	if (vq->packed) {
+		vu_queue_packed_flush(vdev, vq, count);
+		return;
+	}
+
 	/* Make sure buffer is written before we update index. */
 	smp_wmb();
 
@@ -10,29 +10,47 @@
 #define VIRTIO_H
 
 #include <stdbool.h>
+#include <stddef.h>
 #include <linux/vhost_types.h>
 
 /* Maximum size of a virtqueue */
 #define VIRTQUEUE_MAX_SIZE 1024
 
-#define VNET_HLEN	(sizeof(struct virtio_net_hdr_mrg_rxbuf))
+/* Size of virtio-net header, larger with VIRTIO_NET_F_HASH_REPORT */
+extern size_t vu_vnet_hlen;
+#define VNET_HLEN	vu_vnet_hlen
 
 /**
  * struct vu_ring - Virtqueue rings
  * @num:		Size of the queue
  * @desc:		Descriptor ring
+ * @desc_packed:	Descriptor ring, packed layout
  * @avail:		Available ring
+ * @driver_event:	Driver event suppression area, packed layout
  * @used:		Used ring
+ * @device_event:	Device event suppression area, packed layout
  * @log_guest_addr:	Guest address for logging
+ * @log_desc_addr:	Guest address of descriptor ring for logging, packed
+ * 			layout only, as used descriptors are written there
  * @flags:		Vring flags
  * 			VHOST_VRING_F_LOG is set if log address is valid
  */
 struct vu_ring {
 	unsigned int num;
-	struct vring_desc *desc;
-	struct vring_avail *avail;
-	struct vring_used *used;
+	union {
+		struct vring_desc *desc;
+		struct vring_packed_desc *desc_packed;
+	};
+	union {
+		struct vring_avail *avail;
+		struct vring_packed_desc_event *driver_event;
+	};
+	union {
+		struct vring_used *used;
+		struct vring_packed_desc_event *device_event;
+	};
 	uint64_t log_guest_addr;
+	uint64_t log_desc_addr;
 	uint32_t flags;
 };
 
@@ -56,6 +74,21 @@ struct vu_ring {
  * @enable:			True if the virtqueue is enabled
  * @started:			True if the virtqueue is started
  * @vra:			QEMU address of our rings
+ * @packed:			True if VIRTIO_F_RING_PACKED was negotiated
+ * @avail_wrap_counter:		Driver ring wrap counter for
+ * 				@last_avail_idx (packed layout)
+ * @used_wrap_counter:		Device ring wrap counter for @used_idx
+ * 				(packed layout)
+ * @used_pending:		Descriptors filled since last flush (packed)
+ * @used_head_flags:		Flags of first descriptor filled since last
+ * 				flush, written on flush (packed)
+ * @pop_seq:			Count of popped elements, wrapping (packed)
+ * @pop_pos:			Ring position and wrap counter before each
+ * 				pop, indexed by @pop_seq, to rewind (packed)
+ * @region_hint:		Memory region of the last guest address we
+ * 				translated for this queue
+ * @notify_pending:		Notification deferred to the end of the current
+ * 				epoll iteration
  */
 struct vu_virtq {
 	struct vu_ring vring;
@@ -72,6 +105,15 @@ struct vu_virtq {
 	unsigned int enable;
 	bool started;
 	struct vhost_vring_addr vra;
+	bool packed;
+	bool avail_wrap_counter;
+	bool used_wrap_counter;
+	uint16_t used_pending;
+	uint16_t used_head_flags;
+	uint16_t pop_seq;
+	uint16_t pop_pos[VIRTQUEUE_MAX_SIZE];
+	unsigned int region_hint;
+	bool notify_pending;
 };
 
 /**
@@ -90,7 +132,9 @@ struct vu_dev_region {
 	uint64_t mmap_addr;
 };
 
-#define VHOST_USER_MAX_VQS 2U
+/* Up to VHOST_USER_MAX_QUEUE_PAIRS RX/TX pairs, negotiated with VIRTIO_NET_F_MQ */
+#define VHOST_USER_MAX_QUEUE_PAIRS 8U
+#define VHOST_USER_MAX_VQS (VHOST_USER_MAX_QUEUE_PAIRS * 2)
 
 /*
  * Set a reasonable maximum number of ram slots, which will be supported by
@@ -133,7 +177,8 @@ struct vu_dev {
 
 /**
  * struct vu_virtq_element - virtqueue element
- * @index:	Descriptor ring index
+ * @index:	Descriptor ring index, buffer ID for packed layout
+ * @ndescs:	Number of ring descriptors used by the element (packed)
  * @out_num:	Number of outgoing iovec buffers
  * @in_num:	Number of incoming iovec buffers
  * @in_sg:	Incoming iovec buffers
@@ -141,6 +186,7 @@ struct vu_dev {
  */
 struct vu_virtq_element {
 	unsigned int index;
+	unsigned int ndescs;
 	unsigned int out_num;
 	unsigned int in_num;
 	struct iovec *in_sg;
@@ -186,7 +232,12 @@ static inline bool vu_has_protocol_feature(const struct vu_dev *vdev,
 	return has_feature(vdev->protocol_features, fbit);
 }
 
+bool vu_queue_empty(struct vu_virtq *vq);
+void vu_queue_set_notification(const struct vu_dev *dev, struct vu_virtq *vq,
+			       bool enable);
 void vu_queue_notify(const struct vu_dev *dev, struct vu_virtq *vq);
+void vu_queue_notify_defer(struct vu_virtq *vq);
+void vu_notify_deferred(struct vu_dev *dev);
 int vu_queue_pop(const struct vu_dev *dev, struct vu_virtq *vq,
 		 struct vu_virtq_element *elem,
 		 struct iovec *in_sg, size_t max_in_sg,
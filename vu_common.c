@@ -116,34 +116,65 @@ int vu_collect(const struct vu_dev *vdev, struct vu_virtq *vq,
 
 /**
  * vu_set_vnethdr() - set virtio-net headers
+ * @vdev:		vhost-user device
  * @vnethdr:		Address of the header to set
+ * @hdr:		virtio-net header to use, without number of buffers
+ * @hash:		Hash report for the frame, NULL if none
  * @num_buffers:	Number of guest buffers of the frame
  */
-static void vu_set_vnethdr(struct virtio_net_hdr_mrg_rxbuf *vnethdr,
-			   int num_buffers)
+static void vu_set_vnethdr(const struct vu_dev *vdev,
+			   struct virtio_net_hdr_mrg_rxbuf *vnethdr,
+			   const struct virtio_net_hdr *hdr,
+			   const struct vu_hash *hash, int num_buffers)
 {
-	vnethdr->hdr = VU_HEADER;
+	vnethdr->hdr = *hdr;
+	/* Without VIRTIO_NET_F_GUEST_CSUM, we always fill in checksums, and
+	 * the device must not set any flag
+	 */
+	if (!vu_has_feature(vdev, VIRTIO_NET_F_GUEST_CSUM))
+		vnethdr->hdr.flags &= ~VIRTIO_NET_HDR_F_DATA_VALID;
 	/* Note: if VIRTIO_NET_F_MRG_RXBUF is not negotiated,
 	 * num_buffers must be 1
 	 */
 	vnethdr->num_buffers = htole16(num_buffers);
+
+	if (vu_has_feature(vdev, VIRTIO_NET_F_HASH_REPORT)) {
+		struct virtio_net_hdr_v1_hash *h = (void *)vnethdr;
+
+		/* Frames without a flow, such as ARP or DHCP replies, are
+		 * hashed by the guest itself
+		 */
+		h->hash_value = htole32(hash ? hash->value : 0);
+		h->hash_report = htole16(hash ? hash->report :
+					 VIRTIO_NET_HASH_REPORT_NONE);
+		h->padding = 0;
+	}
 }
 
 /**
- * vu_flush() - flush all the collected buffers to the vhost-user interface
+ * vu_fill_hdr() - Fill used ring with collected buffers, don't flush yet
  * @vdev:	vhost-user device
  * @vq:		vhost-user virtqueue
  * @elem:	virtqueue elements array to send back to the virtqueue
  * @elem_cnt:	Length of the array
  * @frame_len:	Total frame length including vnet header
+ * @hdr:	virtio-net header for the frame, e.g. with GSO information
+ * @hash:	Hash report for the frame, NULL if none
+ * @idx:	Used ring entry index for the first element, relative to the
+ *		entries filled since the last flush
+ *
+ * Several frames can be filled this way, in the order their buffers were
+ * collected, and then made visible to the guest with one vu_queue_flush().
  */
-void vu_flush(const struct vu_dev *vdev, struct vu_virtq *vq,
-	      struct vu_virtq_element *elem, int elem_cnt, size_t frame_len)
+void vu_fill_hdr(const struct vu_dev *vdev, struct vu_virtq *vq,
+		 struct vu_virtq_element *elem, int elem_cnt,
+		 size_t frame_len, const struct virtio_net_hdr *hdr,
+		 const struct vu_hash *hash, unsigned int idx)
 {
 	size_t len;
 	int i;
 
-	vu_set_vnethdr(elem[0].in_sg[0].iov_base, elem_cnt);
+	vu_set_vnethdr(vdev, elem[0].in_sg[0].iov_base, hdr, hash, elem_cnt);
 
 	len = MAX(ETH_ZLEN + VNET_HLEN, frame_len);
 	for (i = 0; i < elem_cnt; i++) {
@@ -152,14 +183,45 @@ void vu_flush(const struct vu_dev *vdev, struct vu_virtq *vq,
 		elem_size = iov_size(elem[i].in_sg, elem[i].in_num);
 		fill_size = MIN(elem_size, len);
 
-		vu_queue_fill(vdev, vq, &elem[i], fill_size, i);
+		vu_queue_fill(vdev, vq, &elem[i], fill_size, idx + i);
 
 		len -= fill_size;
 	}
+}
 
+/**
+ * vu_flush_hdr() - flush collected buffers with a given virtio-net header
+ * @vdev:	vhost-user device
+ * @vq:		vhost-user virtqueue
+ * @elem:	virtqueue elements array to send back to the virtqueue
+ * @elem_cnt:	Length of the array
+ * @frame_len:	Total frame length including vnet header
+ * @hdr:	virtio-net header for the frame, e.g. with GSO information
+ * @hash:	Hash report for the frame, NULL if none
+ */
+void vu_flush_hdr(const struct vu_dev *vdev, struct vu_virtq *vq,
+		  struct vu_virtq_element *elem, int elem_cnt,
+		  size_t frame_len, const struct virtio_net_hdr *hdr,
+		  const struct vu_hash *hash)
+{
+	vu_fill_hdr(vdev, vq, elem, elem_cnt, frame_len, hdr, hash, 0);
 	vu_queue_flush(vdev, vq, elem_cnt);
 }
 
+/**
+ * vu_flush() - flush all the collected buffers to the vhost-user interface
+ * @vdev:	vhost-user device
+ * @vq:		vhost-user virtqueue
+ * @elem:	virtqueue elements array to send back to the virtqueue
+ * @elem_cnt:	Length of the array
+ * @frame_len:	Total frame length including vnet header
+ */
+void vu_flush(const struct vu_dev *vdev, struct vu_virtq *vq,
+	      struct vu_virtq_element *elem, int elem_cnt, size_t frame_len)
+{
+	vu_flush_hdr(vdev, vq, elem, elem_cnt, frame_len, &VU_HEADER, NULL);
+}
+
 /**
  * vu_handle_tx() - Receive data from the TX virtqueue
  * @vdev:	vhost-user device
@@ -198,7 +260,7 @@ static void vu_handle_tx(struct vu_dev *vdev, int index,
 		}
 
 		data = IOV_TAIL(elem[count].out_sg, elem[count].out_num, 0);
-		if (IOV_DROP_HEADER(&data, struct virtio_net_hdr_mrg_rxbuf))
+		if (iov_drop_header(&data, VNET_HLEN))
 			tap_add_packet(vdev->context, &data, now);
 
 		count++;
@@ -211,7 +273,7 @@ static void vu_handle_tx(struct vu_dev *vdev, int index,
 		for (i = 0; i < count; i++)
 			vu_queue_fill(vdev, vq, &elem[i], 0, i);
 		vu_queue_flush(vdev, vq, count);
-		vu_queue_notify(vdev, vq);
+		vu_queue_notify_defer(vq);
 	}
 }
 
@@ -237,6 +299,56 @@ void vu_kick_cb(struct vu_dev *vdev, union epoll_ref ref,
 		vu_handle_tx(vdev, ref.queue, now);
 }
 
+/**
+ * vu_tx_notification() - Enable or disable kicks on all usable TX queues
+ * @vdev:	vhost-user device
+ * @enable:	True to ask the guest for kicks, false to suppress them
+ *
+ * Return: true if buffers are available on any TX queue, which the guest
+ *         might have added without kicks while they were disabled
+ */
+bool vu_tx_notification(struct vu_dev *vdev, bool enable)
+{
+	bool pending = false;
+	unsigned int i;
+
+	for (i = 0; i < VHOST_USER_MAX_VQS; i++) {
+		struct vu_virtq *vq = &vdev->vq[i];
+
+		if (!VHOST_USER_IS_QUEUE_TX(i) ||
+		    !vu_queue_enabled(vq) || !vu_queue_started(vq))
+			continue;
+
+		if (vq->notification != enable)
+			vu_queue_set_notification(vdev, vq, enable);
+
+		pending |= !vu_queue_empty(vq);
+	}
+
+	return pending;
+}
+
+/**
+ * vu_tx_poll() - Handle TX queues with available buffers, without kicks
+ * @vdev:	vhost-user device
+ * @now:	Current timestamp
+ */
+void vu_tx_poll(struct vu_dev *vdev, const struct timespec *now)
+{
+	unsigned int i;
+
+	for (i = 0; i < VHOST_USER_MAX_VQS; i++) {
+		struct vu_virtq *vq = &vdev->vq[i];
+
+		if (!VHOST_USER_IS_QUEUE_TX(i) ||
+		    !vu_queue_enabled(vq) || !vu_queue_started(vq))
+			continue;
+
+		if (!vu_queue_empty(vq))
+			vu_handle_tx(vdev, i, now);
+	}
+}
+
 /**
  * vu_send_single() - Send a buffer to the front-end using the RX virtqueue
  * @c:		execution context
@@ -278,7 +390,7 @@ int vu_send_single(const struct ctx *c, const void *buf, size_t size)
 
 	vu_pad(in_sg, in_total, VNET_HLEN + size);
 	vu_flush(vdev, vq, elem, elem_cnt, VNET_HLEN + size);
-	vu_queue_notify(vdev, vq);
+	vu_queue_notify_defer(vq);
 
 	trace("vhost-user sent %zu", size);
 
@@ -15,14 +15,59 @@
 #include "ip.h"
 #include "virtio.h"
 
+/**
+ * struct vu_hash - Hash reported to the guest with VIRTIO_NET_F_HASH_REPORT
+ * @value:	Hash value, the same for all the frames of a flow
+ * @report:	VIRTIO_NET_HASH_REPORT_* type, from protocol and address family
+ */
+struct vu_hash {
+	uint32_t value;
+	uint16_t report;
+};
+
+/**
+ * vu_hash_flow() - Hash report for frames of a given flow
+ * @flowi:	Index of the flow in the flow table
+ * @proto:	IPPROTO_TCP or IPPROTO_UDP
+ * @v6:		Set for IPv6 frames
+ *
+ * Return: hash report with multiplicative hash of @flowi, spreading flows over
+ *	   the whole range of values, as the guest uses upper bits to steer them
+ */
+static inline struct vu_hash vu_hash_flow(unsigned int flowi, uint8_t proto,
+					  bool v6)
+{
+	uint16_t report;
+
+	if (proto == IPPROTO_TCP)
+		report = v6 ? VIRTIO_NET_HASH_REPORT_TCPv6 :
+			      VIRTIO_NET_HASH_REPORT_TCPv4;
+	else
+		report = v6 ? VIRTIO_NET_HASH_REPORT_UDPv6 :
+			      VIRTIO_NET_HASH_REPORT_UDPv4;
+
+	return (struct vu_hash){ .value = flowi * 0x9e3779b1U,
+				 .report = report };
+}
+
 int vu_collect(const struct vu_dev *vdev, struct vu_virtq *vq,
 	       struct vu_virtq_element *elem, int max_elem,
 	       struct iovec *in_sg, size_t max_in_sg, size_t *in_total,
 	       size_t size, size_t *collected);
+void vu_fill_hdr(const struct vu_dev *vdev, struct vu_virtq *vq,
+		 struct vu_virtq_element *elem, int elem_cnt,
+		 size_t frame_len, const struct virtio_net_hdr *hdr,
+		 const struct vu_hash *hash, unsigned int idx);
+void vu_flush_hdr(const struct vu_dev *vdev, struct vu_virtq *vq,
+		  struct vu_virtq_element *elem, int elem_cnt,
+		  size_t frame_len, const struct virtio_net_hdr *hdr,
+		  const struct vu_hash *hash);
 void vu_flush(const struct vu_dev *vdev, struct vu_virtq *vq,
 	      struct vu_virtq_element *elem, int elem_cnt, size_t frame_len);
 void vu_kick_cb(struct vu_dev *vdev, union epoll_ref ref,
 		const struct timespec *now);
+bool vu_tx_notification(struct vu_dev *vdev, bool enable);
+void vu_tx_poll(struct vu_dev *vdev, const struct timespec *now);
 int vu_send_single(const struct ctx *c, const void *buf, size_t size);
 void vu_pad(const struct iovec *iov, size_t cnt, size_t frame_len);
 
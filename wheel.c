@@ -0,0 +1,293 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+
+/* PASST - Plug A Simple Socket Transport
+ *  for qemu/UNIX domain socket mode
+ *
+ * PASTA - Pack A Subtle Tap Abstraction
+ *  for network namespace/tap device mode
+ *
+ * wheel.c - Hierarchical timer wheel for per-flow timeouts
+ *
+ * Copyright Red Hat
+ *
+ * Timers are identified by flow table index, so that at most one is pending
+ * per flow, and their storage doesn't need to live in the flow table itself.
+ *
+ * The wheel has four levels: the first one has 256 slots of one tick each, and
+ * every further level has 64 slots, each one spanning a full rotation of the
+ * level below. With 100 us ticks, this covers timeouts up to about 6700 s, and
+ * longer ones are parked in the last level until they come within range.
+ *
+ * Adding and removing timers is O(1). Whenever we cross the boundary of a slot
+ * in an upper level, entries from that slot are redistributed ("cascaded") to
+ * lower levels, as in the classic timer wheel design described by Varghese and
+ * Lauck, and as used for many years by the Linux kernel.
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "bitmap.h"
+#include "util.h"
+#include "ip.h"
+#include "passt.h"
+#include "inany.h"
+#include "flow.h"
+#include "wheel.h"
+
+#define WHEEL_LEVELS		4
+#define WHEEL_L0_BITS		8
+#define WHEEL_LN_BITS		6
+#define WHEEL_SLOTS		(BIT(WHEEL_L0_BITS) +			\
+				 (WHEEL_LEVELS - 1) * BIT(WHEEL_LN_BITS))
+#define WHEEL_SPAN		BIT(WHEEL_L0_BITS +			\
+				    (WHEEL_LEVELS - 1) * WHEEL_LN_BITS)
+
+/* Shift of tick count for, number of slots in, and first slot of, a level */
+#define WHEEL_SHIFT(l)	((l) ? WHEEL_L0_BITS + ((l) - 1) * WHEEL_LN_BITS : 0)
+#define WHEEL_SIZE(l)	((l) ? BIT(WHEEL_LN_BITS) : BIT(WHEEL_L0_BITS))
+#define WHEEL_BASE(l)	((l) ? BIT(WHEEL_L0_BITS) + ((l) - 1) * BIT(WHEEL_LN_BITS) \
+			     : 0)
+
+/**
+ * struct wheel_entry - Timer for a single flow
+ * @next:	Next entry in the same slot, flow index + 1, 0 if none
+ * @prev:	Previous entry in the same slot, flow index + 1, 0 if none
+ * @slot:	Slot holding this entry, plus one, 0 if timer is not pending
+ * @expires:	Expiry time, in ticks
+ */
+struct wheel_entry {
+	uint32_t next;
+	uint32_t prev;
+	uint16_t slot;
+	uint64_t expires;
+};
+
+/* Indexed by flow, allocated for the whole flow table by wheel_init() */
+static struct wheel_entry *wheel_entries;
+
+/* First and last entries for each slot, flow index + 1, 0 if empty */
+static uint32_t wheel_head[WHEEL_SLOTS];
+static uint32_t wheel_tail[WHEEL_SLOTS];
+
+/* Pending timers for each level */
+static unsigned wheel_cnt[WHEEL_LEVELS];
+
+/* Next tick to be processed */
+static uint64_t wheel_now;
+
+/**
+ * wheel_init() - Allocate timer entries for the whole flow table
+ * @n:		Number of flow table entries
+ *
+ * Return: 0 on success, -1 on failure
+ */
+int wheel_init(unsigned n)
+{
+	wheel_entries = mmap_lazy((size_t)n * sizeof(*wheel_entries));
+	if (!wheel_entries)
+		return -1;
+
+	return 0;
+}
+
+/**
+ * wheel_level() - Get wheel level from slot number
+ * @slot:	Slot number
+ *
+ * Return: level of the wheel @slot belongs to
+ */
+static unsigned wheel_level(unsigned slot)
+{
+	if (slot < BIT(WHEEL_L0_BITS))
+		return 0;
+
+	return 1 + (slot - BIT(WHEEL_L0_BITS)) / BIT(WHEEL_LN_BITS);
+}
+
+/**
+ * wheel_insert() - Link entry into the slot matching its expiry
+ * @idx:	Flow index
+ */
+static void wheel_insert(unsigned idx)
+{
+	struct wheel_entry *e = &wheel_entries[idx];
+	uint64_t t = MAX(e->expires, wheel_now);
+	uint64_t delta = MIN(t - wheel_now, WHEEL_SPAN - 1);
+	unsigned l, slot;
+
+	t = wheel_now + delta;
+	for (l = 0; l < WHEEL_LEVELS - 1; l++) {
+		if (delta < BIT(WHEEL_SHIFT(l + 1)))
+			break;
+	}
+
+	slot = WHEEL_BASE(l) + ((t >> WHEEL_SHIFT(l)) & (WHEEL_SIZE(l) - 1));
+
+	e->next = 0;
+	e->prev = wheel_tail[slot];
+	if (e->prev)
+		wheel_entries[e->prev - 1].next = idx + 1;
+	else
+		wheel_head[slot] = idx + 1;
+	wheel_tail[slot] = idx + 1;
+
+	e->slot = slot + 1;
+	wheel_cnt[l]++;
+}
+
+/**
+ * wheel_pending() - Check if a timer is pending for a given flow
+ * @idx:	Flow index
+ *
+ * Return: true if a timer is pending
+ */
+bool wheel_pending(unsigned idx)
+{
+	return !!wheel_entries[idx].slot;
+}
+
+/**
+ * wheel_del() - Cancel timer for a given flow, if any
+ * @idx:	Flow index
+ */
+void wheel_del(unsigned idx)
+{
+	struct wheel_entry *e = &wheel_entries[idx];
+	unsigned slot;
+
+	if (!e->slot)
+		return;
+
+	slot = e->slot - 1;
+
+	if (e->prev)
+		wheel_entries[e->prev - 1].next = e->next;
+	else
+		wheel_head[slot] = e->next;
+
+	if (e->next)
+		wheel_entries[e->next - 1].prev = e->prev;
+	else
+		wheel_tail[slot] = e->prev;
+
+	e->slot = 0;
+	wheel_cnt[wheel_level(slot)]--;
+}
+
+/**
+ * wheel_add() - Set timer for a given flow, replacing any pending one
+ * @idx:	Flow index
+ * @now:	Current time, in ticks
+ * @expires:	Expiry time, in ticks
+ */
+void wheel_add(unsigned idx, uint64_t now, uint64_t expires)
+{
+	unsigned l, pending = 0;
+
+	wheel_del(idx);
+
+	for (l = 0; l < WHEEL_LEVELS; l++)
+		pending += wheel_cnt[l];
+
+	/* Nothing to process in between, skip ahead */
+	if (!pending)
+		wheel_now = now;
+
+	wheel_entries[idx].expires = expires;
+	wheel_insert(idx);
+}
+
+/**
+ * wheel_next() - Get the next tick where expiry or cascading needs to happen
+ *
+ * Return: tick number, WHEEL_NONE if no timers are pending
+ */
+uint64_t wheel_next(void)
+{
+	uint64_t next = WHEEL_NONE;
+	unsigned l;
+
+	for (l = 0; l < WHEEL_LEVELS; l++) {
+		unsigned shift = WHEEL_SHIFT(l), mask = WHEEL_SIZE(l) - 1;
+		uint64_t b, first;
+
+		if (!wheel_cnt[l])
+			continue;
+
+		first = (wheel_now + BIT(shift) - 1) >> shift;
+		for (b = first; b < first + WHEEL_SIZE(l); b++) {
+			if (wheel_head[WHEEL_BASE(l) + (b & mask)]) {
+				next = MIN(next, b << shift);
+				break;
+			}
+		}
+	}
+
+	return next;
+}
+
+/**
+ * wheel_cascade() - Redistribute entries from an upper level slot
+ * @slot:	Slot number
+ */
+static void wheel_cascade(unsigned slot)
+{
+	uint32_t i = wheel_head[slot];
+
+	wheel_head[slot] = wheel_tail[slot] = 0;
+
+	while (i) {
+		struct wheel_entry *e = &wheel_entries[i - 1];
+		uint32_t next = e->next;
+
+		e->slot = 0;
+		wheel_cnt[wheel_level(slot)]--;
+		wheel_insert(i - 1);
+
+		i = next;
+	}
+}
+
+/**
+ * wheel_pop() - Get next expired timer, cancelling it
+ * @now:	Current time, in ticks
+ *
+ * Return: flow index for expired timer, -1 if no timers are due
+ */
+int wheel_pop(uint64_t now)
+{
+	for (;;) {
+		uint64_t t = wheel_now - 1;
+		unsigned l;
+		uint32_t i;
+
+		/* Timers set after we started on this tick can't be due yet: as
+		 * they are appended, stop at the first one
+		 */
+		if (wheel_now && (i = wheel_head[t & (WHEEL_SIZE(0) - 1)]) &&
+		    wheel_entries[i - 1].expires <= t) {
+			wheel_del(i - 1);
+			return i - 1;
+		}
+
+		t = wheel_next();
+		if (t > now) {
+			wheel_now = MAX(wheel_now, now + 1);
+			return -1;
+		}
+
+		wheel_now = t;
+		for (l = 1; l < WHEEL_LEVELS; l++) {
+			unsigned shift = WHEEL_SHIFT(l);
+
+			if (t & (BIT(shift) - 1))
+				break;
+
+			wheel_cascade(WHEEL_BASE(l) +
+				      ((t >> shift) & (WHEEL_SIZE(l) - 1)));
+		}
+		wheel_now = t + 1;
+	}
+}
@@ -0,0 +1,39 @@
+/* SPDX-License-Identifier: GPL-2.0-or-later
+ * Copyright Red Hat
+ *
+ * Hierarchical timer wheel for per-flow timeouts
+ */
+
+#ifndef WHEEL_H
+#define WHEEL_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <time.h>
+
+/* Timer resolution: matches RTT_STORE_MIN, the shortest TCP timeout we set */
+#define WHEEL_TICK_NS		100000ULL
+
+/* No timer pending, from wheel_next() */
+#define WHEEL_NONE		UINT64_MAX
+
+/**
+ * wheel_tick() - Convert CLOCK_MONOTONIC timestamp to timer wheel ticks
+ * @ts:		Timestamp
+ *
+ * Return: number of ticks since clock origin
+ */
+static inline uint64_t wheel_tick(const struct timespec *ts)
+{
+	return ((uint64_t)ts->tv_sec * 1000000000ULL + ts->tv_nsec) /
+	       WHEEL_TICK_NS;
+}
+
+int wheel_init(unsigned n);
+void wheel_add(unsigned idx, uint64_t now, uint64_t expires);
+void wheel_del(unsigned idx);
+bool wheel_pending(unsigned idx);
+uint64_t wheel_next(void);
+int wheel_pop(uint64_t now);
+
+#endif /* WHEEL_H */